@@ -0,0 +1,472 @@
+/*
+ * QEMU Host Memory Backend populated on first touch from an image
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guest RAM starts out empty and registered with userfaultfd. A thread
+ * serves every missing-page fault by reading the surrounding chunk from
+ * @image, which is typically the RAM file of a booted golden snapshot on
+ * shared storage (memory-backend-file plus x-ignore-shared on the saving
+ * side). Nothing is copied up front, so a clone can start as soon as the
+ * device state is loaded with -incoming.
+ *
+ * While idle the thread works through @prefetch, a list of offsets into
+ * @image, one per line, so the pages a boot touches first are usually in
+ * place before they are needed. With @record, every chunk that faults is
+ * appended to a file in the same format, in the order it faulted, which
+ * makes a prefetch list for the next clone.
+ *
+ * Once every chunk is present the range is unregistered and the thread
+ * exits, leaving ordinary private anonymous memory.
+ *
+ * RAM discards are disabled until then: a discarded chunk that is already
+ * present would fault again, and that fault would never be served.
+ */
+
+#include "qemu/osdep.h"
+#include "sysemu/hostmem.h"
+#include "exec/memory.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qemu/userfaultfd.h"
+#include "qom/object_interfaces.h"
+#include "trace.h"
+
+#define TYPE_MEMORY_BACKEND_LAZY "memory-backend-lazy"
+
+OBJECT_DECLARE_SIMPLE_TYPE(HostMemoryBackendLazy, MEMORY_BACKEND_LAZY)
+
+#define LAZY_DEFAULT_CHUNK_SIZE (64 * KiB)
+#define LAZY_MAX_EVENTS 16
+
+struct HostMemoryBackendLazy {
+    HostMemoryBackend parent_obj;
+
+    char *image;
+    char *prefetch;
+    char *record;
+    uint64_t chunk_size;
+
+    int image_fd;
+    int uffd;
+    FILE *record_file;
+    uint8_t *host;
+    void *buf;
+    unsigned long *present;
+    uint64_t nr_chunks;
+    uint64_t nr_present;
+    uint64_t *prefetch_list;
+    size_t prefetch_len;
+    size_t prefetch_pos;
+    EventNotifier stop;
+    QemuThread thread;
+    bool thread_running;
+    bool discard_disabled;
+};
+
+static bool lazy_load_prefetch(HostMemoryBackendLazy *lb, Error **errp)
+{
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    GError *gerr = NULL;
+    size_t n = 0;
+
+    if (!g_file_get_contents(lb->prefetch, &contents, NULL, &gerr)) {
+        error_setg(errp, "cannot read prefetch list: %s", gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    lb->prefetch_list = g_new(uint64_t, g_strv_length(lines));
+    for (int i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        uint64_t off;
+
+        if (!*line || *line == '#') {
+            continue;
+        }
+        if (qemu_strtou64(line, NULL, 0, &off) < 0) {
+            error_setg(errp, "%s:%d: invalid offset '%s'", lb->prefetch, i + 1,
+                       line);
+            return false;
+        }
+        if (off >= lb->parent_obj.size) {
+            /* A list recorded against a bigger image, not fatal. */
+            continue;
+        }
+        lb->prefetch_list[n++] = off / lb->chunk_size;
+    }
+    lb->prefetch_len = n;
+
+    return true;
+}
+
+/* Called from the fault thread only, which makes it the sole populator. */
+static void lazy_fetch(HostMemoryBackendLazy *lb, uint64_t chunk)
+{
+    uint64_t off = chunk * lb->chunk_size;
+    uint64_t len = MIN(lb->chunk_size, lb->parent_obj.size - off);
+    uint64_t done = 0;
+    int ret;
+
+    if (test_bit(chunk, lb->present)) {
+        return;
+    }
+
+    while (done < len) {
+        ssize_t n = pread(lb->image_fd, lb->buf + done, len - done, off + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* The guest would read garbage or hang, neither is better. */
+            error_report("%s: cannot read 0x%" PRIx64 "+0x%" PRIx64 ": %s",
+                         lb->image, off, len,
+                         n < 0 ? strerror(errno) : "unexpected end of file");
+            abort();
+        }
+        done += n;
+    }
+
+    if (buffer_is_zero(lb->buf, len)) {
+        ret = uffd_zero_page(lb->uffd, lb->host + off, len, false);
+    } else {
+        ret = uffd_copy_page(lb->uffd, lb->host + off, lb->buf, len, false);
+    }
+    if (ret < 0) {
+        abort();
+    }
+
+    set_bit(chunk, lb->present);
+    lb->nr_present++;
+}
+
+static void lazy_serve_faults(HostMemoryBackendLazy *lb)
+{
+    struct uffd_msg msgs[LAZY_MAX_EVENTS];
+    int n = uffd_read_events(lb->uffd, msgs, LAZY_MAX_EVENTS);
+
+    for (int i = 0; i < n; i++) {
+        uint64_t off;
+
+        if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        off = (uint8_t *)(uintptr_t)msgs[i].arg.pagefault.address - lb->host;
+        trace_hostmem_lazy_fault(off);
+        /*
+         * Two vCPUs in the same chunk give two messages, the first copy
+         * woke them both.
+         */
+        if (lb->record_file && !test_bit(off / lb->chunk_size, lb->present)) {
+            fprintf(lb->record_file, "0x%" PRIx64 "\n",
+                    QEMU_ALIGN_DOWN(off, lb->chunk_size));
+        }
+        lazy_fetch(lb, off / lb->chunk_size);
+    }
+}
+
+static void *lazy_thread(void *opaque)
+{
+    HostMemoryBackendLazy *lb = opaque;
+
+    while (lb->nr_present < lb->nr_chunks) {
+        struct pollfd pfd[2] = {
+            { .fd = lb->uffd, .events = POLLIN },
+            { .fd = event_notifier_get_fd(&lb->stop), .events = POLLIN },
+        };
+        bool prefetching = lb->prefetch_pos < lb->prefetch_len;
+        int ret = poll(pfd, ARRAY_SIZE(pfd), prefetching ? 0 : -1);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_report("%s: poll failed: %s", __func__, strerror(errno));
+            abort();
+        }
+        if (pfd[1].revents & POLLIN) {
+            return NULL;
+        }
+        /* Faults always go first, prefetching only fills idle time. */
+        if (pfd[0].revents & POLLIN) {
+            lazy_serve_faults(lb);
+        } else if (prefetching) {
+            lazy_fetch(lb, lb->prefetch_list[lb->prefetch_pos++]);
+            if (lb->prefetch_pos == lb->prefetch_len) {
+                trace_hostmem_lazy_prefetch_done(lb->nr_present,
+                                                 lb->nr_chunks);
+            }
+        }
+    }
+
+    trace_hostmem_lazy_complete(lb->nr_chunks);
+    uffd_unregister_memory(lb->uffd, lb->host, lb->parent_obj.size);
+    ram_block_discard_disable(false);
+    lb->discard_disabled = false;
+    return NULL;
+}
+
+static bool lazy_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(backend);
+    g_autofree char *name = NULL;
+    uint32_t ram_flags;
+    off_t image_size;
+
+    if (!backend->size) {
+        error_setg(errp, "can't create backend with size 0");
+        return false;
+    }
+    if (!lb->image) {
+        error_setg(errp, "property 'image' is required");
+        return false;
+    }
+    if (backend->share) {
+        error_setg(errp, "memory-backend-lazy does not support share=on");
+        return false;
+    }
+    if (!is_power_of_2(lb->chunk_size) ||
+        lb->chunk_size < qemu_real_host_page_size()) {
+        error_setg(errp, "chunk-size must be a power of 2 no smaller than "
+                   "the host page size");
+        return false;
+    }
+    if (backend->size % qemu_real_host_page_size()) {
+        error_setg(errp, "size must be a multiple of the host page size");
+        return false;
+    }
+
+    lb->image_fd = qemu_open(lb->image, O_RDONLY, errp);
+    if (lb->image_fd < 0) {
+        return false;
+    }
+    image_size = lseek(lb->image_fd, 0, SEEK_END);
+    if (image_size < 0 || image_size < backend->size) {
+        error_setg(errp, "image '%s' is smaller than the backend", lb->image);
+        return false;
+    }
+
+    lb->nr_chunks = DIV_ROUND_UP(backend->size, lb->chunk_size);
+    if (lb->prefetch && !lazy_load_prefetch(lb, errp)) {
+        return false;
+    }
+    if (lb->record) {
+        lb->record_file = fopen(lb->record, "w");
+        if (!lb->record_file) {
+            error_setg_errno(errp, errno, "cannot create '%s'", lb->record);
+            return false;
+        }
+        /* One line per fault, so the list survives QEMU being killed. */
+        setvbuf(lb->record_file, NULL, _IOLBF, 0);
+    }
+
+    name = host_memory_backend_get_name(backend);
+    ram_flags = backend->reserve ? 0 : RAM_NORESERVE;
+    if (!memory_region_init_ram_flags_nomigrate(&backend->mr, OBJECT(backend),
+                                                name, backend->size,
+                                                ram_flags, errp)) {
+        return false;
+    }
+    lb->host = memory_region_get_ram_ptr(&backend->mr);
+
+    if (ram_block_discard_disable(true)) {
+        error_setg(errp, "memory-backend-lazy cannot be used with devices "
+                   "that require discarding RAM");
+        return false;
+    }
+    lb->discard_disabled = true;
+
+    lb->uffd = uffd_create_fd(0, true);
+    if (lb->uffd < 0) {
+        error_setg(errp, "cannot create a userfaultfd, unprivileged use may "
+                   "need vm.unprivileged_userfaultfd=1");
+        return false;
+    }
+    if (uffd_register_memory(lb->uffd, lb->host, backend->size,
+                             UFFDIO_REGISTER_MODE_MISSING, NULL)) {
+        error_setg(errp, "cannot register guest RAM with userfaultfd");
+        return false;
+    }
+
+    lb->buf = qemu_memalign(qemu_real_host_page_size(), lb->chunk_size);
+    lb->present = bitmap_new(lb->nr_chunks);
+    if (event_notifier_init(&lb->stop, false) < 0) {
+        error_setg(errp, "cannot create the stop notifier");
+        return false;
+    }
+    qemu_thread_create(&lb->thread, "hostmem-lazy", lazy_thread, lb,
+                       QEMU_THREAD_JOINABLE);
+    lb->thread_running = true;
+
+    return true;
+}
+
+static char *lazy_get_image(Object *o, Error **errp)
+{
+    return g_strdup(MEMORY_BACKEND_LAZY(o)->image);
+}
+
+static void lazy_set_image(Object *o, const char *str, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(o);
+
+    if (host_memory_backend_mr_inited(MEMORY_BACKEND(o))) {
+        error_setg(errp, "cannot change property 'image' of %s",
+                   object_get_typename(o));
+        return;
+    }
+    g_free(lb->image);
+    lb->image = g_strdup(str);
+}
+
+static char *lazy_get_prefetch(Object *o, Error **errp)
+{
+    return g_strdup(MEMORY_BACKEND_LAZY(o)->prefetch);
+}
+
+static void lazy_set_prefetch(Object *o, const char *str, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(o);
+
+    if (host_memory_backend_mr_inited(MEMORY_BACKEND(o))) {
+        error_setg(errp, "cannot change property 'prefetch' of %s",
+                   object_get_typename(o));
+        return;
+    }
+    g_free(lb->prefetch);
+    lb->prefetch = g_strdup(str);
+}
+
+static char *lazy_get_record(Object *o, Error **errp)
+{
+    return g_strdup(MEMORY_BACKEND_LAZY(o)->record);
+}
+
+static void lazy_set_record(Object *o, const char *str, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(o);
+
+    if (host_memory_backend_mr_inited(MEMORY_BACKEND(o))) {
+        error_setg(errp, "cannot change property 'record' of %s",
+                   object_get_typename(o));
+        return;
+    }
+    g_free(lb->record);
+    lb->record = g_strdup(str);
+}
+
+static void lazy_get_chunk_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(obj);
+    uint64_t val = lb->chunk_size;
+
+    visit_type_size(v, name, &val, errp);
+}
+
+static void lazy_set_chunk_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(obj);
+    uint64_t val;
+
+    if (host_memory_backend_mr_inited(MEMORY_BACKEND(obj))) {
+        error_setg(errp, "cannot change property '%s' of %s", name,
+                   object_get_typename(obj));
+        return;
+    }
+    if (!visit_type_size(v, name, &val, errp)) {
+        return;
+    }
+    lb->chunk_size = val;
+}
+
+static void lazy_backend_instance_init(Object *obj)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(obj);
+
+    lb->chunk_size = LAZY_DEFAULT_CHUNK_SIZE;
+    lb->image_fd = -1;
+    lb->uffd = -1;
+}
+
+static void lazy_backend_instance_finalize(Object *obj)
+{
+    HostMemoryBackendLazy *lb = MEMORY_BACKEND_LAZY(obj);
+
+    if (lb->thread_running) {
+        event_notifier_set(&lb->stop);
+        qemu_thread_join(&lb->thread);
+        event_notifier_cleanup(&lb->stop);
+    }
+    if (lb->discard_disabled) {
+        ram_block_discard_disable(false);
+    }
+    if (lb->uffd >= 0) {
+        uffd_close_fd(lb->uffd);
+    }
+    if (lb->image_fd >= 0) {
+        qemu_close(lb->image_fd);
+    }
+    if (lb->record_file) {
+        fclose(lb->record_file);
+    }
+    qemu_vfree(lb->buf);
+    g_free(lb->present);
+    g_free(lb->prefetch_list);
+    g_free(lb->image);
+    g_free(lb->prefetch);
+    g_free(lb->record);
+}
+
+static void lazy_backend_class_init(ObjectClass *oc, void *data)
+{
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(oc);
+
+    bc->alloc = lazy_backend_memory_alloc;
+
+    object_class_property_add_str(oc, "image", lazy_get_image, lazy_set_image);
+    object_class_property_set_description(oc, "image",
+        "File guest RAM is populated from on first touch");
+    object_class_property_add_str(oc, "prefetch", lazy_get_prefetch,
+                                  lazy_set_prefetch);
+    object_class_property_set_description(oc, "prefetch",
+        "List of image offsets to populate ahead of the guest");
+    object_class_property_add_str(oc, "record", lazy_get_record,
+                                  lazy_set_record);
+    object_class_property_set_description(oc, "record",
+        "File to append the offset of every faulting chunk to");
+    object_class_property_add(oc, "chunk-size", "size", lazy_get_chunk_size,
+                              lazy_set_chunk_size, NULL, NULL);
+    object_class_property_set_description(oc, "chunk-size",
+        "Granularity of image reads, a power of 2");
+}
+
+static const TypeInfo lazy_backend_info = {
+    .name = TYPE_MEMORY_BACKEND_LAZY,
+    .parent = TYPE_MEMORY_BACKEND,
+    .instance_init = lazy_backend_instance_init,
+    .instance_finalize = lazy_backend_instance_finalize,
+    .class_init = lazy_backend_class_init,
+    .instance_size = sizeof(HostMemoryBackendLazy),
+};
+
+static void register_types(void)
+{
+    type_register_static(&lazy_backend_info);
+}
+
+type_init(register_types);
@@ -16,6 +16,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
     bool win_dmp = qdict_get_try_bool(qdict, "windmp", false);
+    bool xnu = qdict_get_try_bool(qdict, "xnu", false);
+    bool xnu_zstd = qdict_get_try_bool(qdict, "xnuzstd", false);
     bool paging = qdict_get_try_bool(qdict, "paging", false);
     bool zlib = qdict_get_try_bool(qdict, "zlib", false);
     bool lzo = qdict_get_try_bool(qdict, "lzo", false);
@@ -31,8 +33,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     enum DumpGuestMemoryFormat dump_format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     char *prot;
 
-    if (zlib + lzo + snappy + win_dmp > 1) {
-        error_setg(&err, "only one of '-z|-l|-s|-w' can be set");
+    if (zlib + lzo + snappy + win_dmp + xnu + xnu_zstd > 1) {
+        error_setg(&err, "only one of '-z|-l|-s|-w|-x|-X' can be set");
         hmp_handle_error(mon, err);
         return;
     }
@@ -41,6 +43,14 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
         dump_format = DUMP_GUEST_MEMORY_FORMAT_WIN_DMP;
     }
 
+    if (xnu) {
+        dump_format = DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO;
+    }
+
+    if (xnu_zstd) {
+        dump_format = DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD;
+    }
+
     if (zlib) {
         if (raw) {
             dump_format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_RAW_ZLIB;
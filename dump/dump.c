@@ -30,6 +30,7 @@
 #include "migration/blocker.h"
 #include "hw/core/cpu.h"
 #include "win_dump.h"
+#include "xnu_dump.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -2016,6 +2017,10 @@ static void dump_process(DumpState *s, Error **errp)
 
     if (s->has_format && s->format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         create_win_dump(s, errp);
+    } else if (s->has_format &&
+               (s->format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO ||
+                s->format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD)) {
+        create_xnu_dump(s, errp);
     } else if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
         create_kdump_vmcore(s, errp);
     } else {
@@ -2148,6 +2153,19 @@ void qmp_dump_guest_memory(bool paging, const char *protocol,
         return;
     }
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD) {
+        error_setg(errp, "xnu-macho-zstd is not available now");
+        return;
+    }
+#endif
+
+    if (has_format && (format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO ||
+                       format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD)
+        && !xnu_dump_available(errp)) {
+        return;
+    }
+
     if (strstart(protocol, "fd:", &p)) {
         fd = monitor_get_fd(monitor_cur(), p, errp);
         if (fd == -1) {
@@ -2234,5 +2252,12 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
         QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_WIN_DMP);
     }
 
+    if (xnu_dump_available(NULL)) {
+        QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO);
+#ifdef CONFIG_ZSTD
+        QAPI_LIST_APPEND(tail, DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD);
+#endif
+    }
+
     return cap;
 }
@@ -0,0 +1,399 @@
+/*
+ * XNU Mach-O core dumps (target specific implementations)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "sysemu/dump.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "exec/cpu-common.h"
+#include "hw/core/cpu.h"
+#include "xnu_dump.h"
+#include "cpu.h"
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+static XnuDumpInfoFunc xnu_dump_info_fn;
+static void *xnu_dump_info_opaque;
+
+void xnu_dump_register(XnuDumpInfoFunc fn, void *opaque)
+{
+    xnu_dump_info_fn = fn;
+    xnu_dump_info_opaque = opaque;
+}
+
+bool xnu_dump_get_info(XnuDumpInfo *info, Error **errp)
+{
+    if (xnu_dump_info_fn == NULL) {
+        error_setg(errp, "the machine does not boot XNU");
+        return false;
+    }
+    return xnu_dump_info_fn(info, xnu_dump_info_opaque, errp);
+}
+
+#if defined(TARGET_AARCH64)
+
+#define MACHO_MH_MAGIC_64           (0xfeedfacf)
+#define MACHO_MH_CORE               (0x4)
+#define MACHO_CPU_TYPE_ARM64        (0x0100000c)
+#define MACHO_LC_THREAD             (0x4)
+#define MACHO_LC_SEGMENT_64         (0x19)
+#define MACHO_LC_NOTE               (0x31)
+#define MACHO_VM_PROT_RW            (0x3)
+#define MACHO_ARM_THREAD_STATE64    (6)
+
+/* Segment data is page aligned in the file, as in the kernel's own cores. */
+#define XNU_DUMP_ALIGN              (0x4000)
+#define XNU_DUMP_CHUNK              (1 * MiB)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cpu_type;
+    uint32_t cpu_subtype;
+    uint32_t file_type;
+    uint32_t n_cmds;
+    uint32_t size_of_cmds;
+    uint32_t flags;
+    uint32_t reserved;
+} XnuMachHeader;
+
+typedef struct {
+    uint32_t cmd;
+    uint32_t cmd_size;
+    char segname[16];
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    uint32_t maxprot;
+    uint32_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+} XnuSegmentCommand;
+
+typedef struct {
+    uint64_t x[29];
+    uint64_t fp;
+    uint64_t lr;
+    uint64_t sp;
+    uint64_t pc;
+    uint32_t cpsr;
+    uint32_t pad;
+} XnuThreadState;
+
+typedef struct {
+    uint32_t cmd;
+    uint32_t cmd_size;
+    uint32_t flavor;
+    uint32_t count;
+    XnuThreadState state;
+} XnuThreadCommand;
+
+typedef struct {
+    uint32_t cmd;
+    uint32_t cmd_size;
+    char data_owner[16];
+    uint64_t offset;
+    uint64_t size;
+} XnuNoteCommand;
+
+/* lldb's "main bin spec" note, which tells it the core is a kernel's. */
+typedef struct {
+    uint32_t version;
+    uint32_t type;
+    uint64_t address;
+    uint64_t slide;
+    uint8_t uuid[16];
+    uint32_t log2_pagesize;
+    uint32_t platform;
+} XnuMainBinSpec;
+
+#define XNU_MAIN_BIN_SPEC_VERSION   (2)
+#define XNU_MAIN_BIN_SPEC_KERNEL    (1)
+
+QEMU_BUILD_BUG_ON(sizeof(XnuMachHeader) != 32);
+QEMU_BUILD_BUG_ON(sizeof(XnuSegmentCommand) != 72);
+QEMU_BUILD_BUG_ON(sizeof(XnuThreadState) != 68 * sizeof(uint32_t));
+QEMU_BUILD_BUG_ON(sizeof(XnuNoteCommand) != 40);
+QEMU_BUILD_BUG_ON(sizeof(XnuMainBinSpec) != 48);
+
+typedef struct {
+    int fd;
+    uint64_t offset;            /* of the uncompressed core */
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *cctx;
+    uint8_t *out;
+    size_t out_size;
+#endif
+} XnuDumpWriter;
+
+bool xnu_dump_available(Error **errp)
+{
+    if (xnu_dump_info_fn == NULL) {
+        error_setg(errp, "xnu-macho dumps are only available for machines "
+                         "booting XNU");
+        return false;
+    }
+    return true;
+}
+
+static bool xnu_dump_write_fd(int fd, const void *buf, size_t len,
+                              Error **errp)
+{
+    if (qemu_write_full(fd, buf, len) != len) {
+        error_setg_errno(errp, errno, "dump: failed to save core");
+        return false;
+    }
+    return true;
+}
+
+static bool xnu_dump_write(XnuDumpWriter *w, const void *buf, size_t len,
+                           Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    if (w->cctx != NULL) {
+        ZSTD_inBuffer in = { .src = buf, .size = len };
+
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = { .dst = w->out, .size = w->out_size };
+            size_t ret = ZSTD_compressStream2(w->cctx, &out, &in,
+                                              ZSTD_e_continue);
+
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "dump: failed to compress core: %s",
+                           ZSTD_getErrorName(ret));
+                return false;
+            }
+            if (!xnu_dump_write_fd(w->fd, w->out, out.pos, errp)) {
+                return false;
+            }
+        }
+        w->offset += len;
+        return true;
+    }
+#endif
+    if (!xnu_dump_write_fd(w->fd, buf, len, errp)) {
+        return false;
+    }
+    w->offset += len;
+    return true;
+}
+
+static bool xnu_dump_pad(XnuDumpWriter *w, uint64_t offset, Error **errp)
+{
+    static const uint8_t zero[XNU_DUMP_ALIGN];
+
+    g_assert(offset >= w->offset && offset - w->offset <= sizeof(zero));
+    return xnu_dump_write(w, zero, offset - w->offset, errp);
+}
+
+static bool xnu_dump_finish(XnuDumpWriter *w, Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    if (w->cctx != NULL) {
+        ZSTD_inBuffer in = { 0 };
+        size_t ret;
+
+        do {
+            ZSTD_outBuffer out = { .dst = w->out, .size = w->out_size };
+
+            ret = ZSTD_compressStream2(w->cctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "dump: failed to compress core: %s",
+                           ZSTD_getErrorName(ret));
+                return false;
+            }
+            if (!xnu_dump_write_fd(w->fd, w->out, out.pos, errp)) {
+                return false;
+            }
+        } while (ret != 0);
+    }
+#endif
+    return true;
+}
+
+static void xnu_dump_thread_state(CPUState *cs, XnuThreadCommand *cmd)
+{
+    CPUARMState *env = &ARM_CPU(cs)->env;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->cmd = MACHO_LC_THREAD;
+    cmd->cmd_size = sizeof(*cmd);
+    cmd->flavor = MACHO_ARM_THREAD_STATE64;
+    cmd->count = sizeof(cmd->state) / sizeof(uint32_t);
+    memcpy(cmd->state.x, env->xregs, sizeof(cmd->state.x));
+    cmd->state.fp = env->xregs[29];
+    cmd->state.lr = env->xregs[30];
+    cmd->state.sp = env->xregs[31];
+    cmd->state.pc = env->pc;
+    cmd->state.cpsr = pstate_read(env);
+}
+
+static bool xnu_dump_write_range(DumpState *s, XnuDumpWriter *w,
+                                 const XnuDumpRange *range, uint8_t *buf,
+                                 Error **errp)
+{
+    for (uint64_t off = 0; off < range->size; off += XNU_DUMP_CHUNK) {
+        uint64_t len = MIN(range->size - off, XNU_DUMP_CHUNK);
+
+        cpu_physical_memory_read(range->paddr + off, buf, len);
+        if (!xnu_dump_write(w, buf, len, errp)) {
+            return false;
+        }
+        s->written_size += len;
+    }
+    return true;
+}
+
+/*
+ * The layout is the one XNU's kern_dump writes: the header and all load
+ * commands, the note payloads, then every segment's data page aligned.
+ */
+static void xnu_dump_write_core(DumpState *s, XnuDumpInfo *info,
+                                XnuDumpWriter *w, Error **errp)
+{
+    XnuMachHeader mh = { 0 };
+    XnuNoteCommand note = { 0 };
+    XnuMainBinSpec spec = { 0 };
+    g_autofree uint8_t *buf = NULL;
+    CPUState *cs;
+    uint64_t data_off;
+    uint32_t nr_cpus = 0;
+
+    CPU_FOREACH(cs) {
+        nr_cpus++;
+    }
+
+    mh.magic = MACHO_MH_MAGIC_64;
+    mh.cpu_type = MACHO_CPU_TYPE_ARM64;
+    mh.file_type = MACHO_MH_CORE;
+    mh.n_cmds = 1 + nr_cpus + info->ranges->len;
+    mh.size_of_cmds = sizeof(note) + nr_cpus * sizeof(XnuThreadCommand) +
+                      info->ranges->len * sizeof(XnuSegmentCommand);
+
+    note.cmd = MACHO_LC_NOTE;
+    note.cmd_size = sizeof(note);
+    pstrcpy(note.data_owner, sizeof(note.data_owner), "main bin spec");
+    note.offset = sizeof(mh) + mh.size_of_cmds;
+    note.size = sizeof(spec);
+
+    spec.version = XNU_MAIN_BIN_SPEC_VERSION;
+    spec.type = XNU_MAIN_BIN_SPEC_KERNEL;
+    spec.address = info->kernel_vaddr;
+    spec.slide = UINT64_MAX;
+    memcpy(spec.uuid, info->kernel_uuid, sizeof(spec.uuid));
+
+    if (!xnu_dump_write(w, &mh, sizeof(mh), errp) ||
+        !xnu_dump_write(w, &note, sizeof(note), errp)) {
+        return;
+    }
+
+    CPU_FOREACH(cs) {
+        XnuThreadCommand thread;
+
+        xnu_dump_thread_state(cs, &thread);
+        if (!xnu_dump_write(w, &thread, sizeof(thread), errp)) {
+            return;
+        }
+    }
+
+    data_off = ROUND_UP(note.offset + note.size, XNU_DUMP_ALIGN);
+    for (guint i = 0; i < info->ranges->len; i++) {
+        const XnuDumpRange *range =
+            &g_array_index(info->ranges, XnuDumpRange, i);
+        XnuSegmentCommand seg = { 0 };
+
+        seg.cmd = MACHO_LC_SEGMENT_64;
+        seg.cmd_size = sizeof(seg);
+        seg.vmaddr = range->vaddr;
+        seg.vmsize = range->size;
+        seg.fileoff = data_off;
+        seg.filesize = range->size;
+        seg.maxprot = MACHO_VM_PROT_RW;
+        seg.initprot = MACHO_VM_PROT_RW;
+        if (!xnu_dump_write(w, &seg, sizeof(seg), errp)) {
+            return;
+        }
+        data_off = ROUND_UP(data_off + range->size, XNU_DUMP_ALIGN);
+    }
+
+    if (!xnu_dump_write(w, &spec, sizeof(spec), errp)) {
+        return;
+    }
+
+    buf = g_malloc(XNU_DUMP_CHUNK);
+    for (guint i = 0; i < info->ranges->len; i++) {
+        const XnuDumpRange *range =
+            &g_array_index(info->ranges, XnuDumpRange, i);
+
+        if (!xnu_dump_pad(w, ROUND_UP(w->offset, XNU_DUMP_ALIGN), errp) ||
+            !xnu_dump_write_range(s, w, range, buf, errp)) {
+            return;
+        }
+    }
+
+    xnu_dump_finish(w, errp);
+}
+
+void create_xnu_dump(DumpState *s, Error **errp)
+{
+    XnuDumpInfo info = { 0 };
+    XnuDumpWriter w = { .fd = s->fd };
+
+    info.ranges = g_array_new(FALSE, FALSE, sizeof(XnuDumpRange));
+    if (!xnu_dump_available(errp) ||
+        !xnu_dump_info_fn(&info, xnu_dump_info_opaque, errp)) {
+        goto out;
+    }
+
+    s->total_size = 0;
+    for (guint i = 0; i < info.ranges->len; i++) {
+        s->total_size += g_array_index(info.ranges, XnuDumpRange, i).size;
+    }
+
+    if (s->format == DUMP_GUEST_MEMORY_FORMAT_XNU_MACHO_ZSTD) {
+#ifdef CONFIG_ZSTD
+        w.cctx = ZSTD_createCCtx();
+        w.out_size = ZSTD_CStreamOutSize();
+        w.out = g_malloc(w.out_size);
+        /*
+         * Fails on a libzstd built without ZSTD_MULTITHREAD, which then
+         * compresses on this thread.
+         */
+        ZSTD_CCtx_setParameter(w.cctx, ZSTD_c_nbWorkers,
+                               g_get_num_processors());
+#else
+        g_assert_not_reached();
+#endif
+    }
+
+    xnu_dump_write_core(s, &info, &w, errp);
+
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(w.cctx);
+    g_free(w.out);
+#endif
+out:
+    g_array_free(info.ranges, TRUE);
+}
+
+#else /* !TARGET_AARCH64 */
+
+bool xnu_dump_available(Error **errp)
+{
+    error_setg(errp, "xnu-macho dump is only available for aarch64 guests");
+
+    return false;
+}
+
+void create_xnu_dump(DumpState *s, Error **errp)
+{
+    xnu_dump_available(errp);
+}
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * XNU Mach-O core dumps
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef XNU_DUMP_H
+#define XNU_DUMP_H
+
+#include "sysemu/dump.h"
+
+/* Check whether the machine registered an XNU dump provider */
+bool xnu_dump_available(Error **errp);
+
+void create_xnu_dump(DumpState *s, Error **errp);
+
+/*
+ * Fills @info from the registered provider. info->ranges must be an
+ * empty GArray of XnuDumpRange.
+ */
+bool xnu_dump_get_info(XnuDumpInfo *info, Error **errp);
+
+#endif /* XNU_DUMP_H */
@@ -0,0 +1,259 @@
+/*
+ * XNU guest memory introspection (target specific implementations)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-machine.h"
+#include "exec/address-spaces.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "hw/core/cpu.h"
+#include "qemu/uuid.h"
+#include "sysemu/runstate.h"
+#include "xnu_dump.h"
+#include "cpu.h"
+
+#if defined(TARGET_AARCH64)
+
+/* Where [gpa, gpa + size) lives in a file backed RAM block, if it does. */
+static bool xnu_introspect_host(hwaddr gpa, uint64_t size, int *fd,
+                                uint64_t *offset, bool *shared)
+{
+    MemoryRegionSection section;
+    RAMBlock *rb;
+    bool found = false;
+
+    section = memory_region_find(get_system_memory(), gpa, size);
+    if (section.mr == NULL) {
+        return false;
+    }
+
+    rb = section.mr->ram_block;
+    if (memory_region_is_ram(section.mr) && rb != NULL &&
+        qemu_ram_get_fd(rb) >= 0 && int128_get64(section.size) == size) {
+        *fd = qemu_ram_get_fd(rb);
+        *offset = rb->fd_offset + section.offset_within_region;
+        *shared = qemu_ram_is_shared(rb);
+        found = true;
+    }
+
+    memory_region_unref(section.mr);
+    return found;
+}
+
+XnuMemoryLayout *qmp_query_xnu_memory_layout(Error **errp)
+{
+    XnuDumpInfo info = { 0 };
+    XnuMemoryLayout *layout = NULL;
+    XnuMemoryRangeList **tail;
+    static const uint8_t no_uuid[16];
+
+    info.ranges = g_array_new(FALSE, FALSE, sizeof(XnuDumpRange));
+    if (!xnu_dump_get_info(&info, errp)) {
+        goto out;
+    }
+
+    layout = g_new0(XnuMemoryLayout, 1);
+    layout->kernel_vaddr = info.kernel_vaddr;
+    layout->kernel_slide = info.kernel_slide;
+    if (memcmp(info.kernel_uuid, no_uuid, sizeof(no_uuid)) != 0) {
+        QemuUUID uuid;
+
+        memcpy(uuid.data, info.kernel_uuid, sizeof(uuid.data));
+        layout->kernel_uuid = qemu_uuid_unparse_strdup(&uuid);
+    }
+
+    tail = &layout->ranges;
+    for (guint i = 0; i < info.ranges->len; i++) {
+        const XnuDumpRange *range =
+            &g_array_index(info.ranges, XnuDumpRange, i);
+        XnuMemoryRange *value = g_new0(XnuMemoryRange, 1);
+
+        value->vaddr = range->vaddr;
+        value->gpa = range->paddr;
+        value->size = range->size;
+        value->has_host_fd = value->has_host_offset = value->has_shared =
+            xnu_introspect_host(range->paddr, range->size, &value->host_fd,
+                                &value->host_offset, &value->shared);
+        QAPI_LIST_APPEND(tail, value);
+    }
+
+out:
+    g_array_free(info.ranges, TRUE);
+    return layout;
+}
+
+/*
+ * A direct mapped cache of kernel page translations, valid for one pair
+ * of TTBR1_EL1 and TCR_EL1 values and only while the VM stays stopped.
+ */
+#define XNU_TLB_SIZE (1024)
+
+typedef struct {
+    uint64_t va;                /* page address, bit 0 set when valid */
+    hwaddr pa;
+} XnuTlbEntry;
+
+static struct {
+    uint64_t ttbr;
+    uint64_t tcr;
+    XnuTlbEntry entries[XNU_TLB_SIZE];
+    VMChangeStateEntry *vmstate;
+} xnu_tlb;
+
+static void xnu_tlb_flush(void)
+{
+    memset(xnu_tlb.entries, 0, sizeof(xnu_tlb.entries));
+}
+
+static void xnu_tlb_vm_state_change(void *opaque, bool running,
+                                    RunState state)
+{
+    if (running) {
+        xnu_tlb_flush();
+    }
+}
+
+static unsigned int xnu_granule_bits(uint64_t tcr)
+{
+    switch (extract64(tcr, 30, 2)) { /* TG1 */
+    case 1:
+        return 14;
+    case 3:
+        return 16;
+    default:
+        return 12;
+    }
+}
+
+/*
+ * Walks the TTBR1 tables like the MMU does for an EL1 access, without
+ * permission checks. Only the 48-bit output addresses of ARMv8.0 are
+ * handled, which is all A13 has.
+ */
+static bool xnu_walk(CPUState *cs, uint64_t ttbr, uint64_t tcr, uint64_t va,
+                     hwaddr *pa)
+{
+    unsigned int grain = xnu_granule_bits(tcr);
+    unsigned int stride = grain - 3;
+    unsigned int inputsize = 64 - MIN(MAX(extract64(tcr, 16, 6), 16), 39);
+    unsigned int level, bits;
+    uint64_t table = ttbr & MAKE_64BIT_MASK(1, 47);
+    uint64_t desc;
+
+    if (extract64(tcr, 38, 1)) { /* TBI1 */
+        va = sextract64(va, 0, 56);
+    }
+    if (sextract64(va, inputsize, 64 - inputsize) != -1) {
+        return false;
+    }
+
+    level = 4 - (inputsize - grain + stride - 1) / stride;
+    for (;; level++) {
+        bits = grain + stride * (3 - level);
+        desc = ldq_le_phys(cs->as,
+                           table + extract64(va, bits,
+                                             MIN(stride, inputsize - bits)) *
+                                       8);
+        if (!(desc & 1) || (level == 3 && !(desc & 2))) {
+            return false;
+        }
+        if (level == 3 || !(desc & 2)) {
+            break;
+        }
+        table = desc & MAKE_64BIT_MASK(grain, 48 - grain);
+    }
+
+    *pa = (desc & MAKE_64BIT_MASK(bits, 48 - bits)) | extract64(va, 0, bits);
+    return true;
+}
+
+static bool xnu_translate(CPUState *cs, uint64_t va, hwaddr *pa)
+{
+    CPUARMState *env = &ARM_CPU(cs)->env;
+    uint64_t ttbr = env->cp15.ttbr1_el[1];
+    uint64_t tcr = env->cp15.tcr_el[1];
+    unsigned int grain = xnu_granule_bits(tcr);
+    uint64_t page = va & ~MAKE_64BIT_MASK(0, grain);
+    XnuTlbEntry *entry = &xnu_tlb.entries[(page >> grain) % XNU_TLB_SIZE];
+
+    if (ttbr != xnu_tlb.ttbr || tcr != xnu_tlb.tcr) {
+        xnu_tlb_flush();
+        xnu_tlb.ttbr = ttbr;
+        xnu_tlb.tcr = tcr;
+    }
+
+    if (entry->va != (page | 1)) {
+        if (!xnu_walk(cs, ttbr, tcr, page, &entry->pa)) {
+            return false;
+        }
+        entry->va = page | 1;
+    }
+    *pa = entry->pa | (va & MAKE_64BIT_MASK(0, grain));
+    return true;
+}
+
+XnuTranslationList *qmp_xnu_translate(uint64List *addrs, bool has_cpu_index,
+                                      int64_t cpu_index, Error **errp)
+{
+    XnuTranslationList *head = NULL;
+    XnuTranslationList **tail = &head;
+    CPUState *cs = qemu_get_cpu(has_cpu_index ? cpu_index : 0);
+
+    if (cs == NULL) {
+        error_setg(errp, "no vCPU with index %" PRId64, cpu_index);
+        return NULL;
+    }
+
+    if (xnu_tlb.vmstate == NULL) {
+        xnu_tlb.vmstate =
+            qemu_add_vm_change_state_handler(xnu_tlb_vm_state_change, NULL);
+    }
+    /* A running guest may change its tables under any cached entry. */
+    if (runstate_is_running()) {
+        xnu_tlb_flush();
+    }
+
+    for (; addrs != NULL; addrs = addrs->next) {
+        XnuTranslation *value = g_new0(XnuTranslation, 1);
+        hwaddr pa;
+        bool shared;
+
+        value->vaddr = addrs->value;
+        if (xnu_translate(cs, addrs->value, &pa)) {
+            value->has_gpa = true;
+            value->gpa = pa;
+            value->has_host_fd = value->has_host_offset =
+                xnu_introspect_host(pa, 1, &value->host_fd,
+                                    &value->host_offset, &shared);
+        }
+        QAPI_LIST_APPEND(tail, value);
+    }
+
+    return head;
+}
+
+#else /* !TARGET_AARCH64 */
+
+XnuMemoryLayout *qmp_query_xnu_memory_layout(Error **errp)
+{
+    error_setg(errp, "XNU introspection is only available for aarch64 "
+                     "guests");
+    return NULL;
+}
+
+XnuTranslationList *qmp_xnu_translate(uint64List *addrs, bool has_cpu_index,
+                                      int64_t cpu_index, Error **errp)
+{
+    error_setg(errp, "XNU introspection is only available for aarch64 "
+                     "guests");
+    return NULL;
+}
+
+#endif
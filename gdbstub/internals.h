@@ -11,7 +11,11 @@
 
 #include "exec/cpu-common.h"
 
-#define MAX_PACKET_LENGTH 4096
+/*
+ * Large enough for debugger scripts to read whole kernel structures in one
+ * 'm' packet.
+ */
+#define MAX_PACKET_LENGTH 0x20000
 
 /*
  * Shared structures and definitions
@@ -309,6 +309,27 @@ SRST
     being coalesced.
 ERST
 
+    {
+        .name       = "mmio-profile",
+        .args_type  = "time:-t,max:i?",
+        .params     = "[-t] [max]",
+        .help       = "show MMIO register profiling info, up to max entries "
+                      "(default: 20, 0 for all), sorted by access count "
+                      "(-t: sort by total time spent in the device model)",
+        .cmd        = hmp_info_mmio_profile,
+    },
+
+SRST
+  ``info mmio-profile [-t]`` [*max*]
+    Show the MMIO registers collected by ``mmio-profile on``, up to *max*
+    entries (default: 20, 0 for all), sorted by access count. Each row has
+    the read and write counts, the mean host time per access and a histogram
+    of access latencies.
+
+    ``-t``
+      sort by total time spent in the device model
+ERST
+
     {
         .name       = "kvm",
         .args_type  = "",
@@ -914,7 +935,7 @@ ERST
         .name       = "stats",
         .args_type  = "target:s,names:s?,provider:s?",
         .params     = "target [names] [provider]",
-        .help       = "show statistics for the given target (vm or vcpu); optionally filter by"
+        .help       = "show statistics for the given target (vm, vcpu, cryptodev, iommu or device); optionally filter by"
                       "name (comma-separated list, or * for all) and provider",
         .cmd        = hmp_info_stats,
     },
@@ -1007,3 +1028,18 @@ SRST
   ``info cryptodev``
     Show the crypto devices.
 ERST
+
+#if defined(TARGET_AARCH64)
+    {
+        .name       = "xnu-sym",
+        .args_type  = "addr:l",
+        .params     = "addr",
+        .help       = "symbolize a guest XNU kernel address",
+    },
+#endif
+
+SRST
+  ``info xnu-sym`` *addr*
+    Show the kernelcache image and symbol containing the guest virtual
+    address *addr*, on the Apple silicon machines.
+ERST
@@ -639,6 +639,21 @@ SRST
   whether profiling is on or off.
 ERST
 
+    {
+        .name       = "mmio-profile",
+        .args_type  = "op:s?",
+        .params     = "[on|off|reset]",
+        .help       = "enable, disable or reset MMIO register profiling. "
+                      "With no arguments, prints whether profiling is on or off.",
+        .cmd        = hmp_mmio_profile,
+    },
+
+SRST
+``mmio-profile [on|off|reset]``
+  Enable, disable or reset per-register MMIO access profiling. With no
+  arguments, prints whether profiling is on or off.
+ERST
+
     {
         .name       = "system_reset",
         .args_type  = "",
@@ -1074,8 +1089,8 @@ ERST
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,detach:-d,windmp:-w,zlib:-z,lzo:-l,snappy:-s,raw:-R,filename:F,begin:l?,length:l?",
-        .params     = "[-p] [-d] [-z|-l|-s|-w] [-R] filename [begin length]",
+        .args_type  = "paging:-p,detach:-d,windmp:-w,zlib:-z,lzo:-l,snappy:-s,raw:-R,xnu:-x,xnuzstd:-X,filename:F,begin:l?,length:l?",
+        .params     = "[-p] [-d] [-z|-l|-s|-w|-x|-X] [-R] filename [begin length]",
         .help       = "dump guest memory into file 'filename'.\n\t\t\t"
                       "-p: do paging to get guest's memory mapping.\n\t\t\t"
                       "-d: return immediately (do not wait for completion).\n\t\t\t"
@@ -1086,6 +1101,8 @@ ERST
                       "    format\n\t\t\t"
                       "-w: dump in Windows crashdump format (can be used instead of ELF-dump converting),\n\t\t\t"
                       "    for Windows x86 and x64 guests with vmcoreinfo driver only.\n\t\t\t"
+                      "-x: dump in Mach-O core format, for XNU guests on machines booting XNU only.\n\t\t\t"
+                      "-X: dump in Mach-O core format compressed with zstd, for XNU guests.\n\t\t\t"
                       "begin: the starting physical address.\n\t\t\t"
                       "length: the memory size, in bytes.",
         .cmd        = hmp_dump_guest_memory,
@@ -1094,9 +1111,9 @@ ERST
 SRST
 ``dump-guest-memory [-p]`` *filename* *begin* *length*
   \ 
-``dump-guest-memory [-z|-l|-s|-w]`` *filename*
+``dump-guest-memory [-z|-l|-s|-w|-x|-X]`` *filename*
   Dump guest memory to *protocol*. The file can be processed with crash or
-  gdb. Without ``-z|-l|-s|-w``, the dump format is ELF.
+  gdb. Without ``-z|-l|-s|-w|-x|-X``, the dump format is ELF.
 
   ``-p``
     do paging to get guest's memory mapping.
@@ -1112,6 +1129,11 @@ SRST
   ``-w``
     dump in Windows crashdump format (can be used instead of ELF-dump converting),
     for Windows x64 guests with vmcoreinfo driver only
+  ``-x``
+    dump in Mach-O core format, which lldb can open, for machines booting
+    XNU only. Only the memory the machine describes as the kernel's is kept
+  ``-X``
+    like ``-x``, but compressed with zstd
   *filename*
     dump file name.
   *begin*
@@ -22,19 +22,29 @@
 #include "exec/address-spaces.h"
 #include "hw/arm/apple-silicon/a13.h"
 #include "hw/arm/apple-silicon/a13_gxf.h"
+#include "hw/arm/apple-silicon/core.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/hypercall.h"
 #include "hw/irq.h"
+#include "hw/misc/apple-silicon/deadline.h"
 #include "hw/or-irq.h"
 #include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "sysemu/cpu-timers.h"
 #include "sysemu/reset.h"
+#include "sysemu/tcg.h"
 #include "arm-powerctl.h"
 #include "target/arm/cpregs.h"
+#include "target/arm/cpu-features.h"
+#include "target/arm/internals.h"
+#include "trace.h"
 
 #define VMSTATE_A13_CPREG(name) \
     VMSTATE_UINT64(A13_CPREG_VAR_NAME(name), AppleA13State)
@@ -64,6 +74,20 @@
         .fieldoffset = offsetof(AppleA13Cluster, A13_CPREG_VAR_NAME(p_name)) \
     }
 
+#define A13_PMC_DEF(p_name, p_op1, p_crm, p_access, p_field, p_writefn)     \
+    {                                                                        \
+        .cp = CP_REG_ARM64_SYSREG_CP, .name = #p_name, .opc0 = 3,            \
+        .crn = 15, .crm = p_crm, .opc1 = p_op1, .opc2 = 0,                   \
+        .access = p_access, .state = ARM_CP_STATE_AA64,                      \
+        .type = ARM_CP_OVERRIDE, .accessfn = apple_a13_pmc_access,           \
+        .readfn = apple_a13_pmc_read, .writefn = p_writefn,                  \
+        .raw_writefn = raw_write,                                            \
+        .fieldoffset = offsetof(CPUARMState, apple_pmc.p_field)              \
+    }
+
+#define A13_PMC_MASK ((1ULL << 48) - 1)
+#define A13_PMCR0_USEREN (1ULL << 30)
+
 #define IPI_SR_SRC_CPU_SHIFT 8
 #define IPI_SR_SRC_CPU_WIDTH 8
 #define IPI_SR_SRC_CPU_MASK \
@@ -102,58 +126,223 @@ static void nanoseconds_to_absolutetime(uint64_t nanosecs, uint64_t *result)
     *result += (nanosecs * RTCLOCK_SEC_DIVISOR) / NSEC_PER_SEC;
 }
 
+/*
+ * Counter reads divide the virtual clock by the generic timer period like
+ * target/arm does, but with a precomputed reciprocal (Granlund-Montgomery,
+ * exact for every 64-bit dividend) so the path is a multiply and two shifts.
+ * Every A13 core runs at the same frequency, so the reciprocal is global.
+ */
+static uint64_t cnt_period_ns;
+static uint64_t cnt_magic;
+static unsigned int cnt_shift;
+
+static void apple_a13_cnt_init(uint64_t period_ns)
+{
+    uint64_t lo = 0;
+    uint64_t hi;
+
+    cnt_period_ns = period_ns;
+    if (period_ns <= 1) {
+        return;
+    }
+    cnt_shift = 64 - clz64(period_ns - 1);
+    hi = (1ull << cnt_shift) - period_ns;
+    divu128(&lo, &hi, period_ns);
+    cnt_magic = lo + 1;
+}
+
+static inline uint64_t apple_a13_cnt_get(void)
+{
+    uint64_t ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t lo;
+    uint64_t t;
+
+    if (cnt_period_ns <= 1) {
+        return ns;
+    }
+    mulu64(&lo, &t, ns, cnt_magic);
+    return (t + ((ns - t) >> 1)) >> (cnt_shift - 1);
+}
+
+/*
+ * The A13 has neither EL2 nor EL3, so only CNTKCTL_EL1 gates EL0 access
+ * and the physical count has no offset.
+ */
+static CPAccessResult apple_a13_cnt_access(CPUARMState *env,
+                                           const ARMCPRegInfo *ri,
+                                           bool isread)
+{
+    /* EL0PCTEN is bit 0, EL0VCTEN bit 1 */
+    int bit = ri->opc2 == 1 ? 0 : 1;
+
+    if (arm_current_el(env) == 0 && !extract64(env->cp15.c14_cntkctl, bit, 1)) {
+        return CP_ACCESS_TRAP;
+    }
+    return CP_ACCESS_OK;
+}
+
+static uint64_t apple_a13_cntpct_read(CPUARMState *env, const ARMCPRegInfo *ri)
+{
+    return apple_a13_cnt_get();
+}
+
+static uint64_t apple_a13_cntvct_read(CPUARMState *env, const ARMCPRegInfo *ri)
+{
+    return apple_a13_cnt_get() - env->cp15.cntvoff_el2;
+}
+
+/*
+ * The stock registers are ARM_CP_IO, which takes the BQL on every read.
+ * The count only needs the virtual clock, so without icount these read it
+ * lock-free.
+ */
+static const ARMCPRegInfo apple_a13_cnt_override_reginfo[] = {
+    {
+        .name = "CNTPCT_EL0",
+        .state = ARM_CP_STATE_AA64,
+        .opc0 = 3,
+        .opc1 = 3,
+        .crn = 14,
+        .crm = 0,
+        .opc2 = 1,
+        .access = PL0_R,
+        .type = ARM_CP_NO_RAW | ARM_CP_OVERRIDE,
+        .accessfn = apple_a13_cnt_access,
+        .readfn = apple_a13_cntpct_read,
+    },
+    {
+        .name = "CNTVCT_EL0",
+        .state = ARM_CP_STATE_AA64,
+        .opc0 = 3,
+        .opc1 = 3,
+        .crn = 14,
+        .crm = 0,
+        .opc2 = 2,
+        .access = PL0_R,
+        .type = ARM_CP_NO_RAW | ARM_CP_OVERRIDE,
+        .accessfn = apple_a13_cnt_access,
+        .readfn = apple_a13_cntvct_read,
+    },
+};
+
+/*
+ * The PMU. TCG counts instructions into env->apple_pmc, each access folds
+ * them into the counters first and each write re-evaluates the overflow
+ * limits and the PMI. Without TCG the counters just hold their values.
+ */
+static CPAccessResult apple_a13_pmc_access(CPUARMState *env,
+                                           const ARMCPRegInfo *ri,
+                                           bool isread)
+{
+    if (arm_current_el(env) == 0 &&
+        !(env->apple_pmc.pmcr0 & A13_PMCR0_USEREN)) {
+        return CP_ACCESS_TRAP;
+    }
+    return CP_ACCESS_OK;
+}
+
+static uint64_t apple_a13_pmc_read(CPUARMState *env, const ARMCPRegInfo *ri)
+{
+    arm_apple_pmc_sync(env);
+    arm_apple_pmc_update(env);
+    return raw_read(env, ri);
+}
+
+static void apple_a13_pmc_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                uint64_t value)
+{
+    arm_apple_pmc_sync(env);
+    raw_write(env, ri, value & A13_PMC_MASK);
+    arm_apple_pmc_update(env);
+}
+
+static void apple_a13_pmcr_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                 uint64_t value)
+{
+    arm_apple_pmc_sync(env);
+    raw_write(env, ri, value);
+    arm_apple_pmc_update(env);
+}
+
+/*
+ * Locking under MTTCG:
+ *
+ * The implementation registers defined with A13_CPREG_DEF and the GXF
+ * overrides in a13_gxf.c only touch the state of the vCPU that accesses
+ * them, so they need no locking and run on the vCPU thread directly.
+ *
+ * Everything shared between vCPUs (the deferred/no-wake IPI queues of a
+ * cluster, ipi_cr, ipicr_deadline and the cluster-wide CTRR registers) is
+ * protected by the BQL. The registers accessing it are ARM_CP_IO, which
+ * makes TCG take the BQL around the accessor, and the timer callback runs
+ * with the BQL held. Raising and lowering the fast IPI line needs the
+ * BQL anyway, so a finer-grained lock would not remove it from the path.
+ *
+ * The one exception is IPI_SR reads: a core polls its own status while
+ * handling the fast IPI FIQ, so ipi_sr is accessed atomically and the
+ * read side does not take the BQL. ipi_sr is only written with the BQL
+ * held.
+ */
 
 static QTAILQ_HEAD(, AppleA13Cluster) clusters =
     QTAILQ_HEAD_INITIALIZER(clusters);
 
+/*
+ * Filled in at cluster realize time so the IPI and cluster register paths
+ * do not have to search for their target.
+ */
+static AppleA13Cluster *cluster_by_id[A13_MAX_CLUSTER];
+static AppleA13State *cpu_by_phys_id[A13_MAX_CLUSTER][A13_MAX_CPU];
+
 static uint64_t ipi_cr = kDeferredIPITimerDefault;
-static QEMUTimer *ipicr_timer = NULL;
+static AppleDeadline ipicr_deadline;
+static void apple_a13_cluster_ipicr_tick(void *opaque);
+/* Runs the IPI tick when a core with parked no-wake IPIs wakes up */
+static QEMUBH *nowake_bh = NULL;
 
-inline bool apple_a13_cpu_is_sleep(AppleA13State *tcpu)
+bool apple_a13_cpu_is_sleep(AppleA13State *tcpu)
 {
-    return CPU(tcpu)->halted;
+    return apple_core_is_sleep(ARM_CPU(tcpu));
 }
 
-inline bool apple_a13_cpu_is_powered_off(AppleA13State *tcpu)
+bool apple_a13_cpu_is_powered_off(AppleA13State *tcpu)
 {
-    return ARM_CPU(tcpu)->power_state == PSCI_OFF;
+    return apple_core_is_powered_off(ARM_CPU(tcpu));
 }
 
 void apple_a13_cpu_start(AppleA13State *tcpu)
 {
-    int ret = QEMU_ARM_POWERCTL_RET_SUCCESS;
-
-    if (ARM_CPU(tcpu)->power_state != PSCI_ON) {
-        ret = arm_set_cpu_on_and_reset(tcpu->mpidr);
-    }
-
-    if (ret != QEMU_ARM_POWERCTL_RET_SUCCESS) {
-        error_report("Failed to bring up CPU %d: err %d", tcpu->cpu_id, ret);
-    }
+    apple_core_start(ARM_CPU(tcpu), &tcpu->reset_clean);
 }
 
 void apple_a13_cpu_off(AppleA13State *tcpu)
 {
-    int ret = QEMU_ARM_POWERCTL_RET_SUCCESS;
-
-    if (ARM_CPU(tcpu)->power_state != PSCI_OFF) {
-        ret = arm_set_cpu_off(tcpu->mpidr);
-    }
+    apple_core_off(ARM_CPU(tcpu));
+}
 
-    if (ret != QEMU_ARM_POWERCTL_RET_SUCCESS) {
-        error_report("%s: failed to turn off CPU %d: err %d", __func__,
-                     tcpu->cpu_id, ret);
+static AppleA13Cluster *apple_a13_find_cluster(uint32_t cluster_id)
+{
+    if (unlikely(cluster_id >= A13_MAX_CLUSTER)) {
+        return NULL;
     }
+    return cluster_by_id[cluster_id];
 }
 
-static AppleA13Cluster *apple_a13_find_cluster(int cluster_id)
+/* Find the CPU in cluster `c` whose physical ID is `phys_id` */
+static AppleA13State *apple_a13_find_cpu(AppleA13Cluster *c, uint32_t phys_id)
 {
-    AppleA13Cluster *cluster = NULL;
-    QTAILQ_FOREACH (cluster, &clusters, next) {
-        if (CPU_CLUSTER(cluster)->cluster_id == cluster_id)
-            return cluster;
+    uint32_t cluster_id = phys_id >> 8;
+    uint32_t core = phys_id & 0xff;
+    AppleA13State *tcpu;
+
+    if (unlikely(cluster_id >= A13_MAX_CLUSTER || core >= A13_MAX_CPU)) {
+        return NULL;
+    }
+    tcpu = cpu_by_phys_id[cluster_id][core];
+    if (tcpu == NULL || c->cpus[tcpu->cpu_id] != tcpu) {
+        return NULL;
     }
-    return NULL;
+    return tcpu;
 }
 
 static uint64_t apple_a13_cluster_cpreg_read(CPUARMState *env,
@@ -182,15 +371,52 @@ static void apple_a13_cluster_cpreg_write(CPUARMState *env,
     *(uint64_t *)((char *)(c) + (ri)->fieldoffset) = value;
 }
 
-/* Deliver IPI */
-static void apple_a13_cluster_deliver_ipi(AppleA13Cluster *c, uint64_t cpu_id,
+/* Deliver IPI, returns false if the target still has one outstanding */
+static bool apple_a13_cluster_deliver_ipi(AppleA13Cluster *c, uint64_t cpu_id,
                                           uint64_t src_cpu, uint64_t flag)
 {
-    if (c->cpus[cpu_id]->ipi_sr)
-        return;
+    if (qatomic_read(&c->cpus[cpu_id]->ipi_sr))
+        return false;
 
-    c->cpus[cpu_id]->ipi_sr = 1LL | (src_cpu << IPI_SR_SRC_CPU_SHIFT) | flag;
+    qatomic_set(&c->cpus[cpu_id]->ipi_sr,
+                1 | (src_cpu << IPI_SR_SRC_CPU_SHIFT) | flag);
     qemu_irq_raise(c->cpus[cpu_id]->fast_ipi);
+    return true;
+}
+
+/* Make sure the IPI timer fires no later than `deadline` */
+static void apple_a13_ipicr_kick(int64_t deadline)
+{
+    if (ipicr_deadline.sched) {
+        apple_deadline_mod_anticipate(&ipicr_deadline, deadline);
+    }
+}
+
+/* Queue a deferred IPI from `src_cpu`, due one IPI_CR period from now */
+static void apple_a13_cluster_defer_ipi(AppleA13Cluster *c, uint32_t cpu_id,
+                                        uint32_t src_cpu)
+{
+    if (!c->deferredIPI[cpu_id]) {
+        c->deferred_deadline[cpu_id] =
+            qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr;
+    }
+    c->deferredIPI[cpu_id] |= 1 << src_cpu;
+    apple_a13_ipicr_kick(c->deferred_deadline[cpu_id]);
+}
+
+/* Queue an IPI from `src_cpu` to be delivered once the target wakes up */
+static void apple_a13_cluster_nowake_ipi(AppleA13Cluster *c, uint32_t cpu_id,
+                                         uint32_t src_cpu)
+{
+    c->noWakeIPI[cpu_id] |= 1 << src_cpu;
+    apple_a13_ipicr_kick(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
+}
+
+static void apple_a13_cluster_retract_ipi(AppleA13Cluster *c, uint32_t cpu_id,
+                                          uint32_t src_cpu)
+{
+    c->deferredIPI[cpu_id] &= ~(1 << src_cpu);
+    c->noWakeIPI[cpu_id] &= ~(1 << src_cpu);
 }
 
 static int apple_a13_cluster_pre_save(void *opaque)
@@ -200,10 +426,43 @@ static int apple_a13_cluster_pre_save(void *opaque)
     return 0;
 }
 
+static bool apple_a13_cluster_is_v1(void *opaque, int version_id)
+{
+    return version_id < 2;
+}
+
 static int apple_a13_cluster_post_load(void *opaque, int version_id)
 {
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i;
+    int j;
+
     ipi_cr = cluster->ipi_cr;
+    if (version_id < 2) {
+        /* Whatever was queued by then is overdue by now */
+        memset(cluster->deferredIPI, 0, sizeof(cluster->deferredIPI));
+        memset(cluster->noWakeIPI, 0, sizeof(cluster->noWakeIPI));
+        for (i = 0; i < A13_MAX_CPU; i++) { /* source */
+            for (j = 0; j < A13_MAX_CPU; j++) { /* target */
+                if (cluster->v1_deferredIPI[i * A13_MAX_CPU + j]) {
+                    cluster->deferredIPI[j] |= 1 << i;
+                }
+                if (cluster->v1_noWakeIPI[i * A13_MAX_CPU + j]) {
+                    cluster->noWakeIPI[j] |= 1 << i;
+                }
+            }
+        }
+        for (j = 0; j < A13_MAX_CPU; j++) {
+            cluster->deferred_deadline[j] = now;
+        }
+    }
+    for (i = 0; i < A13_MAX_CPU; i++) {
+        if (cluster->deferredIPI[i] || cluster->noWakeIPI[i]) {
+            apple_a13_ipicr_kick(now);
+            break;
+        }
+    }
     return 0;
 }
 
@@ -212,6 +471,7 @@ static void apple_a13_cluster_reset(DeviceState *dev)
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(dev);
     memset(cluster->deferredIPI, 0, sizeof(cluster->deferredIPI));
     memset(cluster->noWakeIPI, 0, sizeof(cluster->noWakeIPI));
+    memset(cluster->deferred_deadline, 0, sizeof(cluster->deferred_deadline));
 }
 
 static int add_cpu_to_cluster(Object *obj, void *opaque)
@@ -231,14 +491,35 @@ static int add_cpu_to_cluster(Object *obj, void *opaque)
     cluster->base = tcpu->cluster_reg[0];
     cluster->size = tcpu->cluster_reg[1];
     cluster->cpus[tcpu->cpu_id] = tcpu;
+    if ((tcpu->phys_id >> 8) < A13_MAX_CLUSTER &&
+        (tcpu->phys_id & 0xff) < A13_MAX_CPU) {
+        cpu_by_phys_id[tcpu->phys_id >> 8][tcpu->phys_id & 0xff] = tcpu;
+    } else {
+        warn_report("%s: CPU %d physical ID 0x%x is out of range, it will "
+                    "not receive fast IPIs",
+                    __func__, tcpu->cpu_id, tcpu->phys_id);
+    }
     return 0;
 }
 
 static void apple_a13_cluster_realize(DeviceState *dev, Error **errp)
 {
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(dev);
+    uint32_t cluster_id = CPU_CLUSTER(cluster)->cluster_id;
+
+    if (cluster_id >= A13_MAX_CLUSTER) {
+        error_setg(errp, "%s: cluster ID %u is out of range", __func__,
+                   cluster_id);
+        return;
+    }
+    cluster_by_id[cluster_id] = cluster;
     object_child_foreach_recursive(OBJECT(cluster), add_cpu_to_cluster, dev);
 
+    if (ipicr_deadline.sched == NULL) {
+        apple_deadline_init(&ipicr_deadline, apple_a13_cluster_ipicr_tick,
+                            NULL, kDeferredIPITimerDefault / 8);
+    }
+
     if (cluster->size) {
         memory_region_init_ram_device_ptr(
             &cluster->mr, OBJECT(cluster),
@@ -247,53 +528,89 @@ static void apple_a13_cluster_realize(DeviceState *dev, Error **errp)
     }
 }
 
-static void apple_a13_cluster_tick(AppleA13Cluster *c)
+/* Asleep with nothing about to wake it, so a no-wake IPI can wait */
+static bool apple_a13_cpu_is_parked(AppleA13State *tcpu)
+{
+    return apple_a13_cpu_is_sleep(tcpu) &&
+           !apple_a13_cpu_is_powered_off(tcpu) && !cpu_has_work(CPU(tcpu));
+}
+
+/*
+ * Deliver whatever deferred and no-wake IPIs are due at `now`.
+ * Returns the time by which the timer has to fire again, or INT64_MAX if
+ * nothing is left queued. IPIs that cannot be delivered yet (target busy
+ * or off) are retried one IPI_CR period later. No-wake IPIs to a core idle
+ * in WFI are parked instead: apple_a13_has_work() kicks nowake_bh once a
+ * real interrupt wakes it, so idle cores are not polled.
+ */
+static int64_t apple_a13_cluster_tick(AppleA13Cluster *c, int64_t now)
 {
-    int i, j;
+    int64_t next = INT64_MAX;
+    int j;
+
+    for (j = 0; j < A13_MAX_CPU; j++) { /* target */
+        uint32_t src;
+
+        if (!c->cpus[j] || !(c->deferredIPI[j] | c->noWakeIPI[j])) {
+            continue;
+        }
 
-    for (i = 0; i < A13_MAX_CPU; i++) { /* source */
-        for (j = 0; j < A13_MAX_CPU; j++) { /* target */
-            if (c->cpus[j] && c->deferredIPI[i][j] &&
-                !apple_a13_cpu_is_powered_off(c->cpus[j])) {
-                apple_a13_cluster_deliver_ipi(c, j, i, IPI_RR_TYPE_DEFERRED);
-                break;
+        if (c->deferredIPI[j] && c->deferred_deadline[j] > now) {
+            next = MIN(next, c->deferred_deadline[j]);
+        } else if (c->deferredIPI[j] &&
+                   !apple_a13_cpu_is_powered_off(c->cpus[j])) {
+            src = ctz32(c->deferredIPI[j]);
+            if (apple_a13_cluster_deliver_ipi(c, j, src,
+                                              IPI_RR_TYPE_DEFERRED)) {
+                c->deferredIPI[j] &= ~(1 << src);
             }
         }
-    }
 
-    for (i = 0; i < A13_MAX_CPU; i++) { /* source */
-        for (j = 0; j < A13_MAX_CPU; j++) { /* target */
-            if (c->cpus[j] && c->noWakeIPI[i][j] &&
-                !apple_a13_cpu_is_sleep(c->cpus[j]) &&
-                !apple_a13_cpu_is_powered_off(c->cpus[j])) {
-                apple_a13_cluster_deliver_ipi(c, j, i, IPI_RR_TYPE_NOWAKE);
-                break;
+        if (c->noWakeIPI[j] && !apple_a13_cpu_is_sleep(c->cpus[j]) &&
+            !apple_a13_cpu_is_powered_off(c->cpus[j])) {
+            src = ctz32(c->noWakeIPI[j]);
+            if (apple_a13_cluster_deliver_ipi(c, j, src, IPI_RR_TYPE_NOWAKE)) {
+                c->noWakeIPI[j] &= ~(1 << src);
             }
         }
+
+        if ((c->noWakeIPI[j] && !apple_a13_cpu_is_parked(c->cpus[j])) ||
+            (c->deferredIPI[j] && c->deferred_deadline[j] <= now)) {
+            next = MIN(next, now + (int64_t)ipi_cr);
+        }
     }
+
+    return next;
 }
 
 static void apple_a13_cluster_ipicr_tick(void *opaque)
 {
     AppleA13Cluster *cluster;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t next = INT64_MAX;
+
+    trace_apple_a13_ipicr_tick();
     QTAILQ_FOREACH (cluster, &clusters, next) {
-        apple_a13_cluster_tick(cluster);
+        next = MIN(next, apple_a13_cluster_tick(cluster, now));
+    }
+
+    if (next != INT64_MAX) {
+        apple_deadline_mod(&ipicr_deadline, next);
     }
+}
 
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
+static void apple_a13_cluster_nowake_bh(void *opaque)
+{
+    apple_a13_cluster_ipicr_tick(opaque);
 }
 
 
+/* Only armed while a deferred or no-wake IPI is queued */
 static void apple_a13_cluster_reset_handler(void *opaque)
 {
-    if (ipicr_timer) {
-        timer_del(ipicr_timer);
-        ipicr_timer = NULL;
+    if (ipicr_deadline.sched) {
+        apple_deadline_del(&ipicr_deadline);
     }
-    ipicr_timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_a13_cluster_ipicr_tick, NULL);
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
-                                  kDeferredIPITimerDefault);
 }
 
 static void apple_a13_cluster_instance_init(Object *obj)
@@ -301,8 +618,9 @@ static void apple_a13_cluster_instance_init(Object *obj)
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(obj);
     QTAILQ_INSERT_TAIL(&clusters, cluster, next);
 
-    if (ipicr_timer == NULL) {
+    if (nowake_bh == NULL) {
         qemu_register_reset(apple_a13_cluster_reset_handler, NULL);
+        nowake_bh = qemu_bh_new(apple_a13_cluster_nowake_bh, NULL);
     }
 }
 
@@ -314,41 +632,32 @@ static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
 
     uint32_t phys_id = (value & 0xff) | (tcpu->cluster_id << 8);
     AppleA13Cluster *c = apple_a13_find_cluster(tcpu->cluster_id);
-    uint32_t cpu_id = -1;
-    int i;
-
-    for (i = 0; i < A13_MAX_CPU; i++) {
-        if (c->cpus[i]) {
-            if (c->cpus[i]->phys_id == phys_id) {
-                cpu_id = i;
-                break;
-            }
-        }
-    }
+    AppleA13State *target = c ? apple_a13_find_cpu(c, phys_id) : NULL;
+    uint32_t cpu_id;
 
-    if (cpu_id == -1 || c->cpus[cpu_id] == NULL) {
+    if (target == NULL) {
         qemu_log_mask(LOG_GUEST_ERROR,
                       "CPU %x failed to send fast IPI to local CPU %x: value: "
                       "0x" HWADDR_FMT_plx "\n",
                       tcpu->phys_id, phys_id, value);
         return;
     }
+    cpu_id = target->cpu_id;
 
     switch (value & IPI_RR_TYPE_MASK) {
     case IPI_RR_TYPE_NOWAKE:
         if (apple_a13_cpu_is_sleep(c->cpus[cpu_id])) {
-            c->noWakeIPI[tcpu->cpu_id][cpu_id] = 1;
+            apple_a13_cluster_nowake_ipi(c, cpu_id, tcpu->cpu_id);
         } else {
             apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
                                           IPI_RR_TYPE_IMMEDIATE);
         }
         break;
     case IPI_RR_TYPE_DEFERRED:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 1;
+        apple_a13_cluster_defer_ipi(c, cpu_id, tcpu->cpu_id);
         break;
     case IPI_RR_TYPE_RETRACT:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 0;
-        c->noWakeIPI[tcpu->cpu_id][cpu_id] = 0;
+        apple_a13_cluster_retract_ipi(c, cpu_id, tcpu->cpu_id);
         break;
     case IPI_RR_TYPE_IMMEDIATE:
         apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
@@ -373,42 +682,32 @@ static void apple_a13_ipi_rr_global(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 
     uint32_t phys_id = (value & 0xff) | (cluster_id << 8);
-    uint32_t cpu_id = -1;
-    int i;
-
-    for (i = 0; i < A13_MAX_CPU; i++) {
-        if (c->cpus[i] == NULL) {
-            continue;
-        }
-        if (c->cpus[i]->phys_id == phys_id) {
-            cpu_id = i;
-            break;
-        }
-    }
+    AppleA13State *target = apple_a13_find_cpu(c, phys_id);
+    uint32_t cpu_id;
 
-    if (cpu_id == -1 || c->cpus[cpu_id] == NULL) {
+    if (target == NULL) {
         qemu_log_mask(LOG_GUEST_ERROR,
                       "CPU %x failed to send fast IPI to global CPU %x: value: "
                       "0x" HWADDR_FMT_plx "\n",
                       tcpu->phys_id, phys_id, value);
         return;
     }
+    cpu_id = target->cpu_id;
 
     switch (value & IPI_RR_TYPE_MASK) {
     case IPI_RR_TYPE_NOWAKE:
         if (apple_a13_cpu_is_sleep(c->cpus[cpu_id])) {
-            c->noWakeIPI[tcpu->cpu_id][cpu_id] = 1;
+            apple_a13_cluster_nowake_ipi(c, cpu_id, tcpu->cpu_id);
         } else {
             apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
                                           IPI_RR_TYPE_IMMEDIATE);
         }
         break;
     case IPI_RR_TYPE_DEFERRED:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 1;
+        apple_a13_cluster_defer_ipi(c, cpu_id, tcpu->cpu_id);
         break;
     case IPI_RR_TYPE_RETRACT:
-        c->deferredIPI[tcpu->cpu_id][cpu_id] = 0;
-        c->noWakeIPI[tcpu->cpu_id][cpu_id] = 0;
+        apple_a13_cluster_retract_ipi(c, cpu_id, tcpu->cpu_id);
         break;
     case IPI_RR_TYPE_IMMEDIATE:
         apple_a13_cluster_deliver_ipi(c, cpu_id, tcpu->cpu_id,
@@ -426,7 +725,7 @@ static uint64_t apple_a13_ipi_read_sr(CPUARMState *env, const ARMCPRegInfo *ri)
     AppleA13State *tcpu = APPLE_A13(env_archcpu(env));
 
     g_assert_cmphex(env_archcpu(env)->mp_affinity, ==, tcpu->mpidr);
-    return tcpu->ipi_sr;
+    return qatomic_read(&tcpu->ipi_sr);
 }
 
 /* Acknowledge received IPI */
@@ -437,19 +736,37 @@ static void apple_a13_ipi_write_sr(CPUARMState *env, const ARMCPRegInfo *ri,
     AppleA13Cluster *c = apple_a13_find_cluster(tcpu->cluster_id);
     uint64_t src_cpu = IPI_SR_SRC_CPU(value);
 
-    tcpu->ipi_sr = 0;
+    qatomic_set(&tcpu->ipi_sr, 0);
     qemu_irq_lower(tcpu->fast_ipi);
 
+    if (src_cpu >= A13_MAX_CPU) {
+        return;
+    }
+
     switch (value & IPI_RR_TYPE_MASK) {
     case IPI_RR_TYPE_NOWAKE:
-        c->noWakeIPI[src_cpu][tcpu->cpu_id] = 0;
+        c->noWakeIPI[tcpu->cpu_id] &= ~(1 << src_cpu);
         break;
     case IPI_RR_TYPE_DEFERRED:
-        c->deferredIPI[src_cpu][tcpu->cpu_id] = 0;
+        c->deferredIPI[tcpu->cpu_id] &= ~(1 << src_cpu);
         break;
     default:
         break;
     }
+
+    /* Anything that queued up behind this IPI can go out now */
+    if (c->deferredIPI[tcpu->cpu_id] || c->noWakeIPI[tcpu->cpu_id]) {
+        apple_a13_ipicr_kick(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+}
+
+/* IPI_SR is not ARM_CP_IO so that reads stay lock-free */
+static void apple_a13_ipi_write_sr_locked(CPUARMState *env,
+                                          const ARMCPRegInfo *ri,
+                                          uint64_t value)
+{
+    BQL_LOCK_GUARD();
+    apple_a13_ipi_write_sr(env, ri, value);
 }
 
 /* Read deferred interrupt timeout (global) */
@@ -469,13 +786,10 @@ static void apple_a13_ipi_write_cr(CPUARMState *env, const ARMCPRegInfo *ri,
 
     absolutetime_to_nanoseconds(value, &nanosec);
 
-    uint64_t ct;
+    if (nanosec == 0)
+        nanosec = kDeferredIPITimerDefault;
 
-    if (value == 0)
-        value = kDeferredIPITimerDefault;
-
-    ct = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    timer_mod_ns(ipicr_timer, (ct / ipi_cr) * ipi_cr + nanosec);
+    /* Applies to IPIs deferred from now on, queued ones keep their deadline */
     ipi_cr = nanosec;
 }
 
@@ -500,14 +814,36 @@ static const ARMCPRegInfo apple_a13_cp_reginfo_tcg[] = {
     A13_CPREG_DEF(IMP_BARRIER_LBSY_BST_SYNC_W1_EL0, 3, 3, 15, 15, 1, PL1_RW, 0),
     A13_CPREG_DEF(ARM64_REG_3_3_15_7, 3, 3, 15, 7, 0, PL1_RW,
                   0x8000000000332211ULL),
-    A13_CPREG_DEF(PMC0, 3, 2, 15, 0, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMC1, 3, 2, 15, 1, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMCR0, 3, 1, 15, 0, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMCR1, 3, 1, 15, 1, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMSR, 3, 1, 15, 13, 0, PL1_RW, 0),
+    A13_PMC_DEF(PMC0, 2, 0, PL0_RW, pmc[0], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC1, 2, 1, PL0_RW, pmc[1], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC2, 2, 2, PL0_RW, pmc[2], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC3, 2, 3, PL0_RW, pmc[3], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC4, 2, 4, PL0_RW, pmc[4], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC5, 2, 5, PL0_RW, pmc[5], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC6, 2, 6, PL0_RW, pmc[6], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC7, 2, 7, PL0_RW, pmc[7], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC8, 2, 9, PL0_RW, pmc[8], apple_a13_pmc_write),
+    A13_PMC_DEF(PMC9, 2, 10, PL0_RW, pmc[9], apple_a13_pmc_write),
+    A13_PMC_DEF(PMCR0, 1, 0, PL1_RW, pmcr0, apple_a13_pmcr_write),
+    A13_PMC_DEF(PMCR1, 1, 1, PL1_RW, pmcr1, apple_a13_pmcr_write),
+    A13_PMC_DEF(PMESR0, 1, 5, PL1_RW, pmesr[0], apple_a13_pmcr_write),
+    A13_PMC_DEF(PMESR1, 1, 6, PL1_RW, pmesr[1], apple_a13_pmcr_write),
+    A13_PMC_DEF(PMSR, 1, 13, PL1_RW, pmsr, apple_a13_pmcr_write),
     A13_CPREG_DEF(S3_4_c15_c0_5, 3, 4, 15, 0, 5, PL1_RW, 0),
     A13_CPREG_DEF(AMX_STATUS_EL1, 3, 4, 15, 1, 3, PL1_R, 0),
-    A13_CPREG_DEF(AMX_CTL_EL1, 3, 4, 15, 1, 4, PL1_RW, 0),
+    {
+        .cp = CP_REG_ARM64_SYSREG_CP,
+        .name = "AMX_CTL_EL1",
+        .opc0 = 3,
+        .opc1 = 4,
+        .crn = 15,
+        .crm = 1,
+        .opc2 = 4,
+        .access = PL1_RW,
+        .state = ARM_CP_STATE_AA64,
+        .type = ARM_CP_OVERRIDE,
+        .fieldoffset = offsetof(CPUARMState, amx.ctl),
+    },
     A13_CPREG_DEF(ARM64_REG_CYC_OVRD, 3, 5, 15, 5, 0, PL1_RW, 0),
     A13_CPREG_DEF(ARM64_REG_ACC_CFG, 3, 5, 15, 4, 0, PL1_RW, 0),
     A13_CPREG_DEF(S3_5_c15_c10_1, 3, 5, 15, 10, 1, PL0_RW, 0),
@@ -557,10 +893,10 @@ static const ARMCPRegInfo apple_a13_cp_reginfo_tcg[] = {
         .crm = 1,
         .opc2 = 1,
         .access = PL1_RW,
-        .type = ARM_CP_IO | ARM_CP_NO_RAW,
+        .type = ARM_CP_NO_RAW,
         .state = ARM_CP_STATE_AA64,
         .readfn = apple_a13_ipi_read_sr,
-        .writefn = apple_a13_ipi_write_sr,
+        .writefn = apple_a13_ipi_write_sr_locked,
     },
     {
         .cp = CP_REG_ARM64_SYSREG_CP,
@@ -578,11 +914,19 @@ static const ARMCPRegInfo apple_a13_cp_reginfo_tcg[] = {
     },
 };
 
+/*
+ * With a hardware accelerator the implementation-defined registers trap
+ * to the accelerator, which looks them up in cp_regs just like TCG does,
+ * so they are registered either way. GXF and SPRR cannot be provided to a
+ * hardware-virtualised guest and are only set up under TCG.
+ */
 static void apple_a13_add_cpregs(AppleA13State *tcpu)
 {
     ARMCPU *cpu = ARM_CPU(tcpu);
     define_arm_cp_regs(cpu, apple_a13_cp_reginfo_tcg);
-    apple_a13_init_gxf(tcpu);
+    if (tcg_enabled()) {
+        apple_a13_init_gxf(tcpu);
+    }
 }
 
 static void apple_a13_realize(DeviceState *dev, Error **errp)
@@ -598,11 +942,32 @@ static void apple_a13_realize(DeviceState *dev, Error **errp)
         return;
     }
     apple_a13_add_cpregs(tcpu);
+#if !HOST_BIG_ENDIAN
+    /* The AMX helpers view their registers as host vectors. */
+    if (tcg_enabled()) {
+        set_feature(&ARM_CPU(tcpu)->env, ARM_FEATURE_AMX);
+    }
+#endif
+    if (tcg_enabled()) {
+        set_feature(&ARM_CPU(tcpu)->env, ARM_FEATURE_APPLE_PMC);
+    }
+    apple_core_init_features(ARM_CPU(tcpu));
     tclass->parent_realize(dev, errp);
     if (*errp) {
         return;
     }
-    apple_a13_init_gxf_override(tcpu);
+    apple_hypercall_attach(ARM_CPU(tcpu));
+    if (tcg_enabled()) {
+        apple_a13_init_gxf_override(tcpu);
+        if (!icount_enabled()) {
+            ARMCPU *cpu = ARM_CPU(tcpu);
+
+            apple_a13_cnt_init(NANOSECONDS_PER_SECOND > cpu->gt_cntfrq_hz ?
+                                   NANOSECONDS_PER_SECOND / cpu->gt_cntfrq_hz :
+                                   1);
+            define_arm_cp_regs(cpu, apple_a13_cnt_override_reginfo);
+        }
+    }
     fiq_or = qdev_new(TYPE_OR_IRQ);
     object_property_add_child(obj, "fiq-or", OBJECT(fiq_or));
     qdev_prop_set_uint16(fiq_or, "num-lines", 16);
@@ -614,12 +979,18 @@ static void apple_a13_realize(DeviceState *dev, Error **errp)
 
     qdev_connect_gpio_out(dev, GTIMER_VIRT, qdev_get_gpio_in(fiq_or, 0));
     tcpu->fast_ipi = qdev_get_gpio_in(fiq_or, 1);
+    ARM_CPU(tcpu)->apple_pmi = qdev_get_gpio_in(fiq_or, 2);
 }
 
 static void apple_a13_reset(DeviceState *dev)
 {
     AppleA13Class *tclass = APPLE_A13_GET_CLASS(dev);
+    AppleA13State *tcpu = APPLE_A13(dev);
+
     tclass->parent_reset(dev);
+    /* The counters were cleared, so is their PMI */
+    qemu_irq_lower(ARM_CPU(tcpu)->apple_pmi);
+    apple_core_reset(ARM_CPU(tcpu), &tcpu->reset_clean);
 }
 
 static void apple_a13_instance_init(Object *obj)
@@ -682,6 +1053,7 @@ AppleA13State *apple_a13_cpu_create(DTBNode *node, char *name, uint32_t cpu_id,
         prop = find_dtb_prop(node, "cluster-type");
         cluster_type = *prop->value;
     }
+    tcpu->cluster_type = cluster_type;
     switch (cluster_type) {
     case 'P': // Lightning
         tcpu->mpidr |= (1 << ARM_AFF2_SHIFT);
@@ -719,7 +1091,9 @@ AppleA13State *apple_a13_cpu_create(DTBNode *node, char *name, uint32_t cpu_id,
     }
 
     // QARMA is too slow
-    object_property_set_bool(obj, "pauth-impdef", true, NULL);
+    if (tcg_enabled()) {
+        object_property_set_bool(obj, "pauth-impdef", true, NULL);
+    }
 
     // Need to set the CPU frequencies instead of iBoot
     if (node) {
@@ -786,10 +1160,19 @@ static Property apple_a13_cluster_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int apple_a13_post_load(void *opaque, int version_id)
+{
+    AppleA13State *tcpu = APPLE_A13(opaque);
+
+    apple_core_post_load(&tcpu->reset_clean);
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_a13 = {
     .name = "apple_a13",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_a13_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_A13_CPREG(ARM64_REG_EHID3),
@@ -808,14 +1191,14 @@ static const VMStateDescription vmstate_apple_a13 = {
             VMSTATE_A13_CPREG(ARM64_REG_HID14),
             VMSTATE_A13_CPREG(ARM64_REG_HID16),
             VMSTATE_A13_CPREG(ARM64_REG_LSU_ERR_STS),
-            VMSTATE_A13_CPREG(PMC0),
-            VMSTATE_A13_CPREG(PMC1),
-            VMSTATE_A13_CPREG(PMCR0),
-            VMSTATE_A13_CPREG(PMCR1),
-            VMSTATE_A13_CPREG(PMSR),
+            VMSTATE_UINT64(env.apple_pmc.pmc[0], ARMCPU),
+            VMSTATE_UINT64(env.apple_pmc.pmc[1], ARMCPU),
+            VMSTATE_UINT64(env.apple_pmc.pmcr0, ARMCPU),
+            VMSTATE_UINT64(env.apple_pmc.pmcr1, ARMCPU),
+            VMSTATE_UINT64(env.apple_pmc.pmsr, ARMCPU),
             VMSTATE_A13_CPREG(S3_4_c15_c0_5),
             VMSTATE_A13_CPREG(AMX_STATUS_EL1),
-            VMSTATE_A13_CPREG(AMX_CTL_EL1),
+            VMSTATE_UINT64(env.amx.ctl, ARMCPU),
             VMSTATE_A13_CPREG(ARM64_REG_CYC_OVRD),
             VMSTATE_A13_CPREG(ARM64_REG_ACC_CFG),
             VMSTATE_A13_CPREG(S3_5_c15_c10_1),
@@ -830,16 +1213,25 @@ static const VMStateDescription vmstate_apple_a13 = {
 
 static const VMStateDescription vmstate_apple_a13_cluster = {
     .name = "apple_a13_cluster",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .pre_save = apple_a13_cluster_pre_save,
     .post_load = apple_a13_cluster_post_load,
     .fields =
         (VMStateField[]){
-            VMSTATE_UINT32_2DARRAY(deferredIPI, AppleA13Cluster, A13_MAX_CPU,
-                                   A13_MAX_CPU),
-            VMSTATE_UINT32_2DARRAY(noWakeIPI, AppleA13Cluster, A13_MAX_CPU,
-                                   A13_MAX_CPU),
+            VMSTATE_ARRAY_TEST(v1_deferredIPI, AppleA13Cluster,
+                               A13_MAX_CPU * A13_MAX_CPU,
+                               apple_a13_cluster_is_v1, vmstate_info_uint32,
+                               uint32_t),
+            VMSTATE_ARRAY_TEST(v1_noWakeIPI, AppleA13Cluster,
+                               A13_MAX_CPU * A13_MAX_CPU,
+                               apple_a13_cluster_is_v1, vmstate_info_uint32,
+                               uint32_t),
+            VMSTATE_UINT32_ARRAY_V(deferredIPI, AppleA13Cluster, A13_MAX_CPU,
+                                   2),
+            VMSTATE_UINT32_ARRAY_V(noWakeIPI, AppleA13Cluster, A13_MAX_CPU, 2),
+            VMSTATE_INT64_ARRAY_V(deferred_deadline, AppleA13Cluster,
+                                  A13_MAX_CPU, 2),
             VMSTATE_UINT64(tick, AppleA13Cluster),
             VMSTATE_UINT64(ipi_cr, AppleA13Cluster),
             VMSTATE_A13_CLUSTER_CPREG(CTRR_A_LWR_EL1),
@@ -852,13 +1244,36 @@ static const VMStateDescription vmstate_apple_a13_cluster = {
         }
 };
 
+/*
+ * Called from the vCPU thread without the BQL, so it only peeks at the
+ * no-wake queue and leaves the delivery to the bottom half.
+ */
+static bool apple_a13_has_work(CPUState *cs)
+{
+    AppleA13State *tcpu = APPLE_A13(cs);
+    AppleA13Class *tc = APPLE_A13_GET_CLASS(tcpu);
+    AppleA13Cluster *c;
+    bool ret = tc->parent_has_work(cs);
+
+    if (ret && nowake_bh) {
+        c = apple_a13_find_cluster(tcpu->cluster_id);
+        if (c && qatomic_read(&c->noWakeIPI[tcpu->cpu_id])) {
+            qemu_bh_schedule(nowake_bh);
+        }
+    }
+    return ret;
+}
+
 static void apple_a13_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    CPUClass *cc = CPU_CLASS(klass);
     AppleA13Class *tc = APPLE_A13_CLASS(klass);
 
     device_class_set_parent_realize(dc, apple_a13_realize, &tc->parent_realize);
     device_class_set_parent_reset(dc, apple_a13_reset, &tc->parent_reset);
+    tc->parent_has_work = cc->has_work;
+    cc->has_work = apple_a13_has_work;
     dc->desc = "Apple A13 CPU";
     dc->vmsd = &vmstate_apple_a13;
     set_bit(DEVICE_CATEGORY_CPU, dc->categories);
@@ -6,15 +6,6 @@
 #include "target/arm/cpu.h"
 #include "target/arm/internals.h"
 
-static CPAccessResult access_gxf(CPUARMState *env, const ARMCPRegInfo *ri,
-                                 bool isread)
-{
-    if (arm_is_guarded(env)) {
-        return CP_ACCESS_OK;
-    }
-    return CP_ACCESS_TRAP;
-}
-
 static uint64_t tpidr_el1_read(CPUARMState *env, const ARMCPRegInfo *ri)
 {
     if (arm_is_guarded(env)) {
@@ -134,13 +125,34 @@ static void far_el1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+/*
+ * A TLB entry with fewer permissions than the page now has just misses
+ * and gets refilled, so only permissions that were taken away require
+ * cached translations to be dropped.
+ */
+static bool sprr_prot_revoked(const uint8_t old_prot[2][16],
+                              const uint8_t new_prot[2][16])
+{
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 16; j++) {
+            if (old_prot[i][j] & ~new_prot[i][j]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                 uint64_t value)
 {
     uint64_t perm = raw_read(env, ri);
     uint32_t mask = env->sprr.mprr_el_br_el1[0][0];
+    uint8_t old_prot[2][16];
+
     if (arm_current_el(env)) {
         raw_write(env, ri, value);
+        arm_sprr_update_prot_lut(env, 0);
         return;
     }
 
@@ -159,9 +171,28 @@ static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
         perm |= result_perm << APRR_SHIFT_FOR_IDX(i);
     }
 
+    if (perm == raw_read(env, ri)) {
+        return;
+    }
+
+    if (env->sprr.prot_lut_key[0] != raw_read(env, ri)) {
+        arm_sprr_update_prot_lut(env, 0);
+    }
+    memcpy(old_prot, env->sprr.prot_lut[0], sizeof(old_prot));
+
     raw_write(env, ri, perm);
+    arm_sprr_update_prot_lut(env, 0);
 
-    tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+    if (sprr_prot_revoked(old_prot, env->sprr.prot_lut[0])) {
+        tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+    }
+}
+
+static void sprr_perm_el1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                uint64_t value)
+{
+    raw_write(env, ri, value);
+    arm_sprr_update_prot_lut(env, 1);
 }
 
 static uint64_t gxf_cpreg_raw_read(CPUARMState *env, const ARMCPRegInfo *ri)
@@ -344,7 +375,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 8,
         .opc2 = 3,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .resetvalue = 0,
         .fieldoffset = offsetof(CPUARMState, gxf.aspsr_gl[1]),
     },
@@ -358,7 +389,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 0,
         .access = PL2_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.sp_gl[1]),
@@ -374,7 +405,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 1,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.tpidr_gl[1]),
@@ -390,7 +421,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 2,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.vbar_gl[1]),
@@ -406,7 +437,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 3,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.spsr_gl[1]),
@@ -422,7 +453,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 5,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.esr_gl[1]),
@@ -438,7 +469,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 6,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.elr_gl[1]),
@@ -454,7 +485,7 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .crm = 9,
         .opc2 = 7,
         .access = PL1_RW,
-        .accessfn = access_gxf,
+        .type = ARM_CP_GXF,
         .raw_readfn = gxf_cpreg_raw_read,
         .raw_writefn = gxf_cpreg_raw_write,
         .bank_fieldoffsets = { offsetof(CPUARMState, gxf.far_gl[1]),
@@ -473,8 +504,6 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .opc2 = 0,
         .access = PL1_RW,
         .resetvalue = 0,
-        .readfn = raw_read,
-        .writefn = raw_write,
         .fieldoffset = offsetof(CPUARMState, sprr.sprr_config_el[1]),
     },
     {
@@ -488,8 +517,6 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .opc2 = 1,
         .access = PL1_RW,
         .resetvalue = 0,
-        .readfn = raw_read,
-        .writefn = raw_write,
         .fieldoffset = offsetof(CPUARMState, sprr.sprr_config_el[0]),
     },
     {
@@ -503,7 +530,6 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .opc2 = 5,
         .access = PL0_RW,
         .resetvalue = 0,
-        .readfn = raw_read,
         .writefn = sprr_perm_el0_write,
         .raw_writefn = raw_write,
         .fieldoffset = offsetof(CPUARMState, sprr.sprr_el_br_el1[0][0]),
@@ -545,8 +571,8 @@ static const ARMCPRegInfo apple_a13_gxf_cp_reginfo[] = {
         .opc2 = 0,
         .access = PL1_RW,
         .resetvalue = 0,
-        .readfn = raw_read,
-        .writefn = raw_write,
+        .writefn = sprr_perm_el1_write,
+        .raw_writefn = raw_write,
         .fieldoffset = offsetof(CPUARMState, sprr.sprr_el_br_el1[1][1]),
     },
     {
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "exec/address-spaces.h"
 #include "hw/arm/apple-silicon/a9.h"
+#include "hw/arm/apple-silicon/core.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/or-irq.h"
 #include "hw/qdev-properties.h"
@@ -44,27 +45,24 @@
                        offsetof(ARMCPU, env),                                  \
     }
 
-inline bool apple_a9_cpu_is_sleep(AppleA9State *tcpu)
+bool apple_a9_cpu_is_sleep(AppleA9State *tcpu)
 {
-    return CPU(tcpu)->halted;
+    return apple_core_is_sleep(ARM_CPU(tcpu));
 }
 
-inline bool apple_a9_cpu_is_powered_off(AppleA9State *tcpu)
+bool apple_a9_cpu_is_powered_off(AppleA9State *tcpu)
 {
-    return ARM_CPU(tcpu)->power_state == PSCI_OFF;
+    return apple_core_is_powered_off(ARM_CPU(tcpu));
 }
 
 void apple_a9_cpu_start(AppleA9State *tcpu)
 {
-    int ret = QEMU_ARM_POWERCTL_RET_SUCCESS;
-
-    if (ARM_CPU(tcpu)->power_state != PSCI_ON) {
-        ret = arm_set_cpu_on_and_reset(tcpu->mpidr);
-    }
+    apple_core_start(ARM_CPU(tcpu), &tcpu->reset_clean);
+}
 
-    if (ret != QEMU_ARM_POWERCTL_RET_SUCCESS) {
-        error_report("Failed to bring up CPU %d: err %d", tcpu->cpu_id, ret);
-    }
+void apple_a9_cpu_off(AppleA9State *tcpu)
+{
+    apple_core_off(ARM_CPU(tcpu));
 }
 
 static const ARMCPRegInfo a9_cp_reginfo_tcg[] = {
@@ -120,6 +118,7 @@ static void apple_a9_realize(DeviceState *dev, Error **errp)
         return;
     }
     a9_add_cpregs(tcpu);
+    apple_core_init_features(ARM_CPU(tcpu));
     tclass->parent_realize(dev, errp);
     if (*errp) {
         return;
@@ -139,7 +138,10 @@ static void apple_a9_realize(DeviceState *dev, Error **errp)
 static void apple_a9_reset(DeviceState *dev)
 {
     AppleA9Class *tclass = APPLE_A9_GET_CLASS(dev);
+    AppleA9State *tcpu = APPLE_A9(dev);
+
     tclass->parent_reset(dev);
+    apple_core_reset(ARM_CPU(tcpu), &tcpu->reset_clean);
 }
 
 static void apple_a9_instance_init(Object *obj)
@@ -270,10 +272,19 @@ static Property apple_a9_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int apple_a9_post_load(void *opaque, int version_id)
+{
+    AppleA9State *tcpu = APPLE_A9(opaque);
+
+    apple_core_post_load(&tcpu->reset_clean);
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_a9 = {
     .name = "apple_a9",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_a9_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_A9_CPREG(HID11),       VMSTATE_A9_CPREG(HID3),
@@ -26,14 +26,21 @@
 #include "exec/memory.h"
 #include "hw/arm/apple-silicon/boot.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/hypercall.h"
 #include "hw/arm/apple-silicon/mem.h"
 #include "qapi/error.h"
+#include "qapi/qapi-events-machine.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/guest-random.h"
-#include "img4.h"
+#include "qemu/lockable.h"
+#include "qemu/timer.h"
+#include "sysemu/cpu-timers.h"
+#include "sysemu/runstate.h"
+#include "sysemu/sysemu.h"
 #include "lzfse.h"
 #include "lzss.h"
+#include "trace.h"
 
 static const char *KEEP_COMP[] = {
     "adbe0,s8000\0$",
@@ -123,13 +130,75 @@ static const char *REM_PROPS[] = {
     "soc-tuning",
 };
 
+static bool guest_ram_equals(AddressSpace *as, hwaddr pa, const void *buf,
+                             hwaddr size)
+{
+    MemoryRegionSection section;
+    bool ret = false;
+
+    section = memory_region_find(as->root, pa, size);
+    if (section.mr == NULL) {
+        return false;
+    }
+
+    if (memory_region_is_ram(section.mr) &&
+        int128_get64(section.size) >= size) {
+        ret = memcmp((uint8_t *)memory_region_get_ram_ptr(section.mr) +
+                         section.offset_within_region,
+                     buf, size) == 0;
+    }
+
+    memory_region_unref(section.mr);
+    return ret;
+}
+
+/*
+ * Writing to guest RAM invalidates every translation block made from it, so
+ * an image that is already in place (the same kernel reloaded on reboot with
+ * a fixed layout) is not written again and its translations stay valid.
+ */
 static void allocate_and_copy(MemoryRegion *mem, AddressSpace *as,
                               const char *name, hwaddr pa, hwaddr size,
                               void *buf)
 {
+    if (guest_ram_equals(as, pa, buf, size)) {
+        return;
+    }
     address_space_rw(as, pa, MEMTXATTRS_UNSPECIFIED, buf, size, 1);
 }
 
+#ifdef CONFIG_POSIX
+/*
+ * Written aside and renamed into place, so concurrent boots never read a
+ * partially written image. The file is extended to `size`.
+ */
+static bool private_image_write(const char *path, const uint8_t *data,
+                                uint64_t filesize, uint64_t size)
+{
+    g_autofree char *tmp_path = NULL;
+    Error *local_err = NULL;
+    int fd;
+
+    tmp_path = g_strdup_printf("%s.%d", path, getpid());
+    fd = qemu_create(tmp_path, O_WRONLY | O_TRUNC, 0644, &local_err);
+    if (fd < 0) {
+        warn_report_err(local_err);
+        return false;
+    }
+    if (qemu_write_full(fd, data, filesize) != filesize ||
+        ftruncate(fd, size) != 0 || rename(tmp_path, path) != 0) {
+        warn_report("Could not write image '%s': %s", path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+    close(fd);
+
+    return true;
+}
+#endif
+
+
 static void *srawmemchr(void *str, int chr)
 {
     uint8_t *ptr = (uint8_t *)str;
@@ -228,119 +297,371 @@ static void macho_dtb_node_process(DTBNode *node, DTBNode *parent)
 }
 
 /*
- * \param payload_type must be at least 4 bytes long
+ * Reads one DER tag-length-value header at `*pos`. Only the single-byte tags
+ * used by IM4P are supported. On success `*pos` points past the header.
  */
-static void extract_im4p_payload(const char *filename, char *payload_type,
-                                 uint8_t **data, uint32_t *length,
-                                 uint8_t **secure_monitor)
-{
-    uint8_t *file_data;
-    unsigned long fsize;
-    char errorDescription[ASN1_MAX_ERROR_DESCRIPTION_SIZE];
-    asn1_node img4_definitions = NULL;
-    asn1_node img4;
-    int ret;
+static bool der_read_header(const uint8_t *buf, size_t size, size_t *pos,
+                            uint8_t *tag, size_t *len)
+{
+    size_t off = *pos;
+    size_t value_len;
+    uint8_t n;
+
+    if (size < 2 || off > size - 2) {
+        return false;
+    }
+
+    *tag = buf[off++];
+    value_len = buf[off++];
+    if (value_len & 0x80) {
+        n = value_len & 0x7F;
+        if (n == 0 || n > sizeof(size_t) || n > size - off) {
+            return false;
+        }
+        value_len = 0;
+        while (n--) {
+            value_len = (value_len << 8) | buf[off++];
+        }
+    }
+
+    if (value_len > size - off) {
+        return false;
+    }
+
+    *pos = off;
+    *len = value_len;
+    return true;
+}
+
+/*
+ * Reads one DER value with the given tag, returning a pointer to it inside
+ * `buf` without copying.
+ */
+static bool der_read_value(const uint8_t *buf, size_t size, size_t *pos,
+                           uint8_t expected_tag, const uint8_t **value,
+                           size_t *len)
+{
+    uint8_t tag;
+
+    if (!der_read_header(buf, size, pos, &tag, len) || tag != expected_tag) {
+        return false;
+    }
+
+    *value = buf + *pos;
+    *pos += *len;
+    return true;
+}
+
+#define DER_TAG_OCTET_STRING (0x04)
+#define DER_TAG_IA5_STRING (0x16)
+#define DER_TAG_SEQUENCE (0x30)
+
+/*
+ * Optional on-disk cache of decompressed IM4P payloads, keyed by the SHA-256
+ * of the container file.
+ */
+static char *payload_cache_dir;
+
+typedef struct {
     char magic[4];
-    char description[128];
-    int len;
-    uint8_t *payload_data;
+    char type[4];
+    uint32_t data_length;
+    uint32_t monitor_length;
+} QEMU_PACKED PayloadCacheHeader;
 
-    if (!g_file_get_contents(filename, (gchar **)&file_data, &fsize, NULL)) {
-        error_report("Could not load data from file '%s'", filename);
-        exit(EXIT_FAILURE);
+#define PAYLOAD_CACHE_MAGIC "QPC1"
+
+void macho_set_payload_cache_dir(const char *dir)
+{
+    g_free(payload_cache_dir);
+    payload_cache_dir = g_strdup(dir);
+}
+
+static char *payload_cache_path(const uint8_t *file_data, size_t fsize)
+{
+    g_autofree char *digest = NULL;
+    Error *local_err = NULL;
+
+    if (qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, (const char *)file_data,
+                            fsize, &digest, &local_err) < 0) {
+        warn_report_err(local_err);
+        return NULL;
     }
 
-    if (asn1_array2tree(img4_definitions_array, &img4_definitions,
-                        errorDescription) != ASN1_SUCCESS) {
-        error_report("Could not initialize the ASN.1 parser: %s.",
-                     errorDescription);
-        exit(EXIT_FAILURE);
+    return g_strdup_printf("%s/%s.payload", payload_cache_dir, digest);
+}
+
+static bool payload_cache_load(const char *path, char *payload_type,
+                               uint8_t **data, uint32_t *length,
+                               uint8_t **secure_monitor)
+{
+    GMappedFile *mapped;
+    const uint8_t *cache_data;
+    const PayloadCacheHeader *hdr;
+    size_t size;
+    uint32_t data_length;
+    uint32_t monitor_length;
+
+    mapped = g_mapped_file_new(path, FALSE, NULL);
+    if (mapped == NULL) {
+        return false;
     }
 
-    ret = asn1_create_element(img4_definitions, "Img4.Img4Payload", &img4);
-    if (ret != ASN1_SUCCESS) {
-        error_report("Could not create an Img4Payload element: %d", ret);
-        exit(EXIT_FAILURE);
+    cache_data = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    size = g_mapped_file_get_length(mapped);
+    hdr = (const PayloadCacheHeader *)cache_data;
+    if (size < sizeof(*hdr) ||
+        memcmp(hdr->magic, PAYLOAD_CACHE_MAGIC, 4) != 0) {
+        g_mapped_file_unref(mapped);
+        return false;
+    }
+
+    data_length = le32_to_cpu(hdr->data_length);
+    monitor_length = le32_to_cpu(hdr->monitor_length);
+    if ((uint64_t)sizeof(*hdr) + data_length + monitor_length != size) {
+        g_mapped_file_unref(mapped);
+        return false;
     }
 
-    ret =
-        asn1_der_decoding(&img4, file_data, (uint32_t)fsize, errorDescription);
+    memcpy(payload_type, hdr->type, 4);
+    *data = g_memdup2(cache_data + sizeof(*hdr), data_length);
+    *length = data_length;
+    if (secure_monitor && monitor_length != 0) {
+        info_report("Found AP Secure Monitor in payload with size 0x%X!",
+                    monitor_length);
+        *secure_monitor =
+            g_memdup2(cache_data + sizeof(*hdr) + data_length, monitor_length);
+    }
 
-    if (ret != ASN1_SUCCESS) {
-        *data = file_data;
-        *length = (uint32_t)fsize;
-        strncpy(payload_type, "raw", 4);
-        asn1_delete_structure(&img4);
-        asn1_delete_structure(&img4_definitions);
+    g_mapped_file_unref(mapped);
+    return true;
+}
+
+static void payload_cache_store(const char *path, const char *payload_type,
+                                const uint8_t *data, uint32_t length,
+                                const uint8_t *monitor, uint32_t monitor_length)
+{
+    g_autoptr(GError) err = NULL;
+    g_autofree uint8_t *buf = NULL;
+    PayloadCacheHeader *hdr;
+    size_t size;
+
+    if (path == NULL) {
         return;
     }
 
-    len = 4;
-    ret = asn1_read_value(img4, "magic", magic, &len);
-    if (ret != ASN1_SUCCESS) {
-        error_report("Failed to read the im4p magic in file '%s': %d.",
-                     filename, ret);
-        exit(EXIT_FAILURE);
+    size = sizeof(*hdr) + length + monitor_length;
+    buf = g_malloc(size);
+    hdr = (PayloadCacheHeader *)buf;
+    memcpy(hdr->magic, PAYLOAD_CACHE_MAGIC, 4);
+    memcpy(hdr->type, payload_type, 4);
+    hdr->data_length = cpu_to_le32(length);
+    hdr->monitor_length = cpu_to_le32(monitor_length);
+    memcpy(buf + sizeof(*hdr), data, length);
+    if (monitor_length != 0) {
+        memcpy(buf + sizeof(*hdr) + length, monitor, monitor_length);
+    }
+
+    // g_file_set_contents writes to a temporary file and renames it, so
+    // concurrent boots never observe a partially written entry.
+    if (!g_file_set_contents(path, (const gchar *)buf, size, &err)) {
+        warn_report("Could not write payload cache entry '%s': %s", path,
+                    err->message);
+    }
+}
+
+/*
+ * Locates the payload of an IM4P container in place. Returns false if the
+ * file is not an IM4P container at all, in which case it is loaded raw.
+ *
+ * \param payload_type must be at least 4 bytes long
+ */
+static bool im4p_find_payload(const char *filename, const uint8_t *file_data,
+                              size_t fsize, char *payload_type,
+                              const uint8_t **payload, size_t *len)
+{
+    size_t pos = 0;
+    size_t end;
+    uint8_t tag;
+    const uint8_t *magic;
+    const uint8_t *type;
+    const uint8_t *description;
+
+    if (!der_read_header(file_data, fsize, &pos, &tag, &end) ||
+        tag != DER_TAG_SEQUENCE) {
+        return false;
     }
+    end += pos;
 
-    if (strncmp(magic, "IM4P", 4) != 0) {
+    if (!der_read_value(file_data, end, &pos, DER_TAG_IA5_STRING, &magic,
+                        len)) {
+        return false;
+    }
+
+    if (*len != 4 || memcmp(magic, "IM4P", 4) != 0) {
         error_report("Couldn't parse ASN.1 data in file '%s' because it "
                      "does not start with the IM4P header.",
                      filename);
         exit(EXIT_FAILURE);
     }
 
-    len = 4;
-    ret = asn1_read_value(img4, "type", payload_type, &len);
-    if (ret != ASN1_SUCCESS) {
-        error_report("Failed to read the im4p type in file '%s': %d.", filename,
-                     ret);
+    if (!der_read_value(file_data, end, &pos, DER_TAG_IA5_STRING, &type,
+                        len) ||
+        *len != 4) {
+        error_report("Failed to read the im4p type in file '%s'.", filename);
         exit(EXIT_FAILURE);
     }
+    memcpy(payload_type, type, 4);
 
-    len = 128;
-    ret = asn1_read_value(img4, "description", description, &len);
-    if (ret != ASN1_SUCCESS) {
-        error_report("Failed to read the im4p description in file '%s': %d.",
-                     filename, ret);
+    if (!der_read_value(file_data, end, &pos, DER_TAG_IA5_STRING,
+                        &description, len) ||
+        *len > 128) {
+        error_report("Failed to read the im4p description in file '%s'.",
+                     filename);
         exit(EXIT_FAILURE);
     }
 
-    payload_data = NULL;
-    len = 0;
-    ret = asn1_read_value(img4, "data", payload_data, &len);
-    if (ret != ASN1_MEM_ERROR) {
-        error_report("Failed to read the im4p payload in file '%s': %d.",
-                     filename, ret);
+    if (!der_read_value(file_data, end, &pos, DER_TAG_OCTET_STRING,
+                        payload, len)) {
+        error_report("Failed to read the im4p payload in file '%s'.",
+                     filename);
         exit(EXIT_FAILURE);
     }
 
-    payload_data = g_malloc0(len);
-    ret = asn1_read_value(img4, "data", payload_data, &len);
-    g_free(file_data);
+    return true;
+}
 
-    if (ret != ASN1_SUCCESS) {
-        error_report("Failed to read the im4p payload in file '%s': %d.",
-                     filename, ret);
-        exit(EXIT_FAILURE);
+static bool im4p_payload_is_compressed(const uint8_t *payload, size_t len)
+{
+    return (len >= 3 && memcmp(payload, "bvx", 3) == 0) ||
+           (len >= sizeof(LzssCompHeader) &&
+            memcmp(payload, "complzss", 8) == 0);
+}
+
+#define LZFSE_BLOCK_END 0x24787662 /* bvx$ */
+#define LZFSE_BLOCK_RAW 0x2d787662 /* bvx- */
+#define LZFSE_BLOCK_V1 0x31787662 /* bvx1 */
+#define LZFSE_BLOCK_V2 0x32787662 /* bvx2 */
+#define LZFSE_BLOCK_LZVN 0x6e787662 /* bvxn */
+
+#define LZFSE_BLOCK_V1_HEADER_SIZE (772)
+
+/*
+ * Walks the block headers of an LZFSE stream, which all carry the size of
+ * their decoded data, to size the output exactly. Returns false for a
+ * stream it does not understand or that is truncated.
+ *
+ * The blocks cannot be decoded separately, let alone in parallel: matches
+ * refer back to the output of earlier blocks.
+ */
+static bool lzfse_decoded_size(const uint8_t *src, size_t len, size_t *size)
+{
+    size_t pos = 0;
+    size_t total = 0;
+
+    while (len - pos >= 4) {
+        uint32_t magic = ldl_le_p(src + pos);
+        uint64_t block_len;
+
+        if (magic == LZFSE_BLOCK_END) {
+            *size = total;
+            return true;
+        }
+        if (len - pos < 8) {
+            return false;
+        }
+        total += ldl_le_p(src + pos + 4);
+
+        switch (magic) {
+        case LZFSE_BLOCK_RAW:
+            block_len = 8 + (uint64_t)ldl_le_p(src + pos + 4);
+            break;
+        case LZFSE_BLOCK_LZVN:
+            if (len - pos < 12) {
+                return false;
+            }
+            block_len = 12 + (uint64_t)ldl_le_p(src + pos + 8);
+            break;
+        case LZFSE_BLOCK_V1:
+            if (len - pos < 28) {
+                return false;
+            }
+            block_len = LZFSE_BLOCK_V1_HEADER_SIZE +
+                        (uint64_t)ldl_le_p(src + pos + 20) +
+                        ldl_le_p(src + pos + 24);
+            break;
+        case LZFSE_BLOCK_V2: {
+            uint64_t v0;
+            uint64_t v1;
+            uint64_t v2;
+
+            if (len - pos < 32) {
+                return false;
+            }
+            v0 = ldq_le_p(src + pos + 8);
+            v1 = ldq_le_p(src + pos + 16);
+            v2 = ldq_le_p(src + pos + 24);
+            block_len = extract64(v2, 0, 32) + extract64(v0, 20, 20) +
+                        extract64(v1, 40, 20);
+            break;
+        }
+        default:
+            return false;
+        }
+
+        if (block_len > len - pos) {
+            return false;
+        }
+        pos += block_len;
     }
 
-    asn1_delete_structure(&img4);
-    asn1_delete_structure(&img4_definitions);
+    return false;
+}
+
+/*
+ * Decompresses an LZFSE or LZSS payload into a new buffer. Anything after
+ * LZSS-compressed data is the AP secure monitor, returned in place.
+ */
+static void im4p_decompress_payload(const char *filename,
+                                    const uint8_t *payload_data, size_t len,
+                                    uint8_t **data, uint32_t *length,
+                                    const uint8_t **monitor,
+                                    size_t *monitor_size)
+{
+    *monitor = NULL;
+    *monitor_size = 0;
+
+    if (len >= 3 && memcmp(payload_data, "bvx", 3) == 0) {
+        size_t decode_buffer_size;
+        uint8_t *decode_buffer;
+        size_t decoded_length;
+        bool exact = lzfse_decoded_size(payload_data, len, &decode_buffer_size);
+
+        // Guess for streams the scan does not understand.
+        if (!exact) {
+            decode_buffer_size = len * 8;
+        }
+        if (decode_buffer_size > UINT32_MAX) {
+            error_report("LZFSE-compressed data in file '%s' is too large.",
+                         filename);
+            exit(EXIT_FAILURE);
+        }
+        decode_buffer = g_malloc(decode_buffer_size);
 
-    if (memcmp(payload_data, "bvx", 3) == 0) {
-        size_t decode_buffer_size = len * 8;
-        uint8_t *decode_buffer = g_malloc0(decode_buffer_size);
-        int decoded_length =
+        apple_boot_phase_begin("decompress");
+        decoded_length =
             lzfse_decode_buffer(decode_buffer, decode_buffer_size, payload_data,
                                 len, NULL /* scratch_buffer */);
-        g_free(payload_data);
+        apple_boot_phase_end("decompress");
 
-        if (decoded_length == 0 || decoded_length == decode_buffer_size) {
+        if (decoded_length == 0 ||
+            (exact ? decoded_length != decode_buffer_size :
+                     decoded_length == decode_buffer_size)) {
             error_report(
                 "Could not decompress LZFSE-compressed data in file '%s' "
-                "because the decode buffer was too small.",
-                filename);
+                "%s.",
+                filename,
+                exact ? "correctly" : "because the decode buffer was too small");
             exit(EXIT_FAILURE);
         }
 
@@ -349,13 +670,26 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
         return;
     }
 
-    if (memcmp(payload_data, "complzss", 8) == 0) {
-        LzssCompHeader *comp_hdr = (LzssCompHeader *)payload_data;
+    if (len >= sizeof(LzssCompHeader) &&
+        memcmp(payload_data, "complzss", 8) == 0) {
+        const LzssCompHeader *comp_hdr = (const LzssCompHeader *)payload_data;
         size_t uncompressed_size = be32_to_cpu(comp_hdr->uncompressed_size);
         size_t compressed_size = be32_to_cpu(comp_hdr->compressed_size);
-        uint8_t *decode_buffer = g_malloc0(uncompressed_size);
-        int decoded_length =
-            decompress_lzss(decode_buffer, comp_hdr->data, compressed_size);
+        size_t monitor_off = compressed_size + sizeof(LzssCompHeader);
+        uint8_t *decode_buffer;
+        int decoded_length;
+
+        if (monitor_off > len) {
+            error_report("LZSS-compressed data in file '%s' is truncated.",
+                         filename);
+            exit(EXIT_FAILURE);
+        }
+
+        decode_buffer = g_malloc(uncompressed_size);
+        apple_boot_phase_begin("decompress");
+        decoded_length = decompress_lzss(decode_buffer, uncompressed_size,
+                                         comp_hdr->data, compressed_size);
+        apple_boot_phase_end("decompress");
         if (decoded_length == 0 || decoded_length != uncompressed_size) {
             error_report("Could not decompress LZSS-compressed data in "
                          "file '%s' correctly.",
@@ -363,24 +697,108 @@ static void extract_im4p_payload(const char *filename, char *payload_type,
             exit(EXIT_FAILURE);
         }
 
-        size_t monitor_off = compressed_size + sizeof(LzssCompHeader);
-        if (secure_monitor && monitor_off < len) {
-            size_t monitor_size = len - monitor_off;
-            info_report("Found AP Secure Monitor in payload with size 0x%zX!",
-                        monitor_size);
-            *secure_monitor = g_malloc0(monitor_size);
-            memcpy(*secure_monitor, payload_data + monitor_off, monitor_size);
+        *monitor = payload_data + monitor_off;
+        *monitor_size = len - monitor_off;
+        *data = decode_buffer;
+        *length = decoded_length;
+        return;
+    }
+
+    g_assert_not_reached();
+}
+
+/*
+ * \param payload_type must be at least 4 bytes long
+ *
+ * The file is mapped rather than read, and the IM4P container is walked in
+ * place, so the payload is decompressed straight out of the page cache and
+ * only the decompressed output is allocated.
+ *
+ * An uncompressed payload is copied out of the mapping, unless `mapping` is
+ * given: then `data` points into the mapping, which is handed over in
+ * `mapping` for the caller to release. `mapping` is NULL whenever `data`
+ * was allocated.
+ */
+static void do_extract_im4p_payload(const char *filename, char *payload_type,
+                                    uint8_t **data, uint32_t *length,
+                                    uint8_t **secure_monitor,
+                                    GMappedFile **mapping)
+{
+    g_autoptr(GError) err = NULL;
+    GMappedFile *mapped;
+    const uint8_t *file_data;
+    size_t fsize;
+    const uint8_t *payload_data;
+    size_t len;
+    const uint8_t *monitor;
+    size_t monitor_size;
+    g_autofree char *cache_path = NULL;
+
+    mapped = g_mapped_file_new(filename, FALSE, &err);
+    if (mapped == NULL) {
+        error_report("Could not load data from file '%s': %s", filename,
+                     err->message);
+        exit(EXIT_FAILURE);
+    }
+
+    file_data = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    fsize = g_mapped_file_get_length(mapped);
+    if (mapping != NULL) {
+        *mapping = NULL;
+    }
+
+    if (payload_cache_dir != NULL) {
+        cache_path = payload_cache_path(file_data, fsize);
+        if (cache_path != NULL &&
+            payload_cache_load(cache_path, payload_type, data, length,
+                               secure_monitor)) {
+            g_mapped_file_unref(mapped);
+            return;
         }
+    }
 
-        g_free(payload_data);
+    if (!im4p_find_payload(filename, file_data, fsize, payload_type,
+                           &payload_data, &len)) {
+        payload_data = file_data;
+        len = fsize;
+        strncpy(payload_type, "raw", 4);
+    }
 
-        *data = decode_buffer;
-        *length = decoded_length;
+    if (!im4p_payload_is_compressed(payload_data, len)) {
+        *length = len;
+        if (mapping != NULL) {
+            *data = (uint8_t *)payload_data;
+            *mapping = mapped;
+            return;
+        }
+        *data = g_memdup2(payload_data, len);
+        g_mapped_file_unref(mapped);
         return;
     }
 
-    *data = payload_data;
-    *length = len;
+    im4p_decompress_payload(filename, payload_data, len, data, length,
+                            &monitor, &monitor_size);
+    if (secure_monitor && monitor_size != 0) {
+        info_report("Found AP Secure Monitor in payload with size 0x%zX!",
+                    monitor_size);
+        *secure_monitor = g_memdup2(monitor, monitor_size);
+    }
+
+    payload_cache_store(cache_path, payload_type, *data, *length, monitor,
+                        monitor_size);
+
+    g_mapped_file_unref(mapped);
+}
+
+static void extract_im4p_payload(const char *filename, char *payload_type,
+                                 uint8_t **data, uint32_t *length,
+                                 uint8_t **secure_monitor,
+                                 GMappedFile **mapping)
+{
+    apple_boot_phase_begin("extract_im4p_payload");
+    do_extract_im4p_payload(filename, payload_type, data, length,
+                            secure_monitor, mapping);
+    apple_boot_phase_end("extract_im4p_payload");
 }
 
 DTBNode *load_dtb_from_file(char *filename)
@@ -390,7 +808,8 @@ DTBNode *load_dtb_from_file(char *filename)
     uint32_t fsize;
     char payload_type[4];
 
-    extract_im4p_payload(filename, payload_type, &file_data, &fsize, NULL);
+    extract_im4p_payload(filename, payload_type, &file_data, &fsize, NULL,
+                         NULL);
 
     if (strncmp(payload_type, "dtre", 4) != 0 &&
         strncmp(payload_type, "raw", 4) != 0) {
@@ -448,7 +867,53 @@ void macho_populate_dtb(DTBNode *root, AppleBootInfo *info)
     set_dtb_prop(child, "BNCH", sizeof(info->boot_nonce_hash),
                  info->boot_nonce_hash);
 
-    macho_dtb_node_process(root, NULL);
+    // The filtering is idempotent and the tree persists across resets, so
+    // only the first boot of a machine needs to walk it.
+    if (!info->device_tree_filtered) {
+        macho_dtb_node_process(root, NULL);
+        info->device_tree_filtered = true;
+    }
+
+    // Ring and doorbell of the paravirtual console, for the guest's serial
+    // hook to find. See hw/char/apple_shmcon.h for the layout.
+    if (info->shmcon_size != 0) {
+        uint64_t shmcon_reg[4] = {
+            info->shmcon_addr,
+            info->shmcon_size,
+            info->shmcon_doorbell_addr,
+            info->shmcon_doorbell_size,
+        };
+
+        child = get_dtb_node(root, "chosen/shmcon");
+        set_dtb_prop(child, "compatible", sizeof("shmcon,qemu"),
+                     "shmcon,qemu");
+        set_dtb_prop(child, "reg", sizeof(shmcon_reg), shmcon_reg);
+    }
+
+    // Registers of the free page reporting device, for the guest's reporting
+    // kext. See hw/misc/apple-silicon/free-page-report.h for the protocol.
+    if (info->fpr_size != 0) {
+        uint64_t fpr_reg[2] = { info->fpr_addr, info->fpr_size };
+
+        child = get_dtb_node(root, "chosen/free-page-report");
+        set_dtb_prop(child, "compatible", sizeof("free-page-report,qemu"),
+                     "free-page-report,qemu");
+        set_dtb_prop(child, "reg", sizeof(fpr_reg), fpr_reg);
+    }
+
+    // How to reach the paravirtual services. See
+    // include/hw/arm/apple-silicon/hypercall.h for the calling convention.
+    if (info->hypercall_version != 0) {
+        uint32_t imm = APPLE_HYPERCALL_IMM;
+
+        child = get_dtb_node(root, "chosen/hypercall");
+        set_dtb_prop(child, "compatible", sizeof("hypercall,qemu"),
+                     "hypercall,qemu");
+        set_dtb_prop(child, "conduit", sizeof("hvc"), "hvc");
+        set_dtb_prop(child, "immediate", sizeof(imm), &imm);
+        set_dtb_prop(child, "version", sizeof(info->hypercall_version),
+                     &info->hypercall_version);
+    }
 
     child = get_dtb_node(root, "chosen/memory-map");
     g_assert_nonnull(child);
@@ -510,6 +975,7 @@ void macho_load_dtb(DTBNode *root, AddressSpace *as, MemoryRegion *mem,
 {
     g_autofree uint8_t *buf = NULL;
 
+    apple_boot_phase_begin("macho_load_dtb");
     set_memory_range(root, "DeviceTree", info->device_tree_addr,
                      info->device_tree_size);
     set_or_remove_memory_range(root, "RAMDisk", info->ramdisk_addr,
@@ -554,20 +1020,65 @@ void macho_load_dtb(DTBNode *root, AddressSpace *as, MemoryRegion *mem,
     save_dtb(buf, root);
     allocate_and_copy(mem, as, name, info->device_tree_addr,
                       info->device_tree_size, buf);
+    apple_boot_phase_end("macho_load_dtb");
+}
+
+#define TRUSTCACHE_HEADER_SIZE (24)
+#define TRUSTCACHE_HASH_SIZE (20)
+
+static int trustcache_entry_compare(const void *a, const void *b)
+{
+    return memcmp(a, b, TRUSTCACHE_HASH_SIZE);
+}
+
+/*
+ * The kernel binary-searches trust cache entries by CDHash, so custom caches
+ * that were not generated sorted are sorted here, once, when they are loaded.
+ */
+static void trustcache_sort_entries(uint8_t *entries, uint32_t count,
+                                    uint32_t entry_size)
+{
+    uint32_t i;
+
+    for (i = 1; i < count; i++) {
+        if (trustcache_entry_compare(entries + (i - 1) * entry_size,
+                                     entries + i * entry_size) > 0) {
+            qsort(entries, count, entry_size, trustcache_entry_compare);
+            return;
+        }
+    }
 }
 
 uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
 {
+    g_autoptr(GError) err = NULL;
+    GMappedFile *mapped;
+    const uint8_t *file_data;
+    const uint8_t *payload_data;
+    size_t file_size;
+    g_autofree uint8_t *decoded_data = NULL;
+    uint32_t decoded_length = 0;
     uint32_t *trustcache_data = NULL;
     uint64_t trustcache_size = 0;
-    g_autofree uint8_t *file_data = NULL;
-    unsigned long file_size = 0;
-    uint32_t length = 0;
     char payload_type[4];
-    uint32_t trustcache_version, trustcache_entry_count, expected_file_size;
+    uint32_t trustcache_version, trustcache_entry_count;
+    uint64_t expected_file_size;
     uint32_t trustcache_entry_size = 0;
 
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
+    mapped = g_mapped_file_new(filename, FALSE, &err);
+    if (mapped == NULL) {
+        error_report("Could not load data from file '%s': %s", filename,
+                     err->message);
+        exit(EXIT_FAILURE);
+    }
+
+    file_data = (const uint8_t *)g_mapped_file_get_contents(mapped);
+    file_size = g_mapped_file_get_length(mapped);
+    payload_data = file_data;
+    if (!im4p_find_payload(filename, file_data, file_size, payload_type,
+                           &payload_data, &file_size)) {
+        strncpy(payload_type, "raw", 4);
+    }
 
     if (strncmp(payload_type, "trst", 4) != 0 &&
         strncmp(payload_type, "rtsc", 4) != 0 &&
@@ -578,13 +1089,12 @@ uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
         exit(EXIT_FAILURE);
     }
 
-    file_size = (unsigned long)length;
-
-    trustcache_size = align_16k_high(file_size + 8);
-    trustcache_data = (uint32_t *)g_malloc(trustcache_size);
-    trustcache_data[0] = 1; // #trustcaches
-    trustcache_data[1] = 8; // offset
-    memcpy(&trustcache_data[2], file_data, file_size);
+    if (im4p_payload_is_compressed(payload_data, file_size)) {
+        extract_im4p_payload(filename, payload_type, &decoded_data,
+                             &decoded_length, NULL, NULL);
+        payload_data = decoded_data;
+        file_size = decoded_length;
+    }
 
     // Validate the trustcache v1 header. The layout is:
     // uint32_t version
@@ -595,8 +1105,14 @@ uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
     // contains a 20 byte hash and 2 additional bytes (hence is 22 bytes long)
     // for v1 and contains a 20 byte hash and 4 additional bytes (hence is 24
     // bytes long) for v2
-    trustcache_version = trustcache_data[2];
-    trustcache_entry_count = trustcache_data[7];
+    if (file_size < TRUSTCACHE_HEADER_SIZE) {
+        error_report("The trust cache '%s' is too small to hold a header",
+                     filename);
+        exit(EXIT_FAILURE);
+    }
+
+    trustcache_version = ldl_le_p(payload_data);
+    trustcache_entry_count = ldl_le_p(payload_data + 20);
 
     switch (trustcache_version) {
     case 1:
@@ -611,16 +1127,27 @@ uint8_t *load_trustcache_from_file(const char *filename, uint64_t *size)
         exit(EXIT_FAILURE);
     }
 
-    expected_file_size =
-        24 /* header size */ + trustcache_entry_count * trustcache_entry_size;
+    expected_file_size = TRUSTCACHE_HEADER_SIZE +
+                         (uint64_t)trustcache_entry_count * trustcache_entry_size;
 
     if (file_size != expected_file_size) {
-        error_report("The expected size %d of trust cache '%s' does not match "
-                     "the actual size %ld",
+        error_report("The expected size %" PRIu64 " of trust cache '%s' does "
+                     "not match the actual size %zu",
                      expected_file_size, filename, file_size);
         exit(EXIT_FAILURE);
     }
 
+    trustcache_size = align_16k_high(file_size + 8);
+    trustcache_data = (uint32_t *)g_malloc0(trustcache_size);
+    trustcache_data[0] = 1; // #trustcaches
+    trustcache_data[1] = 8; // offset
+    memcpy(&trustcache_data[2], payload_data, file_size);
+    g_mapped_file_unref(mapped);
+
+    trustcache_sort_entries((uint8_t *)&trustcache_data[2] +
+                                TRUSTCACHE_HEADER_SIZE,
+                            trustcache_entry_count, trustcache_entry_size);
+
     *size = trustcache_size;
     return (uint8_t *)trustcache_data;
 }
@@ -631,48 +1158,187 @@ void macho_load_trustcache(void *trustcache, uint64_t size, AddressSpace *as,
     allocate_and_copy(mem, as, "TrustCache", pa, size, trustcache);
 }
 
-void macho_load_ramdisk(const char *filename, AddressSpace *as,
-                        MemoryRegion *mem, hwaddr pa, uint64_t *size)
+#ifdef CONFIG_POSIX
+/*
+ * The extracted ramdisk of a container is cached as its own file, keyed by
+ * the SHA-256 of the container, so later runs skip the decompression.
+ * Its length is rounded up to 16 KiB, as the ramdisk is in guest RAM.
+ */
+static char *ramdisk_cache_create(const char *filename,
+                                  const uint8_t *file_data, size_t fsize,
+                                  const uint8_t *payload_data, size_t len)
 {
-    uint8_t *file_data = NULL;
-    unsigned long file_size = 0;
-    uint32_t length = 0;
-    char payload_type[4];
+    g_autofree char *digest = NULL;
+    g_autofree uint8_t *decoded_data = NULL;
+    uint32_t decoded_length = 0;
+    const uint8_t *monitor;
+    size_t monitor_size;
+    Error *local_err = NULL;
+    char *path;
+
+    if (qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, (const char *)file_data,
+                            fsize, &digest, &local_err) < 0) {
+        warn_report_err(local_err);
+        return NULL;
+    }
 
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
-    if (strncmp(payload_type, "rdsk", 4) != 0 &&
-        strncmp(payload_type, "raw", 4) != 0) {
-        error_report("Couldn't parse ASN.1 data in file '%s' because it is not "
-                     "a 'rdsk' object, found '%.4s' object.",
-                     filename, payload_type);
-        exit(EXIT_FAILURE);
+    path = g_strdup_printf("%s/%s.rdsk", payload_cache_dir, digest);
+    if (access(path, R_OK) == 0) {
+        return path;
     }
 
-    file_size = length;
-    file_data = g_realloc(file_data, file_size);
+    if (im4p_payload_is_compressed(payload_data, len)) {
+        im4p_decompress_payload(filename, payload_data, len, &decoded_data,
+                                &decoded_length, &monitor, &monitor_size);
+        payload_data = decoded_data;
+        len = decoded_length;
+    }
 
-    allocate_and_copy(mem, as, "RamDisk", pa, file_size, file_data);
-    *size = file_size;
-    g_free(file_data);
+    if (!private_image_write(path, payload_data, len, align_16k_high(len))) {
+        g_free(path);
+        return NULL;
+    }
+
+    return path;
 }
+#endif
 
-void macho_load_raw_file(const char *filename, AddressSpace *as,
-                         MemoryRegion *mem, const char *name, hwaddr file_pa,
-                         uint64_t *size)
+/*
+ * With a payload cache directory, a compressed ramdisk is decompressed once
+ * per container and read from the cache on every run after that. LZFSE
+ * matches may reach back across block boundaries, so it cannot be
+ * decompressed block by block instead.
+ *
+ * The ramdisk is resolved on the first load only and kept, so a reboot
+ * neither hashes nor decompresses the container again, it copies the kept
+ * payload.
+ */
+typedef struct {
+    char *filename;
+    GMappedFile *file;
+    GMappedFile *cached;
+    uint8_t *decoded;
+    /* The payload, in one of the three above. */
+    const uint8_t *data;
+    size_t len;
+} MachoRamdisk;
+
+static MachoRamdisk *loaded_ramdisk;
+
+static void macho_ramdisk_free(MachoRamdisk *rd)
 {
-    uint8_t *file_data = NULL;
-    unsigned long sizef;
-
-    if (g_file_get_contents(filename, (char **)&file_data, &sizef, NULL)) {
-        *size = sizef;
-        allocate_and_copy(mem, as, name, file_pa, *size, file_data);
-        g_free(file_data);
-    } else {
-        abort();
+    if (rd == NULL) {
+        return;
+    }
+    if (rd->file != NULL) {
+        g_mapped_file_unref(rd->file);
     }
+    if (rd->cached != NULL) {
+        g_mapped_file_unref(rd->cached);
+    }
+    g_free(rd->decoded);
+    g_free(rd->filename);
+    g_free(rd);
 }
 
-bool xnu_contains_boot_arg(const char *bootArgs, const char *arg,
+static MachoRamdisk *macho_ramdisk_open(const char *filename)
+{
+    g_autoptr(GError) err = NULL;
+    MachoRamdisk *rd = g_new0(MachoRamdisk, 1);
+    const uint8_t *file_data;
+    size_t fsize;
+    uint32_t decoded_length = 0;
+    char payload_type[4];
+
+    rd->filename = g_strdup(filename);
+    rd->file = g_mapped_file_new(filename, FALSE, &err);
+    if (rd->file == NULL) {
+        error_report("Could not load data from file '%s': %s", filename,
+                     err->message);
+        exit(EXIT_FAILURE);
+    }
+
+    file_data = (const uint8_t *)g_mapped_file_get_contents(rd->file);
+    fsize = g_mapped_file_get_length(rd->file);
+    rd->data = file_data;
+    rd->len = fsize;
+    if (!im4p_find_payload(filename, file_data, fsize, payload_type,
+                           &rd->data, &rd->len)) {
+        strncpy(payload_type, "raw", 4);
+    }
+
+    if (strncmp(payload_type, "rdsk", 4) != 0 &&
+        strncmp(payload_type, "raw", 4) != 0) {
+        error_report("Couldn't parse ASN.1 data in file '%s' because it is not "
+                     "a 'rdsk' object, found '%.4s' object.",
+                     filename, payload_type);
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef CONFIG_POSIX
+    if (payload_cache_dir != NULL &&
+        im4p_payload_is_compressed(rd->data, rd->len)) {
+        g_autofree char *path = ramdisk_cache_create(filename, file_data,
+                                                     fsize, rd->data, rd->len);
+
+        if (path != NULL) {
+            rd->cached = g_mapped_file_new(path, FALSE, NULL);
+        }
+        if (rd->cached != NULL) {
+            rd->data = (const uint8_t *)g_mapped_file_get_contents(rd->cached);
+            rd->len = g_mapped_file_get_length(rd->cached);
+        }
+    }
+#endif
+
+    if (rd->cached == NULL && im4p_payload_is_compressed(rd->data, rd->len)) {
+        g_mapped_file_unref(rd->file);
+        rd->file = NULL;
+        extract_im4p_payload(filename, payload_type, &rd->decoded,
+                             &decoded_length, NULL, NULL);
+        rd->data = rd->decoded;
+        rd->len = decoded_length;
+    }
+
+    return rd;
+}
+
+/*
+ * Uncompressed ramdisks and raw files are written to guest memory straight
+ * out of the file mapping, without staging them in a heap buffer first.
+ */
+void macho_load_ramdisk(const char *filename, AddressSpace *as,
+                        MemoryRegion *mem, hwaddr pa, uint64_t *size)
+{
+    MachoRamdisk *rd = loaded_ramdisk;
+
+    if (rd == NULL || strcmp(rd->filename, filename) != 0) {
+        macho_ramdisk_free(rd);
+        rd = loaded_ramdisk = macho_ramdisk_open(filename);
+    }
+
+    allocate_and_copy(mem, as, "RamDisk", pa, rd->len, (void *)rd->data);
+    *size = rd->len;
+}
+
+void macho_load_raw_file(const char *filename, AddressSpace *as,
+                         MemoryRegion *mem, const char *name, hwaddr file_pa,
+                         uint64_t *size)
+{
+    GMappedFile *mapped;
+
+    mapped = g_mapped_file_new(filename, FALSE, NULL);
+    if (mapped == NULL) {
+        abort();
+    }
+
+    *size = g_mapped_file_get_length(mapped);
+    allocate_and_copy(mem, as, name, file_pa, *size,
+                      g_mapped_file_get_contents(mapped));
+    g_mapped_file_unref(mapped);
+}
+
+bool xnu_contains_boot_arg(const char *bootArgs, const char *arg,
                            bool prefixmatch)
 {
     g_autofree char *args = g_strdup(bootArgs);
@@ -746,68 +1412,298 @@ void macho_setup_bootargs(const char *name, AddressSpace *as, MemoryRegion *mem,
     allocate_and_copy(mem, as, name, addr, sizeof(boot_args), &boot_args);
 }
 
-void macho_highest_lowest(MachoHeader64 *mh, uint64_t *lowaddr,
-                          uint64_t *highaddr)
+/*
+ * The load commands of the images loaded by macho_load_file are indexed
+ * once, fileset kernelcaches along with each of their entries, so the
+ * accessors below do not rescan them on every call. Anything else, like
+ * the raw image inside macho_parse, is still scanned each time.
+ */
+typedef struct {
+    /* Bounds of the segments but __PAGEZERO, before any masking. */
+    uint64_t low_addr;
+    uint64_t high_addr;
+    uint64_t text_base;
+    MachoBuildVersionCommand *build_version;
+    MachoSymtabCommand *symtab;
+    MachoDysymtabCommand *dysymtab;
+    /* Segment name -> the first MachoSegmentCommand64 of that name. */
+    GHashTable *segments;
+    /* Entry ID -> MachoFilesetEntryCommand. */
+    GHashTable *filesets;
+    /* Headers of the fileset entries, indexed alongside this one. */
+    GPtrArray *entries;
+} MachoIndex;
+
+/* MachoHeader64 -> MachoIndex. Only used from the main thread. */
+static GHashTable *macho_indices;
+
+/* Fills in `idx`, and its tables when it has them. */
+static void macho_index_scan(MachoHeader64 *mh, MachoIndex *idx)
 {
-    MachoLoadCommand *cmd =
-        (MachoLoadCommand *)((uint8_t *)mh + sizeof(MachoHeader64));
-    // iterate all the segments once to find highest and lowest addresses
-    uint64_t low_addr_temp = ~0, high_addr_temp = 0;
-    unsigned int index;
+    MachoLoadCommand *cmd = (MachoLoadCommand *)(mh + 1);
 
-    for (index = 0; index < mh->n_cmds; index++) {
+    idx->low_addr = ~0ull;
+    idx->high_addr = 0;
+    idx->text_base = 0;
+    for (uint32_t i = 0; i < mh->n_cmds; i++) {
         switch (cmd->cmd) {
         case LC_SEGMENT_64: {
-            MachoSegmentCommand64 *segCmd = (MachoSegmentCommand64 *)cmd;
-            if (!strncmp(segCmd->segname, "__PAGEZERO", 11)) {
-                continue;
-            }
+            MachoSegmentCommand64 *seg = (MachoSegmentCommand64 *)cmd;
+            char *name;
 
-            if (segCmd->vmaddr < low_addr_temp) {
-                low_addr_temp = segCmd->vmaddr;
+            if (seg->vmaddr && seg->fileoff == 0 && !idx->text_base) {
+                idx->text_base = seg->vmaddr;
             }
-            if (segCmd->vmaddr + segCmd->vmsize > high_addr_temp) {
-                high_addr_temp = segCmd->vmaddr + segCmd->vmsize;
+            if (idx->segments) {
+                name = g_strndup(seg->segname, sizeof(seg->segname));
+                if (g_hash_table_contains(idx->segments, name)) {
+                    g_free(name);
+                } else {
+                    g_hash_table_insert(idx->segments, name, seg);
+                }
+            }
+            if (!strncmp(seg->segname, "__PAGEZERO", 11)) {
+                break;
+            }
+            idx->low_addr = MIN(idx->low_addr, seg->vmaddr);
+            idx->high_addr = MAX(idx->high_addr, seg->vmaddr + seg->vmsize);
+            break;
+        }
+        case LC_BUILD_VERSION:
+            if (!idx->build_version) {
+                idx->build_version = (MachoBuildVersionCommand *)cmd;
+            }
+            break;
+        case LC_SYMTAB:
+            if (!idx->symtab) {
+                idx->symtab = (MachoSymtabCommand *)cmd;
+            }
+            break;
+        case LC_DYSYMTAB:
+            if (!idx->dysymtab) {
+                idx->dysymtab = (MachoDysymtabCommand *)cmd;
+            }
+            break;
+        case LC_FILESET_ENTRY: {
+            MachoFilesetEntryCommand *fileset =
+                (MachoFilesetEntryCommand *)cmd;
+            char *entry_id = (char *)fileset + fileset->entry_id;
+
+            if (idx->filesets && mh->file_type == MH_FILESET &&
+                !g_hash_table_contains(idx->filesets, entry_id)) {
+                g_hash_table_insert(idx->filesets, entry_id, fileset);
             }
             break;
         }
-
         default:
             break;
         }
         cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
     }
+}
+
+static void macho_index_add(MachoHeader64 *mh)
+{
+    MachoIndex *idx;
+    GHashTableIter iter;
+    MachoFilesetEntryCommand *fileset;
+
+    if (macho_indices == NULL) {
+        macho_indices = g_hash_table_new(NULL, NULL);
+    }
+    if (g_hash_table_contains(macho_indices, mh)) {
+        return;
+    }
+
+    idx = g_new0(MachoIndex, 1);
+    idx->segments = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          NULL);
+    idx->filesets = g_hash_table_new(g_str_hash, g_str_equal);
+    idx->entries = g_ptr_array_new();
+    macho_index_scan(mh, idx);
+    g_hash_table_insert(macho_indices, mh, idx);
+
+    g_hash_table_iter_init(&iter, idx->filesets);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&fileset)) {
+        MachoHeader64 *entry =
+            (MachoHeader64 *)((char *)mh + fileset->file_off);
+
+        macho_index_add(entry);
+        g_ptr_array_add(idx->entries, entry);
+    }
+}
+
+static void macho_index_remove(MachoHeader64 *mh)
+{
+    MachoIndex *idx;
+
+    if (macho_indices == NULL) {
+        return;
+    }
+    idx = g_hash_table_lookup(macho_indices, mh);
+    if (idx == NULL) {
+        return;
+    }
+    g_hash_table_remove(macho_indices, mh);
+
+    for (guint i = 0; i < idx->entries->len; i++) {
+        macho_index_remove(g_ptr_array_index(idx->entries, i));
+    }
+    g_ptr_array_free(idx->entries, TRUE);
+    g_hash_table_destroy(idx->filesets);
+    g_hash_table_destroy(idx->segments);
+    g_free(idx);
+}
+
+/* The index of `mh`, or a table-less one scanned into `tmp`. */
+static MachoIndex *macho_index_get(MachoHeader64 *mh, MachoIndex *tmp)
+{
+    MachoIndex *idx = NULL;
+
+    if (macho_indices != NULL) {
+        idx = g_hash_table_lookup(macho_indices, mh);
+    }
+    if (idx == NULL) {
+        memset(tmp, 0, sizeof(*tmp));
+        macho_index_scan(mh, tmp);
+        idx = tmp;
+    }
+    return idx;
+}
+
+void macho_highest_lowest(MachoHeader64 *mh, uint64_t *lowaddr,
+                          uint64_t *highaddr)
+{
+    MachoIndex tmp;
+    MachoIndex *idx = macho_index_get(mh, &tmp);
+
     if (lowaddr) {
-        *lowaddr = low_addr_temp & -0x2000000ull;
+        *lowaddr = idx->low_addr & -0x2000000ull;
     }
     if (highaddr) {
-        *highaddr = high_addr_temp;
+        *highaddr = idx->high_addr;
     }
 }
 
-void macho_text_base(MachoHeader64 *mh, uint64_t *base)
+bool macho_text_base(MachoHeader64 *mh, uint64_t *base)
 {
-    MachoLoadCommand *cmd =
-        (MachoLoadCommand *)((uint8_t *)mh + sizeof(MachoHeader64));
-    unsigned int index;
-    *base = 0;
-    for (index = 0; index < mh->n_cmds; index++) {
-        switch (cmd->cmd) {
-        case LC_SEGMENT_64: {
-            MachoSegmentCommand64 *segCmd = (MachoSegmentCommand64 *)cmd;
+    MachoIndex tmp;
 
-            if (segCmd->vmaddr && segCmd->fileoff == 0) {
-                *base = segCmd->vmaddr;
-                return;
+    *base = macho_index_get(mh, &tmp)->text_base;
+    return *base != 0;
+}
+
+typedef struct {
+    uint64_t start;
+    uint64_t filesize;
+    uint64_t vmsize;
+} MachoFlatSegment;
+
+static gint macho_flat_segment_compare(gconstpointer a, gconstpointer b)
+{
+    const MachoFlatSegment *sa = a, *sb = b;
+
+    return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+/*
+ * Whether every segment of `mh` sits at the same distance from its file
+ * offset in memory, with nothing overlapping, so the image is the file
+ * moved up by that distance. Fills `segs` with the segments in image
+ * order, offsets relative to `lowaddr`.
+ */
+static bool macho_layout_is_flat(MachoHeader64 *mh, uint32_t len,
+                                 uint64_t lowaddr, uint64_t *shift,
+                                 GArray *segs)
+{
+    MachoLoadCommand *cmd = (MachoLoadCommand *)(mh + 1);
+    bool found = false;
+    uint64_t end = 0;
+
+    for (uint32_t i = 0; i < mh->n_cmds; i++) {
+        if (cmd->cmd == LC_SEGMENT_64) {
+            MachoSegmentCommand64 *seg = (MachoSegmentCommand64 *)cmd;
+            MachoFlatSegment fs;
+
+            if (seg->vmsize != 0 &&
+                strncmp(seg->segname, "__PAGEZERO", 11) != 0) {
+                if (seg->vmaddr < lowaddr + seg->fileoff ||
+                    (found &&
+                     seg->vmaddr - lowaddr - seg->fileoff != *shift) ||
+                    seg->filesize > seg->vmsize || seg->fileoff > len ||
+                    seg->filesize > len - seg->fileoff) {
+                    return false;
+                }
+                *shift = seg->vmaddr - lowaddr - seg->fileoff;
+                found = true;
+                fs.start = seg->vmaddr - lowaddr;
+                fs.filesize = seg->filesize;
+                fs.vmsize = seg->vmsize;
+                g_array_append_val(segs, fs);
             }
-            break;
         }
+        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+    }
 
-        default:
-            break;
+    g_array_sort(segs, macho_flat_segment_compare);
+    for (guint i = 0; i < segs->len; i++) {
+        MachoFlatSegment *fs = &g_array_index(segs, MachoFlatSegment, i);
+
+        if (fs->start < end) {
+            return false;
         }
-        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+        end = fs->start + fs->vmsize;
+    }
+    return found;
+}
+
+/*
+ * Like macho_parse, but takes over `data` and, when the file is laid out
+ * like the image, which is the usual case for a kernelcache, builds the
+ * image in it instead of in a second buffer. Returns NULL, leaving `data`
+ * alone, when the layout does not allow it.
+ */
+static MachoHeader64 *macho_parse_in_place(uint8_t *data, uint32_t len)
+{
+    MachoHeader64 *mh = (MachoHeader64 *)data;
+    g_autoptr(GArray) segs =
+        g_array_new(FALSE, FALSE, sizeof(MachoFlatSegment));
+    uint64_t lowaddr = 0, highaddr = 0, text_base = 0;
+    uint64_t shift = 0;
+    uint64_t size;
+    uint64_t pos = 0;
+
+    if (len < sizeof(*mh) || mh->magic != MACH_MAGIC_64) {
+        return NULL;
     }
+    macho_highest_lowest(mh, &lowaddr, &highaddr);
+    if (!macho_text_base(mh, &text_base) || lowaddr >= highaddr ||
+        !macho_layout_is_flat(mh, len, lowaddr, &shift, segs) ||
+        text_base != lowaddr + shift || shift >= highaddr - lowaddr) {
+        return NULL;
+    }
+
+    size = highaddr - lowaddr;
+    if (size > len) {
+        data = g_realloc(data, size);
+    }
+    memmove(data + shift, data, MIN(len, size - shift));
+
+    // Clear what no segment's file contents cover, as a fresh copy would.
+    for (guint i = 0; i < segs->len; i++) {
+        MachoFlatSegment *fs = &g_array_index(segs, MachoFlatSegment, i);
+
+        memset(data + pos, 0, fs->start - pos);
+        memset(data + fs->start + fs->filesize, 0,
+               fs->vmsize - fs->filesize);
+        pos = fs->start + fs->vmsize;
+    }
+    memset(data + pos, 0, size - pos);
+    if (size < len) {
+        data = g_realloc(data, size);
+    }
+
+    return (MachoHeader64 *)(data + shift);
 }
 
 MachoHeader64 *macho_load_file(const char *filename,
@@ -817,9 +1713,10 @@ MachoHeader64 *macho_load_file(const char *filename,
     uint8_t *data = NULL;
     char payload_type[4];
     MachoHeader64 *mh = NULL;
+    GMappedFile *mapping = NULL;
 
     extract_im4p_payload(filename, payload_type, &data, &len,
-                         (uint8_t **)secure_monitor);
+                         (uint8_t **)secure_monitor, &mapping);
 
     if (strncmp(payload_type, "krnl", 4) != 0 &&
         strncmp(payload_type, "raw", 4) != 0) {
@@ -829,8 +1726,20 @@ MachoHeader64 *macho_load_file(const char *filename,
         exit(EXIT_FAILURE);
     }
 
-    mh = macho_parse(data, len);
-    g_free(data);
+    if (mapping != NULL) {
+        mh = macho_parse(data, len);
+        g_mapped_file_unref(mapping);
+    } else {
+        mh = macho_parse_in_place(data, len);
+        if (mh == NULL) {
+            mh = macho_parse(data, len);
+            g_free(data);
+        }
+    }
+    macho_index_add(mh);
+    if (secure_monitor && *secure_monitor) {
+        macho_index_add(*secure_monitor);
+    }
     return mh;
 }
 
@@ -887,59 +1796,28 @@ MachoHeader64 *macho_parse(uint8_t *data, uint32_t len)
     return (MachoHeader64 *)(phys_base + text_base - virt_base);
 }
 
-uint32_t macho_build_version(MachoHeader64 *mh)
+static MachoBuildVersionCommand *macho_get_build_version(MachoHeader64 *mh)
 {
-    MachoLoadCommand *cmd;
-    int index;
+    MachoIndex tmp;
 
     if (mh->file_type == MH_FILESET) {
         mh = macho_get_fileset_header(mh, "com.apple.kernel");
     }
-    cmd = (MachoLoadCommand *)((char *)mh + sizeof(MachoHeader64));
-
-    for (index = 0; index < mh->n_cmds; index++) {
-        switch (cmd->cmd) {
-        case LC_BUILD_VERSION: {
-            MachoBuildVersionCommand *buildVerCmd =
-                (MachoBuildVersionCommand *)cmd;
-            return buildVerCmd->sdk;
-            break;
-        }
+    return macho_index_get(mh, &tmp)->build_version;
+}
 
-        default:
-            break;
-        }
+uint32_t macho_build_version(MachoHeader64 *mh)
+{
+    MachoBuildVersionCommand *build_version = macho_get_build_version(mh);
 
-        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
-    }
-    return 0;
+    return build_version ? build_version->sdk : 0;
 }
 
 uint32_t macho_platform(MachoHeader64 *mh)
 {
-    MachoLoadCommand *cmd;
-    int index;
-
-    if (mh->file_type == MH_FILESET) {
-        mh = macho_get_fileset_header(mh, "com.apple.kernel");
-    }
-    cmd = (MachoLoadCommand *)((char *)mh + sizeof(MachoHeader64));
-
-    for (index = 0; index < mh->n_cmds; index++) {
-        switch (cmd->cmd) {
-        case LC_BUILD_VERSION: {
-            MachoBuildVersionCommand *buildVerCmd =
-                (MachoBuildVersionCommand *)cmd;
-            return buildVerCmd->platform;
-        }
-
-        default:
-            break;
-        }
+    MachoBuildVersionCommand *build_version = macho_get_build_version(mh);
 
-        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
-    }
-    return 0;
+    return build_version ? build_version->platform : 0;
 }
 
 const char *macho_platform_string(MachoHeader64 *mh)
@@ -961,49 +1839,6 @@ const char *macho_platform_string(MachoHeader64 *mh)
     }
 }
 
-static MachoSegmentCommand64 *macho_get_firstseg(MachoHeader64 *header)
-{
-    MachoSegmentCommand64 *sgp;
-    uint32_t i;
-
-    sgp = (MachoSegmentCommand64 *)(header + 1);
-
-    for (i = 0; i < header->n_cmds; i++) {
-        if (sgp->cmd == LC_SEGMENT_64) {
-            return sgp;
-        }
-
-        sgp = (MachoSegmentCommand64 *)((char *)sgp + sgp->cmd_size);
-    }
-
-    // not found
-    return NULL;
-}
-
-static MachoSegmentCommand64 *macho_get_nextseg(MachoHeader64 *header,
-                                                MachoSegmentCommand64 *seg)
-{
-    MachoSegmentCommand64 *sgp;
-    uint32_t i;
-    bool found = false;
-
-    sgp = (MachoSegmentCommand64 *)((char *)header + sizeof(MachoHeader64));
-
-    for (i = 0; i < header->n_cmds; i++) {
-        if (found && sgp->cmd == LC_SEGMENT_64) {
-            return sgp;
-        }
-        if (seg == sgp) {
-            found = true;
-        }
-
-        sgp = (MachoSegmentCommand64 *)((char *)sgp + sgp->cmd_size);
-    }
-
-    // not found
-    return NULL;
-}
-
 static MachoSection64 *firstsect(MachoSegmentCommand64 *seg)
 {
     return (MachoSection64 *)(seg + 1);
@@ -1022,73 +1857,81 @@ static MachoSection64 *endsect(MachoSegmentCommand64 *seg)
     return &sp[seg->nsects];
 }
 
+/* Slides the segment and section addresses in the load commands of `mh`. */
+static void macho_slide_segments(MachoHeader64 *mh, uint64_t slide)
+{
+    MachoLoadCommand *cmd = (MachoLoadCommand *)(mh + 1);
+
+    for (uint32_t i = 0; i < mh->n_cmds; i++) {
+        if (cmd->cmd == LC_SEGMENT_64) {
+            MachoSegmentCommand64 *seg = (MachoSegmentCommand64 *)cmd;
+            MachoSection64 *sp;
+
+            seg->vmaddr += slide;
+            for (sp = firstsect(seg); sp != endsect(seg); sp = nextsect(sp)) {
+                sp->addr += slide;
+            }
+        }
+        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+    }
+}
+
+/*
+ * Slides the symbol table and the local relocations of a non-fileset
+ * kernelcache. Fileset kernelcaches carry LC_DYLD_CHAINED_FIXUPS and rebase
+ * themselves early in boot, so they must not be touched here.
+ *
+ * The __LINKEDIT base and the text base are resolved once up front, so the
+ * per-entry loops are plain strided adds over the host copy of the image.
+ * Either is only needed when there is something to slide with it.
+ */
 static void macho_process_symbols(MachoHeader64 *mh, uint64_t slide)
 {
-    MachoLoadCommand *cmd;
+    MachoIndex tmp;
+    MachoIndex *idx;
     uint8_t *data;
     uint64_t kernel_low, kernel_high;
-    uint32_t index;
-    void *base;
+    uint8_t *linkedit;
     MachoSegmentCommand64 *linkedit_seg;
-    MachoNList64 *sym;
-    uint32_t off;
     hwaddr text_base;
+    bool relocs;
 
     if (!slide) {
         return;
     }
 
+    idx = macho_index_get(mh, &tmp);
+    relocs = idx->dysymtab && idx->dysymtab->loc_rel_n;
+    if (!idx->symtab && !relocs) {
+        return;
+    }
+
     macho_highest_lowest(mh, &kernel_low, &kernel_high);
 
     data = macho_get_buffer(mh);
     linkedit_seg = macho_get_segment(mh, "__LINKEDIT");
+    if (linkedit_seg == NULL) {
+        error_report("Did not find __LINKEDIT segment");
+        return;
+    }
+    linkedit = data + (linkedit_seg->vmaddr - kernel_low) -
+               linkedit_seg->fileoff;
 
-    cmd = (MachoLoadCommand *)(mh + 1);
-    for (index = 0; index < mh->n_cmds; index++) {
-        switch (cmd->cmd) {
-        case LC_SYMTAB: {
-            MachoSymtabCommand *symtab = (MachoSymtabCommand *)cmd;
-            if (linkedit_seg == NULL) {
-                error_report("Did not find __LINKEDIT segment");
-                return;
-            }
-            base = data + (linkedit_seg->vmaddr - kernel_low);
-            off = linkedit_seg->fileoff;
-            sym = (MachoNList64 *)(base + (symtab->sym_off - off));
-            for (int i = 0; i < symtab->nsyms; i++) {
-                if (sym[i].n_type & N_STAB) {
-                    continue;
-                }
-                sym[i].n_value += slide;
-            }
-            break;
-        }
-        case LC_DYSYMTAB: {
-            MachoDysymtabCommand *dysymtab = (MachoDysymtabCommand *)cmd;
-            if (!dysymtab->loc_rel_n) {
-                break;
-            }
-
-            if (linkedit_seg == NULL) {
-                error_report("Did not find __LINKEDIT segment");
-                return;
-            }
-
-            base = data + (linkedit_seg->vmaddr - kernel_low);
-            off = linkedit_seg->fileoff;
-            macho_text_base(mh, &text_base);
-            for (size_t i = 0; i < dysymtab->loc_rel_n; i++) {
-                int32_t r_address =
-                    *(int32_t *)(base + (dysymtab->loc_rel_off - off) + i * 8);
-                *(uint64_t *)(data + ((text_base - kernel_low) + r_address)) +=
-                    slide;
-            }
-            break;
-        }
-        default:
-            break;
+    if (idx->symtab) {
+        macho_slide_symbols(
+            (MachoNList64 *)(linkedit + idx->symtab->sym_off),
+            idx->symtab->nsyms, slide);
+    }
+    if (relocs) {
+        if (!macho_text_base(mh, &text_base)) {
+            error_report("Did not find the text base to slide the local "
+                         "relocations against");
+            return;
         }
-        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+        macho_slide_local_relocs(
+            data + (text_base - kernel_low),
+            (const int32_t *)(linkedit + idx->dysymtab->loc_rel_off),
+            idx->dysymtab->loc_rel_n, slide);
     }
 }
 
@@ -1122,6 +1965,75 @@ void macho_allocate_segment_records(DTBNode *memory_map, MachoHeader64 *mh)
     }
 }
 
+static gint macho_dump_range_compare(gconstpointer a, gconstpointer b)
+{
+    const XnuDumpRange *range_a = a;
+    const XnuDumpRange *range_b = b;
+
+    return range_a->vaddr < range_b->vaddr ? -1
+                                           : range_a->vaddr > range_b->vaddr;
+}
+
+bool macho_dump_info(XnuDumpInfo *info, DTBNode *memory_map,
+                     MachoHeader64 *kernel, hwaddr boot_args_pa,
+                     Error **errp)
+{
+    AppleKernelBootArgs args;
+    MachoHeader64 *mh = kernel;
+    MachoLoadCommand *cmd;
+    GList *iter;
+
+    if (address_space_read(&address_space_memory, boot_args_pa,
+                           MEMTXATTRS_UNSPECIFIED, &args,
+                           sizeof(args)) != MEMTX_OK ||
+        args.virt_base == 0) {
+        error_setg(errp, "the guest kernel has no boot arguments yet");
+        return false;
+    }
+
+    info->kernel_slide = g_virt_slide;
+    if (kernel->file_type == MH_FILESET) {
+        MachoFilesetEntryCommand *entry =
+            macho_get_fileset(kernel, "com.apple.kernel");
+
+        g_assert_nonnull(entry);
+        mh = macho_get_fileset_header(kernel, "com.apple.kernel");
+        info->kernel_vaddr = entry->vm_addr + g_virt_slide;
+    } else {
+        info->kernel_vaddr =
+            macho_get_segment(kernel, "__TEXT")->vmaddr + g_virt_slide;
+    }
+
+    cmd = (MachoLoadCommand *)(mh + 1);
+    for (uint32_t i = 0; i < mh->n_cmds; i++) {
+        if (cmd->cmd == LC_UUID) {
+            memcpy(info->kernel_uuid, cmd + 1, sizeof(info->kernel_uuid));
+            break;
+        }
+        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+    }
+
+    for (iter = memory_map->props; iter != NULL; iter = iter->next) {
+        DTBProp *prop = iter->data;
+        const uint64_t *value = (const uint64_t *)prop->value;
+        XnuDumpRange range;
+
+        // The ramdisk is as large as it is useless for a kernel post-mortem.
+        if (prop->length != 2 * sizeof(uint64_t) ||
+            !strcmp((const char *)prop->name, "RAMDisk") || value[0] == 0 ||
+            value[1] == 0) {
+            continue;
+        }
+        range.paddr = value[0];
+        range.size = value[1];
+        range.vaddr = range.paddr - args.phys_base + args.virt_base;
+        g_array_append_val(info->ranges, range);
+    }
+    g_array_sort(info->ranges, macho_dump_range_compare);
+
+    return true;
+}
+
 hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
                       DTBNode *memory_map, hwaddr phys_base,
                       uint64_t virt_slide)
@@ -1135,6 +2047,7 @@ hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
     macho_highest_lowest(mh, &virt_low, &virt_high);
     bool is_fileset = mh->file_type == MH_FILESET;
 
+    apple_boot_phase_begin("arm_load_macho");
     cmd = (MachoLoadCommand *)(mh + 1);
     if (!is_fileset) {
         macho_process_symbols(mh, virt_slide);
@@ -1187,17 +2100,8 @@ hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
             if (!is_fileset) {
                 if (strcmp(segCmd->segname, "__TEXT") == 0) {
                     MachoHeader64 *mh = load_from;
-                    MachoSegmentCommand64 *seg;
                     g_assert_cmphex(mh->magic, ==, MACH_MAGIC_64);
-                    for (seg = macho_get_firstseg(mh); seg != NULL;
-                         seg = macho_get_nextseg(mh, seg)) {
-                        MachoSection64 *sp;
-                        seg->vmaddr += virt_slide;
-                        for (sp = firstsect(seg); sp != endsect(seg);
-                             sp = nextsect(sp)) {
-                            sp->addr += virt_slide;
-                        }
-                    }
+                    macho_slide_segments(mh, virt_slide);
                 }
             }
 
@@ -1207,25 +2111,21 @@ hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
                 "Loading %s to 0x%llx (filesize: 0x%llX vmsize: 0x%llX)",
                 region_name, load_to, segCmd->filesize, segCmd->vmsize);
 #endif
-            uint8_t *buf = g_malloc0(segCmd->vmsize);
-            memcpy(buf, load_from, segCmd->filesize);
-            allocate_and_copy(mem, as, region_name, load_to, segCmd->vmsize,
-                              buf);
-            g_free(buf);
+            // Copy the file-backed part straight out of the kernelcache
+            // buffer and zero-fill the rest instead of staging every
+            // segment in a fresh vmsize-sized heap buffer.
+            uint64_t filesize = MIN(segCmd->filesize, segCmd->vmsize);
+            allocate_and_copy(mem, as, region_name, load_to, filesize,
+                              load_from);
+            if (filesize < segCmd->vmsize) {
+                address_space_set(as, load_to + filesize, 0,
+                                  segCmd->vmsize - filesize,
+                                  MEMTXATTRS_UNSPECIFIED);
+            }
 
             if (!is_fileset) {
                 if (strcmp(segCmd->segname, "__TEXT") == 0) {
-                    MachoHeader64 *mh = load_from;
-                    MachoSegmentCommand64 *seg;
-                    for (seg = macho_get_firstseg(mh); seg != NULL;
-                         seg = macho_get_nextseg(mh, seg)) {
-                        MachoSection64 *sp;
-                        seg->vmaddr -= virt_slide;
-                        for (sp = firstsect(seg); sp != endsect(seg);
-                             sp = nextsect(sp)) {
-                            sp->addr -= virt_slide;
-                        }
-                    }
+                    macho_slide_segments(load_from, -virt_slide);
                 }
             }
 
@@ -1268,6 +2168,7 @@ hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
     if (!is_fileset) {
         macho_process_symbols(mh, -virt_slide);
     }
+    apple_boot_phase_end("arm_load_macho");
 
     return pc;
 }
@@ -1284,19 +2185,28 @@ uint8_t *macho_get_buffer(MachoHeader64 *hdr)
 
 void macho_free(MachoHeader64 *hdr)
 {
-    g_free(macho_get_buffer(hdr));
+    uint8_t *buffer = macho_get_buffer(hdr);
+
+    macho_index_remove(hdr);
+    g_free(buffer);
 }
 
 MachoFilesetEntryCommand *macho_get_fileset(MachoHeader64 *header,
                                             const char *entry)
 {
+    MachoIndex *idx;
+    MachoFilesetEntryCommand *fileset;
+
     if (header->file_type != MH_FILESET) {
         return NULL;
     }
-    MachoFilesetEntryCommand *fileset;
+    idx = macho_indices ? g_hash_table_lookup(macho_indices, header) : NULL;
+    if (idx != NULL) {
+        return g_hash_table_lookup(idx->filesets, entry);
+    }
+
     fileset =
         (MachoFilesetEntryCommand *)((char *)header + sizeof(MachoHeader64));
-
     for (uint32_t i = 0; i < header->n_cmds; i++) {
         if (fileset->cmd == LC_FILESET_ENTRY) {
             const char *entry_id = (char *)fileset + fileset->entry_id;
@@ -1332,8 +2242,17 @@ MachoSegmentCommand64 *macho_get_segment(MachoHeader64 *header,
         return macho_get_segment(
             macho_get_fileset_header(header, "com.apple.kernel"), segname);
     } else {
+        MachoIndex *idx;
         MachoSegmentCommand64 *sgp;
 
+        idx = macho_indices ? g_hash_table_lookup(macho_indices, header) :
+                              NULL;
+        if (idx != NULL) {
+            char name[sizeof(sgp->segname) + 1];
+
+            g_strlcpy(name, segname, sizeof(name));
+            return g_hash_table_lookup(idx->segments, name);
+        }
 
         for (sgp = (MachoSegmentCommand64 *)(header + 1), i = 0;
              i < header->n_cmds; i++,
@@ -1372,3 +2291,210 @@ void *xnu_va_to_ptr(uint64_t va)
 {
     return (void *)(va - g_virt_base + g_phys_base);
 }
+
+typedef struct {
+    const char *name;
+    int64_t start_ns;
+    int64_t total_ns;
+    uint32_t count;
+    uint32_t depth;
+} AppleBootPhase;
+
+typedef struct {
+    const char *name;
+    int64_t at_ns;
+    // Guest instructions retired so far, -1 without -icount.
+    int64_t insns;
+} AppleBootMilestone;
+
+static struct {
+    bool enabled;
+    int64_t start_ns;
+    /* Phases are also timed from the machines' loader threads. */
+    QemuMutex phases_lock;
+    GArray *phases;
+    GArray *milestones;
+    Notifier exit_notifier;
+} boot_profile;
+
+/* Names of the milestones already reached in this boot. */
+static GPtrArray *boot_milestones_seen;
+
+/*
+ * XNU console lines marking the guest-side boot stages, matched as
+ * substrings of a line.
+ */
+static const struct {
+    const char *needle;
+    const char *milestone;
+} boot_profile_console_milestones[] = {
+    { "Darwin Kernel Version", "kernel_bootstrap" },
+    { "BSD root:", "bsd_root_mounted" },
+    { "launchd", "launchd" },
+    { "SpringBoard", "springboard" },
+};
+
+static inline int64_t boot_profile_now(void)
+{
+    return qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+static AppleBootPhase *boot_profile_phase(const char *name)
+{
+    AppleBootPhase *phase;
+    AppleBootPhase new_phase = { .name = name };
+
+    for (guint i = 0; i < boot_profile.phases->len; i++) {
+        phase = &g_array_index(boot_profile.phases, AppleBootPhase, i);
+        if (phase->name == name || g_str_equal(phase->name, name)) {
+            return phase;
+        }
+    }
+
+    g_array_append_val(boot_profile.phases, new_phase);
+    return &g_array_index(boot_profile.phases, AppleBootPhase,
+                          boot_profile.phases->len - 1);
+}
+
+void apple_boot_phase_begin(const char *name)
+{
+    AppleBootPhase *phase;
+
+    trace_apple_boot_phase_begin(name);
+    if (!boot_profile.enabled) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&boot_profile.phases_lock);
+    phase = boot_profile_phase(name);
+    if (phase->depth++ == 0) {
+        phase->start_ns = boot_profile_now();
+    }
+}
+
+void apple_boot_phase_end(const char *name)
+{
+    AppleBootPhase *phase;
+    int64_t elapsed;
+
+    if (!boot_profile.enabled) {
+        trace_apple_boot_phase_end(name, 0);
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&boot_profile.phases_lock);
+    phase = boot_profile_phase(name);
+    if (phase->depth == 0 || --phase->depth != 0) {
+        return;
+    }
+    elapsed = boot_profile_now() - phase->start_ns;
+    phase->total_ns += elapsed;
+    phase->count++;
+    trace_apple_boot_phase_end(name, elapsed);
+}
+
+static void boot_milestones_vm_state_change(void *opaque, bool running,
+                                            RunState state)
+{
+    if (running) {
+        apple_boot_milestone("guest_start");
+    }
+}
+
+static void boot_milestones_init(void)
+{
+    if (boot_milestones_seen == NULL) {
+        boot_milestones_seen = g_ptr_array_new();
+        qemu_add_vm_change_state_handler(boot_milestones_vm_state_change,
+                                         NULL);
+    }
+}
+
+void apple_boot_milestones_reset(void)
+{
+    boot_milestones_init();
+    g_ptr_array_set_size(boot_milestones_seen, 0);
+}
+
+void apple_boot_milestone(const char *name)
+{
+    AppleBootMilestone *milestone;
+    AppleBootMilestone new_milestone = { .name = name };
+
+    boot_milestones_init();
+    for (guint i = 0; i < boot_milestones_seen->len; i++) {
+        if (g_str_equal(g_ptr_array_index(boot_milestones_seen, i), name)) {
+            return;
+        }
+    }
+    g_ptr_array_add(boot_milestones_seen, (gpointer)name);
+    qapi_event_send_apple_boot_milestone(name);
+
+    if (!boot_profile.enabled) {
+        trace_apple_boot_milestone(name, 0);
+        return;
+    }
+
+    for (guint i = 0; i < boot_profile.milestones->len; i++) {
+        milestone =
+            &g_array_index(boot_profile.milestones, AppleBootMilestone, i);
+        if (g_str_equal(milestone->name, name)) {
+            return;
+        }
+    }
+
+    new_milestone.at_ns = boot_profile_now() - boot_profile.start_ns;
+    new_milestone.insns = icount_enabled() ? icount_get_raw() : -1;
+    g_array_append_val(boot_profile.milestones, new_milestone);
+    trace_apple_boot_milestone(name, new_milestone.at_ns);
+}
+
+void apple_boot_console_line(void *opaque, const char *line)
+{
+    for (int i = 0; i < ARRAY_SIZE(boot_profile_console_milestones); i++) {
+        if (strstr(line, boot_profile_console_milestones[i].needle)) {
+            apple_boot_milestone(boot_profile_console_milestones[i].milestone);
+        }
+    }
+}
+
+static void boot_profile_report(Notifier *notifier, void *data)
+{
+    AppleBootPhase *phase;
+    AppleBootMilestone *milestone;
+
+    info_report("Boot profile (host wall-clock, phases are inclusive):");
+    for (guint i = 0; i < boot_profile.phases->len; i++) {
+        phase = &g_array_index(boot_profile.phases, AppleBootPhase, i);
+        info_report("  %-24s %10.3f ms in %u call(s)", phase->name,
+                    phase->total_ns / (double)SCALE_MS, phase->count);
+    }
+    for (guint i = 0; i < boot_profile.milestones->len; i++) {
+        milestone =
+            &g_array_index(boot_profile.milestones, AppleBootMilestone, i);
+        if (milestone->insns < 0) {
+            info_report("  %-24s at %10.3f ms", milestone->name,
+                        milestone->at_ns / (double)SCALE_MS);
+        } else {
+            info_report("  %-24s at %10.3f ms, %" PRId64 " insns",
+                        milestone->name, milestone->at_ns / (double)SCALE_MS,
+                        milestone->insns);
+        }
+    }
+}
+
+void apple_boot_profile_enable(void)
+{
+    if (boot_profile.enabled) {
+        return;
+    }
+
+    boot_profile.enabled = true;
+    boot_profile.start_ns = boot_profile_now();
+    qemu_mutex_init(&boot_profile.phases_lock);
+    boot_profile.phases = g_array_new(FALSE, TRUE, sizeof(AppleBootPhase));
+    boot_profile.milestones =
+        g_array_new(FALSE, TRUE, sizeof(AppleBootMilestone));
+    boot_profile.exit_notifier.notify = boot_profile_report;
+    qemu_add_exit_notifier(&boot_profile.exit_notifier);
+}
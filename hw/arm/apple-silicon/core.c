@@ -0,0 +1,107 @@
+/*
+ * Apple CPU core power control, shared by the A9 and A13.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/core.h"
+#include "qemu/error-report.h"
+#include "sysemu/tcg.h"
+#include "arm-powerctl.h"
+#include "target/arm/cpu-features.h"
+
+bool apple_core_is_sleep(ARMCPU *cpu)
+{
+    return qatomic_read(&CPU(cpu)->halted);
+}
+
+bool apple_core_is_powered_off(ARMCPU *cpu)
+{
+    return cpu->power_state == PSCI_OFF;
+}
+
+void apple_core_reset(ARMCPU *cpu, bool *reset_clean)
+{
+    /* Resets on the way to power-on are followed by running. */
+    *reset_clean = cpu->power_state == PSCI_OFF;
+}
+
+static void apple_core_wake_work(CPUState *cs, run_on_cpu_data data)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+    CPUARMState *env = &cpu->env;
+
+    /* The machine may have moved these since the reset sampled them. */
+    env->cp15.rvbar = cpu->rvbar_prop;
+    env->pc = env->cp15.rvbar;
+    if (cpu_isar_feature(aa64_pauth, cpu)) {
+        env->keys.m.lo = cpu->m_key_lo;
+        env->keys.m.hi = cpu->m_key_hi;
+    }
+    *(bool *)data.host_ptr = false;
+    cs->halted = 0;
+    cpu->power_state = PSCI_ON;
+}
+
+/*
+ * A core that has not run since its last reset is still in reset state, so
+ * it only needs its reset vector re-sampled to start. Resetting it again
+ * would redo every cpreg reset and flush TLBs that are already empty.
+ */
+void apple_core_start(ARMCPU *cpu, bool *reset_clean)
+{
+    int ret = QEMU_ARM_POWERCTL_RET_SUCCESS;
+
+    if (cpu->power_state == PSCI_OFF && *reset_clean) {
+        cpu->power_state = PSCI_ON_PENDING;
+        async_run_on_cpu(CPU(cpu), apple_core_wake_work,
+                         RUN_ON_CPU_HOST_PTR(reset_clean));
+    } else if (cpu->power_state != PSCI_ON) {
+        ret = arm_set_cpu_on_and_reset(cpu->mp_affinity);
+    }
+
+    if (ret != QEMU_ARM_POWERCTL_RET_SUCCESS) {
+        error_report("Failed to bring up CPU %d: err %d", CPU(cpu)->cpu_index,
+                     ret);
+    }
+}
+
+void apple_core_init_features(ARMCPU *cpu)
+{
+    if (tcg_enabled()) {
+        /* XNU's spinlocks wait in WFE and wake each other with SEV. */
+        set_feature(&cpu->env, ARM_FEATURE_WFE_EVENT);
+    }
+}
+
+void apple_core_post_load(bool *reset_clean)
+{
+    /* Whatever the source ran is unknown here, take the full reset. */
+    *reset_clean = false;
+}
+
+void apple_core_off(ARMCPU *cpu)
+{
+    int ret = QEMU_ARM_POWERCTL_RET_SUCCESS;
+
+    if (cpu->power_state != PSCI_OFF) {
+        ret = arm_set_cpu_off(cpu->mp_affinity);
+    }
+
+    if (ret != QEMU_ARM_POWERCTL_RET_SUCCESS) {
+        error_report("%s: failed to turn off CPU %d: err %d", __func__,
+                     CPU(cpu)->cpu_index, ret);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef HW_ARM_APPLE_SILICON_DART_PTW_H
+#define HW_ARM_APPLE_SILICON_DART_PTW_H
+
+#include "qemu/bitops.h"
+
+#define DART_TTE_NO_WRITE (1 << 7)
+#define DART_TTE_NO_READ (1 << 8)
+#define DART_TTE_AP_MASK (3 << 7)
+#define DART_TTE_VALID (1 << 0)
+#define DART_TTE_TYPE_TABLE (1 << 0)
+#define DART_TTE_TYPE_BLOCK (3 << 0)
+#define DART_TTE_TYPE_MASK (0x3)
+#define DART_TTE_ADDR_MASK (0xFFFFFFFFFFull)
+
+/* Upper bound on L2 PTEs coalesced into one translation. */
+#define DART_PTW_SPAN_PTES (64)
+
+/*
+ * Both granules walk three levels over page numbers: the TTBR picked by
+ * the top two bits, then L1 and L2 tables of one page of 8-byte PTEs.
+ */
+#define DART_PTW_LEVEL_BITS(page_shift) ((page_shift) - 3)
+#define DART_PTW_SHIFT(page_shift, level) \
+    ((2 - (level)) * DART_PTW_LEVEL_BITS(page_shift))
+#define DART_PTW_INDEX(page_shift, level, iova)              \
+    (((iova) >> DART_PTW_SHIFT(page_shift, level)) &         \
+     ((level) ? MAKE_64BIT_MASK(0, DART_PTW_LEVEL_BITS(page_shift)) : 3))
+#define DART_PTW_TABLE(page_shift, pte) \
+    ((pte) & ~MAKE_64BIT_MASK(0, page_shift) & DART_TTE_ADDR_MASK)
+
+/*
+ * Page number of the first page whose L2 PTE is in the naturally aligned
+ * window fetched around `iova`, itself a page number. The window stays
+ * within one L2 table, so the L0/L1 bits are those of `iova`.
+ */
+static inline uint64_t apple_dart_ptw_window(uint64_t iova)
+{
+    return iova & ~(uint64_t)(DART_PTW_SPAN_PTES - 1);
+}
+
+/*
+ * Find the largest naturally aligned run of L2 PTEs around ptes[idx] that
+ * maps physically contiguous, equally aligned memory with the same
+ * permissions, and return it as an address mask.
+ */
+static inline QEMU_ALWAYS_INLINE uint64_t
+apple_dart_ptw_span(const uint64_t *ptes, uint32_t idx, unsigned page_shift)
+{
+    const uint64_t attr_mask = DART_TTE_AP_MASK | DART_TTE_VALID;
+    uint32_t n;
+
+    for (n = 2; n <= DART_PTW_SPAN_PTES; n <<= 1) {
+        uint32_t start = idx & ~(n - 1);
+        uint64_t base = DART_PTW_TABLE(page_shift, ptes[start]);
+
+        if (base & (((uint64_t)n << page_shift) - 1)) {
+            break;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t pte = ptes[start + i];
+
+            if (((pte ^ ptes[idx]) & attr_mask) != 0 ||
+                DART_PTW_TABLE(page_shift, pte) !=
+                    base + ((uint64_t)i << page_shift)) {
+                goto done;
+            }
+        }
+    }
+
+done:
+    return ((uint64_t)(n >> 1) << page_shift) - 1;
+}
+
+#endif /* HW_ARM_APPLE_SILICON_DART_PTW_H */
@@ -1,15 +1,23 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dart.h"
+#include "hw/arm/apple-silicon/dart-ptw.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/stats.h"
 #include "hw/irq.h"
 #include "hw/sysbus.h"
 #include "migration/vmstate.h"
 #include "monitor/hmp-target.h"
 #include "monitor/monitor.h"
+#include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qemu/stats64.h"
 #include "qemu/bitops.h"
 #include "qemu/module.h"
+#include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 #include "sysemu/dma.h"
+#include "sysemu/runstate.h"
+#include "sysemu/stats.h"
 
 // #define DEBUG_DART
 
@@ -75,18 +83,9 @@
 #define DART_TTBR_SHIFT 12
 #define DART_TTBR_MASK 0xFFFFFFF
 
-#define DART_TTE_NO_WRITE (1 << 7)
-#define DART_TTE_NO_READ (1 << 8)
-#define DART_TTE_AP_MASK (3 << 7)
-#define DART_TTE_VALID (1 << 0)
-#define DART_TTE_TYPE_TABLE (1 << 0)
-#define DART_TTE_TYPE_BLOCK (3 << 0)
-#define DART_TTE_TYPE_MASK (0x3)
-#define DART_TTE_ADDR_MASK (0xFFFFFFFFFFull)
-
-#define DART_IOTLB_SID_SHIFT (53)
-#define DART_IOTLB_SID(_x) (((_x) & 0xfull) << 53)
-#define DART_IOTLB_SID_EX(_x) (((_x) >> 53) & 0xf)
+#define DART_IOTLB_SETS (64)
+#define DART_IOTLB_WAYS (4)
+#define DART_IOTLB_VALID (1ULL << 63)
 
 typedef enum {
     DART_UNKNOWN = 0,
@@ -102,17 +101,76 @@ static const char *dart_instance_name[] = {
     [DART_DAPF] = "DAPF",
 };
 
+typedef enum {
+    DART_STAT_TRANSLATIONS = 0,
+    DART_STAT_TLB_HITS,
+    DART_STAT_TLB_MISSES,
+    DART_STAT_PTW_READS,
+    DART_STAT_FAULT_TTBR_INVLD,
+    DART_STAT_FAULT_L2E_INVLD,
+    DART_STAT_FAULT_PTE_INVLD,
+    DART_STAT_FAULT_READ_PROT,
+    DART_STAT_FAULT_WRITE_PROT,
+    DART_STAT_INVALIDATIONS,
+    DART_STAT__MAX,
+} dart_stat_t;
+
+static const char *dart_stat_name[DART_STAT__MAX] = {
+    [DART_STAT_TRANSLATIONS] = "translations",
+    [DART_STAT_TLB_HITS] = "tlb-hits",
+    [DART_STAT_TLB_MISSES] = "tlb-misses",
+    [DART_STAT_PTW_READS] = "ptw-reads",
+    [DART_STAT_FAULT_TTBR_INVLD] = "faults-ttbr-invalid",
+    [DART_STAT_FAULT_L2E_INVLD] = "faults-l2e-invalid",
+    [DART_STAT_FAULT_PTE_INVLD] = "faults-pte-invalid",
+    [DART_STAT_FAULT_READ_PROT] = "faults-read-prot",
+    [DART_STAT_FAULT_WRITE_PROT] = "faults-write-prot",
+    [DART_STAT_INVALIDATIONS] = "invalidations",
+};
+
 typedef struct AppleDARTTLBEntry {
+    QemuSeqLock seq;
+    uint64_t tag;
     hwaddr block_addr;
+    hwaddr addr_mask;
     IOMMUAccessFlags perm;
+    uint32_t lru;
 } AppleDARTTLBEntry;
 
+typedef struct AppleDARTTLBSet {
+    AppleDARTTLBEntry ways[DART_IOTLB_WAYS];
+    uint32_t clock;
+} AppleDARTTLBSet;
+
+/*
+ * One IOTLB generation for a single SID. Readers look entries up under
+ * RCU without taking the instance mutex; fills and guest flushes happen
+ * with the mutex held and are published entry by entry through the
+ * per-entry seqlock. Reset and migration replace the whole generation.
+ */
+typedef struct AppleDARTTLB {
+    struct rcu_head rcu;
+    AppleDARTTLBSet sets[DART_IOTLB_SETS];
+    /* Walk state, only touched with the instance mutex held. */
+    uint64_t l2_tag;
+    hwaddr l2_table;
+    uint64_t last_miss;
+    /*
+     * Pages covered by every translation filled since the last flush,
+     * empty when first > last. Mutex held.
+     */
+    uint64_t first;
+    uint64_t last;
+} AppleDARTTLB;
+
 typedef struct AppleDARTInstance AppleDARTInstance;
 
 typedef struct AppleDARTIOMMUMemoryRegion {
     IOMMUMemoryRegion parent_obj;
     AppleDARTInstance *o;
     uint32_t sid;
+    IOMMUNotifierFlag notifier_flags;
+    Stat64 stats[DART_STAT__MAX];
 } AppleDARTIOMMUMemoryRegion;
 
 struct AppleDARTInstance {
@@ -147,10 +205,24 @@ struct AppleDARTInstance {
     };
 #pragma pack(pop)
 
-    GHashTable *tlb;
+    AppleDARTTLB *tlb[DART_MAX_STREAMS];
     QemuMutex mutex;
+    /*
+     * Streams whose remap, TCR or TTBR changed since their last flush.
+     * That may change translations that were never filled into the IOTLB
+     * (bypass), so their next flush covers the whole IOVA space.
+     */
+    uint32_t flush_all_mask;
+    /* Streams that bypass translation, read without the mutex. */
+    uint32_t bypass_mask;
+    /* Loaded state whose MAP notifiers still have to be replayed. */
+    bool replay_pending;
 };
 
+typedef bool AppleDARTPTWFn(AppleDARTIOMMUMemoryRegion *iommu, uint32_t sid,
+                            hwaddr iova, AppleDARTTLBEntry *tlb_entry,
+                            uint32_t *error_status);
+
 struct AppleDARTState {
     SysBusDevice parent_obj;
     char name[0x20];
@@ -163,9 +235,12 @@ struct AppleDARTState {
     uint64_t page_bits;
     uint32_t l_mask[3];
     uint32_t l_shift[3];
+    /* The page table walker specialized for page_shift. */
+    AppleDARTPTWFn *ptw;
     uint32_t sids;
     uint32_t bypass;
     uint64_t bypass_address;
+    VMChangeStateEntry *vmse;
 };
 
 static int apple_dart_device_list(Object *obj, void *opaque)
@@ -188,18 +263,147 @@ static GSList *apple_dart_get_device_list(void)
     return list;
 }
 
-static gboolean apple_dart_tlb_remove_by_sid_mask(gpointer key, gpointer value,
-                                                  gpointer user_data)
+static AppleDARTTLB *apple_dart_tlb_new(void)
+{
+    AppleDARTTLB *tlb = g_new0(AppleDARTTLB, 1);
+
+    tlb->first = UINT64_MAX;
+    return tlb;
+}
+
+/* Must be called with the instance mutex held. */
+static void apple_dart_tlb_remove_by_sid_mask(AppleDARTInstance *o,
+                                              uint64_t sid_mask)
+{
+    for (int i = 0; i < DART_MAX_STREAMS; i++) {
+        AppleDARTTLB *old;
+
+        if ((sid_mask & (1ULL << i)) == 0) {
+            continue;
+        }
+        old = o->tlb[i];
+        qatomic_rcu_set(&o->tlb[i], apple_dart_tlb_new());
+        if (old) {
+            g_free_rcu(old, rcu);
+        }
+    }
+}
+
+/*
+ * Drop the entries for pages `first` to `last` in place, visiting only
+ * the sets those pages index, and forget the cached L2 table.
+ * Must be called with the instance mutex held.
+ */
+static void apple_dart_tlb_invalidate_range(AppleDARTTLB *tlb, uint64_t first,
+                                            uint64_t last)
 {
-    hwaddr va = (hwaddr)key;
-    uint64_t sid_mask = *(uint64_t *)user_data;
+    uint64_t n = MIN(last - first + 1, DART_IOTLB_SETS);
+
+    for (uint64_t i = 0; i < n; i++) {
+        AppleDARTTLBSet *set = &tlb->sets[(first + i) & (DART_IOTLB_SETS - 1)];
+
+        for (int j = 0; j < DART_IOTLB_WAYS; j++) {
+            AppleDARTTLBEntry *tlb_entry = &set->ways[j];
+            uint64_t page = tlb_entry->tag & ~DART_IOTLB_VALID;
 
-    if ((1ULL << DART_IOTLB_SID_EX(va)) & sid_mask) {
-        return true;
+            if ((tlb_entry->tag & DART_IOTLB_VALID) == 0 || page < first ||
+                page > last) {
+                continue;
+            }
+            seqlock_write_begin(&tlb_entry->seq);
+            tlb_entry->tag = 0;
+            seqlock_write_end(&tlb_entry->seq);
+        }
+    }
+    tlb->l2_tag = 0;
+    tlb->last_miss = 0;
+}
+
+/* Must be called within an RCU read-side critical section. */
+static bool apple_dart_tlb_lookup(AppleDARTTLB *tlb, uint64_t iova,
+                                  AppleDARTTLBEntry *out)
+{
+    AppleDARTTLBSet *set = &tlb->sets[iova & (DART_IOTLB_SETS - 1)];
+    uint64_t tag = iova | DART_IOTLB_VALID;
+
+    for (int i = 0; i < DART_IOTLB_WAYS; i++) {
+        AppleDARTTLBEntry *tlb_entry = &set->ways[i];
+        unsigned start;
+        bool hit;
+
+        do {
+            start = seqlock_read_begin(&tlb_entry->seq);
+            hit = tlb_entry->tag == tag;
+            if (hit) {
+                out->block_addr = tlb_entry->block_addr;
+                out->addr_mask = tlb_entry->addr_mask;
+                out->perm = tlb_entry->perm;
+            }
+        } while (seqlock_read_retry(&tlb_entry->seq, start));
+
+        if (hit) {
+            qatomic_set(&tlb_entry->lru, qatomic_inc_fetch(&set->clock));
+            return true;
+        }
     }
     return false;
 }
 
+/*
+ * Install `walk` for `iova`, preferring an invalid way and otherwise
+ * evicting the least recently used entry of the set.
+ * Must be called with the instance mutex held.
+ */
+static void apple_dart_tlb_insert(AppleDARTTLB *tlb, uint64_t iova,
+                                  const AppleDARTTLBEntry *walk)
+{
+    AppleDARTTLBSet *set = &tlb->sets[iova & (DART_IOTLB_SETS - 1)];
+    AppleDARTTLBEntry *victim = &set->ways[0];
+
+    for (int i = 0; i < DART_IOTLB_WAYS; i++) {
+        AppleDARTTLBEntry *tlb_entry = &set->ways[i];
+
+        if ((tlb_entry->tag & DART_IOTLB_VALID) == 0) {
+            victim = tlb_entry;
+            break;
+        }
+        if ((int32_t)(qatomic_read(&tlb_entry->lru) -
+                      qatomic_read(&victim->lru)) < 0) {
+            victim = tlb_entry;
+        }
+    }
+
+    /* Coalesced runs are aligned and at most DART_PTW_SPAN_PTES long. */
+    tlb->first = MIN(tlb->first, iova & ~(uint64_t)(DART_PTW_SPAN_PTES - 1));
+    tlb->last = MAX(tlb->last, iova | (DART_PTW_SPAN_PTES - 1));
+
+    seqlock_write_begin(&victim->seq);
+    victim->tag = iova | DART_IOTLB_VALID;
+    victim->block_addr = walk->block_addr;
+    victim->addr_mask = walk->addr_mask;
+    victim->perm = walk->perm;
+    seqlock_write_end(&victim->seq);
+    qatomic_set(&victim->lru, qatomic_inc_fetch(&set->clock));
+}
+
+/*
+ * Latch a fault for `sid` into the error registers. Returns true when
+ * error_status changed and the interrupt line needs re-evaluating.
+ */
+static bool apple_dart_record_error(AppleDARTInstance *o, uint32_t sid,
+                                    hwaddr addr, uint32_t status)
+{
+    uint32_t old;
+
+    QEMU_LOCK_GUARD(&o->mutex);
+    old = o->error_status;
+    o->error_status |= status;
+    o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
+                                DART_ERROR_STREAM_LENGTH, sid);
+    o->error_address = addr;
+    return o->error_status != old;
+}
+
 static void apple_dart_update_irq(AppleDARTState *s)
 {
     int level = 0;
@@ -214,25 +418,112 @@ static void apple_dart_update_irq(AppleDARTState *s)
 #endif /* DEBUG_DART */
 }
 
+static void apple_dart_notify_map(AppleDARTIOMMUMemoryRegion *iommu);
+
+/* Streams the remap table currently routes to `sid`. */
+static uint32_t apple_dart_streams_of(AppleDARTInstance *o, uint32_t sid)
+{
+    uint32_t streams = 0;
+
+    for (int i = 0; i < DART_MAX_STREAMS; i++) {
+        if ((o->remap[i] & 0xf) == sid) {
+            streams |= 1 << i;
+        }
+    }
+    return streams;
+}
+
+/*
+ * Recompute which streams bypass translation, for apple_dart_translate()
+ * to check without the mutex. Must be called with the instance mutex held.
+ */
+static void apple_dart_update_bypass(AppleDARTInstance *o)
+{
+    uint32_t bypass_mask = 0;
+
+    for (int i = 0; i < DART_MAX_STREAMS; i++) {
+        uint32_t sid = o->remap[i] & 0xf;
+
+        if ((o->s->bypass & (1 << sid)) ||
+            (o->tcr[sid] & DART_TCR_TXEN) == 0 ||
+            (o->tcr[sid] & DART_TCR_BYPASS_DART)) {
+            bypass_mask |= 1 << i;
+        }
+    }
+    qatomic_set(&o->bypass_mask, bypass_mask);
+}
+
+/*
+ * Carry out a guest flush of stream `sid`. The hardware drops everything
+ * the stream has cached, but only the pages filled since its last flush
+ * can be cached here or by the users of those translations, so only they
+ * are invalidated and notified. Shadowing consumers hold whatever the
+ * last replay gave them and still get the whole space again.
+ * Must be called with the instance mutex held.
+ */
+static void apple_dart_tlb_flush(AppleDARTInstance *o, uint32_t sid)
+{
+    AppleDARTIOMMUMemoryRegion *iommu = o->iommus[sid];
+    AppleDARTTLB *tlb = o->tlb[sid];
+    IOMMUTLBEvent event = {
+        .type = IOMMU_NOTIFIER_UNMAP,
+        .entry.target_as = &address_space_memory,
+        .entry.perm = IOMMU_NONE,
+    };
+    hwaddr iova, end;
+
+    if (iommu) {
+        stat64_add(&iommu->stats[DART_STAT_INVALIDATIONS], 1);
+    }
+
+    if ((o->flush_all_mask & (1 << sid)) ||
+        (iommu && (iommu->notifier_flags & IOMMU_NOTIFIER_MAP))) {
+        o->flush_all_mask &= ~(1 << sid);
+        if (iommu) {
+            event.entry.iova = 0;
+            event.entry.addr_mask = ~(hwaddr)0;
+            memory_region_notify_iommu(IOMMU_MEMORY_REGION(iommu), 0, event);
+        }
+        apple_dart_tlb_remove_by_sid_mask(o, 1ULL << sid);
+        if (iommu && (iommu->notifier_flags & IOMMU_NOTIFIER_MAP)) {
+            apple_dart_notify_map(iommu);
+        }
+        return;
+    }
+
+    if (tlb->first > tlb->last) {
+        return;
+    }
+    if (iommu) {
+        iova = tlb->first << o->s->page_shift;
+        end = ((tlb->last + 1) << o->s->page_shift) - 1;
+        while (iova < end) {
+            event.entry.iova = iova;
+            event.entry.addr_mask =
+                dma_aligned_pow2_mask(iova, end, DART_MAX_VA_BITS);
+            memory_region_notify_iommu(IOMMU_MEMORY_REGION(iommu), 0, event);
+            iova += event.entry.addr_mask + 1;
+        }
+    }
+    apple_dart_tlb_invalidate_range(tlb, tlb->first, tlb->last);
+    tlb->first = UINT64_MAX;
+    tlb->last = 0;
+}
+
 static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
                            unsigned size)
 {
     AppleDARTInstance *o = (AppleDARTInstance *)opaque;
     AppleDARTState *s = o->s;
-    uint32_t orig;
     uint32_t val = data;
-    bool iflg = 0;
     DPRINTF("%s[%d]: (%s) %s @ 0x" HWADDR_FMT_plx " value: 0x" HWADDR_FMT_plx
             "\n",
             s->name, o->id, dart_instance_name[o->type], __func__, addr, data);
 
-    orig = o->base_reg[addr >> 2];
-
     if (o->type == DART_DART) {
         switch (addr) {
         case DART_TLB_OP:
             if (val & DART_TLB_OP_INVALIDATE) {
-                IOMMUTLBEvent event;
                 uint64_t sid_mask = o->sid_mask;
                 int i;
 
@@ -243,20 +534,10 @@ static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
                 qemu_mutex_lock(&o->mutex);
 
                 for (i = 0; i < DART_MAX_STREAMS; i++) {
-                    if ((sid_mask & (1ULL << i)) && o->iommus[i]) {
-                        event.type = IOMMU_NOTIFIER_UNMAP;
-                        event.entry.target_as = &address_space_memory;
-                        event.entry.iova = 0;
-                        event.entry.perm = IOMMU_NONE;
-                        event.entry.addr_mask = ~(hwaddr)0;
-
-                        memory_region_notify_iommu(
-                            IOMMU_MEMORY_REGION(o->iommus[i]), 0, event);
+                    if (sid_mask & (1ULL << i)) {
+                        apple_dart_tlb_flush(o, i);
                     }
                 }
-
-                g_hash_table_foreach_remove(
-                    o->tlb, apple_dart_tlb_remove_by_sid_mask, &sid_mask);
                 val &= ~(DART_TLB_OP_INVALIDATE | DART_TLB_OP_BUSY);
                 qatomic_and(&o->tlb_op,
                             ~(DART_TLB_OP_INVALIDATE | DART_TLB_OP_BUSY));
@@ -265,15 +546,39 @@ static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
             }
             break;
         case DART_ERROR_STATUS:
-            val = orig & (~val);
-            iflg = 1;
+            WITH_QEMU_LOCK_GUARD(&o->mutex)
+            {
+                o->error_status &= ~val;
+            }
+            apple_dart_update_irq(s);
+            return;
+        case DART_SID_REMAP(0) ... DART_SID_REMAP(4) - 1:
+            WITH_QEMU_LOCK_GUARD(&o->mutex)
+            {
+                o->flush_all_mask = MAKE_64BIT_MASK(0, DART_MAX_STREAMS);
+                o->base_reg[addr >> 2] = val;
+                apple_dart_update_bypass(o);
+            }
+            return;
+        case DART_TCR(0) ... DART_TCR(DART_MAX_STREAMS) - 1:
+            WITH_QEMU_LOCK_GUARD(&o->mutex)
+            {
+                o->flush_all_mask |=
+                    apple_dart_streams_of(o, (addr - DART_TCR(0)) / 4);
+                o->base_reg[addr >> 2] = val;
+                apple_dart_update_bypass(o);
+            }
+            return;
+        case DART_TTBR(0, 0) ... DART_TTBR(DART_MAX_STREAMS, 0) - 1:
+            WITH_QEMU_LOCK_GUARD(&o->mutex)
+            {
+                o->flush_all_mask |=
+                    apple_dart_streams_of(o, (addr - DART_TTBR(0, 0)) / 16);
+            }
             break;
         }
     }
     o->base_reg[addr >> 2] = val;
-    if (iflg) {
-        apple_dart_update_irq(s);
-    }
 }
 
 static uint64_t base_reg_read(void *opaque, hwaddr addr, unsigned size)
@@ -305,17 +610,71 @@ static const MemoryRegionOps base_reg_ops = {
     .valid.unaligned = false,
 };
 
-static AppleDARTTLBEntry *apple_dart_ptw(AppleDARTInstance *o, uint32_t sid,
-                                         hwaddr iova, uint32_t *error_status)
+/*
+ * Fill the IOTLB from the PTE window fetched for a sequential miss, one
+ * entry per coalesced run following the one that was just walked.
+ */
+static inline QEMU_ALWAYS_INLINE void
+apple_dart_ptw_prefetch(AppleDARTTLB *tlb, const uint64_t *ptes,
+                        uint64_t window, uint32_t idx, uint64_t addr_mask,
+                        unsigned page_shift)
 {
-    AppleDARTState *s = o->s;
+    uint32_t span = (addr_mask >> page_shift) + 1;
+    uint32_t i = (idx & ~(span - 1)) + span;
+
+    while (i < DART_PTW_SPAN_PTES) {
+        AppleDARTTLBEntry walk;
+        uint64_t pte = ptes[i];
+
+        if ((pte & DART_TTE_VALID) == 0) {
+            i++;
+            continue;
+        }
+        walk.addr_mask = apple_dart_ptw_span(ptes, i, page_shift);
+        walk.block_addr = DART_PTW_TABLE(page_shift, pte) & ~walk.addr_mask;
+        walk.perm = IOMMU_ACCESS_FLAG(!(pte & DART_TTE_NO_READ),
+                                      !(pte & DART_TTE_NO_WRITE));
+        apple_dart_tlb_insert(tlb, window + i, &walk);
+        i += (walk.addr_mask >> page_shift) + 1;
+    }
+}
 
-    uint64_t idx = (iova & (s->l_mask[0])) >> s->l_shift[0];
-    uint64_t pte, pa;
-    int level;
-    AppleDARTTLBEntry *tlb_entry = NULL;
+/*
+ * Walk the tables of `sid` (after remapping) on behalf of `iommu`.
+ * Instantiated per granule below, so that every shift and mask is a
+ * constant. Must be called with the instance mutex held.
+ */
+static inline QEMU_ALWAYS_INLINE bool
+apple_dart_ptw_common(AppleDARTIOMMUMemoryRegion *iommu, uint32_t sid,
+                      hwaddr iova, AppleDARTTLBEntry *tlb_entry,
+                      uint32_t *error_status, unsigned page_shift)
+{
+    AppleDARTInstance *o = iommu->o;
+    AppleDARTTLB *tlb = o->tlb[iommu->sid];
+
+    uint64_t idx = DART_PTW_INDEX(page_shift, 0, iova);
+    uint64_t ptes[DART_PTW_SPAN_PTES];
+    uint64_t pte, pa, first, l2_tag;
+    bool found = false;
+    bool sequential;
     uint32_t err_status = 0;
 
+    /* A miss shortly after the previous one is treated as a stream. */
+    sequential = iova > tlb->last_miss &&
+                 iova - tlb->last_miss <= DART_PTW_SPAN_PTES;
+    tlb->last_miss = iova;
+
+    /*
+     * The L0/L1 indices and the SID after remapping select the L2 table;
+     * skip the L1 read while a stream keeps missing in the same table.
+     */
+    l2_tag = (iova >> DART_PTW_SHIFT(page_shift, 1)) |
+             ((uint64_t)sid << 56) | DART_IOTLB_VALID;
+    if (tlb->l2_tag == l2_tag) {
+        pa = tlb->l2_table;
+        goto l2;
+    }
+
     if ((idx >= DART_MAX_TTBR) ||
         ((o->ttbr[sid][idx] & DART_TTBR_VALID) == 0)) {
         err_status = (DART_ERROR_FLAG | DART_ERROR_TTBR_INVLD);
@@ -325,42 +684,101 @@ static AppleDARTTLBEntry *apple_dart_ptw(AppleDARTInstance *o, uint32_t sid,
     pte = o->ttbr[sid][idx];
     pa = (pte & DART_TTBR_MASK) << DART_TTBR_SHIFT;
 
-    for (level = 1; level < 3; level++) {
-        idx = (iova & (s->l_mask[level])) >> s->l_shift[level];
-        pa += 8 * idx;
+    idx = DART_PTW_INDEX(page_shift, 1, iova);
+    pa += 8 * idx;
 
-        if (dma_memory_read(&address_space_memory, pa, &pte, sizeof(pte),
-                            MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
-            err_status = (DART_ERROR_FLAG | DART_ERROR_L2E_INVLD);
-            pa = 0;
-            pte = 0;
-            break;
-        }
-        DPRINTF("%s: level: %d, pa: 0x" HWADDR_FMT_plx " pte: 0x%llx(0x%llx)\n",
-                __func__, level, pa, pte, idx);
+    stat64_add(&iommu->stats[DART_STAT_PTW_READS], 1);
+    if (dma_memory_read(&address_space_memory, pa, &pte, sizeof(pte),
+                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        err_status = (DART_ERROR_FLAG | DART_ERROR_L2E_INVLD);
+        goto end;
+    }
+    DPRINTF("%s: level: 1, pa: 0x" HWADDR_FMT_plx " pte: 0x%llx(0x%llx)\n",
+            __func__, pa, pte, idx);
 
-        if ((pte & DART_TTE_VALID) == 0) {
-            err_status = (DART_ERROR_FLAG | DART_ERROR_PTE_INVLD);
-            pa = 0;
-            pte = 0;
-            break;
-        }
-        pa = pte & s->page_mask & DART_TTE_ADDR_MASK;
+    if ((pte & DART_TTE_VALID) == 0) {
+        err_status = (DART_ERROR_FLAG | DART_ERROR_PTE_INVLD);
+        goto end;
+    }
+    pa = DART_PTW_TABLE(page_shift, pte);
+    tlb->l2_tag = l2_tag;
+    tlb->l2_table = pa;
+
+l2:
+    /*
+     * Fetch the naturally aligned window of L2 PTEs around the leaf in a
+     * single read so that contiguous runs can be returned as one mapping.
+     */
+    idx = DART_PTW_INDEX(page_shift, 2, iova);
+    first = idx & ~(uint64_t)(DART_PTW_SPAN_PTES - 1);
+
+    stat64_add(&iommu->stats[DART_STAT_PTW_READS], 1);
+    if (dma_memory_read(&address_space_memory, pa + 8 * first, ptes,
+                        sizeof(ptes), MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        err_status = (DART_ERROR_FLAG | DART_ERROR_L2E_INVLD);
+        goto end;
     }
+    pte = ptes[idx - first];
+    DPRINTF("%s: level: 2, pa: 0x" HWADDR_FMT_plx " pte: 0x%llx(0x%llx)\n",
+            __func__, pa + 8 * idx, pte, idx);
 
-    if ((pte & DART_TTE_VALID)) {
-        tlb_entry = g_new0(AppleDARTTLBEntry, 1);
-        tlb_entry->block_addr = (pte & s->page_mask & DART_TTE_ADDR_MASK);
-        tlb_entry->perm = IOMMU_ACCESS_FLAG(!(pte & DART_TTE_NO_READ),
-                                            !(pte & DART_TTE_NO_WRITE));
-    } else {
+    if ((pte & DART_TTE_VALID) == 0) {
         err_status = (DART_ERROR_FLAG | DART_ERROR_PTE_INVLD);
+        goto end;
+    }
+
+    found = true;
+    tlb_entry->addr_mask = apple_dart_ptw_span(ptes, idx - first, page_shift);
+    tlb_entry->block_addr =
+        DART_PTW_TABLE(page_shift, pte) & ~tlb_entry->addr_mask;
+    tlb_entry->perm = IOMMU_ACCESS_FLAG(!(pte & DART_TTE_NO_READ),
+                                        !(pte & DART_TTE_NO_WRITE));
+
+    if (sequential) {
+        apple_dart_ptw_prefetch(tlb, ptes, apple_dart_ptw_window(iova),
+                                idx - first, tlb_entry->addr_mask, page_shift);
     }
 end:
     if (error_status) {
         *error_status = err_status;
     }
-    return tlb_entry;
+    return found;
+}
+
+static bool apple_dart_ptw_4k(AppleDARTIOMMUMemoryRegion *iommu, uint32_t sid,
+                              hwaddr iova, AppleDARTTLBEntry *tlb_entry,
+                              uint32_t *error_status)
+{
+    return apple_dart_ptw_common(iommu, sid, iova, tlb_entry, error_status,
+                                 12);
+}
+
+static bool apple_dart_ptw_16k(AppleDARTIOMMUMemoryRegion *iommu, uint32_t sid,
+                               hwaddr iova, AppleDARTTLBEntry *tlb_entry,
+                               uint32_t *error_status)
+{
+    return apple_dart_ptw_common(iommu, sid, iova, tlb_entry, error_status,
+                                 14);
+}
+
+static void apple_dart_count_faults(AppleDARTIOMMUMemoryRegion *iommu,
+                                    uint32_t status)
+{
+    if (status & DART_ERROR_TTBR_INVLD) {
+        stat64_add(&iommu->stats[DART_STAT_FAULT_TTBR_INVLD], 1);
+    }
+    if (status & DART_ERROR_L2E_INVLD) {
+        stat64_add(&iommu->stats[DART_STAT_FAULT_L2E_INVLD], 1);
+    }
+    if (status & DART_ERROR_PTE_INVLD) {
+        stat64_add(&iommu->stats[DART_STAT_FAULT_PTE_INVLD], 1);
+    }
+    if (status & DART_ERROR_READ_PROT) {
+        stat64_add(&iommu->stats[DART_STAT_FAULT_READ_PROT], 1);
+    }
+    if (status & DART_ERROR_WRITE_PROT) {
+        stat64_add(&iommu->stats[DART_STAT_FAULT_WRITE_PROT], 1);
+    }
 }
 
 static int apple_dart_attrs_to_index(IOMMUMemoryRegion *iommu, MemTxAttrs attrs)
@@ -374,9 +792,11 @@ static IOMMUTLBEntry apple_dart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
     AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
     AppleDARTInstance *o = iommu->o;
     AppleDARTState *s = o->s;
-    AppleDARTTLBEntry *tlb_entry = NULL;
+    AppleDARTTLBEntry tlb_entry = { 0 };
     uint32_t sid = iommu->sid;
-    uint64_t iova, key;
+    uint32_t status = 0;
+    uint64_t iova;
+    bool hit = false;
 
     IOMMUTLBEntry entry = {
         .target_as = &address_space_memory,
@@ -387,66 +807,77 @@ static IOMMUTLBEntry apple_dart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
     };
 
     g_assert_cmpuint(sid, <, DART_MAX_STREAMS);
-    qemu_mutex_lock(&o->mutex);
-    sid = o->remap[sid] & 0xf;
 
-    if (s->bypass & (1 << sid)) {
-        goto end;
-    }
+    /*
+     * Bypassed streams, and streams with translation disabled, go to the
+     * bypass address, not an error. Hand out the largest aligned block of
+     * the aperture around `addr` so callers rarely come back.
+     */
+    if (qatomic_read(&o->bypass_mask) & (1 << sid)) {
+        hwaddr mask = (1ULL << DART_MAX_VA_BITS) - 1;
 
-    if ((o->tcr[sid] & DART_TCR_TXEN) == 0) {
-        /* Disabled translation goto bypass address, not error */
+        if (s->bypass_address) {
+            mask &= (s->bypass_address & -s->bypass_address) - 1;
+        }
+        entry.iova = addr & ~mask;
+        entry.translated_addr = s->bypass_address + entry.iova;
+        entry.addr_mask = mask;
         entry.perm = IOMMU_RW;
         goto end;
     }
+    sid = qatomic_read(&o->remap[sid]) & 0xf;
 
-    if (o->tcr[sid] & DART_TCR_BYPASS_DART) {
-        entry.perm = IOMMU_RW;
-        goto end;
+    iova = addr >> s->page_shift;
+    stat64_add(&iommu->stats[DART_STAT_TRANSLATIONS], 1);
+
+    WITH_RCU_READ_LOCK_GUARD()
+    {
+        hit = apple_dart_tlb_lookup(qatomic_rcu_read(&o->tlb[iommu->sid]),
+                                    iova, &tlb_entry);
     }
 
-    iova = addr >> s->page_shift;
-    key = DART_IOTLB_SID(iommu->sid) | iova;
-
-    tlb_entry = g_hash_table_lookup(o->tlb, GUINT_TO_POINTER(key));
-
-    if (tlb_entry == NULL) {
-        uint32_t status = 0;
-        tlb_entry = apple_dart_ptw(o, sid, iova, &status);
-        if (tlb_entry) {
-            g_hash_table_insert(o->tlb, GUINT_TO_POINTER(key), tlb_entry);
-            DPRINTF("%s[%d]: (%s) SID %u: 0x" HWADDR_FMT_plx
-                    " -> 0x" HWADDR_FMT_plx " (%c%c)\n",
-                    s->name, o->id, dart_instance_name[o->type], iommu->sid,
-                    addr, tlb_entry->block_addr | (addr & s->page_bits),
-                    (tlb_entry->perm & IOMMU_RO) ? 'r' : '-',
-                    (tlb_entry->perm & IOMMU_WO) ? 'w' : '-');
-        } else {
-            o->error_status |= status;
-            o->error_status =
-                deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                          DART_ERROR_STREAM_LENGTH, iommu->sid);
-            o->error_address = addr;
-        }
-    }
-    if (tlb_entry) {
-        entry.translated_addr =
-            tlb_entry->block_addr | (addr & entry.addr_mask);
-        entry.perm = tlb_entry->perm;
+    stat64_add(&iommu->stats[hit ? DART_STAT_TLB_HITS : DART_STAT_TLB_MISSES],
+               1);
+    if (!hit) {
+        WITH_QEMU_LOCK_GUARD(&o->mutex)
+        {
+            /* Another thread may have filled it while we were unlocked. */
+            hit = apple_dart_tlb_lookup(o->tlb[iommu->sid], iova, &tlb_entry);
+            if (!hit &&
+                s->ptw(iommu, sid, iova, &tlb_entry, &status)) {
+                apple_dart_tlb_insert(o->tlb[iommu->sid], iova, &tlb_entry);
+                hit = true;
+                DPRINTF("%s[%d]: (%s) SID %u: 0x" HWADDR_FMT_plx
+                        " -> 0x" HWADDR_FMT_plx " (%c%c)\n",
+                        s->name, o->id, dart_instance_name[o->type],
+                        iommu->sid, addr,
+                        tlb_entry.block_addr | (addr & tlb_entry.addr_mask),
+                        (tlb_entry.perm & IOMMU_RO) ? 'r' : '-',
+                        (tlb_entry.perm & IOMMU_WO) ? 'w' : '-');
+            }
+        }
+    }
+
+    if (hit) {
+        entry.iova = addr & ~tlb_entry.addr_mask;
+        entry.addr_mask = tlb_entry.addr_mask;
+        entry.translated_addr = tlb_entry.block_addr;
+        entry.perm = tlb_entry.perm;
     }
 
     if ((flag & IOMMU_WO) && !(entry.perm & IOMMU_WO)) {
-        o->error_address = addr;
-        o->error_status |= (DART_ERROR_FLAG | DART_ERROR_WRITE_PROT);
-        o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                                    DART_ERROR_STREAM_LENGTH, iommu->sid);
+        status |= (DART_ERROR_FLAG | DART_ERROR_WRITE_PROT);
     }
 
     if ((flag & IOMMU_RO) && !(entry.perm & IOMMU_RO)) {
-        o->error_address = addr;
-        o->error_status |= (DART_ERROR_FLAG | DART_ERROR_READ_PROT);
-        o->error_status = deposit32(o->error_status, DART_ERROR_STREAM_SHIFT,
-                                    DART_ERROR_STREAM_LENGTH, iommu->sid);
+        status |= (DART_ERROR_FLAG | DART_ERROR_READ_PROT);
+    }
+
+    if (status) {
+        apple_dart_count_faults(iommu, status);
+        if (apple_dart_record_error(o, iommu->sid, addr, status)) {
+            apple_dart_update_irq(s);
+        }
     }
 
 end:
@@ -455,11 +886,175 @@ end:
             s->name, o->id, dart_instance_name[o->type], iommu->sid, entry.iova,
             entry.translated_addr, (entry.perm & IOMMU_RO) ? 'r' : '-',
             (entry.perm & IOMMU_WO) ? 'w' : '-');
-    qemu_mutex_unlock(&o->mutex);
-    apple_dart_update_irq(s);
     return entry;
 }
 
+/*
+ * Send a MAP event to `n` for every mapping currently visible through
+ * `iommu`, coalescing runs the same way as the translate path.
+ * Must be called with the instance mutex held.
+ */
+static void apple_dart_replay_locked(AppleDARTIOMMUMemoryRegion *iommu,
+                                     IOMMUNotifier *n)
+{
+    AppleDARTInstance *o = iommu->o;
+    AppleDARTState *s = o->s;
+    uint32_t sid = o->remap[iommu->sid] & 0xf;
+    uint64_t l1_n = (s->l_mask[1] >> s->l_shift[1]) + 1;
+    uint64_t l2_n = (s->l_mask[2] >> s->l_shift[2]) + 1;
+    g_autofree uint64_t *l1 = NULL;
+    g_autofree uint64_t *l2 = NULL;
+    IOMMUTLBEvent event = {
+        .type = IOMMU_NOTIFIER_MAP,
+        .entry.target_as = &address_space_memory,
+    };
+
+    if (s->bypass & (1 << sid)) {
+        return;
+    }
+
+    if ((o->tcr[sid] & DART_TCR_TXEN) == 0 ||
+        (o->tcr[sid] & DART_TCR_BYPASS_DART)) {
+        hwaddr end = (1ULL << DART_MAX_VA_BITS) - 1;
+        hwaddr iova = 0;
+
+        event.entry.perm = IOMMU_RW;
+        while (iova < end) {
+            hwaddr mask = dma_aligned_pow2_mask(iova, end, DART_MAX_VA_BITS);
+
+            if (s->bypass_address) {
+                mask &= (s->bypass_address & -s->bypass_address) - 1;
+            }
+            event.entry.iova = iova;
+            event.entry.translated_addr = s->bypass_address + iova;
+            event.entry.addr_mask = mask;
+            memory_region_notify_iommu_one(n, &event);
+            iova += mask + 1;
+        }
+        return;
+    }
+
+    l1 = g_new(uint64_t, l1_n);
+    l2 = g_new(uint64_t, l2_n);
+
+    for (uint64_t i = 0; i < DART_MAX_TTBR; i++) {
+        hwaddr pa;
+
+        if ((o->ttbr[sid][i] & DART_TTBR_VALID) == 0) {
+            continue;
+        }
+        pa = (o->ttbr[sid][i] & DART_TTBR_MASK) << DART_TTBR_SHIFT;
+        if (dma_memory_read(&address_space_memory, pa, l1, l1_n * 8,
+                            MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < l1_n; j++) {
+            uint64_t k = 0;
+
+            if ((l1[j] & DART_TTE_VALID) == 0) {
+                continue;
+            }
+            pa = l1[j] & s->page_mask & DART_TTE_ADDR_MASK;
+            if (dma_memory_read(&address_space_memory, pa, l2, l2_n * 8,
+                                MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+                continue;
+            }
+
+            while (k < l2_n) {
+                uint64_t w = k & ~(uint64_t)(DART_PTW_SPAN_PTES - 1);
+                uint64_t pte = l2[k];
+                hwaddr mask;
+
+                if ((pte & DART_TTE_VALID) == 0) {
+                    k++;
+                    continue;
+                }
+                mask = apple_dart_ptw_span(l2 + w, k - w, s->page_shift);
+                event.entry.iova = ((i << s->l_shift[0]) |
+                                    (j << s->l_shift[1]) | k)
+                                   << s->page_shift;
+                event.entry.iova &= ~mask;
+                event.entry.translated_addr =
+                    (pte & s->page_mask & DART_TTE_ADDR_MASK) & ~mask;
+                event.entry.addr_mask = mask;
+                event.entry.perm = IOMMU_ACCESS_FLAG(
+                    !(pte & DART_TTE_NO_READ), !(pte & DART_TTE_NO_WRITE));
+                if (event.entry.perm != IOMMU_NONE) {
+                    memory_region_notify_iommu_one(n, &event);
+                }
+                k = (k | (mask >> s->page_shift)) + 1;
+            }
+        }
+    }
+}
+
+/* Must be called with the instance mutex held. */
+static void apple_dart_notify_map(AppleDARTIOMMUMemoryRegion *iommu)
+{
+    IOMMUNotifier *n;
+
+    IOMMU_NOTIFIER_FOREACH (n, IOMMU_MEMORY_REGION(iommu)) {
+        if (n->notifier_flags & IOMMU_NOTIFIER_MAP) {
+            apple_dart_replay_locked(iommu, n);
+        }
+    }
+}
+
+static void apple_dart_replay(IOMMUMemoryRegion *mr, IOMMUNotifier *n)
+{
+    AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
+
+    QEMU_LOCK_GUARD(&iommu->o->mutex);
+    apple_dart_replay_locked(iommu, n);
+}
+
+static int apple_dart_notify_flag_changed(IOMMUMemoryRegion *mr,
+                                          IOMMUNotifierFlag old,
+                                          IOMMUNotifierFlag new, Error **errp)
+{
+    AppleDARTIOMMUMemoryRegion *iommu = APPLE_DART_IOMMU_MEMORY_REGION(mr);
+
+    if (new & IOMMU_NOTIFIER_DEVIOTLB_UNMAP) {
+        error_setg(errp, "DART does not support dev-iotlb notifiers");
+        return -EINVAL;
+    }
+    iommu->notifier_flags = new;
+    return 0;
+}
+
+/* Shadowing consumers resync against the page tables loaded with the VM. */
+static void apple_dart_vm_state_change(void *opaque, bool running,
+                                       RunState state)
+{
+    AppleDARTState *s = opaque;
+    int i, j;
+
+    if (!running) {
+        return;
+    }
+
+    for (i = 0; i < s->num_instances; i++) {
+        AppleDARTInstance *o = &s->instances[i];
+
+        if (o->type != DART_DART) {
+            continue;
+        }
+
+        QEMU_LOCK_GUARD(&o->mutex);
+        if (!o->replay_pending) {
+            continue;
+        }
+        o->replay_pending = false;
+        for (j = 0; j < DART_MAX_STREAMS; j++) {
+            if (o->iommus[j] &&
+                (o->iommus[j]->notifier_flags & IOMMU_NOTIFIER_MAP)) {
+                apple_dart_notify_map(o->iommus[j]);
+            }
+        }
+    }
+}
+
 static void apple_dart_reset(DeviceState *dev)
 {
     AppleDARTState *s = APPLE_DART(dev);
@@ -476,12 +1071,11 @@ static void apple_dart_reset(DeviceState *dev)
 
             WITH_QEMU_LOCK_GUARD(&s->instances[i].mutex)
             {
-                if (s->instances[i].tlb) {
-                    g_hash_table_destroy(s->instances[i].tlb);
-                    s->instances[i].tlb = NULL;
-                }
-                s->instances[i].tlb = g_hash_table_new_full(
-                    g_direct_hash, g_direct_equal, NULL, g_free);
+                apple_dart_tlb_remove_by_sid_mask(&s->instances[i],
+                                                  ~0ULL);
+                s->instances[i].flush_all_mask =
+                    MAKE_64BIT_MASK(0, DART_MAX_STREAMS);
+                apple_dart_update_bypass(&s->instances[i]);
             }
         }
         default:
@@ -552,10 +1146,12 @@ AppleDARTState *apple_dart_create(DTBNode *node)
     case 12:
         memcpy(s->l_mask, (uint32_t[3]){ 0xc0000, 0x3fe00, 0x1ff }, 12);
         memcpy(s->l_shift, (uint32_t[3]){ 0x12, 9, 0 }, 12);
+        s->ptw = apple_dart_ptw_4k;
         break;
     case 14:
         memcpy(s->l_mask, (uint32_t[3]){ 0xc00000, 0x3ff800, 0x7ff }, 12);
         memcpy(s->l_shift, (uint32_t[3]){ 0x16, 11, 0 }, 12);
+        s->ptw = apple_dart_ptw_16k;
         break;
     default:
         g_assert_not_reached();
@@ -612,10 +1208,14 @@ AppleDARTState *apple_dart_create(DTBNode *node)
                         o->iommus[i], sizeof(AppleDARTIOMMUMemoryRegion),
                         TYPE_APPLE_DART_IOMMU_MEMORY_REGION, OBJECT(s), name,
                         1ULL << DART_MAX_VA_BITS);
-
-                    qemu_mutex_init(&o->mutex);
                 }
             }
+            qemu_mutex_init(&o->mutex);
+            for (i = 0; i < DART_MAX_STREAMS; i++) {
+                o->tlb[i] = apple_dart_tlb_new();
+            }
+            /* Every TCR starts with translation disabled. */
+            o->bypass_mask = MAKE_64BIT_MASK(0, DART_MAX_STREAMS);
             break;
         }
         case 'SMMU':
@@ -634,6 +1234,7 @@ AppleDARTState *apple_dart_create(DTBNode *node)
     }
 
     sysbus_init_irq(sbd, &s->irq);
+    s->vmse = qemu_add_vm_change_state_handler(apple_dart_vm_state_change, s);
 
     return s;
 }
@@ -678,6 +1279,17 @@ static void apple_dart_dump_pt(Monitor *mon, AppleDARTInstance *o, hwaddr iova,
     }
 }
 
+static void apple_dart_dump_stats(Monitor *mon,
+                                  AppleDARTIOMMUMemoryRegion *iommu)
+{
+    monitor_printf(mon, "\t\t\t");
+    for (int i = 0; i < DART_STAT__MAX; i++) {
+        monitor_printf(mon, "%s%s: %" PRIu64, i ? ", " : "", dart_stat_name[i],
+                       stat64_get(&iommu->stats[i]));
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_dart(Monitor *mon, const QDict *qdict)
 {
     const char *name = qdict_get_try_str(qdict, "name");
@@ -735,6 +1347,7 @@ void hmp_info_dart(Monitor *mon, const QDict *qdict)
                     continue;
                 }
                 monitor_printf(mon, "\t\tSID %d:\n", sid);
+                apple_dart_dump_stats(mon, o->iommus[sid]);
                 uint64_t l0_entries[4] = { o->ttbr[sid][0], o->ttbr[sid][1],
                                            o->ttbr[sid][2], o->ttbr[sid][3] };
                 apple_dart_dump_pt(mon, o, 0, l0_entries, 0, 0);
@@ -743,10 +1356,38 @@ void hmp_info_dart(Monitor *mon, const QDict *qdict)
     }
 }
 
+/*
+ * Cached translations are never part of the stream, they are rebuilt from
+ * the page tables on the next miss. Loading over a running instance only
+ * has to retire whatever generations it still holds.
+ */
+static int apple_dart_instance_post_load(void *opaque, int version_id)
+{
+    AppleDARTInstance *o = opaque;
+
+    if (o->type != DART_DART) {
+        return 0;
+    }
+
+    QEMU_LOCK_GUARD(&o->mutex);
+    apple_dart_tlb_remove_by_sid_mask(o, ~0ULL);
+    o->flush_all_mask = MAKE_64BIT_MASK(0, DART_MAX_STREAMS);
+    apple_dart_update_bypass(o);
+
+    /*
+     * Replaying walks the page tables, which under postcopy are not here
+     * yet; leave it to the VM starting.
+     */
+    o->replay_pending = true;
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_dart_instance = {
     .name = "apple_dart_instance",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_dart_instance_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_UINT32_ARRAY(base_reg, AppleDARTInstance,
@@ -770,10 +1411,70 @@ static const VMStateDescription vmstate_apple_dart = {
         }
 };
 
+static void apple_dart_stats_cb(StatsResultList **result, StatsTarget target,
+                                strList *names, strList *targets,
+                                Error **errp)
+{
+    g_autoptr(GSList) device_list = NULL;
+
+    if (target != STATS_TARGET_IOMMU) {
+        return;
+    }
+
+    device_list = apple_dart_get_device_list();
+    for (GSList *ele = device_list; ele; ele = ele->next) {
+        AppleDARTState *dart = APPLE_DART(ele->data);
+
+        for (int i = 0; i < dart->num_instances; i++) {
+            AppleDARTInstance *o = &dart->instances[i];
+
+            for (int sid = 0; sid < DART_MAX_STREAMS; sid++) {
+                g_autofree char *path = NULL;
+                StatsList *stats_list = NULL;
+
+                if (o->type != DART_DART || !o->iommus[sid]) {
+                    continue;
+                }
+                for (int j = 0; j < DART_STAT__MAX; j++) {
+                    if (apply_str_list_filter(dart_stat_name[j], names)) {
+                        apple_stats_prepend(
+                            &stats_list, dart_stat_name[j],
+                            stat64_get(&o->iommus[sid]->stats[j]));
+                    }
+                }
+                if (!stats_list) {
+                    continue;
+                }
+                path = object_get_canonical_path(OBJECT(o->iommus[sid]));
+                add_stats_entry(result, STATS_PROVIDER_APPLE_DART, path,
+                                stats_list);
+            }
+        }
+    }
+}
+
+static void apple_dart_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = 0; i < DART_STAT__MAX; i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(dart_stat_name[i]);
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_DART, STATS_TARGET_IOMMU,
+                     stats_list);
+}
+
 static void apple_dart_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    add_stats_callbacks(STATS_PROVIDER_APPLE_DART, apple_dart_stats_cb,
+                        apple_dart_schemas_cb);
+
     dc->reset = apple_dart_reset;
     dc->desc = "Apple DART IOMMU";
     dc->vmsd = &vmstate_apple_dart;
@@ -786,6 +1487,8 @@ static void apple_dart_iommu_memory_region_class_init(ObjectClass *klass,
 
     imrc->translate = apple_dart_translate;
     imrc->attrs_to_index = apple_dart_attrs_to_index;
+    imrc->replay = apple_dart_replay;
+    imrc->notify_flag_changed = apple_dart_notify_flag_changed;
 }
 
 static const TypeInfo apple_dart_info = {
@@ -37,6 +37,142 @@ static void *align_4_high_ptr(void *ptr)
     return (void *)align_4_high_num((uint64_t)ptr);
 }
 
+static uint64_t find_dtb_prop_size(DTBProp *prop)
+{
+    g_assert_nonnull(prop);
+
+    return align_4_high_num(sizeof(prop->name) + sizeof(prop->length) +
+                            prop->length);
+}
+
+// Every change goes through here, so it also detaches the path to the root
+// from the loaded blob.
+static void dtb_node_grow(DTBNode *node, int64_t delta)
+{
+    for (; node != NULL; node = node->parent) {
+        node->size += delta;
+        node->src = NULL;
+    }
+}
+
+static DTBNode *dtb_node_new(void)
+{
+    DTBNode *node = g_new0(DTBNode, 1);
+
+    node->size = sizeof(node->prop_count) + sizeof(node->child_node_count);
+
+    node->prop_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             NULL);
+    node->child_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              NULL);
+    return node;
+}
+
+static void dtb_index_prop(DTBNode *node, DTBProp *prop)
+{
+    char *key = g_strndup((const char *)prop->name, DTB_PROP_NAME_LEN);
+
+    if (g_hash_table_contains(node->prop_index, key)) {
+        g_free(key);
+        return;
+    }
+    g_hash_table_insert(node->prop_index, key, prop);
+}
+
+static void dtb_unindex_prop(DTBNode *node, DTBProp *prop)
+{
+    g_autofree char *key =
+        g_strndup((const char *)prop->name, DTB_PROP_NAME_LEN);
+    GList *iter;
+    DTBProp *other;
+
+    if (g_hash_table_lookup(node->prop_index, key) != prop) {
+        return;
+    }
+    g_hash_table_remove(node->prop_index, key);
+
+    for (iter = node->props; iter != NULL; iter = iter->next) {
+        other = (DTBProp *)iter->data;
+        if (other != prop &&
+            strncmp((const char *)other->name, key, DTB_PROP_NAME_LEN) == 0) {
+            g_hash_table_insert(node->prop_index, g_strdup(key), other);
+            return;
+        }
+    }
+}
+
+static char *dtb_node_name(DTBNode *node)
+{
+    DTBProp *prop = find_dtb_prop(node, "name");
+
+    if (prop == NULL || prop->value == NULL) {
+        return NULL;
+    }
+
+    return g_strndup((const char *)prop->value, prop->length);
+}
+
+static void dtb_index_child(DTBNode *parent, DTBNode *child)
+{
+    char *key = dtb_node_name(child);
+
+    if (key != NULL) {
+        g_hash_table_insert(parent->child_index, key, child);
+    }
+}
+
+static void dtb_unindex_child(DTBNode *parent, DTBNode *child)
+{
+    g_autofree char *key = dtb_node_name(child);
+    GList *iter;
+    DTBNode *other;
+    char *other_key;
+
+    if (key == NULL || g_hash_table_lookup(parent->child_index, key) != child) {
+        return;
+    }
+    g_hash_table_remove(parent->child_index, key);
+
+    for (iter = g_list_last(parent->child_nodes); iter != NULL;
+         iter = iter->prev) {
+        other = (DTBNode *)iter->data;
+        if (other == child) {
+            continue;
+        }
+        other_key = dtb_node_name(other);
+        if (other_key != NULL && strcmp(other_key, key) == 0) {
+            g_hash_table_insert(parent->child_index, other_key, other);
+            return;
+        }
+        g_free(other_key);
+    }
+}
+
+static void skip_dtb_node(const uint8_t **dtb_blob)
+{
+    uint32_t prop_count, child_node_count;
+    uint32_t i;
+
+    *dtb_blob = align_4_high_ptr((void *)*dtb_blob);
+    prop_count = ldl_le_p(*dtb_blob);
+    child_node_count = ldl_le_p(*dtb_blob + sizeof(uint32_t));
+    *dtb_blob += 2 * sizeof(uint32_t);
+
+    for (i = 0; i < prop_count; i++) {
+        *dtb_blob = align_4_high_ptr((void *)*dtb_blob);
+        *dtb_blob += DTB_PROP_NAME_LEN;
+        *dtb_blob += sizeof(uint32_t) +
+                     (ldl_le_p(*dtb_blob) & DT_PROP_SIZE_MASK);
+    }
+
+    for (i = 0; i < child_node_count; i++) {
+        skip_dtb_node(dtb_blob);
+    }
+}
+
+// The value is left in the blob, which the tree owns, until it is set.
+// Values the length of a multiple of 8 are read as uint64_t arrays, so
+// those the blob only has 4-aligned get an aligned copy instead.
 static DTBProp *read_dtb_prop(uint8_t **dtb_blob)
 {
     g_assert_nonnull(dtb_blob);
@@ -50,15 +186,20 @@ static DTBProp *read_dtb_prop(uint8_t **dtb_blob)
     *dtb_blob += DTB_PROP_NAME_LEN;
 
     // zero out this flag which sometimes appears in the DT
-    // normally done by iboot
+    // normally done by iboot, in the blob too so that it can be copied out
+    // as is
     prop->length = ldl_le_p(*dtb_blob) & DT_PROP_SIZE_MASK;
     prop->flags = ldl_le_p(*dtb_blob) & DT_PROP_FLAGS_MASK;
+    stl_le_p(*dtb_blob, prop->length);
     *dtb_blob += sizeof(uint32_t);
 
-    if (prop->length) {
-        prop->value = g_malloc0(prop->length);
-        g_assert_nonnull(prop->value);
-        memcpy(&prop->value[0], *dtb_blob, prop->length);
+    if (prop->length % sizeof(uint64_t) == 0 &&
+        !QEMU_PTR_IS_ALIGNED(*dtb_blob, sizeof(uint64_t))) {
+        prop->value = g_memdup2(*dtb_blob, prop->length);
+        *dtb_blob += prop->length;
+    } else if (prop->length) {
+        prop->value = *dtb_blob;
+        prop->borrowed = true;
         *dtb_blob += prop->length;
     }
 
@@ -69,7 +210,9 @@ static void delete_prop(DTBProp *prop)
 {
     g_assert_nonnull(prop);
 
-    g_free(prop->value);
+    if (!prop->borrowed) {
+        g_free(prop->value);
+    }
     g_free(prop);
 }
 
@@ -79,12 +222,14 @@ static DTBNode *read_dtb_node(uint8_t **dtb_blob)
     DTBNode *node;
     DTBNode *child;
     DTBProp *prop;
+    bool copied = false;
 
     g_assert_nonnull(dtb_blob);
     g_assert_nonnull(*dtb_blob);
 
     *dtb_blob = align_4_high_ptr(*dtb_blob);
-    node = g_new0(DTBNode, 1);
+    node = dtb_node_new();
+    node->src = *dtb_blob;
     node->prop_count = *(uint32_t *)*dtb_blob;
     *dtb_blob += sizeof(uint32_t);
     node->child_node_count = *(uint32_t *)*dtb_blob;
@@ -96,14 +241,26 @@ static DTBNode *read_dtb_node(uint8_t **dtb_blob)
         prop = read_dtb_prop(dtb_blob);
         g_assert_nonnull(prop);
         node->props = g_list_append(node->props, prop);
+        node->size += find_dtb_prop_size(prop);
+        dtb_index_prop(node, prop);
+        copied |= prop->length != 0 && !prop->borrowed;
     }
 
     for (i = 0; i < node->child_node_count; i++) {
         child = read_dtb_node(dtb_blob);
         g_assert_nonnull(child);
+        child->parent = node;
         node->child_nodes = g_list_append(node->child_nodes, child);
+        node->size += child->size;
+        dtb_index_child(node, child);
+        copied |= child->src == NULL;
     }
 
+    // Writes to a copied value never reach the blob.
+    node->src_len = *dtb_blob - node->src;
+    if (copied) {
+        node->src = NULL;
+    }
     return node;
 }
 
@@ -119,12 +276,33 @@ static void delete_dtb_node(DTBNode *node)
         g_list_free_full(node->child_nodes, (GDestroyNotify)delete_dtb_node);
     }
 
+    g_hash_table_destroy(node->prop_index);
+    g_hash_table_destroy(node->child_index);
+    g_free(node->blob);
     g_free(node);
 }
 
 DTBNode *load_dtb(uint8_t *dtb_blob)
 {
-    return read_dtb_node(&dtb_blob);
+    const uint8_t *end = dtb_blob;
+    uint8_t *blob;
+    DTBNode *root;
+
+    g_assert_nonnull(dtb_blob);
+    g_assert_true(align_4_high_ptr(dtb_blob) == dtb_blob);
+
+    // One copy of the blob instead of one allocation per property value.
+    skip_dtb_node(&end);
+    blob = g_memdup2(dtb_blob, end - dtb_blob);
+    dtb_blob = blob;
+    root = read_dtb_node(&dtb_blob);
+    root->blob = blob;
+    return root;
+}
+
+void destroy_dtb(DTBNode *root)
+{
+    delete_dtb_node(root);
 }
 
 static void save_prop(DTBProp *prop, uint8_t **buf)
@@ -155,6 +333,13 @@ static void save_node(DTBNode *node, uint8_t **buf)
 
     *buf = align_4_high_ptr(*buf);
 
+    // Nothing in this subtree changed since it was loaded.
+    if (node->src != NULL) {
+        memcpy(*buf, node->src, node->src_len);
+        *buf += node->src_len;
+        return;
+    }
+
     memcpy(*buf, &node->prop_count, sizeof(node->prop_count));
     *buf += sizeof(node->prop_count);
     memcpy(*buf, &node->child_node_count, sizeof(node->child_node_count));
@@ -175,6 +360,8 @@ void remove_dtb_node(DTBNode *parent, DTBNode *node)
             continue;
         }
 
+        dtb_unindex_child(parent, node);
+        dtb_node_grow(parent, -(int64_t)node->size);
         delete_dtb_node(node);
         parent->child_nodes = g_list_delete_link(parent->child_nodes, iter);
 
@@ -213,6 +400,13 @@ void remove_dtb_prop(DTBNode *node, DTBProp *prop)
 
     for (iter = node->props; iter != NULL; iter = iter->next) {
         if (prop == iter->data) {
+            if (node->parent != NULL &&
+                strncmp((const char *)prop->name, "name", DTB_PROP_NAME_LEN) ==
+                    0) {
+                dtb_unindex_child(node->parent, node);
+            }
+            dtb_unindex_prop(node, prop);
+            dtb_node_grow(node, -(int64_t)find_dtb_prop_size(prop));
             delete_prop(prop);
             node->props = g_list_delete_link(node->props, iter);
 
@@ -233,22 +427,41 @@ DTBProp *set_dtb_prop(DTBNode *node, const char *name, const uint32_t size,
     g_assert_nonnull(val);
 
     DTBProp *prop;
+    bool is_name;
+    bool is_new;
+
+    is_name = node->parent != NULL &&
+              strncmp(name, "name", DTB_PROP_NAME_LEN) == 0;
+    if (is_name) {
+        dtb_unindex_child(node->parent, node);
+    }
 
     prop = find_dtb_prop(node, name);
+    is_new = prop == NULL;
 
-    if (prop == NULL) {
+    if (is_new) {
         prop = g_new0(DTBProp, 1);
         node->props = g_list_append(node->props, prop);
         node->prop_count++;
     } else {
-        g_free(prop->value);
-        prop->value = NULL;
+        dtb_node_grow(node, -(int64_t)find_dtb_prop_size(prop));
+        if (!prop->borrowed) {
+            g_free(prop->value);
+        }
         memset(prop, 0, sizeof(DTBProp));
     }
     strncpy((char *)prop->name, name, DTB_PROP_NAME_LEN);
+    if (is_new) {
+        dtb_index_prop(node, prop);
+    }
     prop->length = size;
     prop->value = g_malloc0(size);
     memcpy(prop->value, val, size);
+    dtb_node_grow(node, find_dtb_prop_size(prop));
+
+    if (is_name) {
+        dtb_index_child(node->parent, node);
+    }
 
     return prop;
 }
@@ -265,59 +478,27 @@ void save_dtb(uint8_t *buf, DTBNode *root)
     save_node(root, &buf);
 }
 
-static uint64_t find_dtb_prop_size(DTBProp *prop)
-{
-    g_assert_nonnull(prop);
-
-    return align_4_high_num(sizeof(prop->name) + sizeof(prop->length) +
-                            prop->length);
-}
-
 uint64_t get_dtb_node_buffer_size(DTBNode *node)
 {
     g_assert_nonnull(node);
 
-    uint64_t size;
-    DTBProp *prop;
-    DTBNode *child;
-    GList *iter;
-
-    size = sizeof(node->prop_count) + sizeof(node->child_node_count);
-
-    for (iter = node->props; iter != NULL; iter = iter->next) {
-        prop = (DTBProp *)iter->data;
-        g_assert_nonnull(prop);
-        size += find_dtb_prop_size(prop);
-    }
-
-    for (iter = node->child_nodes; iter != NULL; iter = iter->next) {
-        child = (DTBNode *)iter->data;
-        g_assert_nonnull(child);
-        size += get_dtb_node_buffer_size(child);
-    }
-
-    return size;
+    return node->size;
 }
 
 DTBProp *find_dtb_prop(DTBNode *node, const char *name)
 {
-    GList *iter;
-    DTBProp *prop;
+    g_autofree char *key = NULL;
 
     g_assert_nonnull(node);
     g_assert_nonnull(name);
 
-    for (iter = node->props; iter; iter = iter->next) {
-        prop = (DTBProp *)iter->data;
-
-        g_assert_nonnull(prop);
-
-        if (strncmp((const char *)prop->name, name, DTB_PROP_NAME_LEN) == 0) {
-            return prop;
-        }
+    // Property names are compared on at most DTB_PROP_NAME_LEN bytes.
+    if (strnlen(name, DTB_PROP_NAME_LEN + 1) > DTB_PROP_NAME_LEN) {
+        key = g_strndup(name, DTB_PROP_NAME_LEN);
+        name = key;
     }
 
-    return NULL;
+    return g_hash_table_lookup(node->prop_index, name);
 }
 
 DTBNode *find_dtb_node(DTBNode *node, const char *path)
@@ -325,12 +506,8 @@ DTBNode *find_dtb_node(DTBNode *node, const char *path)
     g_assert_nonnull(node);
     g_assert_nonnull(path);
 
-    GList *iter;
-    DTBProp *prop;
-    DTBNode *child;
     char *s;
     const char *next;
-    bool found;
 
     s = g_strdup(path);
 
@@ -339,29 +516,7 @@ DTBNode *find_dtb_node(DTBNode *node, const char *path)
             continue;
         }
 
-        found = false;
-
-        for (iter = node->child_nodes; iter; iter = iter->next) {
-            child = (DTBNode *)iter->data;
-
-            g_assert_nonnull(child);
-
-            prop = find_dtb_prop(child, "name");
-
-            if (prop == NULL) {
-                continue;
-            }
-
-            if (strncmp((const char *)prop->value, next, prop->length) == 0) {
-                node = child;
-                found = true;
-            }
-        }
-
-        if (!found) {
-            g_free(s);
-            return NULL;
-        }
+        node = g_hash_table_lookup(node->child_index, next);
     }
 
     g_free(s);
@@ -373,12 +528,9 @@ DTBNode *get_dtb_node(DTBNode *node, const char *path)
     g_assert_nonnull(node);
     g_assert_nonnull(path);
 
-    GList *iter = NULL;
-    DTBProp *prop = NULL;
     DTBNode *child = NULL;
     char *s;
     const char *name;
-    bool found;
     size_t name_len;
 
     s = g_strdup(path);
@@ -389,33 +541,19 @@ DTBNode *get_dtb_node(DTBNode *node, const char *path)
             continue;
         }
 
-        found = false;
-
-        for (iter = node->child_nodes; iter; iter = iter->next) {
-            child = (DTBNode *)iter->data;
-
-            g_assert_nonnull(child);
-
-            prop = find_dtb_prop(child, "name");
-
-            if (prop == NULL) {
-                continue;
-            }
-
-            if (strncmp((const char *)prop->value, name, prop->length) == 0) {
-                node = child;
-                found = true;
-            }
-        }
+        child = g_hash_table_lookup(node->child_index, name);
 
-        if (!found) {
-            DTBNode *child = g_new0(DTBNode, 1);
+        if (child == NULL) {
+            child = dtb_node_new();
 
             set_dtb_prop(child, "name", name_len + 1, (uint8_t *)name);
+            child->parent = node;
             node->child_nodes = g_list_append(node->child_nodes, child);
             node->child_node_count++;
-            node = child;
+            dtb_node_grow(node, child->size);
+            dtb_index_child(node, child);
         }
+        node = child;
     }
 
     g_free(s);
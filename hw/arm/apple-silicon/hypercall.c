@@ -0,0 +1,118 @@
+/*
+ * Paravirtual hypercalls for XNU guests.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/hypercall.h"
+#include "trace.h"
+
+typedef struct {
+    const char *name;
+    uint32_t version;
+    AppleHypercallFn *fn;
+    void *opaque;
+} AppleHypercallService;
+
+/* Service number to AppleHypercallService. */
+static GHashTable *apple_hypercall_services;
+
+static GHashTable *apple_hypercall_get_services(void)
+{
+    if (apple_hypercall_services == NULL) {
+        apple_hypercall_services =
+            g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    }
+    return apple_hypercall_services;
+}
+
+void apple_hypercall_register(uint16_t service, const char *name,
+                              uint32_t version, AppleHypercallFn *fn,
+                              void *opaque)
+{
+    GHashTable *services = apple_hypercall_get_services();
+    AppleHypercallService *s;
+
+    g_assert(service != APPLE_HYPERCALL_SERVICE_BASE);
+    g_assert(!g_hash_table_contains(services, GUINT_TO_POINTER(service)));
+
+    s = g_new0(AppleHypercallService, 1);
+    s->name = name;
+    s->version = version;
+    s->fn = fn;
+    s->opaque = opaque;
+    g_hash_table_insert(services, GUINT_TO_POINTER(service), s);
+}
+
+static int64_t apple_hypercall_base(uint16_t func, const uint64_t *args,
+                                    uint64_t *res)
+{
+    GHashTable *services = apple_hypercall_get_services();
+    AppleHypercallService *s;
+
+    switch (func) {
+    case APPLE_HYPERCALL_BASE_VERSION:
+        res[0] = APPLE_HYPERCALL_VERSION;
+        res[1] = g_hash_table_size(services);
+        return APPLE_HYPERCALL_SUCCESS;
+    case APPLE_HYPERCALL_BASE_PROBE:
+        if (args[0] > UINT16_MAX) {
+            return APPLE_HYPERCALL_INVALID_PARAMETERS;
+        }
+        if (args[0] == APPLE_HYPERCALL_SERVICE_BASE) {
+            res[0] = APPLE_HYPERCALL_VERSION;
+            return APPLE_HYPERCALL_SUCCESS;
+        }
+        s = g_hash_table_lookup(services, GUINT_TO_POINTER(args[0]));
+        if (s == NULL) {
+            return APPLE_HYPERCALL_NOT_SUPPORTED;
+        }
+        res[0] = s->version;
+        return APPLE_HYPERCALL_SUCCESS;
+    default:
+        return APPLE_HYPERCALL_NOT_SUPPORTED;
+    }
+}
+
+static void apple_hypercall_dispatch(ARMCPU *cpu, void *opaque)
+{
+    CPUARMState *env = &cpu->env;
+    uint64_t call = env->xregs[0];
+    uint16_t service = extract64(call, 16, 16);
+    uint16_t func = extract64(call, 0, 16);
+    uint64_t res[3] = { 0 };
+    AppleHypercallService *s;
+    int64_t ret;
+
+    if (call > UINT32_MAX) {
+        ret = APPLE_HYPERCALL_NOT_SUPPORTED;
+    } else if (service == APPLE_HYPERCALL_SERVICE_BASE) {
+        ret = apple_hypercall_base(func, &env->xregs[1], res);
+    } else {
+        s = g_hash_table_lookup(apple_hypercall_get_services(),
+                                GUINT_TO_POINTER(service));
+        ret = s ? s->fn(cpu, func, &env->xregs[1], res, s->opaque) :
+                  APPLE_HYPERCALL_NOT_SUPPORTED;
+    }
+
+    trace_apple_hypercall(CPU(cpu)->cpu_index, service, func, ret);
+    env->xregs[0] = ret;
+    memcpy(&env->xregs[1], res, sizeof(res));
+}
+
+void apple_hypercall_attach(ARMCPU *cpu)
+{
+    arm_set_hypercall_handler(cpu, APPLE_HYPERCALL_IMM,
+                              apple_hypercall_dispatch, NULL);
+}
@@ -15,63 +15,84 @@ typedef struct {
     uint8_t data[];
 } QEMU_PACKED LzssCompHeader;
 
-int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen);
+int decompress_lzss(uint8_t *dst, uint32_t dstlen, const uint8_t *src,
+                    uint32_t srclen);
 
 #define N 4096
 #define F 18
 #define THRESHOLD 2
 #define NIL N
 
-int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen)
+/*
+ * Matches are copied straight out of the already decoded output instead of
+ * a ring buffer: ring slot `i` at output position `pos` refers to the byte
+ * `((N - F + pos) - i) & (N - 1)` positions back. References in front of
+ * the start of the output hit the encoder's initial window of spaces.
+ */
+int decompress_lzss(uint8_t *dst, uint32_t dstlen, const uint8_t *src,
+                    uint32_t srclen)
 {
-    uint8_t text_buf[N + F - 1];
     uint8_t *dststart = dst;
-    uint8_t *srcend = src + srclen;
-    int i, j, k, r, c;
-    unsigned int flags;
+    uint8_t *dstend = dst + dstlen;
+    const uint8_t *srcend = src + srclen;
+    unsigned int flags, bit;
+    size_t pos, dist, len, k;
 
-    dst = dststart;
-    srcend = src + srclen;
-    for (i = 0; i < N - F; i++)
-        text_buf[i] = ' ';
-    r = N - F;
-    flags = 0;
-    for (;;) {
-        if (((flags >>= 1) & 0x100) == 0) {
-            if (src < srcend)
-                c = *src++;
-            else
-                break;
-            flags = c | 0xFF00;
+    while (src < srcend) {
+        flags = *src++;
+
+        // Fast path for a run of eight literals.
+        if (flags == 0xFF && srcend - src >= 8 && dstend - dst >= 8) {
+            memcpy(dst, src, 8);
+            dst += 8;
+            src += 8;
+            continue;
         }
-        if (flags & 1) {
-            if (src < srcend)
-                c = *src++;
-            else
-                break;
-            *dst++ = c;
-            text_buf[r++] = c;
-            r &= (N - 1);
-        } else {
-            if (src < srcend)
-                i = *src++;
-            else
-                break;
-            if (src < srcend)
-                j = *src++;
-            else
-                break;
-            i |= ((j & 0xF0) << 4);
-            j = (j & 0x0F) + THRESHOLD;
-            for (k = 0; k <= j; k++) {
-                c = text_buf[(i + k) & (N - 1)];
-                *dst++ = c;
-                text_buf[r++] = c;
-                r &= (N - 1);
+
+        for (bit = 0; bit < 8; bit++, flags >>= 1) {
+            if (flags & 1) {
+                if (src >= srcend || dst >= dstend) {
+                    goto out;
+                }
+                *dst++ = *src++;
+                continue;
+            }
+
+            if (srcend - src < 2) {
+                goto out;
+            }
+            pos = dst - dststart;
+            dist = (N - F + pos - (src[0] | ((src[1] & 0xF0) << 4))) & (N - 1);
+            len = (src[1] & 0x0F) + THRESHOLD + 1;
+            src += 2;
+
+            if (len > (size_t)(dstend - dst)) {
+                goto out;
+            }
+            if (dist == 0) {
+                dist = N;
+            }
+
+            if (dist > pos) {
+                k = MIN(dist - pos, len);
+                memset(dst, ' ', k);
+                dst += k;
+                len -= k;
+            }
+
+            if (dist >= len) {
+                memcpy(dst, dst - dist, len);
+                dst += len;
+            } else {
+                // Overlapping match, replicate the pattern byte by byte.
+                for (k = 0; k < len; k++, dst++) {
+                    *dst = *(dst - dist);
+                }
             }
         }
     }
 
+out:
     return dst - dststart;
 }
 
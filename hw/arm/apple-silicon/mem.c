@@ -89,6 +89,11 @@ hwaddr get_low_bits_mask_for_bit_index(uint8_t bit_index)
     return (1 << bit_index) - 1;
 }
 
+/*
+ * Anonymous RAM for the small fixed SoC memories. Main DRAM is the machine's
+ * `ram` region instead, so it follows -machine memory-backend= (hugepages,
+ * shared memfd, prealloc, host-nodes) like every other board.
+ */
 void allocate_ram(MemoryRegion *top, const char *name, hwaddr addr, hwaddr size,
                   int priority)
 {
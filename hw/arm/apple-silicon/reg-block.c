@@ -0,0 +1,146 @@
+/*
+ * RAM-backed MMIO register blocks for Apple SoCs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/reg-block.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+
+static const AppleRegDesc *apple_reg_block_find(AppleRegBlock *blk,
+                                                hwaddr addr)
+{
+    size_t i;
+
+    if (blk->stride) {
+        addr %= blk->stride;
+    }
+
+    for (i = 0; i < blk->nregs; i++) {
+        if (addr >= blk->regs[i].offset &&
+            addr < blk->regs[i].offset + blk->regs[i].size) {
+            return &blk->regs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void apple_reg_block_write(void *opaque, hwaddr addr, uint64_t data,
+                                  unsigned size)
+{
+    AppleRegBlock *blk = opaque;
+    const AppleRegDesc *desc = apple_reg_block_find(blk, addr);
+    uint32_t value = data;
+
+    if (desc == NULL) {
+        if (blk->wi) {
+            return;
+        }
+    } else {
+        if (desc->write) {
+            desc->write(blk->opaque, addr, &value);
+        }
+        if (desc->ro) {
+            return;
+        }
+    }
+
+    stn_le_p(blk->ram + addr, size, value);
+}
+
+static const MemoryRegionOps apple_reg_block_ops = {
+    .write = apple_reg_block_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl.max_access_size = 4,
+};
+
+void apple_reg_block_reset(AppleRegBlock *blk)
+{
+    hwaddr addr;
+    hwaddr step = blk->stride ? blk->stride : blk->size;
+    size_t i;
+
+    if (blk->seed) {
+        for (addr = 0; addr < blk->size; addr += 4) {
+            stl_le_p(blk->ram + addr, blk->seed(blk->base + addr));
+        }
+    } else {
+        memset(blk->ram, 0, blk->size);
+    }
+
+    for (hwaddr plane = 0; plane < blk->size; plane += step) {
+        for (i = 0; i < blk->nregs; i++) {
+            const AppleRegDesc *desc = &blk->regs[i];
+
+            for (addr = desc->offset;
+                 addr < desc->offset + desc->size && plane + addr < blk->size;
+                 addr += 4) {
+                stl_le_p(blk->ram + plane + addr, desc->reset);
+            }
+        }
+    }
+}
+
+AppleRegBlock *apple_reg_block_create(Object *owner, const char *name,
+                                      hwaddr base, hwaddr size,
+                                      const AppleRegDesc *regs, size_t nregs)
+{
+    AppleRegBlock *blk = g_new0(AppleRegBlock, 1);
+
+    blk->opaque = owner;
+    blk->base = base;
+    blk->size = size;
+    blk->regs = regs;
+    blk->nregs = nregs;
+    memory_region_init_rom_device(&blk->mr, owner, &apple_reg_block_ops, blk,
+                                  name, size, &error_fatal);
+    blk->ram = memory_region_get_ram_ptr(&blk->mr);
+
+    return blk;
+}
+
+AppleRegBlock *apple_reg_block_create_ro(Object *owner, const char *name,
+                                         hwaddr base, hwaddr size,
+                                         const AppleRegDesc *regs,
+                                         size_t nregs,
+                                         uint32_t (*seed)(hwaddr addr))
+{
+    AppleRegBlock *blk;
+    AppleRegDesc *sub = g_new0(AppleRegDesc, nregs);
+    size_t i;
+    size_t nsub = 0;
+
+    for (i = 0; i < nregs; i++) {
+        if (regs[i].offset >= base && regs[i].offset < base + size) {
+            sub[nsub] = regs[i];
+            sub[nsub].offset -= base;
+            sub[nsub].ro = true;
+            nsub++;
+        }
+    }
+
+    blk = apple_reg_block_create(owner, name, base, size, sub, nsub);
+    blk->wi = true;
+    blk->seed = seed;
+    apple_reg_block_reset(blk);
+
+    return blk;
+}
+
+void apple_pmgr_ps_write(void *opaque, hwaddr addr, uint32_t *value)
+{
+    *value = PMGR_PS_STATE(*value);
+}
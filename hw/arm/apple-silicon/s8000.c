@@ -26,6 +26,9 @@
 #include "hw/arm/apple-silicon/s8000-config.c.inc"
 #include "hw/arm/apple-silicon/s8000.h"
 #include "hw/arm/apple-silicon/sep-sim.h"
+#include "hw/arm/apple-silicon/stats.h"
+#include "hw/arm/apple-silicon/xnu-patch.h"
+#include "hw/arm/apple-silicon/xnu-sym.h"
 #include "hw/arm/exynos4210.h"
 #include "hw/block/apple_nvme_mmu.h"
 #include "hw/display/adbe_v2.h"
@@ -139,8 +142,12 @@ static void s8000_create_s3c_uart(const S8000MachineState *s8000_machine,
     g_assert_nonnull(dev);
 }
 
-static void s8000_patch_kernel(MachoHeader64 *hdr)
+static void s8000_patch_kernel(S8000MachineState *s8000_machine,
+                               MachoHeader64 *hdr)
 {
+    if (s8000_machine->kernel_patches_filename != NULL) {
+        xnu_patch_apply_file(hdr, s8000_machine->kernel_patches_filename);
+    }
 }
 
 static bool s8000_check_panic(MachineState *machine)
@@ -225,7 +232,10 @@ static void s8000_load_classic_kc(S8000MachineState *s8000_machine,
 
     g_phys_base = (hwaddr)macho_get_buffer(hdr);
     macho_highest_lowest(hdr, &virt_low, &virt_end);
-    macho_text_base(hdr, &text_base);
+    if (!macho_text_base(hdr, &text_base)) {
+        error_report("Could not find the kernel's text base");
+        exit(EXIT_FAILURE);
+    }
     info->kern_text_off = text_base - virt_low;
     prelink_text_base = macho_get_segment(hdr, "__PRELINK_TEXT")->vmaddr;
 
@@ -464,97 +474,26 @@ static void s8000_memory_setup(MachineState *machine)
     }
 }
 
-static void pmgr_unk_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                               unsigned size)
-{
-    hwaddr base = (hwaddr)opaque;
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg WRITE unk @ 0x" TARGET_FMT_lx
-                  " base: 0x" TARGET_FMT_lx " value: 0x" TARGET_FMT_lx "\n",
-                  base + addr, base, data);
-#endif
-}
-
-static uint64_t pmgr_unk_reg_read(void *opaque, hwaddr addr, unsigned size)
-{
-    hwaddr base = (hwaddr)opaque;
-
-    switch (base + addr) {
-    case 0x102BC000: // CFG_FUSE0
-        return (1 << 2);
-    case 0x102BC200: // CFG_FUSE0_RAW
-        return 0x0;
-    case 0x102BC080: // ECID_LO
-        return 0x13371337;
-    case 0x102BC084: // ECID_HI
-        return 0xDEADBEEF;
-    case 0x102E8000: // ????
-        return 0x4;
-    case 0x102BC104: // ???? bit 24 => is fresh boot?
-        return (1 << 24) | (1 << 25);
-    default:
-#if 0
-        qemu_log_mask(LOG_UNIMP,
-                      "PMGR reg READ unk @ 0x" TARGET_FMT_lx
-                      " base: 0x" TARGET_FMT_lx "\n",
-                      base + addr, base);
-#endif
-        break;
-    }
-    return 0;
-}
-
-static const MemoryRegionOps pmgr_unk_reg_ops = {
-    .write = pmgr_unk_reg_write,
-    .read = pmgr_unk_reg_read,
+static const AppleRegDesc pmgr_unk_regs[] = {
+    { 0x102BC000, 4, 1 << 2, true }, // CFG_FUSE0
+    { 0x102BC200, 4, 0x0, true }, // CFG_FUSE0_RAW
+    { 0x102BC080, 4, 0x13371337, true }, // ECID_LO
+    { 0x102BC084, 4, 0xDEADBEEF, true }, // ECID_HI
+    { 0x102E8000, 4, 0x4, true }, // ????
+    // ???? bit 24 => is fresh boot?
+    { 0x102BC104, 4, (1 << 24) | (1 << 25), true },
 };
 
-static void pmgr_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                           unsigned size)
+static void pmgr_cpu_start_write(void *opaque, hwaddr addr, uint32_t *value)
 {
-    MachineState *machine = MACHINE(opaque);
-    S8000MachineState *s8000_machine = S8000_MACHINE(opaque);
-    uint32_t value = data;
-
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg WRITE @ 0x" TARGET_FMT_lx " value: 0x" TARGET_FMT_lx
-                  "\n",
-                  addr, data);
-#endif
-
-    if (addr >= 0x80000 && addr <= 0x88010) {
-        value = (value & 0xf) << 4 | (value & 0xf);
-    }
-
-    switch (addr) {
-    case 0x80400: // SEP Power State, Manual & Actual: Run Max
-        value = 0xFF;
-        break;
-    case 0xD4004:
-        s8000_start_cpus(machine, data);
-    default:
-        break;
-    }
-    memcpy(s8000_machine->pmgr_reg + addr, &value, size);
+    s8000_start_cpus(MACHINE(opaque), *value);
 }
 
-static uint64_t pmgr_reg_read(void *opaque, hwaddr addr, unsigned size)
-{
-    S8000MachineState *s8000_machine = S8000_MACHINE(opaque);
-    uint64_t result = 0;
-#if 0
-    qemu_log_mask(LOG_UNIMP, "PMGR reg READ @ 0x" TARGET_FMT_lx "\n", addr);
-#endif
-
-    memcpy(&result, s8000_machine->pmgr_reg + addr, size);
-    return result;
-}
-
-static const MemoryRegionOps pmgr_reg_ops = {
-    .write = pmgr_reg_write,
-    .read = pmgr_reg_read,
+static const AppleRegDesc pmgr_regs[] = {
+    // SEP Power State, Manual & Actual: Run Max
+    { 0x80400, 4, 0xFF, true },
+    { 0x80000, 0x8014, 0, false, apple_pmgr_ps_write },
+    { 0xD4004, 4, 0, false, pmgr_cpu_start_write },
 };
 
 static void s8000_cpu_setup(MachineState *machine)
@@ -567,6 +506,13 @@ static void s8000_cpu_setup(MachineState *machine)
 
     root = find_dtb_node(s8000_machine->device_tree, "cpus");
     g_assert_nonnull(root);
+
+    /* Cores beyond -smp are pruned, see t8030_cpu_setup. */
+    if (machine->smp.cpus > g_list_length(root->child_nodes)) {
+        error_report("-smp must be at most %u, got %u",
+                     g_list_length(root->child_nodes), machine->smp.cpus);
+        exit(EXIT_FAILURE);
+    }
     object_initialize_child(OBJECT(machine), "cluster", &s8000_machine->cluster,
                             TYPE_CPU_CLUSTER);
     qdev_prop_set_uint32(DEVICE(&s8000_machine->cluster), "cluster-id", 0);
@@ -624,9 +570,7 @@ static void s8000_create_aic(MachineState *machine)
             &s8000_machine->cpus[i]->memory,
             s8000_machine->soc_base_pa + reg[0],
             sysbus_mmio_get_region(s8000_machine->aic, i), 0);
-        sysbus_connect_irq(
-            s8000_machine->aic, i,
-            qdev_get_gpio_in(DEVICE(s8000_machine->cpus[i]), ARM_CPU_IRQ));
+        apple_aic_connect_cpu(s8000_machine->aic, i, CPU(s8000_machine->cpus[i]));
     }
 }
 
@@ -648,21 +592,26 @@ static void s8000_pmgr_setup(MachineState *machine)
     reg = (uint64_t *)prop->value;
 
     for (i = 0; i < prop->length / 8; i += 2) {
-        MemoryRegion *mem = g_new(MemoryRegion, 1);
-        if (i == 0) {
-            memory_region_init_io(mem, OBJECT(machine), &pmgr_reg_ops,
-                                  s8000_machine, "pmgr-reg", reg[i + 1]);
-        } else {
+        AppleRegBlock *blk;
+
+        if (i > 0) {
             snprintf(name, sizeof(name), "pmgr-unk-reg-%d", i);
-            memory_region_init_io(mem, OBJECT(machine), &pmgr_unk_reg_ops,
-                                  (void *)reg[i], name, reg[i + 1]);
+            blk = apple_reg_block_create_ro(OBJECT(machine), name, reg[i],
+                                            reg[i + 1], pmgr_unk_regs,
+                                            ARRAY_SIZE(pmgr_unk_regs), NULL);
+        } else {
+            blk = apple_reg_block_create(OBJECT(machine), "pmgr-reg", reg[i],
+                                         reg[i + 1], pmgr_regs,
+                                         ARRAY_SIZE(pmgr_regs));
+            apple_reg_block_reset(blk);
+            s8000_machine->pmgr = blk;
         }
         memory_region_add_subregion_overlap(
             s8000_machine->sysmem,
             reg[i] + reg[i + 1] < s8000_machine->soc_size ?
                 s8000_machine->soc_base_pa + reg[i] :
                 reg[i],
-            mem, -1);
+            &blk->mr, -1);
     }
 
     set_dtb_prop(child, "voltage-states1", sizeof(s8000_voltage_states1),
@@ -1168,6 +1117,15 @@ static void s8000_machine_reset(MachineState *machine, ShutdownCause reason)
                  s8000_machine->force_dfu);
 }
 
+static bool s8000_dump_info(XnuDumpInfo *info, void *opaque, Error **errp)
+{
+    S8000MachineState *s8000_machine = opaque;
+
+    return macho_dump_info(
+        info, get_dtb_node(s8000_machine->device_tree, "/chosen/memory-map"),
+        s8000_machine->kernel, s8000_machine->bootinfo.kern_boot_args_addr, errp);
+}
+
 static void s8000_machine_init_done(Notifier *notifier, void *data)
 {
     S8000MachineState *s8000_machine =
@@ -1190,8 +1148,8 @@ static void s8000_machine_init(MachineState *machine)
     s8000_machine->sysmem = get_system_memory();
     allocate_ram(s8000_machine->sysmem, "SRAM", S8000_SRAM_BASE,
                  S8000_SRAM_SIZE, 0);
-    allocate_ram(s8000_machine->sysmem, "DRAM", S8000_DRAM_BASE,
-                 S8000_DRAM_SIZE, 0);
+    memory_region_add_subregion(s8000_machine->sysmem, S8000_DRAM_BASE,
+                                machine->ram);
     allocate_ram(s8000_machine->sysmem, "SEPROM", S8000_SEPROM_BASE,
                  S8000_SEPROM_SIZE, 0);
     MemoryRegion *mr = g_new0(MemoryRegion, 1);
@@ -1218,7 +1176,9 @@ static void s8000_machine_init(MachineState *machine)
     g_virt_base = kernel_low;
     g_phys_base = (hwaddr)macho_get_buffer(hdr);
 
-    s8000_patch_kernel(hdr);
+    s8000_patch_kernel(s8000_machine, hdr);
+    xnu_sym_init(hdr);
+    xnu_dump_register(s8000_dump_info, s8000_machine);
 
     s8000_machine->device_tree = load_dtb_from_file(machine->dtb);
     s8000_machine->trustcache =
@@ -1328,6 +1288,8 @@ static void s8000_machine_init(MachineState *machine)
 
     s8000_display_create(machine);
 
+    apple_stats_init();
+
     s8000_machine->init_done_notifier.notify = s8000_machine_init_done;
     qemu_add_machine_init_done_notifier(&s8000_machine->init_done_notifier);
 }
@@ -1426,6 +1388,24 @@ static char *s8000_get_sepfw_filename(Object *obj, Error **errp)
     return g_strdup(s8000_machine->sep_fw_filename);
 }
 
+static void s8000_set_kernel_patches_filename(Object *obj, const char *value,
+                                              Error **errp)
+{
+    S8000MachineState *s8000_machine;
+
+    s8000_machine = S8000_MACHINE(obj);
+    g_free(s8000_machine->kernel_patches_filename);
+    s8000_machine->kernel_patches_filename = g_strdup(value);
+}
+
+static char *s8000_get_kernel_patches_filename(Object *obj, Error **errp)
+{
+    S8000MachineState *s8000_machine;
+
+    s8000_machine = S8000_MACHINE(obj);
+    return g_strdup(s8000_machine->kernel_patches_filename);
+}
+
 static void s8000_set_boot_mode(Object *obj, const char *value, Error **errp)
 {
     S8000MachineState *s8000_machine;
@@ -1522,6 +1502,7 @@ static void s8000_machine_class_init(ObjectClass *klass, void *data)
     mc->default_cpu_type = TYPE_APPLE_A9;
     mc->minimum_page_bits = 14;
     mc->default_ram_size = S8000_DRAM_SIZE;
+    mc->default_ram_id = "s8000.dram";
     mc->fixup_ram_size = s8000_machine_fixup_ram_size;
 
     object_class_property_add_str(klass, "trustcache",
@@ -1540,6 +1521,12 @@ static void s8000_machine_class_init(ObjectClass *klass, void *data)
     object_class_property_add_str(klass, "sepfw", s8000_get_sepfw_filename,
                                   s8000_set_sepfw_filename);
     object_class_property_set_description(klass, "sepfw", "SEPFW to be loaded");
+    object_class_property_add_str(klass, "kernel-patches",
+                                  s8000_get_kernel_patches_filename,
+                                  s8000_set_kernel_patches_filename);
+    object_class_property_set_description(
+        klass, "kernel-patches",
+        "File of instruction signatures to patch in the kernelcache");
     object_class_property_add_str(klass, "boot-mode", s8000_get_boot_mode,
                                   s8000_set_boot_mode);
     object_class_property_set_description(klass, "boot-mode",
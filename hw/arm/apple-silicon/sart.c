@@ -2,7 +2,13 @@
 #include "exec/address-spaces.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/arm/apple-silicon/sart.h"
+#include "hw/arm/apple-silicon/stats.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
 #include "qemu/module.h"
+#include "qemu/stats64.h"
+#include "sysemu/dma.h"
+#include "sysemu/stats.h"
 
 // #define DEBUG_SART
 
@@ -20,9 +26,24 @@
 #define SART_MAX_VA_BITS 42
 #define SART_NUM_REGIONS 16
 
+typedef enum {
+    SART_STAT_TRANSLATIONS = 0,
+    SART_STAT_OUTSIDE_REGIONS,
+    SART_STAT_REGION_UPDATES,
+    SART_STAT__MAX,
+} sart_stat_t;
+
+static const char *sart_stat_name[SART_STAT__MAX] = {
+    [SART_STAT_TRANSLATIONS] = "translations",
+    [SART_STAT_OUTSIDE_REGIONS] = "outside-regions",
+    [SART_STAT_REGION_UPDATES] = "region-updates",
+};
+
 typedef struct AppleSARTIOMMUMemoryRegion {
     IOMMUMemoryRegion parent_obj;
     AppleSARTState *s;
+    IOMMUNotifierFlag notifier_flags;
+    Stat64 stats[SART_STAT__MAX];
 } AppleSARTIOMMUMemoryRegion;
 
 typedef struct AppleSARTRegion {
@@ -31,11 +52,19 @@ typedef struct AppleSARTRegion {
     uint32_t flags;
 } AppleSARTRegion;
 
+/* Merged run of enabled regions, in 4K pages, `end` inclusive. */
+typedef struct AppleSARTSpan {
+    uint64_t start;
+    uint64_t end;
+} AppleSARTSpan;
+
 struct AppleSARTState {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
     AppleSARTIOMMUMemoryRegion iommu;
     AppleSARTRegion regions[SART_NUM_REGIONS];
+    AppleSARTSpan spans[SART_NUM_REGIONS];
+    uint32_t num_spans;
     uint32_t version;
     uint32_t reg[0x8000 / sizeof(uint32_t)];
 };
@@ -95,40 +124,127 @@ static inline uint32_t sart_get_region_flags(AppleSARTState *s, int region)
     }
 }
 
-static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                           unsigned size)
+/*
+ * Notify `type` for the pages covered by `region`, split into naturally
+ * aligned power-of-two chunks. With `n` set only that notifier is told.
+ */
+static void apple_sart_notify_region(AppleSARTState *s, IOMMUNotifier *n,
+                                     const AppleSARTRegion *region,
+                                     IOMMUNotificationType type)
 {
-    AppleSARTState *s = APPLE_SART(opaque);
-    uint32_t orig;
-    uint32_t val = data;
-    DPRINTF("%s: %s @ 0x" HWADDR_FMT_plx " value: 0x" HWADDR_FMT_plx "\n",
-            DEVICE(s)->id, __func__, addr, data);
+    hwaddr start = region->addr << 12;
+    hwaddr end = ((region->addr + region->size) << 12) - 1;
+    IOMMUTLBEvent event = {
+        .type = type,
+        .entry.target_as = &address_space_memory,
+        .entry.perm = type == IOMMU_NOTIFIER_MAP ? IOMMU_RW : IOMMU_NONE,
+    };
 
-    orig = s->reg[addr >> 2];
+    if (region->size == 0 || (type == IOMMU_NOTIFIER_MAP && !region->flags)) {
+        return;
+    }
 
-    s->reg[addr >> 2] = val;
+    for (;;) {
+        hwaddr mask = dma_aligned_pow2_mask(start, end, SART_MAX_VA_BITS);
+
+        event.entry.iova = start;
+        event.entry.translated_addr = start;
+        event.entry.addr_mask = mask;
+        if (n) {
+            memory_region_notify_iommu_one(n, &event);
+        } else {
+            memory_region_notify_iommu(IOMMU_MEMORY_REGION(&s->iommu), 0,
+                                       event);
+        }
+        if (start + mask >= end) {
+            break;
+        }
+        start += mask + 1;
+    }
+}
+
+static int apple_sart_span_cmp(const void *a, const void *b)
+{
+    const AppleSARTSpan *sa = a;
+    const AppleSARTSpan *sb = b;
+
+    if (sa->start != sb->start) {
+        return sa->start < sb->start ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Rebuild the sorted, non-overlapping index of enabled regions. */
+static void apple_sart_rebuild_spans(AppleSARTState *s)
+{
+    AppleSARTSpan spans[SART_NUM_REGIONS];
+    uint32_t n = 0;
+
+    for (int i = 0; i < SART_NUM_REGIONS; i++) {
+        if (s->regions[i].size == 0 || s->regions[i].flags == 0) {
+            continue;
+        }
+        spans[n].start = s->regions[i].addr;
+        spans[n].end = s->regions[i].addr + s->regions[i].size - 1;
+        n++;
+    }
+    qsort(spans, n, sizeof(spans[0]), apple_sart_span_cmp);
+
+    s->num_spans = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        AppleSARTSpan *last =
+            s->num_spans ? &s->spans[s->num_spans - 1] : NULL;
+
+        if (last && spans[i].start <= last->end + 1) {
+            last->end = MAX(last->end, spans[i].end);
+        } else {
+            s->spans[s->num_spans++] = spans[i];
+        }
+    }
+}
+
+/* Bring the decoded regions in line with the registers, notifying changes. */
+static void apple_sart_sync_regions(AppleSARTState *s)
+{
+    bool changed = false;
 
     for (int i = 0; i < SART_NUM_REGIONS; i++) {
         if ((sart_get_region_addr(s, i) != s->regions[i].addr) ||
             (sart_get_region_size(s, i) != s->regions[i].size) ||
             (sart_get_region_flags(s, i) != s->regions[i].flags)) {
-            hwaddr curr = s->regions[i].addr;
-            for (curr = s->regions[i].addr;
-                 curr < s->regions[i].addr + s->regions[i].size; curr++) {
-                IOMMUTLBEvent event;
-                event.type = IOMMU_NOTIFIER_UNMAP;
-                event.entry.target_as = &address_space_memory;
-                event.entry.iova = curr << 12;
-                event.entry.perm = IOMMU_NONE;
-                event.entry.addr_mask = 0xFFF;
-                memory_region_notify_iommu(IOMMU_MEMORY_REGION(&s->iommu), 0,
-                                           event);
-            }
+            apple_sart_notify_region(s, NULL, &s->regions[i],
+                                     IOMMU_NOTIFIER_UNMAP);
             s->regions[i].addr = sart_get_region_addr(s, i);
             s->regions[i].size = sart_get_region_size(s, i);
             s->regions[i].flags = sart_get_region_flags(s, i);
+            if (s->iommu.notifier_flags & IOMMU_NOTIFIER_MAP) {
+                apple_sart_notify_region(s, NULL, &s->regions[i],
+                                         IOMMU_NOTIFIER_MAP);
+            }
+            stat64_add(&s->iommu.stats[SART_STAT_REGION_UPDATES], 1);
+            changed = true;
         }
     }
+
+    if (changed) {
+        apple_sart_rebuild_spans(s);
+    }
+}
+
+static void base_reg_write(void *opaque, hwaddr addr, uint64_t data,
+                           unsigned size)
+{
+    AppleSARTState *s = APPLE_SART(opaque);
+    uint32_t orig;
+    uint32_t val = data;
+    DPRINTF("%s: %s @ 0x" HWADDR_FMT_plx " value: 0x" HWADDR_FMT_plx "\n",
+            DEVICE(s)->id, __func__, addr, data);
+
+    orig = s->reg[addr >> 2];
+
+    s->reg[addr >> 2] = val;
+
+    apple_sart_sync_regions(s);
 }
 
 static uint64_t base_reg_read(void *opaque, hwaddr addr, unsigned size)
@@ -150,37 +266,110 @@ static const MemoryRegionOps base_reg_ops = {
     .valid.unaligned = false,
 };
 
+/* Largest naturally aligned block around `addr` within [start, end]. */
+static hwaddr apple_sart_span_mask(hwaddr addr, hwaddr start, hwaddr end)
+{
+    hwaddr mask = 0xFFF;
+
+    while (mask < (1ULL << SART_MAX_VA_BITS) - 1) {
+        hwaddr next = (mask << 1) | 1;
+
+        if ((addr & ~next) < start || (addr | next) > end) {
+            break;
+        }
+        mask = next;
+    }
+    return mask;
+}
+
 static IOMMUTLBEntry apple_sart_translate(IOMMUMemoryRegion *mr, hwaddr addr,
                                           IOMMUAccessFlags flag, int iommu_idx)
 {
     AppleSARTIOMMUMemoryRegion *iommu = APPLE_SART_IOMMU_MEMORY_REGION(mr);
     AppleSARTState *s = container_of(iommu, AppleSARTState, iommu);
+    uint64_t page = addr >> 12;
+    uint64_t start = 0;
+    uint64_t end = (1ULL << (SART_MAX_VA_BITS - 12)) - 1;
+    uint32_t lo = 0;
+    uint32_t hi = s->num_spans;
+    hwaddr mask;
+
+    stat64_add(&iommu->stats[SART_STAT_TRANSLATIONS], 1);
+
+    /* Find the first span that does not end before `page`. */
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (s->spans[mid].end < page) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
 
-    IOMMUTLBEntry entry = {
+    /*
+     * Translation is identity either way; the span only bounds how far
+     * the returned entry may reach, either within the matched region or
+     * within the gap between two regions.
+     */
+    if (lo < s->num_spans && s->spans[lo].start <= page) {
+        start = s->spans[lo].start;
+        end = s->spans[lo].end;
+    } else {
+        stat64_add(&iommu->stats[SART_STAT_OUTSIDE_REGIONS], 1);
+        if (lo > 0) {
+            start = s->spans[lo - 1].end + 1;
+        }
+        if (lo < s->num_spans) {
+            end = s->spans[lo].start - 1;
+        }
+    }
+    mask = apple_sart_span_mask(addr, start << 12, ((end + 1) << 12) - 1);
+
+    return (IOMMUTLBEntry){
         .target_as = &address_space_memory,
-        .iova = addr & ~0xFFF,
-        .translated_addr = addr & ~0xFFF,
-        .addr_mask = 0xFFF,
+        .iova = addr & ~mask,
+        .translated_addr = addr & ~mask,
+        .addr_mask = mask,
         .perm = IOMMU_RW,
     };
-    addr >>= 12;
+}
+
+static void apple_sart_replay(IOMMUMemoryRegion *mr, IOMMUNotifier *n)
+{
+    AppleSARTIOMMUMemoryRegion *iommu = APPLE_SART_IOMMU_MEMORY_REGION(mr);
+    AppleSARTState *s = container_of(iommu, AppleSARTState, iommu);
 
     for (int i = 0; i < SART_NUM_REGIONS; i++) {
-        if ((s->regions[i].addr <= addr) &&
-            (addr < s->regions[i].addr + s->regions[i].size) &&
-            s->regions[i].flags) {
-            entry.perm = IOMMU_RW;
-            break;
-        }
+        apple_sart_notify_region(s, n, &s->regions[i], IOMMU_NOTIFIER_MAP);
+    }
+}
+
+static int apple_sart_notify_flag_changed(IOMMUMemoryRegion *mr,
+                                          IOMMUNotifierFlag old,
+                                          IOMMUNotifierFlag new, Error **errp)
+{
+    AppleSARTIOMMUMemoryRegion *iommu = APPLE_SART_IOMMU_MEMORY_REGION(mr);
+
+    if (new & IOMMU_NOTIFIER_DEVIOTLB_UNMAP) {
+        error_setg(errp, "SART does not support dev-iotlb notifiers");
+        return -EINVAL;
     }
-    return entry;
+    iommu->notifier_flags = new;
+    return 0;
 }
 
 static void apple_sart_reset(DeviceState *dev)
 {
     AppleSARTState *s = APPLE_SART(dev);
+
+    for (int i = 0; i < SART_NUM_REGIONS; i++) {
+        apple_sart_notify_region(s, NULL, &s->regions[i],
+                                 IOMMU_NOTIFIER_UNMAP);
+    }
     memset(s->reg, 0, sizeof(s->reg));
     memset(s->regions, 0, sizeof(s->regions));
+    s->num_spans = 0;
 }
 
 SysBusDevice *apple_sart_create(DTBNode *node)
@@ -220,12 +409,103 @@ SysBusDevice *apple_sart_create(DTBNode *node)
     return sbd;
 }
 
+typedef struct AppleSARTStatsArgs {
+    StatsResultList **result;
+    strList *names;
+} AppleSARTStatsArgs;
+
+static int apple_sart_stats_query(Object *obj, void *opaque)
+{
+    AppleSARTStatsArgs *args = opaque;
+    AppleSARTState *s;
+    g_autofree char *path = NULL;
+    StatsList *stats_list = NULL;
+
+    if (!object_dynamic_cast(obj, TYPE_APPLE_SART)) {
+        object_child_foreach(obj, apple_sart_stats_query, opaque);
+        return 0;
+    }
+
+    s = APPLE_SART(obj);
+    for (int i = 0; i < SART_STAT__MAX; i++) {
+        if (apply_str_list_filter(sart_stat_name[i], args->names)) {
+            apple_stats_prepend(&stats_list, sart_stat_name[i],
+                                stat64_get(&s->iommu.stats[i]));
+        }
+    }
+    if (stats_list) {
+        path = object_get_canonical_path(OBJECT(&s->iommu));
+        add_stats_entry(args->result, STATS_PROVIDER_APPLE_SART, path,
+                        stats_list);
+    }
+    return 0;
+}
+
+static void apple_sart_stats_cb(StatsResultList **result, StatsTarget target,
+                                strList *names, strList *targets,
+                                Error **errp)
+{
+    AppleSARTStatsArgs args = { .result = result, .names = names };
+
+    if (target != STATS_TARGET_IOMMU) {
+        return;
+    }
+    object_child_foreach(qdev_get_machine(), apple_sart_stats_query, &args);
+}
+
+static void apple_sart_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = 0; i < SART_STAT__MAX; i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(sart_stat_name[i]);
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_SART, STATS_TARGET_IOMMU,
+                     stats_list);
+}
+
+/*
+ * The decoded regions and spans are derived from the registers. The spans
+ * are rebuilt even when no region changed, rather than trusting whatever
+ * the destination had before the load.
+ */
+static int apple_sart_post_load(void *opaque, int version_id)
+{
+    AppleSARTState *s = APPLE_SART(opaque);
+
+    apple_sart_sync_regions(s);
+    apple_sart_rebuild_spans(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_sart = {
+    .name = "apple_sart",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .priority = MIG_PRI_IOMMU,
+    .post_load = apple_sart_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32_ARRAY(reg, AppleSARTState,
+                                 0x8000 / sizeof(uint32_t)),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_sart_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    add_stats_callbacks(STATS_PROVIDER_APPLE_SART, apple_sart_stats_cb,
+                        apple_sart_schemas_cb);
+
     dc->reset = apple_sart_reset;
     dc->desc = "Apple SART IOMMU";
+    dc->vmsd = &vmstate_apple_sart;
 }
 
 static void apple_sart_iommu_memory_region_class_init(ObjectClass *klass,
@@ -234,6 +514,8 @@ static void apple_sart_iommu_memory_region_class_init(ObjectClass *klass,
     IOMMUMemoryRegionClass *imrc = IOMMU_MEMORY_REGION_CLASS(klass);
 
     imrc->translate = apple_sart_translate;
+    imrc->replay = apple_sart_replay;
+    imrc->notify_flag_changed = apple_sart_notify_flag_changed;
 }
 
 static const TypeInfo apple_sart_info = {
@@ -18,15 +18,22 @@
  */
 
 #include "qemu/osdep.h"
+#include "block/block_int.h"
 #include "crypto/hash.h"
+#include "hw/arm/apple-silicon/boot.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/arm/apple-silicon/sep-sim.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
+#include "hw/nvme/nvme.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
+#include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
 #include "art.h"
 #include "libtasn1.h"
@@ -196,6 +203,29 @@ typedef struct {
     uint16_t size;
 } KeystoreMessage;
 
+/*
+ * A keystore request handed to the worker thread. The OOL buffers are
+ * captured when the message is received so later OOL updates from the AP
+ * cannot redirect a request that is still in flight.
+ *
+ * While the request is handled, in and out point at the OOL buffers mapped
+ * from the SEP's address space, or at bounce buffers when they cannot be
+ * mapped whole or the two overlap.
+ */
+struct AppleSEPSimKeystoreJob {
+    KeystoreMessage msg;
+    uint64_t in_addr;
+    uint64_t out_addr;
+    uint8_t *in;
+    uint8_t *out;
+    dma_addr_t out_len;
+    bool in_mapped;
+    bool out_mapped;
+    uint32_t reply_data;
+    uint32_t generation;
+    QTAILQ_ENTRY(AppleSEPSimKeystoreJob) entry;
+};
+
 
 #define KEYSTORE_IPC_HEADER_SIZE 0x54
 #define KEYSTORE_IPC_VERSION_1 1
@@ -281,19 +311,18 @@ static void apple_sep_sim_send_message(AppleSEPSimState *s, uint8_t ep,
                                        uint32_t data)
 {
     AppleA7IOP *a7iop;
-    AppleA7IOPMessage *sent_msg;
+    AppleA7IOPMessage sent_msg = { 0 };
     SEPMessage *sent_sep_msg;
 
     a7iop = APPLE_A7IOP(s);
 
-    sent_msg = g_new0(AppleA7IOPMessage, 1);
-    sent_sep_msg = (SEPMessage *)sent_msg->data;
+    sent_sep_msg = (SEPMessage *)sent_msg.data;
     sent_sep_msg->ep = ep;
     sent_sep_msg->tag = tag;
     sent_sep_msg->op = op;
     sent_sep_msg->param = param;
     sent_sep_msg->data = data;
-    apple_a7iop_send_ap(a7iop, sent_msg);
+    apple_a7iop_send_ap(a7iop, &sent_msg);
 }
 
 static void apple_sep_sim_message_reply(AppleSEPSimState *s, SEPMessage *msg,
@@ -493,7 +522,7 @@ static const uint32_t apple_sep_sim_endpoint_names[] = {
 static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
 {
     AppleA7IOP *a7iop;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     EPAdvertisementMessage *ep_advert_msg;
     OOLAdvertisementMessage *ool_advert_msg;
     size_t i;
@@ -502,22 +531,22 @@ static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
 
     for (i = 0; i < (sizeof(apple_sep_sim_eps) / sizeof(*apple_sep_sim_eps));
          i++) {
-        msg = g_new0(AppleA7IOPMessage, 1);
-        ep_advert_msg = (EPAdvertisementMessage *)msg->data;
+        memset(&msg, 0, sizeof(msg));
+        ep_advert_msg = (EPAdvertisementMessage *)msg.data;
         ep_advert_msg->ep = EP_DISCOVERY;
         ep_advert_msg->op = DISCOVERY_OP_EP_ADVERT;
         ep_advert_msg->id = apple_sep_sim_eps[i];
         ep_advert_msg->name = apple_sep_sim_endpoint_names[i];
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_a7iop_send_ap(a7iop, &msg);
 
-        msg = g_new0(AppleA7IOPMessage, 1);
-        ool_advert_msg = (OOLAdvertisementMessage *)msg->data;
+        memset(&msg, 0, sizeof(msg));
+        ool_advert_msg = (OOLAdvertisementMessage *)msg.data;
         ool_advert_msg->ep = EP_DISCOVERY;
         ool_advert_msg->op = DISCOVERY_OP_OOL_ADVERT;
         ool_advert_msg->id = apple_sep_sim_eps[i];
         memcpy(&ool_advert_msg->ool_info, s->ool_info + apple_sep_sim_eps[i],
                sizeof(AppleSEPSimOOLInfo));
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_a7iop_send_ap(a7iop, &msg);
     }
 }
 
@@ -555,6 +584,7 @@ static void apple_sep_sim_handle_bootstrap_msg(AppleSEPSimState *s,
                                    0);
 
         apple_sep_sim_advertise_eps(s);
+        apple_boot_milestone("sep_booted");
         break;
     }
     default:
@@ -592,8 +622,209 @@ static uint8_t *apple_sep_sim_gen_sks_hash(uint8_t *buf,
     return hash;
 }
 
+#define SEP_KEYSTORE_FILE_MAGIC 0x53534B53 /* 'SKSS' */
+#define SEP_KEYSTORE_FILE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ecid;
+    uint8_t nand_id[32];
+    AppleSEPSimKeystoreState state;
+} QEMU_PACKED AppleSEPSimKeystoreFile;
+
+/*
+ * Tells NAND images apart by the bottom of the first NVMe namespace's
+ * backing chain, which the overlays cloned from one golden image share.
+ */
+static void apple_sep_sim_keystore_nand_id(uint8_t *id)
+{
+    BlockBackend *blk;
+    DeviceState *dev;
+    const char *name = "";
+    uint8_t *hash = NULL;
+    size_t hash_len = 0;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    for (blk = blk_all_next(NULL); blk != NULL; blk = blk_all_next(blk)) {
+        dev = blk_get_attached_dev(blk);
+        if (dev != NULL && blk_bs(blk) != NULL &&
+            object_dynamic_cast(OBJECT(dev), TYPE_NVME_NS) != NULL) {
+            name = bdrv_find_base(blk_bs(blk))->filename;
+            break;
+        }
+    }
+
+    g_assert_cmpuint(qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, name,
+                                        strlen(name), &hash, &hash_len,
+                                        &error_fatal),
+                     ==, 0);
+    g_assert_cmpuint(hash_len, ==, sizeof_field(AppleSEPSimKeystoreFile,
+                                                nand_id));
+    memcpy(id, hash, hash_len);
+    g_free(hash);
+}
+
+/* Picks up the keystore file, if it was written for this ECID and NAND. */
+static void apple_sep_sim_keystore_load(AppleSEPSimState *s)
+{
+    g_autofree gchar *contents = NULL;
+    gsize len;
+    const AppleSEPSimKeystoreFile *file;
+
+    apple_sep_sim_keystore_nand_id(s->keystore_nand_id);
+
+    if (s->keystore_path == NULL ||
+        !g_file_get_contents(s->keystore_path, &contents, &len, NULL)) {
+        return;
+    }
+
+    file = (const AppleSEPSimKeystoreFile *)contents;
+    if (len != sizeof(*file) || file->magic != SEP_KEYSTORE_FILE_MAGIC ||
+        file->version != SEP_KEYSTORE_FILE_VERSION) {
+        warn_report("SEP: ignoring malformed keystore file %s",
+                    s->keystore_path);
+        return;
+    }
+    if (file->ecid != s->ecid ||
+        memcmp(file->nand_id, s->keystore_nand_id, sizeof(file->nand_id))) {
+        warn_report("SEP: keystore file %s belongs to another device or "
+                    "NAND image, ignoring it",
+                    s->keystore_path);
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+    {
+        s->keystore = file->state;
+    }
+}
+
+static AppleSEPSimKeystoreState
+apple_sep_sim_keystore_get(AppleSEPSimState *s)
+{
+    QEMU_LOCK_GUARD(&s->keystore_lock);
+    return s->keystore;
+}
+
+/* Runs on the keystore worker thread. */
+static void apple_sep_sim_keystore_set(AppleSEPSimState *s,
+                                       const AppleSEPSimKeystoreState *state)
+{
+    AppleSEPSimKeystoreFile file = { 0 };
+    g_autoptr(GError) err = NULL;
+
+    WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+    {
+        if (memcmp(&s->keystore, state, sizeof(*state)) == 0) {
+            return;
+        }
+        s->keystore = *state;
+    }
+
+    if (s->keystore_path == NULL) {
+        return;
+    }
+
+    file.magic = SEP_KEYSTORE_FILE_MAGIC;
+    file.version = SEP_KEYSTORE_FILE_VERSION;
+    file.ecid = s->ecid;
+    memcpy(file.nand_id, s->keystore_nand_id, sizeof(file.nand_id));
+    file.state = *state;
+    if (!g_file_set_contents(s->keystore_path, (const gchar *)&file,
+                             sizeof(file), &err)) {
+        warn_report("SEP: failed to save the keystore to %s: %s",
+                    s->keystore_path, err->message);
+    }
+}
+
+static const uint8_t *apple_sep_sim_keystore_map_in(AppleSEPSimState *s,
+                                                    AppleSEPSimKeystoreJob *job)
+{
+    dma_addr_t len = job->msg.size;
+
+    job->in = dma_memory_map(s->dma_as, job->in_addr, &len,
+                             DMA_DIRECTION_TO_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    if (job->in != NULL && len == job->msg.size) {
+        job->in_mapped = true;
+        return job->in;
+    }
+    if (job->in != NULL) {
+        dma_memory_unmap(s->dma_as, job->in, len, DMA_DIRECTION_TO_DEVICE, 0);
+    }
+
+    job->in_mapped = false;
+    job->in = g_new0(uint8_t, job->msg.size);
+    dma_memory_read(s->dma_as, job->in_addr, job->in, job->msg.size,
+                    MEMTXATTRS_UNSPECIFIED);
+    return job->in;
+}
+
+/*
+ * Returns a zeroed response buffer of the given size, the OOL out buffer
+ * itself unless building the response there would clobber the request.
+ */
+static uint8_t *apple_sep_sim_keystore_resp_buf(AppleSEPSimState *s,
+                                                AppleSEPSimKeystoreJob *job,
+                                                const uint32_t resp_size)
+{
+    dma_addr_t len = resp_size;
+
+    g_assert_null(job->out);
+    job->out_len = resp_size;
+
+    if (job->out_addr >= job->in_addr + job->msg.size ||
+        job->in_addr >= job->out_addr + resp_size) {
+        job->out = dma_memory_map(s->dma_as, job->out_addr, &len,
+                                  DMA_DIRECTION_FROM_DEVICE,
+                                  MEMTXATTRS_UNSPECIFIED);
+        if (job->out != NULL && len == resp_size) {
+            job->out_mapped = true;
+            memset(job->out, 0, resp_size);
+            return job->out;
+        }
+        if (job->out != NULL) {
+            dma_memory_unmap(s->dma_as, job->out, len,
+                             DMA_DIRECTION_FROM_DEVICE, 0);
+        }
+    }
+
+    job->out_mapped = false;
+    job->out = g_new0(uint8_t, resp_size);
+    return job->out;
+}
+
+static void apple_sep_sim_keystore_unmap(AppleSEPSimState *s,
+                                         AppleSEPSimKeystoreJob *job)
+{
+    if (job->in_mapped) {
+        dma_memory_unmap(s->dma_as, job->in, job->msg.size,
+                         DMA_DIRECTION_TO_DEVICE, 0);
+    } else {
+        g_free(job->in);
+    }
+    job->in = NULL;
+
+    if (job->out == NULL) {
+        return;
+    }
+    if (job->out_mapped) {
+        dma_memory_unmap(s->dma_as, job->out, job->out_len,
+                         DMA_DIRECTION_FROM_DEVICE, job->out_len);
+    } else {
+        /* A reset since the request came in has dropped it. */
+        if (job->generation == qatomic_read(&s->keystore_generation)) {
+            dma_memory_write(s->dma_as, job->out_addr, job->out, job->out_len,
+                             MEMTXATTRS_UNSPECIFIED);
+        }
+        g_free(job->out);
+    }
+    job->out = NULL;
+}
+
 static void apple_sep_sim_keystore_send_ipc_resp(AppleSEPSimState *s,
-                                                 const KeystoreMessage *msg,
+                                                 AppleSEPSimKeystoreJob *job,
                                                  uint8_t *resp_buf,
                                                  const uint32_t resp_size)
 {
@@ -606,20 +837,17 @@ static void apple_sep_sim_keystore_send_ipc_resp(AppleSEPSimState *s,
     memcpy(resp_hdr->payload_hash, resp_hash, sizeof(resp_hdr->payload_hash));
     g_free(resp_hash);
 
-    dma_memory_write(s->dma_as, s->ool_state[EP_KEYSTORE].out_addr, resp_buf,
-                     resp_size, MEMTXATTRS_UNSPECIFIED);
-
-    apple_sep_sim_send_message(s, msg->ep, msg->tag | KEYSTORE_MSG_TAG_REPLY,
-                               msg->id, 0, resp_size << 16);
+    job->reply_data = resp_size << 16;
 }
 
+/* Runs on the keystore worker thread; the reply is posted by the caller. */
 static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
-                                              KeystoreMessage *msg)
+                                              AppleSEPSimKeystoreJob *job)
 {
+    const KeystoreMessage *msg = &job->msg;
     uint8_t msg_code = msg->tag & KEYSTORE_MSG_TAG_CODE_MASK;
-    uint8_t *msg_buf = g_new0(uint8_t, msg->size);
-    dma_memory_read(s->dma_as, s->ool_state[EP_KEYSTORE].in_addr, msg_buf,
-                    msg->size, MEMTXATTRS_UNSPECIFIED);
+    AppleSEPSimKeystoreState state = apple_sep_sim_keystore_get(s);
+    const uint8_t *msg_buf = apple_sep_sim_keystore_map_in(s, job);
     const KeystoreIPCHeader *msg_hdr = (KeystoreIPCHeader *)msg_buf;
 #if 0
     char fn[128];
@@ -634,7 +862,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Create Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -651,8 +880,10 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *kb_id = selector + 1;
         *kb_id = 'BAG1';
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        state.keybag_handle = *kb_id;
+        apple_sep_sim_keystore_set(s, &state);
+
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x02: {
@@ -664,7 +895,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
                       *lword, *word1);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x10;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -682,15 +914,15 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *payload_blob = 0x10;
         memset(payload_blob + 1, 0xAF, *payload_blob);
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x03: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Load Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -705,17 +937,21 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         *selector = 0;
         uint32_t *kb_handle = selector + 1;
-        *kb_handle = 'BAG1';
+        if (state.keybag_handle == 0) {
+            state.keybag_handle = 'BAG1';
+            apple_sep_sim_keystore_set(s, &state);
+        }
+        *kb_handle = state.keybag_handle;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x04: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Change Lock State\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x8;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -735,15 +971,20 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *lock_state |= (1 << 22);
         uint64_t *device_state = (uint64_t *)(lock_state + 1);
         *device_state = 0x1 | 0x2;
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+
+        state.lock_state = *lock_state;
+        state.device_state = *device_state;
+        apple_sep_sim_keystore_set(s, &state);
+
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x05: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unload Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -758,8 +999,7 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         *selector = 0;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x08: {
@@ -781,17 +1021,17 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         // uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         // *selector = 0;
 
-        // apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
+        // apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         // g_free(resp_buf);
-        apple_sep_sim_send_message(
-            s, msg->ep, msg->tag | KEYSTORE_MSG_TAG_REPLY, msg->id, 0, 0);
+        job->reply_data = 0;
         break;
     }
     case 0x0A: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Null D Key\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -807,15 +1047,15 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         *selector = 0;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x0C: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unwrap D Key\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -831,15 +1071,15 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         *selector = 0;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x0D: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Make System Keybag\n");
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -855,8 +1095,7 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *selector = (uint32_t *)(resp_hdr + 1);
         *selector = 0;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x19: {
@@ -870,7 +1109,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
             *lword, *word1, *word2);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4 + 0x4 + 0x8;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -890,8 +1130,7 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         *state_blob = 0x8;
         memcpy(state_blob + 1, "applehax", *state_blob);
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     case 0x1B: {
@@ -900,7 +1139,8 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
                       "SEP KeyStore // Client Terminate (0x%X)\n", *selector);
 
         const uint32_t resp_size = KEYSTORE_IPC_HEADER_SIZE + 0x4;
-        uint8_t *resp_buf = g_new0(uint8_t, resp_size);
+        uint8_t *resp_buf =
+            apple_sep_sim_keystore_resp_buf(s, job, resp_size);
 
         KeystoreIPCHeader *resp_hdr = (KeystoreIPCHeader *)resp_buf;
         resp_hdr->header_body_size = KEYSTORE_IPC_HEADER_SIZE - 0x4;
@@ -915,30 +1155,118 @@ static void apple_sep_sim_handle_keystore_msg(AppleSEPSimState *s,
         uint32_t *resp_selector = (uint32_t *)(resp_hdr + 1);
         *resp_selector = 0;
 
-        apple_sep_sim_keystore_send_ipc_resp(s, msg, resp_buf, resp_size);
-        g_free(resp_buf);
+        apple_sep_sim_keystore_send_ipc_resp(s, job, resp_buf, resp_size);
         break;
     }
     default: {
         qemu_log_mask(LOG_GUEST_ERROR, "SEP KeyStore // Unknown (0x%02X)\n",
                       msg_code);
 
-        dma_memory_write(s->dma_as, s->ool_state[EP_KEYSTORE].out_addr, msg_buf,
-                         msg->size, MEMTXATTRS_UNSPECIFIED);
-        apple_sep_sim_send_message(s, msg->ep,
-                                   msg->tag | KEYSTORE_MSG_TAG_REPLY, msg->id,
-                                   0, (uint32_t)msg->size << 16);
+        memcpy(apple_sep_sim_keystore_resp_buf(s, job, msg->size), msg_buf,
+               msg->size);
+        job->reply_data = (uint32_t)msg->size << 16;
         break;
     }
     }
-    g_free(msg_buf);
+    apple_sep_sim_keystore_unmap(s, job);
+}
+
+/*
+ * Runs on the keystore worker. Requests are handled whole, so a pause waits
+ * for at most one; those not started yet stay on the queue.
+ */
+static void apple_sep_sim_keystore_work(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+    AppleSEPSimKeystoreJob *job;
+
+    while (!apple_worker_should_yield(&s->keystore_worker)) {
+        WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+        {
+            job = QTAILQ_FIRST(&s->keystore_queue);
+            if (job != NULL) {
+                QTAILQ_REMOVE(&s->keystore_queue, job, entry);
+            }
+        }
+        if (job == NULL) {
+            return;
+        }
+
+        apple_sep_sim_handle_keystore_msg(s, job);
+
+        WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+        {
+            QTAILQ_INSERT_TAIL(&s->keystore_done, job, entry);
+        }
+        qemu_bh_schedule(s->keystore_bh);
+    }
+}
+
+static void apple_sep_sim_keystore_drop_jobs(AppleSEPSimState *s)
+{
+    AppleSEPSimKeystoreJob *job;
+
+    QEMU_LOCK_GUARD(&s->keystore_lock);
+    while ((job = QTAILQ_FIRST(&s->keystore_queue)) != NULL) {
+        QTAILQ_REMOVE(&s->keystore_queue, job, entry);
+        g_free(job);
+    }
+    while ((job = QTAILQ_FIRST(&s->keystore_done)) != NULL) {
+        QTAILQ_REMOVE(&s->keystore_done, job, entry);
+        g_free(job);
+    }
+}
+
+/* Posts the replies of finished keystore requests, in request order. */
+static void apple_sep_sim_keystore_bh(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+    AppleSEPSimKeystoreJob *job;
+
+    for (;;) {
+        WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+        {
+            job = QTAILQ_FIRST(&s->keystore_done);
+            if (job != NULL) {
+                QTAILQ_REMOVE(&s->keystore_done, job, entry);
+            }
+        }
+        if (job == NULL) {
+            break;
+        }
+        // Requests still in flight across a reset are dropped.
+        if (job->generation == qatomic_read(&s->keystore_generation)) {
+            apple_sep_sim_send_message(
+                s, job->msg.ep, job->msg.tag | KEYSTORE_MSG_TAG_REPLY,
+                job->msg.id, 0, job->reply_data);
+        }
+        g_free(job);
+    }
+}
+
+static void apple_sep_sim_queue_keystore_msg(AppleSEPSimState *s,
+                                             KeystoreMessage *msg)
+{
+    AppleSEPSimKeystoreJob *job;
+
+    job = g_new0(AppleSEPSimKeystoreJob, 1);
+    job->msg = *msg;
+    job->in_addr = s->ool_state[EP_KEYSTORE].in_addr;
+    job->out_addr = s->ool_state[EP_KEYSTORE].out_addr;
+    job->generation = qatomic_read(&s->keystore_generation);
+
+    WITH_QEMU_LOCK_GUARD(&s->keystore_lock)
+    {
+        QTAILQ_INSERT_TAIL(&s->keystore_queue, job, entry);
+    }
+    apple_worker_kick(&s->keystore_worker);
 }
 
 static void apple_sep_sim_bh(void *opaque)
 {
     AppleSEPSimState *s;
     AppleA7IOP *a7iop;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     SEPMessage *sep_msg;
 
     s = APPLE_SEP_SIM(opaque);
@@ -947,8 +1275,10 @@ static void apple_sep_sim_bh(void *opaque)
     QEMU_LOCK_GUARD(&s->lock);
 
     while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
-        msg = apple_a7iop_recv_iop(a7iop);
-        sep_msg = (SEPMessage *)msg->data;
+        if (!apple_a7iop_recv_iop(a7iop, &msg)) {
+            break;
+        }
+        sep_msg = (SEPMessage *)msg.data;
 
         switch (sep_msg->ep) {
         case EP_CONTROL:
@@ -970,7 +1300,7 @@ static void apple_sep_sim_bh(void *opaque)
             apple_sep_sim_handle_xart_msg(s, true, sep_msg);
             break;
         case EP_KEYSTORE:
-            apple_sep_sim_handle_keystore_msg(s, (KeystoreMessage *)sep_msg);
+            apple_sep_sim_queue_keystore_msg(s, (KeystoreMessage *)sep_msg);
             break;
         case EP_XART_MASTER:
             apple_sep_sim_handle_xart_msg(s, false, sep_msg);
@@ -990,8 +1320,6 @@ static void apple_sep_sim_bh(void *opaque)
                           sep_msg->op);
             break;
         }
-
-        g_free(msg);
     }
 }
 
@@ -1017,6 +1345,10 @@ AppleSEPSimState *apple_sep_sim_create(DTBNode *node, bool modern)
                      qemu_bh_new(apple_sep_sim_bh, s));
 
     qemu_mutex_init(&s->lock);
+    qemu_mutex_init(&s->keystore_lock);
+    QTAILQ_INIT(&s->keystore_queue);
+    QTAILQ_INIT(&s->keystore_done);
+    s->keystore_bh = qemu_bh_new(apple_sep_sim_keystore_bh, s);
 
     child = find_dtb_node(node, "iop-sep-nub");
     g_assert_nonnull(child);
@@ -1033,6 +1365,26 @@ static void apple_sep_sim_realize(DeviceState *dev, Error **errp)
     sc = APPLE_SEP_SIM_GET_CLASS(dev);
     if (sc->parent_realize) {
         sc->parent_realize(dev, errp);
+        if (*errp) {
+            return;
+        }
+    }
+
+    apple_worker_init(&s->keystore_worker, TYPE_APPLE_SEP_SIM ".keystore",
+                      NULL, apple_sep_sim_keystore_work, s);
+}
+
+static void apple_sep_sim_unrealize(DeviceState *dev)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(dev);
+    AppleSEPSimClass *sc = APPLE_SEP_SIM_GET_CLASS(dev);
+
+    apple_worker_destroy(&s->keystore_worker);
+    qemu_bh_cancel(s->keystore_bh);
+    apple_sep_sim_keystore_drop_jobs(s);
+
+    if (sc->parent_unrealize) {
+        sc->parent_unrealize(dev);
     }
 }
 
@@ -1042,7 +1394,7 @@ static void apple_sep_sim_reset(DeviceState *dev)
     AppleSEPSimClass *sc;
     AppleA7IOP *a7iop;
     size_t i;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg = { 0 };
     SEPMessage *sep_msg;
 
     s = APPLE_SEP_SIM(dev);
@@ -1052,8 +1404,19 @@ static void apple_sep_sim_reset(DeviceState *dev)
         sc->parent_reset(dev);
     }
 
+    /*
+     * Drop every request from before the reset. One being handled finishes
+     * first, but no longer writes back its reply.
+     */
+    qatomic_inc(&s->keystore_generation);
+    apple_worker_pause(&s->keystore_worker);
+    apple_sep_sim_keystore_drop_jobs(s);
+    apple_worker_resume(&s->keystore_worker);
+
     QEMU_LOCK_GUARD(&s->lock);
 
+    apple_sep_sim_keystore_load(s);
+
     a7iop->iop_mailbox->ap_dir_en = true;
     a7iop->iop_mailbox->iop_dir_en = true;
     a7iop->ap_mailbox->iop_dir_en = true;
@@ -1094,21 +1457,159 @@ static void apple_sep_sim_reset(DeviceState *dev)
 
     s->status = SEP_STATUS_BOOTSTRAP;
 
-    msg = g_new0(AppleA7IOPMessage, 1);
-    sep_msg = (SEPMessage *)msg->data;
+    sep_msg = (SEPMessage *)msg.data;
     sep_msg->ep = EP_BOOTSTRAP;
     sep_msg->op = BOOTSTRAP_OP_ANNOUNCE_STATUS;
     sep_msg->data = s->status;
-    apple_a7iop_send_ap(a7iop, msg);
+    apple_a7iop_send_ap(a7iop, &msg);
 }
 
+static const VMStateDescription vmstate_apple_sep_sim_keystore = {
+    .name = "apple_sep_sim_keystore",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(keybag_handle, AppleSEPSimKeystoreState),
+            VMSTATE_UINT32(lock_state, AppleSEPSimKeystoreState),
+            VMSTATE_UINT64(device_state, AppleSEPSimKeystoreState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static const VMStateDescription vmstate_apple_sep_sim_keystore_job = {
+    .name = "apple_sep_sim_keystore_job",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT8(msg.ep, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT8(msg.tag, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT8(msg.id, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT16(msg.size, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT64(in_addr, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT64(out_addr, AppleSEPSimKeystoreJob),
+            VMSTATE_UINT32(reply_data, AppleSEPSimKeystoreJob),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static bool apple_sep_sim_keystore_jobs_needed(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    return !QTAILQ_EMPTY(&s->keystore_queue) ||
+           !QTAILQ_EMPTY(&s->keystore_done);
+}
+
+/* Requests not started yet, and finished ones whose reply is not posted. */
+static const VMStateDescription vmstate_apple_sep_sim_keystore_jobs = {
+    .name = "apple_sep_sim/keystore_jobs",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = apple_sep_sim_keystore_jobs_needed,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_QTAILQ_V(keystore_queue, AppleSEPSimState, 1,
+                             vmstate_apple_sep_sim_keystore_job,
+                             AppleSEPSimKeystoreJob, entry),
+            VMSTATE_QTAILQ_V(keystore_done, AppleSEPSimState, 1,
+                             vmstate_apple_sep_sim_keystore_job,
+                             AppleSEPSimKeystoreJob, entry),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+/*
+ * Already parked if the VM is stopped. Otherwise this waits for the request
+ * being handled, so that every one is either on a queue or done with.
+ */
+static int apple_sep_sim_pre_save(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    apple_worker_pause(&s->keystore_worker);
+    return 0;
+}
+
+static int apple_sep_sim_post_save(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    apple_worker_resume(&s->keystore_worker);
+    return 0;
+}
+
+static int apple_sep_sim_pre_load(void *opaque)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+
+    apple_sep_sim_keystore_drop_jobs(s);
+    return 0;
+}
+
+static int apple_sep_sim_post_load(void *opaque, int version_id)
+{
+    AppleSEPSimState *s = APPLE_SEP_SIM(opaque);
+    uint32_t generation = qatomic_read(&s->keystore_generation);
+    AppleSEPSimKeystoreJob *job;
+
+    QTAILQ_FOREACH (job, &s->keystore_queue, entry) {
+        job->generation = generation;
+    }
+    QTAILQ_FOREACH (job, &s->keystore_done, entry) {
+        job->generation = generation;
+    }
+    if (!QTAILQ_EMPTY(&s->keystore_queue)) {
+        apple_worker_kick(&s->keystore_worker);
+    }
+    if (!QTAILQ_EMPTY(&s->keystore_done)) {
+        qemu_bh_schedule(s->keystore_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_sep_sim = {
+    .name = "apple_sep_sim",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = apple_sep_sim_pre_save,
+    .post_save = apple_sep_sim_post_save,
+    .pre_load = apple_sep_sim_pre_load,
+    .post_load = apple_sep_sim_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT(parent_obj, AppleSEPSimState, 1, vmstate_apple_a7iop,
+                           AppleA7IOP),
+            VMSTATE_STRUCT(keystore, AppleSEPSimState, 1,
+                           vmstate_apple_sep_sim_keystore,
+                           AppleSEPSimKeystoreState),
+            VMSTATE_END_OF_LIST(),
+        },
+    .subsections =
+        (const VMStateDescription *const[]){
+            &vmstate_apple_sep_sim_keystore_jobs,
+            NULL,
+        }
+};
+
+static Property apple_sep_sim_properties[] = {
+    DEFINE_PROP_UINT64("ecid", AppleSEPSimState, ecid, 0),
+    DEFINE_PROP_STRING("keystore", AppleSEPSimState, keystore_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_sep_sim_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     AppleSEPSimClass *sc = APPLE_SEP_SIM_CLASS(klass);
     device_class_set_parent_realize(dc, apple_sep_sim_realize,
                                     &sc->parent_realize);
+    device_class_set_parent_unrealize(dc, apple_sep_sim_unrealize,
+                                      &sc->parent_unrealize);
     device_class_set_parent_reset(dc, apple_sep_sim_reset, &sc->parent_reset);
+    dc->vmsd = &vmstate_apple_sep_sim;
+    device_class_set_props(dc, apple_sep_sim_properties);
     dc->desc = "Simulated Apple Secure Enclave";
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
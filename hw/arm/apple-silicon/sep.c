@@ -19,13 +19,17 @@
  */
 
 #include "qemu/osdep.h"
-#include "crypto/random.h"
 #include "hw/arm/apple-silicon/a13.h"
 #include "hw/arm/apple-silicon/a9.h"
 #include "hw/arm/apple-silicon/sep.h"
 #include "hw/core/cpu.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
 #include "qemu/log.h"
+#include "qemu/guest-random.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 #define REG_TRNG_FIFO_OUTPUT_BASE (0x00)
 #define REG_TRNG_FIFO_OUTPUT_END (0x0C)
@@ -70,6 +74,24 @@ static void trng_reg_write(void *opaque, hwaddr addr, uint64_t data,
     }
 }
 
+/*
+ * The SEP firmware reads the FIFO a word at a time while generating keys.
+ * Refilling in bulk keeps that off the host RNG, and going through
+ * qemu_guest_getrandom makes the stream reproducible under -seed.
+ */
+static uint64_t trng_pool_read(AppleTRNGState *s, unsigned size)
+{
+    uint64_t ret = 0;
+
+    if (s->pool_pos + size > sizeof(s->pool)) {
+        qemu_guest_getrandom_nofail(s->pool, sizeof(s->pool));
+        s->pool_pos = 0;
+    }
+    memcpy(&ret, s->pool + s->pool_pos, size);
+    s->pool_pos += size;
+    return ret;
+}
+
 static uint64_t trng_reg_read(void *opaque, hwaddr addr, unsigned size)
 {
     AppleTRNGState *s;
@@ -78,11 +100,8 @@ static uint64_t trng_reg_read(void *opaque, hwaddr addr, unsigned size)
     s = (AppleTRNGState *)opaque;
 
     switch (addr) {
-    case REG_TRNG_FIFO_OUTPUT_BASE ... REG_TRNG_FIFO_OUTPUT_END: {
-        uint64_t ret = 0;
-        qcrypto_random_bytes(&ret, size, NULL);
-        return ret;
-    }
+    case REG_TRNG_FIFO_OUTPUT_BASE ... REG_TRNG_FIFO_OUTPUT_END:
+        return trng_pool_read(s, size);
     case REG_TRNG_STATUS:
         return TRNG_STATUS_FILLED;
     case REG_TRNG_CONFIG:
@@ -295,6 +314,7 @@ AppleSEPState *apple_sep_create(DTBNode *node, MemoryRegion *ool_mr, vaddr base,
     object_property_set_uint(OBJECT(s->cpu), "rvbar", s->base & ~0xFFF, NULL);
     object_property_add_child(OBJECT(dev), DEVICE(s->cpu)->id, OBJECT(s->cpu));
 
+    s->trng_state.pool_pos = sizeof(s->trng_state.pool);
     memory_region_init_io(&s->trng_mr, OBJECT(dev), &trng_reg_ops,
                           &s->trng_state, "sep.trng", 0x10000);
     sysbus_init_mmio(sbd, &s->trng_mr);
@@ -324,6 +344,58 @@ AppleSEPState *apple_sep_create(DTBNode *node, MemoryRegion *ool_mr, vaddr base,
     return s;
 }
 
+static bool apple_sep_inbox_empty(AppleSEPState *s)
+{
+    return apple_a7iop_mailbox_is_empty(APPLE_A7IOP(s)->ap_mailbox);
+}
+
+/*
+ * Runs on the SEP vCPU thread, so only the SEP core stalls. The SEP
+ * firmware spins rather than waiting for interrupts when idle; a new
+ * message raises the IOP IRQ, whose kick ends an idle sleep early.
+ */
+static void apple_sep_throttle_work(CPUState *cpu, run_on_cpu_data data)
+{
+    AppleSEPState *s = data.host_ptr;
+    int64_t quantum_ns = (int64_t)s->quantum_us * SCALE_US;
+    int64_t sleep_ns, end_ns;
+    bool idle;
+
+    idle = s->idle_halt && apple_sep_inbox_empty(s);
+    if (idle) {
+        sleep_ns = quantum_ns;
+    } else {
+        sleep_ns = quantum_ns * s->throttle_pct / (100 - s->throttle_pct);
+    }
+    end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleep_ns;
+
+    while (sleep_ns > 0 && !cpu->stop &&
+           !(idle && !apple_sep_inbox_empty(s))) {
+        if (sleep_ns > SCALE_MS) {
+            qemu_cond_timedwait_bql(cpu->halt_cond, sleep_ns / SCALE_MS);
+        } else {
+            bql_unlock();
+            g_usleep(sleep_ns / SCALE_US);
+            bql_lock();
+        }
+        sleep_ns = end_ns - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    qatomic_set(&s->throttle_scheduled, false);
+}
+
+static void apple_sep_throttle_tick(void *opaque)
+{
+    AppleSEPState *s = opaque;
+    CPUState *cpu = CPU(s->cpu);
+
+    if (s->cpu->power_state == PSCI_ON && !cpu->halted &&
+        !qatomic_xchg(&s->throttle_scheduled, true)) {
+        async_run_on_cpu(cpu, apple_sep_throttle_work, RUN_ON_CPU_HOST_PTR(s));
+    }
+    timer_mod(s->throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                     (int64_t)s->quantum_us * SCALE_US);
+}
+
 static void apple_sep_cpu_reset_work(CPUState *cpu, run_on_cpu_data data)
 {
     AppleSEPState *s = data.host_ptr;
@@ -344,6 +416,21 @@ static void apple_sep_realize(DeviceState *dev, Error **errp)
     qdev_realize(DEVICE(s->cpu), NULL, errp);
     qdev_connect_gpio_out_named(dev, APPLE_A7IOP_IOP_IRQ, 0,
                                 qdev_get_gpio_in(DEVICE(s->cpu), ARM_CPU_IRQ));
+
+    if (s->throttle_pct > 99) {
+        error_setg(errp, "SEP throttle must be between 0 and 99 percent");
+        return;
+    }
+    if (s->quantum_us == 0) {
+        error_setg(errp, "SEP quantum must not be zero");
+        return;
+    }
+    if (s->throttle_pct != 0 || s->idle_halt) {
+        s->throttle_timer =
+            timer_new_ns(QEMU_CLOCK_VIRTUAL_RT, apple_sep_throttle_tick, s);
+        timer_mod(s->throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                         (int64_t)s->quantum_us * SCALE_US);
+    }
 }
 
 static void apple_sep_reset(DeviceState *dev)
@@ -359,10 +446,18 @@ static void apple_sep_reset(DeviceState *dev)
     run_on_cpu(CPU(s->cpu), apple_sep_cpu_reset_work, RUN_ON_CPU_HOST_PTR(s));
 }
 
+static Property apple_sep_props[] = {
+    DEFINE_PROP_UINT8("throttle", AppleSEPState, throttle_pct, 0),
+    DEFINE_PROP_UINT32("quantum-us", AppleSEPState, quantum_us, 10000),
+    DEFINE_PROP_BOOL("idle-halt", AppleSEPState, idle_halt, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_sep_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     AppleSEPClass *sc = APPLE_SEP_CLASS(klass);
+    device_class_set_props(dc, apple_sep_props);
     device_class_set_parent_realize(dc, apple_sep_realize, &sc->parent_realize);
     device_class_set_parent_reset(dc, apple_sep_reset, &sc->parent_reset);
     dc->desc = "Apple SEP";
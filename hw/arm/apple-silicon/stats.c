@@ -0,0 +1,252 @@
+/*
+ * query-stats providers shared by the Apple silicon machines.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/memory.h"
+#include "hw/arm/apple-silicon/stats.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "sysemu/stats.h"
+#include "target/arm/cpu.h"
+
+/*
+ * Prime, so the samples do not beat against periodic guest work, and low,
+ * so an idle VM stays cheap. Schedulers look at seconds, not samples.
+ */
+#define APPLE_CPU_STATS_HZ (97)
+
+typedef enum {
+    APPLE_CPU_STAT_EL0 = 0,
+    APPLE_CPU_STAT_EL1,
+    APPLE_CPU_STAT_EL2,
+    APPLE_CPU_STAT_EL3,
+    APPLE_CPU_STAT_PPL,
+    APPLE_CPU_STAT_GXF,
+    APPLE_CPU_STAT_IDLE,
+    APPLE_CPU_STAT__MAX,
+} apple_cpu_stat_t;
+
+static const char *apple_cpu_stat_name[APPLE_CPU_STAT__MAX] = {
+    [APPLE_CPU_STAT_EL0] = "el0-time",
+    [APPLE_CPU_STAT_EL1] = "el1-time",
+    [APPLE_CPU_STAT_EL2] = "el2-time",
+    [APPLE_CPU_STAT_EL3] = "el3-time",
+    [APPLE_CPU_STAT_PPL] = "ppl-time",
+    [APPLE_CPU_STAT_GXF] = "gxf-time",
+    [APPLE_CPU_STAT_IDLE] = "idle-time",
+};
+
+/* Nanoseconds per vCPU and mode. Only touched with the BQL held. */
+static uint64_t (*apple_cpu_stats)[APPLE_CPU_STAT__MAX];
+static int apple_cpu_stats_count;
+static QEMUTimer *apple_cpu_stats_timer;
+
+/*
+ * PPL runs in GL1, XNU's only guarded level on these SoCs; anything
+ * else guarded is reported as plain GXF time.
+ */
+static apple_cpu_stat_t apple_cpu_stats_mode(CPUState *cs)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+    CPUARMState *env = &cpu->env;
+    int el;
+
+    if (cs->halted) {
+        return APPLE_CPU_STAT_IDLE;
+    }
+    el = arm_current_el(env);
+    if (arm_is_guarded(env)) {
+        return el == 1 ? APPLE_CPU_STAT_PPL : APPLE_CPU_STAT_GXF;
+    }
+    return APPLE_CPU_STAT_EL0 + el;
+}
+
+/* The state is read racily, like xnu-prof does; a sample is a sample. */
+static void apple_cpu_stats_sample(void *opaque)
+{
+    CPUState *cs;
+
+    CPU_FOREACH (cs) {
+        if (cs->cpu_index >= apple_cpu_stats_count ||
+            ARM_CPU(cs)->power_state != PSCI_ON) {
+            continue;
+        }
+        apple_cpu_stats[cs->cpu_index][apple_cpu_stats_mode(cs)] +=
+            NANOSECONDS_PER_SECOND / APPLE_CPU_STATS_HZ;
+    }
+
+    timer_mod(apple_cpu_stats_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NANOSECONDS_PER_SECOND / APPLE_CPU_STATS_HZ);
+}
+
+static void apple_cpu_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets, Error **errp)
+{
+    CPUState *cs;
+
+    if (target != STATS_TARGET_VCPU) {
+        return;
+    }
+
+    CPU_FOREACH (cs) {
+        StatsList *stats_list = NULL;
+
+        if (cs->cpu_index >= apple_cpu_stats_count ||
+            !apply_str_list_filter(cs->parent_obj.canonical_path, targets)) {
+            continue;
+        }
+        for (int i = 0; i < APPLE_CPU_STAT__MAX; i++) {
+            if (!apply_str_list_filter(apple_cpu_stat_name[i], names)) {
+                continue;
+            }
+            apple_stats_prepend(&stats_list, apple_cpu_stat_name[i],
+                                apple_cpu_stats[cs->cpu_index][i]);
+        }
+        if (stats_list) {
+            add_stats_entry(result, STATS_PROVIDER_APPLE_CPU,
+                            cs->parent_obj.canonical_path, stats_list);
+        }
+    }
+}
+
+static void apple_cpu_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = 0; i < APPLE_CPU_STAT__MAX; i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(apple_cpu_stat_name[i]);
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_CPU, STATS_TARGET_VCPU,
+                     stats_list);
+}
+
+/* Leaf regions of `mr` owned by `owner`, other devices count for theirs. */
+static uint64_t apple_mmio_stats_region(MemoryRegion *mr, Object *owner)
+{
+    MemoryRegion *sub;
+    uint64_t count = 0;
+
+    if (mr->owner == owner) {
+        count += memory_region_get_accesses(mr);
+    }
+    QTAILQ_FOREACH (sub, &mr->subregions, subregions_link) {
+        count += apple_mmio_stats_region(sub, owner);
+    }
+    return count;
+}
+
+typedef struct {
+    StatsResultList **result;
+    strList *names;
+} AppleMMIOStatsQuery;
+
+static int apple_mmio_stats_device(Object *obj, void *opaque)
+{
+    AppleMMIOStatsQuery *q = opaque;
+    SysBusDevice *sbd;
+    StatsList *stats_list = NULL;
+    g_autofree char *path = NULL;
+    uint64_t count = 0;
+
+    sbd = (SysBusDevice *)object_dynamic_cast(obj, TYPE_SYS_BUS_DEVICE);
+    if (!sbd || !apply_str_list_filter("mmio-accesses", q->names)) {
+        return 0;
+    }
+    for (int i = 0; i < sbd->num_mmio; i++) {
+        count += apple_mmio_stats_region(sysbus_mmio_get_region(sbd, i), obj);
+    }
+    if (!count) {
+        return 0;
+    }
+
+    apple_stats_prepend(&stats_list, "mmio-accesses", count);
+    path = object_get_canonical_path(obj);
+    add_stats_entry(q->result, STATS_PROVIDER_APPLE_MMIO, path, stats_list);
+    return 0;
+}
+
+static void apple_mmio_stats_cb(StatsResultList **result, StatsTarget target,
+                                strList *names, strList *targets, Error **errp)
+{
+    AppleMMIOStatsQuery q = { .result = result, .names = names };
+
+    if (target != STATS_TARGET_DEVICE) {
+        return;
+    }
+    /* Counting costs every dispatch, so only pay for it once asked. */
+    memory_region_enable_access_counting();
+    object_child_foreach_recursive(qdev_get_machine(),
+                                   apple_mmio_stats_device, &q);
+}
+
+static void apple_mmio_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->type = STATS_TYPE_CUMULATIVE;
+    value->name = g_strdup("mmio-accesses");
+    QAPI_LIST_PREPEND(stats_list, value);
+    add_stats_schema(result, STATS_PROVIDER_APPLE_MMIO, STATS_TARGET_DEVICE,
+                     stats_list);
+}
+
+Stats *apple_stats_prepend(StatsList **list, const char *name,
+                           uint64_t value)
+{
+    Stats *stats = g_new0(Stats, 1);
+
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+    QAPI_LIST_PREPEND(*list, stats);
+    return stats;
+}
+
+void apple_stats_init(void)
+{
+    CPUState *cs;
+
+    g_assert_null(apple_cpu_stats_timer);
+
+    CPU_FOREACH (cs) {
+        apple_cpu_stats_count = MAX(apple_cpu_stats_count, cs->cpu_index + 1);
+    }
+    apple_cpu_stats = g_new0(typeof(*apple_cpu_stats), apple_cpu_stats_count);
+    apple_cpu_stats_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_cpu_stats_sample, NULL);
+    timer_mod(apple_cpu_stats_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NANOSECONDS_PER_SECOND / APPLE_CPU_STATS_HZ);
+
+    add_stats_callbacks(STATS_PROVIDER_APPLE_CPU, apple_cpu_stats_cb,
+                        apple_cpu_schemas_cb);
+    add_stats_callbacks(STATS_PROVIDER_APPLE_MMIO, apple_mmio_stats_cb,
+                        apple_mmio_schemas_cb);
+}
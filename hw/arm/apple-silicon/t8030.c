@@ -19,19 +19,28 @@
  */
 
 #include "qemu/osdep.h"
+#ifdef CONFIG_LINUX
+#include <sys/resource.h>
+#endif
 #include "exec/address-spaces.h"
 #include "exec/memattrs.h"
 #include "exec/memory.h"
 #include "hw/arm/apple-silicon/a13.h"
 #include "hw/arm/apple-silicon/dart.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/hypercall.h"
 #include "hw/arm/apple-silicon/mem.h"
 #include "hw/arm/apple-silicon/sart.h"
 #include "hw/arm/apple-silicon/sep-sim.h"
 #include "hw/arm/apple-silicon/sep.h"
+#include "hw/arm/apple-silicon/stats.h"
 #include "hw/arm/apple-silicon/t8030-config.c.inc"
 #include "hw/arm/apple-silicon/t8030.h"
+#include "hw/arm/apple-silicon/xnu-patch.h"
+#include "hw/arm/apple-silicon/xnu-prof.h"
+#include "hw/arm/apple-silicon/xnu-sym.h"
 #include "hw/block/apple_ans.h"
+#include "hw/char/apple_shmcon.h"
 #include "hw/char/apple_uart.h"
 #include "hw/display/apple_displaypipe_v2.h"
 #include "hw/dma/apple_sio.h"
@@ -40,22 +49,36 @@
 #include "hw/intc/apple_aic.h"
 #include "hw/irq.h"
 #include "hw/misc/apple-silicon/aes.h"
+#include "hw/misc/apple-silicon/free-page-report.h"
 #include "hw/misc/apple-silicon/roswell.h"
 #include "hw/misc/apple-silicon/smc.h"
 #include "hw/misc/apple-silicon/spmi-pmu.h"
 #include "hw/nvram/apple_nvram.h"
+#include "hw/qdev-properties-system.h"
 #include "hw/spmi/apple_spmi.h"
 #include "hw/ssi/apple_spi.h"
 #include "hw/ssi/ssi.h"
 #include "hw/usb/apple_typec.h"
 #include "hw/watchdog/apple_wdt.h"
+#include "migration/vmstate.h"
+#include "qapi/qapi-types-run-state.h"
 #include "qapi/visitor.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/guest-random.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "qemu/units.h"
+#include "sysemu/cpu-timers.h"
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
+#include "chardev/char.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/tcg.h"
 #include "target/arm/arm-powerctl.h"
 
 #define T8030_SROM_BASE 0x100000000ull
@@ -67,11 +90,18 @@
 #define T8030_DRAM_BASE 0x800000000ull
 #define T8030_DRAM_SIZE (4ull * GiB)
 
+/* Not described by the DTB, the default only keeps stray accesses mapped. */
+#define T8030_HIGH_DRAM_BASE 0x300000000ull
+#define T8030_HIGH_DRAM_DEFAULT_SIZE (4ull * GiB)
+#define T8030_HIGH_DRAM_MAX_SIZE (T8030_DRAM_BASE - T8030_HIGH_DRAM_BASE)
+
 #define T8030_SEPROM_BASE 0x240000000ull
 #define T8030_SEPROM_SIZE 0x4000000ull
 
 #define T8030_GPIO_FORCE_DFU 161
 
+#define T8030_DEFAULT_ECID 0x1122334455667788ull
+
 #define T8030_DISPLAY_BASE (T8030_DRAM_BASE + 0xF7FB4000)
 #define T8030_DISPLAY_SIZE (67ull * MiB)
 
@@ -107,13 +137,23 @@
 #define T8030_PANIC_BASE 0x8FC2B4000ull
 #define T8030_PANIC_SIZE 0x100000ull
 
+/* In the carveout between the panic region and ANS' data. */
+#define T8030_SHMCON_BASE (T8030_PANIC_BASE + T8030_PANIC_SIZE)
+#define T8030_SHMCON_SIZE (256 * KiB)
+/* The last page of that carveout. */
+#define T8030_FPR_BASE                                                 \
+    (T8030_SHMCON_BASE + APPLE_SHMCON_HEADER_SIZE + T8030_SHMCON_SIZE + \
+     APPLE_SHMCON_DOORBELL_SIZE)
+
 #define T8030_AMCC_BASE 0x200000000ull
 #define T8030_AMCC_SIZE 0x100000ull
 #define AMCC_PLANE_COUNT 4
 #define AMCC_PLANE_STRIDE 0x40000ull
 #define AMCC_LOWER(_p) (0x680 + (_p) * AMCC_PLANE_STRIDE)
 #define AMCC_UPPER(_p) (0x684 + (_p) * AMCC_PLANE_STRIDE)
-#define AMCC_REG(_tms, _x) *(uint32_t *)(&t8030_machine->amcc_reg[_x])
+#define AMCC_LOCK(_p) (0x68C + (_p) * AMCC_PLANE_STRIDE)
+#define AMCC_CTRR_LOCKED BIT(0)
+#define AMCC_REG(_tms, _x) *(uint32_t *)(&(_tms)->amcc->ram[_x])
 
 static size_t t8030_real_cpu_count(T8030MachineState *t8030_machine)
 {
@@ -170,16 +210,221 @@ static void t8030_create_s3c_uart(const T8030MachineState *t8030_machine,
         base, 15, 0, chr, qdev_get_gpio_in(DEVICE(t8030_machine->aic), vector));
     g_assert_nonnull(dev);
     dev->id = g_strdup(name);
+
+    if (port == 0) {
+        apple_uart_set_line_notify(dev, apple_boot_console_line, NULL);
+    }
+}
+
+static void t8030_create_shmcon(T8030MachineState *t8030_machine)
+{
+    AppleBootInfo *info = &t8030_machine->bootinfo;
+    DeviceState *dev;
+    SysBusDevice *sbd;
+    Chardev *chr;
+
+    chr = qemu_chr_find(t8030_machine->shmcon_chardev);
+    if (chr == NULL) {
+        error_report("shmcon: chardev '%s' not found",
+                     t8030_machine->shmcon_chardev);
+        exit(EXIT_FAILURE);
+    }
+
+    dev = qdev_new(TYPE_APPLE_SHMCON);
+    dev->id = g_strdup("shmcon");
+    qdev_prop_set_chr(dev, "chardev", chr);
+    qdev_prop_set_uint32(dev, "size", T8030_SHMCON_SIZE);
+    sbd = SYS_BUS_DEVICE(dev);
+    sysbus_realize_and_unref(sbd, &error_fatal);
+
+    info->shmcon_addr = T8030_SHMCON_BASE;
+    info->shmcon_size = APPLE_SHMCON_HEADER_SIZE + T8030_SHMCON_SIZE;
+    info->shmcon_doorbell_addr = info->shmcon_addr + info->shmcon_size;
+    info->shmcon_doorbell_size = APPLE_SHMCON_DOORBELL_SIZE;
+    sysbus_mmio_map_overlap(sbd, 0, info->shmcon_addr, 1);
+    sysbus_mmio_map_overlap(sbd, 1, info->shmcon_doorbell_addr, 1);
+
+    apple_shmcon_set_line_notify(dev, apple_boot_console_line, NULL);
+}
+
+static void t8030_create_free_page_report(T8030MachineState *t8030_machine)
+{
+    AppleBootInfo *info = &t8030_machine->bootinfo;
+    DeviceState *dev;
+    SysBusDevice *sbd;
+
+    dev = qdev_new(TYPE_APPLE_FPR);
+    dev->id = g_strdup("free-page-report");
+    sbd = SYS_BUS_DEVICE(dev);
+    sysbus_realize_and_unref(sbd, &error_fatal);
+
+    info->fpr_addr = T8030_FPR_BASE;
+    info->fpr_size = APPLE_FPR_MMIO_SIZE;
+    sysbus_mmio_map_overlap(sbd, 0, info->fpr_addr, 1);
+}
+
+static void t8030_patch_kernel(T8030MachineState *t8030_machine,
+                               MachoHeader64 *hdr)
+{
+    if (t8030_machine->kernel_patches_filename != NULL) {
+        xnu_patch_apply_file(hdr, t8030_machine->kernel_patches_filename);
+    }
 }
 
-static void t8030_patch_kernel(MachoHeader64 *hdr)
+static uint8_t *t8030_panic_ptr(T8030MachineState *t8030_machine)
+{
+    return (uint8_t *)memory_region_get_ram_ptr(MACHINE(t8030_machine)->ram) +
+           (T8030_PANIC_BASE - T8030_DRAM_BASE);
+}
+
+/*
+ * XNU fills in the header once the panic log is written, and keeps
+ * updating it while it flushes, so decoding waits until the header
+ * has been quiet for a moment.
+ */
+#define T8030_PANIC_SETTLE_NS (10 * SCALE_MS)
+
+static void t8030_panic_report(void *opaque)
+{
+    T8030MachineState *t8030_machine = opaque;
+    uint8_t *base = t8030_panic_ptr(t8030_machine);
+    AppleEmbeddedPanicHeader *panic_info = (AppleEmbeddedPanicHeader *)base;
+    GuestPanicInformation *info;
+    const char *log;
+    const char *nl;
+    size_t len;
+
+    if (t8030_machine->panic_reported ||
+        panic_info->magic != EMBEDDED_PANIC_MAGIC) {
+        return;
+    }
+    t8030_machine->panic_reported = true;
+
+    log = (const char *)base + panic_info->panic_log_offset;
+    len = 0;
+    if (panic_info->panic_log_offset < T8030_PANIC_SIZE) {
+        len = MIN(panic_info->panic_log_len,
+                  T8030_PANIC_SIZE - panic_info->panic_log_offset);
+    }
+    while (len > 0 && g_ascii_isspace(*log)) {
+        log++;
+        len--;
+    }
+
+    info = g_new0(GuestPanicInformation, 1);
+    info->type = GUEST_PANIC_INFORMATION_TYPE_XNU;
+    nl = memchr(log, '\n', len);
+    info->u.xnu.message = g_strndup(log, nl != NULL ? nl - log : len);
+    info->u.xnu.flags = panic_info->panic_flags;
+
+    apple_boot_milestone("guest_panic");
+    qemu_system_guest_panicked(info);
+}
+
+static uint64_t t8030_panic_header_read(void *opaque, hwaddr addr,
+                                        unsigned size)
+{
+    return ldn_le_p(t8030_panic_ptr(opaque) + addr, size);
+}
+
+static void t8030_panic_header_write(void *opaque, hwaddr addr, uint64_t data,
+                                     unsigned size)
+{
+    T8030MachineState *t8030_machine = opaque;
+    uint8_t *base = t8030_panic_ptr(t8030_machine);
+
+    stn_le_p(base + addr, size, data);
+    // Stores to the RAM pointer are not seen by migration otherwise.
+    memory_region_set_dirty(MACHINE(t8030_machine)->ram,
+                            T8030_PANIC_BASE - T8030_DRAM_BASE + addr, size);
+    if (addr < sizeof(AppleEmbeddedPanicHeader) &&
+        ldl_le_p(base) == EMBEDDED_PANIC_MAGIC) {
+        timer_mod(t8030_machine->panic_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      T8030_PANIC_SETTLE_NS);
+    }
+}
+
+static const MemoryRegionOps t8030_panic_header_ops = {
+    .read = t8030_panic_header_read,
+    .write = t8030_panic_header_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 8,
+    .valid.unaligned = true,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 8,
+    .impl.unaligned = true,
+};
+
+static const VMStateDescription vmstate_t8030_panic = {
+    .name = "t8030_panic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_BOOL(panic_reported, T8030MachineState),
+            VMSTATE_TIMER_PTR(panic_timer, T8030MachineState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+/*
+ * An incoming VM skips t8030_memory_setup, so whatever it placed in guest
+ * RAM and later code relies on has to come along.
+ */
+static const VMStateDescription vmstate_t8030_boot = {
+    .name = "t8030_boot",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64(panic_base, T8030MachineState),
+            VMSTATE_UINT64(panic_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.kern_entry, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.device_tree_addr, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.device_tree_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.ramdisk_addr, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.ramdisk_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.trustcache_addr, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.trustcache_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.sep_fw_addr, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.sep_fw_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.kern_boot_args_addr, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.kern_boot_args_size, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.dram_base, T8030MachineState),
+            VMSTATE_UINT64(bootinfo.dram_size, T8030MachineState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+/*
+ * The first page of the panic region is routed through MMIO ops that
+ * store to the underlying DRAM, so a panic is reported the moment XNU
+ * writes the header rather than on the next boot.
+ */
+static void t8030_panic_monitor_init(T8030MachineState *t8030_machine)
 {
+    memory_region_init_io(&t8030_machine->panic_header_mr,
+                          OBJECT(t8030_machine), &t8030_panic_header_ops,
+                          t8030_machine, "panic-header", 0x1000);
+    memory_region_add_subregion_overlap(t8030_machine->sysmem,
+                                        T8030_PANIC_BASE,
+                                        &t8030_machine->panic_header_mr, 1);
+    t8030_machine->panic_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, t8030_panic_report, t8030_machine);
+    vmstate_register(NULL, 0, &vmstate_t8030_panic, t8030_machine);
 }
 
+/*
+ * Clears the panic header for the next boot. Returns true if the last
+ * boot panicked without it being reported while it ran.
+ */
 static bool t8030_check_panic(MachineState *machine)
 {
     T8030MachineState *t8030_machine;
     AppleEmbeddedPanicHeader *panic_info;
+    bool reported;
     bool ret;
 
     t8030_machine = T8030_MACHINE(machine);
@@ -188,16 +433,15 @@ static bool t8030_check_panic(MachineState *machine)
         return false;
     }
 
-    panic_info = g_malloc0(t8030_machine->panic_size);
-
-    address_space_rw(&address_space_memory, t8030_machine->panic_base,
-                     MEMTXATTRS_UNSPECIFIED, panic_info,
-                     t8030_machine->panic_size, false);
-    address_space_set(&address_space_memory, t8030_machine->panic_base, 0,
-                      t8030_machine->panic_size, MEMTXATTRS_UNSPECIFIED);
+    timer_del(t8030_machine->panic_timer);
+    reported = t8030_machine->panic_reported;
+    t8030_machine->panic_reported = false;
 
-    ret = panic_info->magic == EMBEDDED_PANIC_MAGIC;
-    g_free(panic_info);
+    panic_info = (AppleEmbeddedPanicHeader *)t8030_panic_ptr(t8030_machine);
+    ret = panic_info->magic == EMBEDDED_PANIC_MAGIC && !reported;
+    memset(panic_info, 0, sizeof(*panic_info));
+    memory_region_set_dirty(machine->ram, T8030_PANIC_BASE - T8030_DRAM_BASE,
+                            sizeof(*panic_info));
     return ret;
 }
 
@@ -460,7 +704,7 @@ static void t8030_load_fileset_kc(T8030MachineState *t8030_machine,
     g_virt_base = virt_low;
 }
 
-static void t8030_memory_setup(MachineState *machine)
+static void do_t8030_memory_setup(MachineState *machine)
 {
     MachoHeader64 *hdr;
     T8030MachineState *t8030_machine = T8030_MACHINE(machine);
@@ -470,10 +714,9 @@ static void t8030_memory_setup(MachineState *machine)
         get_dtb_node(t8030_machine->device_tree, "/chosen/memory-map");
     AddressSpace *nsas = &address_space_memory;
     char *cmdline = NULL;
-    char *seprom = NULL;
-    unsigned long fsize = 0;
 
     if (t8030_check_panic(machine)) {
+        apple_boot_milestone("guest_panic");
         qemu_system_guest_panicked(NULL);
         return;
     }
@@ -482,16 +725,18 @@ static void t8030_memory_setup(MachineState *machine)
     info->dram_size = T8030_DRAM_SIZE;
 
     if (t8030_machine->seprom_filename) {
-        if (!g_file_get_contents(t8030_machine->seprom_filename, &seprom,
-                                 &fsize, NULL)) {
+        if (t8030_machine->seprom_data == NULL &&
+            !g_file_get_contents(t8030_machine->seprom_filename,
+                                 &t8030_machine->seprom_data,
+                                 &t8030_machine->seprom_size, NULL)) {
             error_setg(&error_fatal, "Could not load data from file '%s'",
                        t8030_machine->seprom_filename);
             return;
         }
+        // The SEPROM is RAM, so it is written again on every boot.
         address_space_rw(nsas, T8030_SEPROM_BASE, MEMTXATTRS_UNSPECIFIED,
-                         (uint8_t *)seprom, fsize, true);
-
-        g_free(seprom);
+                         (uint8_t *)t8030_machine->seprom_data,
+                         t8030_machine->seprom_size, true);
 
         uint64_t value = 0x8000000000000000;
         address_space_write(nsas, t8030_machine->soc_base_pa + 0x42140108,
@@ -549,7 +794,7 @@ static void t8030_memory_setup(MachineState *machine)
         error_report("%s: Failed to read NVRAM", __func__);
     }
 
-    if (t8030_machine->ticket_filename) {
+    if (t8030_machine->ticket_filename && info->ticket_data == NULL) {
         if (!g_file_get_contents(t8030_machine->ticket_filename,
                                  &info->ticket_data,
                                  (gsize *)&info->ticket_length, NULL)) {
@@ -628,190 +873,134 @@ static void t8030_memory_setup(MachineState *machine)
     g_free(cmdline);
 }
 
-static void pmgr_unk_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                               unsigned size)
+static void t8030_memory_setup(MachineState *machine)
 {
-    hwaddr base = (hwaddr)opaque;
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg WRITE unk @ 0x" TARGET_FMT_lx
-                  " base: 0x" TARGET_FMT_lx " value: 0x" TARGET_FMT_lx "\n",
-                  base + addr, base, data);
-#endif
+    apple_boot_phase_begin("t8030_memory_setup");
+    do_t8030_memory_setup(machine);
+    apple_boot_phase_end("t8030_memory_setup");
 }
 
-static uint64_t pmgr_unk_reg_read(void *opaque, hwaddr addr, unsigned size)
+static uint32_t pmgr_unk_reg_seed(hwaddr addr)
 {
-    hwaddr base = (hwaddr)opaque;
-
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg READ unk @ 0x" TARGET_FMT_lx
-                  " base: 0x" TARGET_FMT_lx "\n",
-                  base + addr, base);
-#endif
-    switch (base + addr) {
-    case 0x3D280088: // PMGR_AON
-        return 0xFF;
-    case 0x3D2BC000:
-        // return 0xA050C030; // IBFL | 0x00
-        return 0xA55AC33C; // IBFL | 0x10
-    case 0x3D2BC008:
-        return 0xA55AC33C; // security domain | 0x1
-    case 0x3D2BC00C:
-        // return 0xA55AC33C; // security domain | 0x2
-        return 0xA050C030; // security domain | 0x0
-    case 0x3D2BC010:
-        return (1 << 5) | (1 << 31); // _rCFG_FUSE0 ; (security epoch & 0x7F) <<
-                                     // 5 ;; (1 << 31) for SEP
-    case 0x3D2BC030:
-        // return 0xFFFFFFFF; // CPRV
-        // return 0x7 << 6; // LOW NIBBLE
-        // return 0x70 << 5; // HIGH NIBBLE
-        return 0x1 << 6;
-    case 0x3D2BC300: // TODO
-        return 0xCAFEBABE; // ECID lower
-    case 0x3D2BC304: // TODO
-        return 0xDEADBEEF; // ECID upper
-    case 0x3D2BC400:
-        // if 0xBC404 returns 1==0xA55AC33C, this will get ignored
-        // return 0xA050C030; // CPFM | 0x00 ; IBFL_base == 0x04
-        return 0xA55AC33C; // CPFM | 0x03 ; IBFL_base == 0x0C
-    case 0x3D2BC404:
-        // return 0xA55AC33C; // CPFM | 0x01 ; IBFL_base == 0x0C
-        return 0xA050C030; // CPFM | 0x00 ; IBFL_base == 0x04
-    case 0x3D2BC604: //?
-        return 0xA050C030;
-    case 0x3D2E8000: // ????
-        return 0x32B3; // memory encryption AMK (Authentication Master Key)
-                       // disabled
-        // return 0xC2E9; // memory encryption AMK (Authentication Master Key)
-        // enabled
-    case 0x3D2D0034: //?
-        return (1 << 24) | (1 << 25);
-    default:
-        if (((base + addr) & 0x10E70000) == 0x10E70000) {
-            return (108 << 4) | 0x200000; //?
-        }
-        return 0;
+    if ((addr & 0x10E70000) == 0x10E70000) {
+        return (108 << 4) | 0x200000; //?
     }
+    return 0;
 }
 
-static const MemoryRegionOps pmgr_unk_reg_ops = {
-    .write = pmgr_unk_reg_write,
-    .read = pmgr_unk_reg_read,
+static const AppleRegDesc pmgr_unk_regs[] = {
+    { 0x3D280088, 4, 0xFF, true }, // PMGR_AON
+    // { 0x3D2BC000, 4, 0xA050C030, true }, // IBFL | 0x00
+    { 0x3D2BC000, 4, 0xA55AC33C, true }, // IBFL | 0x10
+    { 0x3D2BC008, 4, 0xA55AC33C, true }, // security domain | 0x1
+    // { 0x3D2BC00C, 4, 0xA55AC33C, true }, // security domain | 0x2
+    { 0x3D2BC00C, 4, 0xA050C030, true }, // security domain | 0x0
+    // _rCFG_FUSE0 ; (security epoch & 0x7F) << 5 ;; (1 << 31) for SEP
+    { 0x3D2BC010, 4, (1 << 5) | (1u << 31), true },
+    // { 0x3D2BC030, 4, 0xFFFFFFFF, true }, // CPRV
+    // { 0x3D2BC030, 4, 0x7 << 6, true }, // LOW NIBBLE
+    // { 0x3D2BC030, 4, 0x70 << 5, true }, // HIGH NIBBLE
+    { 0x3D2BC030, 4, 0x1 << 6, true },
+    { 0x3D2BC300, 4, 0xCAFEBABE, true }, // ECID lower, TODO
+    { 0x3D2BC304, 4, 0xDEADBEEF, true }, // ECID upper, TODO
+    // if 0xBC404 returns 1==0xA55AC33C, this will get ignored
+    // { 0x3D2BC400, 4, 0xA050C030, true }, // CPFM | 0x00 ; IBFL_base == 0x04
+    { 0x3D2BC400, 4, 0xA55AC33C, true }, // CPFM | 0x03 ; IBFL_base == 0x0C
+    // { 0x3D2BC404, 4, 0xA55AC33C, true }, // CPFM | 0x01 ; IBFL_base == 0x0C
+    { 0x3D2BC404, 4, 0xA050C030, true }, // CPFM | 0x00 ; IBFL_base == 0x04
+    { 0x3D2BC604, 4, 0xA050C030, true }, //?
+    // memory encryption AMK (Authentication Master Key) disabled
+    { 0x3D2E8000, 4, 0x32B3, true },
+    // { 0x3D2E8000, 4, 0xC2E9, true }, // AMK enabled
+    { 0x3D2D0034, 4, (1 << 24) | (1 << 25), true }, //?
 };
 
-static void pmgr_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                           unsigned size)
+static void pmgr_cpu_start_write(void *opaque, hwaddr addr, uint32_t *value)
 {
-    MachineState *machine = MACHINE(opaque);
-    T8030MachineState *t8030_machine = T8030_MACHINE(opaque);
-    uint32_t value = data;
+    t8030_start_cpus(MACHINE(opaque), *value);
+}
+
+static const AppleRegDesc pmgr_regs[] = {
+    // SEP Power State, Manual & Actual: Run Max
+    { 0x80C00, 4, 0xFF, true },
+    { 0x80000, 0xC004, 0, false, apple_pmgr_ps_write },
+    { 0xD4004, 4, 0, true, pmgr_cpu_start_write },
+    { 0xF0010, 4, 0x5000, true }, // AppleT8030PMGR::commonSramCheck
+};
 
-    if (addr >= 0x80000 && addr <= 0x8C000) {
-        value = (value & 0xF) << 4 | (value & 0xF);
+/*
+ * Once a plane is locked, the range it covers is overlaid with a read-only
+ * alias of DRAM, so neither the CPUs nor DMA can write the kernel text any
+ * more. TCG then never sees a store that would invalidate its code there.
+ * Only plane 0 sets the range; XNU programs all planes the same.
+ */
+static void t8030_amcc_ctrr_update(T8030MachineState *t8030_machine)
+{
+    MemoryRegion *mr = &t8030_machine->amcc_ctrr_mr;
+    uint64_t lower = (uint64_t)AMCC_REG(t8030_machine, AMCC_LOWER(0)) << 14;
+    uint64_t upper =
+        ((uint64_t)AMCC_REG(t8030_machine, AMCC_UPPER(0)) + 1) << 14;
+    uint64_t ram_size = memory_region_size(MACHINE(t8030_machine)->ram);
+    bool locked = AMCC_REG(t8030_machine, AMCC_LOCK(0)) & AMCC_CTRR_LOCKED;
+
+    if (locked && (lower >= upper || upper > ram_size)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: bad CTRR range 0x%" PRIx64 "-0x%" PRIx64 "\n",
+                      __func__, lower, upper);
+        locked = false;
+    }
+
+    memory_region_transaction_begin();
+    if (locked) {
+        memory_region_set_alias_offset(mr, lower);
+        memory_region_set_size(mr, upper - lower);
+        memory_region_set_address(mr, T8030_DRAM_BASE + lower);
+    }
+    memory_region_set_enabled(mr, locked);
+    memory_region_transaction_commit();
+}
+
+static void amcc_ctrr_bound_write(void *opaque, hwaddr addr, uint32_t *value)
+{
+    T8030MachineState *t8030_machine = opaque;
+    hwaddr plane = addr - addr % AMCC_PLANE_STRIDE;
+
+    if (AMCC_REG(t8030_machine, plane + AMCC_LOCK(0)) & AMCC_CTRR_LOCKED) {
+        *value = AMCC_REG(t8030_machine, addr);
     }
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg WRITE @ 0x" TARGET_FMT_lx " value: 0x" TARGET_FMT_lx
-                  "\n",
-                  addr, data);
-#endif
-    switch (addr) {
-    case 0xD4004:
-        t8030_start_cpus(machine, data);
+}
+
+static void amcc_ctrr_lock_write(void *opaque, hwaddr addr, uint32_t *value)
+{
+    T8030MachineState *t8030_machine = opaque;
+
+    if (AMCC_REG(t8030_machine, addr) & AMCC_CTRR_LOCKED) {
+        *value = AMCC_REG(t8030_machine, addr);
         return;
     }
-    memcpy(t8030_machine->pmgr_reg + addr, &value, size);
+
+    if (addr == AMCC_LOCK(0) && (*value & AMCC_CTRR_LOCKED)) {
+        AMCC_REG(t8030_machine, addr) = *value;
+        t8030_amcc_ctrr_update(t8030_machine);
+    }
 }
 
-static uint64_t pmgr_reg_read(void *opaque, hwaddr addr, unsigned size)
+static void t8030_amcc_ctrr_vm_state_change(void *opaque, bool running,
+                                            RunState state)
 {
-    T8030MachineState *t8030_machine = T8030_MACHINE(opaque);
-    uint64_t result = 0;
-    switch (addr) {
-    case 0xF0010: // AppleT8030PMGR::commonSramCheck
-        result = 0x5000;
-        break;
-    case 0x80C00: // SEP Power State, Manual & Actual: Run Max
-        result = 0xFF;
-        break;
-#if 0
-    case 0xBC008:
-        result = 0xFFFFFFFF;
-        break;
-    case 0xBC00C:
-        result = 0xFFFFFFFF;
-        break;
-#endif
-    default:
-        memcpy(&result, t8030_machine->pmgr_reg + addr, size);
-        break;
+    if (running) {
+        t8030_amcc_ctrr_update(opaque);
     }
-#if 0
-    qemu_log_mask(LOG_UNIMP,
-                  "PMGR reg READ @ 0x" TARGET_FMT_lx " value: 0x" TARGET_FMT_lx
-                  "\n",
-                  addr, result);
-#endif
-    return result;
 }
 
-static const MemoryRegionOps pmgr_reg_ops = {
-    .write = pmgr_reg_write,
-    .read = pmgr_reg_read,
-};
-
-static void amcc_reg_write(void *opaque, hwaddr addr, uint64_t data,
-                           unsigned size)
-{
-    T8030MachineState *t8030_machine = T8030_MACHINE(opaque);
-    uint32_t value = data;
-
-    memcpy(t8030_machine->amcc_reg + addr, &value, size);
-}
-
-static uint64_t amcc_reg_read(void *opaque, hwaddr addr, unsigned size)
-{
-    T8030MachineState *t8030_machine = T8030_MACHINE(opaque);
-    switch (addr) {
-    case 0x6A0:
-    case 0x406A0:
-    case 0x806A0:
-    case 0xC06A0:
-        return 0x0;
-    case 0x6A4:
-        // return 0x1003;
-    case 0x406A4:
-        // return 0x2003;
-    case 0x806A4:
-        // return 0x3003;
-    case 0xC06A4:
-        // return 0x3;
-        return 0x1003; // 0x1003 == 0x1004000
-        // return 0x4003;
-    case 0x6A8:
-    case 0x406A8:
-    case 0x806A8:
-    case 0xC06A8:
-        return 0x1;
-    case 0x6B8:
-    case 0x406B8:
-    case 0x806B8:
-    case 0xC06B8:
-        return 0x1;
-    default: {
-        uint64_t result = 0;
-        memcpy(&result, t8030_machine->amcc_reg + addr, size);
-        return result;
-    }
-    }
-}
-
-static const MemoryRegionOps amcc_reg_ops = {
-    .write = amcc_reg_write,
-    .read = amcc_reg_read,
+static const AppleRegDesc amcc_plane_regs[] = {
+    { 0x680, 8, 0x0, false, amcc_ctrr_bound_write },
+    { 0x68C, 4, 0x0, false, amcc_ctrr_lock_write },
+    { 0x6A0, 4, 0x0, true },
+    // 0x1003 == 0x1004000; plane 1: 0x2003, plane 2: 0x3003, plane 3: 0x3
+    { 0x6A4, 4, 0x1003, true },
+    { 0x6A8, 4, 0x1, true },
+    { 0x6B8, 4, 0x1, true },
 };
 
 static void t8030_cluster_setup(MachineState *machine)
@@ -844,6 +1033,270 @@ static void t8030_cluster_realize(MachineState *machine)
     }
 }
 
+/* Indices into cluster_affinity and cluster_priority. */
+#define T8030_CLUSTER_P (0)
+#define T8030_CLUSTER_E (1)
+
+/* Enough for the largest hosts; the bitmap is only used at setup. */
+#define T8030_MAX_HOST_CPUS (1024)
+
+static const char *t8030_cluster_option[] = {
+    [T8030_CLUSTER_P] = "pcluster",
+    [T8030_CLUSTER_E] = "ecluster",
+};
+
+static const char *t8030_cluster_core[] = {
+    [T8030_CLUSTER_P] = "Lightning",
+    [T8030_CLUSTER_E] = "Thunder",
+};
+
+static bool t8030_parse_host_cpu_range(const char *str, unsigned long *first,
+                                       unsigned long *last)
+{
+    const char *end;
+
+    if (qemu_strtoul(str, &end, 10, first) < 0) {
+        return false;
+    }
+    if (*end == '-') {
+        if (qemu_strtoul(end + 1, NULL, 10, last) < 0) {
+            return false;
+        }
+    } else if (*end == '\0') {
+        *last = *first;
+    } else {
+        return false;
+    }
+    return *first <= *last && *last < T8030_MAX_HOST_CPUS;
+}
+
+/* Parses a host CPU list such as "0-3,8" into a new bitmap. */
+static unsigned long *t8030_parse_host_cpus(const char *str, Error **errp)
+{
+    g_auto(GStrv) ranges = g_strsplit(str, ",", -1);
+    unsigned long *host_cpus = bitmap_new(T8030_MAX_HOST_CPUS);
+
+    for (int i = 0; ranges[i]; i++) {
+        unsigned long first;
+        unsigned long last;
+
+        if (!t8030_parse_host_cpu_range(ranges[i], &first, &last)) {
+            error_setg(errp,
+                       "invalid host CPU range '%s', expected N or N-M "
+                       "below %d",
+                       ranges[i], T8030_MAX_HOST_CPUS);
+            g_free(host_cpus);
+            return NULL;
+        }
+        bitmap_set(host_cpus, first, last - first + 1);
+    }
+    return host_cpus;
+}
+
+static int t8030_cpu_cluster_index(AppleA13State *tcpu)
+{
+    switch (tcpu->cluster_type) {
+    case 'P':
+        return T8030_CLUSTER_P;
+    case 'E':
+        return T8030_CLUSTER_E;
+    default:
+        return -1;
+    }
+}
+
+/* Runs on the vCPU thread, priorities are per calling thread. */
+static void t8030_cpu_priority_work(CPUState *cs, run_on_cpu_data data)
+{
+    int nice = data.host_int;
+
+#if defined(CONFIG_DARWIN)
+    /* Darwin schedules by QoS class, nice values are mostly ignored. */
+    qos_class_t qos =
+        nice < 0 ? QOS_CLASS_USER_INTERACTIVE : QOS_CLASS_UTILITY;
+    int err = pthread_set_qos_class_self_np(qos, 0);
+
+    if (err) {
+        warn_report("CPU %d: failed to set QoS class: %s", cs->cpu_index,
+                    strerror(err));
+    }
+#elif defined(CONFIG_LINUX)
+    if (setpriority(PRIO_PROCESS, qemu_get_thread_id(), nice) < 0) {
+        warn_report("CPU %d: failed to set nice value %d: %s", cs->cpu_index,
+                    nice, strerror(errno));
+    }
+#else
+    warn_report_once("vCPU thread priorities are not supported on this "
+                     "host");
+#endif
+}
+
+/*
+ * Pins the vCPU threads of each cluster to the host CPUs given with
+ * pcluster-affinity/ecluster-affinity, and applies the cluster priority.
+ * Round-robin TCG runs every vCPU on one thread, so there is nothing to
+ * tell the clusters apart by.
+ */
+static void t8030_cpu_apply_host_policy(T8030MachineState *t8030_machine)
+{
+    unsigned long *host_cpus[2] = { NULL, NULL };
+    bool any = false;
+
+    for (int i = 0; i < ARRAY_SIZE(host_cpus); i++) {
+        if (t8030_machine->cluster_affinity[i]) {
+            host_cpus[i] = t8030_parse_host_cpus(
+                t8030_machine->cluster_affinity[i], &error_fatal);
+        }
+        any |= host_cpus[i] || t8030_machine->cluster_priority[i];
+    }
+    if (!any) {
+        return;
+    }
+    if (tcg_enabled() && !qemu_tcg_mttcg_enabled()) {
+        warn_report("cluster affinity and priority need one thread per "
+                    "vCPU, ignoring them");
+        goto out;
+    }
+
+    for (int i = 0; i < t8030_real_cpu_count(t8030_machine); i++) {
+        AppleA13State *tcpu = t8030_machine->cpus[i];
+        CPUState *cs = CPU(tcpu);
+        int cluster = t8030_cpu_cluster_index(tcpu);
+        int err;
+
+        if (cluster < 0) {
+            continue;
+        }
+        if (host_cpus[cluster]) {
+            err = qemu_thread_set_affinity(cs->thread, host_cpus[cluster],
+                                           T8030_MAX_HOST_CPUS);
+            if (err) {
+                warn_report("CPU %d: failed to set %s-affinity: %s",
+                            cs->cpu_index, t8030_cluster_option[cluster],
+                            strerror(abs(err)));
+            }
+        }
+        if (t8030_machine->cluster_priority[cluster]) {
+            async_run_on_cpu(
+                cs, t8030_cpu_priority_work,
+                RUN_ON_CPU_HOST_INT(t8030_machine->cluster_priority[cluster]));
+        }
+    }
+
+out:
+    g_free(host_cpus[T8030_CLUSTER_P]);
+    g_free(host_cpus[T8030_CLUSTER_E]);
+}
+
+/* How often each vCPU thread's CPU time is checked against cpu-quota. */
+#define T8030_CPU_QUOTA_PERIOD_NS (10 * SCALE_MS)
+
+/* CPU time used by the calling thread, or -1 if the host cannot tell. */
+static int64_t t8030_thread_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+    }
+#endif
+    return -1;
+}
+
+/*
+ * Runs on the vCPU thread between TBs. Sleeps until the CPU time the
+ * thread used since the last check is no more than cpu-quota percent of
+ * the wall time since then. A vCPU that sat in WFI used next to nothing,
+ * so mostly idle guests are hardly ever held off. QEMU_CLOCK_VIRTUAL keeps
+ * following the host clock meanwhile, so the guest's timers stay in step
+ * with the outside world and it merely gets less done per tick.
+ */
+static void t8030_cpu_quota_work(CPUState *cs, run_on_cpu_data data)
+{
+    T8030CPUQuota *q = data.host_ptr;
+    T8030MachineState *t8030_machine = T8030_MACHINE(qdev_get_machine());
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t thread_ns = t8030_thread_cpu_ns();
+    int64_t used, sleep_ns, end_ns;
+
+    if (q->wall_ns != 0) {
+        used = thread_ns < 0 ? now - q->wall_ns : thread_ns - q->thread_ns;
+        sleep_ns =
+            used * 100 / t8030_machine->cpu_quota - (now - q->wall_ns);
+        end_ns = now + sleep_ns;
+
+        while (sleep_ns > 0 && !cs->stop) {
+            if (sleep_ns > SCALE_MS) {
+                qemu_cond_timedwait_bql(cs->halt_cond, sleep_ns / SCALE_MS);
+            } else {
+                bql_unlock();
+                g_usleep(sleep_ns / SCALE_US);
+                bql_lock();
+            }
+            sleep_ns = end_ns - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        }
+    }
+
+    q->wall_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    q->thread_ns = t8030_thread_cpu_ns();
+    qatomic_set(&q->scheduled, false);
+}
+
+static void t8030_cpu_quota_queue(CPUState *cs, T8030CPUQuota *q)
+{
+    if (!qatomic_xchg(&q->scheduled, true)) {
+        async_run_on_cpu(cs, t8030_cpu_quota_work, RUN_ON_CPU_HOST_PTR(q));
+    }
+}
+
+static void t8030_cpu_quota_tick(void *opaque)
+{
+    T8030MachineState *t8030_machine = opaque;
+    bool rr = tcg_enabled() && !qemu_tcg_mttcg_enabled();
+    bool busy = false;
+
+    /*
+     * Halted vCPUs are left alone rather than woken up for nothing; their
+     * next check covers the time they spent idle. Round-robin TCG has one
+     * thread for all of them, accounted through the first.
+     */
+    for (int i = 0; i < t8030_real_cpu_count(t8030_machine); i++) {
+        CPUState *cs = CPU(t8030_machine->cpus[i]);
+
+        if (cs->halted) {
+            continue;
+        }
+        busy = true;
+        if (!rr) {
+            t8030_cpu_quota_queue(cs, &t8030_machine->cpu_quota_state[i]);
+        }
+    }
+    if (rr && busy) {
+        t8030_cpu_quota_queue(CPU(t8030_machine->cpus[0]),
+                              &t8030_machine->cpu_quota_state[0]);
+    }
+
+    timer_mod(t8030_machine->cpu_quota_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                  T8030_CPU_QUOTA_PERIOD_NS);
+}
+
+static void t8030_cpu_start_quota(T8030MachineState *t8030_machine)
+{
+    if (t8030_machine->cpu_quota >= 100) {
+        return;
+    }
+
+    t8030_machine->cpu_quota_state =
+        g_new0(T8030CPUQuota, t8030_real_cpu_count(t8030_machine));
+    t8030_machine->cpu_quota_timer = timer_new_ns(
+        QEMU_CLOCK_VIRTUAL_RT, t8030_cpu_quota_tick, t8030_machine);
+    timer_mod(t8030_machine->cpu_quota_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                  T8030_CPU_QUOTA_PERIOD_NS);
+}
+
 static void t8030_cpu_setup(MachineState *machine)
 {
     unsigned int i;
@@ -857,6 +1310,20 @@ static void t8030_cpu_setup(MachineState *machine)
     root = find_dtb_node(t8030_machine->device_tree, "cpus");
     g_assert_nonnull(root);
 
+    /*
+     * -smp picks how many of the device tree's cores the guest gets, the
+     * rest are pruned so that XNU, the AIC and the clusters agree on it.
+     */
+    if (t8030_real_cpu_count(t8030_machine) < 1 ||
+        t8030_real_cpu_count(t8030_machine) >
+            g_list_length(root->child_nodes)) {
+        error_report("-smp must leave between 1 and %u application cores "
+                     "(the SEP takes one more when configured), got %zu",
+                     g_list_length(root->child_nodes),
+                     t8030_real_cpu_count(t8030_machine));
+        exit(EXIT_FAILURE);
+    }
+
     for (iter = root->child_nodes, i = 0; iter; iter = next, i++) {
         uint32_t cluster_id;
         DTBNode *node;
@@ -877,6 +1344,8 @@ static void t8030_cpu_setup(MachineState *machine)
         qdev_realize(DEVICE(t8030_machine->cpus[i]), NULL, &error_fatal);
     }
     t8030_cluster_realize(machine);
+    t8030_cpu_apply_host_policy(t8030_machine);
+    t8030_cpu_start_quota(t8030_machine);
 }
 
 static void t8030_create_aic(MachineState *machine)
@@ -900,6 +1369,8 @@ static void t8030_create_aic(MachineState *machine)
     object_property_add_child(OBJECT(machine), "aic",
                               OBJECT(t8030_machine->aic));
     g_assert_nonnull(t8030_machine->aic);
+    qdev_prop_set_bit(DEVICE(t8030_machine->aic), "fixed-steering",
+                      t8030_machine->deterministic);
     sysbus_realize(t8030_machine->aic, &error_fatal);
 
     prop = find_dtb_prop(child, "reg");
@@ -912,9 +1383,8 @@ static void t8030_create_aic(MachineState *machine)
             &t8030_machine->cpus[i]->memory,
             t8030_machine->soc_base_pa + reg[0],
             sysbus_mmio_get_region(t8030_machine->aic, i), 0);
-        sysbus_connect_irq(
-            t8030_machine->aic, i,
-            qdev_get_gpio_in(DEVICE(t8030_machine->cpus[i]), ARM_CPU_IRQ));
+        apple_aic_connect_cpu(t8030_machine->aic, i,
+                              CPU(t8030_machine->cpus[i]));
     }
 }
 
@@ -937,32 +1407,37 @@ static void t8030_pmgr_setup(MachineState *machine)
     reg = (uint64_t *)prop->value;
 
     for (i = 0; i < prop->length / 8; i += 2) {
-        MemoryRegion *mem = g_new(MemoryRegion, 1);
+        AppleRegBlock *blk;
+
         if (i > 0) {
             snprintf(name, 32, "pmgr-unk-reg-%d", i);
-            memory_region_init_io(mem, OBJECT(machine), &pmgr_unk_reg_ops,
-                                  (void *)reg[i], name, reg[i + 1]);
+            blk = apple_reg_block_create_ro(
+                OBJECT(machine), name, reg[i], reg[i + 1], pmgr_unk_regs,
+                ARRAY_SIZE(pmgr_unk_regs), pmgr_unk_reg_seed);
         } else {
-            memory_region_init_io(mem, OBJECT(machine), &pmgr_reg_ops,
-                                  t8030_machine, "pmgr-reg", reg[i + 1]);
+            blk = apple_reg_block_create(OBJECT(machine), "pmgr-reg", reg[i],
+                                         reg[i + 1], pmgr_regs,
+                                         ARRAY_SIZE(pmgr_regs));
+            apple_reg_block_reset(blk);
+            t8030_machine->pmgr = blk;
         }
         memory_region_add_subregion(t8030_machine->sysmem,
                                     reg[i] + reg[i + 1] <
                                             t8030_machine->soc_size ?
                                         t8030_machine->soc_base_pa + reg[i] :
                                         reg[i],
-                                    mem);
+                                    &blk->mr);
     }
 
     {
-        MemoryRegion *mem = g_new(MemoryRegion, 1);
+        AppleRegBlock *blk;
 
-        snprintf(name, 32, "pmp-reg");
-        memory_region_init_io(mem, OBJECT(machine), &pmgr_unk_reg_ops,
-                              (void *)0x3BC00000, name, 0x60000);
+        blk = apple_reg_block_create_ro(
+            OBJECT(machine), "pmp-reg", 0x3BC00000, 0x60000, pmgr_unk_regs,
+            ARRAY_SIZE(pmgr_unk_regs), pmgr_unk_reg_seed);
         memory_region_add_subregion(t8030_machine->sysmem,
                                     t8030_machine->soc_base_pa + 0x3BC00000,
-                                    mem);
+                                    &blk->mr);
     }
     set_dtb_prop(child, "voltage-states5", sizeof(t8030_voltage_states5),
                  t8030_voltage_states5);
@@ -1082,10 +1557,25 @@ static void t8030_amcc_setup(MachineState *machine)
     data = 1;
     set_dtb_prop(child, "lock-reg-value", sizeof(data), &data);
 
-    memory_region_init_io(&t8030_machine->amcc, OBJECT(machine), &amcc_reg_ops,
-                          t8030_machine, "amcc", T8030_AMCC_SIZE);
+    t8030_machine->amcc = apple_reg_block_create(
+        OBJECT(machine), "amcc", T8030_AMCC_BASE, T8030_AMCC_SIZE,
+        amcc_plane_regs, ARRAY_SIZE(amcc_plane_regs));
+    t8030_machine->amcc->stride = AMCC_PLANE_STRIDE;
+    apple_reg_block_reset(t8030_machine->amcc);
     memory_region_add_subregion(t8030_machine->sysmem, T8030_AMCC_BASE,
-                                &t8030_machine->amcc);
+                                &t8030_machine->amcc->mr);
+
+    memory_region_init_alias(&t8030_machine->amcc_ctrr_mr,
+                             OBJECT(t8030_machine), "amcc-ctrr", machine->ram,
+                             0, 1ULL << 14);
+    memory_region_set_readonly(&t8030_machine->amcc_ctrr_mr, true);
+    memory_region_set_enabled(&t8030_machine->amcc_ctrr_mr, false);
+    memory_region_add_subregion_overlap(t8030_machine->sysmem,
+                                        T8030_DRAM_BASE,
+                                        &t8030_machine->amcc_ctrr_mr, 2);
+    // A restored snapshot may have been taken after the lock
+    qemu_add_vm_change_state_handler(t8030_amcc_ctrr_vm_state_change,
+                                     t8030_machine);
 }
 
 static void t8030_create_dart(MachineState *machine, const char *name)
@@ -1210,6 +1700,18 @@ static void t8030_create_ans(MachineState *machine)
         OBJECT(ans), "dma-mr", OBJECT(sysbus_mmio_get_region(sart, 1))));
 
     object_property_add_child(OBJECT(machine), "ans", OBJECT(ans));
+    object_property_set_bool(OBJECT(ans), "ioeventfd",
+                             t8030_machine->ans_ioeventfd, &error_fatal);
+    if (t8030_machine->ans_readahead_path != NULL) {
+        object_property_set_str(OBJECT(ans), "readahead-trace",
+                                t8030_machine->ans_readahead_path,
+                                &error_fatal);
+    }
+    if (t8030_machine->ans_vhost_user_path != NULL) {
+        object_property_set_str(OBJECT(ans), "vhost-user",
+                                t8030_machine->ans_vhost_user_path,
+                                &error_fatal);
+    }
     prop = find_dtb_prop(child, "reg");
     g_assert_nonnull(prop);
     reg = (uint64_t *)prop->value;
@@ -1383,6 +1885,9 @@ static void t8030_create_usb(MachineState *machine)
 
     atc = qdev_new(TYPE_APPLE_TYPEC);
     object_property_add_child(OBJECT(machine), "atc", OBJECT(atc));
+    if (t8030_machine->usbmux_path != NULL) {
+        qdev_prop_set_string(atc, "usbmux", t8030_machine->usbmux_path);
+    }
 
     prop = find_dtb_prop(dart_mapper, "reg");
     g_assert_nonnull(prop);
@@ -1497,6 +2002,11 @@ static void t8030_create_aes(MachineState *machine)
 
     aes = apple_aes_create(child);
     g_assert_nonnull(aes);
+    // Timing the host's AES backends would make the choice vary per run
+    if (t8030_machine->deterministic) {
+        object_property_set_str(OBJECT(aes), "native-crypto", "off",
+                                &error_fatal);
+    }
 
     object_property_add_child(OBJECT(machine), "aes", OBJECT(aes));
     prop = find_dtb_prop(child, "reg");
@@ -1774,6 +2284,8 @@ static void t8030_display_create(MachineState *machine)
 
     s = apple_displaypipe_v2_create(machine, child);
     sbd = SYS_BUS_DEVICE(s);
+    object_property_set_bool(OBJECT(s), "headless", t8030_machine->headless,
+                             &error_fatal);
     t8030_machine->video_args.base_addr = T8030_DISPLAY_BASE;
     t8030_machine->video_args.row_bytes = s->width * 4;
     t8030_machine->video_args.width = s->width;
@@ -1941,6 +2453,12 @@ static void t8030_create_sep_sim(MachineState *machine)
     sep->dma_as = g_new0(AddressSpace, 1);
     address_space_init(sep->dma_as, sep->dma_mr, "sep.dma");
 
+    qdev_prop_set_uint64(DEVICE(sep), "ecid", t8030_machine->ecid);
+    if (t8030_machine->sep_keystore_filename != NULL) {
+        qdev_prop_set_string(DEVICE(sep), "keystore",
+                             t8030_machine->sep_keystore_filename);
+    }
+
     sysbus_realize_and_unref(SYS_BUS_DEVICE(sep), &error_fatal);
 }
 
@@ -1991,16 +2509,22 @@ static void t8030_machine_reset(MachineState *machine, ShutdownCause reason)
     T8030MachineState *t8030_machine = T8030_MACHINE(machine);
     DeviceState *gpio = NULL;
 
+    apple_boot_milestones_reset();
     qemu_devices_reset(reason);
-    memset(&t8030_machine->pmgr_reg, 0, sizeof(t8030_machine->pmgr_reg));
+    apple_reg_block_reset(t8030_machine->pmgr);
+    // The kernel is loaded again below, so the locked range must go first
+    apple_reg_block_reset(t8030_machine->amcc);
+    t8030_amcc_ctrr_update(t8030_machine);
     if (!runstate_check(RUN_STATE_RESTORE_VM) &&
-        !runstate_check(RUN_STATE_PRELAUNCH)) {
+        !runstate_check(RUN_STATE_PRELAUNCH) &&
+        !runstate_check(RUN_STATE_INMIGRATE)) {
         if (!runstate_check(RUN_STATE_PAUSED) ||
             reason != SHUTDOWN_CAUSE_NONE) {
             t8030_memory_setup(MACHINE(t8030_machine));
         }
     }
     t8030_cpu_reset(t8030_machine);
+    apple_boot_milestone("kernel_entry");
     gpio =
         DEVICE(object_property_get_link(OBJECT(machine), "gpio", &error_fatal));
 
@@ -2008,14 +2532,105 @@ static void t8030_machine_reset(MachineState *machine, ShutdownCause reason)
                  t8030_machine->force_dfu);
 }
 
+static bool t8030_dump_info(XnuDumpInfo *info, void *opaque, Error **errp)
+{
+    T8030MachineState *t8030_machine = opaque;
+
+    return macho_dump_info(
+        info, get_dtb_node(t8030_machine->device_tree, "/chosen/memory-map"),
+        t8030_machine->kernel, t8030_machine->bootinfo.kern_boot_args_addr, errp);
+}
+
 static void t8030_machine_init_done(Notifier *notifier, void *data)
 {
     T8030MachineState *t8030_machine =
         container_of(notifier, T8030MachineState, init_done_notifier);
+
+    /*
+     * When restoring a booted snapshot with -incoming, guest RAM and CPU
+     * state come from the migration stream (or from a memory backend
+     * file), so skip loading and patching the boot images.
+     */
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        return;
+    }
     t8030_memory_setup(MACHINE(t8030_machine));
     t8030_cpu_reset(t8030_machine);
 }
 
+/*
+ * The high DRAM is NORESERVE so the host never commits memory for pages the
+ * guest leaves untouched; those read back as zero and migrate and snapshot as
+ * zero-page records. Sizing it down with high-dram-size also shrinks the
+ * dirty bitmap, and 0 leaves the range unmapped.
+ */
+static void t8030_high_dram_setup(T8030MachineState *t8030_machine)
+{
+    MemoryRegion *mr;
+
+    if (t8030_machine->high_dram_size == 0) {
+        return;
+    }
+
+    mr = g_new(MemoryRegion, 1);
+    memory_region_init_ram_flags_nomigrate(mr, NULL, "DRAM_3",
+                                           t8030_machine->high_dram_size,
+                                           RAM_NORESERVE, &error_fatal);
+    vmstate_register_ram_global(mr);
+    memory_region_add_subregion(t8030_machine->sysmem, T8030_HIGH_DRAM_BASE,
+                                mr);
+}
+
+/*
+ * The device tree and trustcache do not depend on the kernelcache, so they
+ * are read and decoded on threads of their own while the kernelcache, by
+ * far the largest payload, loads on the main thread.
+ */
+static void *t8030_load_dtb_thread(void *opaque)
+{
+    MachineState *machine = opaque;
+    T8030MachineState *t8030_machine = T8030_MACHINE(machine);
+
+    t8030_machine->device_tree = load_dtb_from_file(machine->dtb);
+    return NULL;
+}
+
+static void *t8030_load_trustcache_thread(void *opaque)
+{
+    T8030MachineState *t8030_machine = opaque;
+
+    t8030_machine->trustcache =
+        load_trustcache_from_file(t8030_machine->trustcache_filename,
+                                  &t8030_machine->bootinfo.trustcache_size);
+    return NULL;
+}
+
+/*
+ * Pin down whatever would make two runs of the same workload diverge. The
+ * timebase and all guest timers follow QEMU_CLOCK_VIRTUAL, which only
+ * advances with the instruction stream under precise icount; that has to
+ * be asked for on the command line.
+ */
+static void t8030_deterministic_setup(T8030MachineState *t8030_machine)
+{
+    if (t8030_machine->ecid != 0 &&
+        t8030_machine->ecid != T8030_DEFAULT_ECID) {
+        error_report("deterministic=on cannot be combined with "
+                     "ecid=0x%" PRIx64, t8030_machine->ecid);
+        exit(EXIT_FAILURE);
+    }
+    t8030_machine->ecid = T8030_DEFAULT_ECID;
+    t8030_machine->kaslr_off = true;
+    t8030_machine->cpu_quota = 100;
+    if (!qemu_guest_random_is_seeded()) {
+        qemu_guest_random_seed_main("0", &error_abort);
+    }
+    if (icount_enabled() != ICOUNT_PRECISE) {
+        warn_report("deterministic=on needs -icount shift=N,sleep=off for "
+                    "guest time to follow the instruction stream");
+    }
+}
+
 static void t8030_machine_init(MachineState *machine)
 {
     T8030MachineState *t8030_machine;
@@ -2028,11 +2643,22 @@ static void t8030_machine_init(MachineState *machine)
     DTBNode *child;
     DTBProp *prop;
     hwaddr *ranges;
+    QemuThread dtb_thread;
+    QemuThread trustcache_thread;
 
     memset(buffer, 0, sizeof(buffer));
 
     t8030_machine = T8030_MACHINE(machine);
 
+    if (t8030_machine->boot_profile) {
+        apple_boot_profile_enable();
+    }
+    apple_boot_phase_begin("t8030_machine_init");
+
+    if (t8030_machine->deterministic) {
+        t8030_deterministic_setup(t8030_machine);
+    }
+
     if (!t8030_machine->sep_fw_filename != !t8030_machine->seprom_filename) {
         error_setg(&error_abort,
                    "You need to specify both the SEPROM and the decrypted "
@@ -2040,17 +2666,31 @@ static void t8030_machine_init(MachineState *machine)
         return;
     }
 
+    if (t8030_machine->payload_cache_dir != NULL &&
+        g_mkdir_with_parents(t8030_machine->payload_cache_dir, 0755) != 0) {
+        warn_report("Could not create payload cache directory '%s': %s",
+                    t8030_machine->payload_cache_dir, strerror(errno));
+    }
+    macho_set_payload_cache_dir(t8030_machine->payload_cache_dir);
+
+    qemu_thread_create(&dtb_thread, "t8030.dtb", t8030_load_dtb_thread,
+                       machine, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&trustcache_thread, "t8030.trustcache",
+                       t8030_load_trustcache_thread, t8030_machine,
+                       QEMU_THREAD_JOINABLE);
+
     t8030_machine->sysmem = get_system_memory();
     allocate_ram(t8030_machine->sysmem, "SROM", T8030_SROM_BASE,
                  T8030_SROM_SIZE, 0);
     allocate_ram(t8030_machine->sysmem, "SRAM", T8030_SRAM_BASE,
                  T8030_SRAM_SIZE, 0);
-    allocate_ram(t8030_machine->sysmem, "DRAM", T8030_DRAM_BASE,
-                 T8030_DRAM_SIZE, 0);
+    memory_region_add_subregion(t8030_machine->sysmem, T8030_DRAM_BASE,
+                                machine->ram);
+    t8030_panic_monitor_init(t8030_machine);
+    vmstate_register(NULL, 0, &vmstate_t8030_boot, t8030_machine);
     allocate_ram(t8030_machine->sysmem, "SEPROM", T8030_SEPROM_BASE,
                  T8030_SEPROM_SIZE, 0);
-    allocate_ram(t8030_machine->sysmem, "DRAM_3", 0x300000000ULL,
-                 0x100000000ULL, 0);
+    t8030_high_dram_setup(t8030_machine);
 
     hdr = macho_load_file(machine->kernel_filename, NULL);
     g_assert_nonnull(hdr);
@@ -2088,12 +2728,15 @@ static void t8030_machine_init(MachineState *machine)
     g_virt_base = kernel_low;
     g_phys_base = (hwaddr)macho_get_buffer(hdr);
 
-    t8030_patch_kernel(hdr);
+    t8030_patch_kernel(t8030_machine, hdr);
+    xnu_sym_init(hdr);
+    xnu_dump_register(t8030_dump_info, t8030_machine);
+    if (t8030_machine->xnu_profile_path != NULL) {
+        xnu_prof_start(hdr, t8030_machine->xnu_profile_path);
+    }
 
-    t8030_machine->device_tree = load_dtb_from_file(machine->dtb);
-    t8030_machine->trustcache =
-        load_trustcache_from_file(t8030_machine->trustcache_filename,
-                                  &t8030_machine->bootinfo.trustcache_size);
+    qemu_thread_join(&dtb_thread);
+    qemu_thread_join(&trustcache_thread);
     data = 24000000;
     set_dtb_prop(t8030_machine->device_tree, "clock-frequency", sizeof(data),
                  &data);
@@ -2148,7 +2791,7 @@ static void t8030_machine_init(MachineState *machine)
     set_dtb_prop(child, "certificate-security-mode", sizeof(data), &data);
 
     if (t8030_machine->ecid == 0) {
-        t8030_machine->ecid = 0x1122334455667788;
+        t8030_machine->ecid = T8030_DEFAULT_ECID;
     }
     set_dtb_prop(child, "unique-chip-id", 8, &t8030_machine->ecid);
 
@@ -2171,7 +2814,10 @@ static void t8030_machine_init(MachineState *machine)
     g_assert_nonnull(
         set_dtb_prop(child, "device-color-policy", sizeof(data), &data));
 
+    apple_boot_phase_begin("device_realize");
     t8030_cpu_setup(machine);
+    // The A13 cores take the paravirtual hypercalls.
+    t8030_machine->bootinfo.hypercall_version = APPLE_HYPERCALL_VERSION;
 
     t8030_create_aic(machine);
 
@@ -2179,6 +2825,14 @@ static void t8030_machine_init(MachineState *machine)
         t8030_create_s3c_uart(t8030_machine, i, serial_hd(i));
     }
 
+    if (t8030_machine->shmcon_chardev != NULL) {
+        t8030_create_shmcon(t8030_machine);
+    }
+
+    if (t8030_machine->free_page_reporting) {
+        t8030_create_free_page_report(t8030_machine);
+    }
+
     t8030_pmgr_setup(machine);
     t8030_amcc_setup(machine);
 
@@ -2227,9 +2881,13 @@ static void t8030_machine_init(MachineState *machine)
     t8030_roswell_create(machine);
 
     t8030_display_create(machine);
+    apple_boot_phase_end("device_realize");
+
+    apple_stats_init();
 
     t8030_machine->init_done_notifier.notify = t8030_machine_init_done;
     qemu_add_machine_init_done_notifier(&t8030_machine->init_done_notifier);
+    apple_boot_phase_end("t8030_machine_init");
 }
 
 static void t8030_set_trustcache_filename(Object *obj, const char *value,
@@ -2304,6 +2962,160 @@ static char *t8030_get_sepfw_filename(Object *obj, Error **errp)
     return g_strdup(t8030_machine->sep_fw_filename);
 }
 
+static void t8030_set_payload_cache_dir(Object *obj, const char *value,
+                                        Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->payload_cache_dir);
+    t8030_machine->payload_cache_dir = g_strdup(value);
+}
+
+static char *t8030_get_payload_cache_dir(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->payload_cache_dir);
+}
+
+static void t8030_set_kernel_patches_filename(Object *obj, const char *value,
+                                              Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->kernel_patches_filename);
+    t8030_machine->kernel_patches_filename = g_strdup(value);
+}
+
+static char *t8030_get_kernel_patches_filename(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->kernel_patches_filename);
+}
+
+static void t8030_set_xnu_profile_path(Object *obj, const char *value,
+                                       Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->xnu_profile_path);
+    t8030_machine->xnu_profile_path = g_strdup(value);
+}
+
+static char *t8030_get_xnu_profile_path(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->xnu_profile_path);
+}
+
+static void t8030_get_cluster_affinity(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    char *value;
+
+    t8030_machine = T8030_MACHINE(obj);
+    value = t8030_machine->cluster_affinity[(uintptr_t)opaque];
+    visit_type_str(v, name, &value, errp);
+}
+
+static void t8030_set_cluster_affinity(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    g_autofree unsigned long *host_cpus = NULL;
+    char *value;
+
+    t8030_machine = T8030_MACHINE(obj);
+
+    if (!visit_type_str(v, name, &value, errp)) {
+        return;
+    }
+
+    host_cpus = t8030_parse_host_cpus(value, errp);
+    if (!host_cpus) {
+        g_free(value);
+        return;
+    }
+
+    g_free(t8030_machine->cluster_affinity[(uintptr_t)opaque]);
+    t8030_machine->cluster_affinity[(uintptr_t)opaque] = value;
+}
+
+static void t8030_get_cluster_priority(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    int32_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+    value = t8030_machine->cluster_priority[(uintptr_t)opaque];
+    visit_type_int32(v, name, &value, errp);
+}
+
+static void t8030_set_cluster_priority(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    int32_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+
+    if (!visit_type_int32(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value < -20 || value > 19) {
+        error_setg(errp, "%s must be a nice value between -20 and 19", name);
+        return;
+    }
+
+    t8030_machine->cluster_priority[(uintptr_t)opaque] = value;
+}
+
+static void t8030_get_cpu_quota(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint8_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+    value = t8030_machine->cpu_quota;
+    visit_type_uint8(v, name, &value, errp);
+}
+
+static void t8030_set_cpu_quota(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint8_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+
+    if (!visit_type_uint8(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value < 1 || value > 100) {
+        error_setg(errp, "%s must be a percentage between 1 and 100", name);
+        return;
+    }
+
+    t8030_machine->cpu_quota = value;
+}
+
 static void t8030_set_boot_mode(Object *obj, const char *value, Error **errp)
 {
     T8030MachineState *t8030_machine;
@@ -2368,6 +3180,22 @@ static void t8030_set_ecid(Object *obj, Visitor *v, const char *name,
     t8030_machine->ecid = value;
 }
 
+static void t8030_set_display(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    t8030_machine->headless = !value;
+}
+
+static bool t8030_get_display(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return !t8030_machine->headless;
+}
+
 static void t8030_set_kaslr_off(Object *obj, bool value, Error **errp)
 {
     T8030MachineState *t8030_machine;
@@ -2384,6 +3212,42 @@ static bool t8030_get_kaslr_off(Object *obj, Error **errp)
     return t8030_machine->kaslr_off;
 }
 
+static void t8030_get_high_dram_size(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint64_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+    value = t8030_machine->high_dram_size;
+    visit_type_size(v, name, &value, errp);
+}
+
+static void t8030_set_high_dram_size(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    T8030MachineState *t8030_machine;
+    uint64_t value;
+
+    t8030_machine = T8030_MACHINE(obj);
+
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value > T8030_HIGH_DRAM_MAX_SIZE || !QEMU_IS_ALIGNED(value, 16 * KiB)) {
+        error_setg(errp,
+                   "high-dram-size must be a multiple of 16 KiB and at most "
+                   "0x%llx",
+                   T8030_HIGH_DRAM_MAX_SIZE);
+        return;
+    }
+
+    t8030_machine->high_dram_size = value;
+}
+
 static ram_addr_t t8030_machine_fixup_ram_size(ram_addr_t size)
 {
     g_assert_cmpuint(size, ==, T8030_DRAM_SIZE);
@@ -2406,6 +3270,161 @@ static bool t8030_get_force_dfu(Object *obj, Error **errp)
     return t8030_machine->force_dfu;
 }
 
+static void t8030_set_ans_ioeventfd(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    t8030_machine->ans_ioeventfd = value;
+}
+
+static bool t8030_get_ans_ioeventfd(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return t8030_machine->ans_ioeventfd;
+}
+
+static void t8030_set_ans_readahead_path(Object *obj, const char *value,
+                                         Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->ans_readahead_path);
+    t8030_machine->ans_readahead_path = g_strdup(value);
+}
+
+static char *t8030_get_ans_readahead_path(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->ans_readahead_path);
+}
+
+static void t8030_set_ans_vhost_user_path(Object *obj, const char *value,
+                                          Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->ans_vhost_user_path);
+    t8030_machine->ans_vhost_user_path = g_strdup(value);
+}
+
+static char *t8030_get_ans_vhost_user_path(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->ans_vhost_user_path);
+}
+
+static void t8030_set_shmcon_chardev(Object *obj, const char *value,
+                                     Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->shmcon_chardev);
+    t8030_machine->shmcon_chardev = g_strdup(value);
+}
+
+static char *t8030_get_shmcon_chardev(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->shmcon_chardev);
+}
+
+static void t8030_set_usbmux_path(Object *obj, const char *value,
+                                  Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->usbmux_path);
+    t8030_machine->usbmux_path = g_strdup(value);
+}
+
+static char *t8030_get_usbmux_path(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->usbmux_path);
+}
+
+static void t8030_set_sep_keystore_filename(Object *obj, const char *value,
+                                            Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    g_free(t8030_machine->sep_keystore_filename);
+    t8030_machine->sep_keystore_filename = g_strdup(value);
+}
+
+static char *t8030_get_sep_keystore_filename(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return g_strdup(t8030_machine->sep_keystore_filename);
+}
+
+static void t8030_set_boot_profile(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    t8030_machine->boot_profile = value;
+}
+
+static bool t8030_get_boot_profile(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return t8030_machine->boot_profile;
+}
+
+static void t8030_set_deterministic(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    t8030_machine->deterministic = value;
+}
+
+static bool t8030_get_deterministic(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return t8030_machine->deterministic;
+}
+
+static void t8030_set_free_page_reporting(Object *obj, bool value,
+                                          Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    t8030_machine->free_page_reporting = value;
+}
+
+static bool t8030_get_free_page_reporting(Object *obj, Error **errp)
+{
+    T8030MachineState *t8030_machine;
+
+    t8030_machine = T8030_MACHINE(obj);
+    return t8030_machine->free_page_reporting;
+}
+
 static void t8030_machine_class_init(ObjectClass *klass, void *data)
 {
     MachineClass *mc = MACHINE_CLASS(klass);
@@ -2421,6 +3440,7 @@ static void t8030_machine_class_init(ObjectClass *klass, void *data)
     mc->default_cpu_type = TYPE_APPLE_A13;
     mc->minimum_page_bits = 14;
     mc->default_ram_size = T8030_DRAM_SIZE;
+    mc->default_ram_id = "t8030.dram";
     mc->fixup_ram_size = t8030_machine_fixup_ram_size;
 
     object_class_property_add_str(klass, "trustcache",
@@ -2439,6 +3459,12 @@ static void t8030_machine_class_init(ObjectClass *klass, void *data)
     object_class_property_add_str(klass, "sepfw", t8030_get_sepfw_filename,
                                   t8030_set_sepfw_filename);
     object_class_property_set_description(klass, "sepfw", "SEPFW to be loaded");
+    object_class_property_add_str(klass, "payload-cache",
+                                  t8030_get_payload_cache_dir,
+                                  t8030_set_payload_cache_dir);
+    object_class_property_set_description(
+        klass, "payload-cache",
+        "Directory used to cache decompressed firmware payloads");
     object_class_property_add_str(klass, "boot-mode", t8030_get_boot_mode,
                                   t8030_set_boot_mode);
     object_class_property_set_description(klass, "boot-mode",
@@ -2446,18 +3472,146 @@ static void t8030_machine_class_init(ObjectClass *klass, void *data)
     object_class_property_add(klass, "ecid", "uint64", t8030_get_ecid,
                               t8030_set_ecid, NULL, NULL);
     object_class_property_set_description(klass, "ecid", "Device ECID");
+    object_class_property_add_bool(klass, "display", t8030_get_display,
+                                   t8030_set_display);
+    object_class_property_set_description(
+        klass, "display",
+        "Draw GenPipe frames into a console. When off, swaps are only "
+        "acknowledged and no layer is read");
     object_class_property_add_bool(klass, "kaslr-off", t8030_get_kaslr_off,
                                    t8030_set_kaslr_off);
     object_class_property_set_description(klass, "kaslr-off", "Disable KASLR");
     object_class_property_add_bool(klass, "force-dfu", t8030_get_force_dfu,
                                    t8030_set_force_dfu);
     object_class_property_set_description(klass, "force-dfu", "Force DFU");
+    object_class_property_add_bool(klass, "ans-ioeventfd",
+                                   t8030_get_ans_ioeventfd,
+                                   t8030_set_ans_ioeventfd);
+    object_class_property_set_description(
+        klass, "ans-ioeventfd",
+        "Process ANS NVMe I/O queues from eventfds instead of in the vCPU "
+        "doorbell write");
+    object_class_property_add_str(klass, "ans-readahead",
+                                  t8030_get_ans_readahead_path,
+                                  t8030_set_ans_readahead_path);
+    object_class_property_set_description(
+        klass, "ans-readahead",
+        "Record the NAND reads of the first boot to this file, and replay "
+        "them as readahead when ANS starts on later boots");
+    object_class_property_add_str(klass, "ans-vhost-user",
+                                  t8030_get_ans_vhost_user_path,
+                                  t8030_set_ans_vhost_user_path);
+    object_class_property_set_description(
+        klass, "ans-vhost-user",
+        "Socket of a vhost-user-blk server that serves the NAND as an ANS "
+        "namespace");
+    object_class_property_add_str(klass, "shmcon", t8030_get_shmcon_chardev,
+                                  t8030_set_shmcon_chardev);
+    object_class_property_set_description(
+        klass, "shmcon",
+        "Chardev that receives the paravirtual shared-memory console, which "
+        "is advertised to the guest as /chosen/shmcon");
+    object_class_property_add_str(klass, "usbmux", t8030_get_usbmux_path,
+                                  t8030_set_usbmux_path);
+    object_class_property_set_description(
+        klass, "usbmux",
+        "UNIX socket to serve the device's usbmux connections on, for "
+        "USBMUXD_SOCKET_ADDRESS=UNIX:<path>");
+    object_class_property_add_str(klass, "sep-keystore",
+                                  t8030_get_sep_keystore_filename,
+                                  t8030_set_sep_keystore_filename);
+    object_class_property_set_description(
+        klass, "sep-keystore",
+        "File the simulated SEP keeps its keystore state in, reused by "
+        "later runs with the same ECID and NAND image");
+    object_class_property_add(klass, "high-dram-size", "size",
+                              t8030_get_high_dram_size,
+                              t8030_set_high_dram_size, NULL, NULL);
+    object_class_property_set_description(
+        klass, "high-dram-size",
+        "Size of the RAM mapped at 0x300000000, 0 to leave it unmapped");
+    for (uintptr_t i = 0; i < ARRAY_SIZE(t8030_cluster_option); i++) {
+        g_autofree char *affinity =
+            g_strdup_printf("%s-affinity", t8030_cluster_option[i]);
+        g_autofree char *priority =
+            g_strdup_printf("%s-priority", t8030_cluster_option[i]);
+
+        g_autofree char *affinity_desc = g_strdup_printf(
+            "Host CPUs (e.g. 0-3,8) to run the %s vCPUs on",
+            t8030_cluster_core[i]);
+        g_autofree char *priority_desc = g_strdup_printf(
+            "Nice value of the %s vCPU threads, 0 to leave them alone; on "
+            "macOS hosts <0 selects user-interactive QoS, >0 utility",
+            t8030_cluster_core[i]);
+
+        object_class_property_add(klass, affinity, "str",
+                                  t8030_get_cluster_affinity,
+                                  t8030_set_cluster_affinity, NULL,
+                                  (void *)i);
+        object_class_property_set_description(klass, affinity, affinity_desc);
+        object_class_property_add(klass, priority, "int32",
+                                  t8030_get_cluster_priority,
+                                  t8030_set_cluster_priority, NULL,
+                                  (void *)i);
+        object_class_property_set_description(klass, priority, priority_desc);
+    }
+    object_class_property_add_str(klass, "kernel-patches",
+                                  t8030_get_kernel_patches_filename,
+                                  t8030_set_kernel_patches_filename);
+    object_class_property_set_description(
+        klass, "kernel-patches",
+        "File of instruction signatures to patch in the kernelcache");
+    object_class_property_add_str(klass, "xnu-profile",
+                                  t8030_get_xnu_profile_path,
+                                  t8030_set_xnu_profile_path);
+    object_class_property_set_description(
+        klass, "xnu-profile",
+        "Sample guest kernel PCs and write a per-kext, per-function "
+        "collapsed-stack profile to this file at exit");
+    object_class_property_add_bool(klass, "boot-profile",
+                                   t8030_get_boot_profile,
+                                   t8030_set_boot_profile);
+    object_class_property_set_description(
+        klass, "boot-profile",
+        "Log a summary of boot phase timings and guest milestones at exit");
+    object_class_property_add_bool(klass, "deterministic",
+                                   t8030_get_deterministic,
+                                   t8030_set_deterministic);
+    object_class_property_set_description(
+        klass, "deterministic",
+        "Make runs repeatable: implies kaslr-off=on, the default ECID (any "
+        "other is rejected), the qcrypto AES backend, a fixed guest random "
+        "seed (0 unless -seed is given), fixed AIC steering and no "
+        "cpu-quota; use with -icount shift=N,sleep=off");
+    object_class_property_add_bool(klass, "free-page-reporting",
+                                   t8030_get_free_page_reporting,
+                                   t8030_set_free_page_reporting);
+    object_class_property_set_description(
+        klass, "free-page-reporting",
+        "Advertise /chosen/free-page-report, through which a guest kext can "
+        "hand free pages back to the host");
+    object_class_property_add(klass, "cpu-quota", "uint8",
+                              t8030_get_cpu_quota, t8030_set_cpu_quota, NULL,
+                              NULL);
+    object_class_property_set_description(
+        klass, "cpu-quota",
+        "Percentage of a host CPU each vCPU thread may use, 1 to 100 "
+        "(default 100, no cap); guest time keeps following the host clock");
+}
+
+static void t8030_machine_instance_init(Object *obj)
+{
+    T8030MachineState *t8030_machine = T8030_MACHINE(obj);
+
+    t8030_machine->high_dram_size = T8030_HIGH_DRAM_DEFAULT_SIZE;
+    t8030_machine->cpu_quota = 100;
 }
 
 static const TypeInfo t8030_machine_info = {
     .name = TYPE_T8030_MACHINE,
     .parent = TYPE_MACHINE,
     .instance_size = sizeof(T8030MachineState),
+    .instance_init = t8030_machine_instance_init,
     .class_size = sizeof(T8030MachineClass),
     .class_init = t8030_machine_class_init,
 };
@@ -0,0 +1 @@
+#include "trace/trace-hw_arm_apple_silicon.h"
@@ -0,0 +1,353 @@
+/*
+ * Signature-based XNU kernelcache patcher.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/xnu-patch.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+
+/*
+ * The patches searched in a segment are bucketed by the mask of their
+ * first word, then by the masked first word, so each word of the segment
+ * costs one lookup per distinct first mask, however many patches there
+ * are. Only the few candidates found that way are compared in full.
+ */
+typedef struct {
+    uint32_t mask;
+    /* Masked first word -> GArray of patch indices. */
+    GHashTable *heads;
+} XnuPatchBucket;
+
+typedef struct {
+    const XnuPatch *patches;
+    /* Per patch, the first matching word of each match. */
+    GPtrArray **matches;
+    uint8_t *data;
+    uint64_t low;
+} XnuPatcher;
+
+static bool xnu_patch_match(const XnuPatch *patch, const uint32_t *words)
+{
+    for (uint32_t i = 1; i < patch->insn_count; i++) {
+        if ((le32_to_cpu(words[i]) & patch->mask[i]) !=
+            (patch->insn[i] & patch->mask[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void xnu_patch_bucket_add(GArray *buckets, const XnuPatch *patch,
+                                 size_t index)
+{
+    XnuPatchBucket *bucket = NULL;
+    gpointer key = GUINT_TO_POINTER(patch->insn[0] & patch->mask[0]);
+    GArray *heads;
+
+    for (guint i = 0; i < buckets->len; i++) {
+        if (g_array_index(buckets, XnuPatchBucket, i).mask == patch->mask[0]) {
+            bucket = &g_array_index(buckets, XnuPatchBucket, i);
+            break;
+        }
+    }
+    if (bucket == NULL) {
+        XnuPatchBucket new_bucket = {
+            .mask = patch->mask[0],
+            .heads = g_hash_table_new_full(NULL, NULL, NULL,
+                                           (GDestroyNotify)g_array_unref),
+        };
+
+        g_array_append_val(buckets, new_bucket);
+        bucket = &g_array_index(buckets, XnuPatchBucket, buckets->len - 1);
+    }
+
+    heads = g_hash_table_lookup(bucket->heads, key);
+    if (heads == NULL) {
+        heads = g_array_new(FALSE, FALSE, sizeof(size_t));
+        g_hash_table_insert(bucket->heads, key, heads);
+    }
+    g_array_append_val(heads, index);
+}
+
+/* Finds the matches of the patches in `indices` within `seg`. */
+static void xnu_patch_scan(XnuPatcher *p, MachoSegmentCommand64 *seg,
+                           GArray *indices)
+{
+    uint32_t *words = (uint32_t *)(p->data + seg->vmaddr - p->low);
+    size_t count = MIN(seg->filesize, seg->vmsize) / sizeof(uint32_t);
+    GArray *buckets = g_array_new(FALSE, FALSE, sizeof(XnuPatchBucket));
+
+    for (guint i = 0; i < indices->len; i++) {
+        size_t index = g_array_index(indices, size_t, i);
+
+        xnu_patch_bucket_add(buckets, &p->patches[index], index);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t word = le32_to_cpu(words[i]);
+
+        for (guint j = 0; j < buckets->len; j++) {
+            XnuPatchBucket *bucket = &g_array_index(buckets, XnuPatchBucket, j);
+            GArray *heads = g_hash_table_lookup(
+                bucket->heads, GUINT_TO_POINTER(word & bucket->mask));
+
+            if (heads == NULL) {
+                continue;
+            }
+            for (guint k = 0; k < heads->len; k++) {
+                size_t index = g_array_index(heads, size_t, k);
+                const XnuPatch *patch = &p->patches[index];
+
+                if (MAX(patch->insn_count, patch->replace_count) <=
+                        count - i &&
+                    xnu_patch_match(patch, words + i)) {
+                    g_ptr_array_add(p->matches[index], words + i);
+                }
+            }
+        }
+    }
+
+    for (guint i = 0; i < buckets->len; i++) {
+        g_hash_table_destroy(g_array_index(buckets, XnuPatchBucket, i).heads);
+    }
+    g_array_free(buckets, TRUE);
+}
+
+static MachoSegmentCommand64 *xnu_patch_segment(MachoHeader64 *kernel,
+                                                const char *bundle)
+{
+    MachoHeader64 *mh;
+
+    if (bundle != NULL && g_str_equal(bundle, "com.apple.kernel")) {
+        bundle = NULL;
+    }
+    if (kernel->file_type != MH_FILESET) {
+        return macho_get_segment(kernel, bundle ? "__PLK_TEXT_EXEC" :
+                                                  "__TEXT_EXEC");
+    }
+    mh = macho_get_fileset_header(kernel, bundle ? bundle : "com.apple.kernel");
+    return mh ? macho_get_segment(mh, "__TEXT_EXEC") : NULL;
+}
+
+void xnu_patch_apply(MachoHeader64 *kernel, const XnuPatch *patches,
+                     size_t count)
+{
+    XnuPatcher p = { .patches = patches };
+    GHashTable *segments;
+    GHashTableIter iter;
+    MachoSegmentCommand64 *seg;
+    GArray *indices;
+
+    if (count == 0) {
+        return;
+    }
+
+    apple_boot_phase_begin("xnu_patch_apply");
+    p.data = macho_get_buffer(kernel);
+    macho_highest_lowest(kernel, &p.low, NULL);
+    p.matches = g_new0(GPtrArray *, count);
+
+    /* Segment -> GArray of the indices of the patches searched in it. */
+    segments = g_hash_table_new_full(NULL, NULL, NULL,
+                                     (GDestroyNotify)g_array_unref);
+    for (size_t i = 0; i < count; i++) {
+        p.matches[i] = g_ptr_array_new();
+        seg = xnu_patch_segment(kernel, patches[i].bundle);
+        if (seg == NULL) {
+            warn_report("Kernel patch '%s': no __TEXT_EXEC for %s, skipping",
+                        patches[i].name,
+                        patches[i].bundle ? patches[i].bundle :
+                                            "the kernel");
+            continue;
+        }
+        indices = g_hash_table_lookup(segments, seg);
+        if (indices == NULL) {
+            indices = g_array_new(FALSE, FALSE, sizeof(size_t));
+            g_hash_table_insert(segments, seg, indices);
+        }
+        g_array_append_val(indices, i);
+    }
+
+    g_hash_table_iter_init(&iter, segments);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&seg,
+                                  (gpointer *)&indices)) {
+        xnu_patch_scan(&p, seg, indices);
+    }
+    g_hash_table_destroy(segments);
+
+    for (size_t i = 0; i < count; i++) {
+        const XnuPatch *patch = &patches[i];
+
+        if (p.matches[i]->len == 0) {
+            warn_report("Kernel patch '%s' did not match, skipping",
+                        patch->name);
+        }
+        for (guint j = 0; j < p.matches[i]->len; j++) {
+            uint32_t *words = g_ptr_array_index(p.matches[i], j);
+
+            for (uint32_t k = 0; k < patch->replace_count; k++) {
+                uint32_t word = le32_to_cpu(words[k]);
+
+                word = (word & ~patch->replace_mask[k]) |
+                       (patch->replace[k] & patch->replace_mask[k]);
+                words[k] = cpu_to_le32(word);
+            }
+        }
+        if (p.matches[i]->len != 0) {
+            info_report("Kernel patch '%s' applied at %u site(s)", patch->name,
+                        p.matches[i]->len);
+        }
+        g_ptr_array_free(p.matches[i], TRUE);
+    }
+    g_free(p.matches);
+    apple_boot_phase_end("xnu_patch_apply");
+}
+
+static bool xnu_patch_parse_word(const char *str, bool allow_mask,
+                                 uint32_t *word, uint32_t *mask)
+{
+    const char *end;
+    unsigned int value;
+
+    if (g_str_equal(str, "-") && !allow_mask) {
+        *word = 0;
+        *mask = 0;
+        return true;
+    }
+    if (qemu_strtoui(str, &end, 16, &value) < 0) {
+        return false;
+    }
+    *word = value;
+    *mask = UINT32_MAX;
+    if (*end == '/' && allow_mask) {
+        if (qemu_strtoui(end + 1, NULL, 16, &value) < 0) {
+            return false;
+        }
+        *mask = value;
+    } else if (*end != '\0') {
+        return false;
+    }
+    return true;
+}
+
+/* Parses one non-empty line, its strings and arrays go to `owned`. */
+static bool xnu_patch_parse_line(char **tokens, XnuPatch *patch,
+                                 GPtrArray *owned)
+{
+    guint count = g_strv_length(tokens);
+    guint sep;
+    uint32_t *insn;
+    uint32_t *mask;
+    uint32_t *replace;
+    uint32_t *replace_mask;
+
+    for (sep = 2; sep < count; sep++) {
+        if (g_str_equal(tokens[sep], "=")) {
+            break;
+        }
+    }
+    if (sep <= 2 || sep >= count - 1) {
+        return false;
+    }
+
+    patch->name = tokens[0];
+    patch->bundle = g_str_equal(tokens[1], "-") ? NULL : tokens[1];
+    patch->insn_count = sep - 2;
+    patch->replace_count = count - sep - 1;
+    insn = g_new(uint32_t, patch->insn_count);
+    mask = g_new(uint32_t, patch->insn_count);
+    replace = g_new(uint32_t, patch->replace_count);
+    replace_mask = g_new(uint32_t, patch->replace_count);
+    g_ptr_array_add(owned, insn);
+    g_ptr_array_add(owned, mask);
+    g_ptr_array_add(owned, replace);
+    g_ptr_array_add(owned, replace_mask);
+
+    for (guint i = 0; i < patch->insn_count; i++) {
+        if (!xnu_patch_parse_word(tokens[2 + i], true, &insn[i], &mask[i])) {
+            return false;
+        }
+    }
+    for (guint i = 0; i < patch->replace_count; i++) {
+        if (!xnu_patch_parse_word(tokens[sep + 1 + i], false, &replace[i],
+                                  &replace_mask[i])) {
+            return false;
+        }
+    }
+
+    patch->insn = insn;
+    patch->mask = mask;
+    patch->replace = replace;
+    patch->replace_mask = replace_mask;
+    return true;
+}
+
+void xnu_patch_apply_file(MachoHeader64 *kernel, const char *path)
+{
+    g_autoptr(GError) err = NULL;
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autoptr(GArray) patches = g_array_new(FALSE, TRUE, sizeof(XnuPatch));
+    /* Keeps the tokens and arrays the patches point into. */
+    g_autoptr(GPtrArray) owned =
+        g_ptr_array_new_with_free_func((GDestroyNotify)g_strfreev);
+    g_autoptr(GPtrArray) words = g_ptr_array_new_with_free_func(g_free);
+
+    if (!g_file_get_contents(path, &contents, NULL, &err)) {
+        error_report("Could not load kernel patches from '%s': %s", path,
+                     err->message);
+        exit(EXIT_FAILURE);
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i] != NULL; i++) {
+        char *comment = strchr(lines[i], '#');
+        char **tokens;
+        XnuPatch patch = { 0 };
+
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        tokens = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+        /* Runs of blanks split into empty tokens, squeeze them out. */
+        for (char **from = tokens, **to = tokens;; from++) {
+            if (*from == NULL || **from != '\0') {
+                *to++ = *from;
+            } else {
+                g_free(*from);
+            }
+            if (*from == NULL) {
+                break;
+            }
+        }
+        g_ptr_array_add(owned, tokens);
+        if (tokens[0] == NULL) {
+            continue;
+        }
+
+        if (!xnu_patch_parse_line(tokens, &patch, words)) {
+            error_report("%s:%d: expected 'name bundle insn[/mask]... = "
+                         "replace|-...'",
+                         path, i + 1);
+            exit(EXIT_FAILURE);
+        }
+        g_array_append_val(patches, patch);
+    }
+
+    xnu_patch_apply(kernel, (XnuPatch *)patches->data, patches->len);
+}
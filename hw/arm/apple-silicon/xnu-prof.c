@@ -0,0 +1,161 @@
+/*
+ * Sampling profiler for XNU guests.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/mem.h"
+#include "hw/arm/apple-silicon/xnu-prof.h"
+#include "hw/arm/apple-silicon/xnu-sym.h"
+#include "hw/core/cpu.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+#include "target/arm/cpu.h"
+
+/* Prime, so the samples do not beat against periodic guest work. */
+#define XNU_PROF_HZ (997)
+
+typedef enum {
+    XNU_PROF_KERNEL,
+    XNU_PROF_GXF,
+    XNU_PROF_KERNEL_MODES,
+} XnuProfMode;
+
+static const char *const xnu_prof_mode_names[XNU_PROF_KERNEL_MODES] = {
+    [XNU_PROF_KERNEL] = "kernel",
+    [XNU_PROF_GXF] = "gxf",
+};
+
+typedef struct {
+    XnuSymIndex *index;
+
+    uint64_t *symbol_hits[XNU_PROF_KERNEL_MODES];
+    uint64_t *image_hits[XNU_PROF_KERNEL_MODES];
+    uint64_t other_hits[XNU_PROF_KERNEL_MODES];
+    uint64_t user_hits;
+
+    QEMUTimer *timer;
+    char *path;
+    Notifier exit_notifier;
+} XnuProfiler;
+
+static void xnu_prof_account(XnuProfiler *p, XnuProfMode mode, uint64_t pc)
+{
+    const XnuSymRange *range;
+    gssize sym;
+
+    if (!xnu_sym_lookup(p->index, pc, &range, &sym)) {
+        p->other_hits[mode]++;
+    } else if (sym >= 0) {
+        p->symbol_hits[mode][sym]++;
+    } else {
+        p->image_hits[mode][range->image]++;
+    }
+}
+
+/*
+ * The PC is read racily from the main loop; with TCG it is the last
+ * translation block boundary, which is as good as a sample gets.
+ */
+static void xnu_prof_sample(void *opaque)
+{
+    XnuProfiler *p = opaque;
+    CPUState *cs;
+
+    CPU_FOREACH (cs) {
+        ARMCPU *cpu = ARM_CPU(cs);
+        CPUARMState *env = &cpu->env;
+
+        if (cpu->power_state != PSCI_ON || cs->halted) {
+            continue;
+        }
+        if (arm_current_el(env) == 0) {
+            p->user_hits++;
+            continue;
+        }
+        xnu_prof_account(p, arm_is_guarded(env) ? XNU_PROF_GXF :
+                                                  XNU_PROF_KERNEL,
+                         env->pc - g_virt_slide);
+    }
+
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                            NANOSECONDS_PER_SECOND / XNU_PROF_HZ);
+}
+
+static void xnu_prof_report(Notifier *notifier, void *data)
+{
+    XnuProfiler *p = container_of(notifier, XnuProfiler, exit_notifier);
+    FILE *f;
+
+    f = fopen(p->path, "w");
+    if (f == NULL) {
+        error_report("Could not write XNU profile '%s': %s", p->path,
+                     strerror(errno));
+        return;
+    }
+
+    for (int mode = 0; mode < XNU_PROF_KERNEL_MODES; mode++) {
+        const char *mode_name = xnu_prof_mode_names[mode];
+
+        for (guint i = 0; i < p->index->symbols->len; i++) {
+            const XnuSym *sym = &g_array_index(p->index->symbols, XnuSym, i);
+
+            if (p->symbol_hits[mode][i]) {
+                fprintf(f, "%s;%s;%s %" PRIu64 "\n", mode_name,
+                        (const char *)g_ptr_array_index(p->index->images,
+                                                        sym->image),
+                        sym->name, p->symbol_hits[mode][i]);
+            }
+        }
+        for (guint i = 0; i < p->index->images->len; i++) {
+            if (p->image_hits[mode][i]) {
+                fprintf(f, "%s;%s %" PRIu64 "\n", mode_name,
+                        (const char *)g_ptr_array_index(p->index->images, i),
+                        p->image_hits[mode][i]);
+            }
+        }
+        if (p->other_hits[mode]) {
+            fprintf(f, "%s;[unknown] %" PRIu64 "\n", mode_name,
+                    p->other_hits[mode]);
+        }
+    }
+    if (p->user_hits) {
+        fprintf(f, "user %" PRIu64 "\n", p->user_hits);
+    }
+
+    fclose(f);
+    info_report("XNU profile written to '%s'", p->path);
+}
+
+void xnu_prof_start(MachoHeader64 *kernel, const char *path)
+{
+    XnuProfiler *p = g_new0(XnuProfiler, 1);
+
+    p->index = xnu_sym_index(kernel);
+    p->path = g_strdup(path);
+    for (int mode = 0; mode < XNU_PROF_KERNEL_MODES; mode++) {
+        p->symbol_hits[mode] = g_new0(uint64_t, p->index->symbols->len);
+        p->image_hits[mode] = g_new0(uint64_t, p->index->images->len);
+    }
+    info_report("XNU profiler: %u images, %u symbols", p->index->images->len,
+                p->index->symbols->len);
+
+    p->exit_notifier.notify = xnu_prof_report;
+    qemu_add_exit_notifier(&p->exit_notifier);
+    p->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xnu_prof_sample, p);
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                            NANOSECONDS_PER_SECOND / XNU_PROF_HZ);
+}
@@ -0,0 +1,250 @@
+/*
+ * Address to symbol index of XNU kernelcaches.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/mem.h"
+#include "hw/arm/apple-silicon/xnu-sym.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qdict.h"
+
+/* One kernelcache per machine, so one index. */
+static MachoHeader64 *xnu_sym_kernel;
+static XnuSymIndex *xnu_sym_cached;
+
+typedef struct {
+    XnuSymIndex *index;
+    uint8_t *data;
+    uint64_t low;
+} XnuSymBuilder;
+
+static void *xnu_sym_file_ptr(XnuSymBuilder *b, uint64_t off, uint64_t size)
+{
+    MachoHeader64 *kernel = b->index->kernel;
+    MachoLoadCommand *cmd = (MachoLoadCommand *)(kernel + 1);
+
+    for (uint32_t i = 0; i < kernel->n_cmds; i++) {
+        if (cmd->cmd == LC_SEGMENT_64) {
+            MachoSegmentCommand64 *seg = (MachoSegmentCommand64 *)cmd;
+
+            if (off >= seg->fileoff && size <= seg->filesize &&
+                off - seg->fileoff <= seg->filesize - size) {
+                return b->data + (seg->vmaddr - b->low) + (off - seg->fileoff);
+            }
+        }
+        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+    }
+
+    return NULL;
+}
+
+static void xnu_sym_add_symtab(XnuSymBuilder *b, uint32_t image,
+                               const MachoSymtabCommand *symtab)
+{
+    const MachoNList64 *syms;
+    const char *strs;
+
+    syms = xnu_sym_file_ptr(b, symtab->sym_off,
+                            (uint64_t)symtab->nsyms * sizeof(*syms));
+    strs = xnu_sym_file_ptr(b, symtab->str_off, symtab->str_size);
+    if (syms == NULL || strs == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < symtab->nsyms; i++) {
+        XnuSym sym;
+
+        if ((syms[i].n_type & N_STAB) ||
+            (syms[i].n_type & N_TYPE) != N_SECT ||
+            syms[i].n_un.n_strx >= symtab->str_size) {
+            continue;
+        }
+        sym.addr = syms[i].n_value;
+        sym.image = image;
+        sym.name = strs + syms[i].n_un.n_strx;
+        g_array_append_val(b->index->symbols, sym);
+    }
+}
+
+static void xnu_sym_add_image(XnuSymBuilder *b, MachoHeader64 *mh,
+                              const char *name)
+{
+    MachoLoadCommand *cmd = (MachoLoadCommand *)(mh + 1);
+    uint32_t image = b->index->images->len;
+
+    g_ptr_array_add(b->index->images, g_strdup(name));
+
+    for (uint32_t i = 0; i < mh->n_cmds; i++) {
+        switch (cmd->cmd) {
+        case LC_SEGMENT_64: {
+            MachoSegmentCommand64 *seg = (MachoSegmentCommand64 *)cmd;
+            XnuSymRange range = {
+                .start = seg->vmaddr,
+                .end = seg->vmaddr + seg->vmsize,
+                .image = image,
+            };
+
+            // Fileset entries all share the one __LINKEDIT.
+            if (seg->vmsize != 0 &&
+                strncmp(seg->segname, "__LINKEDIT", sizeof(seg->segname))) {
+                g_array_append_val(b->index->ranges, range);
+            }
+            break;
+        }
+        case LC_SYMTAB:
+            xnu_sym_add_symtab(b, image, (MachoSymtabCommand *)cmd);
+            break;
+        default:
+            break;
+        }
+        cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+    }
+}
+
+static gint xnu_sym_addr_compare(gconstpointer a, gconstpointer b)
+{
+    uint64_t addr_a = *(const uint64_t *)a;
+    uint64_t addr_b = *(const uint64_t *)b;
+
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+/* Index of the last element starting at or below `addr`, or -1. */
+static gssize xnu_sym_floor(const GArray *array, size_t elt_size,
+                            uint64_t addr)
+{
+    gssize lo = 0;
+    gssize hi = (gssize)array->len - 1;
+    gssize found = -1;
+
+    while (lo <= hi) {
+        gssize mid = lo + (hi - lo) / 2;
+
+        if (*(const uint64_t *)(array->data + mid * elt_size) <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+XnuSymIndex *xnu_sym_index(MachoHeader64 *kernel)
+{
+    XnuSymBuilder b;
+
+    if (xnu_sym_cached != NULL) {
+        g_assert(xnu_sym_cached->kernel == kernel);
+        return xnu_sym_cached;
+    }
+
+    b.index = g_new0(XnuSymIndex, 1);
+    b.index->kernel = kernel;
+    b.index->images = g_ptr_array_new_with_free_func(g_free);
+    b.index->ranges = g_array_new(FALSE, FALSE, sizeof(XnuSymRange));
+    b.index->symbols = g_array_new(FALSE, FALSE, sizeof(XnuSym));
+    b.data = macho_get_buffer(kernel);
+    macho_highest_lowest(kernel, &b.low, NULL);
+
+    if (kernel->file_type == MH_FILESET) {
+        MachoLoadCommand *cmd = (MachoLoadCommand *)(kernel + 1);
+
+        for (uint32_t i = 0; i < kernel->n_cmds; i++) {
+            if (cmd->cmd == LC_FILESET_ENTRY) {
+                MachoFilesetEntryCommand *entry =
+                    (MachoFilesetEntryCommand *)cmd;
+                const char *name = (const char *)entry + entry->entry_id;
+                MachoHeader64 *mh = macho_get_fileset_header(kernel, name);
+
+                if (mh != NULL) {
+                    xnu_sym_add_image(&b, mh, name);
+                }
+            }
+            cmd = (MachoLoadCommand *)((char *)cmd + cmd->cmd_size);
+        }
+    } else {
+        xnu_sym_add_image(&b, kernel, "com.apple.kernel");
+    }
+
+    g_array_sort(b.index->ranges, xnu_sym_addr_compare);
+    g_array_sort(b.index->symbols, xnu_sym_addr_compare);
+    xnu_sym_cached = b.index;
+    return b.index;
+}
+
+bool xnu_sym_lookup(const XnuSymIndex *index, uint64_t addr,
+                    const XnuSymRange **range, gssize *sym)
+{
+    const XnuSym *s;
+    gssize i;
+
+    i = xnu_sym_floor(index->ranges, sizeof(XnuSymRange), addr);
+    if (i < 0 || addr >= g_array_index(index->ranges, XnuSymRange, i).end) {
+        return false;
+    }
+    *range = &g_array_index(index->ranges, XnuSymRange, i);
+
+    *sym = xnu_sym_floor(index->symbols, sizeof(XnuSym), addr);
+    if (*sym >= 0) {
+        s = &g_array_index(index->symbols, XnuSym, *sym);
+        if (s->image != (*range)->image || s->addr < (*range)->start) {
+            *sym = -1;
+        }
+    }
+    return true;
+}
+
+/* Also reachable from gdb as 'monitor info xnu-sym ADDR'. */
+static void hmp_info_xnu_sym(Monitor *mon, const QDict *qdict)
+{
+    uint64_t addr = qdict_get_int(qdict, "addr");
+    const XnuSymIndex *index;
+    const XnuSymRange *range;
+    const char *image;
+    gssize sym;
+
+    if (xnu_sym_kernel == NULL) {
+        monitor_printf(mon, "No kernelcache loaded\n");
+        return;
+    }
+    index = xnu_sym_index(xnu_sym_kernel);
+
+    if (!xnu_sym_lookup(index, addr - g_virt_slide, &range, &sym)) {
+        monitor_printf(mon, "0x%" PRIx64 " is not in the kernelcache\n",
+                       addr);
+        return;
+    }
+    image = g_ptr_array_index(index->images, range->image);
+    if (sym < 0) {
+        monitor_printf(mon, "0x%" PRIx64 " %s+0x%" PRIx64 "\n", addr, image,
+                       addr - g_virt_slide - range->start);
+    } else {
+        const XnuSym *s = &g_array_index(index->symbols, XnuSym, sym);
+
+        monitor_printf(mon, "0x%" PRIx64 " %s`%s+0x%" PRIx64 "\n", addr,
+                       image, s->name, addr - g_virt_slide - s->addr);
+    }
+}
+
+void xnu_sym_init(MachoHeader64 *kernel)
+{
+    g_assert_null(xnu_sym_kernel);
+
+    xnu_sym_kernel = kernel;
+    monitor_register_hmp("xnu-sym", true, hmp_info_xnu_sym);
+}
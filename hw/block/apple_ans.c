@@ -10,12 +10,20 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
 #include "hw/pci/pcie_host.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
 #include "qemu/bitops.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
+#include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
+#include "sysemu/sysemu.h"
 
 // #define DEBUG_ANS
 #ifdef DEBUG_ANS
@@ -47,9 +55,39 @@ OBJECT_DECLARE_SIMPLE_TYPE(AppleANSState, APPLE_ANS)
 #define NVME_APPLE_BASE_CMD_ID_MASK 0xffff
 #define NVME_APPLE_LINEAR_SQ_CTRL 0x24908
 #define NVME_APPLE_LINEAR_SQ_CTRL_EN (1 << 0)
+#define NVME_APPLE_LINEAR_ASQ_DB 0x2490c
+#define NVME_APPLE_LINEAR_IOSQ_DB 0x24910
+#define NVME_APPLE_LINEAR_DB_TAG_MASK 0xffff
+#define NVME_APPLE_NVMMU_NUM_TCBS 0x28100
+#define NVME_APPLE_NVMMU_ASQ_TCB_BASE 0x28108
+#define NVME_APPLE_NVMMU_IOSQ_TCB_BASE 0x28110
+#define NVME_APPLE_NVMMU_TCB_INVAL 0x28118
+#define NVME_APPLE_NVMMU_TCB_STAT 0x28120
 #define NVME_APPLE_MODESEL 0x1304
+
 #define NVME_APPLE_VENDOR_REG_SIZE (0x60000)
 
+/* The NVMe registers aliased into the ANS window, doorbells included. */
+#define ANS_NVME_REG_SIZE (0x1200)
+#define ANS_NVME_MAX_IOQPAIRS ((ANS_NVME_REG_SIZE - 0x1000) / 8 - 1)
+
+/*
+ * Boot readahead. With `readahead-trace` set and no trace in it yet, the
+ * byte ranges the guest reads during the first `readahead-window` seconds
+ * after ANS starts are recorded there. Every later boot replays them as
+ * soon as ANS starts, as reads that only warm the host page cache and the
+ * image format's metadata caches, a few at a time.
+ */
+#define ANS_READAHEAD_MAX_EXTENTS (65536)
+#define ANS_READAHEAD_MAX_LEN (1 * MiB)
+#define ANS_READAHEAD_DEPTH (8)
+
+typedef struct {
+    uint32_t nsid;
+    uint64_t offset;
+    uint64_t len;
+} AppleANSExtent;
+
 typedef struct QEMU_PACKED {
     uint32_t NSID;
     uint32_t NSType;
@@ -69,6 +107,19 @@ struct AppleANSState {
     uint32_t nvme_interrupt_idx;
     uint32_t vendor_reg[NVME_APPLE_VENDOR_REG_SIZE / sizeof(uint32_t)];
     bool started;
+    uint32_t max_ioqpairs;
+    uint8_t mdts;
+    bool ioeventfd;
+    bool unmap;
+    char *vhost_user_path;
+
+    char *readahead_path;
+    uint32_t readahead_window;
+    bool readahead_started;
+    GArray *readahead; /* AppleANSExtent */
+    guint readahead_next;
+    QEMUTimer *readahead_timer;
+    Notifier readahead_exit;
 };
 
 static void ascv2_core_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -125,6 +176,32 @@ static void apple_ans_vendor_reg_write(void *opaque, hwaddr addr, uint64_t data,
     DPRINTF("ANS2: vendor reg WRITE @ 0x" HWADDR_FMT_plx
             " value: 0x" HWADDR_FMT_plx "\n",
             addr, data);
+
+    switch (addr) {
+    case NVME_APPLE_LINEAR_ASQ_DB:
+    case NVME_APPLE_LINEAR_IOSQ_DB:
+        /*
+         * The SQE already carries the PRPs that the TCB for this tag
+         * duplicates, so the command can be fetched straight away without
+         * walking the TCB.
+         */
+        if (s->vendor_reg[NVME_APPLE_LINEAR_SQ_CTRL >> 2] &
+            NVME_APPLE_LINEAR_SQ_CTRL_EN) {
+            nvme_linear_sq_submit(&s->nvme,
+                                  addr == NVME_APPLE_LINEAR_IOSQ_DB ? 1 : 0,
+                                  data & NVME_APPLE_LINEAR_DB_TAG_MASK);
+        } else {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "ANS2: linear doorbell write with linear SQ mode "
+                          "disabled\n");
+        }
+        return;
+    case NVME_APPLE_NVMMU_TCB_INVAL:
+        /* TCBs are never cached, nothing to invalidate. */
+        return;
+    default:
+        break;
+    }
     *mmio = data;
 }
 
@@ -146,6 +223,9 @@ static uint64_t apple_ans_vendor_reg_read(void *opaque, hwaddr addr,
     case NVME_APPLE_BASE_CMD_ID:
         val = 0x6000;
         break;
+    case NVME_APPLE_NVMMU_TCB_STAT:
+        val = 0;
+        break;
     default:
         break;
     }
@@ -169,6 +249,135 @@ static void apple_ans_set_irq(void *opaque, int irq_num, int level)
     qemu_set_irq(s->irq, level);
 }
 
+static void apple_ans_readahead_record(void *opaque, uint32_t nsid,
+                                       uint64_t offset, uint64_t len)
+{
+    AppleANSState *s = APPLE_ANS(opaque);
+    AppleANSExtent extent = { .nsid = nsid, .offset = offset, .len = len };
+    AppleANSExtent *last;
+
+    if (s->readahead->len != 0) {
+        last = &g_array_index(s->readahead, AppleANSExtent,
+                              s->readahead->len - 1);
+        if (last->nsid == nsid && last->offset + last->len == offset &&
+            last->len + len <= ANS_READAHEAD_MAX_LEN) {
+            last->len += len;
+            return;
+        }
+    }
+
+    if (s->readahead->len < ANS_READAHEAD_MAX_EXTENTS) {
+        g_array_append_val(s->readahead, extent);
+    }
+}
+
+static void apple_ans_readahead_save(AppleANSState *s)
+{
+    g_autoptr(GError) err = NULL;
+    g_autoptr(GString) trace = g_string_new(NULL);
+    AppleANSExtent *extent;
+
+    if (s->nvme.read_notify == NULL) {
+        return;
+    }
+    s->nvme.read_notify = NULL;
+    timer_del(s->readahead_timer);
+
+    for (guint i = 0; i < s->readahead->len; i++) {
+        extent = &g_array_index(s->readahead, AppleANSExtent, i);
+        g_string_append_printf(trace, "%u 0x%" PRIx64 " 0x%" PRIx64 "\n",
+                               extent->nsid, extent->offset, extent->len);
+    }
+
+    if (!g_file_set_contents(s->readahead_path, trace->str, trace->len,
+                             &err)) {
+        warn_report("ANS2: could not write readahead trace '%s': %s",
+                    s->readahead_path, err->message);
+    }
+}
+
+static void apple_ans_readahead_timer(void *opaque)
+{
+    apple_ans_readahead_save(APPLE_ANS(opaque));
+}
+
+static void apple_ans_readahead_exit(Notifier *notifier, void *data)
+{
+    apple_ans_readahead_save(
+        container_of(notifier, AppleANSState, readahead_exit));
+}
+
+static void coroutine_fn apple_ans_readahead_co(void *opaque)
+{
+    AppleANSState *s = APPLE_ANS(opaque);
+    void *buf = blk_blockalign(NULL, ANS_READAHEAD_MAX_LEN);
+    AppleANSExtent *extent;
+    NvmeNamespace *ns;
+
+    while (s->readahead_next < s->readahead->len) {
+        extent = &g_array_index(s->readahead, AppleANSExtent,
+                                s->readahead_next++);
+        ns = nvme_ns(&s->nvme, extent->nsid);
+        if (ns == NULL) {
+            continue;
+        }
+        blk_co_pread(ns->blkconf.blk, extent->offset, extent->len, buf, 0);
+    }
+
+    qemu_vfree(buf);
+}
+
+static bool apple_ans_readahead_load(AppleANSState *s)
+{
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    AppleANSExtent extent;
+
+    if (!g_file_get_contents(s->readahead_path, &contents, NULL, NULL)) {
+        return false;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        if (sscanf(lines[i], "%" SCNu32 " %" SCNx64 " %" SCNx64, &extent.nsid,
+                   &extent.offset, &extent.len) != 3) {
+            continue;
+        }
+        if (extent.len == 0 || extent.len > ANS_READAHEAD_MAX_LEN) {
+            continue;
+        }
+        g_array_append_val(s->readahead, extent);
+    }
+
+    return s->readahead->len != 0;
+}
+
+static void apple_ans_readahead_start(AppleANSState *s)
+{
+    if (s->readahead_path == NULL || s->readahead_started) {
+        return;
+    }
+    s->readahead_started = true;
+
+    if (apple_ans_readahead_load(s)) {
+        for (int i = 0; i < ANS_READAHEAD_DEPTH; i++) {
+            aio_co_enter(qemu_get_aio_context(),
+                         qemu_coroutine_create(apple_ans_readahead_co, s));
+        }
+        return;
+    }
+
+    s->nvme.read_notify = apple_ans_readahead_record;
+    s->nvme.read_notify_opaque = s;
+    s->readahead_timer =
+        timer_new_ms(QEMU_CLOCK_VIRTUAL, apple_ans_readahead_timer, s);
+    timer_mod(s->readahead_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  s->readahead_window * 1000LL);
+    s->readahead_exit.notify = apple_ans_readahead_exit;
+    qemu_add_exit_notifier(&s->readahead_exit);
+}
+
 static void apple_ans_start(void *opaque)
 {
     AppleANSState *s = APPLE_ANS(opaque);
@@ -179,6 +388,8 @@ static void apple_ans_start(void *opaque)
     pci_default_write_config(PCI_DEVICE(&s->nvme), PCI_COMMAND, config, 4);
     s->started = true;
     assert(PCI_DEVICE(&s->nvme)->bus_master_enable_region.enabled);
+    apple_boot_milestone("nand_ready");
+    apple_ans_readahead_start(s);
 }
 
 static void apple_ans_ep_handler(void *opaque, uint32_t ep, uint64_t msg)
@@ -246,8 +457,6 @@ SysBusDevice *apple_ans_create(DTBNode *node, AppleA7IOPVersion version,
                             &error_fatal);
     object_property_set_bool(OBJECT(&s->nvme), "is-apple-ans", true,
                              &error_fatal);
-    object_property_set_uint(OBJECT(&s->nvme), "max_ioqpairs", 7, &error_fatal);
-    object_property_set_uint(OBJECT(&s->nvme), "mdts", 8, &error_fatal);
     object_property_set_uint(OBJECT(&s->nvme), "logical_block_size", 4096,
                              &error_fatal);
     object_property_set_uint(OBJECT(&s->nvme), "physical_block_size", 4096,
@@ -265,20 +474,73 @@ SysBusDevice *apple_ans_create(DTBNode *node, AppleA7IOPVersion version,
                           s, TYPE_APPLE_ANS ".mmio", reg[7]);
     alias = g_new(MemoryRegion, 1);
     memory_region_init_alias(alias, OBJECT(dev), TYPE_APPLE_ANS ".nvme",
-                             &s->nvme.iomem, 0, 0x1200);
+                             &s->nvme.iomem, 0, ANS_NVME_REG_SIZE);
     memory_region_add_subregion_overlap(&s->iomems[3], 0, alias, 1);
     sysbus_init_mmio(sbd, &s->iomems[3]);
 
     return sbd;
 }
 
+/*
+ * Serves a namespace from an external vhost-user-blk server, such as
+ * qemu-storage-daemon or SPDK, through libblkio. NVMe commands are still
+ * decoded here, but the image and the I/O behind it are the server's, on
+ * whichever host cores it runs.
+ */
+static bool apple_ans_attach_vhost_user(AppleANSState *s, Error **errp)
+{
+    QDict *options = qdict_new();
+    BlockBackend *blk;
+    DeviceState *ns;
+
+    qdict_put_str(options, "driver", "virtio-blk-vhost-user");
+    qdict_put_str(options, "path", s->vhost_user_path);
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR | BDRV_O_NOCACHE,
+                       errp);
+    if (blk == NULL) {
+        return false;
+    }
+
+    ns = qdev_new(TYPE_NVME_NS);
+    qdev_prop_set_uint32(ns, "logical_block_size", 4096);
+    qdev_prop_set_uint32(ns, "physical_block_size", 4096);
+    if (!qdev_prop_set_drive_err(ns, "drive", blk, errp)) {
+        object_unref(OBJECT(ns));
+        blk_unref(blk);
+        return false;
+    }
+    /* The namespace holds its own reference to the node now. */
+    blk_unref(blk);
+
+    return qdev_realize_and_unref(ns, BUS(&s->nvme.bus), errp);
+}
+
 static void apple_ans_realize(DeviceState *dev, Error **errp)
 {
     AppleANSState *s = APPLE_ANS(dev);
     PCIHostState *pci = PCI_HOST_BRIDGE(dev);
 
+    if (s->max_ioqpairs < 1 || s->max_ioqpairs > ANS_NVME_MAX_IOQPAIRS) {
+        error_setg(errp, "max-ioqpairs must be between 1 and %d",
+                   ANS_NVME_MAX_IOQPAIRS);
+        return;
+    }
+    object_property_set_uint(OBJECT(&s->nvme), "max_ioqpairs", s->max_ioqpairs,
+                             &error_fatal);
+    object_property_set_uint(OBJECT(&s->nvme), "mdts", s->mdts, &error_fatal);
+    object_property_set_bool(OBJECT(&s->nvme), "ioeventfd", s->ioeventfd,
+                             &error_fatal);
+    object_property_set_bool(OBJECT(&s->nvme), "unmap", s->unmap,
+                             &error_fatal);
+
     pci_realize_and_unref(PCI_DEVICE(&s->nvme), pci->bus, &error_fatal);
 
+    if (s->vhost_user_path != NULL && !apple_ans_attach_vhost_user(s, errp)) {
+        return;
+    }
+
+    s->readahead = g_array_new(FALSE, FALSE, sizeof(AppleANSExtent));
+
     sysbus_realize(SYS_BUS_DEVICE(s->rtb), errp);
 }
 
@@ -309,6 +571,18 @@ static const VMStateDescription vmstate_apple_ans = {
         }
 };
 
+static Property apple_ans_props[] = {
+    DEFINE_PROP_UINT32("max-ioqpairs", AppleANSState, max_ioqpairs, 7),
+    DEFINE_PROP_UINT8("mdts", AppleANSState, mdts, 8),
+    DEFINE_PROP_BOOL("ioeventfd", AppleANSState, ioeventfd, false),
+    DEFINE_PROP_BOOL("unmap", AppleANSState, unmap, true),
+    DEFINE_PROP_STRING("vhost-user", AppleANSState, vhost_user_path),
+    DEFINE_PROP_STRING("readahead-trace", AppleANSState, readahead_path),
+    DEFINE_PROP_UINT32("readahead-window", AppleANSState, readahead_window,
+                       60),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_ans_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -318,6 +592,7 @@ static void apple_ans_class_init(ObjectClass *klass, void *data)
     /* dc->reset = apple_ans_reset; */
     dc->desc = "Apple ANS NVMe";
     dc->vmsd = &vmstate_apple_ans;
+    device_class_set_props(dc, apple_ans_props);
     set_bit(DEVICE_CATEGORY_BRIDGE, dc->categories);
     dc->fw_name = "pci";
 }
@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "hw/block/apple_nvme_mmu.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
 #include "qapi/error.h"
 
@@ -49,8 +50,6 @@ SysBusDevice *apple_nvme_mmu_create(DTBNode *node)
 
     object_property_set_str(OBJECT(&s->nvme), "serial", "QEMUAppleSiliconNVMe",
                             &error_fatal);
-    object_property_set_uint(OBJECT(&s->nvme), "max_ioqpairs", 7, &error_fatal);
-    object_property_set_uint(OBJECT(&s->nvme), "mdts", 8, &error_fatal);
     object_property_set_uint(OBJECT(&s->nvme), "logical_block_size", 4096,
                              &error_fatal);
     object_property_set_uint(OBJECT(&s->nvme), "physical_block_size", 4096,
@@ -81,15 +80,29 @@ static void apple_nvme_mmu_realize(DeviceState *dev, Error **errp)
     AppleNVMeMMUState *s = APPLE_NVME_MMU(dev);
     PCIHostState *pci = PCI_HOST_BRIDGE(dev);
 
+    object_property_set_uint(OBJECT(&s->nvme), "max_ioqpairs", s->max_ioqpairs,
+                             &error_fatal);
+    object_property_set_uint(OBJECT(&s->nvme), "mdts", s->mdts, &error_fatal);
+    object_property_set_bool(OBJECT(&s->nvme), "unmap", s->unmap,
+                             &error_fatal);
+
     pci_realize_and_unref(PCI_DEVICE(&s->nvme), pci->bus, &error_fatal);
 }
 
+static Property apple_nvme_mmu_props[] = {
+    DEFINE_PROP_UINT32("max-ioqpairs", AppleNVMeMMUState, max_ioqpairs, 7),
+    DEFINE_PROP_UINT8("mdts", AppleNVMeMMUState, mdts, 8),
+    DEFINE_PROP_BOOL("unmap", AppleNVMeMMUState, unmap, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_nvme_mmu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = apple_nvme_mmu_realize;
     dc->desc = "Apple NVMe MMU";
+    device_class_set_props(dc, apple_nvme_mmu_props);
     set_bit(DEVICE_CATEGORY_BRIDGE, dc->categories);
     dc->fw_name = "pci";
 }
@@ -0,0 +1,181 @@
+/*
+ * Apple Paravirtual Shared-Memory Console
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/char/apple_shmcon.h"
+#include "hw/qdev-properties-system.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+
+static AppleShmconHeader *apple_shmcon_header(AppleShmconState *s)
+{
+    return memory_region_get_ram_ptr(&s->ring);
+}
+
+static void apple_shmcon_drain(AppleShmconState *s)
+{
+    AppleShmconHeader *hdr = apple_shmcon_header(s);
+    uint8_t *data = (uint8_t *)hdr + APPLE_SHMCON_HEADER_SIZE;
+    uint32_t head;
+    uint32_t avail;
+    uint32_t off;
+    uint32_t len;
+
+    head = le32_to_cpu(qatomic_load_acquire(&hdr->head));
+    avail = head - s->tail;
+    if (avail > s->size) {
+        s->tail = head - s->size;
+        avail = s->size;
+    }
+
+    while (avail != 0) {
+        off = s->tail & (s->size - 1);
+        len = MIN(avail, s->size - off);
+        apple_console_line_push(&s->line, data + off, len);
+        /* XXX this blocks entire thread. */
+        qemu_chr_fe_write_all(&s->chr, data + off, len);
+        s->tail += len;
+        avail -= len;
+    }
+
+    qatomic_store_release(&hdr->tail, cpu_to_le32(s->tail));
+}
+
+static void apple_shmcon_poll(void *opaque)
+{
+    AppleShmconState *s = opaque;
+
+    apple_shmcon_drain(s);
+    timer_mod(s->poll_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->poll_ms);
+}
+
+static uint64_t apple_shmcon_doorbell_read(void *opaque, hwaddr addr,
+                                           unsigned size)
+{
+    return 0;
+}
+
+static void apple_shmcon_doorbell_write(void *opaque, hwaddr addr,
+                                        uint64_t data, unsigned size)
+{
+    apple_shmcon_drain(opaque);
+}
+
+static const MemoryRegionOps apple_shmcon_doorbell_ops = {
+    .read = apple_shmcon_doorbell_read,
+    .write = apple_shmcon_doorbell_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 8,
+};
+
+void apple_shmcon_set_line_notify(DeviceState *dev, AppleConsoleLineFunc *fn,
+                                  void *opaque)
+{
+    apple_console_line_set(&APPLE_SHMCON(dev)->line, fn, opaque);
+}
+
+static void apple_shmcon_reset(DeviceState *dev)
+{
+    AppleShmconState *s = APPLE_SHMCON(dev);
+    AppleShmconHeader *hdr = apple_shmcon_header(s);
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = cpu_to_le32(APPLE_SHMCON_MAGIC);
+    hdr->version = cpu_to_le32(APPLE_SHMCON_VERSION);
+    hdr->size = cpu_to_le32(s->size);
+    s->tail = 0;
+    apple_console_line_reset(&s->line);
+
+    if (s->poll_ms != 0) {
+        timer_mod(s->poll_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->poll_ms);
+    }
+}
+
+static void apple_shmcon_realize(DeviceState *dev, Error **errp)
+{
+    AppleShmconState *s = APPLE_SHMCON(dev);
+    SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
+
+    if (s->size == 0 || !is_power_of_2(s->size)) {
+        error_setg(errp, "size must be a power of two");
+        return;
+    }
+
+    if (!memory_region_init_ram(&s->ring, OBJECT(dev), "apple.shmcon.ring",
+                                APPLE_SHMCON_HEADER_SIZE + s->size, errp)) {
+        return;
+    }
+    sysbus_init_mmio(sbd, &s->ring);
+
+    memory_region_init_io(&s->doorbell, OBJECT(dev),
+                          &apple_shmcon_doorbell_ops, s,
+                          "apple.shmcon.doorbell", APPLE_SHMCON_DOORBELL_SIZE);
+    sysbus_init_mmio(sbd, &s->doorbell);
+
+    s->poll_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, apple_shmcon_poll, s);
+}
+
+static Property apple_shmcon_properties[] = {
+    DEFINE_PROP_CHR("chardev", AppleShmconState, chr),
+    DEFINE_PROP_UINT32("size", AppleShmconState, size, 256 * KiB),
+    DEFINE_PROP_UINT32("poll-ms", AppleShmconState, poll_ms, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_apple_shmcon = {
+    .name = "apple.shmcon",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(tail, AppleShmconState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static void apple_shmcon_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = apple_shmcon_realize;
+    dc->reset = apple_shmcon_reset;
+    dc->desc = "Apple Paravirtual Shared-Memory Console";
+    device_class_set_props(dc, apple_shmcon_properties);
+    dc->vmsd = &vmstate_apple_shmcon;
+}
+
+static const TypeInfo apple_shmcon_info = {
+    .name = TYPE_APPLE_SHMCON,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AppleShmconState),
+    .class_init = apple_shmcon_class_init,
+};
+
+static void apple_shmcon_register(void)
+{
+    type_register_static(&apple_shmcon_info);
+}
+
+type_init(apple_shmcon_register)
@@ -22,11 +22,14 @@
 #include "hw/sysbus.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-char.h"
+#include "qemu/base64.h"
 #include "qemu/error-report.h"
 #include "qemu/fifo8.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "qemu/units.h"
 
 #include "hw/char/apple_uart.h"
 #include "hw/irq.h"
@@ -132,6 +135,14 @@ static const AppleUartReg apple_uart_regs[] = {
 #define UERSTAT_FRAME 0x4
 #define UERSTAT_BREAK 0x8
 
+/*
+ * Guest Tx bytes are collected here and handed to the chardev in batches,
+ * rather than one blocking write per UTXH store.
+ */
+#define APPLE_UART_TX_BUF_SIZE (4 * KiB)
+/* Bytes a QMP client may have waiting for the guest to read. */
+#define APPLE_UART_INJECT_MAX (1 * MiB)
+
 typedef struct {
     uint8_t *data;
     uint32_t sp, rp; /* store and retrieve pointers */
@@ -155,6 +166,25 @@ struct AppleUartState {
     QEMUTimer *fifo_timeout_timer;
     uint64_t wordtime; /* word time in ns */
 
+    uint8_t tx_buf[APPLE_UART_TX_BUF_SIZE];
+    uint32_t tx_len;
+    uint32_t tx_batch; /* flush threshold, 0 writes each byte through */
+    QEMUTimer *tx_flush_timer;
+    guint tx_watch;
+    bool fast_console; /* don't pace anything by the baud rate */
+
+    AppleConsoleLine line;
+
+    /*
+     * Input from apple-uart-write, fed to the Rx FIFO as the guest drains
+     * it. The chardev is held off until it is all in.
+     */
+    GByteArray *inject;
+    uint32_t inject_pos;
+    /* The latest transmitted bytes, for apple-uart-read. */
+    Fifo8 capture;
+    uint32_t capture_size;
+
     CharBackend chr;
     qemu_irq irq;
     qemu_irq dmairq;
@@ -322,7 +352,10 @@ static void apple_uart_update_parameters(AppleUartState *s)
     ssp.data_bits = data_bits;
     ssp.stop_bits = stop_bits;
 
-    s->wordtime = NANOSECONDS_PER_SECOND * (data_bits + stop_bits + 1) / speed;
+    if (!s->fast_console) {
+        s->wordtime =
+            NANOSECONDS_PER_SECOND * (data_bits + stop_bits + 1) / speed;
+    }
 
     qemu_chr_fe_ioctl(&s->chr, CHR_IOCTL_SERIAL_SET_PARAMS, &ssp);
 
@@ -342,6 +375,108 @@ static void apple_uart_rx_timeout_set(AppleUartState *s)
     }
 }
 
+static void apple_uart_tx_flush(AppleUartState *s, bool block);
+
+static gboolean apple_uart_tx_watch(void *do_not_use, GIOCondition cond,
+                                    void *opaque)
+{
+    AppleUartState *s = opaque;
+
+    s->tx_watch = 0;
+    if (cond & G_IO_HUP) {
+        /* Nobody is listening anymore. */
+        s->tx_len = 0;
+    } else {
+        apple_uart_tx_flush(s, false);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Hand the buffered Tx bytes to the chardev. Without `block`, only what the
+ * backend takes right away is written, and the rest waits for it to become
+ * writable again.
+ */
+static void apple_uart_tx_flush(AppleUartState *s, bool block)
+{
+    int ret;
+
+    timer_del(s->tx_flush_timer);
+
+    if (s->tx_len == 0) {
+        return;
+    }
+
+    if (block) {
+        if (s->tx_watch) {
+            g_source_remove(s->tx_watch);
+            s->tx_watch = 0;
+        }
+        qemu_chr_fe_write_all(&s->chr, s->tx_buf, s->tx_len);
+        s->tx_len = 0;
+        return;
+    }
+
+    if (s->tx_watch) {
+        return;
+    }
+
+    ret = qemu_chr_fe_write(&s->chr, s->tx_buf, s->tx_len);
+    if (ret > 0) {
+        s->tx_len -= ret;
+        memmove(s->tx_buf, s->tx_buf + ret, s->tx_len);
+    }
+
+    if (s->tx_len) {
+        s->tx_watch = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                            apple_uart_tx_watch, s);
+        if (!s->tx_watch) {
+            apple_uart_tx_flush(s, true);
+        }
+    }
+}
+
+static void apple_uart_tx_flush_timer(void *opaque)
+{
+    apple_uart_tx_flush(opaque, false);
+}
+
+static void apple_uart_tx_push(AppleUartState *s, uint8_t ch)
+{
+    apple_console_line_push(&s->line, &ch, 1);
+
+    if (s->capture_size) {
+        if (fifo8_is_full(&s->capture)) {
+            fifo8_pop(&s->capture);
+        }
+        fifo8_push(&s->capture, ch);
+    }
+
+    if (s->tx_batch == 0) {
+        /* XXX this blocks entire thread. */
+        qemu_chr_fe_write_all(&s->chr, &ch, 1);
+        return;
+    }
+
+    /* Only full when the backend has stopped taking data, wait for it. */
+    if (s->tx_len == sizeof(s->tx_buf)) {
+        apple_uart_tx_flush(s, true);
+    }
+
+    s->tx_buf[s->tx_len++] = ch;
+
+    if (s->tx_len >= s->tx_batch) {
+        apple_uart_tx_flush(s, false);
+    } else if (!timer_pending(s->tx_flush_timer) && !s->tx_watch) {
+        /* About the time the hardware FIFO would take to drain. */
+        timer_mod(s->tx_flush_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                         s->wordtime * s->tx_fifo_size);
+    }
+}
+
+static void apple_uart_inject_fill(AppleUartState *s);
+
 static void apple_uart_write(void *opaque, hwaddr offset, uint64_t val,
                              unsigned size)
 {
@@ -369,6 +504,7 @@ static void apple_uart_write(void *opaque, hwaddr offset, uint64_t val,
             s->reg[I_(UFCON)] &= ~UFCON_Tx_FIFO_RESET;
             trace_apple_uart_tx_fifo_reset(s->channel);
         }
+        apple_uart_inject_fill(s);
         break;
 
     case UTXH:
@@ -376,9 +512,7 @@ static void apple_uart_write(void *opaque, hwaddr offset, uint64_t val,
             s->reg[I_(UTRSTAT)] &=
                 ~(UTRSTAT_Tx_EMPTY | UTRSTAT_Tx_BUFFER_EMPTY);
             ch = (uint8_t)val;
-            /* XXX this blocks entire thread. Rewrite to use
-             * qemu_chr_fe_write and background I/O callbacks */
-            qemu_chr_fe_write_all(&s->chr, &ch, 1);
+            apple_uart_tx_push(s, ch);
             trace_apple_uart_tx(s->channel, ch);
             s->reg[I_(UTRSTAT)] |= UTRSTAT_Tx_EMPTY | UTRSTAT_Tx_BUFFER_EMPTY;
             apple_uart_update_irq(s);
@@ -449,6 +583,7 @@ static uint64_t apple_uart_read(void *opaque, hwaddr offset, unsigned size)
             s->reg[I_(UTRSTAT)] &= ~UTRSTAT_Rx_BUFFER_DATA_READY;
             res = s->reg[I_(URXH)];
         }
+        apple_uart_inject_fill(s);
         qemu_chr_fe_accept_input(&s->chr);
         trace_apple_uart_read(s->channel, offset, apple_uart_regname(offset),
                               res);
@@ -478,6 +613,10 @@ static int apple_uart_can_receive(void *opaque)
 {
     AppleUartState *s = (AppleUartState *)opaque;
 
+    if (s->inject != NULL) {
+        return 0;
+    }
+
     if (s->reg[I_(UFCON)] & UFCON_FIFO_ENABLE) {
         return fifo8_num_free(&s->rx);
     } else {
@@ -485,10 +624,9 @@ static int apple_uart_can_receive(void *opaque)
     }
 }
 
-static void apple_uart_receive(void *opaque, const uint8_t *buf, int size)
+static void apple_uart_rx_push(AppleUartState *s, const uint8_t *buf,
+                               int size)
 {
-    AppleUartState *s = (AppleUartState *)opaque;
-
     if (s->reg[I_(UFCON)] & UFCON_FIFO_ENABLE) {
         if (fifo8_num_free(&s->rx) < size) {
             qemu_log_mask(LOG_GUEST_ERROR, "%s: tx overflow: %d < %d\n",
@@ -505,6 +643,129 @@ static void apple_uart_receive(void *opaque, const uint8_t *buf, int size)
     apple_uart_update_irq(s);
 }
 
+static void apple_uart_receive(void *opaque, const uint8_t *buf, int size)
+{
+    apple_uart_rx_push(APPLE_UART(opaque), buf, size);
+}
+
+/* Moves as much injected input to the Rx FIFO as it has room for. */
+static void apple_uart_inject_fill(AppleUartState *s)
+{
+    uint32_t n;
+
+    if (s->inject == NULL) {
+        return;
+    }
+
+    if (s->reg[I_(UFCON)] & UFCON_FIFO_ENABLE) {
+        n = MIN(s->inject->len - s->inject_pos, fifo8_num_free(&s->rx));
+    } else {
+        n = !(s->reg[I_(UTRSTAT)] & UTRSTAT_Rx_BUFFER_DATA_READY);
+    }
+    if (n == 0) {
+        return;
+    }
+
+    apple_uart_rx_push(s, s->inject->data + s->inject_pos, n);
+    s->inject_pos += n;
+    if (s->inject_pos == s->inject->len) {
+        g_byte_array_unref(s->inject);
+        s->inject = NULL;
+        s->inject_pos = 0;
+        qemu_chr_fe_accept_input(&s->chr);
+    }
+}
+
+static AppleUartState *apple_uart_find(const char *device, Error **errp)
+{
+    DeviceState *dev = qdev_find_recursive(sysbus_get_default(), device);
+    Object *obj = dev ? OBJECT(dev) : object_resolve_path(device, NULL);
+
+    if (obj == NULL || object_dynamic_cast(obj, TYPE_APPLE_UART) == NULL) {
+        error_setg(errp, "'%s' is not an Apple UART", device);
+        return NULL;
+    }
+    return APPLE_UART(obj);
+}
+
+void qmp_apple_uart_write(const char *device, const char *data,
+                          bool has_format, DataFormat format, Error **errp)
+{
+    AppleUartState *s = apple_uart_find(device, errp);
+    g_autofree uint8_t *decoded = NULL;
+    const uint8_t *buf;
+    size_t len;
+
+    if (s == NULL) {
+        return;
+    }
+
+    if (has_format && format == DATA_FORMAT_BASE64) {
+        decoded = qbase64_decode(data, -1, &len, errp);
+        if (decoded == NULL) {
+            return;
+        }
+        buf = decoded;
+    } else {
+        buf = (const uint8_t *)data;
+        len = strlen(data);
+    }
+
+    if (len > APPLE_UART_INJECT_MAX -
+                  (s->inject ? s->inject->len - s->inject_pos : 0)) {
+        error_setg(errp, "'%s' has too much input pending", device);
+        return;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    if (s->inject == NULL) {
+        s->inject = g_byte_array_sized_new(len);
+    } else if (s->inject_pos) {
+        /* Drop what the guest has consumed, so the buffer stays bounded. */
+        g_byte_array_remove_range(s->inject, 0, s->inject_pos);
+        s->inject_pos = 0;
+    }
+    g_byte_array_append(s->inject, buf, len);
+    apple_uart_inject_fill(s);
+}
+
+char *qmp_apple_uart_read(const char *device, int64_t size, bool has_format,
+                          DataFormat format, Error **errp)
+{
+    AppleUartState *s = apple_uart_find(device, errp);
+    g_autofree uint8_t *data = NULL;
+    const uint8_t *chunk;
+    uint32_t len = 0, n;
+
+    if (s == NULL) {
+        return NULL;
+    }
+    if (s->capture_size == 0) {
+        error_setg(errp, "'%s' has capture-size=0", device);
+        return NULL;
+    }
+    if (size < 0) {
+        error_setg(errp, "size must be greater than or equal to 0");
+        return NULL;
+    }
+
+    size = MIN(size, fifo8_num_used(&s->capture));
+    data = g_malloc(size + 1);
+    while (len < size) {
+        chunk = fifo8_pop_buf(&s->capture, size - len, &n);
+        memcpy(data + len, chunk, n);
+        len += n;
+    }
+
+    if (has_format && format == DATA_FORMAT_BASE64) {
+        return g_base64_encode(data, len);
+    }
+    data[len] = 0;
+    return g_steal_pointer(&data);
+}
+
 
 static void apple_uart_event(void *opaque, QEMUChrEvent event)
 {
@@ -531,10 +792,27 @@ static void apple_uart_reset(DeviceState *dev)
 
     fifo8_reset(&s->rx);
     fifo8_reset(&s->tx);
+    apple_uart_tx_flush(s, true);
+
+    if (s->inject != NULL) {
+        g_byte_array_unref(s->inject);
+        s->inject = NULL;
+        s->inject_pos = 0;
+    }
 
     trace_apple_uart_rxsize(s->channel, s->rx_fifo_size);
 }
 
+static int apple_uart_pre_save(void *opaque)
+{
+    AppleUartState *s = APPLE_UART(opaque);
+
+    /* Buffered output isn't migrated, get it out now. */
+    apple_uart_tx_flush(s, true);
+
+    return 0;
+}
+
 static int apple_uart_post_load(void *opaque, int version_id)
 {
     AppleUartState *s = APPLE_UART(opaque);
@@ -549,6 +827,7 @@ static const VMStateDescription vmstate_apple_uart = {
     .name = "apple.uart",
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_save = apple_uart_pre_save,
     .post_load = apple_uart_post_load,
     .fields =
         (VMStateField[]){
@@ -582,6 +861,12 @@ DeviceState *apple_uart_create(hwaddr addr, int fifo_size, int channel,
     return dev;
 }
 
+void apple_uart_set_line_notify(DeviceState *dev, AppleConsoleLineFunc *fn,
+                                void *opaque)
+{
+    apple_console_line_set(&APPLE_UART(dev)->line, fn, opaque);
+}
+
 static void apple_uart_init(Object *obj)
 {
     SysBusDevice *dev = SYS_BUS_DEVICE(obj);
@@ -612,11 +897,25 @@ static void apple_uart_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (s->tx_batch > APPLE_UART_TX_BUF_SIZE) {
+        error_setg(errp, "tx-batch must not exceed %d", APPLE_UART_TX_BUF_SIZE);
+        return;
+    }
+
+    if (s->fast_console) {
+        s->wordtime = 0;
+    }
+
     fifo8_create(&s->rx, s->rx_fifo_size);
     fifo8_create(&s->tx, s->tx_fifo_size);
+    if (s->capture_size) {
+        fifo8_create(&s->capture, s->capture_size);
+    }
 
     s->fifo_timeout_timer =
         timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_uart_timeout_int, s);
+    s->tx_flush_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_uart_tx_flush_timer, s);
 
     qemu_chr_fe_set_handlers(&s->chr, apple_uart_can_receive,
                              apple_uart_receive, apple_uart_event, NULL, s,
@@ -628,6 +927,9 @@ static Property apple_uart_properties[] = {
     DEFINE_PROP_UINT32("channel", AppleUartState, channel, 0),
     DEFINE_PROP_UINT32("rx-size", AppleUartState, rx_fifo_size, 15),
     DEFINE_PROP_UINT32("tx-size", AppleUartState, tx_fifo_size, 15),
+    DEFINE_PROP_UINT32("tx-batch", AppleUartState, tx_batch, 256),
+    DEFINE_PROP_BOOL("fast-console", AppleUartState, fast_console, false),
+    DEFINE_PROP_UINT32("capture-size", AppleUartState, capture_size, 64 * KiB),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -21,15 +21,20 @@
 #include "qemu/osdep.h"
 #include "block/aio.h"
 #include "exec/memory.h"
+#include "hw/arm/apple-silicon/stats.h"
 #include "hw/display/apple_displaypipe_v2.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "qemu/log.h"
 #include "qom/object.h"
 #include "sysemu/dma.h"
+#include "sysemu/stats.h"
 #include "ui/console.h"
 #include "ui/pixel_ops.h"
 #include "framebuffer.h"
+#ifdef CONFIG_OPENGL
+#include <epoxy/gl.h>
+#endif
 
 // #define DEBUG_DISP
 
@@ -110,123 +115,146 @@
 #define GP_STATUS_DECOMPRESSION_FAIL BIT(0)
 
 #define GP_BLOCK_BASE_FOR(i) (GP_BLOCK_BASE + i * REG_GP_REG_SIZE)
-#define GP_BLOCK_END_FOR(i) (GP_BLOCK_BASE_FOR(i) + (REG_GP_REG_SIZE - 1))
 
-static void apple_disp_gp_reg_write(GenPipeState *s, hwaddr addr, uint64_t data)
+// The register space is repeated from here on.
+#define DISP_MIRROR_BASE 0x200000
+
+/*
+ * Without a display listening on the console, GenPipe runs are acknowledged
+ * at the idle rate and not drawn. The last run is drawn once something asks
+ * for an update, either a display connecting or a QMP screendump.
+ */
+static bool apple_displaypipe_v2_throttled(AppleDisplayPipeV2State *s)
+{
+    return s->idle_rate != 0 && s->console != NULL &&
+           !qemu_console_is_visible(s->console);
+}
+
+static uint32_t apple_displaypipe_v2_rate(AppleDisplayPipeV2State *s)
+{
+    return apple_displaypipe_v2_throttled(s) ? s->idle_rate : s->refresh_rate;
+}
+
+static MemoryRegion *apple_displaypipe_v2_buffer(AppleDisplayPipeV2State *s,
+                                                 unsigned int index)
+{
+    return index == 0 ? &s->vram : &s->vram_back;
+}
+
+/*
+ * With a refresh rate set, GenPipe runs are latched and only drawn on the
+ * next VBlank, so several swaps within one frame coalesce into a single
+ * draw. The timer is only armed while a frame is pending, making an idle
+ * display free regardless of the rate.
+ */
+static void apple_displaypipe_v2_arm_vblank(AppleDisplayPipeV2State *s)
 {
-    switch (addr - GP_BLOCK_BASE_FOR(s->index)) {
-    case REG_GP_CONFIG_CONTROL: {
-        DISP_DBGLOG("[GP%zu] Control <- 0x" HWADDR_FMT_plx, s->index, data);
-        s->config_control = (uint32_t)data;
-        if (data & GP_CONFIG_CONTROL_RUN) {
+    int64_t period;
+    int64_t now;
+
+    if (timer_pending(s->vblank_timer)) {
+        return;
+    }
+
+    period = NANOSECONDS_PER_SECOND / apple_displaypipe_v2_rate(s);
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    timer_mod(s->vblank_timer, (now / period + 1) * period);
+}
+
+static void apple_disp_gp_control_write(void *opaque, hwaddr addr,
+                                        uint64_t data, unsigned size)
+{
+    GenPipeState *s = opaque;
+
+    DISP_DBGLOG("[GP%zu] Control <- 0x" HWADDR_FMT_plx, s->index, data);
+    s->config_control = (uint32_t)data;
+    if (data & GP_CONFIG_CONTROL_RUN) {
+        if (apple_displaypipe_v2_rate(s->disp_state) == 0) {
             qemu_bh_schedule(s->bh);
+        } else {
+            s->draw_pending = true;
+            apple_displaypipe_v2_arm_vblank(s->disp_state);
         }
-        break;
-    }
-    case REG_GP_PIXEL_FORMAT: {
-        DISP_DBGLOG("[GP%zu] Pixel format <- 0x" HWADDR_FMT_plx, s->index,
-                    data);
-        s->pixel_format = (uint32_t)data;
-        break;
-    }
-    case REG_GP_LAYER_0_START: {
-        DISP_DBGLOG("[GP%zu] Layer 0 start <- 0x" HWADDR_FMT_plx, s->index,
-                    data);
-        s->layers[0].start = (uint32_t)data;
-        break;
-    }
-    case REG_GP_LAYER_0_END: {
-        DISP_DBGLOG("[GP%zu] Layer 0 end <- 0x" HWADDR_FMT_plx, s->index, data);
-        s->layers[0].end = (uint32_t)data;
-        break;
-    }
-    case REG_GP_LAYER_0_STRIDE: {
-        s->layers[0].stride = (uint32_t)data;
-        DISP_DBGLOG("[GP%zu] Layer 0 stride <- 0x" HWADDR_FMT_plx, s->index,
-                    data);
-        break;
-    }
-    case REG_GP_LAYER_0_SIZE: {
-        s->layers[0].size = (uint32_t)data;
-        DISP_DBGLOG("[GP%zu] Layer 0 size <- 0x" HWADDR_FMT_plx, s->index,
-                    data);
-        break;
-    }
-    case REG_GP_FRAME_SIZE: {
-        DISP_DBGLOG("[GP%zu] Frame size <- 0x" HWADDR_FMT_plx, s->index, data);
-        s->height = data & 0xFFFF;
-        s->width = (data >> 16) & 0xFFFF;
-        break;
-    }
-    default: {
-        DISP_DBGLOG("[GP%zu] Unknown write @ 0x" HWADDR_FMT_plx
-                    " value: 0x" HWADDR_FMT_plx,
-                    s->index, addr, data);
-        break;
-    }
     }
 }
 
-static uint32_t apple_disp_gp_reg_read(GenPipeState *s, hwaddr addr)
+static uint64_t apple_disp_gp_control_read(void *opaque, hwaddr addr,
+                                           unsigned size)
 {
-    switch (addr - GP_BLOCK_BASE_FOR(s->index)) {
-    case REG_GP_CONFIG_CONTROL: {
-        DISP_DBGLOG("[GP%zu] Control -> 0x%x", s->index, s->config_control);
-        return s->config_control;
-    }
-    case REG_GP_PIXEL_FORMAT: {
-        DISP_DBGLOG("[GP%zu] Pixel format -> 0x%x", s->index, s->pixel_format);
-        return s->pixel_format;
-    }
-    case REG_GP_LAYER_0_START: {
-        DISP_DBGLOG("[GP%zu] Layer 0 start -> 0x%x", s->index,
-                    s->layers[0].start);
-        return s->layers[0].start;
-    }
-    case REG_GP_LAYER_0_END: {
-        DISP_DBGLOG("[GP%zu] Layer 0 end -> 0x%x", s->index, s->layers[0].end);
-        return s->layers[0].end;
-    }
-    case REG_GP_LAYER_0_STRIDE: {
-        DISP_DBGLOG("[GP%zu] Layer 0 stride -> 0x%x", s->index,
-                    s->layers[0].stride);
-        return s->layers[0].stride;
-    }
-    case REG_GP_LAYER_0_SIZE: {
-        DISP_DBGLOG("[GP%zu] Layer 0 size -> 0x%x", s->index,
-                    s->layers[0].size);
-        return s->layers[0].size;
-    }
-    case REG_GP_FRAME_SIZE: {
-        DISP_DBGLOG("[GP%zu] Frame size -> 0x%x (width: %d height: %d)",
-                    s->index, (s->width << 16) | s->height, s->width,
-                    s->height);
-        return (s->width << 16) | s->height;
-    }
-    default: {
-        DISP_DBGLOG("[GP%zu] Unknown read @ 0x" HWADDR_FMT_plx, s->index, addr);
-        return 0;
-    }
-    }
+    GenPipeState *s = opaque;
+
+    DISP_DBGLOG("[GP%zu] Control -> 0x%x", s->index, s->config_control);
+    return s->config_control;
 }
 
-static uint8_t *apple_disp_gp_read_layer(GenPipeState *s, size_t i,
-                                         AddressSpace *dma_as, size_t *size_out)
+static const MemoryRegionOps apple_disp_gp_control_ops = {
+    .write = apple_disp_gp_control_write,
+    .read = apple_disp_gp_control_read,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .valid.unaligned = false,
+};
+
+/*
+ * The guest rewrites the layer registers for every frame, so they are
+ * plain RAM and only read here, when a run is drawn.
+ */
+static void apple_disp_gp_latch(GenPipeState *s)
+{
+    const uint8_t *regs =
+        memory_region_get_ram_ptr(&s->disp_state->gp_regs[s->index]);
+    uint32_t frame_size;
+
+    s->pixel_format = ldl_le_p(regs + REG_GP_PIXEL_FORMAT);
+    s->layers[0].start = ldl_le_p(regs + REG_GP_LAYER_0_START);
+    s->layers[0].end = ldl_le_p(regs + REG_GP_LAYER_0_END);
+    s->layers[0].stride = ldl_le_p(regs + REG_GP_LAYER_0_STRIDE);
+    s->layers[0].size = ldl_le_p(regs + REG_GP_LAYER_0_SIZE);
+    s->layers[1].start = ldl_le_p(regs + REG_GP_LAYER_1_START);
+    s->layers[1].end = ldl_le_p(regs + REG_GP_LAYER_1_END);
+    s->layers[1].stride = ldl_le_p(regs + REG_GP_LAYER_1_STRIDE);
+    s->layers[1].size = ldl_le_p(regs + REG_GP_LAYER_1_SIZE);
+    frame_size = ldl_le_p(regs + REG_GP_FRAME_SIZE);
+    s->height = frame_size & 0xFFFF;
+    s->width = (frame_size >> 16) & 0xFFFF;
+}
+
+/*
+ * Maps the layer straight out of the DART address space when it resolves to
+ * contiguous RAM, so it can be copied into VRAM without staging. Falls back
+ * to a DMA read into a temporary buffer otherwise.
+ */
+static uint8_t *apple_disp_gp_map_layer(GenPipeState *s, size_t i,
+                                        size_t *size_out, AppleDMAMap **map)
 {
     size_t size;
     uint8_t *buf;
 
     *size_out = 0;
+    *map = NULL;
 
     if (!s->layers[i].start || !s->layers[i].end) {
         return NULL;
     }
 
     size = s->layers[i].end - s->layers[i].start;
+    *map = apple_dma_map(s->dma, s->layers[i].start, size,
+                         DMA_DIRECTION_TO_DEVICE);
+    if (*map != NULL && (*map)->iov.niov == 1) {
+        *size_out = size;
+        return (*map)->iov.iov[0].iov_base;
+    }
+    if (*map != NULL) {
+        apple_dma_unmap(s->dma, *map, 0);
+        *map = NULL;
+    }
+
     buf = g_malloc(size);
 
-    if (dma_memory_read(dma_as, s->layers[i].start, buf, size,
-                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+    if (apple_dma_read(s->dma, s->layers[i].start, buf, size) != MEMTX_OK) {
         g_free(buf);
         return NULL;
     }
@@ -235,21 +263,44 @@ static uint8_t *apple_disp_gp_read_layer(GenPipeState *s, size_t i,
     return buf;
 }
 
-static void apple_gp_draw_bh(void *opaque)
+static void apple_disp_gp_unmap_layer(AppleDMA *dma, uint8_t *buf,
+                                      AppleDMAMap *map)
+{
+    if (map != NULL) {
+        apple_dma_unmap(dma, map, 0);
+    } else {
+        g_free(buf);
+    }
+}
+
+/*
+ * Signals that the GenPipe run completed, as a drawn frame would, so the
+ * guest's swap and VBlank handling behave the same without a display.
+ */
+static void apple_gp_signal(GenPipeState *s)
+{
+    // TODO: bit 10 might be VBlank, and bit 20 that the transfer finished.
+    s->disp_state->int_filter |= BIT(10) | BIT(20);
+    // TODO: irq 0 might be VBlank, 2 be GP0, 3 be GP1.
+    qemu_irq_raise(s->disp_state->irqs[0]);
+}
+
+static bool apple_gp_draw(GenPipeState *s)
 {
-    GenPipeState *s;
     size_t size;
     uint8_t *buf;
+    AppleDMAMap *map;
 
-    s = (GenPipeState *)opaque;
+    apple_disp_gp_latch(s);
     size = 0;
-    buf = apple_disp_gp_read_layer(s, 0, s->dma_as, &size);
+    buf = apple_disp_gp_map_layer(s, 0, &size, &map);
 
     if (buf == NULL) {
-        return;
+        return false;
     }
 
-    // TODO: Blend both layers. 2nd layer is currently not used.
+    // TODO: Blend both layers. Layer 1's registers are latched, but it is
+    // not composited yet.
     uint16_t height = s->layers[0].size & 0xFFFF;
     uint16_t width = (s->layers[0].size >> 16) & 0xFFFF;
     DISP_DBGLOG("[GP%zu] Layer 0 width and height is %dx%d.", s->index, width,
@@ -267,32 +318,104 @@ static void apple_gp_draw_bh(void *opaque)
         DISP_DBGLOG("[GP%zu] Pixel Format is unknown (0x%X).", s->index,
                     s->pixel_format);
     }
-    // TODO: Decompress the data and display it properly.
-    uint16_t stride = s->pixel_format & GP_PIXEL_FORMAT_COMPRESSED ?
-                          width :
-                          s->layers[0].stride;
-    for (uint16_t y = 0; y < height; y++) {
-        uint8_t *dest = memory_region_get_ram_ptr(s->vram);
-        memcpy(dest + (y * (s->disp_state->width * sizeof(uint32_t))),
-               buf + (y * stride), width * sizeof(uint32_t));
-    }
-    memory_region_set_dirty(s->vram, 0,
-                            s->height * s->width * sizeof(uint32_t));
-    g_free(buf);
-    // TODO: bit 10 might be VBlank, and bit 20 that the transfer finished.
-    s->disp_state->int_filter |= BIT(10) | BIT(20);
-    // TODO: irq 0 might be VBlank, 2 be GP0, 3 be GP1.
-    qemu_irq_raise(s->disp_state->irqs[0]);
+    uint16_t stride = s->layers[0].stride;
+    // The front buffer holds the previous frame, so it doubles as the shadow
+    // copy: a frame without changed rows is not flipped at all, which keeps
+    // an idle screen from being rescanned and re-uploaded every frame.
+    AppleDisplayPipeV2State *ds = s->disp_state;
+    uint8_t *front = memory_region_get_ram_ptr(
+        apple_displaypipe_v2_buffer(ds, ds->front));
+    MemoryRegion *back_mr = apple_displaypipe_v2_buffer(ds, !ds->front);
+    uint8_t *back = memory_region_get_ram_ptr(back_mr);
+    size_t vram_stride = ds->width * sizeof(uint32_t);
+    size_t row_size = MIN(width, s->disp_state->width) * sizeof(uint32_t);
+    uint16_t rows = MIN(height, s->disp_state->height);
+    int first = -1;
+    int last = -1;
+    int dirty_first, dirty_last;
+    if (rows != 0 && (size_t)stride * (rows - 1) + row_size > size) {
+        rows = 0;
+    }
+    // TODO: Decompress the data and display it properly. Until the
+    // compressed layout is known, keep showing the previous frame rather
+    // than copying the compressed stream into VRAM as if it were pixels.
+    if (s->pixel_format & GP_PIXEL_FORMAT_COMPRESSED) {
+        qemu_log_mask(LOG_UNIMP,
+                      "[GP%zu] Compressed layers are not supported (0x%X).\n",
+                      s->index, s->pixel_format);
+        rows = 0;
+    }
+    for (uint16_t y = 0; y < rows; y++) {
+        if (memcmp(front + y * vram_stride, buf + y * stride, row_size) != 0) {
+            if (first < 0) {
+                first = y;
+            }
+            last = y;
+        }
+    }
+    ds->frames++;
+    if (first < 0) {
+        ds->frames_unchanged++;
+        apple_disp_gp_unmap_layer(s->dma, buf, map);
+        return true;
+    }
+
+    // The back buffer is the frame before the front one, so it only differs
+    // from it in the rows of the last flip. Catch those up from the front,
+    // then draw the rows that changed in this frame.
+    for (int y = ds->flip_first; y <= ds->flip_last; y++) {
+        memcpy(back + y * vram_stride, front + y * vram_stride, vram_stride);
+    }
+    for (int y = first; y <= last; y++) {
+        memcpy(back + y * vram_stride, buf + y * stride, row_size);
+        memcpy(back + y * vram_stride + row_size,
+               front + y * vram_stride + row_size, vram_stride - row_size);
+    }
+    apple_disp_gp_unmap_layer(s->dma, buf, map);
+
+    dirty_first = first;
+    dirty_last = last;
+    if (ds->flip_first <= ds->flip_last) {
+        dirty_first = MIN(dirty_first, ds->flip_first);
+        dirty_last = MAX(dirty_last, ds->flip_last);
+    }
+    memory_region_set_dirty(back_mr, dirty_first * vram_stride,
+                            (dirty_last - dirty_first + 1) * vram_stride);
+    ds->flip_first = first;
+    ds->flip_last = last;
+    ds->front = !ds->front;
+    return true;
 }
 
-static bool apple_genpipev2_init(GenPipeState *s, size_t index,
-                                 MemoryRegion *vram, AddressSpace *dma_as,
+static void apple_gp_draw_bh(void *opaque)
+{
+    GenPipeState *s = (GenPipeState *)opaque;
+
+    if (s->disp_state->headless) {
+        s->disp_state->frames++;
+        s->disp_state->frames_unchanged++;
+        apple_gp_signal(s);
+        return;
+    }
+
+    if (apple_displaypipe_v2_throttled(s->disp_state)) {
+        s->stale = true;
+        apple_gp_signal(s);
+        return;
+    }
+
+    s->stale = false;
+    if (apple_gp_draw(s)) {
+        apple_gp_signal(s);
+    }
+}
+
+static bool apple_genpipev2_init(GenPipeState *s, size_t index, AppleDMA *dma,
                                  AppleDisplayPipeV2State *disp_state)
 {
     memset(s, 0, sizeof(*s));
     s->index = index;
-    s->vram = vram;
-    s->dma_as = dma_as;
+    s->dma = dma;
     s->bh = qemu_bh_new(apple_gp_draw_bh, s);
     s->disp_state = disp_state;
     return true;
@@ -305,19 +428,11 @@ static void apple_disp_reg_write(void *opaque, hwaddr addr, uint64_t data,
 
     s = APPLE_DISPLAYPIPE_V2(opaque);
 
-    if (addr >= 0x200000) {
-        addr -= 0x200000;
+    if (addr >= DISP_MIRROR_BASE) {
+        addr -= DISP_MIRROR_BASE;
     }
 
     switch (addr) {
-    case GP_BLOCK_BASE_FOR(0)... GP_BLOCK_END_FOR(0):
-        apple_disp_gp_reg_write(&s->genpipes[0], addr, data);
-        break;
-
-    case GP_BLOCK_BASE_FOR(1)... GP_BLOCK_END_FOR(1):
-        apple_disp_gp_reg_write(&s->genpipes[1], addr, data);
-        break;
-
     case REG_CONTROL_INT_FILTER:
         s->int_filter &= ~(uint32_t)data;
         qemu_irq_lower(s->irqs[0]);
@@ -338,17 +453,11 @@ static uint64_t apple_disp_reg_read(void *opaque, hwaddr addr,
 
     s = APPLE_DISPLAYPIPE_V2(opaque);
 
-    if (addr >= 0x200000) {
-        addr -= 0x200000;
+    if (addr >= DISP_MIRROR_BASE) {
+        addr -= DISP_MIRROR_BASE;
     }
 
     switch (addr) {
-    case GP_BLOCK_BASE_FOR(0)... GP_BLOCK_END_FOR(0): {
-        return apple_disp_gp_reg_read(&s->genpipes[0], addr);
-    }
-    case GP_BLOCK_BASE_FOR(1)... GP_BLOCK_END_FOR(1): {
-        return apple_disp_gp_reg_read(&s->genpipes[1], addr);
-    }
     case REG_CONTROL_VERSION: {
         DISP_DBGLOG("[disp] Version -> 0x%x", CONTROL_VERSION_A0);
         return CONTROL_VERSION_A0;
@@ -412,6 +521,7 @@ AppleDisplayPipeV2State *apple_displaypipe_v2_create(MachineState *machine,
     return s;
 }
 
+#if HOST_BIG_ENDIAN
 static void apple_displaypipe_v2_draw_row(void *opaque, uint8_t *dest,
                                           const uint8_t *src, int width,
                                           int dest_pitch)
@@ -423,6 +533,73 @@ static void apple_displaypipe_v2_draw_row(void *opaque, uint8_t *dest,
         dest += sizeof(colour);
     }
 }
+#endif
+
+#if defined(CONFIG_OPENGL) && !HOST_BIG_ENDIAN
+/*
+ * With gl=on, the front buffer is mirrored into a texture that the display
+ * scans out, so scaling and presentation run on the host GPU. Only runs of
+ * dirty rows are uploaded, as sub-images, so a flip needs no full upload.
+ */
+static void apple_displaypipe_v2_gl_init(AppleDisplayPipeV2State *s)
+{
+    QEMUGLParams params = { .major_ver = 3, .minor_ver = 0 };
+    uint8_t *vram =
+        memory_region_get_ram_ptr(apple_displaypipe_v2_buffer(s, s->front));
+
+    if (s->gl_ctx == NULL) {
+        s->gl_ctx = dpy_gl_ctx_create(s->console, &params);
+    }
+    dpy_gl_ctx_make_current(s->console, s->gl_ctx);
+
+    if (s->gl_texture == 0) {
+        glGenTextures(1, &s->gl_texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, s->gl_texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, s->width);
+    // VRAM is little-endian x8r8g8b8, i.e. B, G, R, X in memory.
+    if (epoxy_is_desktop_gl()) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, s->width, s->height, 0,
+                     GL_BGRA_EXT, GL_UNSIGNED_BYTE, vram);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, s->width, s->height, 0,
+                     GL_BGRA_EXT, GL_UNSIGNED_BYTE, vram);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ONE);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    dpy_gl_scanout_texture(s->console, s->gl_texture, true, s->width,
+                           s->height, 0, 0, s->width, s->height, NULL);
+    dpy_gl_update(s->console, 0, 0, s->width, s->height);
+}
+
+static void apple_displaypipe_v2_gl_update_rows(AppleDisplayPipeV2State *s,
+                                                int y, int rows)
+{
+    uint8_t *vram =
+        memory_region_get_ram_ptr(apple_displaypipe_v2_buffer(s, s->front));
+
+    dpy_gl_ctx_make_current(s->console, s->gl_ctx);
+    glBindTexture(GL_TEXTURE_2D, s->gl_texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, s->width);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, s->width, rows, GL_BGRA_EXT,
+                    GL_UNSIGNED_BYTE, vram + y * s->width * sizeof(uint32_t));
+    dpy_gl_update(s->console, 0, y, s->width, rows);
+}
+#endif
+
+static void apple_displaypipe_v2_update_rows(AppleDisplayPipeV2State *s,
+                                             int y, int rows)
+{
+#if defined(CONFIG_OPENGL) && !HOST_BIG_ENDIAN
+    if (s->gl) {
+        apple_displaypipe_v2_gl_update_rows(s, y, rows);
+        return;
+    }
+#endif
+    dpy_gfx_update(s->console, 0, y, s->width, rows);
+}
 
 static void apple_displaypipe_v2_gfx_update(void *opaque)
 {
@@ -431,20 +608,115 @@ static void apple_displaypipe_v2_gfx_update(void *opaque)
 
     int stride = s->width * sizeof(uint32_t);
     int first = 0, last = 0;
+    MemoryRegion *front;
+    bool flipped;
 
+    for (size_t i = 0; i < ARRAY_SIZE(s->genpipes); i++) {
+        if (s->genpipes[i].stale) {
+            s->genpipes[i].stale = false;
+            apple_gp_draw(&s->genpipes[i]);
+        }
+    }
+
+    front = apple_displaypipe_v2_buffer(s, s->front);
+    flipped = s->scanout != s->front;
+    s->scanout = s->front;
+
+#if !HOST_BIG_ENDIAN
+    DirtyBitmapSnapshot *snap;
+    int y;
+
+    // VRAM is little-endian x8r8g8b8, which is the host surface format here,
+    // so the console scans out of the front buffer directly instead of a
+    // converted copy.
     if (!s->vram_section.mr) {
         framebuffer_update_memory_section(&s->vram_section, &s->vram, 0,
                                           s->height, stride);
+        g_free(memory_region_snapshot_and_clear_dirty(
+            &s->vram, 0, stride * s->height, DIRTY_MEMORY_VGA));
+        g_free(memory_region_snapshot_and_clear_dirty(
+            &s->vram_back, 0, stride * s->height, DIRTY_MEMORY_VGA));
+#ifdef CONFIG_OPENGL
+        if (s->gl) {
+            apple_displaypipe_v2_gl_init(s);
+            return;
+        }
+#endif
+        surface = qemu_create_displaysurface_from(
+            s->width, s->height, PIXMAN_x8r8g8b8, stride,
+            memory_region_get_ram_ptr(front));
+        dpy_gfx_replace_surface(s->console, surface);
+        dpy_gfx_update_full(s->console);
+        return;
+    }
+
+    // A flip only points the surface at the other buffer. The rows it
+    // changed are dirty in the new front buffer and are reported below; the
+    // retired buffer's dirty rows are stale and dropped.
+    if (flipped && !s->gl) {
+        surface = qemu_create_displaysurface_from(
+            s->width, s->height, PIXMAN_x8r8g8b8, stride,
+            memory_region_get_ram_ptr(front));
+        dpy_gfx_replace_surface(s->console, surface);
+    }
+    g_free(memory_region_snapshot_and_clear_dirty(
+        apple_displaypipe_v2_buffer(s, !s->front), 0, stride * s->height,
+        DIRTY_MEMORY_VGA));
+
+    // Report every contiguous run of dirty rows separately, so display
+    // back ends (VNC, D-Bus) only encode and export the rows that changed
+    // rather than the whole span between the first and last dirty row.
+    snap = memory_region_snapshot_and_clear_dirty(
+        front, 0, stride * s->height, DIRTY_MEMORY_VGA);
+    first = -1;
+    for (y = 0; y < s->height; y++) {
+        if (memory_region_snapshot_get_dirty(front, snap, y * stride,
+                                             stride)) {
+            if (first < 0) {
+                first = y;
+            }
+        } else if (first >= 0) {
+            apple_displaypipe_v2_update_rows(s, first, y - first);
+            first = -1;
+        }
+    }
+    last = y - 1;
+    g_free(snap);
+#else
+    if (!s->vram_section.mr || flipped) {
+        framebuffer_update_memory_section(&s->vram_section, front, 0,
+                                          s->height, stride);
     }
     framebuffer_update_display(surface, &s->vram_section, s->width, s->height,
-                               stride, stride, 0, 0,
+                               stride, stride, 0, flipped,
                                apple_displaypipe_v2_draw_row, s, &first, &last);
+#endif
     if (first >= 0) {
-        dpy_gfx_update(s->console, 0, first, s->width, last - first + 1);
+        apple_displaypipe_v2_update_rows(s, first, last - first + 1);
     }
 }
 
+static void apple_displaypipe_v2_vblank(void *opaque)
+{
+    AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(opaque);
+
+    for (size_t i = 0; i < ARRAY_SIZE(s->genpipes); i++) {
+        if (s->genpipes[i].draw_pending) {
+            s->genpipes[i].draw_pending = false;
+            apple_gp_draw_bh(&s->genpipes[i]);
+        }
+    }
+}
+
+static int apple_displaypipe_v2_get_flags(void *opaque)
+{
+    AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(opaque);
+
+    return s->gl ? GRAPHIC_FLAGS_GL : GRAPHIC_FLAGS_NONE;
+}
+
 static const GraphicHwOps apple_displaypipe_v2_ops = {
+    .get_flags = apple_displaypipe_v2_get_flags,
     .gfx_update = apple_displaypipe_v2_gfx_update,
 };
 
@@ -454,16 +726,97 @@ static void apple_displaypipe_v2_reset(DeviceState *dev)
 
     s->int_filter = 0;
     qemu_irq_lower(s->irqs[0]);
-    apple_genpipev2_init(&s->genpipes[0], 0, &s->vram, &s->dma_as, s);
-    apple_genpipev2_init(&s->genpipes[1], 1, &s->vram, &s->dma_as, s);
+    timer_del(s->vblank_timer);
+    for (size_t i = 0; i < ARRAY_SIZE(s->genpipes); i++) {
+        apple_genpipev2_init(&s->genpipes[i], i, &s->dma, s);
+        memset(memory_region_get_ram_ptr(&s->gp_regs[i]), 0, REG_GP_REG_SIZE);
+    }
+    s->front = 0;
+    s->flip_first = 0;
+    s->flip_last = s->height - 1;
+    if (s->dma_mr) {
+        apple_dma_flush(&s->dma);
+    }
+}
+
+static bool apple_disp_gp_init_regs(AppleDisplayPipeV2State *s, size_t i,
+                                    Error **errp)
+{
+    g_autofree char *regs_name = g_strdup_printf("gp%zu.regs", i);
+    g_autofree char *control_name = g_strdup_printf("gp%zu.control", i);
+    hwaddr base = GP_BLOCK_BASE_FOR(i);
+
+    if (!memory_region_init_ram(&s->gp_regs[i], OBJECT(s), regs_name,
+                                REG_GP_REG_SIZE, errp)) {
+        return false;
+    }
+    memory_region_init_io(&s->gp_control[i], OBJECT(s),
+                          &apple_disp_gp_control_ops, &s->genpipes[i],
+                          control_name, sizeof(uint32_t));
+    memory_region_add_subregion(&s->up_regs, base, &s->gp_regs[i]);
+    memory_region_add_subregion_overlap(
+        &s->up_regs, base + REG_GP_CONFIG_CONTROL, &s->gp_control[i], 1);
+
+    if (memory_region_size(&s->up_regs) < DISP_MIRROR_BASE + base +
+                                              REG_GP_REG_SIZE) {
+        return true;
+    }
+    memory_region_init_alias(&s->gp_regs_mirror[i], OBJECT(s), regs_name,
+                             &s->gp_regs[i], 0, REG_GP_REG_SIZE);
+    memory_region_init_alias(&s->gp_control_mirror[i], OBJECT(s),
+                             control_name, &s->gp_control[i], 0,
+                             sizeof(uint32_t));
+    memory_region_add_subregion(&s->up_regs, DISP_MIRROR_BASE + base,
+                                &s->gp_regs_mirror[i]);
+    memory_region_add_subregion_overlap(
+        &s->up_regs, DISP_MIRROR_BASE + base + REG_GP_CONFIG_CONTROL,
+        &s->gp_control_mirror[i], 1);
+    return true;
 }
 
 static void apple_displaypipe_v2_realize(DeviceState *dev, Error **errp)
 {
     AppleDisplayPipeV2State *s = APPLE_DISPLAYPIPE_V2(dev);
 
-    s->console = graphic_console_init(dev, 0, &apple_displaypipe_v2_ops, s);
-    qemu_console_resize(s->console, s->width, s->height);
+    // The VBlank period is a whole number of nanoseconds, at either rate.
+    if (s->refresh_rate > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "refresh-rate must be at most %" PRId64 " Hz",
+                   (int64_t)NANOSECONDS_PER_SECOND);
+        return;
+    }
+    if (s->idle_rate > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "idle-rate must be at most %" PRId64 " Hz",
+                   (int64_t)NANOSECONDS_PER_SECOND);
+        return;
+    }
+
+    s->vblank_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_displaypipe_v2_vblank, s);
+#if !defined(CONFIG_OPENGL) || HOST_BIG_ENDIAN
+    if (s->gl) {
+        error_setg(errp, "gl=on needs OpenGL support on a little-endian host");
+        return;
+    }
+#endif
+    if (!memory_region_init_ram(&s->vram_back, OBJECT(dev), "vram-back",
+                                (uint64_t)s->width * s->height *
+                                    sizeof(uint32_t),
+                                errp)) {
+        return;
+    }
+    memory_region_set_log(&s->vram_back, true, DIRTY_MEMORY_VGA);
+    for (size_t i = 0; i < ARRAY_SIZE(s->genpipes); i++) {
+        if (!apple_disp_gp_init_regs(s, i, errp)) {
+            return;
+        }
+    }
+    if (!s->headless) {
+        s->console = graphic_console_init(dev, 0, &apple_displaypipe_v2_ops, s);
+        qemu_console_resize(s->console, s->width, s->height);
+    }
+    if (s->dma_mr && !apple_dma_init(&s->dma, &s->dma_as, s->dma_mr, errp)) {
+        return;
+    }
 }
 
 static Property apple_displaypipe_v2_props[] = {
@@ -473,13 +826,97 @@ static Property apple_displaypipe_v2_props[] = {
     // iPhone 11
     // DEFINE_PROP_UINT32("width", AppleDisplayPipeV2State, width, 828),
     // DEFINE_PROP_UINT32("height", AppleDisplayPipeV2State, height, 1792),
+    DEFINE_PROP_UINT32("refresh-rate", AppleDisplayPipeV2State, refresh_rate,
+                       0),
+    DEFINE_PROP_UINT32("idle-rate", AppleDisplayPipeV2State, idle_rate, 1),
+    DEFINE_PROP_BOOL("headless", AppleDisplayPipeV2State, headless, false),
+    DEFINE_PROP_BOOL("gl", AppleDisplayPipeV2State, gl, false),
+    DEFINE_APPLE_DMA_PROPERTIES(AppleDisplayPipeV2State, dma),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+typedef enum {
+    DISP_STAT_FRAMES = 0,
+    DISP_STAT_FRAMES_UNCHANGED,
+    DISP_STAT__MAX,
+} disp_stat_t;
+
+static const char *disp_stat_name[DISP_STAT__MAX] = {
+    [DISP_STAT_FRAMES] = "frames",
+    [DISP_STAT_FRAMES_UNCHANGED] = "frames-unchanged",
+};
+
+typedef struct {
+    StatsResultList **result;
+    strList *names;
+} AppleDisplayStatsQuery;
+
+static int apple_displaypipe_v2_stats_device(Object *obj, void *opaque)
+{
+    AppleDisplayStatsQuery *q = opaque;
+    AppleDisplayPipeV2State *s;
+    StatsList *stats_list = NULL;
+    g_autofree char *path = NULL;
+    uint64_t values[DISP_STAT__MAX];
+
+    s = (AppleDisplayPipeV2State *)object_dynamic_cast(
+        obj, TYPE_APPLE_DISPLAYPIPE_V2);
+    if (!s) {
+        return 0;
+    }
+    values[DISP_STAT_FRAMES] = s->frames;
+    values[DISP_STAT_FRAMES_UNCHANGED] = s->frames_unchanged;
+
+    for (int i = 0; i < DISP_STAT__MAX; i++) {
+        if (apply_str_list_filter(disp_stat_name[i], q->names)) {
+            apple_stats_prepend(&stats_list, disp_stat_name[i], values[i]);
+        }
+    }
+    if (!stats_list) {
+        return 0;
+    }
+    path = object_get_canonical_path(obj);
+    add_stats_entry(q->result, STATS_PROVIDER_APPLE_DISPLAY, path, stats_list);
+    return 0;
+}
+
+static void apple_displaypipe_v2_stats_cb(StatsResultList **result,
+                                          StatsTarget target, strList *names,
+                                          strList *targets, Error **errp)
+{
+    AppleDisplayStatsQuery q = { .result = result, .names = names };
+
+    if (target != STATS_TARGET_DEVICE) {
+        return;
+    }
+    object_child_foreach_recursive(qdev_get_machine(),
+                                   apple_displaypipe_v2_stats_device, &q);
+}
+
+static void apple_displaypipe_v2_schemas_cb(StatsSchemaList **result,
+                                            Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = 0; i < DISP_STAT__MAX; i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(disp_stat_name[i]);
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_DISPLAY, STATS_TARGET_DEVICE,
+                     stats_list);
+}
+
 static void apple_displaypipe_v2_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    add_stats_callbacks(STATS_PROVIDER_APPLE_DISPLAY,
+                        apple_displaypipe_v2_stats_cb,
+                        apple_displaypipe_v2_schemas_cb);
+
     set_bit(DEVICE_CATEGORY_DISPLAY, dc->categories);
     device_class_set_props(dc, apple_displaypipe_v2_props);
     dc->realize = apple_displaypipe_v2_realize;
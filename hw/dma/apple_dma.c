@@ -0,0 +1,556 @@
+/*
+ * Zero-copy DMA helpers for Apple silicon devices behind a DART.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/apple-silicon/stats.h"
+#include "hw/dma/apple_dma.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/timer.h"
+#include "sysemu/stats.h"
+
+/* Unused maps kept per device, enough for a few buffers per direction. */
+#define APPLE_DMA_CACHE_SIZE (16)
+
+typedef enum {
+    APPLE_DMA_STAT_READ_BYTES = 0,
+    APPLE_DMA_STAT_WRITE_BYTES,
+    APPLE_DMA_STAT_RATE,
+    APPLE_DMA_STAT_DELAY,
+    APPLE_DMA_STAT_HEATMAP,
+    APPLE_DMA_STAT__MAX,
+} apple_dma_stat_t;
+
+static const char *apple_dma_stat_name[APPLE_DMA_STAT__MAX] = {
+    [APPLE_DMA_STAT_READ_BYTES] = "read-bytes",
+    [APPLE_DMA_STAT_WRITE_BYTES] = "write-bytes",
+    [APPLE_DMA_STAT_RATE] = "bytes-per-second",
+    [APPLE_DMA_STAT_DELAY] = "throttle-delay",
+    [APPLE_DMA_STAT_HEATMAP] = "heatmap",
+};
+
+/* Everything with accounting on, under the BQL. */
+static QLIST_HEAD(, AppleDMA) apple_dma_list =
+    QLIST_HEAD_INITIALIZER(apple_dma_list);
+
+/* a * b / c, saturating. */
+static uint64_t apple_dma_scale(uint64_t a, uint64_t b, uint64_t c)
+{
+    uint64_t lo, hi;
+
+    mulu64(&lo, &hi, a, b);
+    if (hi >= c) {
+        return UINT64_MAX;
+    }
+    divu128(&lo, &hi, c);
+    return lo;
+}
+
+/* Must be called with the mutex held. */
+static void apple_dma_account(AppleDMA *d, const ScatterGatherEntry *sg,
+                              int nsg, DMADirection dir)
+{
+    int64_t now;
+
+    if (!d->accounting) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (now - d->window_start >= NANOSECONDS_PER_SECOND) {
+        d->rate = apple_dma_scale(d->window_bytes, NANOSECONDS_PER_SECOND,
+                                  now - d->window_start);
+        d->window_start = now;
+        d->window_bytes = 0;
+    }
+
+    for (int i = 0; i < nsg; i++) {
+        dma_addr_t base = sg[i].base;
+        dma_addr_t len = sg[i].len;
+
+        d->bytes[dir] += len;
+        d->window_bytes += len;
+        while (len) {
+            uint64_t bucket = MIN(base >> APPLE_DMA_HEATMAP_SHIFT,
+                                  APPLE_DMA_HEATMAP_BUCKETS - 1);
+            dma_addr_t xlen = len;
+
+            if (bucket < APPLE_DMA_HEATMAP_BUCKETS - 1) {
+                xlen = MIN(len, ((bucket + 1) << APPLE_DMA_HEATMAP_SHIFT) -
+                                    base);
+            }
+            d->heatmap[bucket] += xlen;
+            base += xlen;
+            len -= xlen;
+        }
+    }
+}
+
+static void apple_dma_account_one(AppleDMA *d, dma_addr_t addr,
+                                  dma_addr_t len, DMADirection dir)
+{
+    ScatterGatherEntry sg = { .base = addr, .len = len };
+
+    if (d->accounting) {
+        QEMU_LOCK_GUARD(&d->mutex);
+        apple_dma_account(d, &sg, 1, dir);
+    }
+}
+
+static void apple_dma_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets, Error **errp)
+{
+    AppleDMA *d;
+
+    if (target != STATS_TARGET_IOMMU) {
+        return;
+    }
+
+    QLIST_FOREACH (d, &apple_dma_list, list) {
+        g_autofree char *path = NULL;
+        StatsList *stats_list = NULL;
+        uint64_t values[APPLE_DMA_STAT_HEATMAP];
+        g_autofree uint64_t *heatmap = NULL;
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+        WITH_QEMU_LOCK_GUARD(&d->mutex)
+        {
+            values[APPLE_DMA_STAT_READ_BYTES] =
+                d->bytes[DMA_DIRECTION_TO_DEVICE];
+            values[APPLE_DMA_STAT_WRITE_BYTES] =
+                d->bytes[DMA_DIRECTION_FROM_DEVICE];
+            /* A window that has run its course is the latest second. */
+            values[APPLE_DMA_STAT_RATE] =
+                now - d->window_start >= NANOSECONDS_PER_SECOND ?
+                    apple_dma_scale(d->window_bytes, NANOSECONDS_PER_SECOND,
+                                    now - d->window_start) :
+                    d->rate;
+            values[APPLE_DMA_STAT_DELAY] = d->delayed_ns;
+            heatmap = g_memdup2(d->heatmap, APPLE_DMA_HEATMAP_BUCKETS *
+                                                sizeof(*d->heatmap));
+        }
+
+        if (apply_str_list_filter(apple_dma_stat_name[APPLE_DMA_STAT_HEATMAP],
+                                  names)) {
+            Stats *stats = apple_stats_prepend(
+                &stats_list, apple_dma_stat_name[APPLE_DMA_STAT_HEATMAP], 0);
+
+            stats->value->type = QTYPE_QLIST;
+            stats->value->u.list = NULL;
+            for (int i = APPLE_DMA_HEATMAP_BUCKETS - 1; i >= 0; i--) {
+                QAPI_LIST_PREPEND(stats->value->u.list, heatmap[i]);
+            }
+        }
+        for (int i = APPLE_DMA_STAT_HEATMAP - 1; i >= 0; i--) {
+            if (apply_str_list_filter(apple_dma_stat_name[i], names)) {
+                apple_stats_prepend(&stats_list, apple_dma_stat_name[i],
+                                    values[i]);
+            }
+        }
+        if (!stats_list) {
+            continue;
+        }
+        path = object_get_canonical_path(OBJECT(d->mr));
+        add_stats_entry(result, STATS_PROVIDER_APPLE_DMA, path, stats_list);
+    }
+}
+
+static void apple_dma_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = APPLE_DMA_STAT__MAX - 1; i >= 0; i--) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->name = g_strdup(apple_dma_stat_name[i]);
+        value->has_unit = true;
+        value->unit = STATS_UNIT_BYTES;
+        switch (i) {
+        case APPLE_DMA_STAT_RATE:
+            value->type = STATS_TYPE_INSTANT;
+            break;
+        case APPLE_DMA_STAT_DELAY:
+            value->type = STATS_TYPE_CUMULATIVE;
+            value->unit = STATS_UNIT_SECONDS;
+            value->has_base = true;
+            value->base = 10;
+            value->exponent = -9;
+            break;
+        case APPLE_DMA_STAT_HEATMAP:
+            value->type = STATS_TYPE_LINEAR_HISTOGRAM;
+            value->has_bucket_size = true;
+            value->bucket_size = 1U << APPLE_DMA_HEATMAP_SHIFT;
+            break;
+        default:
+            value->type = STATS_TYPE_CUMULATIVE;
+            break;
+        }
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_DMA, STATS_TARGET_IOMMU,
+                     stats_list);
+}
+
+static bool apple_dma_map_hit(const AppleDMAMap *map,
+                              const IOMMUTLBEntry *iotlb)
+{
+    for (int i = 0; i < map->nsg; i++) {
+        const ScatterGatherEntry *sg = &map->sg[i];
+
+        if (sg->len && sg->base <= iotlb->iova + iotlb->addr_mask &&
+            iotlb->iova <= sg->base + sg->len - 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void apple_dma_map_free(AppleDMAMap *map)
+{
+    if (map->mrs) {
+        for (int i = 0; i < map->iov.niov; i++) {
+            memory_region_unref(map->mrs[i]);
+        }
+        g_free(map->mrs);
+    }
+    qemu_iovec_destroy(&map->iov);
+    g_free(map->sg);
+    g_free(map);
+}
+
+/* Must be called with the mutex held. */
+static void apple_dma_evict(AppleDMA *d, AppleDMAMap *map)
+{
+    g_assert(!map->in_use);
+    QTAILQ_REMOVE(&d->maps, map, next);
+    d->num_cached--;
+    apple_dma_map_free(map);
+}
+
+static void apple_dma_unmap_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
+{
+    AppleDMA *d = container_of(n, AppleDMA, notifier);
+    AppleDMAMap *map, *next_map;
+
+    QEMU_LOCK_GUARD(&d->mutex);
+    d->unmap_gen++;
+    QTAILQ_FOREACH_SAFE (map, &d->maps, next, next_map) {
+        if (!apple_dma_map_hit(map, iotlb)) {
+            continue;
+        }
+        if (map->in_use) {
+            /* Let the running transfer finish, but don't keep it. */
+            map->stale = true;
+        } else {
+            apple_dma_evict(d, map);
+        }
+    }
+}
+
+/*
+ * A region going away from the flat view is all it takes for a cached
+ * host pointer to stop being what the IOVA resolves to, e.g. when an alias
+ * is laid over RAM. Flush once per transaction.
+ */
+static void apple_dma_region_del(MemoryListener *listener,
+                                 MemoryRegionSection *section)
+{
+    AppleDMA *d = container_of(listener, AppleDMA, listener);
+
+    d->map_changed = true;
+}
+
+static void apple_dma_commit(MemoryListener *listener)
+{
+    AppleDMA *d = container_of(listener, AppleDMA, listener);
+
+    if (d->map_changed) {
+        d->map_changed = false;
+        apple_dma_flush(d);
+    }
+}
+
+bool apple_dma_init(AppleDMA *d, AddressSpace *as, MemoryRegion *mr,
+                    Error **errp)
+{
+    static bool stats_registered;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    d->as = as;
+    d->mr = mr;
+    qemu_mutex_init(&d->mutex);
+    QTAILQ_INIT(&d->maps);
+
+    d->tokens = MIN(d->burst ? d->burst : d->rate_limit, INT64_MAX);
+    d->refill_time = now;
+    if (d->accounting) {
+        d->heatmap = g_new0(uint64_t, APPLE_DMA_HEATMAP_BUCKETS);
+        d->window_start = now;
+        QLIST_INSERT_HEAD(&apple_dma_list, d, list);
+        if (!stats_registered) {
+            add_stats_callbacks(STATS_PROVIDER_APPLE_DMA, apple_dma_stats_cb,
+                                apple_dma_schemas_cb);
+            stats_registered = true;
+        }
+    }
+
+    if (memory_region_is_iommu(mr)) {
+        iommu_notifier_init(&d->notifier, apple_dma_unmap_notify,
+                            IOMMU_NOTIFIER_UNMAP, 0, HWADDR_MAX, 0);
+        if (memory_region_register_iommu_notifier(mr, &d->notifier, errp)) {
+            return false;
+        }
+    }
+
+    d->listener = (MemoryListener){
+        .name = "apple-dma",
+        .region_del = apple_dma_region_del,
+        .commit = apple_dma_commit,
+    };
+    memory_listener_register(&d->listener, memory_region_is_iommu(mr) ?
+                                               &address_space_memory :
+                                               as);
+    return true;
+}
+
+void apple_dma_destroy(AppleDMA *d)
+{
+    memory_listener_unregister(&d->listener);
+    if (memory_region_is_iommu(d->mr)) {
+        memory_region_unregister_iommu_notifier(d->mr, &d->notifier);
+    }
+    apple_dma_flush(d);
+    g_assert(QTAILQ_EMPTY(&d->maps));
+    if (d->accounting) {
+        QLIST_REMOVE(d, list);
+        g_free(d->heatmap);
+        d->heatmap = NULL;
+    }
+    qemu_mutex_destroy(&d->mutex);
+}
+
+void apple_dma_flush(AppleDMA *d)
+{
+    AppleDMAMap *map, *next_map;
+
+    QEMU_LOCK_GUARD(&d->mutex);
+    QTAILQ_FOREACH_SAFE (map, &d->maps, next, next_map) {
+        if (map->in_use) {
+            map->stale = true;
+        } else {
+            apple_dma_evict(d, map);
+        }
+    }
+}
+
+AppleDMAMap *apple_dma_map_sg(AppleDMA *d, const ScatterGatherEntry *sg,
+                              int nsg, DMADirection dir)
+{
+    AppleDMAMap *map;
+    uint64_t unmap_gen;
+
+    WITH_QEMU_LOCK_GUARD(&d->mutex)
+    {
+        QTAILQ_FOREACH (map, &d->maps, next) {
+            if (map->in_use || map->dir != dir || map->nsg != nsg ||
+                memcmp(map->sg, sg, nsg * sizeof(*sg)) != 0) {
+                continue;
+            }
+            /*
+             * The cache's references stand in for those dma_memory_map
+             * would have taken, and are dropped again by the unmap.
+             */
+            g_free(map->mrs);
+            map->mrs = NULL;
+            map->in_use = true;
+            d->num_cached--;
+            apple_dma_account(d, sg, nsg, dir);
+            return map;
+        }
+        unmap_gen = d->unmap_gen;
+    }
+
+    map = g_new0(AppleDMAMap, 1);
+    map->dir = dir;
+    map->sg = g_memdup2(sg, nsg * sizeof(*sg));
+    map->nsg = nsg;
+    map->in_use = true;
+    qemu_iovec_init(&map->iov, nsg);
+
+    /* Translating takes the DART's lock, which its notifier holds. */
+    for (int i = 0; i < nsg; i++) {
+        dma_addr_t base = sg[i].base;
+        dma_addr_t len = sg[i].len;
+
+        while (len) {
+            dma_addr_t xlen = len;
+            void *mem = dma_memory_map(d->as, base, &xlen, dir,
+                                       MEMTXATTRS_UNSPECIFIED);
+
+            if (!mem) {
+                for (int j = 0; j < map->iov.niov; j++) {
+                    dma_memory_unmap(d->as, map->iov.iov[j].iov_base,
+                                     map->iov.iov[j].iov_len, dir, 0);
+                }
+                qemu_iovec_destroy(&map->iov);
+                g_free(map->sg);
+                g_free(map);
+                return NULL;
+            }
+            xlen = MIN(xlen, len);
+            qemu_iovec_add(&map->iov, mem, xlen);
+            len -= xlen;
+            base += xlen;
+        }
+    }
+
+    WITH_QEMU_LOCK_GUARD(&d->mutex)
+    {
+        /* An unmap may have raced with the translation. */
+        map->stale = d->unmap_gen != unmap_gen;
+        QTAILQ_INSERT_HEAD(&d->maps, map, next);
+        apple_dma_account(d, sg, nsg, dir);
+    }
+    return map;
+}
+
+AppleDMAMap *apple_dma_map(AppleDMA *d, dma_addr_t addr, dma_addr_t len,
+                           DMADirection dir)
+{
+    ScatterGatherEntry sg = { .base = addr, .len = len };
+
+    return apple_dma_map_sg(d, &sg, 1, dir);
+}
+
+void apple_dma_unmap(AppleDMA *d, AppleDMAMap *map, dma_addr_t access_len)
+{
+    AppleDMAMap *victim, *prev;
+    bool cacheable = !qatomic_read(&map->stale);
+
+    /* Bounce buffers must be released, only RAM can be kept. */
+    for (int i = 0; i < map->iov.niov && cacheable; i++) {
+        ram_addr_t offset;
+
+        if (!memory_region_from_host(map->iov.iov[i].iov_base, &offset)) {
+            cacheable = false;
+        }
+    }
+
+    if (cacheable) {
+        map->mrs = g_new(MemoryRegion *, map->iov.niov);
+    }
+    for (int i = 0; i < map->iov.niov; i++) {
+        dma_addr_t len = MIN(access_len, map->iov.iov[i].iov_len);
+
+        if (cacheable) {
+            ram_addr_t offset;
+
+            /*
+             * Hold the region past the unmap, which still does the dirty
+             * tracking for what the device wrote.
+             */
+            map->mrs[i] =
+                memory_region_from_host(map->iov.iov[i].iov_base, &offset);
+            memory_region_ref(map->mrs[i]);
+        }
+        dma_memory_unmap(d->as, map->iov.iov[i].iov_base,
+                         map->iov.iov[i].iov_len, map->dir, len);
+        access_len -= len;
+    }
+
+    QEMU_LOCK_GUARD(&d->mutex);
+    QTAILQ_REMOVE(&d->maps, map, next);
+    map->in_use = false;
+    if (!cacheable || map->stale) {
+        apple_dma_map_free(map);
+        return;
+    }
+    QTAILQ_INSERT_HEAD(&d->maps, map, next);
+    d->num_cached++;
+
+    for (victim = QTAILQ_LAST(&d->maps);
+         victim && d->num_cached > APPLE_DMA_CACHE_SIZE; victim = prev) {
+        prev = QTAILQ_PREV(victim, next);
+        if (!victim->in_use) {
+            apple_dma_evict(d, victim);
+        }
+    }
+}
+
+MemTxResult apple_dma_read(AppleDMA *d, dma_addr_t addr, void *buf,
+                           dma_addr_t len)
+{
+    AppleDMAMap *map = apple_dma_map(d, addr, len, DMA_DIRECTION_TO_DEVICE);
+
+    if (!map) {
+        apple_dma_account_one(d, addr, len, DMA_DIRECTION_TO_DEVICE);
+        return dma_memory_read(d->as, addr, buf, len, MEMTXATTRS_UNSPECIFIED);
+    }
+    qemu_iovec_to_buf(&map->iov, 0, buf, len);
+    apple_dma_unmap(d, map, 0);
+    return MEMTX_OK;
+}
+
+MemTxResult apple_dma_write(AppleDMA *d, dma_addr_t addr, const void *buf,
+                            dma_addr_t len)
+{
+    AppleDMAMap *map = apple_dma_map(d, addr, len, DMA_DIRECTION_FROM_DEVICE);
+
+    if (!map) {
+        apple_dma_account_one(d, addr, len, DMA_DIRECTION_FROM_DEVICE);
+        return dma_memory_write(d->as, addr, buf, len,
+                                MEMTXATTRS_UNSPECIFIED);
+    }
+    qemu_iovec_from_buf(&map->iov, 0, buf, len);
+    apple_dma_unmap(d, map, len);
+    return MEMTX_OK;
+}
+
+int64_t apple_dma_throttle(AppleDMA *d, dma_addr_t len)
+{
+    int64_t now;
+    int64_t burst;
+    uint64_t delay;
+
+    if (!d->rate_limit) {
+        return 0;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    burst = MIN(d->burst ? d->burst : d->rate_limit, INT64_MAX);
+
+    QEMU_LOCK_GUARD(&d->mutex);
+    if (now > d->refill_time) {
+        uint64_t refill = apple_dma_scale(now - d->refill_time, d->rate_limit,
+                                          NANOSECONDS_PER_SECOND);
+
+        d->tokens = refill >= burst - d->tokens ? burst : d->tokens + refill;
+        d->refill_time = now;
+    }
+    d->tokens -= MIN(len, INT64_MAX / 2);
+    if (d->tokens >= 0) {
+        return 0;
+    }
+
+    /* Whatever is owed, earlier transfers' included, takes this long. */
+    delay = MIN(apple_dma_scale(-d->tokens, NANOSECONDS_PER_SECOND,
+                                d->rate_limit),
+                INT64_MAX);
+    d->delayed_ns += delay;
+    return delay;
+}
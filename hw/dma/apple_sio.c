@@ -1,6 +1,7 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/boot.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/dma/apple_dma.h"
 #include "hw/dma/apple_sio.h"
 #include "hw/irq.h"
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
@@ -9,6 +10,7 @@
 #include "qemu/bitops.h"
 #include "qemu/iov.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/queue.h"
 #include "sysemu/dma.h"
@@ -87,66 +89,123 @@ typedef struct QEMU_PACKED sio_msg {
     };
 } sio_msg;
 
+/* Retries on bounce buffer release before a transfer is failed. */
+#define SIO_DMA_MAP_MAX_RETRIES (16)
+
+static void apple_sio_unmap_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep);
+
+/*
+ * Map the whole sglist. If a bounce buffer can't be had, nothing stays
+ * mapped and the caller can retry from scratch.
+ */
+static bool apple_sio_map_sgl(AppleSIOState *s, AppleSIODMAEndpoint *ep)
+{
+    ep->map = apple_dma_map_sg(&s->dma, ep->sgl.sg, ep->sgl.nsg, ep->dir);
+    return ep->map != NULL;
+}
+
+static void apple_sio_map_done(AppleSIODMAEndpoint *ep)
+{
+    ep->mapped = true;
+    ep->actual_length = 0;
+    /* TODO: call handler? */
+}
+
+static void apple_sio_map_retry_bh(void *opaque)
+{
+    AppleSIODMAEndpoint *ep = opaque;
+    AppleSIOState *s = container_of(ep, AppleSIOState, eps[ep->id]);
+    sio_msg m = { 0 };
+
+    if (!ep->map_pending) {
+        return;
+    }
+    if (apple_sio_map_sgl(s, ep)) {
+        ep->map_pending = false;
+        apple_sio_map_done(ep);
+        return;
+    }
+    if (++ep->map_retries < SIO_DMA_MAP_MAX_RETRIES) {
+        cpu_register_map_client(ep->map_retry_bh);
+        return;
+    }
+
+    qemu_log_mask(LOG_GUEST_ERROR, "%s: unable to map memory for ep %u\n",
+                  __func__, ep->id);
+    ep->map_pending = false;
+    m.op = OP_ASYNC_ERROR;
+    m.ep = ep->id;
+    m.tag = ep->tag;
+    apple_sio_unmap_dma(s, ep);
+    apple_rtbuddy_send_user_msg(APPLE_RTBUDDY(s), 0, m.raw);
+}
+
 static void apple_sio_map_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep)
 {
-    if (ep->mapped) {
+    if (ep->mapped || ep->map_pending) {
         return;
     }
-    qemu_iovec_init(&ep->iov, ep->count);
-    for (int i = 0; i < ep->count; i++) {
-        dma_addr_t base = ep->sgl.sg[i].base;
-        dma_addr_t len = ep->sgl.sg[i].len;
-
-        while (len) {
-            dma_addr_t xlen = len;
-            void *mem = dma_memory_map(&s->dma_as, base, &xlen, ep->dir,
-                                       MEMTXATTRS_UNSPECIFIED);
-            if (!mem) {
-                qemu_log_mask(LOG_GUEST_ERROR, "%s: unable to map memory\n",
-                              __func__);
-                continue;
-            }
-            if (xlen > len) {
-                xlen = len;
-            }
-            qemu_iovec_add(&ep->iov, mem, xlen);
-            len -= xlen;
-            base += xlen;
+    if (!apple_sio_map_sgl(s, ep)) {
+        /* Out of bounce buffers, try again once one is released. */
+        ep->map_pending = true;
+        ep->map_retries = 0;
+        if (!ep->map_retry_bh) {
+            ep->map_retry_bh = qemu_bh_new(apple_sio_map_retry_bh, ep);
         }
+        cpu_register_map_client(ep->map_retry_bh);
+        return;
     }
+    apple_sio_map_done(ep);
+}
 
-    ep->mapped = true;
-    ep->actual_length = 0;
-    /* TODO: call handler? */
+static void apple_sio_map_cancel(AppleSIODMAEndpoint *ep)
+{
+    if (ep->map_pending) {
+        cpu_unregister_map_client(ep->map_retry_bh);
+        ep->map_pending = false;
+    }
 }
 
 static void apple_sio_unmap_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep)
 {
     ep->mapped = false;
-    int unmap_length = ep->actual_length;
-    for (int i = 0; i < ep->iov.niov; i++) {
-        int access_len = ep->iov.iov[i].iov_len;
-        if (access_len > unmap_length) {
-            access_len = unmap_length;
-        }
-
-        dma_memory_unmap(&s->dma_as, ep->iov.iov[i].iov_base,
-                         ep->iov.iov[i].iov_len, ep->dir, access_len);
-        unmap_length -= access_len;
+    if (ep->map) {
+        apple_dma_unmap(&s->dma, ep->map, ep->actual_length);
+        ep->map = NULL;
     }
-    qemu_iovec_destroy(&ep->iov);
+    g_free(ep->segments);
     ep->count = 0;
     ep->actual_length = 0;
     ep->tag = 0;
-    g_free(ep->segments);
     ep->segments = NULL;
     qemu_sglist_destroy(&ep->sgl);
 }
 
+static void apple_sio_completion_timer(void *opaque)
+{
+    AppleSIODMAEndpoint *ep = opaque;
+    AppleSIOState *s = container_of(ep, AppleSIOState, eps[ep->id]);
+
+    if (!ep->completion_pending) {
+        return;
+    }
+    ep->completion_pending = false;
+    apple_rtbuddy_send_user_msg(APPLE_RTBUDDY(s), 0, ep->completion);
+}
+
+static void apple_sio_completion_cancel(AppleSIODMAEndpoint *ep)
+{
+    if (ep->completion_pending) {
+        timer_del(ep->completion_timer);
+        ep->completion_pending = false;
+    }
+}
+
 static void apple_sio_dma_writeback(AppleSIOState *s, AppleSIODMAEndpoint *ep)
 {
     AppleRTBuddy *rtb;
     sio_msg m = { 0 };
+    int64_t delay;
 
     rtb = APPLE_RTBUDDY(s);
     m.op = OP_DMA_COMPLETE;
@@ -154,8 +213,22 @@ static void apple_sio_dma_writeback(AppleSIOState *s, AppleSIODMAEndpoint *ep)
     m.param = (1 << 7);
     m.tag = ep->tag;
     m.data = ep->actual_length;
+    delay = apple_dma_throttle(&s->dma, ep->actual_length);
     apple_sio_unmap_dma(s, ep);
-    apple_rtbuddy_send_user_msg(rtb, 0, m.raw);
+    if (delay == 0) {
+        apple_rtbuddy_send_user_msg(rtb, 0, m.raw);
+        return;
+    }
+
+    /* The data is in place already, only the guest hears of it later. */
+    if (!ep->completion_timer) {
+        ep->completion_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                            apple_sio_completion_timer, ep);
+    }
+    ep->completion = m.raw;
+    ep->completion_pending = true;
+    timer_mod(ep->completion_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay);
 }
 
 int apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
@@ -166,9 +239,9 @@ int apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
         return 0;
     }
     assert(ep->dir == DMA_DIRECTION_TO_DEVICE);
-    xlen = qemu_iovec_to_buf(&ep->iov, ep->actual_length, buffer, len);
+    xlen = qemu_iovec_to_buf(&ep->map->iov, ep->actual_length, buffer, len);
     ep->actual_length += xlen;
-    if (ep->actual_length >= ep->iov.size) {
+    if (ep->actual_length >= ep->map->iov.size) {
         apple_sio_dma_writeback(s, ep);
     }
     return xlen;
@@ -182,9 +255,9 @@ int apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
         return 0;
     }
     assert(ep->dir == DMA_DIRECTION_FROM_DEVICE);
-    xlen = qemu_iovec_from_buf(&ep->iov, ep->actual_length, buffer, len);
+    xlen = qemu_iovec_from_buf(&ep->map->iov, ep->actual_length, buffer, len);
     ep->actual_length += xlen;
-    if (ep->actual_length >= ep->iov.size) {
+    if (ep->actual_length >= ep->map->iov.size) {
         apple_sio_dma_writeback(s, ep);
     }
     return xlen;
@@ -192,7 +265,10 @@ int apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
 
 int apple_sio_dma_remaining(AppleSIODMAEndpoint *ep)
 {
-    return ep->iov.size - ep->actual_length;
+    if (!ep->mapped) {
+        return 0;
+    }
+    return ep->map->iov.size - ep->actual_length;
 }
 
 static void apple_sio_control(AppleSIOState *s, AppleSIODMAEndpoint *ep,
@@ -246,7 +322,7 @@ static void apple_sio_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
             (s->params[PARAM_DMA_SEGMENT_BASE] << 12) + m.data * 12;
         dma_addr_t seg_addr = handle_addr + 0x48;
         uint32_t segment_count = 0;
-        if (ep->mapped) {
+        if (ep->mapped || ep->map_pending || ep->completion_pending) {
             qemu_log_mask(LOG_GUEST_ERROR, "SIO: Another DMA is running\n");
             reply.op = OP_ERROR;
             break;
@@ -273,7 +349,14 @@ static void apple_sio_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
         break;
     }
     case OP_QUERY_DMA:
-        if (!ep->mapped) {
+        if (ep->completion_pending) {
+            sio_msg done = { .raw = ep->completion };
+
+            reply.op = OP_QUERY_DMA_OK;
+            reply.data = done.data;
+            break;
+        }
+        if (!ep->mapped && !ep->map_pending) {
             reply.op = OP_ERROR;
             break;
         }
@@ -281,11 +364,13 @@ static void apple_sio_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
         reply.data = ep->actual_length;
         break;
     case OP_STOP_DMA:
-        if (!ep->mapped) {
+        if (!ep->mapped && !ep->map_pending && !ep->completion_pending) {
             reply.op = OP_ERROR;
             break;
         }
         reply.op = OP_ACK;
+        apple_sio_completion_cancel(ep);
+        apple_sio_map_cancel(ep);
         apple_sio_unmap_dma(s, ep);
         break;
     default:
@@ -437,6 +522,10 @@ static void apple_sio_realize(DeviceState *dev, Error **errp)
     s->dma_mr = MEMORY_REGION(obj);
     assert(s->dma_mr);
     address_space_init(&s->dma_as, s->dma_mr, "sio.dma-as");
+    if (!apple_dma_init(&s->dma, &s->dma_as, s->dma_mr, errp)) {
+        return;
+    }
+    apple_rtbuddy_set_dma(APPLE_RTBUDDY(s), &s->dma_as);
 
     for (int i = 0; i < SIO_NUM_EPS; i++) {
         s->eps[i].id = i;
@@ -457,13 +546,22 @@ static void apple_sio_reset(DeviceState *dev)
     }
     s->params[PARAM_PROTOCOL] = 9;
     for (int i = 0; i < SIO_NUM_EPS; i++) {
-        if (s->eps[i].mapped) {
+        apple_sio_completion_cancel(&s->eps[i]);
+        if (s->eps[i].mapped || s->eps[i].map_pending) {
+            apple_sio_map_cancel(&s->eps[i]);
             apple_sio_unmap_dma(s, &s->eps[i]);
         }
         memset(&s->eps[i].config, 0, sizeof(s->eps[i].config));
     }
+    apple_dma_flush(&s->dma);
 }
 
+static Property apple_sio_props[] = {
+    DEFINE_APPLE_DMA_PROPERTIES(AppleSIOState, dma),
+    DEFINE_APPLE_DMA_LIMIT_PROPERTIES(AppleSIOState, dma),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_sio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc;
@@ -476,6 +574,7 @@ static void apple_sio_class_init(ObjectClass *klass, void *data)
                                     &sioc->parent_realize);
     device_class_set_parent_reset(dc, apple_sio_reset, &sioc->parent_reset);
     dc->desc = "Apple Smart IO DMA Controller";
+    device_class_set_props(dc, apple_sio_props);
 }
 
 static const TypeInfo apple_sio_info = {
@@ -2,6 +2,7 @@
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/gpio/apple_gpio.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
@@ -72,31 +73,86 @@
 #define CFG_FUNC1 (INPUT_ENABLE | FUNC_ALT1 | INT_MASKED)
 #define CFG_FUNC2 (INPUT_ENABLE | FUNC_ALT2 | INT_MASKED)
 
+#define GPIO_WORD(_pin) ((_pin) >> 5)
+#define GPIO_BIT(_pin) (1U << ((_pin) & 31))
+
+static void apple_gpio_update_irq(AppleGPIOState *s, int irqgrp)
+{
+    uint32_t pending = 0;
+
+    for (int i = 0; i < s->nwords; i++) {
+        pending |= s->int_cfg[irqgrp][i];
+    }
+    qemu_set_irq(s->irqs[irqgrp], pending != 0);
+}
+
+/* Latch the interrupts `mask` pins in word `word` now trigger. */
+static void apple_gpio_eval_word(AppleGPIOState *s, int word, uint32_t mask)
+{
+    uint32_t in = s->in[word];
+    uint32_t changed = in ^ s->old_in[word];
+    uint32_t hit = (s->int_lvl_hi[word] & in) |
+                   (s->int_lvl_lo[word] & ~in) |
+                   (s->int_edg_ris[word] & changed & in) |
+                   (s->int_edg_fal[word] & changed & ~in);
+
+    hit &= mask;
+    for (int i = 0; hit && i < s->nirqgrps; i++) {
+        uint32_t grp_hit = hit & s->int_en[i][word];
+
+        if (grp_hit) {
+            s->int_cfg[i][word] |= grp_hit;
+            apple_gpio_update_irq(s, i);
+        }
+    }
+}
+
 static void apple_gpio_update_pincfg(AppleGPIOState *s, int pin, uint32_t value)
 {
+    int word = GPIO_WORD(pin);
+    uint32_t bit = GPIO_BIT(pin);
+
+    for (int i = 0; i < s->nirqgrps; i++) {
+        s->int_en[i][word] &= ~bit;
+    }
+    s->int_lvl_hi[word] &= ~bit;
+    s->int_lvl_lo[word] &= ~bit;
+    s->int_edg_ris[word] &= ~bit;
+    s->int_edg_fal[word] &= ~bit;
+
     if ((value & INT_MASKED) != INT_MASKED) {
         int irqgrp = (value & INT_MASKED) >> INTR_GRP_SHIFT;
 
-        clear_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
+        s->int_en[irqgrp][word] |= bit;
+        s->int_cfg[irqgrp][word] &= ~bit;
 
         switch (value & CFG_MASK) {
         case CFG_INT_LVL_HI:
-            if (test_bit(pin, (unsigned long *)s->in)) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
+            s->int_lvl_hi[word] |= bit;
             break;
-
         case CFG_INT_LVL_LO:
-            if (!test_bit(pin, (unsigned long *)s->in)) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
+            s->int_lvl_lo[word] |= bit;
+            break;
+        case CFG_INT_EDG_RIS:
+            s->int_edg_ris[word] |= bit;
+            break;
+        case CFG_INT_EDG_FAL:
+            s->int_edg_fal[word] |= bit;
+            break;
+        case CFG_INT_EDG_ANY:
+            s->int_edg_ris[word] |= bit;
+            s->int_edg_fal[word] |= bit;
             break;
         default:
             break;
         }
-        qemu_set_irq(s->irqs[irqgrp],
-                     find_first_bit((unsigned long *)s->int_cfg[irqgrp],
-                                    s->npins) != s->npins);
+
+        /* Only levels trigger on configuration, edges wait for a change. */
+        if ((s->int_lvl_hi[word] & s->in[word] & bit) ||
+            (s->int_lvl_lo[word] & ~s->in[word] & bit)) {
+            s->int_cfg[irqgrp][word] |= bit;
+        }
+        apple_gpio_update_irq(s, irqgrp);
     }
 
     s->gpio_cfg[pin] = value;
@@ -132,71 +188,21 @@ static void apple_gpio_update_pincfg(AppleGPIOState *s, int pin, uint32_t value)
 static void apple_gpio_set(void *opaque, int pin, int level)
 {
     AppleGPIOState *s = APPLE_GPIO(opaque);
-    int grp;
-    int irqgrp = -1;
+    int word;
 
     if (pin >= s->npins) {
         return;
     }
 
-    level = level != 0;
+    word = GPIO_WORD(pin);
     if (level) {
-        set_bit(pin, (unsigned long *)s->in);
+        s->in[word] |= GPIO_BIT(pin);
     } else {
-        clear_bit(pin, (unsigned long *)s->in);
-    }
-
-    grp = pin >> 5;
-    if ((s->gpio_cfg[pin] & INT_MASKED) != INT_MASKED) {
-        irqgrp = (s->gpio_cfg[pin] & INT_MASKED) >> INTR_GRP_SHIFT;
-
-        switch (s->gpio_cfg[pin] & CFG_MASK) {
-        case CFG_GP_IN:
-        case CFG_GP_OUT:
-            break;
-
-        case CFG_INT_LVL_HI:
-            if (level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
-
-        case CFG_INT_LVL_LO:
-            if (!level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
-
-        case CFG_INT_EDG_RIS:
-            if (test_bit(pin, (unsigned long *)s->old_in) == 0 && level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
-
-        case CFG_INT_EDG_FAL:
-            if (test_bit(pin, (unsigned long *)s->old_in) && !level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
-
-        case CFG_INT_EDG_ANY:
-            if (test_bit(pin, (unsigned long *)s->old_in) != level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
-
-        default:
-            break;
-        }
+        s->in[word] &= ~GPIO_BIT(pin);
     }
 
-    s->old_in[grp] = s->in[grp];
-
-    if (irqgrp != -1) {
-        qemu_set_irq(s->irqs[irqgrp],
-                     find_first_bit((unsigned long *)s->int_cfg[irqgrp],
-                                    s->npins) != s->npins);
-    }
+    apple_gpio_eval_word(s, word, GPIO_BIT(pin));
+    s->old_in[word] = s->in[word];
 }
 
 static void apple_gpio_realize(DeviceState *dev, Error **errp)
@@ -204,43 +210,84 @@ static void apple_gpio_realize(DeviceState *dev, Error **errp)
     int i;
     AppleGPIOState *s = APPLE_GPIO(dev);
 
+    s->nwords = DIV_ROUND_UP(s->npins, 32);
     s->gpio_cfg = g_new0(uint32_t, s->npins);
     s->int_cfg = g_new0(uint32_t *, s->nirqgrps);
+    s->int_en = g_new0(uint32_t *, s->nirqgrps);
 
     for (i = 0; i < s->nirqgrps; i++) {
-        s->int_cfg[i] = g_new0(uint32_t, s->npins);
+        s->int_cfg[i] = g_new0(uint32_t, s->nwords);
+        s->int_en[i] = g_new0(uint32_t, s->nwords);
     }
 
-    s->old_in = g_new0(uint32_t, (s->npins + 63) >> 5);
-    s->in = g_new0(uint32_t, (s->npins + 63) >> 5);
+    s->int_lvl_hi = g_new0(uint32_t, s->nwords);
+    s->int_lvl_lo = g_new0(uint32_t, s->nwords);
+    s->int_edg_ris = g_new0(uint32_t, s->nwords);
+    s->int_edg_fal = g_new0(uint32_t, s->nwords);
+    s->old_in = g_new0(uint32_t, s->nwords);
+    s->in = g_new0(uint32_t, s->nwords);
 }
 
 static void apple_gpio_reset(DeviceState *dev)
 {
     int i;
+    size_t size;
     AppleGPIOState *s = APPLE_GPIO(dev);
 
     for (i = 0; i < s->npins; i++) {
         s->gpio_cfg[i] = CFG_DISABLED;
     }
 
+    size = s->nwords * sizeof(uint32_t);
     for (i = 0; i < s->nirqgrps; i++) {
-        memset(s->int_cfg[i], 0, 4 * s->npins);
+        memset(s->int_cfg[i], 0, size);
+        memset(s->int_en[i], 0, size);
     }
 
-    memset(s->old_in, 0, 4 * ((s->npins + 31) >> 5));
-    memset(s->in, 0, 4 * ((s->npins + 31) >> 5));
+    memset(s->int_lvl_hi, 0, size);
+    memset(s->int_lvl_lo, 0, size);
+    memset(s->int_edg_ris, 0, size);
+    memset(s->int_edg_fal, 0, size);
+    memset(s->old_in, 0, size);
+    memset(s->in, 0, size);
+}
+
+/* Whether `cfg` is a plain GPIO with its interrupt masked. */
+static bool apple_gpio_cfg_is_plain(uint32_t cfg)
+{
+    return (cfg & (FUNC_MASK | INT_MASKED)) == (FUNC_GPIO | INT_MASKED);
+}
+
+static int apple_gpio_cfg_level(uint32_t cfg)
+{
+    return (cfg & CFG_MASK) == CFG_GP_OUT ? cfg & DATA_1 : 1;
 }
 
 static void apple_gpio_cfg_write(AppleGPIOState *s, unsigned int pin,
                                  hwaddr addr, uint32_t value)
 {
+    uint32_t old;
+
     if (pin >= s->npins) {
         qemu_log_mask(LOG_UNIMP, "%s: Bad offset 0x" HWADDR_FMT_plx "\n",
                       __func__, addr);
         return;
     }
 
+    /*
+     * Bit-banged buses, like soft I2C, write these a few times per bit:
+     * there is no interrupt state to redo, and the line only needs to be
+     * driven when its level changes.
+     */
+    old = s->gpio_cfg[pin];
+    if (apple_gpio_cfg_is_plain(old) && apple_gpio_cfg_is_plain(value)) {
+        s->gpio_cfg[pin] = value;
+        if (apple_gpio_cfg_level(old) != apple_gpio_cfg_level(value)) {
+            qemu_set_irq(s->out[pin], apple_gpio_cfg_level(value));
+        }
+        return;
+    }
+
     apple_gpio_update_pincfg(s, pin, value);
 }
 
@@ -259,7 +306,7 @@ static uint32_t apple_gpio_cfg_read(AppleGPIOState *s, unsigned int pin,
 
     if (((val & FUNC_MASK) == FUNC_GPIO) && ((val & CFG_MASK) == CFG_GP_IN)) {
         val &= ~DATA_1;
-        val |= test_bit(pin, (unsigned long *)s->in);
+        val |= (s->in[GPIO_WORD(pin)] & GPIO_BIT(pin)) != 0;
     }
 
     return val;
@@ -276,13 +323,13 @@ static void apple_gpio_int_write(AppleGPIOState *s, unsigned int group,
         return;
     }
 
-    offset = addr - REG_GPIOINT(group, 0);
-    s->int_cfg[group][offset >> 2] &= ~value;
-
-    if (find_first_bit((unsigned long *)s->int_cfg[group], s->npins) ==
-        s->npins) {
-        qemu_irq_lower(s->irqs[group]);
+    offset = (addr - REG_GPIOINT(group, 0)) >> 2;
+    if (offset >= s->nwords) {
+        return;
     }
+    s->int_cfg[group][offset] &= ~value;
+
+    apple_gpio_update_irq(s, group);
 }
 
 static uint32_t apple_gpio_int_read(AppleGPIOState *s, unsigned int group,
@@ -296,8 +343,11 @@ static uint32_t apple_gpio_int_read(AppleGPIOState *s, unsigned int group,
         return 0;
     }
 
-    offset = addr - REG_GPIOINT(group, 0);
-    return s->int_cfg[group][offset >> 2];
+    offset = (addr - REG_GPIOINT(group, 0)) >> 2;
+    if (offset >= s->nwords) {
+        return 0;
+    }
+    return s->int_cfg[group][offset];
 }
 
 static void apple_gpio_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -413,12 +463,98 @@ DeviceState *apple_gpio_create(DTBNode *node)
     return dev;
 }
 
+static uint32_t apple_gpio_mig_words(AppleGPIOState *s)
+{
+    return s->npins + (2 * s->nirqgrps + 6) * s->nwords;
+}
+
+/* Copies the pin state to (`save`) or from `s->mig_state`. */
+static void apple_gpio_mig_pack(AppleGPIOState *s, bool save)
+{
+    uint32_t *words[] = { s->int_lvl_hi,  s->int_lvl_lo, s->int_edg_ris,
+                          s->int_edg_fal, s->in,         s->old_in };
+    uint32_t *p = s->mig_state;
+    size_t size = s->nwords * sizeof(uint32_t);
+    int i;
+
+#define MIG_COPY(_ptr, _size)              \
+    do {                                   \
+        if (save) {                        \
+            memcpy(p, (_ptr), (_size));    \
+        } else {                           \
+            memcpy((_ptr), p, (_size));    \
+        }                                  \
+        p += (_size) / sizeof(uint32_t);   \
+    } while (0)
+
+    MIG_COPY(s->gpio_cfg, s->npins * sizeof(uint32_t));
+    for (i = 0; i < s->nirqgrps; i++) {
+        MIG_COPY(s->int_cfg[i], size);
+        MIG_COPY(s->int_en[i], size);
+    }
+    for (i = 0; i < ARRAY_SIZE(words); i++) {
+        MIG_COPY(words[i], size);
+    }
+#undef MIG_COPY
+}
+
+static int apple_gpio_pre_save(void *opaque)
+{
+    AppleGPIOState *s = APPLE_GPIO(opaque);
+
+    s->mig_words = apple_gpio_mig_words(s);
+    s->mig_state = g_new(uint32_t, s->mig_words);
+    apple_gpio_mig_pack(s, true);
+    return 0;
+}
+
+static int apple_gpio_post_save(void *opaque)
+{
+    AppleGPIOState *s = APPLE_GPIO(opaque);
+
+    g_free(s->mig_state);
+    s->mig_state = NULL;
+    return 0;
+}
+
+static int apple_gpio_post_load(void *opaque, int version_id)
+{
+    AppleGPIOState *s = APPLE_GPIO(opaque);
+    int ret = 0;
+
+    if (s->mig_words == apple_gpio_mig_words(s)) {
+        apple_gpio_mig_pack(s, false);
+    } else {
+        ret = -EINVAL;
+    }
+    g_free(s->mig_state);
+    s->mig_state = NULL;
+    return ret;
+}
+
+static const VMStateDescription vmstate_apple_gpio = {
+    .name = "apple_gpio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = apple_gpio_pre_save,
+    .post_save = apple_gpio_post_save,
+    .post_load = apple_gpio_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(mig_words, AppleGPIOState),
+            VMSTATE_VARRAY_UINT32_ALLOC(mig_state, AppleGPIOState, mig_words,
+                                        0, vmstate_info_uint32, uint32_t),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_gpio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = apple_gpio_realize;
     dc->reset = apple_gpio_reset;
     dc->desc = "Apple General Purpose Input/Output Controller";
+    dc->vmsd = &vmstate_apple_gpio;
 }
 
 static const TypeInfo apple_gpio_info = {
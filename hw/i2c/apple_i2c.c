@@ -2,6 +2,7 @@
 #include "hw/i2c/apple_i2c.h"
 #include "hw/i2c/i2c.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
@@ -125,6 +126,7 @@ static void apple_i2c_reg_write(void *opaque, hwaddr addr, uint64_t data,
         uint8_t addr = kMTXFIFOData(value) >> 1;
         iflg = true;
         if ((value & kMTXFIFOStart)) {
+            s->target = addr;
             if (kMTXFIFOData(value) & 1) {
                 s->is_recv = true;
             } else {
@@ -144,7 +146,8 @@ static void apple_i2c_reg_write(void *opaque, hwaddr addr, uint64_t data,
                 uint8_t len = kMTXFIFOData(value);
                 if (!s->is_recv) {
                     s->is_recv = 1;
-                    if (i2c_start_transfer(s->bus, addr, s->is_recv) != 0) {
+                    if (i2c_start_transfer(s->bus, s->target, s->is_recv) !=
+                        0) {
                         REG(s, REG_SMSTA) |= kSMSTAmtn;
                         break;
                     }
@@ -161,7 +164,8 @@ static void apple_i2c_reg_write(void *opaque, hwaddr addr, uint64_t data,
             } else {
                 if (s->is_recv) {
                     s->is_recv = 0;
-                    if (i2c_start_transfer(s->bus, addr, s->is_recv) != 0) {
+                    if (i2c_start_transfer(s->bus, s->target, s->is_recv) !=
+                        0) {
                         REG(s, REG_SMSTA) |= kSMSTAmtn;
                         break;
                     }
@@ -179,6 +183,15 @@ static void apple_i2c_reg_write(void *opaque, hwaddr addr, uint64_t data,
                 s->xip = false;
             }
         }
+        /*
+         * Start and write stages complete immediately and there is nothing
+         * to wait for, so in burst mode only data to read, the end of the
+         * transaction or a NAK update the interrupt.
+         */
+        if (s->burst && s->xip && !(value & kMTXFIFORead) &&
+            !(REG(s, REG_SMSTA) & kSMSTAmtn)) {
+            iflg = false;
+        }
         break;
     }
     case REG_SMSTA:
@@ -255,6 +268,7 @@ static void apple_i2c_reset_enter(Object *obj, ResetType type)
     }
     memset(s->reg, 0, sizeof(s->reg));
     s->nak = s->xip = s->is_recv = 0;
+    s->target = 0;
     fifo8_reset(&s->rx_fifo);
 }
 
@@ -309,7 +323,7 @@ SysBusDevice *apple_i2c_create(const char *name)
 
 static const VMStateDescription vmstate_apple_i2c = {
     .name = "apple_i2c",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .fields =
         (VMStateField[]){
@@ -319,10 +333,16 @@ static const VMStateDescription vmstate_apple_i2c = {
             VMSTATE_BOOL(nak, AppleI2CState),
             VMSTATE_BOOL(xip, AppleI2CState),
             VMSTATE_BOOL(is_recv, AppleI2CState),
+            VMSTATE_UINT8_V(target, AppleI2CState, 2),
             VMSTATE_END_OF_LIST(),
         }
 };
 
+static Property apple_i2c_properties[] = {
+    DEFINE_PROP_BOOL("burst", AppleI2CState, burst, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_i2c_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -331,6 +351,7 @@ static void apple_i2c_class_init(ObjectClass *klass, void *data)
 
     dc->desc = "Apple I2C Controller";
     dc->vmsd = &vmstate_apple_i2c;
+    device_class_set_props(dc, apple_i2c_properties);
     resettable_class_set_parent_phases(rc, apple_i2c_reset_enter,
                                        apple_i2c_reset_hold,
                                        apple_i2c_reset_exit, &c->parent_phases);
@@ -1,7 +1,6 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/i2c/apple_soft_i2c.h"
-#include "hw/i2c/bitbang_i2c.h"
 #include "hw/i2c/i2c.h"
 #include "hw/irq.h"
 #include "migration/vmstate.h"
@@ -11,11 +10,168 @@
 #include "qemu/module.h"
 #include "qemu/timer.h"
 
+#define APPLE_SOFT_I2C_SDA (0)
+#define APPLE_SOFT_I2C_SCL (1)
+
+/* Hand the buffered bytes to the slave in one go. */
+static void apple_soft_i2c_flush(AppleSoftI2CState *s)
+{
+    for (uint32_t i = 0; i < s->len; i++) {
+        i2c_send(s->bus, s->buf[i]);
+    }
+    s->len = 0;
+}
+
+static void apple_soft_i2c_start(AppleSoftI2CState *s)
+{
+    apple_soft_i2c_flush(s);
+    s->phase = APPLE_SOFT_I2C_ADDR;
+    s->shift = 0;
+    s->bits = 0;
+    s->drive = true;
+}
+
+static void apple_soft_i2c_stop(AppleSoftI2CState *s)
+{
+    apple_soft_i2c_flush(s);
+    if (s->busy) {
+        i2c_end_transfer(s->bus);
+        s->busy = false;
+    }
+    s->phase = APPLE_SOFT_I2C_IDLE;
+    s->drive = true;
+}
+
+/* SCL rose, the master or the slave has the bit on SDA. */
+static void apple_soft_i2c_clock_rise(AppleSoftI2CState *s)
+{
+    switch (s->phase) {
+    case APPLE_SOFT_I2C_ADDR:
+        s->shift = (s->shift << 1) | s->sda;
+        if (++s->bits < 8) {
+            break;
+        }
+        s->recv = s->shift & 1;
+        s->nack = i2c_start_transfer(s->bus, s->shift >> 1, s->recv) != 0;
+        if (s->nack && s->busy) {
+            i2c_end_transfer(s->bus);
+        }
+        s->busy = !s->nack;
+        s->phase = APPLE_SOFT_I2C_ADDR_ACK;
+        s->acked = false;
+        break;
+    case APPLE_SOFT_I2C_WRITE:
+        s->shift = (s->shift << 1) | s->sda;
+        if (++s->bits < 8) {
+            break;
+        }
+        /* ACKed on the slave's behalf, it sees the bytes at the stop. */
+        s->buf[s->len++] = s->shift;
+        if (s->len == sizeof(s->buf)) {
+            apple_soft_i2c_flush(s);
+        }
+        s->nack = false;
+        s->phase = APPLE_SOFT_I2C_WRITE_ACK;
+        s->acked = false;
+        break;
+    case APPLE_SOFT_I2C_READ:
+        if (++s->bits == 8) {
+            s->phase = APPLE_SOFT_I2C_READ_ACK;
+            s->acked = false;
+        }
+        break;
+    case APPLE_SOFT_I2C_READ_ACK:
+        s->nack = s->sda;
+        /* fallthrough */
+    case APPLE_SOFT_I2C_ADDR_ACK:
+    case APPLE_SOFT_I2C_WRITE_ACK:
+        s->acked = true;
+        break;
+    default:
+        break;
+    }
+}
+
+/* SCL fell, drive SDA for the next bit. */
+static void apple_soft_i2c_clock_fall(AppleSoftI2CState *s)
+{
+    switch (s->phase) {
+    case APPLE_SOFT_I2C_ADDR_ACK:
+    case APPLE_SOFT_I2C_WRITE_ACK:
+        if (!s->acked) {
+            s->drive = s->nack;
+            break;
+        }
+        s->bits = 0;
+        s->shift = 0;
+        if (s->nack) {
+            s->phase = APPLE_SOFT_I2C_NACKED;
+            s->drive = true;
+        } else if (s->phase == APPLE_SOFT_I2C_ADDR_ACK && s->recv) {
+            s->phase = APPLE_SOFT_I2C_READ;
+            s->shift = i2c_recv(s->bus);
+            s->drive = s->shift & 0x80;
+        } else {
+            s->phase = APPLE_SOFT_I2C_WRITE;
+            s->drive = true;
+        }
+        break;
+    case APPLE_SOFT_I2C_READ:
+        s->drive = (s->shift >> (7 - s->bits)) & 1;
+        break;
+    case APPLE_SOFT_I2C_READ_ACK:
+        if (!s->acked) {
+            s->drive = true;
+        } else if (s->nack) {
+            s->phase = APPLE_SOFT_I2C_NACKED;
+            s->drive = true;
+        } else {
+            s->phase = APPLE_SOFT_I2C_READ;
+            s->bits = 0;
+            s->shift = i2c_recv(s->bus);
+            s->drive = s->shift & 0x80;
+        }
+        break;
+    default:
+        s->drive = true;
+        break;
+    }
+}
+
+/*
+ * Recognizes start, address, data and stop from the pin levels the guest
+ * bit-bangs, and returns the level of SDA, which the slave may pull low.
+ */
+static int apple_soft_i2c_set(AppleSoftI2CState *s, int line, bool level)
+{
+    if (line == APPLE_SOFT_I2C_SDA) {
+        if (level != s->sda) {
+            s->sda = level;
+            if (s->scl) {
+                if (level) {
+                    apple_soft_i2c_stop(s);
+                } else {
+                    apple_soft_i2c_start(s);
+                }
+            }
+        }
+    } else if (level != s->scl) {
+        s->scl = level;
+        if (level) {
+            apple_soft_i2c_clock_rise(s);
+        } else {
+            apple_soft_i2c_clock_fall(s);
+        }
+    }
+
+    return s->drive && s->sda;
+}
+
 static void apple_soft_i2c_gpio_set(void *opaque, int line, int level)
 {
     AppleSoftI2CState *s = APPLE_SOFT_I2C(opaque);
 
-    level = bitbang_i2c_set(&s->bitbang, line, level);
+    level = apple_soft_i2c_set(s, line, level != 0);
     if (level != s->last_level) {
         s->last_level = level;
         qemu_set_irq(s->out, level);
@@ -71,15 +227,30 @@ DeviceState *apple_soft_i2c_create(DTBNode *node)
 
     sysbus_init_irq(sbd, &s->irq);
 
-    bitbang_i2c_init(&s->bitbang, s->bus);
-
     return dev;
 }
 
+static void apple_soft_i2c_reset(DeviceState *dev)
+{
+    AppleSoftI2CState *s = APPLE_SOFT_I2C(dev);
+
+    if (s->busy) {
+        i2c_end_transfer(s->bus);
+    }
+    s->phase = APPLE_SOFT_I2C_IDLE;
+    s->scl = true;
+    s->sda = true;
+    s->drive = true;
+    s->busy = false;
+    s->len = 0;
+    s->last_level = -1;
+}
+
 static void apple_soft_i2c_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->reset = apple_soft_i2c_reset;
     dc->desc = "Apple Software I2C Controller";
 }
 
@@ -1,14 +1,20 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/core/cpu.h"
 #include "hw/intc/apple_aic.h"
 #include "hw/irq.h"
 #include "hw/pci/msi.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "sysemu/cpu-timers.h"
+#include "sysemu/cpus.h"
+#include "sysemu/tcg.h"
+#include "target/arm/cpu.h"
 #include "trace.h"
 
 /*
@@ -111,62 +117,195 @@ static inline uint64_t apple_aic_emulate_timer(void)
     return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / period_ns;
 }
 
+#define AIC_NO_TARGET (UINT32_MAX)
+
+static void apple_aic_wake_work(CPUState *cs, run_on_cpu_data data)
+{
+    /* Queuing the work is what woke the CPU, the IRQ is already pending. */
+}
+
 /*
- * Check state and interrupt cpus, call with mutex locked
+ * Raise the IRQ line of `o`. The line only ever goes to the CPU's IRQ
+ * input, so under MTTCG it is driven lock-free: the request bit is set
+ * atomically and a running target is kicked out of its TB, exactly what
+ * qemu_irq_raise() would have done, minus the BQL. A halted target is
+ * woken through its work queue instead, which is safe from any thread.
+ * May be called with the AIC mutex held.
  */
-static void apple_aic_update(AppleAICState *s)
+static void apple_aic_raise(AppleAICState *s, AppleAICCPU *o)
 {
-    uint32_t intr = 0;
-    uint32_t potential = 0;
-    int i;
+    CPUState *cs = o->cpu;
 
-    for (i = 0; i < s->numCPU; i++) {
-        s->cpus[i].pendingIPI |= s->cpus[i].deferredIPI;
-        s->cpus[i].deferredIPI = 0;
+    if (!s->lockless) {
+        qemu_irq_raise(o->irq);
+        return;
     }
 
-    for (i = 0; i < s->numCPU; i++) {
-        if ((s->cpus[i].pendingIPI & AIC_IPI_SELF) & (~s->cpus[i].ipi_mask)) {
-            intr |= (1 << i);
+    qatomic_or(&ARM_CPU(cs)->env.irq_line_state, CPU_INTERRUPT_HARD);
+    if (qatomic_fetch_or(&cs->interrupt_request, CPU_INTERRUPT_HARD) &
+        CPU_INTERRUPT_HARD) {
+        return;
+    }
+    if (qemu_cpu_is_self(cs)) {
+        qatomic_set(&cs->neg.icount_decr.u16.high, -1);
+        return;
+    }
+    /* Pairs with the barrier WFI puts between halting and sleeping. */
+    smp_mb__after_rmw();
+    if (qatomic_read(&cs->halted)) {
+        async_run_on_cpu(cs, apple_aic_wake_work, RUN_ON_CPU_NULL);
+    } else {
+        cpu_exit(cs);
+    }
+}
+
+/* Lower the IRQ line of `o`, which is only done by `o` itself on IACK. */
+static void apple_aic_lower(AppleAICState *s, AppleAICCPU *o)
+{
+    if (!s->lockless) {
+        qemu_irq_lower(o->irq);
+        return;
+    }
+
+    qatomic_and(&ARM_CPU(o->cpu)->env.irq_line_state, ~CPU_INTERRUPT_HARD);
+    qatomic_and(&o->cpu->interrupt_request, ~CPU_INTERRUPT_HARD);
+}
+
+/*
+ * Pick the CPU of `dest` to deliver a newly pending IRQ to. CPUs that are
+ * running come first, so that a multi-destination IRQ does not pull a core
+ * out of WFI while another one could take it right away; the choice then
+ * rotates, so the load spreads over the candidates. An IRQ stays where it
+ * is for as long as that CPU remains a destination.
+ *
+ * With "fixed-steering" set the choice is always the lowest CPU of `dest`,
+ * which depends neither on the vCPUs' timing nor on the history.
+ */
+static uint32_t apple_aic_steer(AppleAICState *s, uint32_t dest, uint32_t old)
+{
+    uint32_t awake = 0;
+    uint32_t after;
+    uint32_t new;
+
+    dest &= (1 << s->numCPU) - 1;
+    if (old != AIC_NO_TARGET && (dest & (1 << old))) {
+        return old;
+    }
+    if (!dest) {
+        return AIC_NO_TARGET;
+    }
+    if (s->fixed_steering) {
+        return ctz32(dest);
+    }
+    if (dest & (dest - 1)) {
+        for (uint32_t bits = dest; bits; bits &= bits - 1) {
+            CPUState *cs = s->cpus[ctz32(bits)].cpu;
+
+            if (cs && !qatomic_read(&cs->halted)) {
+                awake |= bits & -bits;
+            }
         }
-        if ((~s->cpus[i].ipi_mask & AIC_IPI_NORMAL) &&
-            (s->cpus[i].pendingIPI & ((1 << s->numCPU) - 1))) {
-            intr |= (1 << i);
+        if (awake) {
+            dest = awake;
         }
     }
+    after = dest & ~MAKE_64BIT_MASK(0, s->steer_last + 1);
+    new = ctz32(after ? after : dest);
+    s->steer_last = new;
+    return new;
+}
 
-    i = -1;
-    while ((i = find_next_bit((unsigned long *)s->eir_state, s->numIRQ,
-                              i + 1)) < s->numIRQ) {
-        int dest;
-        if ((test_bit(i, (unsigned long *)s->eir_mask) == 0) &&
-            (dest = s->eir_dest[i])) {
-            if (((intr & dest) == 0)) {
-                /* The interrupt doesn't have a cpu that can process it yet */
-                uint32_t cpu =
-                    find_first_bit((unsigned long *)&s->eir_dest[i], s->numCPU);
-                intr |= (1 << cpu);
-                potential |= dest;
-            } else {
-                int k;
-                for (k = 0; k < s->numCPU; k++) {
-                    if (((intr & (1 << k)) == 0) && (potential & (1 << k))) {
-                        /*
-                         * cpu K isn't in the interrupt list
-                         * and can handle some of the previous interrupts
-                         */
-                        intr |= (1 << k);
-                        break;
-                    }
-                }
-            }
+/*
+ * Recompute which CPU an external IRQ is pending on. An IRQ that is
+ * asserted and unmasked is accounted to one CPU of its destination set,
+ * so deciding whom to interrupt never has to walk the IRQ bitmaps.
+ * Call with mutex locked.
+ */
+static void apple_aic_refresh_irq(AppleAICState *s, uint32_t irq)
+{
+    uint32_t old = s->eir_target[irq];
+    uint32_t new = AIC_NO_TARGET;
+
+    if (test_bit(irq, (unsigned long *)s->eir_state) &&
+        !test_bit(irq, (unsigned long *)s->eir_mask)) {
+        set_bit(irq, (unsigned long *)s->eir_active);
+        new = apple_aic_steer(s, s->eir_dest[irq], old);
+    } else {
+        clear_bit(irq, (unsigned long *)s->eir_active);
+    }
+
+    if (old == new) {
+        return;
+    }
+    if (old != AIC_NO_TARGET) {
+        clear_bit(irq, (unsigned long *)s->cpus[old].eir_pending);
+        if (--s->cpus[old].num_pending == 0) {
+            qatomic_and(&s->pending_cpus, ~(1 << old));
+        }
+    }
+    if (new != AIC_NO_TARGET) {
+        set_bit(irq, (unsigned long *)s->cpus[new].eir_pending);
+        if (s->cpus[new].num_pending++ == 0) {
+            qatomic_or(&s->pending_cpus, 1 << new);
         }
     }
+    s->eir_target[irq] = new;
+}
+
+/* Refresh the IRQs selected by `bits` in EIR word `eir`. */
+static void apple_aic_refresh_eir(AppleAICState *s, uint32_t eir,
+                                  uint32_t bits)
+{
+    while (bits) {
+        int i = ctz32(bits);
+
+        apple_aic_refresh_irq(s, AIC_EIR_TO_SRC(eir, i));
+        bits &= bits - 1;
+    }
+}
+
+static void apple_aic_rebuild(AppleAICState *s)
+{
+    qatomic_set(&s->pending_cpus, 0);
+    memset(s->eir_active, 0, sizeof(uint32_t) * s->numEIR);
+    memset(s->eir_target, 0xff, sizeof(uint32_t) * s->numIRQ);
+    for (int i = 0; i < s->numCPU; i++) {
+        memset(s->cpus[i].eir_pending, 0, sizeof(uint32_t) * s->numEIR);
+        s->cpus[i].num_pending = 0;
+    }
+    for (uint32_t i = 0; i < s->numIRQ; i++) {
+        apple_aic_refresh_irq(s, i);
+    }
+}
+
+/*
+ * Check state and interrupt cpus, call with mutex locked.
+ * This runs whenever something that can make an interrupt deliverable
+ * changes, so there is no periodic polling of the state.
+ */
+static void apple_aic_update(AppleAICState *s)
+{
+    uint32_t intr = qatomic_read(&s->pending_cpus);
+    int i;
+
     for (i = 0; i < s->numCPU; i++) {
-        if (intr & (1 << i)) {
-            qemu_irq_raise(s->cpus[i].irq);
+        uint32_t pending = qatomic_read(&s->cpus[i].pendingIPI);
+        uint32_t mask = qatomic_read(&s->cpus[i].ipi_mask);
+
+        if ((pending & AIC_IPI_SELF) & (~mask)) {
+            intr |= (1 << i);
+        }
+        if ((~mask & AIC_IPI_NORMAL) &&
+            (pending & ((1 << s->numCPU) - 1))) {
+            intr |= (1 << i);
         }
     }
+
+    while (intr) {
+        i = ctz32(intr);
+        apple_aic_raise(s, &s->cpus[i]);
+        intr &= intr - 1;
+    }
 }
 
 static void apple_aic_set_irq(void *opaque, int irq, int level)
@@ -177,23 +316,41 @@ static void apple_aic_set_irq(void *opaque, int irq, int level)
     {
         trace_aic_set_irq(irq, level);
         if (level) {
-            set_bit(irq, (unsigned long *)s->eir_state);
-        } else {
-            clear_bit(irq, (unsigned long *)s->eir_state);
+            if (!test_and_set_bit(irq, (unsigned long *)s->eir_state)) {
+                apple_aic_refresh_irq(s, irq);
+                apple_aic_update(s);
+            }
+        } else if (test_and_clear_bit(irq, (unsigned long *)s->eir_state)) {
+            apple_aic_refresh_irq(s, irq);
         }
     }
 }
 
+/*
+ * Deferred IPIs are held back for the deferral wait time, so the timer
+ * only runs while at least one of them is outstanding. Arming never
+ * pushes out an earlier deadline, so no lock is needed.
+ */
+static void apple_aic_defer_ipi(AppleAICState *s)
+{
+    apple_deadline_mod_anticipate(&s->tick,
+                                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                      kAICWT);
+}
+
 static void apple_aic_tick(void *opaque)
 {
     AppleAICState *s = APPLE_AIC(opaque);
 
+    trace_aic_tick();
     WITH_QEMU_LOCK_GUARD(&s->mutex)
     {
+        for (int i = 0; i < s->numCPU; i++) {
+            qatomic_or(&s->cpus[i].pendingIPI,
+                       qatomic_xchg(&s->cpus[i].deferredIPI, 0));
+        }
         apple_aic_update(s);
     }
-
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
 }
 
 static void apple_aic_reset(DeviceState *dev)
@@ -217,102 +374,131 @@ static void apple_aic_reset(DeviceState *dev)
         s->cpus[i].pendingIPI = 0;
         s->cpus[i].deferredIPI = 0;
     }
+    apple_aic_rebuild(s);
+
+    apple_deadline_del(&s->tick);
 }
 
-static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
-                            unsigned size)
+/*
+ * Re-raise CPU `o` if it has anything deliverable. Only needs the
+ * per-CPU IPI state and the pending_cpus summary, so it can run without
+ * the AIC mutex.
+ */
+static void apple_aic_update_cpu(AppleAICState *s, AppleAICCPU *o)
 {
-    AppleAICCPU *o = (AppleAICCPU *)opaque;
-    AppleAICState *s = APPLE_AIC(o->aic);
-    uint32_t val = (uint32_t)data;
-
-    WITH_QEMU_LOCK_GUARD(&s->mutex)
-    {
-        switch (addr) {
-        case REG_AIC_RST:
-            apple_aic_reset(DEVICE(s));
-            break;
+    uint32_t pending = qatomic_read(&o->pendingIPI);
+    uint32_t mask = qatomic_read(&o->ipi_mask);
 
-        case REG_AIC_GLB_CFG:
-            s->global_cfg = data;
-            break;
-
-        case REG_AIC_IPI_SET: {
-            int i;
+    if ((pending & AIC_IPI_SELF & ~mask) ||
+        ((~mask & AIC_IPI_NORMAL) && (pending & ((1 << s->numCPU) - 1))) ||
+        (qatomic_read(&s->pending_cpus) & (1 << o->cpu_id))) {
+        apple_aic_raise(s, o);
+    }
+}
 
-            for (i = 0; i < s->numCPU; i++) {
-                if (val & (1 << i)) {
-                    set_bit(o->cpu_id, (unsigned long *)&s->cpus[i].pendingIPI);
-                    if (~s->cpus[i].ipi_mask & AIC_IPI_NORMAL) {
-                        qemu_irq_raise(s->cpus[i].irq);
-                    }
-                }
-            }
+/*
+ * IPI registers only touch per-CPU state, which is updated atomically,
+ * so IPI traffic between different cores does not serialize on the AIC
+ * mutex, nor on the BQL once the registers are lock-free.
+ * Returns false if `addr` is not an IPI register.
+ */
+static bool apple_aic_write_ipi(AppleAICState *s, AppleAICCPU *o,
+                                hwaddr addr, uint32_t val)
+{
+    int i;
 
-            if (val & AIC_IPI_SELF) {
-                o->pendingIPI |= AIC_IPI_SELF;
-                if (~o->ipi_mask & AIC_IPI_SELF) {
-                    qemu_irq_raise(o->irq);
+    switch (addr) {
+    case REG_AIC_IPI_SET:
+        for (i = 0; i < s->numCPU; i++) {
+            if (val & (1 << i)) {
+                qatomic_or(&s->cpus[i].pendingIPI, 1 << o->cpu_id);
+                if (~qatomic_read(&s->cpus[i].ipi_mask) & AIC_IPI_NORMAL) {
+                    apple_aic_raise(s, &s->cpus[i]);
                 }
             }
-            break;
         }
 
-        case REG_AIC_IPI_CLR: {
-            int i;
-
-            for (i = 0; i < s->numCPU; i++) {
-                if (val & (1 << i)) {
-                    clear_bit(o->cpu_id,
-                              (unsigned long *)&s->cpus[i].pendingIPI);
-                }
+        if (val & AIC_IPI_SELF) {
+            qatomic_or(&o->pendingIPI, AIC_IPI_SELF);
+            if (~qatomic_read(&o->ipi_mask) & AIC_IPI_SELF) {
+                apple_aic_raise(s, o);
             }
+        }
+        break;
 
-            if (val & AIC_IPI_SELF) {
-                o->pendingIPI &= ~AIC_IPI_SELF;
+    case REG_AIC_IPI_CLR:
+        for (i = 0; i < s->numCPU; i++) {
+            if (val & (1 << i)) {
+                qatomic_and(&s->cpus[i].pendingIPI, ~(1 << o->cpu_id));
             }
-            break;
         }
 
-        case REG_AIC_IPI_MASK_SET:
-            o->ipi_mask |= (val & (AIC_IPI_NORMAL | AIC_IPI_SELF));
-            break;
+        if (val & AIC_IPI_SELF) {
+            qatomic_and(&o->pendingIPI, ~AIC_IPI_SELF);
+        }
+        break;
 
-        case REG_AIC_IPI_MASK_CLR:
-            o->ipi_mask &= ~(val & (AIC_IPI_NORMAL | AIC_IPI_SELF));
-            break;
+    case REG_AIC_IPI_MASK_SET:
+        qatomic_or(&o->ipi_mask, val & (AIC_IPI_NORMAL | AIC_IPI_SELF));
+        break;
 
-        case REG_AIC_IPI_DEFER_SET: {
-            int i;
+    case REG_AIC_IPI_MASK_CLR:
+        qatomic_and(&o->ipi_mask, ~(val & (AIC_IPI_NORMAL | AIC_IPI_SELF)));
+        apple_aic_update_cpu(s, o);
+        break;
 
-            for (i = 0; i < s->numCPU; i++) {
-                if (val & (1 << i)) {
-                    set_bit(o->cpu_id,
-                            (unsigned long *)&s->cpus[i].deferredIPI);
-                }
+    case REG_AIC_IPI_DEFER_SET:
+        for (i = 0; i < s->numCPU; i++) {
+            if (val & (1 << i)) {
+                qatomic_or(&s->cpus[i].deferredIPI, 1 << o->cpu_id);
             }
+        }
 
-            if (val & AIC_IPI_SELF) {
-                o->deferredIPI |= AIC_IPI_SELF;
+        if (val & AIC_IPI_SELF) {
+            qatomic_or(&o->deferredIPI, AIC_IPI_SELF);
+        }
+        apple_aic_defer_ipi(s);
+        break;
+
+    case REG_AIC_IPI_DEFER_CLR:
+        for (i = 0; i < s->numCPU; i++) {
+            if (val & (1 << i)) {
+                qatomic_and(&s->cpus[i].deferredIPI, ~(1 << o->cpu_id));
             }
-            break;
         }
 
-        case REG_AIC_IPI_DEFER_CLR: {
-            int i;
+        if (val & AIC_IPI_SELF) {
+            qatomic_and(&o->deferredIPI, ~AIC_IPI_SELF);
+        }
+        break;
 
-            for (i = 0; i < s->numCPU; i++) {
-                if (val & (1 << i)) {
-                    clear_bit(o->cpu_id,
-                              (unsigned long *)&s->cpus[i].deferredIPI);
-                }
-            }
+    default:
+        return false;
+    }
+    return true;
+}
 
-            if (val & AIC_IPI_SELF) {
-                o->deferredIPI &= ~AIC_IPI_SELF;
-            }
+static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
+                            unsigned size)
+{
+    AppleAICCPU *o = (AppleAICCPU *)opaque;
+    AppleAICState *s = APPLE_AIC(o->aic);
+    uint32_t val = (uint32_t)data;
+
+    if (apple_aic_write_ipi(s, o, addr, val)) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->mutex)
+    {
+        switch (addr) {
+        case REG_AIC_RST:
+            apple_aic_reset(DEVICE(s));
+            break;
+
+        case REG_AIC_GLB_CFG:
+            s->global_cfg = data;
             break;
-        }
 
         case REG_AIC_EIR_DEST(0)... REG_AIC_EIR_DEST(AIC_INT_COUNT): {
             uint32_t vector = (addr - REG_AIC_EIR_DEST(0)) / 4;
@@ -320,6 +506,8 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_dest[vector] = val;
+            apple_aic_refresh_irq(s, vector);
+            apple_aic_update(s);
             break;
         }
 
@@ -329,6 +517,8 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_state[eir] |= val;
+            apple_aic_refresh_eir(s, eir, val);
+            apple_aic_update(s);
             break;
         }
 
@@ -338,6 +528,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_state[eir] &= ~val;
+            apple_aic_refresh_eir(s, eir, val);
             break;
         }
 
@@ -347,6 +538,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                 break;
             }
             s->eir_mask[eir] |= val;
+            apple_aic_refresh_eir(s, eir, val);
             break;
         }
 
@@ -358,6 +550,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             }
 
             s->eir_mask[eir] &= ~val;
+            apple_aic_refresh_eir(s, eir, val);
 
 #ifdef AIC_DEBUG_NEW_IRQ
             if ((s->eir_mask[eir] | s->eir_mask_once[eir]) !=
@@ -371,6 +564,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             }
             s->eir_mask_once[eir] &= s->eir_mask[eir];
 #endif
+            apple_aic_update(s);
             break;
         }
 
@@ -396,6 +590,47 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
     }
 }
 
+/*
+ * Pick the interrupt the IACK read of `o` returns, masking it.
+ * Call with mutex locked.
+ */
+static uint32_t apple_aic_ack(AppleAICState *s, AppleAICCPU *o)
+{
+    uint32_t pending = qatomic_read(&o->pendingIPI);
+    uint32_t mask = qatomic_read(&o->ipi_mask);
+    int i;
+
+    if (pending & AIC_IPI_SELF & ~mask) {
+        qatomic_or(&o->ipi_mask, AIC_IPI_SELF);
+        return kAIC_INT_IPI | kAIC_INT_IPI_SELF;
+    }
+
+    if (~mask & AIC_IPI_NORMAL) {
+        if (pending & ((1 << s->numCPU) - 1)) {
+            qatomic_or(&o->ipi_mask, AIC_IPI_NORMAL);
+            return kAIC_INT_IPI | kAIC_INT_IPI_NORM;
+        }
+    }
+
+    /* IRQs accounted to this CPU first, then any it is a destination of. */
+    i = find_first_bit((unsigned long *)o->eir_pending, s->numIRQ);
+    if (i >= s->numIRQ) {
+        i = -1;
+        while ((i = find_next_bit((unsigned long *)s->eir_active, s->numIRQ,
+                                  i + 1)) < s->numIRQ) {
+            if (s->eir_dest[i] & (1 << o->cpu_id)) {
+                break;
+            }
+        }
+    }
+    if (i < s->numIRQ) {
+        set_bit(i, (unsigned long *)s->eir_mask);
+        apple_aic_refresh_irq(s, i);
+        return kAIC_INT_EXT | AIC_INT_EXTID(i);
+    }
+    return kAIC_INT_SPURIOUS;
+}
+
 static uint64_t apple_aic_read(void *opaque, hwaddr addr, unsigned size)
 {
     AppleAICCPU *o = (AppleAICCPU *)opaque;
@@ -417,32 +652,15 @@ static uint64_t apple_aic_read(void *opaque, hwaddr addr, unsigned size)
             return o->cpu_id;
 
         case REG_AIC_IACK: {
-            int i;
+            uint32_t ret;
 
-            qemu_irq_lower(o->irq);
-            if (o->pendingIPI & AIC_IPI_SELF & ~o->ipi_mask) {
-                o->ipi_mask |= AIC_IPI_SELF;
-                return kAIC_INT_IPI | kAIC_INT_IPI_SELF;
+            apple_aic_lower(s, o);
+            ret = apple_aic_ack(s, o);
+            /* Anything still pending is re-raised now, not on a tick. */
+            if (ret != kAIC_INT_SPURIOUS) {
+                apple_aic_update(s);
             }
-
-            if (~o->ipi_mask & AIC_IPI_NORMAL) {
-                if (o->pendingIPI & ((1 << s->numCPU) - 1)) {
-                    o->ipi_mask |= AIC_IPI_NORMAL;
-                    return kAIC_INT_IPI | kAIC_INT_IPI_NORM;
-                }
-            }
-
-            i = -1;
-            while ((i = find_next_bit((unsigned long *)s->eir_state, s->numIRQ,
-                                      i + 1)) < s->numIRQ) {
-                if (test_bit(i, (unsigned long *)s->eir_mask) == 0) {
-                    if (s->eir_dest[i] & (1 << o->cpu_id)) {
-                        set_bit(i, (unsigned long *)s->eir_mask);
-                        return kAIC_INT_EXT | AIC_INT_EXTID(i);
-                    }
-                }
-            }
-            return kAIC_INT_SPURIOUS;
+            return ret;
         }
 
         case REG_AIC_EIR_DEST(0)... REG_AIC_EIR_DEST(AIC_INT_COUNT): {
@@ -535,14 +753,24 @@ static void apple_aic_realize(DeviceState *dev, struct Error **errp)
 
     qemu_mutex_init(&s->mutex);
     s->cpus = g_new0(AppleAICCPU, s->numCPU);
+    /*
+     * Round-robin TCG sleeps on all vCPUs at once and icount accounts for
+     * every IRQ change, both want them to go through the accelerator.
+     */
+    s->lockless =
+        tcg_enabled() && qemu_tcg_mttcg_enabled() && !icount_enabled();
 
     for (i = 0; i < s->numCPU; i++) {
         AppleAICCPU *cpu = &s->cpus[i];
 
         cpu->aic = s;
         cpu->cpu_id = i;
+        cpu->eir_pending = g_new0(uint32_t, s->numEIR);
         memory_region_init_io(&cpu->iomem, OBJECT(dev), &apple_aic_ops, cpu,
                               TYPE_APPLE_AIC, s->base_size);
+        if (s->lockless) {
+            memory_region_clear_global_locking(&cpu->iomem);
+        }
         sysbus_init_mmio(sbd, &cpu->iomem);
         sysbus_init_irq(sbd, &cpu->irq);
     }
@@ -554,20 +782,32 @@ static void apple_aic_realize(DeviceState *dev, struct Error **errp)
     s->eir_mask = g_new0(uint32_t, s->numEIR);
     s->eir_dest = g_new0(uint32_t, s->numIRQ);
     s->eir_state = g_new0(uint32_t, s->numEIR);
+    s->eir_active = g_new0(uint32_t, s->numEIR);
+    s->eir_target = g_new(uint32_t, s->numIRQ);
+    memset(s->eir_target, 0xff, sizeof(uint32_t) * s->numIRQ);
 
 #ifdef AIC_DEBUG_NEW_IRQ
     s->eir_mask_once = g_new0(uint32_t, s->numEIR);
 #endif
 
-    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_aic_tick, dev);
-    timer_mod_ns(s->timer, kAICWT);
+    /* The deferral wait is a hint, let it coalesce with other deadlines */
+    apple_deadline_init(&s->tick, apple_aic_tick, dev, kAICWT / 8);
     msi_nonbroken = true;
 }
 
 static void apple_aic_unrealize(DeviceState *dev)
 {
     AppleAICState *s = APPLE_AIC(dev);
-    timer_free(s->timer);
+    apple_deadline_destroy(&s->tick);
+}
+
+void apple_aic_connect_cpu(SysBusDevice *sbd, uint32_t n, CPUState *cpu)
+{
+    AppleAICState *s = APPLE_AIC(sbd);
+
+    g_assert_cmpuint(n, <, s->numCPU);
+    s->cpus[n].cpu = cpu;
+    sysbus_connect_irq(sbd, n, qdev_get_gpio_in(DEVICE(cpu), ARM_CPU_IRQ));
 }
 
 SysBusDevice *apple_aic_create(uint32_t numCPU, DTBNode *node,
@@ -627,10 +867,26 @@ static const VMStateDescription vmstate_apple_aic_cpu = {
         }
 };
 
+static int apple_aic_post_load(void *opaque, int version_id)
+{
+    AppleAICState *s = APPLE_AIC(opaque);
+
+    QEMU_LOCK_GUARD(&s->mutex);
+    apple_aic_rebuild(s);
+    for (int i = 0; i < s->numCPU; i++) {
+        if (s->cpus[i].deferredIPI) {
+            apple_aic_defer_ipi(s);
+            break;
+        }
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_aic = {
     .name = "apple_aic",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_aic_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_UINT32(numEIR, AppleAICState),
@@ -654,6 +910,11 @@ static const VMStateDescription vmstate_apple_aic = {
         }
 };
 
+static Property apple_aic_props[] = {
+    DEFINE_PROP_BOOL("fixed-steering", AppleAICState, fixed_steering, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_aic_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -663,6 +924,7 @@ static void apple_aic_class_init(ObjectClass *klass, void *data)
     dc->reset = apple_aic_reset;
     dc->desc = "Apple Interrupt Controller";
     dc->vmsd = &vmstate_apple_aic;
+    device_class_set_props(dc, apple_aic_props);
 }
 
 static const TypeInfo apple_aic_info = {
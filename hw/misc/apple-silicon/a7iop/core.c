@@ -1,30 +1,33 @@
 #include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/stats.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/misc/apple-silicon/a7iop/private.h"
+#include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
+#include "sysemu/stats.h"
 
 #define CPU_CTRL_RUN BIT(4)
 
-void apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
+void apple_a7iop_send_ap(AppleA7IOP *s, const AppleA7IOPMessage *msg)
 {
     apple_a7iop_mailbox_send_ap(s->iop_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s)
+bool apple_a7iop_recv_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    return apple_a7iop_mailbox_recv_ap(s->iop_mailbox);
+    return apple_a7iop_mailbox_recv_ap(s->iop_mailbox, msg);
 }
 
-void apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
+void apple_a7iop_send_iop(AppleA7IOP *s, const AppleA7IOPMessage *msg)
 {
     apple_a7iop_mailbox_send_iop(s->ap_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_recv_iop(AppleA7IOP *s)
+bool apple_a7iop_recv_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    return apple_a7iop_mailbox_recv_iop(s->ap_mailbox);
+    return apple_a7iop_mailbox_recv_iop(s->ap_mailbox, msg);
 }
 
 void apple_a7iop_cpu_start(AppleA7IOP *s, bool wake)
@@ -143,15 +146,106 @@ static void apple_a7iop_unrealize(DeviceState *opaque)
     qdev_unrealize(DEVICE(s->ap_mailbox));
 }
 
+/* The mailboxes are devices of their own and migrate separately. */
+const VMStateDescription vmstate_apple_a7iop = {
+    .name = "apple_a7iop",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(cpu_status, AppleA7IOP),
+            VMSTATE_UINT32(cpu_ctrl, AppleA7IOP),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+typedef enum {
+    A7IOP_STAT_MESSAGES_TO_IOP = 0,
+    A7IOP_STAT_MESSAGES_TO_AP,
+    A7IOP_STAT__MAX,
+} a7iop_stat_t;
+
+static const char *a7iop_stat_name[A7IOP_STAT__MAX] = {
+    [A7IOP_STAT_MESSAGES_TO_IOP] = "messages-to-iop",
+    [A7IOP_STAT_MESSAGES_TO_AP] = "messages-to-ap",
+};
+
+typedef struct {
+    StatsResultList **result;
+    strList *names;
+} AppleA7IOPStatsQuery;
+
+static int apple_a7iop_stats_device(Object *obj, void *opaque)
+{
+    AppleA7IOPStatsQuery *q = opaque;
+    AppleA7IOP *s;
+    StatsList *stats_list = NULL;
+    g_autofree char *path = NULL;
+    uint64_t values[A7IOP_STAT__MAX];
+
+    s = (AppleA7IOP *)object_dynamic_cast(obj, TYPE_APPLE_A7IOP);
+    if (!s || !s->iop_mailbox) {
+        return 0;
+    }
+    values[A7IOP_STAT_MESSAGES_TO_IOP] =
+        apple_a7iop_mailbox_get_messages(s->iop_mailbox);
+    values[A7IOP_STAT_MESSAGES_TO_AP] =
+        apple_a7iop_mailbox_get_messages(s->ap_mailbox);
+
+    for (int i = 0; i < A7IOP_STAT__MAX; i++) {
+        if (apply_str_list_filter(a7iop_stat_name[i], q->names)) {
+            apple_stats_prepend(&stats_list, a7iop_stat_name[i], values[i]);
+        }
+    }
+    if (!stats_list) {
+        return 0;
+    }
+    path = object_get_canonical_path(obj);
+    add_stats_entry(q->result, STATS_PROVIDER_APPLE_A7IOP, path, stats_list);
+    return 0;
+}
+
+static void apple_a7iop_stats_cb(StatsResultList **result, StatsTarget target,
+                                 strList *names, strList *targets,
+                                 Error **errp)
+{
+    AppleA7IOPStatsQuery q = { .result = result, .names = names };
+
+    if (target != STATS_TARGET_DEVICE) {
+        return;
+    }
+    object_child_foreach_recursive(qdev_get_machine(),
+                                   apple_a7iop_stats_device, &q);
+}
+
+static void apple_a7iop_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    for (int i = 0; i < A7IOP_STAT__MAX; i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(a7iop_stat_name[i]);
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_A7IOP, STATS_TARGET_DEVICE,
+                     stats_list);
+}
+
 static void apple_a7iop_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc;
 
+    add_stats_callbacks(STATS_PROVIDER_APPLE_A7IOP, apple_a7iop_stats_cb,
+                        apple_a7iop_schemas_cb);
+
     dc = DEVICE_CLASS(oc);
     dc->reset = apple_a7iop_reset;
     dc->realize = apple_a7iop_realize;
     dc->unrealize = apple_a7iop_unrealize;
     dc->desc = "Apple A7IOP";
+    dc->vmsd = &vmstate_apple_a7iop;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
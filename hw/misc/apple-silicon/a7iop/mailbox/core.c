@@ -6,6 +6,7 @@
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/qdev-core.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
@@ -14,6 +15,7 @@
 #include "trace.h"
 
 #define MAX_MESSAGE_COUNT 15
+#define INBOX_INITIAL_SIZE 16
 
 #define CTRL_ENABLE_SHIFT 0
 #define CTRL_ENABLE_MASK BIT(CTRL_ENABLE_SHIFT)
@@ -59,6 +61,15 @@ static inline bool ap_nonempty_is_unmasked(uint32_t int_mask)
     return (int_mask & AP_NONEMPTY) == 0;
 }
 
+static void apple_a7iop_mailbox_set_irq(AppleA7IOPMailbox *s, int n,
+                                        int level)
+{
+    if (s->irq_levels[n] != level) {
+        s->irq_levels[n] = level;
+        qemu_set_irq(s->irqs[n], level);
+    }
+}
+
 static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
 {
     bool iop_empty;
@@ -70,8 +81,8 @@ static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
     bool ap_nonempty_unmasked;
     bool ap_empty_unmasked;
 
-    iop_empty = QTAILQ_EMPTY(&s->iop_mailbox->inbox);
-    ap_empty = QTAILQ_EMPTY(&s->ap_mailbox->inbox);
+    iop_empty = s->iop_mailbox->count == 0;
+    ap_empty = s->ap_mailbox->count == 0;
     iop_underflow = s->iop_mailbox->underflow;
     ap_underflow = s->ap_mailbox->underflow;
     iop_nonempty_unmasked = iop_nonempty_is_unmasked(s->int_mask);
@@ -83,15 +94,17 @@ static void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s)
         s->role, iop_empty, ap_empty, !iop_nonempty_unmasked,
         !iop_empty_unmasked, !ap_nonempty_unmasked, !ap_empty_unmasked);
 
-    qemu_set_irq(s->irqs[APPLE_A7IOP_IRQ_IOP_NONEMPTY],
-                 (iop_nonempty_unmasked && !iop_empty) || iop_underflow);
-    qemu_set_irq(s->irqs[APPLE_A7IOP_IRQ_IOP_EMPTY],
-                 iop_empty_unmasked && iop_empty);
-
-    qemu_set_irq(s->irqs[APPLE_A7IOP_IRQ_AP_NONEMPTY],
-                 (ap_nonempty_unmasked && !ap_empty) || ap_underflow);
-    qemu_set_irq(s->irqs[APPLE_A7IOP_IRQ_AP_EMPTY],
-                 ap_empty_unmasked && ap_empty);
+    apple_a7iop_mailbox_set_irq(s, APPLE_A7IOP_IRQ_IOP_NONEMPTY,
+                                (iop_nonempty_unmasked && !iop_empty) ||
+                                    iop_underflow);
+    apple_a7iop_mailbox_set_irq(s, APPLE_A7IOP_IRQ_IOP_EMPTY,
+                                iop_empty_unmasked && iop_empty);
+
+    apple_a7iop_mailbox_set_irq(s, APPLE_A7IOP_IRQ_AP_NONEMPTY,
+                                (ap_nonempty_unmasked && !ap_empty) ||
+                                    ap_underflow);
+    apple_a7iop_mailbox_set_irq(s, APPLE_A7IOP_IRQ_AP_EMPTY,
+                                ap_empty_unmasked && ap_empty);
 }
 
 bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s)
@@ -100,19 +113,49 @@ bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s)
     if (s->underflow) {
         return true;
     }
-    return QTAILQ_EMPTY(&s->inbox);
+    return s->count == 0;
+}
+
+uint64_t apple_a7iop_mailbox_get_messages(AppleA7IOPMailbox *s)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+    return s->messages;
+}
+
+/*
+ * Software senders (rollcall, SEP endpoint adverts) can queue more than the
+ * hardware FIFO depth, so the ring doubles instead of dropping messages.
+ * Steady-state traffic never allocates.
+ */
+static void apple_a7iop_mailbox_inbox_grow(AppleA7IOPMailbox *s)
+{
+    AppleA7IOPMessage *inbox;
+    size_t first;
+
+    inbox = g_new(AppleA7IOPMessage, s->inbox_size * 2);
+    first = MIN(s->count, s->inbox_size - s->inbox_head);
+    memcpy(inbox, s->inbox + s->inbox_head, first * sizeof(*inbox));
+    memcpy(inbox + first, s->inbox, (s->count - first) * sizeof(*inbox));
+    g_free(s->inbox);
+    s->inbox = inbox;
+    s->inbox_size *= 2;
+    s->inbox_head = 0;
 }
 
 static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
-                                     AppleA7IOPMessage *msg)
+                                     const AppleA7IOPMessage *msg)
 {
     g_assert_nonnull(msg);
 
     QEMU_LOCK_GUARD(&s->lock);
     trace_apple_a7iop_mailbox_send(s->role, msg->endpoint, msg->data[0],
                                    msg->data[1]);
-    QTAILQ_INSERT_TAIL(&s->inbox, msg, entry);
+    if (s->count == s->inbox_size) {
+        apple_a7iop_mailbox_inbox_grow(s);
+    }
+    s->inbox[(s->inbox_head + s->count) & (s->inbox_size - 1)] = *msg;
     s->count++;
+    s->messages++;
     apple_a7iop_mailbox_update_irq(s);
 
     if (s->bh != NULL) {
@@ -120,7 +163,8 @@ static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
     }
 }
 
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg)
 {
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
@@ -138,7 +182,8 @@ void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
     }
 }
 
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg)
 {
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
@@ -156,71 +201,70 @@ void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
     }
 }
 
-static AppleA7IOPMessage *apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s)
+static bool apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s,
+                                     AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
-
     QEMU_LOCK_GUARD(&s->lock);
     if (s->underflow) {
-        return NULL;
+        return false;
     }
-    msg = QTAILQ_FIRST(&s->inbox);
-    if (!msg) {
+    if (s->count == 0) {
         s->underflow = true;
         qemu_log_mask(LOG_GUEST_ERROR, "%s %s underflowed.\n", __FUNCTION__,
                       s->role);
         apple_a7iop_mailbox_update_irq(s);
-        return NULL;
+        return false;
     }
-    QTAILQ_REMOVE(&s->inbox, msg, entry);
+    *msg = s->inbox[s->inbox_head];
+    s->inbox_head = (s->inbox_head + 1) & (s->inbox_size - 1);
     msg->flags |= CTRL_COUNT(s->count);
     trace_apple_a7iop_mailbox_recv(s->role, msg->endpoint, msg->data[0],
                                    msg->data[1]);
     s->count--;
     apple_a7iop_mailbox_update_irq(s);
-    return msg;
+    return true;
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
+    bool ret;
 
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
         if (!s->iop_dir_en) {
             qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
                           __FUNCTION__, s->role);
-            return NULL;
+            return false;
         }
     }
 
-    msg = apple_a7iop_mailbox_recv(s->iop_mailbox);
+    ret = apple_a7iop_mailbox_recv(s->iop_mailbox, msg);
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
         apple_a7iop_mailbox_update_irq(s);
     }
-    return msg;
+    return ret;
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
+    bool ret;
 
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
         if (!s->ap_dir_en) {
             qemu_log_mask(LOG_GUEST_ERROR, "%s %s direction not enabled.\n",
                           __FUNCTION__, s->role);
-            return NULL;
+            return false;
         }
     }
 
-    msg = apple_a7iop_mailbox_recv(s->ap_mailbox);
+    ret = apple_a7iop_mailbox_recv(s->ap_mailbox, msg);
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
         apple_a7iop_mailbox_update_irq(s);
     }
-    return msg;
+    return ret;
 }
 
 uint32_t apple_a7iop_mailbox_get_int_mask(AppleA7IOPMailbox *s)
@@ -250,7 +294,7 @@ static inline uint32_t apple_a7iop_mailbox_ctrl(AppleA7IOPMailbox *s)
         return CTRL_UNDERFLOW(s->underflow);
     }
     return CTRL_FULL(s->count >= MAX_MESSAGE_COUNT) |
-           CTRL_EMPTY(QTAILQ_EMPTY(&s->inbox)) |
+           CTRL_EMPTY(s->count == 0) |
            CTRL_COUNT(MIN(s->count, MAX_MESSAGE_COUNT));
 }
 
@@ -309,10 +353,12 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
     s->iop_mailbox = iop_mailbox ? iop_mailbox : s;
     s->ap_mailbox = ap_mailbox ? ap_mailbox : s;
     s->bh = bh;
-    QTAILQ_INIT(&s->inbox);
+    s->inbox_size = INBOX_INITIAL_SIZE;
+    s->inbox = g_new(AppleA7IOPMessage, s->inbox_size);
     qemu_mutex_init(&s->lock);
     for (i = 0; i < APPLE_A7IOP_IRQ_MAX; i++) {
         sysbus_init_irq(sbd, s->irqs + i);
+        s->irq_levels[i] = -1;
     }
     snprintf(name, sizeof(name), TYPE_APPLE_A7IOP_MAILBOX ".%s.regs", s->role);
     switch (version) {
@@ -331,13 +377,14 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
 static void apple_a7iop_mailbox_reset(DeviceState *dev)
 {
     AppleA7IOPMailbox *s;
-    AppleA7IOPMessage *msg;
+    int i;
 
     s = APPLE_A7IOP_MAILBOX(dev);
 
     g_assert_true(s->iop_mailbox != s->ap_mailbox);
     QEMU_LOCK_GUARD(&s->lock);
     s->count = 0;
+    s->inbox_head = 0;
     s->iop_dir_en = true;
     s->ap_dir_en = true;
     s->underflow = false;
@@ -346,14 +393,93 @@ static void apple_a7iop_mailbox_reset(DeviceState *dev)
     memset(s->iop_send_reg, 0, sizeof(s->iop_send_reg));
     memset(s->ap_send_reg, 0, sizeof(s->ap_send_reg));
 
-    while (!QTAILQ_EMPTY(&s->inbox)) {
-        msg = QTAILQ_FIRST(&s->inbox);
-        QTAILQ_REMOVE(&s->inbox, msg, entry);
-        g_free(msg);
+    // Drive every line again after reset, whatever was cached before.
+    for (i = 0; i < APPLE_A7IOP_IRQ_MAX; i++) {
+        s->irq_levels[i] = -1;
     }
     apple_a7iop_mailbox_update_irq(s);
 }
 
+static int apple_a7iop_mailbox_pre_save(void *opaque)
+{
+    AppleA7IOPMailbox *s = APPLE_A7IOP_MAILBOX(opaque);
+    size_t i;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    s->mig_inbox_words = s->count * 2;
+    s->mig_inbox = g_new(uint64_t, s->mig_inbox_words);
+    for (i = 0; i < s->count; i++) {
+        const AppleA7IOPMessage *msg =
+            &s->inbox[(s->inbox_head + i) & (s->inbox_size - 1)];
+
+        s->mig_inbox[i * 2] = msg->data[0];
+        s->mig_inbox[i * 2 + 1] = msg->data[1];
+    }
+    return 0;
+}
+
+static int apple_a7iop_mailbox_post_save(void *opaque)
+{
+    AppleA7IOPMailbox *s = APPLE_A7IOP_MAILBOX(opaque);
+
+    g_free(s->mig_inbox);
+    s->mig_inbox = NULL;
+    return 0;
+}
+
+static int apple_a7iop_mailbox_post_load(void *opaque, int version_id)
+{
+    AppleA7IOPMailbox *s = APPLE_A7IOP_MAILBOX(opaque);
+    size_t count = s->mig_inbox_words / 2;
+    size_t i;
+
+    if (s->mig_inbox_words & 1) {
+        return -EINVAL;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+    s->count = 0;
+    s->inbox_head = 0;
+    while (s->inbox_size < count) {
+        apple_a7iop_mailbox_inbox_grow(s);
+    }
+    for (i = 0; i < count; i++) {
+        s->inbox[i].data[0] = s->mig_inbox[i * 2];
+        s->inbox[i].data[1] = s->mig_inbox[i * 2 + 1];
+    }
+    s->count = count;
+    g_free(s->mig_inbox);
+    s->mig_inbox = NULL;
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_a7iop_mailbox = {
+    .name = "apple_a7iop_mailbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = apple_a7iop_mailbox_pre_save,
+    .post_save = apple_a7iop_mailbox_post_save,
+    .post_load = apple_a7iop_mailbox_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT32(mig_inbox_words, AppleA7IOPMailbox),
+            VMSTATE_VARRAY_UINT32_ALLOC(mig_inbox, AppleA7IOPMailbox,
+                                        mig_inbox_words, 0,
+                                        vmstate_info_uint64, uint64_t),
+            VMSTATE_INT32_ARRAY(irq_levels, AppleA7IOPMailbox,
+                                APPLE_A7IOP_IRQ_MAX),
+            VMSTATE_BOOL(iop_dir_en, AppleA7IOPMailbox),
+            VMSTATE_BOOL(ap_dir_en, AppleA7IOPMailbox),
+            VMSTATE_BOOL(underflow, AppleA7IOPMailbox),
+            VMSTATE_UINT32(int_mask, AppleA7IOPMailbox),
+            VMSTATE_UINT8_ARRAY(iop_recv_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(ap_recv_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(iop_send_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_UINT8_ARRAY(ap_send_reg, AppleA7IOPMailbox, 16),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void apple_a7iop_mailbox_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc;
@@ -362,6 +488,7 @@ static void apple_a7iop_mailbox_class_init(ObjectClass *klass, void *data)
 
     dc->reset = apple_a7iop_mailbox_reset;
     dc->desc = "Apple A7IOP Mailbox";
+    dc->vmsd = &vmstate_apple_a7iop_mailbox;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
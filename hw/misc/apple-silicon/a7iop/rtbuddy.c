@@ -2,8 +2,12 @@
 #include "hw/misc/apple-silicon/a7iop/mailbox/core.h"
 #include "hw/misc/apple-silicon/a7iop/private.h"
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
 #include "qemu/lockable.h"
 #include "qemu/main-loop.h"
+#include "sysemu/dma.h"
 #include "trace.h"
 
 #define MSG_SEND_HELLO 1
@@ -27,6 +31,21 @@
 #define MSG_TYPE_ROLLCALL 8
 #define MSG_TYPE_SET_AP_PSTATE 11
 
+/* Messages on the shared buffer endpoints. */
+#define MSG_BUFFER_TYPE(_x) extract64((_x), 52, 8)
+#define MSG_BUFFER_IOVA(_x) extract64((_x), 0, 44)
+#define MSG_TYPE_BUFFER_REQUEST 1
+/* Sent on EP_CRASHLOG once its buffer is mapped. */
+#define MSG_TYPE_CRASHLOG_CRASH 1
+#define MSG_TYPE_SYSLOG_LOG 5
+#define MSG_TYPE_SYSLOG_INIT 8
+#define BUFFER_PAGE_SIZE 0x1000
+
+/* A syslog entry is 8 bytes, the sender's name, then the message. */
+#define SYSLOG_CONTEXT_OFFSET 8
+#define SYSLOG_CONTEXT_SIZE 24
+#define SYSLOG_MSG_OFFSET 0x20
+
 static inline AppleA7IOPMessage *apple_rtbuddy_construct_msg(uint32_t ep,
                                                              uint64_t data)
 {
@@ -42,7 +61,11 @@ static inline AppleA7IOPMessage *apple_rtbuddy_construct_msg(uint32_t ep,
 static inline void apple_rtbuddy_send_msg(AppleRTBuddy *s, uint32_t ep,
                                           uint64_t data)
 {
-    apple_a7iop_send_ap(APPLE_A7IOP(s), apple_rtbuddy_construct_msg(ep, data));
+    AppleA7IOPMessage msg = { 0 };
+
+    msg.endpoint = ep;
+    msg.msg = data;
+    apple_a7iop_send_ap(APPLE_A7IOP(s), &msg);
 }
 
 void apple_rtbuddy_send_control_msg(AppleRTBuddy *s, uint32_t ep, uint64_t data)
@@ -69,6 +92,8 @@ static inline void apple_rtbuddy_register_ep(AppleRTBuddy *s, uint32_t ep,
     data->opaque = opaque;
     data->handler = handler;
     data->user = user;
+    g_free(s->ep_table[ep]);
+    s->ep_table[ep] = data;
     g_tree_insert(s->endpoints, GUINT_TO_POINTER(ep), data);
 }
 
@@ -89,9 +114,10 @@ void apple_rtbuddy_register_user_ep(AppleRTBuddy *s, uint32_t ep, void *opaque,
 
 static inline void apple_rtbuddy_unregister_ep(AppleRTBuddy *s, uint32_t ep)
 {
-    void *ep_data = g_tree_lookup(s->endpoints, GUINT_TO_POINTER(ep));
+    AppleRTBuddyEPData *ep_data = s->ep_table[ep];
     if (ep_data != NULL) {
         g_tree_remove(s->endpoints, GUINT_TO_POINTER(ep));
+        s->ep_table[ep] = NULL;
         g_free(ep_data);
     }
 }
@@ -108,6 +134,178 @@ void apple_rtbuddy_unregister_user_ep(AppleRTBuddy *s, uint32_t ep)
     apple_rtbuddy_unregister_ep(s, ep + EP_USER_START);
 }
 
+static AppleRTBuddyBuffer *apple_rtbuddy_buffer(AppleRTBuddy *s, uint32_t ep)
+{
+    switch (ep) {
+    case EP_CRASHLOG:
+        return &s->crashlog;
+    case EP_SYSLOG:
+        return &s->syslog;
+    case EP_IOREPORT:
+        return &s->ioreport;
+    default:
+        return NULL;
+    }
+}
+
+static uint64_t apple_rtbuddy_buffer_msg(uint32_t type,
+                                         const AppleRTBuddyBuffer *buf)
+{
+    uint64_t msg = 0;
+
+    msg = deposit64(msg, 52, 8, type);
+    msg = deposit64(msg, 44, 8, buf->size / BUFFER_PAGE_SIZE);
+    return deposit64(msg, 0, 44, buf->iova);
+}
+
+static MemTxResult apple_rtbuddy_buffer_write(AppleRTBuddy *s,
+                                              const AppleRTBuddyBuffer *buf,
+                                              uint64_t offset,
+                                              const void *data, uint64_t len)
+{
+    if (s->dma_as == NULL || buf->iova == 0 || offset > buf->size ||
+        len > buf->size - offset) {
+        return MEMTX_ERROR;
+    }
+    return dma_memory_write(s->dma_as, buf->iova + offset, data, len,
+                            MEMTXATTRS_UNSPECIFIED);
+}
+
+/* The AP started @ep, ask it for the endpoint's buffer. */
+static void apple_rtbuddy_start_ep(AppleRTBuddy *s, uint32_t ep)
+{
+    AppleRTBuddyBuffer *buf = apple_rtbuddy_buffer(s, ep);
+
+    if (buf == NULL || buf->size == 0) {
+        return;
+    }
+    buf->iova = 0;
+    if (ep == EP_SYSLOG) {
+        s->syslog_next = 0;
+        s->syslog_inflight = 0;
+    }
+    /* An IOVA of 0 has the AP allocate and map the buffer. */
+    apple_rtbuddy_send_msg(
+        s, ep, apple_rtbuddy_buffer_msg(MSG_TYPE_BUFFER_REQUEST, buf));
+}
+
+static void apple_rtbuddy_handle_buffer_msg(void *opaque, uint32_t ep,
+                                            uint64_t msg)
+{
+    AppleRTBuddy *s = APPLE_RTBUDDY(opaque);
+    AppleRTBuddyBuffer *buf = apple_rtbuddy_buffer(s, ep);
+    uint64_t init = 0;
+
+    switch (MSG_BUFFER_TYPE(msg)) {
+    case MSG_TYPE_BUFFER_REQUEST:
+        buf->iova = MSG_BUFFER_IOVA(msg);
+        trace_apple_rtbuddy_buffer(APPLE_A7IOP(s)->role, ep, buf->iova,
+                                   buf->size);
+        if (ep == EP_SYSLOG && buf->iova != 0) {
+            init = deposit64(init, 52, 8, MSG_TYPE_SYSLOG_INIT);
+            init = deposit64(init, 24, 8, s->syslog_msg_size);
+            init = deposit64(init, 0, 8, s->syslog_entries);
+            apple_rtbuddy_send_msg(s, ep, init);
+        }
+        break;
+    case MSG_TYPE_SYSLOG_LOG:
+        /* The AP has read the entry and echoes the message back. */
+        if (ep == EP_SYSLOG && s->syslog_inflight > 0) {
+            s->syslog_inflight--;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void apple_rtbuddy_set_dma(AppleRTBuddy *s, AddressSpace *as)
+{
+    s->dma_as = as;
+}
+
+static void apple_rtbuddy_enable_buffer(AppleRTBuddy *s, uint32_t ep,
+                                        uint32_t size)
+{
+    AppleRTBuddyBuffer *buf = apple_rtbuddy_buffer(s, ep);
+
+    size = ROUND_UP(size, BUFFER_PAGE_SIZE);
+    g_assert_cmpuint(size / BUFFER_PAGE_SIZE, <=, 0xFF);
+    buf->size = size;
+    buf->iova = 0;
+    apple_rtbuddy_register_control_ep(s, ep, s,
+                                      apple_rtbuddy_handle_buffer_msg);
+}
+
+void apple_rtbuddy_enable_crashlog(AppleRTBuddy *s, uint32_t size)
+{
+    apple_rtbuddy_enable_buffer(s, EP_CRASHLOG, size);
+}
+
+void apple_rtbuddy_enable_syslog(AppleRTBuddy *s, uint32_t entries,
+                                 uint32_t msg_size)
+{
+    g_assert_cmpuint(entries, >, 0);
+    g_assert_cmpuint(entries, <=, 0xFF);
+    g_assert_cmpuint(msg_size, <=, 0xFF);
+    s->syslog_entries = entries;
+    s->syslog_msg_size = msg_size;
+    apple_rtbuddy_enable_buffer(s, EP_SYSLOG,
+                                entries * (SYSLOG_MSG_OFFSET + msg_size));
+}
+
+void apple_rtbuddy_enable_ioreport(AppleRTBuddy *s, uint32_t size)
+{
+    apple_rtbuddy_enable_buffer(s, EP_IOREPORT, size);
+}
+
+void apple_rtbuddy_syslog(AppleRTBuddy *s, const char *fmt, ...)
+{
+    const char *role = APPLE_A7IOP(s)->role;
+    uint32_t entry_size = SYSLOG_MSG_OFFSET + s->syslog_msg_size;
+    g_autofree char *line = NULL;
+    g_autofree char *entry = NULL;
+    uint32_t idx = s->syslog_next;
+    va_list ap;
+
+    va_start(ap, fmt);
+    line = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    trace_apple_rtbuddy_syslog(role, line);
+
+    /* Lines are dropped while every entry waits for the AP. */
+    if (s->syslog.iova == 0 || s->syslog_inflight >= s->syslog_entries) {
+        return;
+    }
+    entry = g_malloc0(entry_size);
+    g_strlcpy(entry + SYSLOG_CONTEXT_OFFSET, role, SYSLOG_CONTEXT_SIZE);
+    g_strlcpy(entry + SYSLOG_MSG_OFFSET, line, s->syslog_msg_size);
+    if (apple_rtbuddy_buffer_write(s, &s->syslog, idx * entry_size, entry,
+                                   entry_size) != MEMTX_OK) {
+        return;
+    }
+    s->syslog_next = (idx + 1) % s->syslog_entries;
+    s->syslog_inflight++;
+    apple_rtbuddy_send_msg(s, EP_SYSLOG,
+                           deposit64(idx, 52, 8, MSG_TYPE_SYSLOG_LOG));
+}
+
+MemTxResult apple_rtbuddy_ioreport_write(AppleRTBuddy *s, uint64_t offset,
+                                         const void *buf, uint64_t len)
+{
+    return apple_rtbuddy_buffer_write(s, &s->ioreport, offset, buf, len);
+}
+
+void apple_rtbuddy_crashlog(AppleRTBuddy *s, const void *buf, uint64_t len)
+{
+    if (apple_rtbuddy_buffer_write(s, &s->crashlog, 0, buf,
+                                   MIN(len, s->crashlog.size)) == MEMTX_OK) {
+        apple_rtbuddy_send_msg(
+            s, EP_CRASHLOG,
+            apple_rtbuddy_buffer_msg(MSG_TYPE_CRASHLOG_CRASH, &s->crashlog));
+    }
+}
+
 static gboolean iop_rollcall(gpointer key, gpointer value, gpointer data)
 {
     AppleRTBuddyRollcallData *d = (AppleRTBuddyRollcallData *)data;
@@ -161,6 +359,7 @@ static void iop_start_rollcall(AppleRTBuddy *s)
     msg = QTAILQ_FIRST(&s->rollcall);
     QTAILQ_REMOVE(&s->rollcall, msg, entry);
     apple_a7iop_send_ap(a7iop, msg);
+    g_free(msg);
 }
 
 static void apple_rtbuddy_handle_mgmt_msg(void *opaque, uint32_t ep,
@@ -189,6 +388,9 @@ static void apple_rtbuddy_handle_mgmt_msg(void *opaque, uint32_t ep,
         m.power.state = msg->power.state;
         apple_rtbuddy_send_msg(s, ep, m.raw);
         return;
+    case MSG_TYPE_EPSTART:
+        apple_rtbuddy_start_ep(s, msg->epstart.ep & 0xFF);
+        break;
     default:
         break;
     }
@@ -235,6 +437,7 @@ static void apple_rtbuddy_handle_mgmt_msg(void *opaque, uint32_t ep,
                 AppleA7IOPMessage *m = QTAILQ_FIRST(&s->rollcall);
                 QTAILQ_REMOVE(&s->rollcall, m, entry);
                 apple_a7iop_send_ap(a7iop, m);
+                g_free(m);
             }
             break;
         }
@@ -305,22 +508,29 @@ static void apple_rtbuddy_bh(void *opaque)
     AppleRTBuddy *s;
     AppleA7IOP *a7iop;
     AppleRTBuddyEPData *data;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
 
     s = APPLE_RTBUDDY(opaque);
     a7iop = APPLE_A7IOP(opaque);
 
+    /*
+     * On a dedicated thread the handlers still need the BQL, as they raise
+     * IRQs and touch device state. Take it before s->lock, matching the
+     * order on the main loop.
+     */
+    BQL_LOCK_GUARD();
     QEMU_LOCK_GUARD(&s->lock);
     while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
-        msg = apple_a7iop_recv_iop(a7iop);
-        data = g_tree_lookup(s->endpoints, GUINT_TO_POINTER(msg->endpoint));
+        if (!apple_a7iop_recv_iop(a7iop, &msg)) {
+            break;
+        }
+        data = msg.endpoint < EP_MAX ? s->ep_table[msg.endpoint] : NULL;
         if (data && data->handler) {
             data->handler(data->opaque,
-                          data->user ? msg->endpoint - EP_USER_START :
-                                       msg->endpoint,
-                          msg->msg);
+                          data->user ? msg.endpoint - EP_USER_START :
+                                       msg.endpoint,
+                          msg.msg);
         }
-        g_free(msg);
     }
 }
 
@@ -369,6 +579,59 @@ AppleRTBuddy *apple_rtbuddy_new(void *opaque, const char *role,
     return s;
 }
 
+static void apple_rtbuddy_realize(DeviceState *dev, Error **errp)
+{
+    AppleRTBuddy *s;
+    AppleRTBuddyClass *rtbc;
+    AppleA7IOP *a7iop;
+    g_autofree char *id = NULL;
+
+    s = APPLE_RTBUDDY(dev);
+    rtbc = APPLE_RTBUDDY_GET_CLASS(dev);
+    a7iop = APPLE_A7IOP(dev);
+
+    if (rtbc->parent_realize) {
+        rtbc->parent_realize(dev, errp);
+    }
+
+    if (!s->dedicated_thread) {
+        return;
+    }
+
+    // Move message dispatch off the main loop for this coprocessor.
+    id = g_strdup_printf("%s-rtbuddy", a7iop->role);
+    s->iothread = iothread_create(id, errp);
+    if (s->iothread == NULL) {
+        return;
+    }
+    qemu_bh_delete(a7iop->iop_mailbox->bh);
+    a7iop->iop_mailbox->bh = aio_bh_new(iothread_get_aio_context(s->iothread),
+                                        apple_rtbuddy_bh, s);
+}
+
+static void apple_rtbuddy_unrealize(DeviceState *dev)
+{
+    AppleRTBuddy *s;
+    AppleRTBuddyClass *rtbc;
+    AppleA7IOP *a7iop;
+
+    s = APPLE_RTBUDDY(dev);
+    rtbc = APPLE_RTBUDDY_GET_CLASS(dev);
+    a7iop = APPLE_A7IOP(dev);
+
+    if (s->iothread != NULL) {
+        // The BH runs in the IOThread's context, so it has to go first.
+        qemu_bh_delete(a7iop->iop_mailbox->bh);
+        a7iop->iop_mailbox->bh = NULL;
+        iothread_destroy(s->iothread);
+        s->iothread = NULL;
+    }
+
+    if (rtbc->parent_unrealize) {
+        rtbc->parent_unrealize(dev);
+    }
+}
+
 static void apple_rtbuddy_reset(DeviceState *dev)
 {
     AppleRTBuddy *s;
@@ -385,6 +648,11 @@ static void apple_rtbuddy_reset(DeviceState *dev)
     QEMU_LOCK_GUARD(&s->lock);
 
     s->ep0_status = EP0_IDLE;
+    s->crashlog.iova = 0;
+    s->syslog.iova = 0;
+    s->ioreport.iova = 0;
+    s->syslog_next = 0;
+    s->syslog_inflight = 0;
 
     while (!QTAILQ_EMPTY(&s->rollcall)) {
         msg = QTAILQ_FIRST(&s->rollcall);
@@ -393,6 +661,68 @@ static void apple_rtbuddy_reset(DeviceState *dev)
     }
 }
 
+static Property apple_rtbuddy_props[] = {
+    DEFINE_PROP_BOOL("dedicated-thread", AppleRTBuddy, dedicated_thread,
+                     false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_apple_rtbuddy_rollcall_msg = {
+    .name = "apple_rtbuddy_rollcall_msg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64_ARRAY(data, AppleA7IOPMessage, 2),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static bool apple_rtbuddy_buffers_needed(void *opaque)
+{
+    AppleRTBuddy *s = opaque;
+
+    return s->crashlog.iova || s->syslog.iova || s->ioreport.iova;
+}
+
+static const VMStateDescription vmstate_apple_rtbuddy_buffers = {
+    .name = "apple_rtbuddy/buffers",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = apple_rtbuddy_buffers_needed,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64(crashlog.iova, AppleRTBuddy),
+            VMSTATE_UINT64(syslog.iova, AppleRTBuddy),
+            VMSTATE_UINT64(ioreport.iova, AppleRTBuddy),
+            VMSTATE_UINT32(syslog_next, AppleRTBuddy),
+            VMSTATE_UINT32(syslog_inflight, AppleRTBuddy),
+            VMSTATE_END_OF_LIST(),
+        },
+};
+
+/* Endpoints are registered by the owning device and are not migrated. */
+const VMStateDescription vmstate_apple_rtbuddy = {
+    .name = "apple_rtbuddy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_STRUCT(parent_obj, AppleRTBuddy, 1, vmstate_apple_a7iop,
+                           AppleA7IOP),
+            VMSTATE_UINT32(ep0_status, AppleRTBuddy),
+            VMSTATE_QTAILQ_V(rollcall, AppleRTBuddy, 1,
+                             vmstate_apple_rtbuddy_rollcall_msg,
+                             AppleA7IOPMessage, entry),
+            VMSTATE_END_OF_LIST(),
+        },
+    .subsections =
+        (const VMStateDescription *const[]){
+            &vmstate_apple_rtbuddy_buffers,
+            NULL,
+        },
+};
+
 static void apple_rtbuddy_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc;
@@ -402,6 +732,12 @@ static void apple_rtbuddy_class_init(ObjectClass *oc, void *data)
     rtbc = APPLE_RTBUDDY_CLASS(oc);
 
     dc->desc = "Apple RTBuddy IOP";
+    dc->vmsd = &vmstate_apple_rtbuddy;
+    device_class_set_props(dc, apple_rtbuddy_props);
+    device_class_set_parent_realize(dc, apple_rtbuddy_realize,
+                                    &rtbc->parent_realize);
+    device_class_set_parent_unrealize(dc, apple_rtbuddy_unrealize,
+                                      &rtbc->parent_unrealize);
     device_class_set_parent_reset(dc, apple_rtbuddy_reset, &rtbc->parent_reset);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
@@ -1,9 +1,15 @@
 #include "qemu/osdep.h"
+#include "crypto/aes-round.h"
+#include "crypto/aes.h"
 #include "crypto/cipher.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/stats.h"
+#include "hw/dma/apple_dma.h"
 #include "hw/irq.h"
 #include "hw/misc/apple-silicon/aes.h"
 #include "hw/misc/apple-silicon/aes_reg.h"
+#include "hw/misc/apple-silicon/worker.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/bitops.h"
@@ -11,8 +17,13 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/range.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
 #include "sysemu/dma.h"
+#include "sysemu/stats.h"
 #include "trace.h"
 
 OBJECT_DECLARE_SIMPLE_TYPE(AppleAESState, APPLE_AES)
@@ -21,11 +32,28 @@ typedef struct AESCommand {
     uint32_t command;
     uint32_t *data;
     uint32_t data_len;
+    /* Yielded to a worker pause with part of its data still to go. */
+    bool partial;
     QTAILQ_ENTRY(AESCommand) entry;
 } AESCommand;
 
+/*
+ * A prepared key, run either by the qcrypto backend QEMU was built with or,
+ * for the modes where the host's AES instructions were measured to be
+ * faster, directly on those.
+ */
+typedef struct AESCipher {
+    /* NULL when running on the host's AES instructions. */
+    QCryptoCipher *qcrypto;
+    block_mode_t mode;
+    int rounds;
+    AESState ek[AES_MAXNR + 1];
+    AESState dk[AES_MAXNR + 1];
+    AESState iv;
+} AESCipher;
+
 typedef struct AESKey {
-    QCryptoCipher *cipher;
+    AESCipher *cipher;
     key_select_t select;
     QCryptoCipherAlgorithm algo;
     uint8_t key[32];
@@ -38,17 +66,70 @@ typedef struct AESKey {
     uint8_t id;
 } AESKey;
 
+#define AES_CIPHER_CACHE_SIZE (8)
+
+/*
+ * A prepared cipher that is not loaded in any key context, kept around so
+ * that the guest reloading the same key is a lookup instead of a fresh
+ * qcrypto_cipher_new().
+ */
+typedef struct AESCipherCacheEntry {
+    AESCipher *cipher;
+    QCryptoCipherAlgorithm algo;
+    block_mode_t mode;
+    uint32_t len;
+    uint8_t key[32];
+} AESCipherCacheEntry;
+
+#define AES_LANE_MAX_COMMANDS (32)
+
+/* How much of a DATA command runs before checking for a worker pause. */
+#define AES_DATA_CHUNK_SIZE (256 * KiB)
+
+/*
+ * The I/O side of a bounce-buffered DATA pipeline: one step writes a
+ * ciphered chunk back and reads the next one ahead, on its own thread, while
+ * the caller ciphers the chunk in between. There is one per key context,
+ * since a context's DATA commands only ever run on one thread at a time.
+ */
+typedef struct AESPipe {
+    AppleAESState *s;
+    QemuThread thread;
+    QemuSemaphore start;
+    QemuSemaphore done;
+    bool exit;
+    uint8_t *buf[3];
+    dma_addr_t read_addr;
+    uint8_t *read_buf;
+    uint32_t read_len;
+    dma_addr_t write_addr;
+    const uint8_t *write_buf;
+    uint32_t write_len;
+} AESPipe;
+
+/*
+ * A run of DATA commands on one key context that can execute concurrently
+ * with the other context's lane.
+ */
+typedef struct AESLane {
+    AESCommand *cmds[AES_LANE_MAX_COMMANDS];
+    uint32_t count;
+    /* Commands run to completion, the rest go back on the queue. */
+    uint32_t done;
+    uint32_t iv_ctx_mask;
+} AESLane;
+
 struct AppleAESState {
     SysBusDevice parent_obj;
     MemoryRegion iomems[2];
     MemoryRegion *dma_mr;
     AddressSpace dma_as;
+    AppleDMA dma;
     qemu_irq irq;
     int last_level;
     aes_reg_t reg;
     QemuMutex mutex;
-    QemuThread thread;
-    QemuCond thread_cond;
+    AppleWorker worker;
     QemuMutex queue_mutex;
     QTAILQ_HEAD(, AESCommand) queue;
     uint32_t command;
@@ -57,7 +138,30 @@ struct AppleAESState {
     uint32_t data_read;
     AESKey keys[2];
     uint8_t iv[4][16];
+    /* Most recently used first. Only touched by the worker thread. */
+    AESCipherCacheEntry cipher_cache[AES_CIPHER_CACHE_SIZE];
+    uint32_t cipher_cache_count;
+    bool parallel_data;
+    QemuThread lane_thread;
+    QemuSemaphore lane_start;
+    QemuSemaphore lane_done;
+    AESLane lanes[2];
+    bool lane_exit;
+    bool pipeline_data;
+    AESPipe pipes[2];
     bool stopped;
+    /* Payload bytes run through the cipher, for query-stats. */
+    Stat64 bytes;
+    OnOffAuto native_crypto;
+    /* Block modes run on the host's AES instructions, by BIT(mode). */
+    uint32_t native_modes;
+    /*
+     * Measured at realize for the backend picked, in bytes per second, with
+     * native-crypto=auto only.
+     */
+    uint64_t throughput[BLOCK_MODE_CTR + 1];
+    /* Where the worker, lane and pipe threads are started, if set. */
+    ThreadContext *thread_context;
 };
 
 static uint32_t key_size(uint8_t len)
@@ -103,7 +207,6 @@ static QCryptoCipherMode key_mode(block_mode_t mode)
 }
 
 static void apple_aes_reset(DeviceState *s);
-static void *aes_thread(void *opaque);
 
 static void aes_update_irq(AppleAESState *s)
 {
@@ -155,20 +258,475 @@ static void aes_empty_fifo(AppleAESState *s)
 
 static void aes_start(AppleAESState *s)
 {
-    if (s->stopped) {
-        s->stopped = false;
-        qemu_thread_create(&s->thread, TYPE_APPLE_AES, aes_thread, s,
-                           QEMU_THREAD_JOINABLE);
+    if (qatomic_read(&s->stopped)) {
+        qatomic_set(&s->stopped, false);
+        apple_worker_kick(&s->worker);
     }
 }
 
+/*
+ * Once this returns nothing is executing; a DATA command that was cut short
+ * keeps its remainder at the head of the queue.
+ */
 static void aes_stop(AppleAESState *s)
 {
-    if (!s->stopped) {
-        s->stopped = true;
-        qemu_cond_signal(&s->thread_cond);
-        qemu_thread_join(&s->thread);
+    qatomic_set(&s->stopped, true);
+    apple_worker_pause(&s->worker);
+    apple_worker_resume(&s->worker);
+}
+
+static bool aes_native_available(void)
+{
+    return HAVE_AES_ACCEL && !HOST_BIG_ENDIAN;
+}
+
+static void aes_native_encrypt_block(const AESCipher *c, AESState *st)
+{
+    int i;
+
+    st->v ^= c->ek[0].v;
+    for (i = 1; i < c->rounds; i++) {
+        aesenc_SB_SR_MC_AK(st, st, &c->ek[i], false);
+    }
+    aesenc_SB_SR_AK(st, st, &c->ek[c->rounds], false);
+}
+
+/* The decryption schedule is the equivalent inverse cipher's. */
+static void aes_native_decrypt_block(const AESCipher *c, AESState *st)
+{
+    int i;
+
+    st->v ^= c->dk[0].v;
+    for (i = 1; i < c->rounds; i++) {
+        aesdec_ISB_ISR_IMC_AK(st, st, &c->dk[i], false);
+    }
+    aesdec_ISB_ISR_AK(st, st, &c->dk[c->rounds], false);
+}
+
+static void aes_native_crypt(AESCipher *c, bool encrypt, const uint8_t *in,
+                             uint8_t *out, size_t len)
+{
+    AESState st;
+    AESState t;
+    size_t off;
+    int i;
+
+    for (off = 0; off + 16 <= len; off += 16) {
+        memcpy(&st, in + off, 16);
+        switch (c->mode) {
+        case BLOCK_MODE_ECB:
+            if (encrypt) {
+                aes_native_encrypt_block(c, &st);
+            } else {
+                aes_native_decrypt_block(c, &st);
+            }
+            break;
+        case BLOCK_MODE_CBC:
+            if (encrypt) {
+                st.v ^= c->iv.v;
+                aes_native_encrypt_block(c, &st);
+                c->iv = st;
+            } else {
+                t = st;
+                aes_native_decrypt_block(c, &st);
+                st.v ^= c->iv.v;
+                c->iv = t;
+            }
+            break;
+        case BLOCK_MODE_CTR:
+            t = c->iv;
+            aes_native_encrypt_block(c, &t);
+            st.v ^= t.v;
+            /* A 128-bit big-endian counter, as the qcrypto backends use. */
+            for (i = 15; i >= 0; i--) {
+                if (++c->iv.b[i] != 0) {
+                    break;
+                }
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        memcpy(out + off, &st, 16);
+    }
+}
+
+static AESCipher *aes_cipher_new(AppleAESState *s, AESKey *key)
+{
+    AESCipher *c = g_new0(AESCipher, 1);
+    AES_KEY ek;
+    AES_KEY dk;
+    int i;
+
+    c->mode = key->mode;
+    if (!(s->native_modes & BIT(key->mode))) {
+        c->qcrypto = qcrypto_cipher_new(key->algo, key_mode(key->mode),
+                                        key->key, key->len, &error_abort);
+        return c;
+    }
+
+    g_assert_cmpint(AES_set_encrypt_key(key->key, key->len * 8, &ek), ==, 0);
+    g_assert_cmpint(AES_set_decrypt_key(key->key, key->len * 8, &dk), ==, 0);
+    c->rounds = ek.rounds;
+    for (i = 0; i < 4 * (c->rounds + 1); i++) {
+        stl_be_p(&c->ek[i / 4].w[i % 4], ek.rd_key[i]);
+        stl_be_p(&c->dk[i / 4].w[i % 4], dk.rd_key[i]);
+    }
+    return c;
+}
+
+static void aes_cipher_free(AESCipher *c)
+{
+    if (c != NULL) {
+        qcrypto_cipher_free(c->qcrypto);
+        g_free(c);
+    }
+}
+
+static void aes_cipher_setiv(AESCipher *c, const uint8_t *iv, Error **errp)
+{
+    if (c->qcrypto == NULL) {
+        memcpy(c->iv.b, iv, 16);
+    } else {
+        qcrypto_cipher_setiv(c->qcrypto, iv, 16, errp);
+    }
+}
+
+static void aes_cipher_getiv(AESCipher *c, uint8_t *iv, Error **errp)
+{
+    if (c->qcrypto == NULL) {
+        memcpy(iv, c->iv.b, 16);
+    } else {
+        qcrypto_cipher_getiv(c->qcrypto, iv, 16, errp);
+    }
+}
+
+/* Hands out a cipher for the key, taking it out of the cache on a hit. */
+static AESCipher *aes_cipher_cache_get(AppleAESState *s, AESKey *key)
+{
+    AESCipher *cipher;
+    uint32_t i;
+
+    for (i = 0; i < s->cipher_cache_count; i++) {
+        AESCipherCacheEntry *e = &s->cipher_cache[i];
+        if (e->algo == key->algo && e->mode == key->mode &&
+            e->len == key->len && memcmp(e->key, key->key, key->len) == 0) {
+            cipher = e->cipher;
+            s->cipher_cache_count--;
+            memmove(e, e + 1, (s->cipher_cache_count - i) * sizeof(*e));
+            memset(&s->cipher_cache[s->cipher_cache_count], 0, sizeof(*e));
+            return cipher;
+        }
+    }
+
+    return aes_cipher_new(s, key);
+}
+
+/* Returns the key's cipher to the cache, evicting the least recently used. */
+static void aes_cipher_cache_put(AppleAESState *s, AESKey *key)
+{
+    AESCipherCacheEntry *e = &s->cipher_cache[0];
+
+    if (key->cipher == NULL) {
+        return;
+    }
+    if (s->cipher_cache_count == AES_CIPHER_CACHE_SIZE) {
+        s->cipher_cache_count--;
+        aes_cipher_free(s->cipher_cache[s->cipher_cache_count].cipher);
     }
+    memmove(e + 1, e, s->cipher_cache_count * sizeof(*e));
+    s->cipher_cache_count++;
+
+    e->cipher = key->cipher;
+    e->algo = key->algo;
+    e->mode = key->mode;
+    e->len = key->len;
+    memcpy(e->key, key->key, key->len);
+    key->cipher = NULL;
+}
+
+static void aes_cipher_cache_flush(AppleAESState *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->cipher_cache_count; i++) {
+        aes_cipher_free(s->cipher_cache[i].cipher);
+    }
+    memset(s->cipher_cache, 0, sizeof(s->cipher_cache));
+    s->cipher_cache_count = 0;
+}
+
+static void aes_cipher(AESKey *key, const void *in, void *out, size_t len,
+                       Error **errp)
+{
+    if (key->cipher->qcrypto == NULL) {
+        aes_native_crypt(key->cipher, key->encrypt, in, out, len);
+    } else if (key->encrypt) {
+        qcrypto_cipher_encrypt(key->cipher->qcrypto, in, out, len, errp);
+    } else {
+        qcrypto_cipher_decrypt(key->cipher->qcrypto, in, out, len, errp);
+    }
+}
+
+#define AES_CALIBRATE_SIZE (64 * KiB)
+#define AES_CALIBRATE_ROUNDS (8)
+
+static uint64_t aes_calibrate_one(AppleAESState *s, AESKey *key, bool native,
+                                  uint8_t *buf)
+{
+    static const uint8_t iv[16];
+    int64_t start;
+    int64_t elapsed;
+    int i;
+
+    if (native) {
+        s->native_modes |= BIT(key->mode);
+    } else {
+        s->native_modes &= ~BIT(key->mode);
+    }
+    key->cipher = aes_cipher_new(s, key);
+    aes_cipher_setiv(key->cipher, iv, NULL);
+    start = get_clock();
+    for (i = 0; i < AES_CALIBRATE_ROUNDS; i++) {
+        aes_cipher(key, buf, buf, AES_CALIBRATE_SIZE, &error_abort);
+    }
+    elapsed = MAX(get_clock() - start, 1);
+    aes_cipher_free(key->cipher);
+    key->cipher = NULL;
+
+    return (uint64_t)AES_CALIBRATE_SIZE * AES_CALIBRATE_ROUNDS *
+           NANOSECONDS_PER_SECOND / elapsed;
+}
+
+/*
+ * The qcrypto backends differ a lot in speed, and not all of them use the
+ * host's AES instructions for every mode. With native-crypto=auto, time the
+ * backend against those instructions for each block mode and keep the
+ * faster one. That takes a while and depends on the host's load, so it is
+ * not the default: on and off just pick a side.
+ */
+static bool aes_select_backend(AppleAESState *s, Error **errp)
+{
+    static const char *const mode_names[] = { "ecb", "cbc", "ctr" };
+    g_autofree uint8_t *buf = NULL;
+    AESKey key = {
+        .algo = QCRYPTO_CIPHER_ALG_AES_256,
+        .len = 32,
+        .encrypt = true,
+    };
+    uint64_t qcrypto_bps;
+    uint64_t native_bps;
+    block_mode_t mode;
+
+    s->native_modes = 0;
+    memset(s->throughput, 0, sizeof(s->throughput));
+    switch (s->native_crypto) {
+    case ON_OFF_AUTO_OFF:
+        return true;
+    case ON_OFF_AUTO_ON:
+        if (!aes_native_available()) {
+            error_setg(errp, "native-crypto: the host has no usable AES "
+                             "instructions");
+            return false;
+        }
+        s->native_modes = BIT(BLOCK_MODE_ECB) | BIT(BLOCK_MODE_CBC) |
+                          BIT(BLOCK_MODE_CTR);
+        return true;
+    default:
+        break;
+    }
+
+    buf = g_malloc0(AES_CALIBRATE_SIZE);
+    for (mode = BLOCK_MODE_ECB; mode <= BLOCK_MODE_CTR; mode++) {
+        key.mode = mode;
+        native_bps = 0;
+
+        qcrypto_bps = aes_calibrate_one(s, &key, false, buf);
+        if (aes_native_available()) {
+            native_bps = aes_calibrate_one(s, &key, true, buf);
+        }
+        if (native_bps > qcrypto_bps) {
+            s->native_modes |= BIT(mode);
+        } else {
+            s->native_modes &= ~BIT(mode);
+        }
+        s->throughput[mode] = MAX(native_bps, qcrypto_bps);
+        trace_apple_aes_backend(mode_names[mode],
+                                (s->native_modes & BIT(mode)) != 0,
+                                qcrypto_bps, native_bps);
+    }
+    return true;
+}
+
+/*
+ * Runs the cipher directly between the mapped source and destination. Returns
+ * false, having touched nothing, if either side cannot be mapped in one piece
+ * or the two partially overlap, so the caller falls back to a bounce buffer.
+ */
+static bool aes_process_data_mapped(AppleAESState *s, AESKey *key,
+                                    dma_addr_t source_addr,
+                                    dma_addr_t dest_addr, uint32_t len,
+                                    Error **errp)
+{
+    AppleDMAMap *src_map;
+    AppleDMAMap *dst_map;
+    uint8_t *src;
+    uint8_t *dst;
+    bool ok = false;
+
+    RCU_READ_LOCK_GUARD();
+
+    src_map = apple_dma_map(&s->dma, source_addr, len, DMA_DIRECTION_TO_DEVICE);
+    if (src_map == NULL) {
+        return false;
+    }
+    dst_map = apple_dma_map(&s->dma, dest_addr, len, DMA_DIRECTION_FROM_DEVICE);
+    if (dst_map != NULL && src_map->iov.niov == 1 && dst_map->iov.niov == 1) {
+        src = src_map->iov.iov[0].iov_base;
+        dst = dst_map->iov.iov[0].iov_base;
+        if (src == dst || src + len <= dst || dst + len <= src) {
+            aes_cipher(key, src, dst, len, errp);
+            ok = true;
+        }
+    }
+    if (dst_map != NULL) {
+        apple_dma_unmap(&s->dma, dst_map, ok ? len : 0);
+    }
+    apple_dma_unmap(&s->dma, src_map, 0);
+    return ok;
+}
+
+static void aes_pipe_io(AESPipe *p)
+{
+    if (p->write_len) {
+        apple_dma_write(&p->s->dma, p->write_addr, p->write_buf, p->write_len);
+    }
+    if (p->read_len) {
+        WITH_RCU_READ_LOCK_GUARD()
+        {
+            apple_dma_read(&p->s->dma, p->read_addr, p->read_buf, p->read_len);
+        }
+    }
+}
+
+static void *aes_pipe_thread(void *opaque)
+{
+    AESPipe *p = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&p->start);
+        if (p->exit) {
+            break;
+        }
+        aes_pipe_io(p);
+        qemu_sem_post(&p->done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Whether a bounce-buffered DATA command can be pipelined: the I/O of one
+ * step reads a chunk after the one it writes back, which only gives the
+ * in-order result if source and destination are the same or disjoint.
+ */
+static bool aes_pipe_usable(AppleAESState *s, dma_addr_t source_addr,
+                            dma_addr_t dest_addr, uint32_t len)
+{
+    return s->pipeline_data && len > AES_DATA_CHUNK_SIZE &&
+           (source_addr == dest_addr ||
+            !ranges_overlap(source_addr, len, dest_addr, len));
+}
+
+/*
+ * Runs DATA through bounce buffers in three stages: while chunk N is
+ * ciphered here, the pipe writes chunk N-1 back and reads chunk N+1 ahead.
+ * Advances the addresses and length past what has been written back, which
+ * is everything unless the worker should yield; a chunk read ahead for a
+ * yield is simply read again on resume.
+ */
+static void aes_process_data_pipelined(AppleAESState *s, AESPipe *p,
+                                       AESKey *key, dma_addr_t *source_addr,
+                                       dma_addr_t *dest_addr, uint32_t *len,
+                                       Error **errp)
+{
+    uint32_t chunk = MIN(*len, AES_DATA_CHUNK_SIZE);
+    uint32_t off = 0;
+    uint32_t next;
+    uint8_t *cur;
+    uint32_t i;
+
+    if (p->buf[0] == NULL) {
+        for (i = 0; i < ARRAY_SIZE(p->buf); i++) {
+            p->buf[i] = g_malloc(AES_DATA_CHUNK_SIZE);
+        }
+    }
+
+    p->write_len = 0;
+    p->read_addr = *source_addr;
+    p->read_buf = p->buf[0];
+    p->read_len = chunk;
+    aes_pipe_io(p);
+
+    for (i = 0;; i++) {
+        cur = p->buf[i % 3];
+        next = MIN(*len - off - chunk, AES_DATA_CHUNK_SIZE);
+
+        p->read_addr = *source_addr + off + chunk;
+        p->read_buf = p->buf[(i + 1) % 3];
+        p->read_len = next;
+        qemu_sem_post(&p->start);
+        aes_cipher(key, cur, cur, chunk, errp);
+        qemu_sem_wait(&p->done);
+        stat64_add(&s->bytes, chunk);
+
+        p->write_addr = *dest_addr + off;
+        p->write_buf = cur;
+        p->write_len = chunk;
+        off += chunk;
+        chunk = next;
+        if (chunk == 0 || apple_worker_should_yield(&s->worker)) {
+            break;
+        }
+    }
+
+    p->read_len = 0;
+    aes_pipe_io(p);
+
+    *source_addr += off;
+    *dest_addr += off;
+    *len -= off;
+}
+
+static dma_addr_t aes_data_source_addr(const command_data_t *c)
+{
+    return c->source_addr |
+           ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_SOURCE(c->upper_addr)) << 32;
+}
+
+static dma_addr_t aes_data_dest_addr(const command_data_t *c)
+{
+    return c->dest_addr |
+           ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_DEST(c->upper_addr)) << 32;
+}
+
+/* Rewrites @c in place to cover only the part that has not run yet. */
+static void aes_data_set_remainder(command_data_t *c, dma_addr_t source_addr,
+                                   dma_addr_t dest_addr, uint32_t len)
+{
+    c->command = (c->command & ~COMMAND_DATA_COMMAND_LENGTH_MASK) | len;
+    c->upper_addr = (c->upper_addr &
+                     ~((COMMAND_DATA_UPPER_ADDR_SOURCE_MASK
+                        << COMMAND_DATA_UPPER_ADDR_SOURCE_SHIFT) |
+                       (COMMAND_DATA_UPPER_ADDR_DEST_MASK
+                        << COMMAND_DATA_UPPER_ADDR_DEST_SHIFT))) |
+                    (((source_addr >> 32) & COMMAND_DATA_UPPER_ADDR_SOURCE_MASK)
+                     << COMMAND_DATA_UPPER_ADDR_SOURCE_SHIFT) |
+                    (((dest_addr >> 32) & COMMAND_DATA_UPPER_ADDR_DEST_MASK)
+                     << COMMAND_DATA_UPPER_ADDR_DEST_SHIFT);
+    c->source_addr = source_addr;
+    c->dest_addr = dest_addr;
 }
 
 static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
@@ -183,6 +741,7 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
     switch (COMMAND_OPCODE(cmd->command)) {
     case OPCODE_KEY: {
         uint32_t ctx = COMMAND_KEY_COMMAND_KEY_CONTEXT(cmd->command);
+        aes_cipher_cache_put(s, &s->keys[ctx]);
         s->keys[ctx].select = COMMAND_KEY_COMMAND_KEY_SELECT(cmd->command);
         s->keys[ctx].algo =
             key_algo(COMMAND_KEY_COMMAND_KEY_LENGTH(cmd->command));
@@ -196,16 +755,6 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         s->keys[ctx].mode = COMMAND_KEY_COMMAND_BLOCK_MODE(cmd->command);
         s->keys[ctx].id = COMMAND_KEY_COMMAND_COMMAND_ID(cmd->command);
         memcpy(s->keys[ctx].key, &cmd->data[1], s->keys[ctx].len);
-        if (ctx) {
-            s->reg.key_id.context_1 = s->keys[ctx].id;
-        } else {
-            s->reg.key_id.context_0 = s->keys[ctx].id;
-        }
-        if (s->keys[ctx].cipher) {
-            qcrypto_cipher_free(s->keys[ctx].cipher);
-            s->keys[ctx].cipher = NULL;
-        }
-        lock_reg();
         if (s->keys[ctx].select != KEY_SELECT_SOFTWARE) {
             s->keys[ctx].disabled = true;
             if (ctx) {
@@ -230,9 +779,14 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
                 qatomic_and(&s->reg.int_status.raw,
                             ~AES_BLK_INT_KEY_0_DISABLED);
             }
-            s->keys[ctx].cipher = qcrypto_cipher_new(
-                s->keys[ctx].algo, key_mode(s->keys[ctx].mode),
-                s->keys[ctx].key, s->keys[ctx].len, &error_abort);
+            s->keys[ctx].cipher = aes_cipher_cache_get(s, &s->keys[ctx]);
+        }
+        /* KEY_ID is read by MMIO under the BQL, and is not a whole word. */
+        lock_reg();
+        if (ctx) {
+            s->reg.key_id.context_1 = s->keys[ctx].id;
+        } else {
+            s->reg.key_id.context_0 = s->keys[ctx].id;
         }
         break;
     }
@@ -246,22 +800,17 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         uint32_t key_ctx = COMMAND_DATA_COMMAND_KEY_CONTEXT(c->command);
         uint32_t iv_ctx = COMMAND_DATA_COMMAND_IV_CONTEXT(c->command);
         uint32_t len = COMMAND_DATA_COMMAND_LENGTH(c->command);
-        dma_addr_t source_addr = c->source_addr;
-        dma_addr_t dest_addr = c->dest_addr;
+        dma_addr_t source_addr = aes_data_source_addr(c);
+        dma_addr_t dest_addr = aes_data_dest_addr(c);
+        AESKey *key = &s->keys[key_ctx];
         g_autofree uint8_t *buffer = NULL;
         g_autofree Error *errp = NULL;
 
-        source_addr |=
-            ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_SOURCE(c->upper_addr)) << 32;
-        dest_addr |= ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_DEST(c->upper_addr))
-                     << 32;
         if (len & 0xf) {
-            lock_reg();
             qatomic_or(&s->reg.int_status.raw, AES_BLK_INT_INVALID_DATA_LENGTH);
             break;
         }
         if (s->keys[key_ctx].disabled || !s->keys[key_ctx].cipher) {
-            lock_reg();
             if (key_ctx) {
                 qatomic_or(&s->reg.int_status.raw, AES_BLK_INT_KEY_1_DISABLED);
             } else {
@@ -270,25 +819,51 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
             break;
         }
 
-        buffer = g_malloc0(len);
+        aes_cipher_setiv(key->cipher, s->iv[iv_ctx], &errp);
+
+        /*
+         * The cipher carries the chaining state from one chunk to the
+         * next, and the IV context carries it across a pause.
+         */
+        while (len) {
+            uint32_t chunk = MIN(len, AES_DATA_CHUNK_SIZE);
+
+            if (!aes_process_data_mapped(s, key, source_addr, dest_addr, chunk,
+                                         &errp)) {
+                if (aes_pipe_usable(s, source_addr, dest_addr, len)) {
+                    aes_process_data_pipelined(s, &s->pipes[key_ctx], key,
+                                               &source_addr, &dest_addr, &len,
+                                               &errp);
+                    if (len) {
+                        aes_data_set_remainder(c, source_addr, dest_addr, len);
+                        cmd->partial = true;
+                    }
+                    break;
+                }
+                if (buffer == NULL) {
+                    buffer = g_malloc0(chunk);
+                }
 
-        WITH_RCU_READ_LOCK_GUARD()
-        {
-            dma_memory_read(&s->dma_as, source_addr, buffer, len,
-                            MEMTXATTRS_UNSPECIFIED);
-        }
-        qcrypto_cipher_setiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
+                WITH_RCU_READ_LOCK_GUARD()
+                {
+                    apple_dma_read(&s->dma, source_addr, buffer, chunk);
+                }
 
-        if (s->keys[key_ctx].encrypt) {
-            qcrypto_cipher_encrypt(s->keys[key_ctx].cipher, buffer, buffer, len,
-                                   &errp);
-        } else {
-            qcrypto_cipher_decrypt(s->keys[key_ctx].cipher, buffer, buffer, len,
-                                   &errp);
+                aes_cipher(key, buffer, buffer, chunk, &errp);
+                apple_dma_write(&s->dma, dest_addr, buffer, chunk);
+            }
+            stat64_add(&s->bytes, chunk);
+            source_addr += chunk;
+            dest_addr += chunk;
+            len -= chunk;
+
+            if (len && apple_worker_should_yield(&s->worker)) {
+                aes_data_set_remainder(c, source_addr, dest_addr, len);
+                cmd->partial = true;
+                break;
+            }
         }
-        qcrypto_cipher_getiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
-        dma_memory_write(&s->dma_as, dest_addr, buffer, len,
-                         MEMTXATTRS_UNSPECIFIED);
+        aes_cipher_getiv(key->cipher, s->iv[iv_ctx], &errp);
         break;
     }
     case OPCODE_STORE_IV: {
@@ -299,8 +874,7 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         dest_addr |=
             ((dma_addr_t)COMMAND_STORE_IV_COMMAND_UPPER_ADDR_DEST(c->command))
             << 32;
-        dma_memory_write(&s->dma_as, dest_addr, s->iv[ctx], 16,
-                         MEMTXATTRS_UNSPECIFIED);
+        apple_dma_write(&s->dma, dest_addr, s->iv[ctx], 16);
         break;
     }
     case OPCODE_FLAG:
@@ -308,14 +882,13 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         qatomic_set(&s->reg.flag_command.code,
                     COMMAND_FLAG_ID_CODE(cmd->command));
         if (cmd->command & COMMAND_FLAG_STOP_COMMANDS) {
-            s->stopped = true;
+            qatomic_set(&s->stopped, true);
         }
         if (cmd->command & COMMAND_FLAG_SEND_INTERRUPT) {
             qatomic_or(&s->reg.int_status.raw, AES_BLK_INT_FLAG_COMMAND);
         }
         break;
     default:
-        lock_reg();
         qatomic_or(&s->reg.int_status.raw, AES_BLK_INT_INVALID_COMMAND);
         break;
     }
@@ -324,41 +897,197 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
 #undef lock_reg
 }
 
-static void *aes_thread(void *opaque)
+static void aes_process_lane(AppleAESState *s, AESLane *lane)
+{
+    while (lane->done < lane->count) {
+        AESCommand *cmd = lane->cmds[lane->done];
+
+        if (apple_worker_should_yield(&s->worker)) {
+            break;
+        }
+        aes_process_command(s, cmd);
+        if (cmd->partial) {
+            break;
+        }
+        lane->done++;
+    }
+}
+
+static void *aes_lane_thread(void *opaque)
 {
     AppleAESState *s = APPLE_AES(opaque);
     rcu_register_thread();
-    while (!s->stopped) {
-        AESCommand *cmd = NULL;
+    for (;;) {
+        qemu_sem_wait(&s->lane_start);
+        if (s->lane_exit) {
+            break;
+        }
+        aes_process_lane(s, &s->lanes[1]);
+        qemu_sem_post(&s->lane_done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Whether DATA command @cmd may join the lane of its key context without
+ * changing the result relative to running the FIFO in order: it must not
+ * share an IV context with the other lane, and its buffers must not
+ * overlap anything the other lane writes, or read what it would write.
+ */
+static bool aes_lane_accepts(AppleAESState *s, AESCommand *cmd)
+{
+    const command_data_t *c = (const command_data_t *)cmd->data;
+    uint32_t key_ctx = COMMAND_DATA_COMMAND_KEY_CONTEXT(c->command);
+    uint32_t iv_ctx = COMMAND_DATA_COMMAND_IV_CONTEXT(c->command);
+    uint32_t len = COMMAND_DATA_COMMAND_LENGTH(c->command);
+    AESLane *other = &s->lanes[key_ctx ^ 1];
+    uint32_t i;
+
+    if (s->lanes[key_ctx].count == AES_LANE_MAX_COMMANDS ||
+        (other->iv_ctx_mask & BIT(iv_ctx))) {
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+    for (i = 0; i < other->count; i++) {
+        const command_data_t *o = (const command_data_t *)other->cmds[i]->data;
+        uint32_t olen = COMMAND_DATA_COMMAND_LENGTH(o->command);
+
+        if (olen == 0) {
+            continue;
+        }
+        if (ranges_overlap(aes_data_dest_addr(c), len, aes_data_source_addr(o),
+                           olen) ||
+            ranges_overlap(aes_data_dest_addr(c), len, aes_data_dest_addr(o),
+                           olen) ||
+            ranges_overlap(aes_data_source_addr(c), len, aes_data_dest_addr(o),
+                           olen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void aes_lane_add(AppleAESState *s, AESCommand *cmd)
+{
+    const command_data_t *c = (const command_data_t *)cmd->data;
+    AESLane *lane = &s->lanes[COMMAND_DATA_COMMAND_KEY_CONTEXT(c->command)];
+
+    lane->cmds[lane->count++] = cmd;
+    lane->iv_ctx_mask |= BIT(COMMAND_DATA_COMMAND_IV_CONTEXT(c->command));
+}
+
+/*
+ * Pulls the run of independent DATA commands following @first off the
+ * queue and executes the two key contexts' lanes side by side. Any other
+ * opcode, and any DATA command that depends on the other lane, ends the
+ * run, so KEY/IV/STORE_IV/FLAG keep their barrier semantics. Returns the
+ * number of FIFO words consumed; finished commands are freed. Whatever a
+ * pause cut short goes back to the head of the queue, lane 0 first, which
+ * is a valid order since the lanes never depend on each other.
+ */
+static uint32_t aes_process_data_batch(AppleAESState *s, AESCommand *first)
+{
+    AESCommand *cmd;
+    uint32_t consumed = 0;
+    uint32_t i, j;
+
+    memset(s->lanes, 0, sizeof(s->lanes));
+    aes_lane_add(s, first);
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        while ((cmd = QTAILQ_FIRST(&s->queue)) != NULL &&
+               COMMAND_OPCODE(cmd->command) == OPCODE_DATA &&
+               aes_lane_accepts(s, cmd)) {
+            QTAILQ_REMOVE(&s->queue, cmd, entry);
+            aes_lane_add(s, cmd);
+        }
+    }
+
+    if (s->lanes[0].count && s->lanes[1].count) {
+        qemu_sem_post(&s->lane_start);
+        aes_process_lane(s, &s->lanes[0]);
+        qemu_sem_wait(&s->lane_done);
+    } else {
+        aes_process_lane(s, &s->lanes[0]);
+        aes_process_lane(s, &s->lanes[1]);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s->lanes); i++) {
+        for (j = 0; j < s->lanes[i].done; j++) {
+            cmd = s->lanes[i].cmds[j];
+            consumed += cmd->data_len;
+            g_free(cmd->data);
+            g_free(cmd);
+        }
+    }
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        for (i = ARRAY_SIZE(s->lanes); i-- > 0;) {
+            for (j = s->lanes[i].count; j-- > s->lanes[i].done;) {
+                cmd = s->lanes[i].cmds[j];
+                cmd->partial = false;
+                QTAILQ_INSERT_HEAD(&s->queue, cmd, entry);
+            }
+        }
+    }
+    memset(s->lanes, 0, sizeof(s->lanes));
+    return consumed;
+}
+
+/*
+ * Drains everything queued before going back to sleep, and only settles the
+ * FIFO level under the BQL once the queue runs dry (or when a command
+ * already had to take it) instead of per command.
+ */
+static void aes_worker_run(void *opaque)
+{
+    AppleAESState *s = APPLE_AES(opaque);
+    AESCommand *cmd;
+    uint32_t consumed = 0;
+
+    while (!qatomic_read(&s->stopped) &&
+           !apple_worker_should_yield(&s->worker)) {
         WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
         {
-            if (!QTAILQ_EMPTY(&s->queue)) {
-                cmd = QTAILQ_FIRST(&s->queue);
+            cmd = QTAILQ_FIRST(&s->queue);
+            if (cmd) {
                 QTAILQ_REMOVE(&s->queue, cmd, entry);
             }
         }
-        if (cmd) {
-            if (!aes_process_command(s, cmd)) {
-                bql_lock();
-            }
-            s->reg.command_fifo_status.level -= cmd->data_len;
+        if (!cmd) {
+            break;
+        }
+        if (s->parallel_data && COMMAND_OPCODE(cmd->command) == OPCODE_DATA) {
+            consumed += aes_process_data_batch(s, cmd);
+            continue;
+        }
+        if (aes_process_command(s, cmd)) {
+            s->reg.command_fifo_status.level -= consumed + cmd->data_len;
             aes_update_command_fifo_status(s);
             bql_unlock();
-
-            if (cmd->data) {
-                g_free(cmd->data);
-            }
-            g_free(cmd);
-        }
-        WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
-        {
-            while (QTAILQ_EMPTY(&s->queue) && !s->stopped) {
-                qemu_cond_wait(&s->thread_cond, &s->queue_mutex);
+            consumed = 0;
+        } else if (cmd->partial) {
+            cmd->partial = false;
+            WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+            {
+                QTAILQ_INSERT_HEAD(&s->queue, cmd, entry);
             }
+            break;
+        } else {
+            consumed += cmd->data_len;
         }
+        g_free(cmd->data);
+        g_free(cmd);
+    }
+    if (consumed) {
+        bql_lock();
+        s->reg.command_fifo_status.level -= consumed;
+        aes_update_command_fifo_status(s);
+        bql_unlock();
     }
-    rcu_unregister_thread();
-    return NULL;
 }
 
 static void aes_security_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -524,7 +1253,9 @@ static void aes_reg_write(void *opaque, hwaddr addr, uint64_t data,
             {
                 QTAILQ_INSERT_TAIL(&s->queue, cmd, entry);
             }
-            qemu_cond_signal(&s->thread_cond);
+            if (!qatomic_read(&s->stopped)) {
+                apple_worker_kick(&s->worker);
+            }
         }
 
         nowrite = true;
@@ -636,33 +1367,89 @@ static void apple_aes_reset(DeviceState *dev)
     }
     s->data_read = 0;
     s->data_len = 0;
-    s->stopped = true;
-    aes_stop(s);
+
+    apple_worker_pause(&s->worker);
+    qatomic_set(&s->stopped, true);
     aes_empty_fifo(s);
+    aes_cipher_cache_flush(s);
+    apple_dma_flush(&s->dma);
+    apple_worker_resume(&s->worker);
 }
 
 static void apple_aes_realize(DeviceState *dev, Error **errp)
 {
     AppleAESState *s = APPLE_AES(dev);
     Object *obj;
+    uint32_t i;
+
+    if (!aes_select_backend(s, errp)) {
+        return;
+    }
 
     obj = object_property_get_link(OBJECT(dev), "dma-mr", &error_abort);
 
     s->dma_mr = MEMORY_REGION(obj);
     address_space_init(&s->dma_as, s->dma_mr, TYPE_APPLE_AES);
+    if (!apple_dma_init(&s->dma, &s->dma_as, s->dma_mr, errp)) {
+        return;
+    }
 
-    qemu_cond_init(&s->thread_cond);
     qemu_mutex_init(&s->queue_mutex);
+    qemu_sem_init(&s->lane_start, 0);
+    qemu_sem_init(&s->lane_done, 0);
+    if (s->parallel_data) {
+        s->lane_exit = false;
+        apple_thread_create(s->thread_context, &s->lane_thread,
+                            TYPE_APPLE_AES ".lane", aes_lane_thread, s);
+    }
+    if (s->pipeline_data) {
+        for (i = 0; i < ARRAY_SIZE(s->pipes); i++) {
+            AESPipe *p = &s->pipes[i];
+
+            p->s = s;
+            p->exit = false;
+            qemu_sem_init(&p->start, 0);
+            qemu_sem_init(&p->done, 0);
+            apple_thread_create(s->thread_context, &p->thread,
+                                TYPE_APPLE_AES ".pipe", aes_pipe_thread, p);
+        }
+    }
+    apple_worker_init(&s->worker, TYPE_APPLE_AES, s->thread_context,
+                      aes_worker_run, s);
     apple_aes_reset(dev);
 }
 
 static void apple_aes_unrealize(DeviceState *dev)
 {
     AppleAESState *s = APPLE_AES(dev);
+    uint32_t i, j;
 
     apple_aes_reset(dev);
-    qemu_cond_destroy(&s->thread_cond);
+    apple_worker_destroy(&s->worker);
+    if (s->parallel_data) {
+        s->lane_exit = true;
+        qemu_sem_post(&s->lane_start);
+        qemu_thread_join(&s->lane_thread);
+    }
+    if (s->pipeline_data) {
+        for (i = 0; i < ARRAY_SIZE(s->pipes); i++) {
+            AESPipe *p = &s->pipes[i];
+
+            p->exit = true;
+            qemu_sem_post(&p->start);
+            qemu_thread_join(&p->thread);
+            qemu_sem_destroy(&p->start);
+            qemu_sem_destroy(&p->done);
+            for (j = 0; j < ARRAY_SIZE(p->buf); j++) {
+                g_free(p->buf[j]);
+                p->buf[j] = NULL;
+            }
+        }
+    }
+    apple_dma_destroy(&s->dma);
     qemu_mutex_destroy(&s->queue_mutex);
+    qemu_sem_destroy(&s->lane_start);
+    qemu_sem_destroy(&s->lane_done);
 }
 
 SysBusDevice *apple_aes_create(DTBNode *node)
@@ -706,36 +1493,46 @@ SysBusDevice *apple_aes_create(DTBNode *node)
 static int apple_aes_key_post_load(void *opaque, int version_id)
 {
     AESKey *k = (AESKey *)opaque;
-    if (k->cipher) {
-        qcrypto_cipher_free(k->cipher);
-        k->cipher = NULL;
-    }
-    if (k->select != KEY_SELECT_SOFTWARE) {
-        k->disabled = true;
-    } else {
-        k->disabled = false;
-        k->cipher = qcrypto_cipher_new(k->algo, key_mode(k->mode), k->key,
-                                       k->len, &error_abort);
-    }
+
+    aes_cipher_free(k->cipher);
+    k->cipher = NULL;
+    k->disabled = k->select != KEY_SELECT_SOFTWARE;
     return 0;
 }
 
+/*
+ * Already parked if the VM is stopped. Otherwise this waits for at most one
+ * chunk of a DATA command, whose remainder is then saved with the queue.
+ */
 static int apple_aes_pre_save(void *opaque)
 {
     AppleAESState *s = APPLE_AES(opaque);
-    if (!s->stopped) {
-        aes_stop(s);
-        s->stopped = false;
-    }
+
+    apple_worker_pause(&s->worker);
+    return 0;
+}
+
+static int apple_aes_post_save(void *opaque)
+{
+    AppleAESState *s = APPLE_AES(opaque);
+
+    apple_worker_resume(&s->worker);
     return 0;
 }
 
 static int apple_aes_post_load(void *opaque, int version_id)
 {
     AppleAESState *s = APPLE_AES(opaque);
+    uint32_t i;
+
+    /* The backend picked for a mode may differ from the source's. */
+    for (i = 0; i < ARRAY_SIZE(s->keys); i++) {
+        if (!s->keys[i].disabled && s->keys[i].len) {
+            s->keys[i].cipher = aes_cipher_new(s, &s->keys[i]);
+        }
+    }
     if (!s->stopped) {
-        s->stopped = true;
-        aes_start(s);
+        apple_worker_kick(&s->worker);
     }
     return 0;
 }
@@ -774,6 +1571,7 @@ static const VMStateDescription vmstate_apple_aes_key = {
 static const VMStateDescription vmstate_apple_aes = {
     .name = "apple_aes",
     .pre_save = apple_aes_pre_save,
+    .post_save = apple_aes_post_save,
     .post_load = apple_aes_post_load,
     .fields =
         (VMStateField[]){
@@ -793,15 +1591,133 @@ static const VMStateDescription vmstate_apple_aes = {
         }
 };
 
+static Property apple_aes_props[] = {
+    DEFINE_PROP_BOOL("parallel-data", AppleAESState, parallel_data, false),
+    DEFINE_PROP_BOOL("pipeline-data", AppleAESState, pipeline_data, false),
+    DEFINE_APPLE_DMA_PROPERTIES(AppleAESState, dma),
+    DEFINE_PROP_ON_OFF_AUTO("native-crypto", AppleAESState, native_crypto,
+                            ON_OFF_AUTO_OFF),
+    DEFINE_PROP_LINK("thread-context", AppleAESState, thread_context,
+                     TYPE_THREAD_CONTEXT, ThreadContext *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+typedef enum {
+    AES_STAT_BYTES,
+    AES_STAT_ECB_THROUGHPUT,
+    AES_STAT_CBC_THROUGHPUT,
+    AES_STAT_CTR_THROUGHPUT,
+    AES_STAT_ECB_NATIVE,
+    AES_STAT_CBC_NATIVE,
+    AES_STAT_CTR_NATIVE,
+    AES_STAT__MAX,
+} AESStat;
+
+/*
+ * The throughputs are what the backend picked for each block mode did at
+ * realize, in bytes per second, or 0 unless native-crypto=auto timed them;
+ * native is whether that is the host's AES instructions rather than the
+ * qcrypto backend.
+ */
+static const char *const aes_stat_name[AES_STAT__MAX] = {
+    [AES_STAT_BYTES] = "bytes",
+    [AES_STAT_ECB_THROUGHPUT] = "ecb-throughput",
+    [AES_STAT_CBC_THROUGHPUT] = "cbc-throughput",
+    [AES_STAT_CTR_THROUGHPUT] = "ctr-throughput",
+    [AES_STAT_ECB_NATIVE] = "ecb-native",
+    [AES_STAT_CBC_NATIVE] = "cbc-native",
+    [AES_STAT_CTR_NATIVE] = "ctr-native",
+};
+
+typedef struct AESStatsQuery {
+    StatsResultList **result;
+    strList *names;
+} AESStatsQuery;
+
+static int apple_aes_stats_device(Object *obj, void *opaque)
+{
+    AESStatsQuery *q = opaque;
+    AppleAESState *s;
+    StatsList *stats_list = NULL;
+    g_autofree char *path = NULL;
+    uint64_t values[AES_STAT__MAX];
+    block_mode_t mode;
+    int i;
+
+    s = (AppleAESState *)object_dynamic_cast(obj, TYPE_APPLE_AES);
+    if (!s) {
+        return 0;
+    }
+    values[AES_STAT_BYTES] = stat64_get(&s->bytes);
+    for (mode = BLOCK_MODE_ECB; mode <= BLOCK_MODE_CTR; mode++) {
+        values[AES_STAT_ECB_THROUGHPUT + mode] = s->throughput[mode];
+        values[AES_STAT_ECB_NATIVE + mode] =
+            (s->native_modes & BIT(mode)) != 0;
+    }
+    for (i = AES_STAT__MAX - 1; i >= 0; i--) {
+        if (apply_str_list_filter(aes_stat_name[i], q->names)) {
+            apple_stats_prepend(&stats_list, aes_stat_name[i], values[i]);
+        }
+    }
+    if (!stats_list) {
+        return 0;
+    }
+    path = object_get_canonical_path(obj);
+    add_stats_entry(q->result, STATS_PROVIDER_APPLE_AES, path, stats_list);
+    return 0;
+}
+
+static void apple_aes_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets, Error **errp)
+{
+    AESStatsQuery q = { .result = result, .names = names };
+
+    if (target != STATS_TARGET_DEVICE) {
+        return;
+    }
+    object_child_foreach_recursive(qdev_get_machine(), apple_aes_stats_device,
+                                   &q);
+}
+
+static void apple_aes_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+    StatsSchemaValue *value;
+    int i;
+
+    for (i = AES_STAT__MAX - 1; i >= 0; i--) {
+        value = g_new0(StatsSchemaValue, 1);
+        value->name = g_strdup(aes_stat_name[i]);
+        value->has_unit = true;
+        if (i == AES_STAT_BYTES) {
+            value->type = STATS_TYPE_CUMULATIVE;
+            value->unit = STATS_UNIT_BYTES;
+        } else if (i >= AES_STAT_ECB_NATIVE) {
+            value->type = STATS_TYPE_INSTANT;
+            value->unit = STATS_UNIT_BOOLEAN;
+        } else {
+            value->type = STATS_TYPE_INSTANT;
+            value->unit = STATS_UNIT_BYTES;
+        }
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_APPLE_AES, STATS_TARGET_DEVICE,
+                     stats_list);
+}
+
 static void apple_aes_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    add_stats_callbacks(STATS_PROVIDER_APPLE_AES, apple_aes_stats_cb,
+                        apple_aes_schemas_cb);
+
     dc->realize = apple_aes_realize;
     dc->unrealize = apple_aes_unrealize;
     dc->reset = apple_aes_reset;
     dc->desc = "Apple AES Accelerator";
     dc->vmsd = &vmstate_apple_aes;
+    device_class_set_props(dc, apple_aes_props);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -0,0 +1,208 @@
+#include "qemu/osdep.h"
+#include "hw/misc/apple-silicon/deadline.h"
+#include "hw/qdev-core.h"
+#include "qemu/lockable.h"
+#include "trace.h"
+
+/* Called with the lock held. */
+static void apple_deadline_sched_update(AppleDeadlineSched *s)
+{
+    AppleDeadline *d;
+    int64_t fire = -1;
+
+    QLIST_FOREACH (d, &s->deadlines, next) {
+        int64_t t = d->expire > INT64_MAX - d->slack_ns ?
+                        INT64_MAX :
+                        d->expire + d->slack_ns;
+
+        if (fire == -1 || t < fire) {
+            fire = t;
+        }
+    }
+
+    if (fire == s->armed) {
+        return;
+    }
+    s->armed = fire;
+    if (fire == -1) {
+        timer_del(s->timer);
+    } else {
+        timer_mod_ns(s->timer, fire);
+    }
+}
+
+typedef struct {
+    AppleDeadlineFn *fn;
+    void *opaque;
+} AppleDeadlineCall;
+
+static void apple_deadline_sched_fire(void *opaque)
+{
+    AppleDeadlineSched *s = APPLE_DEADLINE_SCHED(opaque);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    g_autoptr(GArray) due =
+        g_array_new(false, false, sizeof(AppleDeadlineCall));
+    AppleDeadline *d, *tmp;
+    guint i;
+
+    /*
+     * Take the due deadlines off the list, then run them unlocked so they
+     * can rearm themselves. A deadline rearmed from another thread in the
+     * meantime still gets this run, as with a QEMUTimer.
+     */
+    WITH_QEMU_LOCK_GUARD(&s->lock)
+    {
+        s->armed = -1;
+        QLIST_FOREACH_SAFE (d, &s->deadlines, next, tmp) {
+            if (d->expire <= now) {
+                AppleDeadlineCall call = { d->fn, d->opaque };
+
+                QLIST_REMOVE(d, next);
+                qatomic_set(&d->expire, -1);
+                g_array_append_val(due, call);
+            }
+        }
+    }
+
+    trace_apple_deadline_sched_fire(due->len);
+    for (i = 0; i < due->len; i++) {
+        AppleDeadlineCall *call = &g_array_index(due, AppleDeadlineCall, i);
+
+        call->fn(call->opaque);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock)
+    {
+        apple_deadline_sched_update(s);
+    }
+}
+
+AppleDeadlineSched *apple_deadline_sched_get(void)
+{
+    Object *machine = qdev_get_machine();
+    Object *obj;
+
+    obj = object_resolve_path_component(machine, "deadline-sched");
+    if (obj == NULL) {
+        obj = object_new(TYPE_APPLE_DEADLINE_SCHED);
+        object_property_add_child(machine, "deadline-sched", obj);
+        object_unref(obj);
+    }
+    return APPLE_DEADLINE_SCHED(obj);
+}
+
+void apple_deadline_init(AppleDeadline *d, AppleDeadlineFn *fn, void *opaque,
+                         int64_t slack_ns)
+{
+    d->sched = apple_deadline_sched_get();
+    d->fn = fn;
+    d->opaque = opaque;
+    d->slack_ns = slack_ns;
+    d->expire = -1;
+}
+
+void apple_deadline_destroy(AppleDeadline *d)
+{
+    if (d->sched) {
+        apple_deadline_del(d);
+        d->sched = NULL;
+    }
+}
+
+/* Called with the lock held. */
+static void apple_deadline_set(AppleDeadline *d, int64_t expire)
+{
+    if (d->expire == -1) {
+        QLIST_INSERT_HEAD(&d->sched->deadlines, d, next);
+    }
+    qatomic_set(&d->expire, MAX(expire, 0));
+    apple_deadline_sched_update(d->sched);
+}
+
+void apple_deadline_mod(AppleDeadline *d, int64_t expire)
+{
+    QEMU_LOCK_GUARD(&d->sched->lock);
+    apple_deadline_set(d, expire);
+}
+
+void apple_deadline_mod_anticipate(AppleDeadline *d, int64_t expire)
+{
+    QEMU_LOCK_GUARD(&d->sched->lock);
+    if (d->expire == -1 || expire < d->expire) {
+        apple_deadline_set(d, expire);
+    }
+}
+
+void apple_deadline_del(AppleDeadline *d)
+{
+    QEMU_LOCK_GUARD(&d->sched->lock);
+    if (d->expire != -1) {
+        QLIST_REMOVE(d, next);
+        qatomic_set(&d->expire, -1);
+        apple_deadline_sched_update(d->sched);
+    }
+}
+
+static int apple_deadline_pre_load(void *opaque)
+{
+    apple_deadline_del(opaque);
+    return 0;
+}
+
+static int apple_deadline_post_load(void *opaque, int version_id)
+{
+    AppleDeadline *d = opaque;
+    int64_t expire = d->expire;
+
+    if (expire != -1) {
+        d->expire = -1;
+        apple_deadline_mod(d, expire);
+    }
+    return 0;
+}
+
+const VMStateDescription vmstate_apple_deadline = {
+    .name = "apple_deadline",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = apple_deadline_pre_load,
+    .post_load = apple_deadline_post_load,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_INT64(expire, AppleDeadline),
+            VMSTATE_END_OF_LIST(),
+        },
+};
+
+static void apple_deadline_sched_instance_init(Object *obj)
+{
+    AppleDeadlineSched *s = APPLE_DEADLINE_SCHED(obj);
+
+    qemu_mutex_init(&s->lock);
+    QLIST_INIT(&s->deadlines);
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_deadline_sched_fire, s);
+    s->armed = -1;
+}
+
+static void apple_deadline_sched_instance_finalize(Object *obj)
+{
+    AppleDeadlineSched *s = APPLE_DEADLINE_SCHED(obj);
+
+    timer_free(s->timer);
+    qemu_mutex_destroy(&s->lock);
+}
+
+static const TypeInfo apple_deadline_sched_info = {
+    .name = TYPE_APPLE_DEADLINE_SCHED,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(AppleDeadlineSched),
+    .instance_init = apple_deadline_sched_instance_init,
+    .instance_finalize = apple_deadline_sched_instance_finalize,
+};
+
+static void apple_deadline_register_types(void)
+{
+    type_register_static(&apple_deadline_sched_info);
+}
+
+type_init(apple_deadline_register_types);
@@ -0,0 +1,212 @@
+/*
+ * Apple Paravirtual Free Page Reporting
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "hw/misc/apple-silicon/free-page-report.h"
+#include "migration/misc.h"
+#include "migration/vmstate.h"
+#include "qemu/bswap.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "trace.h"
+
+/*
+ * Discarding zaps the backing on the host, so it is only safe while nobody
+ * else relies on the pages staying put: not with VFIO pinning them, and not
+ * while postcopy or a background snapshot is tracking them.
+ */
+static bool apple_fpr_inhibited(void)
+{
+    return ram_block_discard_is_disabled() ||
+           migration_in_incoming_postcopy() || migration_in_bg_snapshot();
+}
+
+/* Returns the number of pages discarded, all or nothing. */
+static uint64_t apple_fpr_discard(hwaddr addr, uint64_t pages)
+{
+    MemoryRegionSection section;
+    uint64_t len;
+    uint64_t done = 0;
+    RAMBlock *rb;
+
+    if (pages == 0 || pages > (UINT64_MAX - addr) / APPLE_FPR_PAGE_SIZE ||
+        !QEMU_IS_ALIGNED(addr, APPLE_FPR_PAGE_SIZE)) {
+        return 0;
+    }
+    len = pages * APPLE_FPR_PAGE_SIZE;
+
+    section = memory_region_find(get_system_memory(), addr, len);
+    if (section.mr == NULL) {
+        return 0;
+    }
+
+    rb = section.mr->ram_block;
+    if (memory_region_is_ram(section.mr) &&
+        !memory_region_is_ram_device(section.mr) && !section.readonly &&
+        rb != NULL && int128_get64(section.size) == len &&
+        QEMU_IS_ALIGNED(section.offset_within_region | len,
+                        qemu_ram_pagesize(rb)) &&
+        section.offset_within_region + len <= qemu_ram_get_used_length(rb) &&
+        ram_block_discard_range(rb, section.offset_within_region, len) == 0) {
+        done = pages;
+    }
+
+    memory_region_unref(section.mr);
+    return done;
+}
+
+static void apple_fpr_report(AppleFPRState *s, uint32_t count)
+{
+    g_autofree AppleFPREntry *entries = NULL;
+    uint64_t pages = 0;
+    uint32_t i;
+
+    s->result = 0;
+    count = MIN(count, APPLE_FPR_MAX_ENTRIES);
+    if (count == 0 || apple_fpr_inhibited()) {
+        return;
+    }
+
+    entries = g_new(AppleFPREntry, count);
+    if (address_space_read(&address_space_memory, s->list,
+                           MEMTXATTRS_UNSPECIFIED, entries,
+                           count * sizeof(*entries)) != MEMTX_OK) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: bad report list 0x%" HWADDR_PRIx "\n", __func__,
+                      s->list);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        pages += apple_fpr_discard(le64_to_cpu(entries[i].addr),
+                                   le64_to_cpu(entries[i].pages));
+    }
+
+    s->result = MIN(pages, UINT32_MAX);
+    trace_apple_fpr_report(count, pages);
+}
+
+static uint64_t apple_fpr_read(void *opaque, hwaddr addr, unsigned size)
+{
+    AppleFPRState *s = APPLE_FPR(opaque);
+
+    switch (addr) {
+    case APPLE_FPR_REG_MAGIC:
+        return APPLE_FPR_MAGIC;
+    case APPLE_FPR_REG_VERSION:
+        return APPLE_FPR_VERSION;
+    case APPLE_FPR_REG_PAGE_SIZE:
+        return APPLE_FPR_PAGE_SIZE;
+    case APPLE_FPR_REG_MAX_ENTRIES:
+        return APPLE_FPR_MAX_ENTRIES;
+    case APPLE_FPR_REG_LIST_LO:
+        return extract64(s->list, 0, 32);
+    case APPLE_FPR_REG_LIST_HI:
+        return extract64(s->list, 32, 32);
+    case APPLE_FPR_REG_RESULT:
+        return s->result;
+    default:
+        return 0;
+    }
+}
+
+static void apple_fpr_write(void *opaque, hwaddr addr, uint64_t data,
+                            unsigned size)
+{
+    AppleFPRState *s = APPLE_FPR(opaque);
+
+    switch (addr) {
+    case APPLE_FPR_REG_LIST_LO:
+        s->list = deposit64(s->list, 0, 32, data);
+        break;
+    case APPLE_FPR_REG_LIST_HI:
+        s->list = deposit64(s->list, 32, 32, data);
+        break;
+    case APPLE_FPR_REG_COUNT:
+        apple_fpr_report(s, data);
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: bad offset 0x%" HWADDR_PRIx "\n", __func__, addr);
+        break;
+    }
+}
+
+static const MemoryRegionOps apple_fpr_ops = {
+    .read = apple_fpr_read,
+    .write = apple_fpr_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+};
+
+static void apple_fpr_reset(DeviceState *dev)
+{
+    AppleFPRState *s = APPLE_FPR(dev);
+
+    s->list = 0;
+    s->result = 0;
+}
+
+static void apple_fpr_realize(DeviceState *dev, Error **errp)
+{
+    AppleFPRState *s = APPLE_FPR(dev);
+
+    memory_region_init_io(&s->iomem, OBJECT(dev), &apple_fpr_ops, s,
+                          TYPE_APPLE_FPR, APPLE_FPR_MMIO_SIZE);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->iomem);
+}
+
+static const VMStateDescription vmstate_apple_fpr = {
+    .name = "apple_free_page_report",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_UINT64(list, AppleFPRState),
+            VMSTATE_UINT32(result, AppleFPRState),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
+static void apple_fpr_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = apple_fpr_realize;
+    dc->reset = apple_fpr_reset;
+    dc->desc = "Apple Paravirtual Free Page Reporting";
+    dc->vmsd = &vmstate_apple_fpr;
+}
+
+static const TypeInfo apple_fpr_info = {
+    .name = TYPE_APPLE_FPR,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AppleFPRState),
+    .class_init = apple_fpr_class_init,
+};
+
+static void apple_fpr_register_types(void)
+{
+    type_register_static(&apple_fpr_info);
+}
+
+type_init(apple_fpr_register_types);
@@ -1,13 +1,18 @@
 #include "qemu/osdep.h"
+#include <math.h>
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
 #include "hw/misc/apple-silicon/smc.h"
 #include "hw/qdev-core.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
-#include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "sysemu/runstate.h"
+#include "trace.h"
 
 #define TYPE_APPLE_SMC_IOP "apple.smc"
 OBJECT_DECLARE_TYPE(AppleSMCState, AppleSMCClass, APPLE_SMC_IOP)
@@ -116,6 +121,9 @@ enum smc_notify {
 
 #define kSMCKeyEndpoint 0
 
+/* Distinct notifications waiting for the coalescing window to close. */
+#define SMC_NOTIFY_MAX_PENDING (16)
+
 struct QEMU_PACKED key_message {
     uint8_t cmd;
     uint8_t ui8TagAndId;
@@ -154,14 +162,25 @@ typedef uint8_t (*KeyReader)(AppleSMCState *s, smc_key *k, void *payload,
 typedef uint8_t (*KeyWriter)(AppleSMCState *s, smc_key *k, void *payload,
                              uint8_t length);
 
+/* Payload sizes travel in a byte, so every key fits a fixed slot. */
+#define SMC_KEY_MAX_SIZE (UINT8_MAX)
+
 struct smc_key {
     uint32_t key;
     smc_key_info info;
-    void *data;
+    uint8_t data[SMC_KEY_MAX_SIZE];
 
-    QTAILQ_ENTRY(smc_key) entry;
     KeyReader read;
     KeyWriter write;
+
+    /*
+     * Fed keys take their value from the "sensor-<key>" property. The guest
+     * reads the slot as usual, and a notification goes out once the value
+     * moves `feed-threshold` away from the last one notified.
+     */
+    bool feed;
+    double feed_value;
+    double feed_notified;
 };
 
 struct AppleSMCClass {
@@ -170,43 +189,66 @@ struct AppleSMCClass {
 
     /*< public >*/
     DeviceRealize parent_realize;
+    DeviceReset parent_reset;
 };
 
 struct AppleSMCState {
     AppleRTBuddy parent_obj;
 
     MemoryRegion *iomems[3];
-    QTAILQ_HEAD(, smc_key) keys;
+    /* FourCC to key, `key_list` keeps the creation order for indexing. */
+    GHashTable *keys;
+    GPtrArray *key_list;
     uint32_t key_count;
     uint64_t sram_addr;
     uint8_t sram[0x4000];
+
+    QEMUTimer *feed_timer;
+    int64_t feed_last_notify;
+    bool feed_notify_pending;
+    uint32_t feed_threshold;
+    uint32_t feed_interval_ms;
+
+    /*
+     * Notifications to the AP wait up to `notify-window-ms`, so that the
+     * repeats of a pending one are dropped rather than each costing the AP
+     * a mailbox interrupt.
+     */
+    QEMUTimer *notify_timer;
+    uint64_t notify_pending[SMC_NOTIFY_MAX_PENDING];
+    uint32_t notify_count;
+    uint32_t notify_coalesced;
+    uint32_t notify_window_ms;
 };
 
 static smc_key *smc_get_key(AppleSMCState *s, uint32_t key)
 {
-    smc_key *d;
-    QTAILQ_FOREACH (d, &s->keys, entry) {
-        if (d->key == key) {
-            return d;
-        }
-    }
-    return NULL;
+    return g_hash_table_lookup(s->keys, GUINT_TO_POINTER(key));
 }
 
-static smc_key *smc_create_key(AppleSMCState *s, uint32_t key, uint32_t size,
-                               uint32_t type, uint32_t attr, void *data)
+static smc_key *smc_get_or_add_key(AppleSMCState *s, uint32_t key)
 {
     smc_key *k = smc_get_key(s, key);
+
     if (!k) {
         k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
+        k->key = key;
+        g_hash_table_insert(s->keys, GUINT_TO_POINTER(key), k);
+        g_ptr_array_add(s->key_list, k);
         s->key_count++;
     }
-    k->key = key;
+    return k;
+}
+
+static smc_key *smc_create_key(AppleSMCState *s, uint32_t key, uint32_t size,
+                               uint32_t type, uint32_t attr, void *data)
+{
+    smc_key *k = smc_get_or_add_key(s, key);
+
+    g_assert(size <= sizeof(k->data));
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
-    k->data = g_realloc(k->data, size);
     memcpy(k->data, data, size);
     return k;
 }
@@ -215,17 +257,12 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
                                     uint32_t size, uint32_t type, uint32_t attr,
                                     KeyReader reader, KeyWriter writer)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_get_or_add_key(s, key);
+
+    g_assert(size <= sizeof(k->data));
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
-    k->data = g_realloc(k->data, size);
     k->read = reader;
     k->write = writer;
     return k;
@@ -234,19 +271,75 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
 static smc_key *smc_set_key(AppleSMCState *s, uint32_t key, uint32_t size,
                             void *data)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_get_or_add_key(s, key);
+
+    size = MIN(size, sizeof(k->data));
     k->info.size = size;
-    k->data = g_realloc(k->data, size);
     memcpy(k->data, data, size);
     return k;
 }
 
+static void smc_notify_flush(AppleSMCState *s)
+{
+    AppleRTBuddy *rtb = APPLE_RTBUDDY(s);
+    uint32_t i;
+
+    timer_del(s->notify_timer);
+    if (s->notify_count == 0) {
+        return;
+    }
+
+    trace_apple_smc_notify_flush(s->notify_count, s->notify_coalesced);
+    for (i = 0; i < s->notify_count; i++) {
+        apple_rtbuddy_send_user_msg(rtb, kSMCKeyEndpoint,
+                                    s->notify_pending[i]);
+    }
+    s->notify_count = 0;
+    s->notify_coalesced = 0;
+}
+
+static void smc_notify_timer_cb(void *opaque)
+{
+    smc_notify_flush(APPLE_SMC_IOP(opaque));
+}
+
+/*
+ * Queues a notification, dropping it if the same one is pending already.
+ * The queue goes out in order when the window opened by its first entry
+ * closes, or right away with @urgent.
+ */
+static void smc_notify(AppleSMCState *s, uint8_t type, uint8_t code,
+                       bool urgent)
+{
+    key_response r = { 0 };
+    uint32_t i;
+
+    r.status = SMC_NOTIFICATION;
+    r.response[2] = code;
+    r.response[3] = type;
+
+    for (i = 0; i < s->notify_count; i++) {
+        if (s->notify_pending[i] == r.raw) {
+            break;
+        }
+    }
+    if (i < s->notify_count) {
+        s->notify_coalesced++;
+    } else {
+        if (s->notify_count == SMC_NOTIFY_MAX_PENDING) {
+            smc_notify_flush(s);
+        }
+        s->notify_pending[s->notify_count++] = r.raw;
+    }
+
+    if (urgent || s->notify_window_ms == 0) {
+        smc_notify_flush(s);
+    } else if (!timer_pending(s->notify_timer)) {
+        timer_mod(s->notify_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                                       s->notify_window_ms);
+    }
+}
+
 static uint8_t smc_key_reject_read(AppleSMCState *s, smc_key *k, void *payload,
                                    uint8_t length)
 {
@@ -276,18 +369,15 @@ static uint8_t smc_key_count_read(AppleSMCState *s, smc_key *k, void *payload,
                                   uint8_t length)
 {
     k->info.size = 4;
-    k->data = g_realloc(k->data, 4);
-    *(uint32_t *)k->data = s->key_count;
+    stl_le_p(k->data, s->key_count);
     return kSMCSuccess;
 }
 
 static uint8_t smc_key_mbse_write(AppleSMCState *s, smc_key *k, void *payload,
                                   uint8_t length)
 {
-    AppleRTBuddy *rtb;
     uint32_t value;
 
-    rtb = APPLE_RTBUDDY(s);
     if (!payload || length != k->info.size) {
         return kSMCBadArgumentError;
     }
@@ -305,22 +395,13 @@ static uint8_t smc_key_mbse_write(AppleSMCState *s, smc_key *k, void *payload,
         return kSMCSuccess;
     case SMC_MAKE_IDENTIFIER('s', 'l', 'p', 'w'):
         return kSMCSuccess;
-    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'b'): {
-        key_response r = { 0 };
-        r.status = SMC_NOTIFICATION;
-        r.response[2] = kSMCNotifySMCPanicProgress;
-        r.response[3] = kSMCSystemStateNotify;
-        apple_rtbuddy_send_user_msg(rtb, kSMCKeyEndpoint, r.raw);
+    /* A panicking AP will not wait for the window to close. */
+    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'b'):
+        smc_notify(s, kSMCSystemStateNotify, kSMCNotifySMCPanicProgress, true);
         return kSMCSuccess;
-    }
-    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'e'): {
-        key_response r = { 0 };
-        r.status = SMC_NOTIFICATION;
-        r.response[2] = kSMCNotifySMCPanicDone;
-        r.response[3] = kSMCSystemStateNotify;
-        apple_rtbuddy_send_user_msg(rtb, kSMCKeyEndpoint, r.raw);
+    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'e'):
+        smc_notify(s, kSMCSystemStateNotify, kSMCNotifySMCPanicDone, true);
         return kSMCSuccess;
-    }
     default:
         return kSMCBadFuncParameter;
     }
@@ -354,6 +435,125 @@ static uint8_t smc_key_nesn_write(AppleSMCState *s, smc_key *k, void *payload,
     return kSMCSuccess;
 }
 
+static void smc_feed_encode(smc_key *k, double value)
+{
+    switch (k->info.type) {
+    case SmcKeyTypeFlt: {
+        float f = value;
+        uint32_t raw;
+
+        memcpy(&raw, &f, sizeof(raw));
+        stl_le_p(k->data, raw);
+        break;
+    }
+    case SmcKeyTypeIoft:
+        /* 48.16 fixed point */
+        stq_le_p(k->data, (int64_t)(value * 65536.0));
+        break;
+    case SmcKeyTypeSp78:
+        stw_le_p(k->data, (int16_t)(value * 256.0));
+        break;
+    default:
+        stn_le_p(k->data, MIN(k->info.size, sizeof(uint64_t)),
+                 (int64_t)value);
+        break;
+    }
+}
+
+static void smc_feed_send_notify(AppleSMCState *s)
+{
+    smc_key *nesn = smc_get_key(s, SmcKeyNESN);
+
+    s->feed_notify_pending = false;
+
+    /* The guest enables notifications by writing NESN. */
+    if (!nesn || !ldl_le_p(nesn->data)) {
+        return;
+    }
+
+    smc_notify(s, kSMCPowerStateNotify, 0, false);
+    s->feed_last_notify = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+}
+
+static void smc_feed_timer_cb(void *opaque)
+{
+    AppleSMCState *s = APPLE_SMC_IOP(opaque);
+
+    if (s->feed_notify_pending) {
+        smc_feed_send_notify(s);
+    }
+}
+
+/* Notify at most once per `feed-interval-ms`, coalescing what comes between. */
+static void smc_feed_notify(AppleSMCState *s)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+    int64_t next = s->feed_last_notify + s->feed_interval_ms;
+
+    if (s->feed_notify_pending) {
+        return;
+    }
+
+    if (now >= next) {
+        smc_feed_send_notify(s);
+        return;
+    }
+
+    s->feed_notify_pending = true;
+    timer_mod(s->feed_timer, next);
+}
+
+static void smc_feed_get(Object *obj, Visitor *v, const char *name,
+                         void *opaque, Error **errp)
+{
+    smc_key *k = opaque;
+
+    visit_type_number(v, name, &k->feed_value, errp);
+}
+
+static void smc_feed_set(Object *obj, Visitor *v, const char *name,
+                         void *opaque, Error **errp)
+{
+    AppleSMCState *s = APPLE_SMC_IOP(obj);
+    smc_key *k = opaque;
+    double value;
+
+    if (!visit_type_number(v, name, &value, errp)) {
+        return;
+    }
+
+    k->feed_value = value;
+    smc_feed_encode(k, value);
+
+    if (fabs(value - k->feed_notified) >= s->feed_threshold) {
+        k->feed_notified = value;
+        smc_feed_notify(s);
+    }
+}
+
+static smc_key *smc_create_feed_key(AppleSMCState *s, uint32_t key,
+                                    uint32_t size, uint32_t type, double value)
+{
+    uint8_t zero[SMC_KEY_MAX_SIZE] = { 0 };
+    smc_key *k = smc_create_key(s, key, size, type, SMC_ATTR_LITTLE_ENDIAN,
+                                zero);
+    char name[] = "sensor-XXXX";
+
+    k->feed_value = value;
+    k->feed_notified = value;
+    smc_feed_encode(k, value);
+
+    if (k->feed) {
+        return k;
+    }
+
+    k->feed = true;
+    stl_be_p(name + sizeof("sensor-") - 1, key);
+    object_property_add(OBJECT(s), name, "number", smc_feed_get, smc_feed_set,
+                        NULL, k);
+    return k;
+}
+
 static void apple_smc_handle_key_endpoint(void *opaque, uint32_t ep,
                                           uint64_t msg)
 {
@@ -411,11 +611,8 @@ static void apple_smc_handle_key_endpoint(void *opaque, uint32_t ep,
     case SMC_GET_KEY_BY_INDEX: {
         key_response r = { 0 };
         uint32_t idx = kmsg->key;
-        smc_key *k = QTAILQ_FIRST(&s->keys);
-
-        for (int i = 0; i < idx && k; i++) {
-            k = QTAILQ_NEXT(k, entry);
-        }
+        smc_key *k =
+            idx < s->key_list->len ? g_ptr_array_index(s->key_list, idx) : NULL;
 
         if (!k) {
             r.status = kSMCKeyIndexRangeError;
@@ -530,7 +727,8 @@ SysBusDevice *apple_smc_create(DTBNode *node, AppleA7IOPVersion version,
     set_dtb_prop(child, "pre-loaded", 4, (uint8_t *)&data);
     set_dtb_prop(child, "running", 4, (uint8_t *)&data);
 
-    QTAILQ_INIT(&s->keys);
+    s->keys = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->key_list = g_ptr_array_new_with_free_func(g_free);
 
     return sbd;
 }
@@ -544,6 +742,10 @@ static void apple_smc_realize(DeviceState *dev, Error **errp)
         sc->parent_realize(dev, errp);
     }
 
+    s->feed_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, smc_feed_timer_cb, s);
+    s->notify_timer =
+        timer_new_ms(QEMU_CLOCK_VIRTUAL, smc_notify_timer_cb, s);
+
     uint8_t data[8] = { 0x00, 0x00, 0x70, 0x80, 0x00, 0x01, 0x19, 0x40 };
     uint64_t value;
 
@@ -576,52 +778,67 @@ static void apple_smc_realize(DeviceState *dev, Error **errp)
     smc_create_key_func(s, SmcKeyNESN, 4, SmcKeyTypeHex, SMC_ATTR_LITTLE_ENDIAN,
                         &smc_key_reject_read, &smc_key_nesn_write);
 
-    value = 1;
-    smc_create_key(s, SmcKeyAC_N, 1, SmcKeyTypeUint8, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    value = 0;
-    smc_create_key(s, SMC_MAKE_IDENTIFIER('C', 'H', 'A', 'I'), 4,
-                   SmcKeyTypeUint32, SMC_ATTR_LITTLE_ENDIAN, &value);
-    smc_create_key(s, SmcKeyTG0B, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyTG0V, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyTP1A, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyTP2C, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
+    smc_create_feed_key(s, SmcKeyAC_N, 1, SmcKeyTypeUint8, 1);
+    smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('C', 'H', 'A', 'I'), 4,
+                        SmcKeyTypeUint32, 0);
+    smc_create_feed_key(s, SmcKeyTG0B, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyTG0V, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyTP1A, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyTP2C, 8, SmcKeyTypeIoft, 0);
     for (char i = '1'; i <= '5'; i++) {
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'P', i, 'd'), 8,
-                       SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN, &value);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'P', i, 'd'), 8,
+                            SmcKeyTypeIoft, 0);
     }
-    smc_create_key(s, SmcKeyTP3R, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyTP4H, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyTP0Z, 8, SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
-    smc_create_key(s, SmcKeyB0AP, 4, SmcKeyTypeSint32, SMC_ATTR_LITTLE_ENDIAN,
-                   &value);
+    smc_create_feed_key(s, SmcKeyTP3R, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyTP4H, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyTP0Z, 8, SmcKeyTypeIoft, 0);
+    smc_create_feed_key(s, SmcKeyB0AP, 4, SmcKeyTypeSint32, 0);
     for (char i = '0'; i <= '2'; i++) {
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'a'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'f'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'x'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'a'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'f'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
-        smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'x'), 8,
-                       SmcKeyTypeFlt, SMC_ATTR_LITTLE_ENDIAN, &value);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'a'), 8,
+                            SmcKeyTypeFlt, 0);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'f'), 8,
+                            SmcKeyTypeFlt, 0);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'h', i, 'x'), 8,
+                            SmcKeyTypeFlt, 0);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'a'), 8,
+                            SmcKeyTypeFlt, 0);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'f'), 8,
+                            SmcKeyTypeFlt, 0);
+        smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'c', i, 'x'), 8,
+                            SmcKeyTypeFlt, 0);
+    }
+    smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('D', '0', 'V', 'R'), 2,
+                        SmcKeyTypeUint16, 0);
+    smc_create_feed_key(s, SMC_MAKE_IDENTIFIER('T', 'V', '0', 's'), 8,
+                        SmcKeyTypeIoft, 0);
+}
+
+/* Notifications batched up for the previous boot must not reach the next. */
+static void apple_smc_reset(DeviceState *dev)
+{
+    AppleSMCState *s = APPLE_SMC_IOP(dev);
+    AppleSMCClass *sc = APPLE_SMC_IOP_GET_CLASS(dev);
+
+    if (sc->parent_reset) {
+        sc->parent_reset(dev);
     }
-    smc_create_key(s, SMC_MAKE_IDENTIFIER('D', '0', 'V', 'R'), 2,
-                   SmcKeyTypeUint16, SMC_ATTR_LITTLE_ENDIAN, &value);
-    smc_create_key(s, SMC_MAKE_IDENTIFIER('T', 'V', '0', 's'), 8,
-                   SmcKeyTypeIoft, SMC_ATTR_LITTLE_ENDIAN, &value);
+
+    timer_del(s->notify_timer);
+    s->notify_count = 0;
+    s->notify_coalesced = 0;
+    timer_del(s->feed_timer);
+    s->feed_notify_pending = false;
+    s->feed_last_notify = 0;
 }
 
+static Property apple_smc_properties[] = {
+    DEFINE_PROP_UINT32("feed-threshold", AppleSMCState, feed_threshold, 1),
+    DEFINE_PROP_UINT32("feed-interval-ms", AppleSMCState, feed_interval_ms,
+                       1000),
+    DEFINE_PROP_UINT32("notify-window-ms", AppleSMCState, notify_window_ms, 5),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_smc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc;
@@ -631,8 +848,9 @@ static void apple_smc_class_init(ObjectClass *klass, void *data)
     sc = APPLE_SMC_IOP_CLASS(klass);
 
     device_class_set_parent_realize(dc, apple_smc_realize, &sc->parent_realize);
-    /* dc->reset = apple_smc_reset; */
+    device_class_set_parent_reset(dc, apple_smc_reset, &sc->parent_reset);
     dc->desc = "Apple SMC IOP";
+    device_class_set_props(dc, apple_smc_properties);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
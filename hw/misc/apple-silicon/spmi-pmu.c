@@ -4,6 +4,7 @@
 #include "hw/misc/apple-silicon/spmi-pmu.h"
 #include "migration/vmstate.h"
 #include "qemu/module.h"
+#include "qemu/range.h"
 #include "qemu/timer.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -52,6 +53,11 @@ static uint64_t G_GNUC_UNUSED tick_to_ns(AppleSPMIPMUState *p, uint64_t tick)
            (tick & 0x7fff) * p->tick_period;
 }
 
+/*
+ * The RTC is never stored: it is rtc_clock less the offset it was started
+ * at, worked out on read. rtc_clock keeps running across a migration, so
+ * the offset is all that needs saving.
+ */
 static uint64_t rtc_get_tick(AppleSPMIPMUState *p, uint64_t *out_ns)
 {
     uint64_t now = qemu_clock_get_ns(rtc_clock);
@@ -61,7 +67,8 @@ static uint64_t rtc_get_tick(AppleSPMIPMUState *p, uint64_t *out_ns)
     }
     now -= offset;
     return ((now / NANOSECONDS_PER_SECOND) << 15) |
-           ((now / p->tick_period) & 0x7fff);
+           ((now % NANOSECONDS_PER_SECOND) * RTC_TICK_FREQ /
+            NANOSECONDS_PER_SECOND);
 }
 
 static uint64_t apple_spmi_pmu_get_tick_offset(AppleSPMIPMUState *p)
@@ -104,45 +111,59 @@ static void apple_spmi_pmu_alarm(void *opaque)
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_RTC, NULL);
 }
 
+/*
+ * The alarm is a single deadline on rtc_clock, the instant the RTC reaches
+ * the alarm's second; one already passed fires straight away.
+ */
 static void apple_spmi_pmu_set_alarm(AppleSPMIPMUState *p)
 {
-    uint32_t seconds = REG32(p, p->reg_alarm) - (rtc_get_tick(p, NULL) >> 15);
-    if (REG32(p, p->reg_alarm_ctrl) & kDIALOG_RTC_CONTROL_ALARM_EN) {
-        if (seconds == 0) {
-            timer_del(p->timer);
-            apple_spmi_pmu_alarm(p);
-        } else {
-            int64_t now = qemu_clock_get_ns(rtc_clock);
-            timer_mod_ns(p->timer,
-                         now + (int64_t)seconds * NANOSECONDS_PER_SECOND);
-        }
-    } else {
+    int64_t deadline;
+
+    if (!(REG32(p, p->reg_alarm_ctrl) & kDIALOG_RTC_CONTROL_ALARM_EN)) {
+        timer_del(p->timer);
+        return;
+    }
+
+    deadline = p->rtc_offset +
+               (int64_t)REG32(p, p->reg_alarm) * NANOSECONDS_PER_SECOND;
+    if (deadline <= qemu_clock_get_ns(rtc_clock)) {
         timer_del(p->timer);
+        apple_spmi_pmu_alarm(p);
+    } else {
+        timer_mod_ns(p->timer, deadline);
     }
 }
 
+/* Clamp a burst at `p->addr` to the register file. */
+static uint8_t apple_spmi_pmu_burst_len(AppleSPMIPMUState *p, uint8_t len)
+{
+    return MIN(len, sizeof(p->reg) - MIN(p->addr, sizeof(p->reg)));
+}
+
+/*
+ * Registers are a flat byte array, so a burst is a single copy; the side
+ * effects are checked once per burst against the ranges they cover.
+ */
 static int apple_spmi_pmu_send(SPMISlave *s, uint8_t *data, uint8_t len)
 {
     AppleSPMIPMUState *p = APPLE_SPMI_PMU(s);
-    bool aflg = false;
-    uint16_t addr;
-    for (addr = p->addr; addr < p->addr + len; addr++) {
-        p->reg[addr] = data[addr - p->addr];
-        if (addr == p->reg_alarm_ctrl) {
-            aflg = true;
-        }
-        if (addr >= p->reg_alarm && addr < p->reg_alarm + 4) {
-            aflg = true;
-        }
-        if ((addr >= p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET &&
-             addr < p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET + 4) ||
-            (addr >= p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET &&
-             addr < p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET + 2)) {
-            p->tick_offset = apple_spmi_pmu_get_tick_offset(p);
-        }
+    uint16_t addr = p->addr;
+
+    len = apple_spmi_pmu_burst_len(p, len);
+    if (len == 0) {
+        return 0;
     }
-    p->addr = addr;
-    if (aflg) {
+    memcpy(&p->reg[addr], data, len);
+    p->addr += len;
+
+    if (ranges_overlap(addr, len,
+                       p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET, 4) ||
+        ranges_overlap(addr, len,
+                       p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET, 2)) {
+        p->tick_offset = apple_spmi_pmu_get_tick_offset(p);
+    }
+    if (ranges_overlap(addr, len, p->reg_alarm_ctrl, 1) ||
+        ranges_overlap(addr, len, p->reg_alarm, 4)) {
         apple_spmi_pmu_set_alarm(p);
     }
     return len;
@@ -151,21 +172,23 @@ static int apple_spmi_pmu_send(SPMISlave *s, uint8_t *data, uint8_t len)
 static int apple_spmi_pmu_recv(SPMISlave *s, uint8_t *data, uint8_t len)
 {
     AppleSPMIPMUState *p = APPLE_SPMI_PMU(s);
-    uint16_t addr;
+    uint16_t addr = p->addr;
 
-    for (addr = p->addr; addr < p->addr + len; addr++) {
-        if (addr >= p->reg_rtc && addr < p->reg_rtc + 6) {
-            uint64_t now = rtc_get_tick(p, NULL);
-            p->reg[p->reg_rtc] = now << 1;
-            p->reg[p->reg_rtc + 1] = now >> 7;
-            p->reg[p->reg_rtc + 2] = now >> 15;
-            p->reg[p->reg_rtc + 3] = now >> 23;
-            p->reg[p->reg_rtc + 4] = now >> 31;
-            p->reg[p->reg_rtc + 5] = now >> 39;
-        }
-        data[addr - p->addr] = p->reg[addr];
+    len = apple_spmi_pmu_burst_len(p, len);
+    if (len == 0) {
+        return 0;
     }
-    p->addr = addr;
+    if (ranges_overlap(addr, len, p->reg_rtc, 6)) {
+        uint64_t now = rtc_get_tick(p, NULL);
+        p->reg[p->reg_rtc] = now << 1;
+        p->reg[p->reg_rtc + 1] = now >> 7;
+        p->reg[p->reg_rtc + 2] = now >> 15;
+        p->reg[p->reg_rtc + 3] = now >> 23;
+        p->reg[p->reg_rtc + 4] = now >> 31;
+        p->reg[p->reg_rtc + 5] = now >> 39;
+    }
+    memcpy(data, &p->reg[addr], len);
+    p->addr += len;
     return len;
 }
 
@@ -217,7 +240,7 @@ DeviceState *apple_spmi_pmu_create(DTBNode *node)
     p->tick_offset = rtc_get_tick(p, &p->rtc_offset);
     apple_spmi_pmu_set_tick_offset(p, p->tick_offset);
 
-    p->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_spmi_pmu_alarm, p);
+    p->timer = timer_new_ns(rtc_clock, apple_spmi_pmu_alarm, p);
     qemu_system_wakeup_enable(QEMU_WAKEUP_REASON_RTC, true);
 
     qdev_init_gpio_out(dev, &p->irq, 1);
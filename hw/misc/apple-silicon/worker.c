@@ -0,0 +1,148 @@
+#include "qemu/osdep.h"
+#include "hw/misc/apple-silicon/worker.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+
+/* Called with the worker mutex held, returns with it held. */
+static void apple_worker_park(AppleWorker *w)
+{
+    qemu_mutex_unlock(&w->mutex);
+    bql_lock();
+    w->parked = true;
+    qemu_cond_broadcast(&w->parked_cond);
+    bql_unlock();
+    qemu_mutex_lock(&w->mutex);
+
+    while (w->pause_depth && !w->exit) {
+        qemu_cond_wait(&w->cond, &w->mutex);
+    }
+
+    /*
+     * A pause that raced with the resume may already have seen `parked`
+     * and returned; that is fine, nothing runs before the next check.
+     */
+    qemu_mutex_unlock(&w->mutex);
+    bql_lock();
+    w->parked = false;
+    bql_unlock();
+    qemu_mutex_lock(&w->mutex);
+}
+
+static void *apple_worker_thread(void *opaque)
+{
+    AppleWorker *w = opaque;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&w->mutex);
+    while (!w->exit) {
+        if (w->pause_depth) {
+            apple_worker_park(w);
+            continue;
+        }
+        if (!w->pending) {
+            qemu_cond_wait(&w->cond, &w->mutex);
+            continue;
+        }
+        w->pending = false;
+        qemu_mutex_unlock(&w->mutex);
+        w->fn(w->opaque);
+        qemu_mutex_lock(&w->mutex);
+    }
+    qemu_mutex_unlock(&w->mutex);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void apple_worker_vm_state_change(void *opaque, bool running,
+                                         RunState state)
+{
+    AppleWorker *w = opaque;
+
+    if (running && w->vm_paused) {
+        w->vm_paused = false;
+        apple_worker_resume(w);
+    } else if (!running && !w->vm_paused) {
+        w->vm_paused = true;
+        apple_worker_pause(w);
+    }
+}
+
+void apple_thread_create(ThreadContext *tc, QemuThread *thread,
+                         const char *name, void *(*fn)(void *), void *arg)
+{
+    if (tc != NULL) {
+        thread_context_create_thread(tc, thread, name, fn, arg,
+                                     QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(thread, name, fn, arg, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void apple_worker_init(AppleWorker *w, const char *name, ThreadContext *tc,
+                       AppleWorkerFn *fn, void *opaque)
+{
+    memset(w, 0, sizeof(*w));
+    w->fn = fn;
+    w->opaque = opaque;
+    qemu_mutex_init(&w->mutex);
+    qemu_cond_init(&w->cond);
+    qemu_cond_init(&w->parked_cond);
+    w->vmse = qemu_add_vm_change_state_handler(apple_worker_vm_state_change, w);
+    apple_thread_create(tc, &w->thread, name, apple_worker_thread, w);
+}
+
+void apple_worker_destroy(AppleWorker *w)
+{
+    qemu_del_vm_change_state_handler(w->vmse);
+
+    /* Once parked the thread leaves without needing the BQL. */
+    apple_worker_pause(w);
+    WITH_QEMU_LOCK_GUARD(&w->mutex)
+    {
+        qatomic_set(&w->exit, true);
+        qemu_cond_signal(&w->cond);
+    }
+    qemu_thread_join(&w->thread);
+
+    qemu_cond_destroy(&w->parked_cond);
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->mutex);
+}
+
+void apple_worker_kick(AppleWorker *w)
+{
+    QEMU_LOCK_GUARD(&w->mutex);
+    w->pending = true;
+    qemu_cond_signal(&w->cond);
+}
+
+void apple_worker_pause(AppleWorker *w)
+{
+    g_assert(bql_locked());
+    g_assert(!qemu_thread_is_self(&w->thread));
+
+    WITH_QEMU_LOCK_GUARD(&w->mutex)
+    {
+        qatomic_set(&w->pause_depth, w->pause_depth + 1);
+        qemu_cond_signal(&w->cond);
+    }
+    /* Drops the BQL, which whatever @fn is doing may be waiting on. */
+    while (!w->parked) {
+        qemu_cond_wait_bql(&w->parked_cond);
+    }
+}
+
+void apple_worker_resume(AppleWorker *w)
+{
+    g_assert(bql_locked());
+
+    QEMU_LOCK_GUARD(&w->mutex);
+    g_assert(w->pause_depth);
+    qatomic_set(&w->pause_depth, w->pause_depth - 1);
+    if (!w->pause_depth) {
+        /* Whatever yielded to the pause picks up where it left off. */
+        w->pending = true;
+        qemu_cond_signal(&w->cond);
+    }
+}
@@ -314,6 +314,23 @@ static void pmu_d2255_reset(DeviceState *device)
            REG_DIALOG_DEVICE_ID7 - REG_DIALOG_MASK_REV_CODE);
 }
 
+static const VMStateDescription vmstate_pmu_d2255 = {
+    .name = "pmu_d2255",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (VMStateField[]){
+            VMSTATE_I2C_SLAVE(i2c, PMUD2255State),
+            VMSTATE_UINT8_ARRAY(reg, PMUD2255State, 0x8800),
+            VMSTATE_TIMER_PTR(timer, PMUD2255State),
+            VMSTATE_UINT64(rtc_offset, PMUD2255State),
+            VMSTATE_UINT32(op_state, PMUD2255State),
+            VMSTATE_UINT16(address, PMUD2255State),
+            VMSTATE_UINT32(address_state, PMUD2255State),
+            VMSTATE_END_OF_LIST(),
+        }
+};
+
 static void pmu_d2255_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -322,6 +339,7 @@ static void pmu_d2255_class_init(ObjectClass *klass, void *data)
     dc->desc = "Apple PMU D2255";
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     dc->reset = pmu_d2255_reset;
+    dc->vmsd = &vmstate_pmu_d2255;
 
     c->event = pmu_d2255_event;
     c->recv = pmu_d2255_rx;
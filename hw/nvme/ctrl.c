@@ -3467,6 +3467,11 @@ static uint16_t nvme_read(NvmeCtrl *n, NvmeRequest *req)
 
     data_offset = nvme_l2b(ns, slba);
 
+    if (n->read_notify) {
+        n->read_notify(n->read_notify_opaque, nvme_nsid(ns), data_offset,
+                       data_size);
+    }
+
     block_acct_start(blk_get_stats(blk), &req->acct, data_size,
                      BLOCK_ACCT_READ);
     nvme_blk_read(blk, data_offset, BDRV_SECTOR_SIZE, nvme_rw_cb, req);
@@ -7180,6 +7185,44 @@ static void nvme_process_sq(void *opaque)
     }
 }
 
+/*
+ * Apple ANS linear submission: the host writes the command into the SQ slot
+ * matching its tag and rings a per-queue-type doorbell with that tag, rather
+ * than advancing the tail. The slot is fetched immediately.
+ */
+void nvme_linear_sq_submit(NvmeCtrl *n, uint16_t sqid, uint16_t tag)
+{
+    NvmeSQueue *sq;
+
+    if (unlikely(nvme_check_sqid(n, sqid))) {
+        NVME_GUEST_ERR(pci_nvme_ub_db_wr_invalid_sq,
+                       "linear submission for nonexistent queue,"
+                       " sqid=%"PRIu32", ignoring", (uint32_t)sqid);
+        return;
+    }
+
+    sq = n->sq[sqid];
+    if (unlikely(tag >= sq->size)) {
+        NVME_GUEST_ERR(pci_nvme_ub_db_wr_invalid_sqtail,
+                       "linear submission tag beyond queue size,"
+                       " sqid=%"PRIu32", tag=%"PRIu16", ignoring",
+                       (uint32_t)sqid, tag);
+        return;
+    }
+
+    if (unlikely(QTAILQ_EMPTY(&sq->req_list))) {
+        NVME_GUEST_ERR(pci_nvme_ub_linear_db_wr_busy,
+                       "linear submission with no free request,"
+                       " sqid=%"PRIu32", tag=%"PRIu16", ignoring",
+                       (uint32_t)sqid, tag);
+        return;
+    }
+
+    sq->head = tag;
+    sq->tail = (tag + 1) % sq->size;
+    nvme_process_sq(sq);
+}
+
 static void nvme_update_msixcap_ts(PCIDevice *pci_dev, uint32_t table_size)
 {
     uint8_t *config;
@@ -8567,6 +8610,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT8("vsl", NvmeCtrl, params.vsl, 7),
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("is-apple-ans", NvmeCtrl, params.is_apple_ans, false),
+    DEFINE_PROP_BOOL("unmap", NvmeCtrl, params.unmap, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
     DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
@@ -20,6 +20,8 @@
 #include "qemu/bitops.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qdict.h"
 
 #include "nvme.h"
 #include "trace.h"
@@ -713,6 +715,42 @@ static void nvme_ns_unrealize(DeviceState *dev)
     nvme_ns_cleanup(ns);
 }
 
+/*
+ * Lets Dataset Management deallocation and Write Zeroes reach the image:
+ * unless the drive was configured otherwise, discards are passed down and
+ * written zeroes are unmapped, so the image shrinks as the guest trims.
+ */
+static void nvme_ns_default_unmap(NvmeNamespace *ns)
+{
+    BlockDriverState *bs = blk_bs(ns->blkconf.blk);
+    Error *local_err = NULL;
+    bool discard_unmap;
+    QDict *opts;
+
+    if (bs == NULL || bdrv_is_read_only(bs)) {
+        return;
+    }
+
+    opts = qdict_new();
+    discard_unmap = bs->open_flags & BDRV_O_UNMAP;
+    if (!qdict_haskey(bs->explicit_options, BDRV_OPT_DISCARD)) {
+        qdict_put_str(opts, BDRV_OPT_DISCARD, "unmap");
+        discard_unmap = true;
+    }
+    if (!qdict_haskey(bs->explicit_options, "detect-zeroes")) {
+        qdict_put_str(opts, "detect-zeroes", discard_unmap ? "unmap" : "on");
+    }
+
+    if (qdict_size(opts) == 0) {
+        qobject_unref(opts);
+        return;
+    }
+
+    if (bdrv_reopen(bs, opts, true, &local_err) < 0) {
+        warn_reportf_err(local_err, "nvme-ns: could not enable discard: ");
+    }
+}
+
 static void nvme_ns_realize(DeviceState *dev, Error **errp)
 {
     NvmeNamespace *ns = NVME_NS(dev);
@@ -746,6 +784,10 @@ static void nvme_ns_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (n->params.unmap) {
+        nvme_ns_default_unmap(ns);
+    }
+
     if (!nsid) {
         for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
             if (nvme_ns(n, i) || nvme_subsys_ns(subsys, i)) {
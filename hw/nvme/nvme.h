@@ -532,6 +532,7 @@ typedef struct NvmeParams {
     uint8_t  vsl;
     bool     use_intel_id;
     bool     is_apple_ans;
+    bool     unmap;
     uint8_t  zasl;
     bool     auto_transition_zones;
     bool     legacy_cmb;
@@ -622,6 +623,11 @@ typedef struct NvmeCtrl {
         uint16_t    vqrfap;
         uint16_t    virfap;
     } next_pri_ctrl_cap;    /* These override pri_ctrl_cap after reset */
+
+    /* Called with the byte range of every read, if set (Apple ANS) */
+    void        (*read_notify)(void *opaque, uint32_t nsid, uint64_t offset,
+                               uint64_t len);
+    void        *read_notify_opaque;
 } NvmeCtrl;
 
 typedef enum NvmeResetType {
@@ -694,6 +700,7 @@ uint16_t nvme_bounce_data(NvmeCtrl *n, void *ptr, uint32_t len,
 uint16_t nvme_bounce_mdata(NvmeCtrl *n, void *ptr, uint32_t len,
                            NvmeTxDirection dir, NvmeRequest *req);
 void nvme_rw_complete_cb(void *opaque, int ret);
+void nvme_linear_sq_submit(NvmeCtrl *n, uint16_t sqid, uint16_t tag);
 uint16_t nvme_map_dptr(NvmeCtrl *n, NvmeSg *sg, size_t len,
                        NvmeCmd *cmd);
 
@@ -1,6 +1,7 @@
 #include "qemu/osdep.h"
 #include <zlib.h>
 #include "hw/nvram/apple_nvram.h"
+#include "hw/qdev-properties.h"
 #include "libdecnumber/decNumberLocal.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
@@ -23,13 +24,7 @@ static inline uint8_t chrp_checksum(ChrpNvramPartHdr *header)
 
 static env_var *find_env(AppleNvramState *s, const char *name)
 {
-    env_var *v;
-    QTAILQ_FOREACH (v, &s->env, entry) {
-        if (!strcmp(v->name, name)) {
-            return v;
-        }
-    }
-    return NULL;
+    return g_hash_table_lookup(s->env_index, name);
 }
 
 const char *env_get(AppleNvramState *s, const char *name)
@@ -85,6 +80,7 @@ int env_unset(AppleNvramState *s, const char *name)
         return 0;
     }
 
+    g_hash_table_remove(s->env_index, v->name);
     QTAILQ_REMOVE(&s->env, v, entry);
 
     g_free(v->str);
@@ -97,12 +93,23 @@ int env_set(AppleNvramState *s, const char *name, const char *val,
             uint32_t flags)
 {
     g_autofree env_var *v;
+    char *str;
 
     v = find_env(s, name);
 
+    /* Update in place, the variable keeps its slot in the partition. */
     if (v) {
-        env_unset(s, name);
-        v = NULL;
+        str = g_strdup(val);
+        if (str == NULL) {
+            v = NULL;
+            return -1;
+        }
+        g_free(v->str);
+        v->str = str;
+        v->u = strtoul(v->str, NULL, 0);
+        v->flags = flags;
+        g_steal_pointer(&v);
+        return 0;
     }
 
     v = g_malloc0(sizeof(env_var));
@@ -122,6 +129,7 @@ int env_set(AppleNvramState *s, const char *name, const char *val,
     v->flags = flags;
 
     QTAILQ_INSERT_TAIL(&s->env, v, entry);
+    g_hash_table_insert(s->env_index, v->name, v);
 
     g_steal_pointer(&v);
     return 0;
@@ -147,21 +155,28 @@ static ssize_t env_serialize(AppleNvramState *s, uint8_t *buffer, size_t len)
 {
     env_var *v;
     size_t pos = 0;
-    g_autofree char *buf = g_malloc0(len);
-
-    if (buf == NULL) {
-        return -1;
-    }
 
+    /* Size it first so a partition that is too small is left untouched. */
     QTAILQ_FOREACH (v, &s->env, entry) {
-        snprintf(buf + pos, len - pos, "%s=%s", v->name, v->str);
-        pos += strlen(buf + pos) + 1;
-
+        pos += strlen(v->name) + strlen(v->str) + 2;
         if (pos >= len) {
             return -1;
         }
     }
-    memcpy(buffer, buf, len);
+
+    pos = 0;
+    QTAILQ_FOREACH (v, &s->env, entry) {
+        size_t name_len = strlen(v->name);
+        size_t str_len = strlen(v->str);
+
+        memcpy(buffer + pos, v->name, name_len);
+        pos += name_len;
+        buffer[pos++] = '=';
+        memcpy(buffer + pos, v->str, str_len);
+        pos += str_len;
+        buffer[pos++] = '\0';
+    }
+    memset(buffer + pos, 0, len - pos);
     return pos;
 }
 
@@ -221,6 +236,23 @@ static void nvram_parse_partitions(NvramBank *bank, void *buf)
     }
 }
 
+/* A bank is valid when both its header checksum and adler32 match. */
+static bool nvram_bank_valid(void *buf, size_t len)
+{
+    AppleNvramPartHdr *hdr = buf;
+
+    return hdr->chrp.checksum == chrp_checksum(&hdr->chrp) &&
+           hdr->adler == adler32(1, buf + 0x14, len - 0x14);
+}
+
+static void nvram_stamp_bank(void *buf, size_t len, uint32_t generation)
+{
+    AppleNvramPartHdr *hdr = buf;
+
+    hdr->generation = generation;
+    hdr->adler = adler32(1, buf + 0x14, len - 0x14);
+}
+
 NvramBank *nvram_parse(void *buf, size_t len)
 {
     AppleNvramPartHdr *hdr = buf;
@@ -244,27 +276,28 @@ NvramBank *nvram_parse(void *buf, size_t len)
                      hdr->adler, adler);
         return bank;
     }
+    bank->generation = hdr->generation;
     nvram_parse_partitions(bank, buf);
 
     return bank;
 }
 
-static int nvram_prepare_bank(NvramBank *bank, void **buffer, size_t *len)
+/* Lay the bank out straight into `buf`, which holds at least bank->len. */
+static int nvram_prepare_bank(NvramBank *bank, uint8_t *buf)
 {
-    g_autofree void *buf = NULL;
     off_t offset = 0;
     AppleNvramPartHdr *apple_hdr = NULL;
     ChrpNvramPartHdr *hdr = NULL;
     NvramPartition *part = NULL;
 
-    buf = g_malloc0(bank->len);
+    memset(buf, 0, bank->len);
 
     apple_hdr = (AppleNvramPartHdr *)buf;
     apple_hdr->chrp.signature = 0x5a;
     apple_hdr->chrp.len = 0x2;
     memcpy(apple_hdr->chrp.name, "nvram", sizeof("nvram"));
     apple_hdr->chrp.checksum = chrp_checksum(&apple_hdr->chrp);
-    apple_hdr->generation = 0;
+    apple_hdr->generation = bank->generation;
 
     offset = 0x20;
     QTAILQ_FOREACH (part, &bank->parts, entry) {
@@ -301,8 +334,6 @@ static int nvram_prepare_bank(NvramBank *bank, void **buffer, size_t *len)
 
     apple_hdr->adler = adler32(1, buf + 0x14, bank->len - 0x14);
 
-    *buffer = g_steal_pointer(&buf);
-    *len = bank->len;
     return 0;
 }
 
@@ -371,8 +402,8 @@ static void apple_nvram_load_env(AppleNvramState *s)
 ssize_t apple_nvram_serialize(AppleNvramState *s, void *buffer, size_t size)
 {
     NvramPartition *p = nvram_find_part(s->bank, "common");
-    g_autofree void *buf = NULL;
-    size_t len = 0;
+    g_autofree uint8_t *buf = NULL;
+    size_t len = s->bank->len;
 
     if (!p) {
         p = g_malloc0(sizeof(NvramPartition));
@@ -387,16 +418,21 @@ ssize_t apple_nvram_serialize(AppleNvramState *s, void *buffer, size_t size)
         error_report("%s: failed to serialize env", __func__);
     }
 
-    if (nvram_prepare_bank(s->bank, &buf, &len) < 0) {
-        error_report("%s: failed to prepare bank", __func__);
-        return -1;
+    if (size >= len) {
+        if (nvram_prepare_bank(s->bank, buffer) < 0) {
+            error_report("%s: failed to prepare bank", __func__);
+            return -1;
+        }
+        return len;
     }
 
-    if (size < len) {
-        len = size;
+    buf = g_malloc(len);
+    if (nvram_prepare_bank(s->bank, buf) < 0) {
+        error_report("%s: failed to prepare bank", __func__);
+        return -1;
     }
-    memcpy(buffer, buf, len);
-    return len;
+    memcpy(buffer, buf, size);
+    return size;
 }
 
 static void apple_nvram_cleanup(AppleNvramState *s)
@@ -407,6 +443,7 @@ static void apple_nvram_cleanup(AppleNvramState *s)
         s->bank = NULL;
     }
 
+    g_hash_table_remove_all(s->env_index);
     while (v != NULL) {
         env_var *next = QTAILQ_NEXT(v, entry);
         g_free(v->str);
@@ -414,49 +451,179 @@ static void apple_nvram_cleanup(AppleNvramState *s)
         v = next;
     }
     QTAILQ_INIT(&s->env);
+    g_free(s->image);
+    s->image = NULL;
+    g_free(s->wb_pending);
+    s->wb_pending = NULL;
+}
+
+static void apple_nvram_wb_submit(AppleNvramState *s);
+
+static void apple_nvram_wb_done(AppleNvramState *s)
+{
+    g_free(s->wb_buf);
+    s->wb_buf = NULL;
+
+    if (s->wb_pending) {
+        apple_nvram_wb_submit(s);
+    }
+}
+
+static void apple_nvram_wb_flushed(void *opaque, int ret)
+{
+    AppleNvramState *s = opaque;
+
+    if (ret < 0) {
+        error_report("%s: Failed to flush NVRAM", __func__);
+    } else {
+        s->slot = s->wb_slot;
+    }
+    apple_nvram_wb_done(s);
+}
+
+static void apple_nvram_wb_written(void *opaque, int ret)
+{
+    AppleNvramState *s = opaque;
+    NvmeNamespace *ns = NVME_NS(s);
+
+    if (ret < 0) {
+        error_report("%s: Failed to write NVRAM", __func__);
+        apple_nvram_wb_done(s);
+        return;
+    }
+
+    blk_aio_flush(ns->blkconf.blk, apple_nvram_wb_flushed, s);
+}
+
+/* Write the pending bank over the slot that does not hold the newest one. */
+static void apple_nvram_wb_submit(AppleNvramState *s)
+{
+    NvmeNamespace *ns = NVME_NS(s);
+
+    s->wb_buf = g_steal_pointer(&s->wb_pending);
+    s->wb_slot = (s->slot + 1) % s->nslots;
+    qemu_iovec_init_buf(&s->wb_qiov, s->wb_buf, s->len);
+    blk_aio_pwritev(ns->blkconf.blk, s->wb_slot * s->len, &s->wb_qiov, 0,
+                    apple_nvram_wb_written, s);
+}
+
+static void apple_nvram_wb_queue(AppleNvramState *s, uint8_t *buf)
+{
+    g_free(s->wb_pending);
+    s->wb_pending = buf;
+
+    if (s->wb_buf == NULL) {
+        apple_nvram_wb_submit(s);
+    }
 }
 
 void apple_nvram_save(AppleNvramState *s)
 {
     NvmeNamespace *ns = NVME_NS(s);
-    g_autofree void *buf = g_malloc0(s->len);
+    g_autofree uint8_t *buf = g_malloc0(s->len);
     ssize_t len = apple_nvram_serialize(s, buf, s->len);
+    size_t start;
+    size_t end;
 
     if (len < 0) {
         error_report("%s: Failed to serialize NVRAM", __func__);
         return;
     }
 
-    if (blk_pwrite(ns->blkconf.blk, 0, len, buf, 0) < 0) {
+    /*
+     * A golden image shared between instances may be attached read-only,
+     * with each instance's writes landing in its own qcow2 overlay (or the
+     * temporary one -snapshot creates). Without an overlay there is nowhere
+     * to put the changes, which is not fatal.
+     */
+    if (!blk_is_writable(ns->blkconf.blk)) {
+        warn_report_once("%s: NVRAM backend is read-only, changes will not "
+                         "persist",
+                         __func__);
+        return;
+    }
+
+    if (s->write_behind) {
+        if (s->image && !memcmp(buf, s->image, len)) {
+            return;
+        }
+        nvram_stamp_bank(buf, len, ++s->bank->generation);
+        g_free(s->image);
+        s->image = g_memdup2(buf, len);
+        apple_nvram_wb_queue(s, g_steal_pointer(&buf));
+        return;
+    }
+
+    /* Only write back the sectors that differ from the backend. */
+    start = 0;
+    end = len;
+    if (s->image) {
+        while (start < end && buf[start] == s->image[start]) {
+            start++;
+        }
+        while (end > start && buf[end - 1] == s->image[end - 1]) {
+            end--;
+        }
+        if (start == end) {
+            return;
+        }
+        start = QEMU_ALIGN_DOWN(start, BDRV_SECTOR_SIZE);
+        end = MIN(QEMU_ALIGN_UP(end, BDRV_SECTOR_SIZE), len);
+    }
+
+    if (blk_pwrite(ns->blkconf.blk, start, end - start, buf + start, 0) < 0) {
         error_report("%s: Failed to write NVRAM", __func__);
         return;
     }
+
+    if (blk_flush(ns->blkconf.blk) < 0) {
+        error_report("%s: Failed to flush NVRAM", __func__);
+        return;
+    }
+
+    g_free(s->image);
+    s->image = g_steal_pointer(&buf);
 }
 
 void apple_nvram_load(AppleNvramState *s)
 {
     NvmeNamespace *ns = NVME_NS(s);
-    g_autofree void *buffer = NULL;
-    size_t len = blk_getlength(ns->blkconf.blk);
+    g_autofree uint8_t *buffer = NULL;
+    size_t blk_len = blk_getlength(ns->blkconf.blk);
+    size_t len = MIN(blk_len, 0x2000);
+    unsigned int nslots = 1;
+    unsigned int slot = 0;
 
-    if (len > 0x2000) {
-        len = 0x2000;
+    if (s->write_behind && blk_len >= 2 * len) {
+        nslots = 2;
     }
 
-    buffer = g_malloc0(len);
+    buffer = g_malloc0(nslots * len);
 
     blk_flush(ns->blkconf.blk);
     blk_drain(ns->blkconf.blk);
 
-    if (blk_pread(ns->blkconf.blk, 0, len, buffer, 0) < 0) {
+    if (blk_pread(ns->blkconf.blk, 0, nslots * len, buffer, 0) < 0) {
         error_report("%s: Failed to read NVRAM", __func__);
         return;
     }
 
+    if (nslots > 1 && nvram_bank_valid(buffer + len, len)) {
+        AppleNvramPartHdr *a = (AppleNvramPartHdr *)buffer;
+        AppleNvramPartHdr *b = (AppleNvramPartHdr *)(buffer + len);
+
+        if (!nvram_bank_valid(buffer, len) ||
+            (int32_t)(b->generation - a->generation) > 0) {
+            slot = 1;
+        }
+    }
+
     apple_nvram_cleanup(s);
     s->len = len;
-    s->bank = nvram_parse(buffer, len);
-    QTAILQ_INIT(&s->env);
+    s->nslots = nslots;
+    s->slot = slot;
+    s->bank = nvram_parse(buffer + slot * len, len);
+    s->image = g_memdup2(buffer + slot * len, len);
 
     if (nvram_find_part(s->bank, "common") == NULL) {
         NvramPartition *part = g_malloc0(sizeof(NvramPartition));
@@ -487,12 +654,22 @@ static void apple_nvram_unrealize(DeviceState *dev)
 {
     AppleNvramState *s = APPLE_NVRAM(dev);
     AppleNvramClass *anc = APPLE_NVRAM_GET_CLASS(dev);
+    NvmeNamespace *ns = NVME_NS(s);
+
+    if (ns->blkconf.blk) {
+        blk_drain(ns->blkconf.blk);
+    }
 
     anc->parent_unrealize(dev);
 
     apple_nvram_cleanup(s);
 }
 
+static Property apple_nvram_properties[] = {
+    DEFINE_PROP_BOOL("write-behind", AppleNvramState, write_behind, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_nvram_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -505,10 +682,22 @@ static void apple_nvram_class_init(ObjectClass *klass, void *data)
     device_class_set_parent_unrealize(dc, apple_nvram_unrealize,
                                       &anc->parent_unrealize);
     dc->desc = "Apple NVRAM";
+    device_class_set_props(dc, apple_nvram_properties);
 }
 
 static void apple_nvram_instance_init(Object *obj)
 {
+    AppleNvramState *s = APPLE_NVRAM(obj);
+
+    QTAILQ_INIT(&s->env);
+    s->env_index = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void apple_nvram_instance_finalize(Object *obj)
+{
+    AppleNvramState *s = APPLE_NVRAM(obj);
+
+    g_hash_table_destroy(s->env_index);
 }
 
 static const TypeInfo apple_nvram_info = {
@@ -518,6 +707,7 @@ static const TypeInfo apple_nvram_info = {
     .class_init = apple_nvram_class_init,
     .instance_size = sizeof(AppleNvramState),
     .instance_init = apple_nvram_instance_init,
+    .instance_finalize = apple_nvram_instance_finalize,
 };
 
 static void apple_nvram_register_types(void)
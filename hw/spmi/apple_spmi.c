@@ -128,7 +128,10 @@ static void apple_spmi_update_irq(AppleSPMIState *s)
         }
     }
 
-    qemu_set_irq(s->irq, level);
+    if (level != s->irq_level) {
+        s->irq_level = level;
+        qemu_set_irq(s->irq, level);
+    }
 }
 
 static void apple_spmi_set_irq(void *opaque, int irq, int level)
@@ -154,12 +157,18 @@ static void apple_spmi_set_irq(void *opaque, int irq, int level)
     apple_spmi_update_irq(s);
 }
 
-static void apple_spmi_update_queues_status(AppleSPMIState *s)
+/*
+ * Signal the response interrupt when new responses were queued (`pushed`),
+ * otherwise only when the queue drains; popping the rest of a batch
+ * doesn't raise it again.
+ */
+static void apple_spmi_update_queues_status(AppleSPMIState *s, bool pushed)
 {
-    if (!fifo32_is_empty(&s->resp_fifo)) {
-        qemu_irq_raise(s->resp_irq);
-    } else {
-        qemu_irq_lower(s->resp_irq);
+    bool pending = !fifo32_is_empty(&s->resp_fifo);
+
+    if (pending != s->resp_pending || (pending && pushed)) {
+        s->resp_pending = pending;
+        qemu_set_irq(s->resp_irq, pending);
     }
 }
 
@@ -203,7 +212,8 @@ static void apple_spmi_queue_reg_write(void *opaque, hwaddr addr, uint64_t data,
             }
             if (s->data == NULL && len) {
                 assert(opc == SPMI_CMD_EXT_READ || opc == SPMI_CMD_EXT_READL);
-                g_autofree uint32_t *data = g_malloc0(len + 3);
+                /* Reads are at most 8 bytes. */
+                uint32_t data[2] = { 0 };
                 int count = spmi_recv(s->bus, (uint8_t *)data, len);
                 uint8_t ack = 0;
                 value &= 0xFFF;
@@ -254,7 +264,7 @@ static void apple_spmi_queue_reg_write(void *opaque, hwaddr addr, uint64_t data,
     }
     *mmio = value;
     if (qflg) {
-        apple_spmi_update_queues_status(s);
+        apple_spmi_update_queues_status(s, true);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -279,8 +289,8 @@ static uint64_t apple_spmi_queue_reg_read(void *opaque, hwaddr addr,
         } else {
             value = fifo32_pop(&s->resp_fifo);
         }
+        /* The response interrupt updates the IRQ if it changes. */
         qflg = true;
-        iflg = true;
         break;
     case SPMI_QUEUE_STATUS:
         value &= ~(SPMI_QUEUE_STATUS_REQ_EMPTY | SPMI_QUEUE_STATUS_RSP_EMPTY);
@@ -294,8 +304,7 @@ static uint64_t apple_spmi_queue_reg_read(void *opaque, hwaddr addr,
     }
 
     if (qflg) {
-        apple_spmi_update_queues_status(s);
-        iflg = true;
+        apple_spmi_update_queues_status(s, false);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -333,7 +342,7 @@ static uint64_t apple_spmi_control_read(void *opaque, hwaddr addr,
     }
 
     if (qflg) {
-        apple_spmi_update_queues_status(s);
+        apple_spmi_update_queues_status(s, false);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -374,7 +383,7 @@ static void apple_spmi_control_write(void *opaque, hwaddr addr, uint64_t data,
 
     *mmio = value;
     if (qflg) {
-        apple_spmi_update_queues_status(s);
+        apple_spmi_update_queues_status(s, false);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -410,7 +419,7 @@ static uint64_t apple_spmi_fault_read(void *opaque, hwaddr addr, unsigned size)
     }
 
     if (qflg) {
-        apple_spmi_update_queues_status(s);
+        apple_spmi_update_queues_status(s, false);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -443,7 +452,7 @@ static void apple_spmi_fault_write(void *opaque, hwaddr addr, uint64_t data,
 
     *mmio = value;
     if (qflg) {
-        apple_spmi_update_queues_status(s);
+        apple_spmi_update_queues_status(s, false);
     }
     if (iflg) {
         apple_spmi_update_irq(s);
@@ -488,7 +497,12 @@ static void apple_spmi_reset_exit(Object *obj)
     if (c->parent_phases.exit) {
         c->parent_phases.exit(obj);
     }
-    apple_spmi_update_queues_status(s);
+    /* Drive both lines again whatever they were left at. */
+    s->resp_pending = false;
+    qemu_irq_lower(s->resp_irq);
+    s->irq_level = false;
+    qemu_irq_lower(s->irq);
+    apple_spmi_update_queues_status(s, false);
     apple_spmi_update_irq(s);
 }
 
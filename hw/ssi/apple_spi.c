@@ -8,6 +8,7 @@
 #include "qemu/fifo32.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qemu/units.h"
 
 /* XXX: Based on linux/drivers/spi/spi-apple.c */
 
@@ -60,6 +61,8 @@
 
 #define REG(_s, _v) ((_s)->regs[(_v) >> 2])
 
+#define SPI_DMA_CHUNK_SIZE (4 * KiB)
+
 struct AppleSPIState {
     SysBusDevice parent_obj;
 
@@ -210,6 +213,82 @@ static void apple_spi_cs_set(void *opaque, int pin, int level)
     apple_spi_update_cs(s);
 }
 
+/*
+ * In DMA mode, with nothing left in the FIFOs, move whole chunks between the
+ * SIO channels and the bus rather than a word at a time through the FIFOs.
+ * Whatever the channels can't take is left to the FIFO path.
+ */
+static void apple_spi_run_dma(AppleSPIState *s)
+{
+    g_autofree uint8_t *tx = NULL;
+    g_autofree uint8_t *rx = NULL;
+    int word_size = apple_spi_word_size(s);
+
+    if (!fifo32_is_empty(&s->tx_fifo) || !fifo32_is_empty(&s->rx_fifo)) {
+        return;
+    }
+
+    tx = g_malloc(SPI_DMA_CHUNK_SIZE);
+    rx = g_malloc(SPI_DMA_CHUNK_SIZE);
+
+    for (;;) {
+        uint64_t len;
+        uint64_t rx_len;
+        uint64_t rx_avail;
+        bool agd = false;
+
+        if (REG(s, REG_TXCNT)) {
+            len = MIN((uint64_t)REG(s, REG_TXCNT) * word_size,
+                      apple_sio_dma_remaining(s->tx_chan));
+        } else if (REG(s, REG_RXCNT) && (REG(s, REG_CFG) & REG_CFG_AGD)) {
+            len = (uint64_t)REG(s, REG_RXCNT) * word_size;
+            agd = true;
+        } else {
+            break;
+        }
+        len = MIN(len, SPI_DMA_CHUNK_SIZE);
+        len -= len % word_size;
+
+        rx_len = MIN(len, (uint64_t)REG(s, REG_RXCNT) * word_size);
+        rx_avail = apple_sio_dma_remaining(s->rx_chan);
+        if (rx_len > rx_avail) {
+            len = rx_len = rx_avail - rx_avail % word_size;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        if (agd) {
+            memset(tx, 0xff, len);
+        } else {
+            len = apple_sio_dma_read(s->tx_chan, tx, len);
+            len -= len % word_size;
+            if (len == 0) {
+                break;
+            }
+            rx_len = MIN(rx_len, len);
+        }
+
+        ssi_transfer_bulk(s->spi, tx, rx, len);
+
+        if (!agd) {
+            REG(s, REG_TXCNT) -= len / word_size;
+        }
+        if (rx_len) {
+            /* The FIFO path stores the first byte in as the word's MSB. */
+            for (int i = 0; word_size > 1 && i < rx_len; i += word_size) {
+                for (int j = 0; j < word_size / 2; j++) {
+                    uint8_t v = rx[i + j];
+                    rx[i + j] = rx[i + word_size - 1 - j];
+                    rx[i + word_size - 1 - j] = v;
+                }
+            }
+            apple_sio_dma_write(s->rx_chan, rx, rx_len);
+            REG(s, REG_RXCNT) -= rx_len / word_size;
+        }
+    }
+}
+
 static void apple_spi_run(AppleSPIState *s)
 {
     uint32_t tx;
@@ -233,6 +312,10 @@ static void apple_spi_run(AppleSPIState *s)
         return;
     }
 
+    if (REG_CFG_MODE(REG(s, REG_CFG)) == REG_CFG_MODE_DMA) {
+        apple_spi_run_dma(s);
+    }
+
     apple_spi_update_xfer_tx(s);
 
     while (REG(s, REG_TXCNT) && !fifo32_is_empty(&s->tx_fifo)) {
@@ -1,8 +1,11 @@
 #include "qemu/osdep.h"
 #include "hw/qdev-properties.h"
 #include "hw/usb/apple_typec.h"
+#include "hw/usb/hcd-ncm.h"
 #include "hw/usb/hcd-tcp.h"
+#include "hw/usb/hcd-usbmux.h"
 #include "migration/vmstate.h"
+#include "net/net.h"
 #include "qapi/error.h"
 #include "qemu/module.h"
 
@@ -11,6 +14,7 @@ static void apple_typec_realize(DeviceState *dev, Error **errp)
     AppleTypeCState *s = APPLE_TYPEC(dev);
     Object *obj;
     BusState *bus = NULL;
+    NICInfo *nd;
 
     memory_region_init(&s->dma_container_mr, OBJECT(dev),
                        TYPE_APPLE_TYPEC ".dma-container-mr", UINT32_MAX);
@@ -34,7 +38,20 @@ static void apple_typec_realize(DeviceState *dev, Error **errp)
     sysbus_pass_irq(SYS_BUS_DEVICE(s), SYS_BUS_DEVICE(&s->dwc3));
     sysbus_init_irq(SYS_BUS_DEVICE(s), &s->dwc2.irq);
 
-    s->host = SYS_BUS_DEVICE(qdev_new(TYPE_USB_TCP_HOST));
+    /*
+     * A usbmux socket, or `-nic <backend>,model=usb-ncm`, drives the
+     * gadget from here instead of relaying it to a usb-tcp remote.
+     */
+    nd = qemu_find_nic_info(TYPE_USB_NCM_HOST, false, "usb-ncm");
+    if (s->usbmux_path) {
+        s->host = SYS_BUS_DEVICE(qdev_new(TYPE_USB_MUX_HOST));
+        qdev_prop_set_string(DEVICE(s->host), "path", s->usbmux_path);
+    } else if (nd) {
+        s->host = SYS_BUS_DEVICE(qdev_new(TYPE_USB_NCM_HOST));
+        qdev_set_nic_properties(DEVICE(s->host), nd);
+    } else {
+        s->host = SYS_BUS_DEVICE(qdev_new(TYPE_USB_TCP_HOST));
+    }
     sysbus_realize(s->host, errp);
 
     bus = QLIST_FIRST(&DEVICE(s->host)->child_bus);
@@ -144,6 +161,7 @@ static int apple_typec_post_load(void *opaque, int version_id)
 }
 
 static Property apple_typec_properties[] = {
+    DEFINE_PROP_STRING("usbmux", AppleTypeCState, usbmux_path),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -7,6 +7,7 @@
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
@@ -18,6 +19,10 @@
 #include "tcp-usb.h"
 #include "trace.h"
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
 // #define DEBUG_DEV_TCP_REMOTE
 
 #ifdef DEBUG_DEV_TCP_REMOTE
@@ -31,16 +36,87 @@
     } while (0)
 #endif
 
+/* Must be called with the queue mutex held. */
+static void usb_tcp_remote_inflight_insert(USBTCPRemoteState *s,
+                                           USBTCPInflightPacket *pkt)
+{
+    USBTCPInflightPacket *head;
+
+    pkt->id = pkt->p->id;
+    pkt->next = NULL;
+    head = g_hash_table_lookup(s->inflight, &pkt->id);
+    if (head == NULL) {
+        g_hash_table_insert(s->inflight, &pkt->id, pkt);
+    } else {
+        /* Oldest first, like the host answers them. */
+        while (head->next != NULL) {
+            head = head->next;
+        }
+        head->next = pkt;
+    }
+    QTAILQ_INSERT_TAIL(&s->queue, pkt, queue);
+}
+
+/* Must be called with the queue mutex held. */
+static void usb_tcp_remote_inflight_remove(USBTCPRemoteState *s,
+                                           USBTCPInflightPacket *pkt)
+{
+    USBTCPInflightPacket *head = g_hash_table_lookup(s->inflight, &pkt->id);
+    USBTCPInflightPacket **link;
+
+    if (head != pkt) {
+        for (link = &head->next; *link != pkt; link = &(*link)->next) {
+            continue;
+        }
+        *link = pkt->next;
+    } else if (pkt->next != NULL) {
+        /* The key lives in the record, hand it over to the next one. */
+        g_hash_table_replace(s->inflight, &pkt->next->id, pkt->next);
+    } else {
+        g_hash_table_remove(s->inflight, &pkt->id);
+    }
+    QTAILQ_REMOVE(&s->queue, pkt, queue);
+}
+
+/* Must be called with the queue mutex held. */
+static USBTCPInflightPacket *
+usb_tcp_remote_inflight_alloc(USBTCPRemoteState *s)
+{
+    USBTCPInflightPacket *pkt = s->pool;
+
+    if (pkt == NULL) {
+        return g_new0(USBTCPInflightPacket, 1);
+    }
+    s->pool = pkt->next;
+    memset(pkt, 0, sizeof(*pkt));
+    return pkt;
+}
+
+/* Must be called with the queue mutex held. */
+static void usb_tcp_remote_inflight_free(USBTCPRemoteState *s,
+                                         USBTCPInflightPacket *pkt)
+{
+    pkt->next = s->pool;
+    s->pool = pkt;
+}
+
+/*
+ * The record of a response's packet. Records of async packets are taken
+ * out on the final response and the caller frees them.
+ */
 static USBTCPInflightPacket *
 usb_tcp_remote_find_inflight_packet(USBTCPRemoteState *s, int pid, uint8_t ep,
-                                    uint64_t id)
+                                    uint64_t id, bool final)
 {
     USBTCPInflightPacket *p;
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
-        QTAILQ_FOREACH (p, &s->queue, queue) {
-            if (p->p->pid == pid && p->p->ep->nr == ep && p->p->id == id) {
+        for (p = g_hash_table_lookup(s->inflight, &id); p; p = p->next) {
+            if (p->p->pid == pid && p->p->ep->nr == ep) {
+                if (p->async && final) {
+                    usb_tcp_remote_inflight_remove(s, p);
+                }
                 return p;
             }
         }
@@ -56,6 +132,10 @@ static void usb_tcp_remote_clean_inflight_queue(USBTCPRemoteState *s)
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
         QTAILQ_FOREACH (p, &s->queue, queue) {
+            if (p->async) {
+                /* Nobody waits on these, the HCD cancels them. */
+                continue;
+            }
             p->p->status = USB_RET_STALL;
             qatomic_set(&p->handled, 1);
             /* Will be cleaned by usb_tcp_remote_handle_packet */
@@ -84,6 +164,28 @@ static void usb_tcp_remote_clean_completed_queue(USBTCPRemoteState *s)
     }
 }
 
+static void usb_tcp_remote_pipeline_reset(USBTCPRemoteState *s)
+{
+    USBTCPPendingPacket *pend;
+    USBTCPInflightPacket *pkt, *next;
+
+    while (!QTAILQ_EMPTY(&s->pending_queue)) {
+        pend = QTAILQ_FIRST(&s->pending_queue);
+        QTAILQ_REMOVE(&s->pending_queue, pend, queue);
+        g_free(pend);
+    }
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        QTAILQ_FOREACH_SAFE (pkt, &s->queue, queue, next) {
+            if (pkt->async) {
+                usb_tcp_remote_inflight_remove(s, pkt);
+                usb_tcp_remote_inflight_free(s, pkt);
+            }
+        }
+    }
+    memset(s->pipeline_inflight, 0, sizeof(s->pipeline_inflight));
+}
+
 static void usb_tcp_remote_cleanup(void *opaque)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(opaque);
@@ -99,6 +201,7 @@ static void usb_tcp_remote_cleanup(void *opaque)
     s->addr = 0;
 
     usb_tcp_remote_clean_completed_queue(s);
+    usb_tcp_remote_pipeline_reset(s);
 
     if (USB_DEVICE(s)->attached) {
         usb_device_detach(USB_DEVICE(s));
@@ -168,18 +271,22 @@ static void usb_tcp_remote_closed(USBTCPRemoteState *s)
     qemu_bh_schedule(s->cleanup_bh);
 }
 
-static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
-                               unsigned int length)
+/* Note: consumes `iov`. */
+static int usb_tcp_remote_readv(USBTCPRemoteState *s, struct iovec *iov,
+                                unsigned int iovcnt)
 {
-    int ret = 0;
+    ssize_t ret = 0;
     int n = 0;
     bool locked = bql_locked();
     if (locked) {
         bql_unlock();
     }
 
-    while (n < length) {
-        ret = read(s->fd, (char *)buffer + n, length - n);
+    while (iovcnt) {
+        ret = readv(s->fd, iov, iovcnt);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
         if (ret <= 0) {
             if (locked) {
                 bql_lock();
@@ -188,6 +295,7 @@ static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
             return -errno;
         }
 
+        iov_discard_front(&iov, &iovcnt, ret);
         n += ret;
     }
 
@@ -198,52 +306,314 @@ static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
     return n;
 }
 
-static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
-                                unsigned int length)
+static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
+                               unsigned int length)
 {
-    int ret = 0;
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+
+    return usb_tcp_remote_readv(s, &iov, 1);
+}
+
+/* Note: consumes `iov`. */
+static int usb_tcp_remote_writev(USBTCPRemoteState *s, struct iovec *iov,
+                                 unsigned int iovcnt)
+{
+    ssize_t ret = 0;
     int n = 0;
 
-    while (n < length) {
-        ret = write(s->fd, (char *)buffer + n, length - n);
+    while (iovcnt) {
+        ret = writev(s->fd, iov, iovcnt);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
         if (ret <= 0) {
             usb_tcp_remote_closed(s);
             return -errno;
         }
 
+        iov_discard_front(&iov, &iovcnt, ret);
         n += ret;
     }
 
     return n;
 }
 
+static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
+                                unsigned int length)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+
+    return usb_tcp_remote_writev(s, &iov, 1);
+}
+
+/*
+ * Write the request for `p`, with its OUT payload taken straight from the
+ * packet. Must be called with the request mutex held.
+ */
+static bool usb_tcp_remote_send_request(USBTCPRemoteState *s, USBPacket *p,
+                                        uint8_t flags)
+{
+    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_request_header pkt = { 0 };
+    uint8_t buf[TCP_USB_MAX_HDR_SIZE];
+    size_t len;
+    g_autofree struct iovec *iov = NULL;
+    unsigned int iovcnt = 2;
+
+    hdr.type = TCP_USB_REQUEST;
+    pkt.addr = s->addr;
+    pkt.pid = p->pid;
+    pkt.ep = p->ep->nr;
+    pkt.stream = p->stream;
+    pkt.id = p->id;
+    pkt.short_not_ok = p->short_not_ok;
+    pkt.int_req = p->int_req | flags;
+    pkt.length = p->iov.size - p->actual_length;
+
+    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx len 0x%x\n", __func__, pkt.pid,
+            pkt.ep, pkt.id, pkt.length);
+
+    len = tcp_usb_encode_request(buf, &pkt, s->proto_version);
+
+    /* Header, request and OUT payload go out in a single writev. */
+    iov = g_new(struct iovec, 2 + p->iov.niov);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+
+    if (p->pid != USB_TOKEN_IN && pkt.length) {
+        iovcnt += iov_copy(iov + 2, p->iov.niov, p->iov.iov, p->iov.niov,
+                           p->actual_length, pkt.length);
+        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0) {
+            struct usb_control_packet setup = { 0 };
+
+            iov_to_buf(p->iov.iov, p->iov.niov, p->actual_length, &setup,
+                       sizeof(setup));
+#ifdef DEBUG_DEV_TCP_REMOTE
+            qemu_hexdump(stderr, __func__, &setup, sizeof(setup));
+#endif
+
+            if (setup.bmRequestType == 0 &&
+                setup.bRequest == USB_REQ_SET_ADDRESS) {
+                s->addr = setup.wValue;
+            }
+        }
+    }
+
+    return usb_tcp_remote_writev(s, iov, iovcnt) >=
+           sizeof(hdr) + len +
+               (p->pid != USB_TOKEN_IN ? pkt.length : 0);
+}
+
+static bool usb_tcp_remote_is_pipelined(USBTCPRemoteState *s, USBPacket *p)
+{
+    return s->pipeline_depth > 1 && p->ep->nr != 0 && !p->stream &&
+           (p->pid == USB_TOKEN_IN || p->pid == USB_TOKEN_OUT);
+}
+
+static uint32_t *usb_tcp_remote_pipeline_inflight(USBTCPRemoteState *s,
+                                                  USBPacket *p)
+{
+    return &s->pipeline_inflight[p->pid == USB_TOKEN_IN][p->ep->nr];
+}
+
+/*
+ * Send a pipelined request, indexed first so that the read thread finds
+ * it. Must be called with the BQL held.
+ */
+static bool usb_tcp_remote_pipeline_send(USBTCPRemoteState *s, USBPacket *p)
+{
+    USBTCPInflightPacket *pkt;
+    bool sent = false;
+
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        pkt = usb_tcp_remote_inflight_alloc(s);
+        pkt->p = p;
+        pkt->async = true;
+        usb_tcp_remote_inflight_insert(s, pkt);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->request_mutex)
+    {
+        sent = usb_tcp_remote_send_request(s, p, TCP_USB_REQ_PIPELINED);
+    }
+
+    if (!sent) {
+        WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+        {
+            usb_tcp_remote_inflight_remove(s, pkt);
+            usb_tcp_remote_inflight_free(s, pkt);
+        }
+    }
+    return sent;
+}
+
+/*
+ * Drop the record of an async request, unless the read thread took it
+ * already. Must be called with the BQL held.
+ */
+static bool usb_tcp_remote_async_forget(USBTCPRemoteState *s, USBPacket *p)
+{
+    USBTCPInflightPacket *pkt;
+    uint64_t id = p->id;
+
+    QEMU_LOCK_GUARD(&s->queue_mutex);
+    for (pkt = g_hash_table_lookup(s->inflight, &id); pkt; pkt = pkt->next) {
+        if (pkt->p == p && pkt->async) {
+            usb_tcp_remote_inflight_remove(s, pkt);
+            usb_tcp_remote_inflight_free(s, pkt);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Send held back requests for `ep` while its window has room.
+ * Must be called with the BQL held.
+ */
+static void usb_tcp_remote_pipeline_kick(USBTCPRemoteState *s,
+                                         USBEndpoint *ep)
+{
+    USBTCPPendingPacket *pend, *next;
+
+    QTAILQ_FOREACH_SAFE (pend, &s->pending_queue, queue, next) {
+        uint32_t *inflight;
+
+        if (pend->p->ep != ep) {
+            continue;
+        }
+        inflight = usb_tcp_remote_pipeline_inflight(s, pend->p);
+        if (*inflight >= s->pipeline_depth) {
+            break;
+        }
+        QTAILQ_REMOVE(&s->pending_queue, pend, queue);
+        (*inflight)++;
+        usb_tcp_remote_pipeline_send(s, pend->p);
+        g_free(pend);
+    }
+}
+
+static bool usb_tcp_remote_pipeline_unqueue(USBTCPRemoteState *s,
+                                            USBPacket *p)
+{
+    USBTCPPendingPacket *pend;
+
+    QTAILQ_FOREACH (pend, &s->pending_queue, queue) {
+        if (pend->p == p) {
+            QTAILQ_REMOVE(&s->pending_queue, pend, queue);
+            g_free(pend);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Read a compressed IN payload of `clength` bytes that inflates to
+ * `length`, into `p` if there is one.
+ */
+static bool usb_tcp_remote_read_compressed(USBTCPRemoteState *s, USBPacket *p,
+                                           uint32_t clength, uint16_t length)
+{
+#ifdef CONFIG_ZSTD
+    g_autofree void *cbuf = g_malloc(clength);
+    g_autofree void *buffer = g_malloc(length);
+    size_t ret;
+
+    if (usb_tcp_remote_read(s, cbuf, clength) < clength) {
+        return false;
+    }
+
+    ret = ZSTD_decompress(buffer, length, cbuf, clength);
+    if (ZSTD_isError(ret) || ret != length) {
+        warn_report("%s: bad compressed payload", __func__);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    if (p && length <= p->iov.size - p->actual_length) {
+        usb_packet_copy(p, buffer, length);
+    }
+    return true;
+#else
+    /* Never negotiated. */
+    usb_tcp_remote_closed(s);
+    return false;
+#endif
+}
+
 static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
 {
     tcp_usb_header_t hdr = { 0 };
+    tcp_usb_response_header rhdr = { 0 };
+    uint8_t buf[TCP_USB_MAX_HDR_SIZE];
+    size_t len;
+    uint32_t clength = 0;
+    struct iovec hdr_iov[] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = buf, .iov_len = 1 },
+    };
+
+    /*
+     * The host only ever sends responses, so read both headers at once, or
+     * the header and v2 length byte. Anything else closes the connection
+     * regardless.
+     */
+    if (s->proto_version < TCP_USB_PROTO_V2) {
+        hdr_iov[1].iov_len = sizeof(rhdr);
+    }
+    if (usb_tcp_remote_readv(s, hdr_iov, ARRAY_SIZE(hdr_iov)) <
+        sizeof(hdr) + hdr_iov[1].iov_len) {
+        return false;
+    }
+
+    if (s->proto_version < TCP_USB_PROTO_V2) {
+        len = sizeof(rhdr);
+    } else {
+        len = buf[0];
+        if (len >= sizeof(buf)) {
+            usb_tcp_remote_closed(s);
+            return false;
+        }
+        if (usb_tcp_remote_read(s, buf, len) < (int)len) {
+            return false;
+        }
+    }
 
-    if (usb_tcp_remote_read(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+    if (hdr.type == TCP_USB_RESPONSE &&
+        !tcp_usb_decode_response(buf, len, &rhdr, &clength,
+                                 s->proto_version)) {
+        DPRINTF("%s: Malformed response\n", __func__);
+        usb_tcp_remote_closed(s);
         return false;
     }
 
     switch (hdr.type) {
     case TCP_USB_RESPONSE: {
-        tcp_usb_response_header rhdr = { 0 };
         USBPacket *p = NULL;
         USBTCPInflightPacket *pkt = NULL;
         bool cancelled = false;
-
-        if (usb_tcp_remote_read(s, &rhdr, sizeof(rhdr)) < sizeof(rhdr)) {
-            return false;
-        }
+        bool async = false;
 
         smp_rmb();
-        pkt =
-            usb_tcp_remote_find_inflight_packet(s, rhdr.pid, rhdr.ep, rhdr.id);
-        if (pkt == NULL) {
-            p = usb_ep_find_packet_by_id(USB_DEVICE(s), rhdr.pid, rhdr.ep,
-                                         rhdr.id);
-        } else {
+        pkt = usb_tcp_remote_find_inflight_packet(
+            s, rhdr.pid, rhdr.ep, rhdr.id, rhdr.status != USB_RET_ASYNC);
+        if (pkt != NULL) {
             p = pkt->p;
+            async = pkt->async;
+        }
+        if (async) {
+            /* Completed from here, not by a waiting handle_packet. */
+            if (rhdr.status != USB_RET_ASYNC) {
+                WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+                {
+                    usb_tcp_remote_inflight_free(s, pkt);
+                }
+            }
+            pkt = NULL;
         }
         DPRINTF("%s: TCP_USB_RESPONSE "
                 "Received packet pid: 0x%x ep: 0x%x id: 0x%" PRIx64
@@ -260,8 +630,25 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
         }
 
         if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC) {
-            g_autofree void *buffer = g_malloc(rhdr.length);
-            if (rhdr.pid == USB_TOKEN_IN) {
+            if (rhdr.pid == USB_TOKEN_IN && clength) {
+                if (!usb_tcp_remote_read_compressed(s, p, clength,
+                                                    rhdr.length)) {
+                    return false;
+                }
+            } else if (rhdr.pid == USB_TOKEN_IN && p &&
+                rhdr.length <= p->iov.size - p->actual_length) {
+                /* Receive straight into the packet. */
+                g_autofree struct iovec *iov = g_new(struct iovec, p->iov.niov);
+                unsigned int iovcnt;
+
+                iovcnt = iov_copy(iov, p->iov.niov, p->iov.iov, p->iov.niov,
+                                  p->actual_length, rhdr.length);
+                if (usb_tcp_remote_readv(s, iov, iovcnt) < rhdr.length) {
+                    return false;
+                }
+                p->actual_length += rhdr.length;
+            } else if (rhdr.pid == USB_TOKEN_IN) {
+                g_autofree void *buffer = g_malloc(rhdr.length);
                 if (usb_tcp_remote_read(s, buffer, rhdr.length) < rhdr.length) {
                     return false;
                 }
@@ -277,6 +664,15 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
             return true;
         }
 
+        if (async && p->ep->pipeline) {
+            if (rhdr.status == USB_RET_ASYNC) {
+                /* Interim reply, the host has queued the request. */
+                return true;
+            }
+            (*usb_tcp_remote_pipeline_inflight(s, p))--;
+            usb_tcp_remote_pipeline_kick(s, p->ep);
+        }
+
         p->status = rhdr.status;
         if (p->state == USB_PACKET_ASYNC) {
             if (p->status == USB_RET_NAK || p->status == USB_RET_ASYNC) {
@@ -343,6 +739,34 @@ static void *usb_tcp_remote_read_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Answer the host's TCP_USB_HELLO with the highest version and the features
+ * both ends support. Runs on the freshly accepted socket, before any packet.
+ */
+static bool usb_tcp_remote_handshake(USBTCPRemoteState *s)
+{
+    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_hello hello = { 0 };
+    uint8_t features = 0;
+
+    if (recv(s->fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr) ||
+        hdr.type != TCP_USB_HELLO ||
+        recv(s->fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+        !tcp_usb_hello_parse(&hello, &s->proto_version, &features)) {
+        return false;
+    }
+
+#ifdef CONFIG_ZSTD
+    s->proto_features = features & TCP_USB_FEAT_ZSTD;
+#else
+    s->proto_features = 0;
+#endif
+
+    tcp_usb_hello_init(&hello, s->proto_version, s->proto_features);
+    return qemu_write_full(s->fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+           qemu_write_full(s->fd, &hello, sizeof(hello)) == sizeof(hello);
+}
+
 static void *usb_tcp_remote_thread(void *arg)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(arg);
@@ -359,6 +783,13 @@ static void *usb_tcp_remote_thread(void *arg)
                 DPRINTF("%s: accept error %d.\n", __func__, errno);
                 continue;
             }
+            tcp_usb_set_socket_bufs(s->fd);
+            if (!usb_tcp_remote_handshake(s)) {
+                warn_report("%s: handshake with the host failed", __func__);
+                close(s->fd);
+                s->fd = -1;
+                continue;
+            }
             migrate_add_blocker(&s->migration_blocker, NULL);
 
             s->closed = 0;
@@ -401,10 +832,18 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
 
     qemu_mutex_init(&s->queue_mutex);
     QTAILQ_INIT(&s->queue);
+    s->inflight = g_hash_table_new(g_int64_hash, g_int64_equal);
+    if (s->pipeline_depth > 1) {
+        /* A bulk IN and a bulk OUT pipe at full depth. */
+        for (uint32_t i = 0; i < s->pipeline_depth * 2; i++) {
+            usb_tcp_remote_inflight_free(s, g_new0(USBTCPInflightPacket, 1));
+        }
+    }
 
     qemu_mutex_init(&s->completed_queue_mutex);
     qemu_cond_init(&s->completed_queue_cond);
     QTAILQ_INIT(&s->completed_queue);
+    QTAILQ_INIT(&s->pending_queue);
 
     s->completed_bh = qemu_bh_new(usb_tcp_remote_completed_bh, s);
     s->addr_bh = qemu_bh_new(usb_tcp_remote_update_addr_bh, s);
@@ -495,6 +934,7 @@ static void usb_tcp_remote_handle_reset(USBDevice *dev)
     DPRINTF("%s\n", __func__);
     usb_tcp_remote_clean_inflight_queue(s);
     usb_tcp_remote_clean_completed_queue(s);
+    usb_tcp_remote_pipeline_reset(s);
     s->addr = 0;
     hdr.type = TCP_USB_RESET;
 
@@ -510,7 +950,9 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
     USBTCPInflightPacket inflightPacket = { 0 };
     tcp_usb_header_t hdr = { 0 };
     tcp_usb_cancel_header pkt = { 0 };
+    uint8_t buf[TCP_USB_MAX_HDR_SIZE];
     bool locked = bql_locked();
+    bool pipelined;
     int64_t start;
 
     if (p->combined) {
@@ -518,6 +960,16 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
         return;
     }
 
+    pipelined = usb_tcp_remote_is_pipelined(s, p);
+    if (pipelined && usb_tcp_remote_pipeline_unqueue(s, p)) {
+        /* Never made it to the wire. */
+        return;
+    }
+    /* The response now goes to the record below, the window is ours. */
+    if (!usb_tcp_remote_async_forget(s, p)) {
+        pipelined = false;
+    }
+
     if (s->closed) {
         return;
     }
@@ -537,13 +989,18 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
-        QTAILQ_INSERT_TAIL(&s->queue, &inflightPacket, queue);
+        usb_tcp_remote_inflight_insert(s, &inflightPacket);
     }
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex)
     {
-        usb_tcp_remote_write(s, &hdr, sizeof(hdr));
-        usb_tcp_remote_write(s, &pkt, sizeof(pkt));
+        struct iovec iov[] = {
+            { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+            { .iov_base = buf,
+              .iov_len = tcp_usb_encode_cancel(buf, &pkt, s->proto_version) },
+        };
+
+        usb_tcp_remote_writev(s, iov, ARRAY_SIZE(iov));
     }
     /* TODO: wait for status */
 
@@ -565,17 +1022,24 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
-        QTAILQ_REMOVE(&s->queue, &inflightPacket, queue);
+        usb_tcp_remote_inflight_remove(s, &inflightPacket);
+    }
+
+    if (pipelined) {
+        uint32_t *inflight = usb_tcp_remote_pipeline_inflight(s, p);
+
+        if (*inflight) {
+            (*inflight)--;
+        }
+        usb_tcp_remote_pipeline_kick(s, p->ep);
     }
 }
 
 static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
-    tcp_usb_header_t hdr = { 0 };
-    tcp_usb_request_header pkt = { 0 };
     USBTCPInflightPacket inflightPacket = { 0 };
-    g_autofree void *buffer = NULL;
+    USBTCPInflightPacket *pkt;
     bool locked = bql_locked();
 
     if (s->closed) {
@@ -583,35 +1047,28 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
         return;
     }
 
-    hdr.type = TCP_USB_REQUEST;
-    pkt.addr = s->addr;
-    pkt.pid = p->pid;
-    pkt.ep = p->ep->nr;
-    pkt.stream = p->stream;
-    pkt.id = p->id;
-    pkt.short_not_ok = p->short_not_ok;
-    pkt.int_req = p->int_req;
-    pkt.length = p->iov.size - p->actual_length;
-
-    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx len 0x%x\n", __func__, pkt.pid,
-            pkt.ep, pkt.id, pkt.length);
+    if (usb_tcp_remote_is_pipelined(s, p)) {
+        uint32_t *inflight = usb_tcp_remote_pipeline_inflight(s, p);
 
-    if (p->pid != USB_TOKEN_IN && pkt.length) {
-        buffer = g_malloc0(pkt.length);
-        usb_packet_copy(p, buffer, pkt.length);
-        p->actual_length -= pkt.length;
-        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0 && buffer) {
-            struct usb_control_packet *setup =
-                (struct usb_control_packet *)buffer;
-#ifdef DEBUG_DEV_TCP_REMOTE
-            qemu_hexdump(stderr, __func__, buffer, pkt.length);
-#endif
+        /*
+         * Don't wait for the host, the response is matched by id in the
+         * read thread and completes the packet from there.
+         */
+        p->ep->pipeline = true;
+        p->status = USB_RET_ASYNC;
+        if (*inflight >= s->pipeline_depth) {
+            USBTCPPendingPacket *pend = g_new0(USBTCPPendingPacket, 1);
 
-            if (setup->bmRequestType == 0 &&
-                setup->bRequest == USB_REQ_SET_ADDRESS) {
-                s->addr = setup->wValue;
-            }
+            pend->p = p;
+            QTAILQ_INSERT_TAIL(&s->pending_queue, pend, queue);
+            return;
+        }
+        (*inflight)++;
+        if (!usb_tcp_remote_pipeline_send(s, p)) {
+            (*inflight)--;
+            p->status = USB_RET_STALL;
         }
+        return;
     }
 
     inflightPacket.p = p;
@@ -620,29 +1077,17 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
-        QTAILQ_INSERT_TAIL(&s->queue, &inflightPacket, queue);
+        usb_tcp_remote_inflight_insert(s, &inflightPacket);
     }
     /* Retire the writes so that the read thread can find it */
     smp_wmb();
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex)
     {
-        if (usb_tcp_remote_write(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+        if (!usb_tcp_remote_send_request(s, p, 0)) {
             p->status = USB_RET_STALL;
             goto out;
         }
-
-        if (usb_tcp_remote_write(s, &pkt, sizeof(pkt)) < sizeof(pkt)) {
-            p->status = USB_RET_STALL;
-            goto out;
-        }
-
-        if (buffer) {
-            if (usb_tcp_remote_write(s, buffer, pkt.length) < pkt.length) {
-                p->status = USB_RET_STALL;
-                goto out;
-            }
-        }
     }
 
     if (locked) {
@@ -665,11 +1110,19 @@ out:
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
     {
-        QTAILQ_REMOVE(&s->queue, &inflightPacket, queue);
+        usb_tcp_remote_inflight_remove(s, &inflightPacket);
+        if (p->status == USB_RET_ASYNC) {
+            /* The final response completes it from the read thread. */
+            pkt = usb_tcp_remote_inflight_alloc(s);
+            pkt->p = p;
+            pkt->async = true;
+            usb_tcp_remote_inflight_insert(s, pkt);
+        }
     }
 }
 
 static Property usb_tcp_remote_properties[] = {
+    DEFINE_PROP_UINT32("pipeline-depth", USBTCPRemoteState, pipeline_depth, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -12,7 +12,12 @@ typedef struct USBTCPInflightPacket {
     USBPacket *p;
     uint64_t handled;
     QTAILQ_ENTRY(USBTCPInflightPacket) queue;
+    /* Key in "inflight", the next record with the same id. */
+    uint64_t id;
+    struct USBTCPInflightPacket *next;
     uint8_t addr;
+    /* Completed by the read thread, the record comes from "pool". */
+    bool async;
 } USBTCPInflightPacket;
 
 typedef struct USBTCPCompletedPacket {
@@ -21,6 +26,11 @@ typedef struct USBTCPCompletedPacket {
     uint8_t addr;
 } USBTCPCompletedPacket;
 
+typedef struct USBTCPPendingPacket {
+    USBPacket *p;
+    QTAILQ_ENTRY(USBTCPPendingPacket) queue;
+} USBTCPPendingPacket;
+
 
 typedef struct USBTCPRemoteState {
     USBDevice parent_obj;
@@ -33,6 +43,10 @@ typedef struct USBTCPRemoteState {
 
     QemuMutex queue_mutex;
     QTAILQ_HEAD(, USBTCPInflightPacket) queue;
+    /* Packet id to the chain of records in "queue" with that id. */
+    GHashTable *inflight;
+    /* Free records for async packets, linked through "next". */
+    USBTCPInflightPacket *pool;
 
     QemuMutex completed_queue_mutex;
     QemuCond completed_queue_cond;
@@ -42,8 +56,16 @@ typedef struct USBTCPRemoteState {
     QEMUBH *cleanup_bh;
     Error *migration_blocker;
 
+    /* Requests per data endpoint allowed on the wire at once. */
+    uint32_t pipeline_depth;
+    uint32_t pipeline_inflight[2][USB_MAX_ENDPOINTS + 1];
+    QTAILQ_HEAD(, USBTCPPendingPacket) pending_queue;
+
     int socket;
     int fd;
+    /* Agreed on with the host at connect, see TCP_USB_HELLO. */
+    uint8_t proto_version;
+    uint8_t proto_features;
     uint8_t addr;
     bool closed;
     bool stopped;
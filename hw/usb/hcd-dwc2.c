@@ -42,6 +42,7 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/units.h"
+#include "sysemu/runstate.h"
 #include "trace.h"
 
 // #define SOC_DMA_BASE (0x100000000ULL)
@@ -204,39 +205,57 @@ static inline void dwc2_update_ep_irq(DWC2State *s, int ep)
     }
 }
 
-/* set a timer for EOF */
-static void dwc2_eof_timer(DWC2State *s)
+static bool dwc2_bus_running(DWC2State *s)
 {
-    timer_mod(s->eof_timer, s->sof_time + s->usb_frame_time);
+    return s->hprt0 & HPRT0_CONNSTS;
 }
 
-/* Set a timer for EOF and generate SOF event */
-static void dwc2_sof(DWC2State *s)
+/*
+ * Frames are counted lazily from virtual time: bring sof_time and the
+ * frame number up to the frame containing now.
+ */
+static void dwc2_update_frame(DWC2State *s)
 {
-    s->sof_time += s->usb_frame_time;
-    trace_usb_dwc2_sof(s->sof_time);
-    dwc2_eof_timer(s);
-    dwc2_raise_global_irq(s, GINTSTS_SOF);
+    int64_t now, frames;
+
+    if (!dwc2_bus_running(s)) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (now < s->sof_time + s->usb_frame_time) {
+        return;
+    }
+
+    frames = (now - s->sof_time) / s->usb_frame_time;
+    s->sof_time += frames * s->usb_frame_time;
+    s->frame_number = (s->frame_number + frames) & 0xffff;
+    s->hfnum = s->frame_number & HFNUM_MAX_FRNUM;
+}
+
+/*
+ * Only SOF interrupts need a timer per frame; periodic transfers are
+ * retried by frame_timer. Keep the EOF timer armed only while the guest
+ * is listening for SOF.
+ */
+static void dwc2_update_eof_timer(DWC2State *s)
+{
+    if (dwc2_bus_running(s) && (s->gintmsk & GINTSTS_SOF)) {
+        timer_mod(s->eof_timer, s->sof_time + s->usb_frame_time);
+    } else {
+        timer_del(s->eof_timer);
+    }
 }
 
 /* Do frame processing on frame boundary */
 static void dwc2_frame_boundary(void *opaque)
 {
     DWC2State *s = opaque;
-    int64_t now;
-    uint16_t frcnt;
-
-    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-
-    /* Frame boundary, so do EOF stuff here */
-
-    /* Increment frame number */
-    frcnt = (uint16_t)((now - s->sof_time) / s->fi);
-    s->frame_number = (s->frame_number + frcnt) & 0xffff;
-    s->hfnum = s->frame_number & HFNUM_MAX_FRNUM;
 
-    /* Do SOF stuff here */
-    dwc2_sof(s);
+    dwc2_update_frame(s);
+    trace_usb_dwc2_sof(s->sof_time);
+    dwc2_raise_global_irq(s, GINTSTS_SOF);
+    dwc2_update_eof_timer(s);
 }
 
 /* Start sending SOF tokens on the USB bus */
@@ -244,13 +263,14 @@ static void dwc2_bus_start(DWC2State *s)
 {
     trace_usb_dwc2_bus_start();
     s->sof_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    dwc2_eof_timer(s);
+    dwc2_update_eof_timer(s);
 }
 
 /* Stop sending SOF tokens on the USB bus */
 static void dwc2_bus_stop(DWC2State *s)
 {
     trace_usb_dwc2_bus_stop();
+    dwc2_update_frame(s);
     timer_del(s->eof_timer);
 }
 
@@ -606,6 +626,7 @@ static uint32_t dwc2_get_frame_remaining(DWC2State *s)
     uint32_t fr = 0;
     int64_t tks;
 
+    dwc2_update_frame(s);
     tks = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->sof_time;
     if (tks < 0) {
         tks = 0;
@@ -858,6 +879,10 @@ static void dwc2_glbreg_write(void *ptr, hwaddr addr, int index, uint64_t val,
     trace_usb_dwc2_glbreg_write(addr, glbregnm[index], orig, old, val);
     *mmio = val;
 
+    if (addr == GINTMSK && ((old ^ val) & GINTSTS_SOF)) {
+        dwc2_update_frame(s);
+        dwc2_update_eof_timer(s);
+    }
     if (iflg) {
         dwc2_update_irq(s);
     }
@@ -959,8 +984,9 @@ static uint64_t dwc2_hreg0_read(void *ptr, hwaddr addr, int index,
 
     switch (addr) {
     case HFNUM:
-        val = (dwc2_get_frame_remaining(s) << HFNUM_FRREM_SHIFT) |
-              (s->hfnum << HFNUM_FRNUM_SHIFT);
+        /* Updates hfnum as well, so it must come first. */
+        val = dwc2_get_frame_remaining(s) << HFNUM_FRREM_SHIFT;
+        val |= s->hfnum << HFNUM_FRNUM_SHIFT;
         break;
     default:
         break;
@@ -1193,6 +1219,58 @@ static void dwc2_update_out_ep(DWC2State *s, int ep)
     qemu_bh_schedule(s->device_async_bh);
 }
 
+/*
+ * Move the data for `p` straight between its iovec and the guest buffers in
+ * `sgl`, mapping each segment instead of staging the transfer in a bounce
+ * buffer. Returns the number of bytes moved.
+ */
+static dma_addr_t dwc2_device_sg_copy(DWC2State *s, USBPacket *p,
+                                      QEMUSGList *sgl)
+{
+    DMADirection dir = p->pid == USB_TOKEN_IN ? DMA_DIRECTION_TO_DEVICE :
+                                                DMA_DIRECTION_FROM_DEVICE;
+    dma_addr_t done = 0;
+
+    for (int i = 0; i < sgl->nsg; i++) {
+        dma_addr_t base = sgl->sg[i].base;
+        dma_addr_t len = sgl->sg[i].len;
+
+        while (len) {
+            dma_addr_t xlen = len;
+            void *mem = dma_memory_map(&s->dma_as, base, &xlen, dir,
+                                       MEMTXATTRS_UNSPECIFIED);
+
+            if (mem == NULL) {
+                /* Not RAM, or the bounce buffer is taken; go through it. */
+                g_autofree void *buffer = g_malloc0(len);
+                MemTxResult res;
+
+                xlen = len;
+                if (dir == DMA_DIRECTION_TO_DEVICE) {
+                    res = dma_memory_read(&s->dma_as, base, buffer, xlen,
+                                          MEMTXATTRS_UNSPECIFIED);
+                    usb_packet_copy(p, buffer, xlen);
+                } else {
+                    usb_packet_copy(p, buffer, xlen);
+                    res = dma_memory_write(&s->dma_as, base, buffer, xlen,
+                                           MEMTXATTRS_UNSPECIFIED);
+                }
+                if (res != MEMTX_OK) {
+                    return done;
+                }
+            } else {
+                usb_packet_copy(p, mem, xlen);
+                dma_memory_unmap(&s->dma_as, mem, xlen, dir, xlen);
+            }
+            base += xlen;
+            len -= xlen;
+            done += xlen;
+        }
+    }
+
+    return done;
+}
+
 static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
 {
     int ep = p->ep->nr;
@@ -1213,7 +1291,6 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
         }
         if (s->diepctl(ep) & DXEPCTL_EPENA) {
             int sz, amtDone, pktcnt, txfz, mps, fifo;
-            g_autofree void *buffer = NULL;
             // IN transfer
             fifo = DXEPCTL_TXFNUM_GET(s->diepctl(ep));
             if (ep == 0) {
@@ -1244,7 +1321,6 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
 
             if (s->dcfg & DCFG_DESCDMA_EN) {
                 struct dwc2_dma_desc desc;
-                dma_addr_t residual;
                 QEMUSGList sglist;
                 bool ioc = false;
                 qemu_sglist_init(&sglist, DEVICE(s), MAX_DMA_DESC_NUM_GENERIC,
@@ -1284,14 +1360,7 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
                 qemu_log_mask(LOG_UNIMP, "%s: starting IN transfer on EP %d (%zu/%d)...\n",
                                 __func__, ep, sglist.size, pktsize);
 #endif
-                buffer = g_malloc0(sglist.size);
-                dma_buf_write(buffer, sglist.size, &residual, &sglist,
-                              MEMTXATTRS_UNSPECIFIED);
-                amtDone = sglist.size - residual;
-                usb_packet_copy(p, buffer, amtDone);
-#if 0
-                qemu_hexdump(stderr, __func__, buffer, sglist.size);
-#endif
+                amtDone = dwc2_device_sg_copy(s, p, &sglist);
                 s->diepctl(ep) &= ~DXEPCTL_EPENA;
                 s->diepint(ep) |= DXEPINT_XFERCOMPL;
                 qemu_sglist_destroy(&sglist);
@@ -1462,11 +1531,16 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
                 qemu_log_mask(LOG_UNIMP, "%s: starting OUT transfer on EP %d (%zu/%d)...\n",
                                 __func__, ep, sglist.size, pktsize);
 #endif
-                buffer = g_malloc0(sglist.size);
-                usb_packet_copy(p, buffer, sglist.size);
-                dma_buf_read(buffer, sglist.size, &residual, &sglist,
-                             MEMTXATTRS_UNSPECIFIED);
-                amtDone = sglist.size - residual;
+                if (p->pid == USB_TOKEN_SETUP) {
+                    /* Keep a copy to decode the request below. */
+                    buffer = g_malloc0(sglist.size);
+                    usb_packet_copy(p, buffer, sglist.size);
+                    dma_buf_read(buffer, sglist.size, &residual, &sglist,
+                                 MEMTXATTRS_UNSPECIFIED);
+                    amtDone = sglist.size - residual;
+                } else {
+                    amtDone = dwc2_device_sg_copy(s, p, &sglist);
+                }
 #if 0
                 qemu_hexdump(stderr, __func__, buffer, sglist.size);
 #endif
@@ -2261,6 +2335,34 @@ static void dwc2_reset_exit(Object *obj)
     USB_DEVICE(s->device)->addr = 0;
 }
 
+/*
+ * In device mode the link to the remote host is not part of the stream:
+ * the gadget comes back off the bus, so plug it in again, which has the
+ * remote re-enumerate it. Wait for the VM to run so the TCP host does not
+ * connect for a destination that never starts.
+ */
+static void dwc2_vm_state_change(void *opaque, bool running, RunState state)
+{
+    DWC2State *s = opaque;
+
+    if (running && s->device_attach_pending) {
+        s->device_attach_pending = false;
+        if (!USB_DEVICE(s->device)->attached) {
+            usb_device_attach(USB_DEVICE(s->device), NULL);
+        }
+    }
+}
+
+static int dwc2_post_load(void *opaque, int version_id)
+{
+    DWC2State *s = opaque;
+
+    s->device_attach_pending = !s->uport.dev &&
+                               DEVICE(s->device)->realized &&
+                               !(s->dctl & DCTL_SFTDISCON);
+    return 0;
+}
+
 static void dwc2_realize(DeviceState *dev, Error **errp)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
@@ -2298,6 +2400,8 @@ static void dwc2_realize(DeviceState *dev, Error **errp)
 
     s->device = DWC2_USB_DEVICE(qdev_new(TYPE_DWC2_USB_DEVICE));
     s->device->dwc2 = s;
+
+    s->vmse = qemu_add_vm_change_state_handler(dwc2_vm_state_change, s);
 }
 
 static void dwc2_init(Object *obj)
@@ -2406,6 +2510,7 @@ const VMStateDescription vmstate_dwc2_state = {
     .name = "dwc2",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = dwc2_post_load,
     .fields =
         (VMStateField[]){
             VMSTATE_UINT32_ARRAY(glbreg, DWC2State,
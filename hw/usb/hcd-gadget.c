@@ -0,0 +1,287 @@
+#include "qemu/osdep.h"
+#include "hw/usb.h"
+#include "hw/usb/hcd-gadget.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+
+// #define DEBUG_HCD_GADGET
+
+#ifdef DEBUG_HCD_GADGET
+#define DPRINTF(fmt, ...)                                   \
+    do {                                                    \
+        fprintf(stderr, "hcd-gadget: " fmt, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do {                  \
+    } while (0)
+#endif
+
+#define USB_GADGET_HOST_ADDR (1)
+
+void usb_gadget_host_wake(Coroutine **co)
+{
+    Coroutine *c = *co;
+
+    if (c != NULL) {
+        *co = NULL;
+        aio_co_schedule(qemu_get_aio_context(), c);
+    }
+}
+
+int coroutine_fn usb_gadget_host_xfer(USBGadgetHost *h, uint32_t gen,
+                                      USBGadgetXfer *x, int pid, uint8_t ep,
+                                      void *buf, size_t len)
+{
+    for (;;) {
+        if (gen != h->generation) {
+            return -ENODEV;
+        }
+
+        usb_packet_setup(&x->p, pid, usb_ep_get(h->dev, pid, ep), 0,
+                         h->next_id++, false, false);
+        if (len != 0) {
+            usb_packet_addbuf(&x->p, buf, len);
+        }
+        usb_handle_packet(h->dev, &x->p);
+
+        if (x->p.status == USB_RET_NAK) {
+            qemu_co_sleep_ns(QEMU_CLOCK_VIRTUAL, USB_GADGET_HOST_NAK_RETRY_NS);
+            continue;
+        }
+
+        if (x->p.status == USB_RET_ASYNC) {
+            x->co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            if (gen != h->generation) {
+                return -ENODEV;
+            }
+        }
+        break;
+    }
+
+    if (x->p.status != USB_RET_SUCCESS) {
+        DPRINTF("%s: pid 0x%x ep %d failed: %d\n", __func__, pid, ep,
+                x->p.status);
+        return -EIO;
+    }
+    return x->p.actual_length;
+}
+
+int coroutine_fn usb_gadget_host_control(USBGadgetHost *h, uint32_t gen,
+                                         uint8_t type, uint8_t request,
+                                         uint16_t value, uint16_t index,
+                                         void *data, uint16_t length)
+{
+    uint8_t setup[8];
+    bool in = type & USB_DIR_IN;
+    int ret = 0;
+    int status;
+
+    setup[0] = type;
+    setup[1] = request;
+    stw_le_p(setup + 2, value);
+    stw_le_p(setup + 4, index);
+    stw_le_p(setup + 6, length);
+
+    status = usb_gadget_host_xfer(h, gen, &h->ctrl, USB_TOKEN_SETUP, 0, setup,
+                                  sizeof(setup));
+    if (status < 0) {
+        return status;
+    }
+
+    if (length != 0) {
+        ret = usb_gadget_host_xfer(h, gen, &h->ctrl,
+                                   in ? USB_TOKEN_IN : USB_TOKEN_OUT, 0, data,
+                                   length);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    status = usb_gadget_host_xfer(
+        h, gen, &h->ctrl, in && length != 0 ? USB_TOKEN_OUT : USB_TOKEN_IN, 0,
+        NULL, 0);
+    return status < 0 ? status : ret;
+}
+
+/* Enumerates the gadget, picks the configuration with the function in it. */
+static void coroutine_fn usb_gadget_host_run_co(void *opaque)
+{
+    USBGadgetHost *h = opaque;
+    uint32_t gen = h->generation;
+    uint8_t dev_desc[18];
+    g_autofree uint8_t *desc = NULL;
+    uint8_t config = 0;
+    uint8_t num_configs;
+    int ret;
+
+    ret = usb_gadget_host_control(h, gen, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+                                  USB_DT_DEVICE << 8, 0, dev_desc,
+                                  sizeof(dev_desc));
+    if (ret < (int)sizeof(dev_desc)) {
+        goto fail;
+    }
+    num_configs = dev_desc[17];
+
+    ret = usb_gadget_host_control(h, gen, USB_DIR_OUT, USB_REQ_SET_ADDRESS,
+                                  USB_GADGET_HOST_ADDR, 0, NULL, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (uint8_t i = 0; i < num_configs && config == 0; i++) {
+        uint8_t hdr[9];
+        uint16_t total;
+
+        ret = usb_gadget_host_control(h, gen, USB_DIR_IN,
+                                      USB_REQ_GET_DESCRIPTOR,
+                                      (USB_DT_CONFIG << 8) | i, 0, hdr,
+                                      sizeof(hdr));
+        if (ret < (int)sizeof(hdr)) {
+            goto fail;
+        }
+        total = lduw_le_p(hdr + 2);
+        desc = g_realloc(desc, total);
+        ret = usb_gadget_host_control(h, gen, USB_DIR_IN,
+                                      USB_REQ_GET_DESCRIPTOR,
+                                      (USB_DT_CONFIG << 8) | i, 0, desc,
+                                      total);
+        if (ret < (int)sizeof(hdr)) {
+            goto fail;
+        }
+        if (h->ops->parse_config(h, desc, ret)) {
+            config = desc[5];
+        }
+    }
+
+    if (config == 0) {
+        warn_report("%s: the gadget has no %s function", __func__,
+                    h->ops->function);
+        return;
+    }
+
+    ret = usb_gadget_host_control(h, gen, USB_DIR_OUT,
+                                  USB_REQ_SET_CONFIGURATION, config, 0, NULL,
+                                  0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    DPRINTF("%s: %s in config %d, IN %d, OUT %d\n", __func__,
+            h->ops->function, config, h->ep_in, h->ep_out);
+
+    h->ops->run(h, gen, dev_desc);
+    return;
+
+fail:
+    if (gen == h->generation) {
+        warn_report("%s: enumerating the gadget failed", __func__);
+    }
+}
+
+void usb_gadget_host_stop(USBGadgetHost *h)
+{
+    USBGadgetXfer *xfers[] = { &h->ctrl, &h->bulk_in, &h->bulk_out };
+    bool was_running = h->running;
+
+    h->generation++;
+    h->running = false;
+
+    for (int i = 0; i < ARRAY_SIZE(xfers); i++) {
+        if (usb_packet_is_inflight(&xfers[i]->p)) {
+            usb_cancel_packet(&xfers[i]->p);
+            xfers[i]->p.status = USB_RET_NODEV;
+        }
+        usb_gadget_host_wake(&xfers[i]->co);
+    }
+
+    h->ops->stop(h, was_running);
+}
+
+static void usb_gadget_host_start(USBGadgetHost *h)
+{
+    usb_gadget_host_stop(h);
+    usb_device_reset(h->dev);
+    aio_co_schedule(qemu_get_aio_context(),
+                    qemu_coroutine_create(usb_gadget_host_run_co, h));
+}
+
+static void usb_gadget_host_attach(USBPort *uport)
+{
+    USBGadgetHost *h = uport->opaque;
+
+    if (!uport->dev || !uport->dev->attached) {
+        return;
+    }
+
+    /* Both controllers share the bus, keep whichever has a link up. */
+    if (h->dev != NULL && h->dev != uport->dev && h->running) {
+        warn_report("%s: only one gadget link is driven at a time", __func__);
+        return;
+    }
+
+    h->dev = uport->dev;
+    usb_gadget_host_start(h);
+}
+
+static void usb_gadget_host_detach(USBPort *uport)
+{
+    USBGadgetHost *h = uport->opaque;
+
+    if (uport->dev == h->dev) {
+        usb_gadget_host_stop(h);
+        h->dev = NULL;
+    }
+}
+
+static void usb_gadget_host_async_packet_complete(USBPort *port, USBPacket *p)
+{
+    usb_gadget_host_wake(&container_of(p, USBGadgetXfer, p)->co);
+}
+
+static USBBusOps usb_gadget_bus_ops = {};
+
+static USBPortOps usb_gadget_host_port_ops = {
+    .attach = usb_gadget_host_attach,
+    .detach = usb_gadget_host_detach,
+    .child_detach = NULL,
+    .wakeup = NULL,
+    .complete = usb_gadget_host_async_packet_complete,
+};
+
+void usb_gadget_host_init(USBGadgetHost *h, DeviceState *dev,
+                          const USBGadgetHostOps *ops)
+{
+    h->ops = ops;
+
+    usb_bus_new(&h->bus, sizeof(h->bus), &usb_gadget_bus_ops, dev);
+    for (int i = 0; i < G_N_ELEMENTS(h->uports); i++) {
+        usb_register_port(&h->bus, &h->uports[i], h, i,
+                          &usb_gadget_host_port_ops,
+                          USB_SPEED_MASK_LOW | USB_SPEED_MASK_FULL |
+                              USB_SPEED_MASK_HIGH);
+    }
+
+    usb_packet_init(&h->ctrl.p);
+    usb_packet_init(&h->bulk_in.p);
+    usb_packet_init(&h->bulk_out.p);
+}
+
+void usb_gadget_host_cleanup(USBGadgetHost *h)
+{
+    usb_gadget_host_stop(h);
+    usb_packet_cleanup(&h->ctrl.p);
+    usb_packet_cleanup(&h->bulk_in.p);
+    usb_packet_cleanup(&h->bulk_out.p);
+}
+
+void usb_gadget_host_reset(USBGadgetHost *h)
+{
+    if (h->dev != NULL && h->dev->attached) {
+        usb_gadget_host_start(h);
+    } else {
+        usb_gadget_host_stop(h);
+    }
+}
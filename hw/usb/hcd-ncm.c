@@ -0,0 +1,439 @@
+#include "qemu/osdep.h"
+#include "hw/qdev-properties-system.h"
+#include "hw/qdev-properties.h"
+#include "hw/usb.h"
+#include "hw/usb/hcd-ncm.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qom/object.h"
+
+#define USB_CDC_SUBCLASS_NCM (0x0D)
+#define USB_CDC_UNION_TYPE (0x06)
+
+#define USB_NCM_GET_NTB_PARAMETERS (0x80)
+#define USB_NCM_SET_NTB_INPUT_SIZE (0x86)
+#define USB_NCM_NTB_PARAMETERS_SIZE (28)
+
+#define USB_NCM_NTH16_SIGN (0x484D434E) /* "NCMH" */
+#define USB_NCM_NTH16_SIZE (12)
+#define USB_NCM_NDP16_NOCRC_SIGN (0x304D434E) /* "NCM0" */
+#define USB_NCM_NDP16_CRC_SIGN (0x314D434E) /* "NCM1" */
+#define USB_NCM_NDP16_SIZE (8)
+#define USB_NCM_NDP16_ALIGN (4)
+
+/*
+ * Look for a CDC-NCM communication interface in the configuration, and the
+ * alternate setting of its data interface that has the bulk endpoints.
+ */
+static bool usb_ncm_host_parse_config(USBGadgetHost *h, const uint8_t *desc,
+                                      size_t len)
+{
+    USBNCMHostState *s = container_of(h, USBNCMHostState, host);
+    int comm_iface = -1;
+    int data_iface = -1;
+    int iface = -1;
+    int alt = 0;
+    uint8_t ep_in = 0;
+    uint8_t ep_out = 0;
+    uint16_t ep_out_mps = 0;
+
+    for (size_t off = 0; off + 2 <= len && desc[off] >= 2;
+         off += desc[off]) {
+        const uint8_t *d = desc + off;
+
+        if (off + d[0] > len) {
+            break;
+        }
+
+        switch (d[1]) {
+        case USB_DT_INTERFACE:
+            if (d[0] < 9) {
+                return false;
+            }
+            if (ep_in != 0 && ep_out != 0) {
+                break;
+            }
+            iface = d[2];
+            alt = d[3];
+            ep_in = ep_out = 0;
+            if (d[5] == USB_CLASS_COMM && d[6] == USB_CDC_SUBCLASS_NCM) {
+                comm_iface = iface;
+            }
+            break;
+        case USB_DT_CS_INTERFACE:
+            if (d[0] >= 5 && d[2] == USB_CDC_UNION_TYPE && iface == comm_iface &&
+                comm_iface >= 0) {
+                data_iface = d[4];
+            }
+            break;
+        case USB_DT_ENDPOINT:
+            if (d[0] < 7 || iface != data_iface || data_iface < 0 ||
+                (d[3] & 3) != USB_ENDPOINT_XFER_BULK) {
+                break;
+            }
+            if (d[2] & USB_DIR_IN) {
+                ep_in = d[2] & 0xF;
+            } else {
+                ep_out = d[2] & 0xF;
+                ep_out_mps = lduw_le_p(d + 4) & 0x7FF;
+            }
+            if (ep_in != 0 && ep_out != 0) {
+                s->comm_iface = comm_iface;
+                s->data_iface = data_iface;
+                s->data_alt = alt;
+                h->ep_in = ep_in;
+                h->ep_out = ep_out;
+                h->ep_out_mps = ep_out_mps ? ep_out_mps : 512;
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return false;
+}
+
+static void usb_ncm_host_parse_ntb_parameters(USBNCMHostState *s,
+                                              const uint8_t *params)
+{
+    uint32_t in_size = ldl_le_p(params + 4);
+    uint32_t out_size = ldl_le_p(params + 16);
+    uint16_t divisor = lduw_le_p(params + 20);
+
+    if (in_size != 0) {
+        s->ntb_in_size = MIN(in_size, USB_NCM_NTB_MAX_SIZE);
+    }
+    if (out_size >= USB_NCM_NTH16_SIZE + USB_NCM_NDP16_SIZE + 8) {
+        s->ntb_out_size = MIN(out_size, USB_NCM_NTB_MAX_SIZE);
+    }
+    if (divisor >= USB_NCM_NDP16_ALIGN && is_power_of_2(divisor) &&
+        divisor <= 512) {
+        s->ntb_out_divisor = divisor;
+    }
+    s->ntb_out_max_datagrams = lduw_le_p(params + 26);
+}
+
+/* Hand every datagram of an NTB16 the gadget sent to the backend. */
+static void usb_ncm_host_rx_ntb(USBNCMHostState *s, const uint8_t *ntb,
+                                uint32_t len)
+{
+    NetClientState *nc = qemu_get_queue(s->nic);
+    uint32_t ndp;
+
+    if (len < USB_NCM_NTH16_SIZE || ldl_le_p(ntb) != USB_NCM_NTH16_SIGN) {
+        return;
+    }
+    len = MIN(len, lduw_le_p(ntb + 8));
+    ndp = lduw_le_p(ntb + 10);
+
+    /* Bounded, a gadget could chain its NDPs into a loop. */
+    for (int n = 0; ndp != 0 && n < USB_NCM_MAX_DATAGRAMS; n++) {
+        uint32_t sign;
+        uint32_t ndp_len;
+        bool crc;
+
+        if (ndp + USB_NCM_NDP16_SIZE > len || (ndp % USB_NCM_NDP16_ALIGN)) {
+            return;
+        }
+        sign = ldl_le_p(ntb + ndp);
+        if (sign != USB_NCM_NDP16_NOCRC_SIGN && sign != USB_NCM_NDP16_CRC_SIGN) {
+            return;
+        }
+        crc = sign == USB_NCM_NDP16_CRC_SIGN;
+        ndp_len = lduw_le_p(ntb + ndp + 4);
+        if (ndp_len < USB_NCM_NDP16_SIZE + 8 || ndp + ndp_len > len) {
+            return;
+        }
+
+        for (uint32_t off = ndp + USB_NCM_NDP16_SIZE; off + 4 <= ndp + ndp_len;
+             off += 4) {
+            uint32_t index = lduw_le_p(ntb + off);
+            uint32_t length = lduw_le_p(ntb + off + 2);
+
+            if (index == 0 || length == 0) {
+                break;
+            }
+            if (crc) {
+                length = length > 4 ? length - 4 : 0;
+            }
+            if (length == 0 || index + length > len) {
+                continue;
+            }
+            qemu_send_packet(nc, ntb + index, length);
+        }
+
+        ndp = lduw_le_p(ntb + ndp + 6);
+    }
+}
+
+static uint32_t usb_ncm_host_tx_max_datagrams(USBNCMHostState *s)
+{
+    if (s->ntb_out_max_datagrams == 0) {
+        return USB_NCM_MAX_DATAGRAMS;
+    }
+    return MIN(s->ntb_out_max_datagrams, USB_NCM_MAX_DATAGRAMS);
+}
+
+/* The NTB size once a datagram of `size` bytes is added, NDP included. */
+static uint32_t usb_ncm_host_tx_size(USBNCMHostState *s, size_t size)
+{
+    uint32_t end = ROUND_UP(s->tx_len, s->ntb_out_divisor) + size;
+
+    /* One more entry, the terminator, and a byte to force a short packet. */
+    return ROUND_UP(end, USB_NCM_NDP16_ALIGN) + USB_NCM_NDP16_SIZE +
+           4 * (s->tx_count + 2) + 1;
+}
+
+/* Close the pending NTB into tx_ntb, and start gathering the next one. */
+static uint32_t usb_ncm_host_tx_finish(USBNCMHostState *s)
+{
+    uint32_t ndp = ROUND_UP(s->tx_len, USB_NCM_NDP16_ALIGN);
+    uint32_t ndp_len = USB_NCM_NDP16_SIZE + 4 * (s->tx_count + 1);
+    uint32_t len = ndp + ndp_len;
+    uint8_t *ntb = s->tx_ntb;
+
+    memcpy(ntb, s->tx_buf, s->tx_len);
+    memset(ntb + s->tx_len, 0, len - s->tx_len);
+
+    stl_le_p(ntb + ndp, USB_NCM_NDP16_NOCRC_SIGN);
+    stw_le_p(ntb + ndp + 4, ndp_len);
+    stw_le_p(ntb + ndp + 6, 0);
+    for (uint32_t i = 0; i < s->tx_count; i++) {
+        stw_le_p(ntb + ndp + USB_NCM_NDP16_SIZE + 4 * i, s->tx_index[i]);
+        stw_le_p(ntb + ndp + USB_NCM_NDP16_SIZE + 4 * i + 2, s->tx_length[i]);
+    }
+
+    /* As cdc_ncm does: a byte of padding ends the transfer on a short one. */
+    if (len % s->host.ep_out_mps == 0 && len < s->ntb_out_size) {
+        ntb[len++] = 0;
+    }
+
+    stl_le_p(ntb, USB_NCM_NTH16_SIGN);
+    stw_le_p(ntb + 4, USB_NCM_NTH16_SIZE);
+    stw_le_p(ntb + 6, s->tx_sequence++);
+    stw_le_p(ntb + 8, len);
+    stw_le_p(ntb + 10, ndp);
+
+    s->tx_len = USB_NCM_NTH16_SIZE;
+    s->tx_count = 0;
+    return len;
+}
+
+/*
+ * Sends NTBs for as long as the gadget is configured. Datagrams that arrive
+ * while one is in flight are gathered into the next, so a busy link sends
+ * many per transfer.
+ */
+static void coroutine_fn usb_ncm_host_tx_co(void *opaque)
+{
+    USBNCMHostState *s = opaque;
+    uint32_t gen = s->host.generation;
+    uint32_t len;
+
+    while (gen == s->host.generation) {
+        if (s->tx_count == 0) {
+            s->tx_co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            continue;
+        }
+
+        len = usb_ncm_host_tx_finish(s);
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+        usb_gadget_host_xfer(&s->host, gen, &s->host.bulk_out, USB_TOKEN_OUT,
+                             s->host.ep_out, s->tx_ntb, len);
+    }
+}
+
+/* Sets the function up once the gadget is configured, then moves NTBs. */
+static void coroutine_fn usb_ncm_host_run(USBGadgetHost *h, uint32_t gen,
+                                          const uint8_t *dev_desc)
+{
+    USBNCMHostState *s = container_of(h, USBNCMHostState, host);
+    uint8_t params[USB_NCM_NTB_PARAMETERS_SIZE];
+    uint8_t size[4];
+    int ret;
+
+    s->ntb_in_size = USB_NCM_NTB_MAX_SIZE;
+    s->ntb_out_size = 2 * KiB;
+    s->ntb_out_divisor = USB_NCM_NDP16_ALIGN;
+    s->ntb_out_max_datagrams = 0;
+    ret = usb_gadget_host_control(
+        h, gen, USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+        USB_NCM_GET_NTB_PARAMETERS, 0, s->comm_iface, params, sizeof(params));
+    if (ret == -ENODEV) {
+        return;
+    }
+    if (ret >= (int)sizeof(params)) {
+        usb_ncm_host_parse_ntb_parameters(s, params);
+        if (ldl_le_p(params + 4) > s->ntb_in_size) {
+            stl_le_p(size, s->ntb_in_size);
+            usb_gadget_host_control(h, gen,
+                                    USB_DIR_OUT | USB_TYPE_CLASS |
+                                        USB_RECIP_INTERFACE,
+                                    USB_NCM_SET_NTB_INPUT_SIZE, 0,
+                                    s->comm_iface, size, sizeof(size));
+        }
+    }
+
+    ret = usb_gadget_host_control(h, gen, USB_DIR_OUT | USB_RECIP_INTERFACE,
+                                  USB_REQ_SET_INTERFACE, s->data_alt,
+                                  s->data_iface, NULL, 0);
+    if (ret < 0) {
+        if (gen == h->generation) {
+            warn_report("%s: selecting the data interface failed", __func__);
+        }
+        return;
+    }
+
+    s->tx_len = USB_NCM_NTH16_SIZE;
+    s->tx_count = 0;
+    h->running = true;
+    qemu_coroutine_enter(qemu_coroutine_create(usb_ncm_host_tx_co, s));
+    qemu_flush_queued_packets(qemu_get_queue(s->nic));
+
+    for (;;) {
+        ret = usb_gadget_host_xfer(h, gen, &h->bulk_in, USB_TOKEN_IN, h->ep_in,
+                                   s->rx_ntb, s->ntb_in_size);
+        if (gen != h->generation) {
+            return;
+        }
+        if (ret < 0) {
+            qemu_co_sleep_ns(QEMU_CLOCK_VIRTUAL, USB_GADGET_HOST_NAK_RETRY_NS);
+            continue;
+        }
+        usb_ncm_host_rx_ntb(s, s->rx_ntb, ret);
+    }
+}
+
+static void usb_ncm_host_stop(USBGadgetHost *h, bool was_running)
+{
+    USBNCMHostState *s = container_of(h, USBNCMHostState, host);
+
+    s->tx_len = USB_NCM_NTH16_SIZE;
+    s->tx_count = 0;
+    usb_gadget_host_wake(&s->tx_co);
+}
+
+static const USBGadgetHostOps usb_ncm_host_ops = {
+    .function = "CDC-NCM",
+    .parse_config = usb_ncm_host_parse_config,
+    .run = usb_ncm_host_run,
+    .stop = usb_ncm_host_stop,
+};
+
+static ssize_t usb_ncm_host_receive(NetClientState *nc, const uint8_t *buf,
+                                    size_t size)
+{
+    USBNCMHostState *s = qemu_get_nic_opaque(nc);
+    uint32_t off;
+
+    if (!s->host.running) {
+        return -1;
+    }
+
+    if (s->tx_count >= usb_ncm_host_tx_max_datagrams(s) ||
+        usb_ncm_host_tx_size(s, size) > s->ntb_out_size) {
+        /* Never fits, even in an NTB of its own. */
+        if (s->tx_count == 0) {
+            return size;
+        }
+        /* Held by the net layer until the pending NTB has been sent. */
+        return 0;
+    }
+
+    off = ROUND_UP(s->tx_len, s->ntb_out_divisor);
+    memset(s->tx_buf + s->tx_len, 0, off - s->tx_len);
+    memcpy(s->tx_buf + off, buf, size);
+    s->tx_index[s->tx_count] = off;
+    s->tx_length[s->tx_count] = size;
+    s->tx_count++;
+    s->tx_len = off + size;
+
+    usb_gadget_host_wake(&s->tx_co);
+    return size;
+}
+
+static void usb_ncm_host_cleanup(NetClientState *nc)
+{
+    USBNCMHostState *s = qemu_get_nic_opaque(nc);
+
+    s->nic = NULL;
+}
+
+static NetClientInfo net_usb_ncm_host_info = {
+    .type = NET_CLIENT_DRIVER_NIC,
+    .size = sizeof(NICState),
+    .receive = usb_ncm_host_receive,
+    .cleanup = usb_ncm_host_cleanup,
+};
+
+static void usb_ncm_host_realize(DeviceState *dev, Error **errp)
+{
+    USBNCMHostState *s = USB_NCM_HOST(dev);
+
+    usb_gadget_host_init(&s->host, dev, &usb_ncm_host_ops);
+
+    qemu_macaddr_default_if_unset(&s->conf.macaddr);
+    s->nic = qemu_new_nic(&net_usb_ncm_host_info, &s->conf,
+                          object_get_typename(OBJECT(dev)), dev->id,
+                          &dev->mem_reentrancy_guard, s);
+    qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
+}
+
+static void usb_ncm_host_unrealize(DeviceState *dev)
+{
+    USBNCMHostState *s = USB_NCM_HOST(dev);
+
+    usb_gadget_host_cleanup(&s->host);
+    qemu_del_nic(s->nic);
+}
+
+static void usb_ncm_host_reset(DeviceState *dev)
+{
+    USBNCMHostState *s = USB_NCM_HOST(dev);
+
+    usb_gadget_host_reset(&s->host);
+}
+
+static const VMStateDescription vmstate_usb_ncm_host = {
+    .name = "usb-ncm-host",
+    .unmigratable = 1,
+};
+
+static Property usb_ncm_host_properties[] = {
+    DEFINE_NIC_PROPERTIES(USBNCMHostState, conf),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void usb_ncm_host_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = usb_ncm_host_realize;
+    dc->unrealize = usb_ncm_host_unrealize;
+    dc->reset = usb_ncm_host_reset;
+    dc->desc = "USB CDC-NCM host for a guest gadget";
+    dc->vmsd = &vmstate_usb_ncm_host;
+    device_class_set_props(dc, usb_ncm_host_properties);
+    set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
+}
+
+static const TypeInfo usb_ncm_host_info = {
+    .name = TYPE_USB_NCM_HOST,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(USBNCMHostState),
+    .class_init = usb_ncm_host_class_init,
+};
+
+static void usb_ncm_host_register_types(void)
+{
+    type_register_static(&usb_ncm_host_info);
+}
+
+type_init(usb_ncm_host_register_types)
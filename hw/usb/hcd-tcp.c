@@ -4,15 +4,19 @@
 #include "hw/usb/hcd-tcp.h"
 #include "io/channel-util.h"
 #include "io/channel.h"
-#include "migration/blocker.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qom/object.h"
 #include "sysemu/iothread.h"
+#include "sysemu/runstate.h"
 #include "tcp-usb.h"
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
 // #define DEBUG_HCD_TCP
 
 #ifdef DEBUG_HCD_TCP
@@ -26,17 +30,55 @@
     } while (0)
 #endif
 
+/* About a USB frame, the interval a real HC would retry a NAK at. */
+#define TCP_USB_NAK_RETRY_NS (1 * SCALE_MS)
+
+static void usb_tcp_host_retry_flush(USBTCPHostState *s)
+{
+    USBTCPPacket *pkt;
+
+    timer_del(s->retry_timer);
+    while (!QTAILQ_EMPTY(&s->retry_queue)) {
+        pkt = QTAILQ_FIRST(&s->retry_queue);
+        QTAILQ_REMOVE(&s->retry_queue, pkt, retry);
+        g_free(pkt->buffer);
+        usb_packet_cleanup(&pkt->p);
+        g_free(pkt);
+    }
+}
+
+/*
+ * With an IOThread, the message loop and the writes to the channel run
+ * there, and take the BQL only to hand packets to and from the device.
+ */
+static void usb_tcp_host_lock(USBTCPHostState *s)
+{
+    if (s->iothread) {
+        bql_lock();
+    }
+}
+
+static void usb_tcp_host_unlock(USBTCPHostState *s)
+{
+    if (s->iothread) {
+        bql_unlock();
+    }
+}
+
 static void usb_tcp_host_closed(USBTCPHostState *s)
 {
     DPRINTF("%s\n", __func__);
+    usb_tcp_host_retry_flush(s);
     if (s->ioc) {
         qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-        qio_channel_close(s->ioc, NULL);
+        /* The message loop may be waiting on it there, and closes it. */
+        if (!s->iothread) {
+            qio_channel_close(s->ioc, NULL);
+        }
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
     s->closed = true;
-    migrate_del_blocker(&s->migration_blocker);
 }
 
 static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
@@ -69,9 +111,9 @@ static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
     return (ret <= 0) ? ret : iov.iov_len;
 }
 
-static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
+static bool tcp_usb_writev(QIOChannel *ioc, const struct iovec *iov,
+                           size_t niov)
 {
-    struct iovec iov = { .iov_base = buf, .iov_len = len };
     bool iolock = bql_locked();
     bool iothread = qemu_in_iothread();
     bool ret = false;
@@ -87,7 +129,7 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
         bql_unlock();
     }
 
-    if (!qio_channel_writev_full_all(ioc, &iov, 1, NULL, 0, 0, &err)) {
+    if (!qio_channel_writev_full_all(ioc, iov, niov, NULL, 0, 0, &err)) {
         ret = true;
     }
 
@@ -101,6 +143,96 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
     return ret;
 }
 
+/*
+ * Read the header following a `type` byte into `buf`, which must hold
+ * TCP_USB_MAX_HDR_SIZE bytes, and return its size through `len`.
+ */
+static bool usb_tcp_host_read_header(USBTCPHostState *s, QIOChannel *ioc,
+                                     uint8_t type, uint8_t *buf, size_t *len)
+{
+    uint8_t hlen;
+
+    if (s->proto_version < TCP_USB_PROTO_V2) {
+        *len = tcp_usb_v1_header_size(type);
+        return tcp_usb_read(ioc, buf, *len) == *len;
+    }
+
+    if (tcp_usb_read(ioc, &hlen, sizeof(hlen)) != sizeof(hlen) ||
+        hlen >= TCP_USB_MAX_HDR_SIZE) {
+        return false;
+    }
+    *len = hlen;
+    return tcp_usb_read(ioc, buf, hlen) == hlen;
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * Compress the IN payload of `p` if that was agreed on and it is worth it.
+ * Returns the compressed size, or 0 to send the payload as is.
+ */
+static size_t usb_tcp_host_compress(USBTCPHostState *s, USBPacket *p,
+                                    size_t length, void **out)
+{
+    g_autofree void *buffer = NULL;
+    g_autofree void *cbuf = NULL;
+    size_t bound, ret;
+
+    if (!(s->proto_features & TCP_USB_FEAT_ZSTD) ||
+        length < TCP_USB_COMPRESS_MIN) {
+        return 0;
+    }
+
+    buffer = g_malloc(length);
+    iov_to_buf(p->iov.iov, p->iov.niov, 0, buffer, length);
+    bound = ZSTD_compressBound(length);
+    cbuf = g_malloc(bound);
+
+    /* Favour speed, this runs for every large IN transfer. */
+    ret = ZSTD_compress(cbuf, bound, buffer, length, 1);
+    if (ZSTD_isError(ret) || ret >= length) {
+        return 0;
+    }
+
+    *out = g_steal_pointer(&cbuf);
+    return ret;
+}
+#endif
+
+/*
+ * Offer our highest version and features on the freshly connected `fd`,
+ * and take what the remote agrees to.
+ */
+static bool usb_tcp_host_handshake(USBTCPHostState *s, int fd)
+{
+    tcp_usb_header_t hdr = { .type = TCP_USB_HELLO };
+    tcp_usb_hello hello = { 0 };
+    uint8_t features = 0;
+
+#ifdef CONFIG_ZSTD
+    if (s->compress) {
+        features |= TCP_USB_FEAT_ZSTD;
+    }
+#endif
+
+    tcp_usb_hello_init(&hello, TCP_USB_PROTO_VERSION, features);
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        qemu_write_full(fd, &hello, sizeof(hello)) != sizeof(hello)) {
+        return false;
+    }
+
+    if (recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr) ||
+        hdr.type != TCP_USB_HELLO ||
+        recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+        !tcp_usb_hello_parse(&hello, &s->proto_version,
+                             &s->proto_features)) {
+        return false;
+    }
+
+    /* Never accept more than was offered. */
+    s->proto_features &= features;
+    return true;
+}
+
 static USBPort *usb_tcp_host_find_active_port(USBTCPHostState *s)
 {
     for (int i = 0; i < G_N_ELEMENTS(s->uports) - 1; i++) {
@@ -111,56 +243,72 @@ static USBPort *usb_tcp_host_find_active_port(USBTCPHostState *s)
     return &s->uports[0];
 }
 
+typedef struct USBTCPResponse {
+    USBTCPHostState *s;
+    USBTCPPacket *pkt;
+    tcp_usb_response_header resp;
+    /* Taken under the BQL, the device may still complete an async packet. */
+    bool done;
+    bool payload;
+} USBTCPResponse;
+
 static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
 {
-    USBTCPPacket *pkt = (USBTCPPacket *)opaque;
-    USBTCPHostState *s = USB_TCP_HOST(pkt->s);
+    g_autofree USBTCPResponse *r = opaque;
+    USBTCPHostState *s = r->s;
+    USBTCPPacket *pkt = r->pkt;
     USBPacket *p = &pkt->p;
-    tcp_usb_header_t hdr = { 0 };
-    tcp_usb_response_header resp = { 0 };
-    g_autofree void *buffer = NULL;
-    USBPort *uport = usb_tcp_host_find_active_port(s);
-
-    WITH_QEMU_LOCK_GUARD(&s->write_mutex)
-    {
-        if (!s->closed) {
-            hdr.type = TCP_USB_RESPONSE;
-            resp.addr = uport->dev->addr;
-            resp.pid = p->pid;
-            resp.ep = p->ep->nr;
-            resp.id = p->id;
-            resp.status = p->status;
-            resp.length = p->iov.size;
-
-            if (resp.length > p->actual_length) {
-                resp.length = p->actual_length;
-            }
-
-            if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC) {
-                buffer = g_malloc(resp.length);
-                iov_to_buf(p->iov.iov, p->iov.niov, 0, buffer, resp.length);
-            }
+    tcp_usb_header_t hdr = { .type = TCP_USB_RESPONSE };
+    uint8_t buf[TCP_USB_MAX_HDR_SIZE];
+    g_autofree struct iovec *iov = g_new(struct iovec, 2 + p->iov.niov);
+    g_autofree void *cbuf = NULL;
+    size_t clength = 0;
+    size_t niov = 2;
+    QIOChannel *ioc = NULL;
 
-            if (!tcp_usb_write(s->ioc, &hdr, sizeof(hdr))) {
-                usb_tcp_host_closed(s);
-                return;
+    usb_tcp_host_lock(s);
+    if (!s->closed && s->ioc) {
+        ioc = s->ioc;
+        object_ref(OBJECT(ioc));
+    }
+    usb_tcp_host_unlock(s);
+
+    if (ioc) {
+        WITH_QEMU_LOCK_GUARD(&s->write_mutex)
+        {
+#ifdef CONFIG_ZSTD
+            if (r->payload) {
+                clength = usb_tcp_host_compress(s, p, r->resp.length, &cbuf);
             }
+#endif
 
-            if (!tcp_usb_write(s->ioc, &resp, sizeof(resp))) {
-                usb_tcp_host_closed(s);
-                return;
+            /* Send the headers and IN payload from the packet in one go. */
+            iov[0].iov_base = &hdr;
+            iov[0].iov_len = sizeof(hdr);
+            iov[1].iov_base = buf;
+            iov[1].iov_len = tcp_usb_encode_response(buf, &r->resp, clength,
+                                                     s->proto_version);
+            if (clength) {
+                iov[2].iov_base = cbuf;
+                iov[2].iov_len = clength;
+                niov++;
+            } else if (r->payload) {
+                niov += iov_copy(iov + 2, p->iov.niov, p->iov.iov, p->iov.niov,
+                                 0, r->resp.length);
             }
 
-            if (buffer) {
-                if (!tcp_usb_write(s->ioc, buffer, resp.length)) {
+            if (!tcp_usb_writev(ioc, iov, niov)) {
+                usb_tcp_host_lock(s);
+                if (s->ioc == ioc) {
                     usb_tcp_host_closed(s);
-                    return;
                 }
+                usb_tcp_host_unlock(s);
             }
         }
+        object_unref(OBJECT(ioc));
     }
 
-    if (!usb_packet_is_inflight(p)) {
+    if (r->done) {
         if (pkt->buffer) {
             g_free(pkt->buffer);
         }
@@ -169,24 +317,122 @@ static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
     }
 }
 
+/* Called under the BQL. */
 static void usb_tcp_host_respond_packet(USBTCPHostState *s, USBTCPPacket *pkt)
 {
+    USBTCPResponse *r = g_new0(USBTCPResponse, 1);
+    USBPacket *p = &pkt->p;
+    USBPort *uport = usb_tcp_host_find_active_port(s);
     Coroutine *co = NULL;
-    co = qemu_coroutine_create(usb_tcp_host_respond_packet_co, pkt);
-    qemu_coroutine_enter(co);
+
+    r->s = s;
+    r->pkt = pkt;
+    r->resp.addr = uport->dev->addr;
+    r->resp.pid = p->pid;
+    r->resp.ep = p->ep->nr;
+    r->resp.id = p->id;
+    r->resp.status = p->status;
+    r->resp.length = MIN(p->iov.size, p->actual_length);
+    r->done = !usb_packet_is_inflight(p);
+    r->payload = r->done && p->pid == USB_TOKEN_IN &&
+                 p->status != USB_RET_ASYNC;
+
+    co = qemu_coroutine_create(usb_tcp_host_respond_packet_co, r);
+    if (s->iothread) {
+        aio_co_schedule(iothread_get_aio_context(s->iothread), co);
+    } else {
+        qemu_coroutine_enter(co);
+    }
 }
 
-static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
+/* Whether a request queued ahead of `pkt` targets the same endpoint. */
+static bool usb_tcp_host_retry_blocked(USBTCPHostState *s, USBTCPPacket *pkt)
+{
+    USBTCPPacket *r;
+
+    QTAILQ_FOREACH (r, &s->retry_queue, retry) {
+        if (r == pkt) {
+            break;
+        }
+        if (r->p.ep == pkt->p.ep) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usb_tcp_host_retry_arm(USBTCPHostState *s)
+{
+    timer_mod(s->retry_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                  TCP_USB_NAK_RETRY_NS);
+}
+
+static void usb_tcp_host_retry_cb(void *opaque)
 {
     USBTCPHostState *s = USB_TCP_HOST(opaque);
-    USBPort *uport = usb_tcp_host_find_active_port(s);
-    QIOChannel *ioc = s->ioc;
+    USBTCPPacket *pkt, *next;
+
+    QTAILQ_FOREACH_SAFE (pkt, &s->retry_queue, retry, next) {
+        if (usb_tcp_host_retry_blocked(s, pkt)) {
+            continue;
+        }
+        usb_handle_packet(pkt->dev, &pkt->p);
+        if (pkt->p.status == USB_RET_NAK) {
+            continue;
+        }
+        QTAILQ_REMOVE(&s->retry_queue, pkt, retry);
+        usb_tcp_host_respond_packet(s, pkt);
+    }
+
+    if (!QTAILQ_EMPTY(&s->retry_queue)) {
+        usb_tcp_host_retry_arm(s);
+    }
+}
+
+static USBTCPPacket *usb_tcp_host_retry_find(USBTCPHostState *s, int pid,
+                                             uint8_t ep, uint64_t id)
+{
+    USBTCPPacket *pkt;
+
+    QTAILQ_FOREACH (pkt, &s->retry_queue, retry) {
+        if (pkt->p.pid == pid && pkt->p.ep->nr == ep && pkt->p.id == id) {
+            return pkt;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The remote doesn't wait on pipelined requests, so a NAK can't be handed
+ * back for it to retry; hold the request and any behind it on the same
+ * endpoint instead, so they still reach the device in order.
+ */
+static void usb_tcp_host_submit_packet(USBTCPHostState *s, USBTCPPacket *pkt)
+{
+    if (pkt->pipelined && usb_tcp_host_retry_blocked(s, pkt)) {
+        QTAILQ_INSERT_TAIL(&s->retry_queue, pkt, retry);
+        return;
+    }
 
+    usb_handle_packet(pkt->dev, &pkt->p);
+    if (pkt->pipelined && pkt->p.status == USB_RET_NAK) {
+        QTAILQ_INSERT_TAIL(&s->retry_queue, pkt, retry);
+        usb_tcp_host_retry_arm(s);
+        return;
+    }
+    usb_tcp_host_respond_packet(s, pkt);
+}
+
+/* Returns once the channel is closed or the remote misbehaves. */
+static void coroutine_fn usb_tcp_host_msg_loop(USBTCPHostState *s,
+                                               QIOChannel *ioc)
+{
     for (;;) {
         tcp_usb_header_t hdr = { 0 };
+        uint8_t buf[TCP_USB_MAX_HDR_SIZE];
+        size_t len = 0;
 
         if (unlikely((tcp_usb_read(ioc, &hdr, sizeof(hdr)) != sizeof(hdr)))) {
-            usb_tcp_host_closed(s);
             return;
         }
 
@@ -197,42 +443,50 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
             g_autofree void *buffer = NULL;
             g_autofree USBTCPPacket *pkt =
                 (USBTCPPacket *)g_malloc0(sizeof(USBTCPPacket));
+            USBPort *uport;
             USBEndpoint *ep = NULL;
 
-            if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) !=
-                         sizeof(pkt_hdr))) {
-                usb_tcp_host_closed(s);
+            if (unlikely(!usb_tcp_host_read_header(s, ioc, hdr.type, buf,
+                                                   &len) ||
+                         !tcp_usb_decode_request(buf, len, &pkt_hdr,
+                                                 s->proto_version))) {
                 return;
             }
 
 #if 0
                 DPRINTF("%s: TCP_USB_REQUEST pid: 0x%x ep: %d id: 0x%lx\n", __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id);
 #endif
-            ep = usb_ep_get(uport->dev, pkt_hdr.pid, pkt_hdr.ep);
-            if (ep == NULL) {
-                DPRINTF("%s: TCP_USB_REQUEST unknown EP\n", __func__);
-                usb_tcp_host_closed(s);
-                return;
-            }
-
-            usb_packet_init(&pkt->p);
-            usb_packet_setup(&pkt->p, pkt_hdr.pid, ep, pkt_hdr.stream,
-                             pkt_hdr.id, pkt_hdr.short_not_ok, pkt_hdr.int_req);
 
+            /* The OUT payload is read before taking the BQL. */
             if (pkt_hdr.length > 0) {
                 buffer = g_malloc0(pkt_hdr.length);
 
                 if (pkt_hdr.pid != USB_TOKEN_IN) {
-                    if (unlikely(tcp_usb_read(s->ioc, buffer, pkt_hdr.length) !=
+                    if (unlikely(tcp_usb_read(ioc, buffer, pkt_hdr.length) !=
                                  pkt_hdr.length)) {
-                        usb_tcp_host_closed(s);
-                        usb_packet_cleanup(&pkt->p);
                         return;
                     }
                     /* qemu_hexdump(stderr, __func__, buffer, pkt_hdr.length);
                      */
                 }
+            }
+
+            usb_tcp_host_lock(s);
+            uport = usb_tcp_host_find_active_port(s);
+            ep = usb_ep_get(uport->dev, pkt_hdr.pid, pkt_hdr.ep);
+            if (ep == NULL) {
+                DPRINTF("%s: TCP_USB_REQUEST unknown EP\n", __func__);
+                usb_tcp_host_unlock(s);
+                return;
+            }
+
+            usb_packet_init(&pkt->p);
+            usb_packet_setup(&pkt->p, pkt_hdr.pid, ep, pkt_hdr.stream,
+                             pkt_hdr.id, pkt_hdr.short_not_ok,
+                             pkt_hdr.int_req & ~TCP_USB_REQ_PIPELINED);
+            pkt->pipelined = pkt_hdr.int_req & TCP_USB_REQ_PIPELINED;
 
+            if (pkt_hdr.length > 0) {
                 usb_packet_addbuf(&pkt->p, buffer, pkt_hdr.length);
                 pkt->buffer = buffer;
                 g_steal_pointer(&buffer);
@@ -253,24 +507,25 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
             pkt->addr = pkt_hdr.addr;
             assert(bql_locked());
 
-            usb_handle_packet(pkt->dev, &pkt->p);
-            usb_tcp_host_respond_packet(s, pkt);
+            usb_tcp_host_submit_packet(s, pkt);
             g_steal_pointer(&pkt);
+            usb_tcp_host_unlock(s);
             break;
         }
         case TCP_USB_RESPONSE:
             fprintf(stderr, "%s: unexpected TCP_USB_RESPONSE\n", __func__);
-            usb_tcp_host_closed(s);
             return;
         case TCP_USB_CANCEL: {
             /* DPRINTF("%s: TCP_USB_CANCEL\n", __func__); */
             tcp_usb_cancel_header pkt_hdr = { 0 };
             USBTCPPacket *pkt = NULL;
             USBPacket *p = NULL;
+            USBPort *uport;
 
-            if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) !=
-                         sizeof(pkt_hdr))) {
-                usb_tcp_host_closed(s);
+            if (unlikely(!usb_tcp_host_read_header(s, ioc, hdr.type, buf,
+                                                   &len) ||
+                         !tcp_usb_decode_cancel(buf, len, &pkt_hdr,
+                                                s->proto_version))) {
                 return;
             }
 
@@ -279,6 +534,8 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
                     pkt_hdr.pid, pkt_hdr.ep);
 #endif
 
+            usb_tcp_host_lock(s);
+            uport = usb_tcp_host_find_active_port(s);
             if (pkt_hdr.addr != uport->dev->addr) {
                 /*
                  * fprintf(stderr,
@@ -300,55 +557,73 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
                         __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id,
                         p->actual_length);
                 usb_tcp_host_respond_packet(s, pkt);
+            } else if ((pkt = usb_tcp_host_retry_find(s, pkt_hdr.pid,
+                                                      pkt_hdr.ep,
+                                                      pkt_hdr.id))) {
+                /* Still waiting out a NAK, never reached the device. */
+                QTAILQ_REMOVE(&s->retry_queue, pkt, retry);
+                pkt->p.status = USB_RET_IOERROR;
+                usb_tcp_host_respond_packet(s, pkt);
             } else {
                 warn_report("%s: TCP_USB_CANCEL: packet"
                             " pid: 0x%x ep: %d id: 0x%llx not found",
                             __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id);
             }
+            usb_tcp_host_unlock(s);
             break;
         }
         case TCP_USB_RESET:
             /* fprintf(stderr, "%s: TCP_USB_RESET\n", __func__); */
             DPRINTF("%s: TCP_USB_RESET\n", __func__);
+            usb_tcp_host_lock(s);
             assert(bql_locked());
-            usb_device_reset(uport->dev);
+            usb_device_reset(usb_tcp_host_find_active_port(s)->dev);
+            usb_tcp_host_unlock(s);
             break;
-            ;
         default:
             g_assert_not_reached();
             break;
         }
     }
+}
+
+typedef struct USBTCPMsgLoop {
+    USBTCPHostState *s;
+    /* A reference of its own, the channel may be dropped from s meanwhile. */
+    QIOChannel *ioc;
+} USBTCPMsgLoop;
+
+static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
+{
+    g_autofree USBTCPMsgLoop *loop = opaque;
+    USBTCPHostState *s = loop->s;
+    QIOChannel *ioc = loop->ioc;
+
+    usb_tcp_host_msg_loop(s, ioc);
+
+    usb_tcp_host_lock(s);
+    /* Closed under us for a handoff, maybe reconnected since. */
+    if (s->ioc == ioc) {
+        usb_tcp_host_closed(s);
+    }
+    usb_tcp_host_unlock(s);
 
-    return;
+    if (s->iothread) {
+        qio_channel_close(ioc, NULL);
+    }
+    object_unref(OBJECT(ioc));
 }
 
-static void usb_tcp_host_attach(USBPort *uport)
+static void usb_tcp_host_connect(USBTCPHostState *s)
 {
     struct sockaddr_un server_addr;
-    USBTCPHostState *s = USB_TCP_HOST(uport->opaque);
     int sock = -1;
     Coroutine *co = NULL;
     QIOChannel *ioc = NULL;
+    USBTCPMsgLoop *loop;
     int ret;
     Error *err = NULL;
 
-    if (uport->index >= G_N_ELEMENTS(s->uports) - 1) {
-        error_report("%s: attached to unused port\n", __func__);
-        return;
-    }
-
-    if (usb_tcp_host_find_active_port(s) != uport) {
-        error_report("%s: Attaching to 2 proxy ports at the same time. "
-                     "This port might not be able to receive packets.\n",
-                     __func__);
-        return;
-    }
-
-    if (!uport->dev || !uport->dev->attached) {
-        return;
-    }
-
     sock = socket(AF_UNIX, SOCK_STREAM, 0);
 
     if (socket < 0) {
@@ -368,20 +643,60 @@ static void usb_tcp_host_attach(USBPort *uport)
         return;
     }
 
+    tcp_usb_set_socket_bufs(sock);
+
+    if (!usb_tcp_host_handshake(s, sock)) {
+        error_report("%s: handshake with the remote failed", __func__);
+        close(sock);
+        return;
+    }
+
     ioc = qio_channel_new_fd(sock, &err);
     if (!ioc) {
         error_report_err(err);
         close(sock);
         return;
     }
-    object_ref(ioc);
     qio_channel_set_blocking(ioc, false, NULL);
     s->closed = false;
     s->ioc = ioc;
 
-    migrate_add_blocker(&s->migration_blocker, NULL);
-    co = qemu_coroutine_create(usb_tcp_host_msg_loop_co, s);
-    qemu_coroutine_enter(co);
+    loop = g_new0(USBTCPMsgLoop, 1);
+    loop->s = s;
+    loop->ioc = ioc;
+    object_ref(ioc);
+
+    co = qemu_coroutine_create(usb_tcp_host_msg_loop_co, loop);
+    if (s->iothread) {
+        /* Reads yield to the IOThread's AioContext, not the main loop's. */
+        qio_channel_set_follow_coroutine_ctx(ioc, true);
+        aio_co_schedule(iothread_get_aio_context(s->iothread), co);
+    } else {
+        qemu_coroutine_enter(co);
+    }
+}
+
+static void usb_tcp_host_attach(USBPort *uport)
+{
+    USBTCPHostState *s = USB_TCP_HOST(uport->opaque);
+
+    if (uport->index >= G_N_ELEMENTS(s->uports) - 1) {
+        error_report("%s: attached to unused port\n", __func__);
+        return;
+    }
+
+    if (usb_tcp_host_find_active_port(s) != uport) {
+        error_report("%s: Attaching to 2 proxy ports at the same time. "
+                     "This port might not be able to receive packets.\n",
+                     __func__);
+        return;
+    }
+
+    if (!uport->dev || !uport->dev->attached) {
+        return;
+    }
+
+    usb_tcp_host_connect(s);
 }
 
 static void usb_tcp_host_detach(USBPort *uport)
@@ -397,6 +712,31 @@ static void usb_tcp_host_async_packet_complete(USBPort *port, USBPacket *p)
     usb_tcp_host_respond_packet(s, container_of(p, USBTCPPacket, p));
 }
 
+/*
+ * The link follows the guest: the source drops it once stopped for the
+ * switchover so the remote can take the destination's connection, which
+ * dwc2 opens when it re-attaches its gadget after loading. If migration
+ * fails and the source resumes, it connects again. Either way the remote
+ * sees a disconnect and re-enumerates, like a cable being replugged.
+ */
+static void usb_tcp_host_vm_state_change(void *opaque, bool running,
+                                         RunState state)
+{
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
+    USBPort *uport;
+
+    if (!running && state == RUN_STATE_FINISH_MIGRATE && !s->closed) {
+        usb_tcp_host_closed(s);
+        s->handoff = true;
+    } else if (running && s->handoff) {
+        s->handoff = false;
+        uport = usb_tcp_host_find_active_port(s);
+        if (s->closed && uport && uport->dev && uport->dev->attached) {
+            usb_tcp_host_connect(s);
+        }
+    }
+}
+
 static USBBusOps usb_tcp_bus_ops = {};
 
 static USBPortOps usb_tcp_host_port_ops = {
@@ -420,17 +760,23 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
 
     s->closed = 1;
     qemu_co_mutex_init(&s->write_mutex);
+    QTAILQ_INIT(&s->retry_queue);
+    s->retry_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, usb_tcp_host_retry_cb, s);
+    s->vmse =
+        qemu_add_vm_change_state_handler(usb_tcp_host_vm_state_change, s);
 }
 
 static void usb_tcp_host_unrealize(DeviceState *dev)
 {
     USBTCPHostState *s = USB_TCP_HOST(dev);
 
-    if (s->ioc) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-        qio_channel_close(s->ioc, NULL);
-        s->ioc = NULL;
-    }
+    qemu_del_vm_change_state_handler(s->vmse);
+    s->vmse = NULL;
+
+    usb_tcp_host_closed(s);
+    timer_free(s->retry_timer);
+    s->retry_timer = NULL;
 
     s->closed = 1;
     s->stopped = 1;
@@ -440,13 +786,12 @@ static void usb_tcp_host_init(Object *obj)
 {
     USBTCPHostState *s = USB_TCP_HOST(obj);
     s->closed = 1;
-    error_setg(&s->migration_blocker,
-               "%s does not support migration "
-               "while connected",
-               TYPE_USB_TCP_HOST);
 }
 
 static Property usb_tcp_host_properties[] = {
+    DEFINE_PROP_BOOL("compress", USBTCPHostState, compress, true),
+    DEFINE_PROP_LINK("iothread", USBTCPHostState, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
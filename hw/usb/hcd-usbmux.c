@@ -0,0 +1,1124 @@
+#include "qemu/osdep.h"
+#include "hw/qdev-properties.h"
+#include "hw/usb.h"
+#include "hw/usb/hcd-usbmux.h"
+#include "io/channel-socket.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qom/object.h"
+
+// #define DEBUG_HCD_USBMUX
+
+#ifdef DEBUG_HCD_USBMUX
+#define DPRINTF(fmt, ...)                                   \
+    do {                                                    \
+        fprintf(stderr, "hcd-usbmux: " fmt, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do {                  \
+    } while (0)
+#endif
+
+#define USB_MUX_SUBCLASS (0xFE)
+#define USB_MUX_PROTOCOL (2)
+
+/* Device side, the framing between us and the gadget's mux interface. */
+#define USB_MUX_PROTO_VERSION (0)
+#define USB_MUX_PROTO_CONTROL (1)
+#define USB_MUX_PROTO_SETUP (2)
+#define USB_MUX_PROTO_TCP (6)
+#define USB_MUX_MAGIC (0xFEED)
+#define USB_MUX_V1_HDR_SIZE (8)
+#define USB_MUX_V2_HDR_SIZE (16)
+
+#define USB_MUX_TCP_HDR_SIZE (20)
+#define USB_MUX_TH_SYN (0x02)
+#define USB_MUX_TH_RST (0x04)
+#define USB_MUX_TH_ACK (0x10)
+
+/* What we advertise, and the most we put in one segment. */
+#define USB_MUX_WINDOW (128 * KiB)
+#define USB_MUX_SEG_MAX (32 * KiB)
+
+/* Client side, usbmuxd's plist protocol. */
+#define USB_MUX_CLIENT_HDR_SIZE (16)
+#define USB_MUX_CLIENT_VERSION_PLIST (1)
+#define USB_MUX_CLIENT_MSG_PLIST (8)
+#define USB_MUX_CLIENT_REQ_MAX (1 * MiB)
+
+#define USB_MUX_RESULT_OK (0)
+#define USB_MUX_RESULT_BADCOMMAND (1)
+#define USB_MUX_RESULT_BADDEV (2)
+#define USB_MUX_RESULT_CONNREFUSED (3)
+#define USB_MUX_RESULT_BADVERSION (6)
+
+#define USB_MUX_PLIST_HEAD                                                  \
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"                          \
+    "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "               \
+    "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"                 \
+    "<plist version=\"1.0\">\n<dict>\n"
+#define USB_MUX_PLIST_TAIL "</dict>\n</plist>\n"
+
+typedef enum {
+    USB_MUX_CONN_NONE,
+    USB_MUX_CONN_CONNECTING,
+    USB_MUX_CONN_CONNECTED,
+    USB_MUX_CONN_REFUSED,
+} USBMuxConnState;
+
+/*
+ * A client of the socket. Once a Connect succeeds it stops speaking the
+ * plist protocol and becomes the pipe of one connection to the device.
+ */
+struct USBMuxClient {
+    USBMuxHostState *s;
+    QIOChannelSocket *sioc;
+    QIOChannel *ioc;
+    CoMutex write_lock;
+    unsigned int refcnt;
+    bool closed;
+    bool listening;
+
+    USBMuxConnState state;
+    uint32_t generation;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t tx_seq;
+    uint32_t tx_ack;
+    uint32_t rx_ack;
+    uint32_t rx_win;
+    /* Our own coroutine, while it waits on the device. */
+    Coroutine *wait_co;
+
+    QLIST_ENTRY(USBMuxClient) next;
+};
+
+/* Of the elements in <plist><dict><key>, the depth of the key. */
+#define USB_MUX_PLIST_ENTRY_DEPTH (3)
+
+/*
+ * A usbmuxd request is a plist with a single dict of scalars. The reader
+ * keeps the top-level keys of that dict, each with the element name of its
+ * value and the value's text; nested dicts and arrays are kept by type only.
+ */
+typedef struct USBMuxPlistValue {
+    char *type;
+    GString *text;
+} USBMuxPlistValue;
+
+typedef struct USBMuxPlistReader {
+    GHashTable *dict;
+    int depth;
+    /* The last top-level key, until its value comes. */
+    char *key;
+    /* Where the text of the key or value being read goes, if anywhere. */
+    GString *text;
+    bool in_key;
+} USBMuxPlistReader;
+
+static void usb_mux_plist_value_free(gpointer data)
+{
+    USBMuxPlistValue *v = data;
+
+    g_free(v->type);
+    g_string_free(v->text, true);
+    g_free(v);
+}
+
+static void usb_mux_plist_start(GMarkupParseContext *context,
+                                const char *element_name,
+                                const char **attribute_names,
+                                const char **attribute_values,
+                                gpointer user_data, GError **error)
+{
+    USBMuxPlistReader *r = user_data;
+    static const char *const outer[] = { "plist", "dict" };
+    USBMuxPlistValue *v;
+
+    r->depth++;
+    if (r->depth <= ARRAY_SIZE(outer)) {
+        if (!g_str_equal(element_name, outer[r->depth - 1])) {
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                        "unexpected <%s>", element_name);
+        }
+        return;
+    }
+    if (r->depth > USB_MUX_PLIST_ENTRY_DEPTH) {
+        return;
+    }
+
+    if (g_str_equal(element_name, "key")) {
+        g_free(r->key);
+        r->key = NULL;
+        r->text = g_string_new(NULL);
+        r->in_key = true;
+        return;
+    }
+    if (r->key == NULL) {
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "<%s> without a key", element_name);
+        return;
+    }
+
+    v = g_new0(USBMuxPlistValue, 1);
+    v->type = g_strdup(element_name);
+    v->text = g_string_new(NULL);
+    g_hash_table_replace(r->dict, r->key, v);
+    r->key = NULL;
+    r->text = v->text;
+}
+
+static void usb_mux_plist_end(GMarkupParseContext *context,
+                              const char *element_name, gpointer user_data,
+                              GError **error)
+{
+    USBMuxPlistReader *r = user_data;
+
+    if (r->depth == USB_MUX_PLIST_ENTRY_DEPTH) {
+        if (r->in_key) {
+            r->key = g_string_free(r->text, false);
+            r->in_key = false;
+        }
+        r->text = NULL;
+    }
+    r->depth--;
+}
+
+static void usb_mux_plist_text(GMarkupParseContext *context, const char *text,
+                               gsize text_len, gpointer user_data,
+                               GError **error)
+{
+    USBMuxPlistReader *r = user_data;
+
+    if (r->depth == USB_MUX_PLIST_ENTRY_DEPTH && r->text != NULL) {
+        g_string_append_len(r->text, text, text_len);
+    }
+}
+
+static const GMarkupParser usb_mux_plist_parser = {
+    .start_element = usb_mux_plist_start,
+    .end_element = usb_mux_plist_end,
+    .text = usb_mux_plist_text,
+};
+
+/* The top-level dict of `xml`, or NULL if it is not a plist of one. */
+static GHashTable *usb_mux_plist_parse(const char *xml, size_t len)
+{
+    USBMuxPlistReader r = {
+        .dict = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      usb_mux_plist_value_free),
+    };
+    GMarkupParseContext *ctx =
+        g_markup_parse_context_new(&usb_mux_plist_parser, 0, &r, NULL);
+    bool ok;
+
+    ok = g_markup_parse_context_parse(ctx, xml, len, NULL) &&
+         g_markup_parse_context_end_parse(ctx, NULL);
+    g_markup_parse_context_free(ctx);
+
+    if (r.in_key) {
+        g_string_free(r.text, true);
+    }
+    g_free(r.key);
+    if (!ok) {
+        g_hash_table_unref(r.dict);
+        return NULL;
+    }
+    return r.dict;
+}
+
+/* The text of the top-level `key`, which must be of `type`. */
+static const char *usb_mux_plist_value(GHashTable *dict, const char *key,
+                                       const char *type)
+{
+    USBMuxPlistValue *v = g_hash_table_lookup(dict, key);
+
+    return v != NULL && g_str_equal(v->type, type) ? v->text->str : NULL;
+}
+
+static bool usb_mux_plist_int(GHashTable *dict, const char *key, int64_t *val)
+{
+    const char *str = usb_mux_plist_value(dict, key, "integer");
+
+    return str != NULL && qemu_strtoi64(str, NULL, 10, val) == 0;
+}
+
+/* Look for the mux interface and its bulk endpoints in the configuration. */
+static bool usb_mux_host_parse_config(USBGadgetHost *h, const uint8_t *desc,
+                                      size_t len)
+{
+    bool mux = false;
+    uint8_t ep_in = 0;
+    uint8_t ep_out = 0;
+    uint16_t ep_out_mps = 0;
+
+    for (size_t off = 0; off + 2 <= len && desc[off] >= 2;
+         off += desc[off]) {
+        const uint8_t *d = desc + off;
+
+        if (off + d[0] > len) {
+            break;
+        }
+
+        switch (d[1]) {
+        case USB_DT_INTERFACE:
+            if (d[0] < 9) {
+                return false;
+            }
+            mux = d[3] == 0 && d[5] == USB_CLASS_VENDOR_SPEC &&
+                  d[6] == USB_MUX_SUBCLASS && d[7] == USB_MUX_PROTOCOL;
+            ep_in = ep_out = 0;
+            break;
+        case USB_DT_ENDPOINT:
+            if (!mux || d[0] < 7 ||
+                (d[3] & 3) != USB_ENDPOINT_XFER_BULK) {
+                break;
+            }
+            if (d[2] & USB_DIR_IN) {
+                ep_in = d[2] & 0xF;
+            } else {
+                ep_out = d[2] & 0xF;
+                ep_out_mps = lduw_le_p(d + 4) & 0x7FF;
+            }
+            if (ep_in != 0 && ep_out != 0) {
+                h->ep_in = ep_in;
+                h->ep_out = ep_out;
+                h->ep_out_mps = ep_out_mps ? ep_out_mps : 512;
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return false;
+}
+
+/* The UDID, formatted the way usbmuxd reports it. */
+static void usb_mux_host_parse_serial(USBMuxHostState *s, const uint8_t *desc,
+                                      int len)
+{
+    size_t n = 0;
+
+    for (int i = 2; i + 1 < len && i + 1 < desc[0]; i += 2) {
+        if (n == 8 && len == 2 + 24 * 2) {
+            s->serial[n++] = '-';
+        }
+        if (n + 1 >= sizeof(s->serial)) {
+            break;
+        }
+        s->serial[n++] = desc[i + 1] == 0 && g_ascii_isalnum(desc[i]) ?
+                             desc[i] :
+                             '_';
+    }
+    s->serial[n] = '\0';
+}
+
+static void usb_mux_client_ref(USBMuxClient *c)
+{
+    c->refcnt++;
+}
+
+static void usb_mux_client_unref(USBMuxClient *c)
+{
+    if (--c->refcnt == 0) {
+        object_unref(OBJECT(c->sioc));
+        g_free(c);
+    }
+}
+
+static void usb_mux_client_close(USBMuxClient *c)
+{
+    if (c->closed) {
+        return;
+    }
+
+    c->closed = true;
+    QLIST_REMOVE(c, next);
+    qio_channel_shutdown(c->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    usb_gadget_host_wake(&c->wait_co);
+}
+
+/* Callers hold a reference, the write may yield. */
+static bool coroutine_fn usb_mux_client_write(USBMuxClient *c, const void *buf,
+                                              size_t len)
+{
+    bool ok;
+
+    if (c->closed) {
+        return false;
+    }
+
+    qemu_co_mutex_lock(&c->write_lock);
+    ok = qio_channel_write_all(c->ioc, buf, len, NULL) == 0;
+    qemu_co_mutex_unlock(&c->write_lock);
+
+    if (!ok) {
+        usb_mux_client_close(c);
+    }
+    return ok;
+}
+
+static bool coroutine_fn usb_mux_client_send_plist(USBMuxClient *c,
+                                                   uint32_t tag,
+                                                   const char *body)
+{
+    g_autoptr(GString) msg = g_string_new(NULL);
+    uint8_t hdr[USB_MUX_CLIENT_HDR_SIZE];
+
+    g_string_append_printf(msg, USB_MUX_PLIST_HEAD "%s" USB_MUX_PLIST_TAIL,
+                           body);
+    stl_le_p(hdr, sizeof(hdr) + msg->len);
+    stl_le_p(hdr + 4, USB_MUX_CLIENT_VERSION_PLIST);
+    stl_le_p(hdr + 8, USB_MUX_CLIENT_MSG_PLIST);
+    stl_le_p(hdr + 12, tag);
+    g_string_prepend_len(msg, (const char *)hdr, sizeof(hdr));
+
+    return usb_mux_client_write(c, msg->str, msg->len);
+}
+
+static bool coroutine_fn usb_mux_client_send_result(USBMuxClient *c,
+                                                    uint32_t tag, int result)
+{
+    g_autofree char *body = g_strdup_printf(
+        "<key>MessageType</key>\n<string>Result</string>\n"
+        "<key>Number</key>\n<integer>%d</integer>\n",
+        result);
+
+    return usb_mux_client_send_plist(c, tag, body);
+}
+
+/* The keys of an Attached message, which ListDevices also lists. */
+static char *usb_mux_host_attached_body(USBMuxHostState *s)
+{
+    g_autofree char *serial = g_markup_escape_text(s->serial, -1);
+
+    return g_strdup_printf(
+        "<key>DeviceID</key>\n<integer>%u</integer>\n"
+        "<key>MessageType</key>\n<string>Attached</string>\n"
+        "<key>Properties</key>\n<dict>\n"
+        "<key>ConnectionSpeed</key>\n<integer>480000000</integer>\n"
+        "<key>ConnectionType</key>\n<string>USB</string>\n"
+        "<key>DeviceID</key>\n<integer>%u</integer>\n"
+        "<key>LocationID</key>\n<integer>0</integer>\n"
+        "<key>ProductID</key>\n<integer>%u</integer>\n"
+        "<key>SerialNumber</key>\n<string>%s</string>\n"
+        "</dict>\n",
+        s->device_id, s->device_id, s->product_id, serial);
+}
+
+typedef struct USBMuxNotify {
+    USBMuxHostState *s;
+    char *body;
+} USBMuxNotify;
+
+static void coroutine_fn usb_mux_host_notify_co(void *opaque)
+{
+    USBMuxNotify *n = opaque;
+    g_autoptr(GPtrArray) targets = g_ptr_array_new();
+    USBMuxClient *c;
+
+    /* The list can change while a write yields. */
+    QLIST_FOREACH (c, &n->s->clients, next) {
+        if (c->listening) {
+            usb_mux_client_ref(c);
+            g_ptr_array_add(targets, c);
+        }
+    }
+
+    for (guint i = 0; i < targets->len; i++) {
+        c = g_ptr_array_index(targets, i);
+        usb_mux_client_send_plist(c, 0, n->body);
+        usb_mux_client_unref(c);
+    }
+
+    g_free(n->body);
+    g_free(n);
+}
+
+/* Tell every listening client, takes ownership of `body`. */
+static void usb_mux_host_notify(USBMuxHostState *s, char *body)
+{
+    USBMuxNotify *n = g_new0(USBMuxNotify, 1);
+
+    n->s = s;
+    n->body = body;
+    aio_co_schedule(qemu_get_aio_context(),
+                    qemu_coroutine_create(usb_mux_host_notify_co, n));
+}
+
+/* Send one mux packet, its header followed by `hdr` and `data`. */
+static int coroutine_fn usb_mux_host_send(USBMuxHostState *s, uint32_t gen,
+                                          uint32_t proto, const void *hdr,
+                                          size_t hdr_len, const void *data,
+                                          size_t len)
+{
+    size_t mux_len =
+        s->version >= 2 ? USB_MUX_V2_HDR_SIZE : USB_MUX_V1_HDR_SIZE;
+    size_t total = mux_len + hdr_len + len;
+    g_autofree uint8_t *buf = g_malloc0(total);
+    int ret;
+
+    memcpy(buf + mux_len, hdr, hdr_len);
+    if (len != 0) {
+        memcpy(buf + mux_len + hdr_len, data, len);
+    }
+
+    qemu_co_mutex_lock(&s->tx_lock);
+
+    /* The sequence numbers have to go out in the order they are taken. */
+    stl_be_p(buf, proto);
+    stl_be_p(buf + 4, total);
+    if (s->version >= 2) {
+        if (proto == USB_MUX_PROTO_SETUP) {
+            s->tx_seq = 0;
+            s->rx_seq = 0xFFFF;
+        }
+        stw_be_p(buf + 8, USB_MUX_MAGIC);
+        stw_be_p(buf + 10, s->tx_seq++);
+        stw_be_p(buf + 12, s->rx_seq);
+    }
+
+    ret = usb_gadget_host_xfer(&s->host, gen, &s->host.bulk_out,
+                               USB_TOKEN_OUT, s->host.ep_out, buf, total);
+    if (ret >= 0 && total % s->host.ep_out_mps == 0) {
+        ret = usb_gadget_host_xfer(&s->host, gen, &s->host.bulk_out,
+                                   USB_TOKEN_OUT, s->host.ep_out, NULL, 0);
+    }
+
+    qemu_co_mutex_unlock(&s->tx_lock);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn usb_mux_conn_send(USBMuxClient *c, uint8_t flags,
+                                          const void *data, size_t len)
+{
+    uint8_t th[USB_MUX_TCP_HDR_SIZE] = { 0 };
+
+    stw_be_p(th, c->sport);
+    stw_be_p(th + 2, c->dport);
+    stl_be_p(th + 4, c->tx_seq);
+    stl_be_p(th + 8, c->tx_ack);
+    th[12] = (USB_MUX_TCP_HDR_SIZE / 4) << 4;
+    th[13] = flags;
+    stw_be_p(th + 14, USB_MUX_WINDOW >> 8);
+
+    /* Taken before sending, an ACK from the IN side may go out meanwhile. */
+    c->tx_seq += len;
+    return usb_mux_host_send(c->s, c->generation, USB_MUX_PROTO_TCP, th,
+                             sizeof(th), data, len);
+}
+
+static USBMuxClient *usb_mux_host_find_conn(USBMuxHostState *s, uint16_t sport,
+                                            uint16_t dport)
+{
+    USBMuxClient *c;
+
+    QLIST_FOREACH (c, &s->clients, next) {
+        if ((c->state == USB_MUX_CONN_CONNECTING ||
+             c->state == USB_MUX_CONN_CONNECTED) &&
+            c->sport == sport && c->dport == dport) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static uint16_t usb_mux_host_alloc_sport(USBMuxHostState *s)
+{
+    USBMuxClient *c;
+    bool used;
+
+    do {
+        if (++s->next_sport == 0) {
+            s->next_sport = 1;
+        }
+        used = false;
+        QLIST_FOREACH (c, &s->clients, next) {
+            used |= c->state != USB_MUX_CONN_NONE && c->sport == s->next_sport;
+        }
+    } while (used);
+
+    return s->next_sport;
+}
+
+static void coroutine_fn usb_mux_host_rx_tcp(USBMuxHostState *s,
+                                             const uint8_t *th,
+                                             const uint8_t *data, uint32_t len)
+{
+    uint8_t flags = th[13];
+    USBMuxClient *c;
+
+    c = usb_mux_host_find_conn(s, lduw_be_p(th + 2), lduw_be_p(th));
+    if (c == NULL) {
+        DPRINTF("%s: no connection for port %d\n", __func__,
+                lduw_be_p(th + 2));
+        return;
+    }
+
+    c->rx_ack = ldl_be_p(th + 8);
+    c->rx_win = lduw_be_p(th + 14) << 8;
+
+    if (c->state == USB_MUX_CONN_CONNECTING) {
+        if (flags == (USB_MUX_TH_SYN | USB_MUX_TH_ACK)) {
+            c->tx_seq++;
+            c->tx_ack = ldl_be_p(th + 4) + 1;
+            c->state = USB_MUX_CONN_CONNECTED;
+            usb_mux_conn_send(c, USB_MUX_TH_ACK, NULL, 0);
+        } else {
+            c->state = USB_MUX_CONN_REFUSED;
+        }
+        usb_gadget_host_wake(&c->wait_co);
+        return;
+    }
+
+    if (flags & USB_MUX_TH_RST) {
+        c->state = USB_MUX_CONN_NONE;
+        usb_mux_client_close(c);
+        return;
+    }
+
+    if (len != 0) {
+        usb_mux_client_ref(c);
+        c->tx_ack += len;
+        if (usb_mux_client_write(c, data, len) &&
+            c->state == USB_MUX_CONN_CONNECTED) {
+            usb_mux_conn_send(c, USB_MUX_TH_ACK, NULL, 0);
+        }
+        usb_mux_client_unref(c);
+    }
+
+    /* The window may have opened. */
+    usb_gadget_host_wake(&c->wait_co);
+}
+
+static void coroutine_fn usb_mux_host_rx_packet(USBMuxHostState *s,
+                                                uint32_t gen,
+                                                const uint8_t *pkt,
+                                                uint32_t len)
+{
+    uint32_t hlen =
+        s->version >= 2 ? USB_MUX_V2_HDR_SIZE : USB_MUX_V1_HDR_SIZE;
+    uint32_t major;
+
+    if (len < hlen) {
+        return;
+    }
+    if (s->version >= 2) {
+        s->rx_seq = lduw_be_p(pkt + 12);
+    }
+
+    switch (ldl_be_p(pkt)) {
+    case USB_MUX_PROTO_VERSION:
+        if (len < hlen + 12 || s->host.running) {
+            return;
+        }
+        major = ldl_be_p(pkt + hlen);
+        if (major != 1 && major != 2) {
+            warn_report("%s: unsupported mux version %u", __func__, major);
+            return;
+        }
+        s->version = major;
+        if (major >= 2) {
+            usb_mux_host_send(s, gen, USB_MUX_PROTO_SETUP, "\x07", 1, NULL, 0);
+        }
+        if (gen != s->host.generation) {
+            return;
+        }
+        s->device_id++;
+        s->host.running = true;
+        usb_mux_host_notify(s, usb_mux_host_attached_body(s));
+        break;
+    case USB_MUX_PROTO_TCP:
+        if (len < hlen + USB_MUX_TCP_HDR_SIZE) {
+            return;
+        }
+        usb_mux_host_rx_tcp(s, pkt + hlen, pkt + hlen + USB_MUX_TCP_HDR_SIZE,
+                            len - hlen - USB_MUX_TCP_HDR_SIZE);
+        break;
+    default:
+        /* CONTROL carries the device's own log messages. */
+        break;
+    }
+}
+
+static void coroutine_fn usb_mux_host_rx(USBMuxHostState *s, uint32_t gen)
+{
+    uint32_t plen;
+
+    while (s->rx_len >= USB_MUX_V1_HDR_SIZE) {
+        plen = ldl_be_p(s->rx_pkt + 4);
+        if (plen < USB_MUX_V1_HDR_SIZE || plen > USB_MUX_PKT_MAX) {
+            /* Lost sync, start again with the next transfer. */
+            s->rx_len = 0;
+            return;
+        }
+        if (s->rx_len < plen) {
+            return;
+        }
+
+        usb_mux_host_rx_packet(s, gen, s->rx_pkt, plen);
+        if (gen != s->host.generation) {
+            return;
+        }
+        memmove(s->rx_pkt, s->rx_pkt + plen, s->rx_len - plen);
+        s->rx_len -= plen;
+    }
+}
+
+/* Reads the UDID, agrees on a version, then moves mux packets. */
+static void coroutine_fn usb_mux_host_run(USBGadgetHost *h, uint32_t gen,
+                                          const uint8_t *dev_desc)
+{
+    USBMuxHostState *s = container_of(h, USBMuxHostState, host);
+    uint8_t str_desc[255];
+    uint8_t version[12] = { 0 };
+    int ret;
+
+    s->product_id = lduw_le_p(dev_desc + 10);
+    g_strlcpy(s->serial, "unknown", sizeof(s->serial));
+    if (dev_desc[16] != 0) {
+        ret = usb_gadget_host_control(h, gen, USB_DIR_IN,
+                                      USB_REQ_GET_DESCRIPTOR,
+                                      (USB_DT_STRING << 8) | dev_desc[16],
+                                      0x0409, str_desc, sizeof(str_desc));
+        if (ret == -ENODEV) {
+            return;
+        }
+        if (ret > 2) {
+            usb_mux_host_parse_serial(s, str_desc, ret);
+        }
+    }
+
+    DPRINTF("%s: serial %s\n", __func__, s->serial);
+
+    /* Offer version 2, the reply comes back with a v1 header. */
+    s->version = 0;
+    s->rx_len = 0;
+    stl_be_p(version, 2);
+    if (usb_mux_host_send(s, gen, USB_MUX_PROTO_VERSION, version,
+                          sizeof(version), NULL, 0) < 0) {
+        if (gen == h->generation) {
+            warn_report("%s: offering the mux version failed", __func__);
+        }
+        return;
+    }
+
+    for (;;) {
+        ret = usb_gadget_host_xfer(h, gen, &h->bulk_in, USB_TOKEN_IN,
+                                   h->ep_in, s->rx_pkt + s->rx_len,
+                                   USB_MUX_MRU);
+        if (gen != h->generation) {
+            return;
+        }
+        if (ret < 0) {
+            qemu_co_sleep_ns(QEMU_CLOCK_VIRTUAL, USB_GADGET_HOST_NAK_RETRY_NS);
+            continue;
+        }
+        s->rx_len += ret;
+        usb_mux_host_rx(s, gen);
+        if (gen != h->generation) {
+            return;
+        }
+    }
+}
+
+/* Pair records live in `records`, one <udid>.plist each, as usbmuxd's do. */
+static char *usb_mux_host_record_path(USBMuxHostState *s, const char *id)
+{
+    if (s->records == NULL || id == NULL || id[0] == '\0' || id[0] == '.' ||
+        strchr(id, '/') != NULL) {
+        return NULL;
+    }
+    return g_strdup_printf("%s/%s.plist", s->records, id);
+}
+
+static bool coroutine_fn usb_mux_client_connect(USBMuxClient *c, uint32_t tag,
+                                                GHashTable *req)
+{
+    USBMuxHostState *s = c->s;
+    int64_t id;
+    int64_t port;
+
+    if (!usb_mux_plist_int(req, "DeviceID", &id) ||
+        !usb_mux_plist_int(req, "PortNumber", &port) || !s->host.running ||
+        id != s->device_id) {
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADDEV);
+    }
+
+    /* The port comes in network byte order. */
+    c->dport = bswap16(port & 0xFFFF);
+    c->sport = usb_mux_host_alloc_sport(s);
+    c->generation = s->host.generation;
+    c->tx_seq = 0;
+    c->tx_ack = 0;
+    c->rx_ack = 0;
+    c->rx_win = 0;
+    c->state = USB_MUX_CONN_CONNECTING;
+
+    if (usb_mux_conn_send(c, USB_MUX_TH_SYN, NULL, 0) < 0) {
+        c->state = USB_MUX_CONN_NONE;
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADDEV);
+    }
+
+    while (c->state == USB_MUX_CONN_CONNECTING && !c->closed) {
+        c->wait_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    if (c->state != USB_MUX_CONN_CONNECTED) {
+        c->state = USB_MUX_CONN_NONE;
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_CONNREFUSED);
+    }
+    return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_OK);
+}
+
+static bool coroutine_fn usb_mux_client_request(USBMuxClient *c, uint32_t tag,
+                                                GHashTable *req)
+{
+    USBMuxHostState *s = c->s;
+    const char *type = usb_mux_plist_value(req, "MessageType", "string");
+    const char *id;
+    const char *record_data;
+    g_autofree char *body = NULL;
+    g_autofree char *path = NULL;
+    g_autofree char *data = NULL;
+    g_autofree char *contents = NULL;
+    g_autofree guchar *record = NULL;
+    gsize len;
+
+    DPRINTF("%s: %s\n", __func__, type ? type : "(none)");
+
+    if (type == NULL) {
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADCOMMAND);
+    }
+
+    if (g_str_equal(type, "ListDevices")) {
+        g_autofree char *attached = NULL;
+
+        if (s->host.running) {
+            attached = usb_mux_host_attached_body(s);
+        }
+        body = g_strdup_printf("<key>DeviceList</key>\n<array>\n%s%s%s"
+                               "</array>\n",
+                               attached ? "<dict>\n" : "",
+                               attached ? attached : "",
+                               attached ? "</dict>\n" : "");
+        return usb_mux_client_send_plist(c, tag, body);
+    }
+
+    if (g_str_equal(type, "Listen")) {
+        c->listening = true;
+        if (!usb_mux_client_send_result(c, tag, USB_MUX_RESULT_OK)) {
+            return false;
+        }
+        if (s->host.running) {
+            body = usb_mux_host_attached_body(s);
+            return usb_mux_client_send_plist(c, 0, body);
+        }
+        return true;
+    }
+
+    if (g_str_equal(type, "ListListeners")) {
+        return usb_mux_client_send_plist(
+            c, tag, "<key>ListenerList</key>\n<array>\n</array>\n");
+    }
+
+    if (g_str_equal(type, "Connect")) {
+        return usb_mux_client_connect(c, tag, req);
+    }
+
+    if (g_str_equal(type, "ReadBUID")) {
+        body = g_strdup_printf("<key>BUID</key>\n<string>%s</string>\n",
+                               s->buid);
+        return usb_mux_client_send_plist(c, tag, body);
+    }
+
+    id = usb_mux_plist_value(req, "PairRecordID", "string");
+    path = usb_mux_host_record_path(s, id);
+
+    if (g_str_equal(type, "ReadPairRecord")) {
+        if (path == NULL || !g_file_get_contents(path, &contents, &len, NULL)) {
+            return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADDEV);
+        }
+        data = g_base64_encode((const guchar *)contents, len);
+        body = g_strdup_printf(
+            "<key>PairRecordData</key>\n<data>%s</data>\n", data);
+        return usb_mux_client_send_plist(c, tag, body);
+    }
+
+    if (g_str_equal(type, "SavePairRecord")) {
+        record_data = usb_mux_plist_value(req, "PairRecordData", "data");
+        if (path == NULL || record_data == NULL ||
+            g_mkdir_with_parents(s->records, 0700) < 0) {
+            return usb_mux_client_send_result(c, tag,
+                                              USB_MUX_RESULT_BADCOMMAND);
+        }
+        record = g_base64_decode(record_data, &len);
+        if (!g_file_set_contents(path, (const char *)record, len, NULL)) {
+            return usb_mux_client_send_result(c, tag,
+                                              USB_MUX_RESULT_BADCOMMAND);
+        }
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_OK);
+    }
+
+    if (g_str_equal(type, "DeletePairRecord")) {
+        if (path == NULL || (unlink(path) < 0 && errno != ENOENT)) {
+            return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADDEV);
+        }
+        return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_OK);
+    }
+
+    return usb_mux_client_send_result(c, tag, USB_MUX_RESULT_BADCOMMAND);
+}
+
+/* Forward what the client writes to its connection, within the window. */
+static void coroutine_fn usb_mux_client_pipe(USBMuxClient *c)
+{
+    USBMuxHostState *s = c->s;
+    g_autofree uint8_t *buf = g_malloc(USB_MUX_SEG_MAX);
+    ssize_t n;
+    ssize_t off;
+    int64_t window;
+
+    while (!c->closed && c->state == USB_MUX_CONN_CONNECTED) {
+        n = qio_channel_read(c->ioc, (char *)buf, USB_MUX_SEG_MAX, NULL);
+        if (n == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_yield(c->ioc, G_IO_IN);
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        for (off = 0; off < n;) {
+            window = (int64_t)c->rx_win - (int32_t)(c->tx_seq - c->rx_ack);
+            if (c->closed || c->state != USB_MUX_CONN_CONNECTED) {
+                break;
+            }
+            if (window <= 0) {
+                c->wait_co = qemu_coroutine_self();
+                qemu_coroutine_yield();
+                continue;
+            }
+            window = MIN(window, n - off);
+            if (usb_mux_conn_send(c, USB_MUX_TH_ACK, buf + off, window) < 0) {
+                break;
+            }
+            off += window;
+        }
+    }
+
+    if (c->state == USB_MUX_CONN_CONNECTED && c->generation == s->host.generation) {
+        usb_mux_conn_send(c, USB_MUX_TH_RST, NULL, 0);
+    }
+    c->state = USB_MUX_CONN_NONE;
+}
+
+static void coroutine_fn usb_mux_client_co(void *opaque)
+{
+    USBMuxClient *c = opaque;
+    uint8_t hdr[USB_MUX_CLIENT_HDR_SIZE];
+    uint32_t len;
+
+    while (!c->closed) {
+        g_autofree char *xml = NULL;
+        g_autoptr(GHashTable) req = NULL;
+
+        if (qio_channel_read_all(c->ioc, (char *)hdr, sizeof(hdr), NULL) < 0) {
+            break;
+        }
+        len = ldl_le_p(hdr);
+        if (len < sizeof(hdr) || len > USB_MUX_CLIENT_REQ_MAX) {
+            break;
+        }
+        xml = g_malloc(len - sizeof(hdr) + 1);
+        if (qio_channel_read_all(c->ioc, xml, len - sizeof(hdr), NULL) < 0) {
+            break;
+        }
+        xml[len - sizeof(hdr)] = '\0';
+
+        /* Only the plist protocol, libusbmuxd falls back to it. */
+        if (ldl_le_p(hdr + 4) != USB_MUX_CLIENT_VERSION_PLIST ||
+            ldl_le_p(hdr + 8) != USB_MUX_CLIENT_MSG_PLIST) {
+            if (!usb_mux_client_send_result(c, ldl_le_p(hdr + 12),
+                                            USB_MUX_RESULT_BADVERSION)) {
+                break;
+            }
+            continue;
+        }
+
+        req = usb_mux_plist_parse(xml, strlen(xml));
+        if (req == NULL) {
+            if (!usb_mux_client_send_result(c, ldl_le_p(hdr + 12),
+                                            USB_MUX_RESULT_BADCOMMAND)) {
+                break;
+            }
+            continue;
+        }
+
+        if (!usb_mux_client_request(c, ldl_le_p(hdr + 12), req)) {
+            break;
+        }
+        if (c->state == USB_MUX_CONN_CONNECTED) {
+            usb_mux_client_pipe(c);
+            break;
+        }
+    }
+
+    usb_mux_client_close(c);
+    usb_mux_client_unref(c);
+}
+
+static void usb_mux_host_accept(QIONetListener *listener,
+                                QIOChannelSocket *sioc, gpointer opaque)
+{
+    USBMuxHostState *s = USB_MUX_HOST(opaque);
+    USBMuxClient *c = g_new0(USBMuxClient, 1);
+
+    object_ref(OBJECT(sioc));
+    c->s = s;
+    c->sioc = sioc;
+    c->ioc = QIO_CHANNEL(sioc);
+    c->refcnt = 1;
+    qemu_co_mutex_init(&c->write_lock);
+    qio_channel_set_blocking(c->ioc, false, NULL);
+    QLIST_INSERT_HEAD(&s->clients, c, next);
+
+    qemu_coroutine_enter(qemu_coroutine_create(usb_mux_client_co, c));
+}
+
+/* The connections go down with the link. */
+static void usb_mux_host_stop(USBGadgetHost *h, bool was_running)
+{
+    USBMuxHostState *s = container_of(h, USBMuxHostState, host);
+    USBMuxClient *c, *next;
+
+    s->rx_len = 0;
+
+    QLIST_FOREACH_SAFE (c, &s->clients, next, next) {
+        if (c->state == USB_MUX_CONN_CONNECTING) {
+            c->state = USB_MUX_CONN_REFUSED;
+            usb_gadget_host_wake(&c->wait_co);
+        } else if (c->state == USB_MUX_CONN_CONNECTED) {
+            c->state = USB_MUX_CONN_NONE;
+            usb_mux_client_close(c);
+        }
+    }
+
+    if (was_running) {
+        usb_mux_host_notify(
+            s, g_strdup_printf("<key>DeviceID</key>\n<integer>%u</integer>\n"
+                               "<key>MessageType</key>\n"
+                               "<string>Detached</string>\n",
+                               s->device_id));
+    }
+}
+
+static const USBGadgetHostOps usb_mux_host_ops = {
+    .function = "usbmux",
+    .parse_config = usb_mux_host_parse_config,
+    .run = usb_mux_host_run,
+    .stop = usb_mux_host_stop,
+};
+
+static void usb_mux_host_realize(DeviceState *dev, Error **errp)
+{
+    USBMuxHostState *s = USB_MUX_HOST(dev);
+    SocketAddress addr = { .type = SOCKET_ADDRESS_TYPE_UNIX };
+
+    if (s->path == NULL) {
+        error_setg(errp, "path is required");
+        return;
+    }
+
+    s->listener = qio_net_listener_new();
+    qio_net_listener_set_name(s->listener, "usb-mux-host-listener");
+    addr.u.q_unix.path = s->path;
+    if (qio_net_listener_open_sync(s->listener, &addr, 1, errp) < 0) {
+        object_unref(OBJECT(s->listener));
+        s->listener = NULL;
+        return;
+    }
+    qio_net_listener_set_client_func(s->listener, usb_mux_host_accept, s,
+                                     NULL);
+
+    if (s->buid == NULL) {
+        g_autofree char *uuid = g_uuid_string_random();
+
+        s->buid = g_ascii_strup(uuid, -1);
+    }
+
+    usb_gadget_host_init(&s->host, dev, &usb_mux_host_ops);
+    qemu_co_mutex_init(&s->tx_lock);
+    QLIST_INIT(&s->clients);
+}
+
+static void usb_mux_host_unrealize(DeviceState *dev)
+{
+    USBMuxHostState *s = USB_MUX_HOST(dev);
+    USBMuxClient *c, *next;
+
+    usb_gadget_host_cleanup(&s->host);
+    QLIST_FOREACH_SAFE (c, &s->clients, next, next) {
+        usb_mux_client_close(c);
+    }
+
+    qio_net_listener_disconnect(s->listener);
+    object_unref(OBJECT(s->listener));
+    s->listener = NULL;
+    unlink(s->path);
+}
+
+static void usb_mux_host_reset(DeviceState *dev)
+{
+    USBMuxHostState *s = USB_MUX_HOST(dev);
+
+    usb_gadget_host_reset(&s->host);
+}
+
+static const VMStateDescription vmstate_usb_mux_host = {
+    .name = "usb-mux-host",
+    .unmigratable = 1,
+};
+
+static Property usb_mux_host_properties[] = {
+    DEFINE_PROP_STRING("path", USBMuxHostState, path),
+    DEFINE_PROP_STRING("records", USBMuxHostState, records),
+    DEFINE_PROP_STRING("buid", USBMuxHostState, buid),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void usb_mux_host_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = usb_mux_host_realize;
+    dc->unrealize = usb_mux_host_unrealize;
+    dc->reset = usb_mux_host_reset;
+    dc->desc = "USB usbmux host for a guest gadget";
+    dc->vmsd = &vmstate_usb_mux_host;
+    device_class_set_props(dc, usb_mux_host_properties);
+    set_bit(DEVICE_CATEGORY_USB, dc->categories);
+}
+
+static const TypeInfo usb_mux_host_info = {
+    .name = TYPE_USB_MUX_HOST,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(USBMuxHostState),
+    .class_init = usb_mux_host_class_init,
+};
+
+static void usb_mux_host_register_types(void)
+{
+    type_register_static(&usb_mux_host_info);
+}
+
+type_init(usb_mux_host_register_types)
@@ -0,0 +1,254 @@
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "tcp-usb.h"
+
+static size_t tcp_usb_put_varint(uint8_t *buf, uint64_t val)
+{
+    size_t n = 0;
+
+    do {
+        buf[n] = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            buf[n] |= 0x80;
+        }
+        n++;
+    } while (val);
+
+    return n;
+}
+
+static bool tcp_usb_get_varint(const uint8_t *buf, size_t len, size_t *pos,
+                               uint64_t *val)
+{
+    unsigned int shift = 0;
+
+    *val = 0;
+    while (*pos < len && shift < 64) {
+        uint8_t b = buf[(*pos)++];
+
+        *val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+
+    return false;
+}
+
+static bool tcp_usb_get_u8(const uint8_t *buf, size_t len, size_t *pos,
+                           uint8_t *val)
+{
+    if (*pos >= len) {
+        return false;
+    }
+    *val = buf[(*pos)++];
+    return true;
+}
+
+static inline uint64_t tcp_usb_zigzag(int32_t val)
+{
+    return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+static inline int32_t tcp_usb_unzigzag(uint64_t val)
+{
+    return (int32_t)((uint32_t)(val >> 1) ^ -(uint32_t)(val & 1));
+}
+
+/* The fields every v2 header starts with, `pid` always fits a byte. */
+static size_t tcp_usb_put_target(uint8_t *buf, uint8_t addr, int pid,
+                                 uint8_t ep)
+{
+    buf[0] = addr;
+    buf[1] = pid;
+    buf[2] = ep;
+    return 3;
+}
+
+/* A macro rather than a helper, `h` is a packed struct. */
+#define TCP_USB_GET_TARGET(buf, len, pos, h)                   \
+    ((len) - *(pos) >= 3 ? ((h)->addr = (buf)[*(pos)],         \
+                            (h)->pid = (buf)[*(pos) + 1],      \
+                            (h)->ep = (buf)[*(pos) + 2],       \
+                            *(pos) += 3, true)                 \
+                         : false)
+
+size_t tcp_usb_v1_header_size(uint8_t type)
+{
+    switch (type) {
+    case TCP_USB_REQUEST:
+        return sizeof(tcp_usb_request_header);
+    case TCP_USB_RESPONSE:
+        return sizeof(tcp_usb_response_header);
+    case TCP_USB_CANCEL:
+        return sizeof(tcp_usb_cancel_header);
+    default:
+        return 0;
+    }
+}
+
+size_t tcp_usb_encode_request(uint8_t *buf, const tcp_usb_request_header *h,
+                              uint8_t version)
+{
+    size_t n = 1;
+
+    if (version < TCP_USB_PROTO_V2) {
+        memcpy(buf, h, sizeof(*h));
+        return sizeof(*h);
+    }
+
+    n += tcp_usb_put_target(buf + n, h->addr, h->pid, h->ep);
+    buf[n++] = h->short_not_ok;
+    buf[n++] = h->int_req;
+    n += tcp_usb_put_varint(buf + n, h->stream);
+    n += tcp_usb_put_varint(buf + n, h->id);
+    n += tcp_usb_put_varint(buf + n, h->length);
+    buf[0] = n - 1;
+
+    return n;
+}
+
+bool tcp_usb_decode_request(const uint8_t *buf, size_t len,
+                            tcp_usb_request_header *h, uint8_t version)
+{
+    size_t pos = 0;
+    uint64_t stream, id, length;
+
+    if (version < TCP_USB_PROTO_V2) {
+        if (len < sizeof(*h)) {
+            return false;
+        }
+        memcpy(h, buf, sizeof(*h));
+        return true;
+    }
+
+    if (!TCP_USB_GET_TARGET(buf, len, &pos, h) ||
+        !tcp_usb_get_u8(buf, len, &pos, &h->short_not_ok) ||
+        !tcp_usb_get_u8(buf, len, &pos, &h->int_req) ||
+        !tcp_usb_get_varint(buf, len, &pos, &stream) ||
+        !tcp_usb_get_varint(buf, len, &pos, &id) ||
+        !tcp_usb_get_varint(buf, len, &pos, &length) ||
+        length > UINT16_MAX) {
+        return false;
+    }
+    h->stream = stream;
+    h->id = id;
+    h->length = length;
+
+    return true;
+}
+
+size_t tcp_usb_encode_response(uint8_t *buf, const tcp_usb_response_header *h,
+                               uint32_t clength, uint8_t version)
+{
+    size_t n = 1;
+
+    if (version < TCP_USB_PROTO_V2) {
+        assert(clength == 0);
+        memcpy(buf, h, sizeof(*h));
+        return sizeof(*h);
+    }
+
+    n += tcp_usb_put_target(buf + n, h->addr, h->pid, h->ep);
+    n += tcp_usb_put_varint(buf + n, h->id);
+    n += tcp_usb_put_varint(buf + n, tcp_usb_zigzag(h->status));
+    n += tcp_usb_put_varint(buf + n, h->length);
+    n += tcp_usb_put_varint(buf + n, clength);
+    buf[0] = n - 1;
+
+    return n;
+}
+
+bool tcp_usb_decode_response(const uint8_t *buf, size_t len,
+                             tcp_usb_response_header *h, uint32_t *clength,
+                             uint8_t version)
+{
+    size_t pos = 0;
+    uint64_t id, status, length, clen;
+
+    if (version < TCP_USB_PROTO_V2) {
+        if (len < sizeof(*h)) {
+            return false;
+        }
+        memcpy(h, buf, sizeof(*h));
+        *clength = 0;
+        return true;
+    }
+
+    if (!TCP_USB_GET_TARGET(buf, len, &pos, h) ||
+        !tcp_usb_get_varint(buf, len, &pos, &id) ||
+        !tcp_usb_get_varint(buf, len, &pos, &status) ||
+        !tcp_usb_get_varint(buf, len, &pos, &length) ||
+        !tcp_usb_get_varint(buf, len, &pos, &clen) ||
+        length > UINT16_MAX || clen > UINT32_MAX) {
+        return false;
+    }
+    h->id = id;
+    h->status = tcp_usb_unzigzag(status);
+    h->length = length;
+    *clength = clen;
+
+    return true;
+}
+
+size_t tcp_usb_encode_cancel(uint8_t *buf, const tcp_usb_cancel_header *h,
+                             uint8_t version)
+{
+    size_t n = 1;
+
+    if (version < TCP_USB_PROTO_V2) {
+        memcpy(buf, h, sizeof(*h));
+        return sizeof(*h);
+    }
+
+    n += tcp_usb_put_target(buf + n, h->addr, h->pid, h->ep);
+    n += tcp_usb_put_varint(buf + n, h->id);
+    buf[0] = n - 1;
+
+    return n;
+}
+
+bool tcp_usb_decode_cancel(const uint8_t *buf, size_t len,
+                           tcp_usb_cancel_header *h, uint8_t version)
+{
+    size_t pos = 0;
+    uint64_t id;
+
+    if (version < TCP_USB_PROTO_V2) {
+        if (len < sizeof(*h)) {
+            return false;
+        }
+        memcpy(h, buf, sizeof(*h));
+        return true;
+    }
+
+    if (!TCP_USB_GET_TARGET(buf, len, &pos, h) ||
+        !tcp_usb_get_varint(buf, len, &pos, &id)) {
+        return false;
+    }
+    h->id = id;
+
+    return true;
+}
+
+void tcp_usb_hello_init(tcp_usb_hello *hello, uint8_t version,
+                        uint8_t features)
+{
+    hello->magic = cpu_to_le32(TCP_USB_HELLO_MAGIC);
+    hello->version = version;
+    hello->features = features;
+}
+
+bool tcp_usb_hello_parse(const tcp_usb_hello *hello, uint8_t *version,
+                         uint8_t *features)
+{
+    if (le32_to_cpu(hello->magic) != TCP_USB_HELLO_MAGIC ||
+        hello->version < TCP_USB_PROTO_V1) {
+        return false;
+    }
+    *version = MIN(hello->version, TCP_USB_PROTO_VERSION);
+    *features = hello->features;
+    return true;
+}
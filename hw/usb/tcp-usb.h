@@ -3,20 +3,76 @@
 
 #include "qemu/osdep.h"
 #include "hw/usb.h"
+#include "qemu/units.h"
 
 static const char *socket_path = "/tmp/usbqemu";
 
+/*
+ * Large enough for a whole bulk transfer to be queued by one writev, so
+ * neither side blocks mid-message waiting for the peer to drain.
+ */
+#define TCP_USB_SOCKET_BUF_SIZE (4 * MiB)
+
+static inline void tcp_usb_set_socket_bufs(int fd)
+{
+    int size = TCP_USB_SOCKET_BUF_SIZE;
+
+    /* Best effort, the kernel may clamp or refuse this. */
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
 enum {
     TCP_USB_REQUEST  = (1 << 0),
     TCP_USB_RESPONSE = (1 << 1),
     TCP_USB_RESET    = (1 << 2),
-    TCP_USB_CANCEL   = (1 << 3)
+    TCP_USB_CANCEL   = (1 << 3),
+    TCP_USB_HELLO    = (1 << 4)
 };
 
+/*
+ * Wire formats, agreed on with a TCP_USB_HELLO exchange right after connect:
+ * the host offers its highest version and features, the remote answers with
+ * the highest version both support and the common features.
+ *
+ * v1: each header is the QEMU_PACKED struct below, in host byte order.
+ * v2: each header is a length byte followed by its fields, single bytes or
+ *     LEB128 varints (zigzag for the signed status), so it is byte order
+ *     independent and usually under half the size.
+ */
+#define TCP_USB_PROTO_V1 (1)
+#define TCP_USB_PROTO_V2 (2)
+#define TCP_USB_PROTO_VERSION TCP_USB_PROTO_V2
+
+#define TCP_USB_HELLO_MAGIC (0x42535554) /* "TUSB" */
+
+/* IN payloads in responses may be zstd frames, see tcp_usb_response. */
+#define TCP_USB_FEAT_ZSTD (1 << 0)
+
+/* Smaller IN payloads aren't worth compressing. */
+#define TCP_USB_COMPRESS_MIN (4 * KiB)
+
+/* Room for any encoded v2 header, length byte included. */
+#define TCP_USB_MAX_HDR_SIZE (64)
+
+/* Always little endian, whatever the version. */
+typedef struct QEMU_PACKED tcp_usb_hello {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t features;
+} tcp_usb_hello;
+
 typedef struct QEMU_PACKED tcp_usb_header {
     uint8_t type;
 } tcp_usb_header_t;
 
+/*
+ * Set in tcp_usb_request_header.int_req above the int_req bit itself: the
+ * remote doesn't wait for this request, so the host must hold it across NAKs
+ * instead of answering with USB_RET_NAK.
+ */
+#define TCP_USB_REQ_PIPELINED (1 << 1)
+
 typedef struct QEMU_PACKED tcp_usb_request_header {
     uint8_t addr;
     int pid;
@@ -45,4 +101,25 @@ typedef struct QEMU_PACKED tcp_usb_cancel_header {
 
 } tcp_usb_cancel_header;
 
+size_t tcp_usb_encode_request(uint8_t *buf, const tcp_usb_request_header *h,
+                              uint8_t version);
+bool tcp_usb_decode_request(const uint8_t *buf, size_t len,
+                            tcp_usb_request_header *h, uint8_t version);
+/* `clength` is the size of a compressed payload, or 0 for a plain one. */
+size_t tcp_usb_encode_response(uint8_t *buf, const tcp_usb_response_header *h,
+                               uint32_t clength, uint8_t version);
+bool tcp_usb_decode_response(const uint8_t *buf, size_t len,
+                             tcp_usb_response_header *h, uint32_t *clength,
+                             uint8_t version);
+size_t tcp_usb_encode_cancel(uint8_t *buf, const tcp_usb_cancel_header *h,
+                             uint8_t version);
+bool tcp_usb_decode_cancel(const uint8_t *buf, size_t len,
+                           tcp_usb_cancel_header *h, uint8_t version);
+/* Size of the v1 header for `type`, which has no length byte. */
+size_t tcp_usb_v1_header_size(uint8_t type);
+void tcp_usb_hello_init(tcp_usb_hello *hello, uint8_t version,
+                        uint8_t features);
+bool tcp_usb_hello_parse(const tcp_usb_hello *hello, uint8_t *version,
+                         uint8_t *features);
+
 #endif //HW_USB_TCP_USB_H
@@ -1,6 +1,9 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/core/cpu.h"
 #include "hw/irq.h"
+#include "hw/misc/apple-silicon/deadline.h"
+#include "hw/qdev-properties.h"
 #include "hw/watchdog/apple_wdt.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
@@ -27,12 +30,15 @@ OBJECT_DECLARE_SIMPLE_TYPE(AppleWDTState, APPLE_WDT)
 
 #define WDOG_CNTFRQ_HZ (24000000)
 
+/* How far an expiry is pushed out while every vCPU sits in WFI. */
+#define WDOG_IDLE_DEFER_NS (100 * SCALE_MS)
+
 struct AppleWDTState {
     SysBusDevice parent_obj;
     MemoryRegion iomems[2];
     qemu_irq irqs[2];
 
-    QEMUTimer *timer;
+    AppleDeadline deadline;
     uint64_t cnt_period_ns;
     uint64_t cntfrq_hz;
 #pragma pack(push, 1)
@@ -54,6 +60,7 @@ struct AppleWDTState {
 #pragma pack(pop)
 
     uint32_t scratch;
+    bool suspend_on_idle;
 };
 
 static unsigned int wdog_cntfrq_period_ns(AppleWDTState *s)
@@ -90,10 +97,45 @@ static inline uint32_t wdt_get_sys_timer(AppleWDTState *s)
     return wdt_get_clock(s) - s->reg.sys_timer;
 }
 
-static void wdt_update(void *opaque)
+static bool wdt_all_cpus_idle(void)
 {
-    AppleWDTState *s = APPLE_WDT(opaque);
-    uint64_t expiry = 0xffffffff;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (!cpu->halted) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool wdt_due(AppleWDTState *s)
+{
+    uint32_t chip_tmr = wdt_get_chip_timer(s);
+    uint32_t sys_tmr = wdt_get_sys_timer(s);
+
+    return ((s->reg.chip_control & WDOG_CTL_EN_RESET) &&
+            chip_tmr >= s->reg.chip_reset_counter) ||
+           ((s->reg.sys_control & WDOG_CTL_EN_RESET) &&
+            sys_tmr >= s->reg.sys_reset_counter) ||
+           ((s->reg.chip_control & WDOG_CTL_EN_IRQ) &&
+            !(s->reg.chip_control & WDOG_CTL_ACK_IRQ) &&
+            chip_tmr >= s->reg.chip_interrupt_counter);
+}
+
+/*
+ * Pets only ever move the deadline out, so a later deadline is left for the
+ * armed one to pick up when it fires; only an earlier one re-arms it.
+ */
+static void wdt_arm(AppleWDTState *s, int64_t deadline)
+{
+    apple_deadline_mod_anticipate(&s->deadline, deadline);
+}
+
+static void wdt_update(AppleWDTState *s)
+{
+    uint64_t expiry = UINT64_MAX;
     uint32_t chip_tmr = wdt_get_chip_timer(s);
     uint32_t sys_tmr = wdt_get_sys_timer(s);
 
@@ -132,8 +174,35 @@ static void wdt_update(void *opaque)
             expiry = MIN(expiry, d);
         }
     }
+
+    if (expiry == UINT64_MAX) {
+        apple_deadline_del(&s->deadline);
+        return;
+    }
+
     expiry *= s->cnt_period_ns;
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + expiry);
+    wdt_arm(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + expiry);
+}
+
+static void wdt_timer_expired(void *opaque)
+{
+    AppleWDTState *s = APPLE_WDT(opaque);
+
+    trace_apple_wdt_timer_expired();
+
+    /*
+     * In suspend-on-idle mode watchdog time does not run out while the guest
+     * is idle: push the counters back so the guest gets to pet it once a
+     * vCPU wakes up.
+     */
+    if (s->suspend_on_idle && wdt_due(s) && wdt_all_cpus_idle()) {
+        uint32_t defer = WDOG_IDLE_DEFER_NS / s->cnt_period_ns;
+
+        s->reg.chip_timer += defer;
+        s->reg.sys_timer += defer;
+    }
+
+    wdt_update(s);
 }
 
 static void wdt_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -177,7 +246,7 @@ static void wdt_reg_write(void *opaque, hwaddr addr, uint64_t data,
     }
 
     trace_apple_wdt_write(addr, data, old, val);
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    wdt_update(s);
 }
 
 static uint64_t wdt_reg_read(void *opaque, hwaddr addr, unsigned size)
@@ -215,6 +284,9 @@ static void apple_wdt_reset(DeviceState *dev)
 {
     AppleWDTState *s = APPLE_WDT(dev);
     memset(s->reg.raw, 0, REG_SIZE);
+    if (s->deadline.sched) {
+        apple_deadline_del(&s->deadline);
+    }
 }
 
 static const MemoryRegionOps wdt_reg_ops = {
@@ -233,7 +305,8 @@ static void apple_wdt_realize(DeviceState *dev, Error **errp)
     AppleWDTState *s = APPLE_WDT(dev);
     s->cntfrq_hz = WDOG_CNTFRQ_HZ;
     s->cnt_period_ns = wdog_cntfrq_period_ns(s);
-    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, wdt_update, s);
+    /* Nobody needs a watchdog to bite to the microsecond */
+    apple_deadline_init(&s->deadline, wdt_timer_expired, s, SCALE_MS);
     apple_wdt_reset(dev);
 }
 
@@ -241,8 +314,7 @@ static void apple_wdt_unrealize(DeviceState *dev)
 {
     AppleWDTState *s = APPLE_WDT(dev);
 
-    timer_free(s->timer);
-    s->timer = NULL;
+    apple_deadline_destroy(&s->deadline);
 }
 
 SysBusDevice *apple_wdt_create(DTBNode *node)
@@ -291,17 +363,21 @@ static const VMStateDescription vmstate_apple_wdt = {
     .name = "apple_wdt",
     .fields =
         (VMStateField[]){
-            VMSTATE_TIMER_PTR(timer, AppleWDTState),
+            VMSTATE_APPLE_DEADLINE(deadline, AppleWDTState),
             VMSTATE_UINT64(cnt_period_ns, AppleWDTState),
             VMSTATE_UINT64(cntfrq_hz, AppleWDTState),
             VMSTATE_UINT32_ARRAY(reg.raw, AppleWDTState,
                                  REG_SIZE / sizeof(uint32_t)),
             VMSTATE_UINT32(scratch, AppleWDTState),
-            VMSTATE_TIMER_PTR(timer, AppleWDTState),
             VMSTATE_END_OF_LIST(),
         }
 };
 
+static Property apple_wdt_properties[] = {
+    DEFINE_PROP_BOOL("suspend-on-idle", AppleWDTState, suspend_on_idle, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_wdt_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -311,6 +387,7 @@ static void apple_wdt_class_init(ObjectClass *klass, void *data)
     dc->reset = apple_wdt_reset;
     dc->desc = "Apple Watch Dog Timer";
     dc->vmsd = &vmstate_apple_wdt;
+    device_class_set_props(dc, apple_wdt_properties);
     set_bit(DEVICE_CATEGORY_WATCHDOG, dc->categories);
 }
 
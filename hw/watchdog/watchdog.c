@@ -31,6 +31,7 @@
 #include "hw/nmi.h"
 #include "qemu/help_option.h"
 #include "trace.h"
+#include "trace/flight.h"
 
 static WatchdogAction watchdog_action = WATCHDOG_ACTION_RESET;
 
@@ -45,6 +46,7 @@ WatchdogAction get_watchdog_action(void)
 void watchdog_perform_action(void)
 {
     trace_watchdog_perform_action(watchdog_action);
+    flight_dump("watchdog expired");
 
     switch (watchdog_action) {
     case WATCHDOG_ACTION_RESET:     /* same as 'system_reset' in monitor */
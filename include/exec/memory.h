@@ -28,6 +28,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
 
@@ -829,6 +830,9 @@ struct MemoryRegion {
 
     /* For devices designed to perform re-entrant IO into their own IO MRs */
     bool disable_reentrancy_guard;
+
+    /* Accesses dispatched to @ops, see memory_region_get_accesses() */
+    Stat64 accesses;
 };
 
 struct IOMMUMemoryRegion {
@@ -2583,6 +2587,30 @@ bool memory_region_access_valid(MemoryRegion *mr, hwaddr addr,
                                 unsigned size, bool is_write,
                                 MemTxAttrs attrs);
 
+/**
+ * memory_region_get_accesses: return the number of accesses dispatched to
+ *                             the callbacks of an I/O region
+ *
+ * Once memory_region_enable_access_counting() has been called, every read
+ * or write that reaches memory_region_dispatch_read() or
+ * memory_region_dispatch_write() counts once, after alias resolution and
+ * whether or not the device accepts it. Counts are never reset.
+ *
+ * @mr: the #MemoryRegion
+ */
+uint64_t memory_region_get_accesses(MemoryRegion *mr);
+
+extern bool memory_region_count_accesses;
+
+/**
+ * memory_region_enable_access_counting: start counting the accesses
+ *                                       dispatched to every I/O region
+ *
+ * Off by default, so the dispatch fast path stays free of the shared
+ * counter updates. There is no way back: counts are cumulative.
+ */
+void memory_region_enable_access_counting(void);
+
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
  * MemoryRegion.
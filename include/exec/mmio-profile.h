@@ -0,0 +1,42 @@
+/*
+ * Per-register MMIO access profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_MMIO_PROFILE_H
+#define EXEC_MMIO_PROFILE_H
+
+#include "exec/hwaddr.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+
+extern bool mmio_profile_enabled;
+
+void mmio_profile_enable(void);
+void mmio_profile_disable(void);
+void mmio_profile_reset(void);
+
+/*
+ * Account one dispatched access to @mr at @addr that began at host time
+ * @start. Only called while profiling is enabled.
+ */
+void mmio_profile_record(MemoryRegion *mr, hwaddr addr, bool is_write,
+                         int64_t start);
+
+/* Returns the start timestamp of an access, or 0 when not profiling. */
+static inline int64_t mmio_profile_begin(void)
+{
+    return unlikely(qatomic_read(&mmio_profile_enabled)) ? get_clock() : 0;
+}
+
+static inline void mmio_profile_end(MemoryRegion *mr, hwaddr addr,
+                                    bool is_write, int64_t start)
+{
+    if (unlikely(start)) {
+        mmio_profile_record(mr, addr, is_write, start);
+    }
+}
+
+#endif /* EXEC_MMIO_PROFILE_H */
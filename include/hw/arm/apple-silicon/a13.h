@@ -52,6 +52,7 @@ typedef struct AppleA13Class {
     DeviceRealize parent_realize;
     DeviceUnrealize parent_unrealize;
     DeviceReset parent_reset;
+    bool (*parent_has_work)(CPUState *cpu);
 } AppleA13Class;
 
 typedef struct AppleA13State {
@@ -66,10 +67,14 @@ typedef struct AppleA13State {
     uint32_t cpu_id;
     uint32_t phys_id;
     uint32_t cluster_id;
+    /* 'P' for Lightning, 'E' for Thunder. */
+    uint8_t cluster_type;
     uint64_t mpidr;
-    uint64_t ipi_sr;
+    uint32_t ipi_sr;
     hwaddr cluster_reg[2];
     qemu_irq fast_ipi;
+    /* Powered off and not run since the last reset. */
+    bool reset_clean;
     A13_CPREG_VAR_DEF(ARM64_REG_EHID3);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID4);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID10);
@@ -89,14 +94,8 @@ typedef struct AppleA13State {
     A13_CPREG_VAR_DEF(IMP_BARRIER_LBSY_BST_SYNC_W0_EL0);
     A13_CPREG_VAR_DEF(IMP_BARRIER_LBSY_BST_SYNC_W1_EL0);
     A13_CPREG_VAR_DEF(ARM64_REG_3_3_15_7);
-    A13_CPREG_VAR_DEF(PMC0);
-    A13_CPREG_VAR_DEF(PMC1);
-    A13_CPREG_VAR_DEF(PMCR0);
-    A13_CPREG_VAR_DEF(PMCR1);
-    A13_CPREG_VAR_DEF(PMSR);
     A13_CPREG_VAR_DEF(S3_4_c15_c0_5);
     A13_CPREG_VAR_DEF(AMX_STATUS_EL1);
-    A13_CPREG_VAR_DEF(AMX_CTL_EL1);
     A13_CPREG_VAR_DEF(ARM64_REG_CYC_OVRD);
     A13_CPREG_VAR_DEF(ARM64_REG_ACC_CFG);
     A13_CPREG_VAR_DEF(S3_5_c15_c10_1);
@@ -113,8 +112,14 @@ typedef struct AppleA13Cluster {
     uint32_t cluster_type;
     MemoryRegion mr;
     AppleA13State *cpus[A13_MAX_CPU];
-    uint32_t deferredIPI[A13_MAX_CPU][A13_MAX_CPU];
-    uint32_t noWakeIPI[A13_MAX_CPU][A13_MAX_CPU];
+    /* Indexed by target CPU, one bit per source CPU. */
+    uint32_t deferredIPI[A13_MAX_CPU];
+    uint32_t noWakeIPI[A13_MAX_CPU];
+    /* When the oldest deferred IPI to each target becomes due. */
+    int64_t deferred_deadline[A13_MAX_CPU];
+    /* Version 1 migration layout: [source][target], one word per IPI. */
+    uint32_t v1_deferredIPI[A13_MAX_CPU * A13_MAX_CPU];
+    uint32_t v1_noWakeIPI[A13_MAX_CPU * A13_MAX_CPU];
     uint64_t tick;
     uint64_t ipi_cr;
     QTAILQ_ENTRY(AppleA13Cluster) next;
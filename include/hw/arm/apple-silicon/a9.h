@@ -52,6 +52,8 @@ typedef struct AppleA9State {
     uint32_t cpu_id;
     uint32_t phys_id;
     uint64_t mpidr;
+    /* Powered off and not run since the last reset. */
+    bool reset_clean;
     A9_CPREG_VAR_DEF(HID11);
     A9_CPREG_VAR_DEF(HID3);
     A9_CPREG_VAR_DEF(HID4);
@@ -90,5 +92,6 @@ AppleA9State *apple_a9_create(DTBNode *node, char *name, uint32_t cpu_id,
 bool apple_a9_cpu_is_sleep(AppleA9State *tcpu);
 bool apple_a9_cpu_is_powered_off(AppleA9State *tcpu);
 void apple_a9_cpu_start(AppleA9State *tcpu);
+void apple_a9_cpu_off(AppleA9State *tcpu);
 
 #endif /* HW_ARM_APPLE_SILICON_A9_H */
@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "exec/hwaddr.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "sysemu/dump.h"
 
 #define BOOT_ARGS_REVISION_2 (2)
 #define BOOT_ARGS_VERSION_2 (2)
@@ -30,6 +31,7 @@
 #define LC_UNIXTHREAD (0x5)
 #define LC_DYSYMTAB (0xB)
 #define LC_SEGMENT_64 (0x19)
+#define LC_UUID (0x1B)
 #define LC_SOURCE_VERSION (0x2A)
 #define LC_BUILD_VERSION (0x32)
 #define LC_REQ_DYLD (0x80000000)
@@ -82,6 +84,9 @@ typedef struct {
     uint32_t flags;
 } MachoSegmentCommand64;
 
+#define VM_PROT_WRITE (0x2)
+#define VM_PROT_EXECUTE (0x4)
+
 typedef struct {
     char sect_name[16];
     char seg_name[16];
@@ -166,6 +171,7 @@ typedef struct {
 #define N_STAB (0xE0)
 #define N_PEXT (0x10)
 #define N_TYPE (0x0E)
+#define N_SECT (0x0E)
 #define N_EXT (0x01)
 
 typedef struct {
@@ -281,8 +287,18 @@ typedef struct {
     char *ticket_data;
     uint64_t ticket_length;
     uint8_t boot_nonce_hash[XNU_BNCH_SIZE];
+    bool device_tree_filtered;
+    hwaddr shmcon_addr;
+    uint64_t shmcon_size;
+    hwaddr shmcon_doorbell_addr;
+    uint64_t shmcon_doorbell_size;
+    hwaddr fpr_addr;
+    uint64_t fpr_size;
+    uint32_t hypercall_version;
 } AppleBootInfo;
 
+void macho_set_payload_cache_dir(const char *dir);
+
 MachoHeader64 *macho_load_file(const char *filename,
                                MachoHeader64 **secure_monitor);
 
@@ -301,7 +317,11 @@ const char *macho_platform_string(MachoHeader64 *mh);
 void macho_highest_lowest(MachoHeader64 *mh, uint64_t *lowaddr,
                           uint64_t *highaddr);
 
-void macho_text_base(MachoHeader64 *mh, uint64_t *text_base);
+/*
+ * The address of the segment mapping the start of the file. Returns false,
+ * with 0 in `text_base`, when there is none.
+ */
+bool macho_text_base(MachoHeader64 *mh, uint64_t *text_base);
 
 MachoFilesetEntryCommand *macho_get_fileset(MachoHeader64 *header,
                                             const char *entry);
@@ -314,6 +334,34 @@ MachoSegmentCommand64 *macho_get_segment(MachoHeader64 *header,
 
 MachoSection64 *macho_get_section(MachoSegmentCommand64 *seg, const char *name);
 
+/*
+ * The per-entry loops of sliding a non-fileset kernelcache: every symbol
+ * but the debugger entries, and the pointer each local relocation points
+ * at from `text`. Inline so tests/bench can time them without the loader.
+ */
+static inline void macho_slide_symbols(MachoNList64 *sym, uint32_t nsyms,
+                                       uint64_t slide)
+{
+    MachoNList64 *sym_end = sym + nsyms;
+
+    for (; sym < sym_end; sym++) {
+        if (!(sym->n_type & N_STAB)) {
+            sym->n_value += slide;
+        }
+    }
+}
+
+static inline void macho_slide_local_relocs(uint8_t *text, const int32_t *rel,
+                                            uint32_t nrel, uint64_t slide)
+{
+    /* relocation_info is { int32_t r_address; uint32_t r_info; }. */
+    const int32_t *rel_end = rel + nrel * 2;
+
+    for (; rel < rel_end; rel += 2) {
+        *(uint64_t *)(text + *rel) += slide;
+    }
+}
+
 uint64_t xnu_slide_hdr_va(MachoHeader64 *header, uint64_t hdr_va);
 
 void *xnu_va_to_ptr(uint64_t va);
@@ -335,6 +383,14 @@ void macho_setup_bootargs(const char *name, AddressSpace *as, MemoryRegion *mem,
 
 void macho_allocate_segment_records(DTBNode *memory_map, MachoHeader64 *mh);
 
+/*
+ * Describes the `memory_map` regions, but the ramdisk, for the xnu-macho
+ * dump formats, at the addresses the guest's boot arguments map them.
+ */
+bool macho_dump_info(XnuDumpInfo *info, DTBNode *memory_map,
+                     MachoHeader64 *kernel, hwaddr boot_args_pa,
+                     Error **errp);
+
 hwaddr arm_load_macho(MachoHeader64 *mh, AddressSpace *as, MemoryRegion *mem,
                       DTBNode *memory_map, hwaddr phys_base, hwaddr virt_slide);
 
@@ -356,4 +412,23 @@ void macho_load_trustcache(void *trustcache, uint64_t size, AddressSpace *as,
 void macho_load_ramdisk(const char *filename, AddressSpace *as,
                         MemoryRegion *mem, hwaddr pa, uint64_t *size);
 
+/*
+ * Boot profiling. Phases are timed in host wall-clock time and may nest,
+ * so the reported times are inclusive. Milestones are recorded once, at
+ * the first time they are reached, relative to when profiling started.
+ * Every phase and milestone is also a trace event, whether the summary is
+ * enabled or not; the summary is logged when QEMU exits.
+ *
+ * Independently of profiling, each milestone is emitted once per boot as
+ * an APPLE_BOOT_MILESTONE QMP event; apple_boot_milestones_reset() starts
+ * a new boot.
+ */
+void apple_boot_profile_enable(void);
+void apple_boot_phase_begin(const char *name);
+void apple_boot_phase_end(const char *name);
+void apple_boot_milestone(const char *name);
+void apple_boot_milestones_reset(void);
+/* Matches a line of guest console output against known guest milestones. */
+void apple_boot_console_line(void *opaque, const char *line);
+
 #endif /* HW_ARM_APPLE_SILICON_BOOT_H */
@@ -0,0 +1,39 @@
+/*
+ * Apple CPU core power control, shared by the A9 and A13.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_ARM_APPLE_SILICON_CORE_H
+#define HW_ARM_APPLE_SILICON_CORE_H
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+
+/*
+ * Each core model keeps a `reset_clean` flag: powered off and not run
+ * since its last reset. apple_core_reset() sets it from the power state,
+ * and apple_core_start() then skips the redundant second reset.
+ */
+bool apple_core_is_sleep(ARMCPU *cpu);
+bool apple_core_is_powered_off(ARMCPU *cpu);
+void apple_core_reset(ARMCPU *cpu, bool *reset_clean);
+void apple_core_start(ARMCPU *cpu, bool *reset_clean);
+void apple_core_off(ARMCPU *cpu);
+/* Before the parent realize: the features both core models share. */
+void apple_core_init_features(ARMCPU *cpu);
+/* From the core's vmstate post_load. */
+void apple_core_post_load(bool *reset_clean);
+
+#endif /* HW_ARM_APPLE_SILICON_CORE_H */
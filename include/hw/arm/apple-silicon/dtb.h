@@ -36,17 +36,39 @@ typedef struct {
     uint8_t name[DTB_PROP_NAME_LEN];
     uint32_t length;
     uint32_t flags;
+    // Writable in place. Points into the blob the tree was loaded from until
+    // the property is set, unless its length is a multiple of 8: those are
+    // always 8-aligned, so they can be read as uint64_t.
     uint8_t *value;
+    bool borrowed;
 } DTBProp;
 
-typedef struct {
+typedef struct DTBNode DTBNode;
+
+struct DTBNode {
     uint32_t prop_count;
     uint32_t child_node_count;
     GList *props;
     GList *child_nodes;
-} DTBNode;
+    DTBNode *parent;
+    // Serialized size of this node and its subtree, kept up to date on every
+    // change so save_dtb callers never have to walk the tree to size it.
+    uint64_t size;
+    // Name -> DTBProp *, first property with a given name wins.
+    GHashTable *prop_index;
+    // Name -> DTBNode *, last child with a given name wins.
+    GHashTable *child_index;
+    // Where this subtree lies in the loaded blob while it is unchanged, so
+    // save_dtb can copy it out whole. NULL once anything in it is changed,
+    // or if any of its values had to be copied out of the blob.
+    const uint8_t *src;
+    uint64_t src_len;
+    // The root's copy of the loaded blob.
+    uint8_t *blob;
+};
 
 DTBNode *load_dtb(uint8_t *dtb_blob);
+void destroy_dtb(DTBNode *root);
 void save_dtb(uint8_t *buf, DTBNode *root);
 bool remove_dtb_node_by_name(DTBNode *parent, const char *name);
 void remove_dtb_node(DTBNode *node, DTBNode *child);
@@ -0,0 +1,55 @@
+#ifndef HW_ARM_APPLE_SILICON_HYPERCALL_H
+#define HW_ARM_APPLE_SILICON_HYPERCALL_H
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+
+/*
+ * Paravirtual hypercalls for XNU guests on CPUs without EL2.
+ *
+ * The guest issues "HVC #APPLE_HYPERCALL_IMM" from EL1 with the service
+ * in bits [31:16] of x0, the function in bits [15:0] and the arguments in
+ * x1-x6. x0 returns an APPLE_HYPERCALL_* status, x1-x3 the results of the
+ * function; the other registers are left alone. Execution resumes after
+ * the HVC. HVC with any other immediate UNDEFs as before.
+ *
+ * Service 0 is always there:
+ *  - function 0 returns the interface version in x1 and the number of
+ *    registered services in x2.
+ *  - function 1 returns the version of the service in x1, or
+ *    APPLE_HYPERCALL_NOT_SUPPORTED if it is not registered.
+ *
+ * The machine advertises the interface in the device tree as
+ * /chosen/hypercall, with "compatible" "hypercall,qemu", the "immediate"
+ * and the interface "version".
+ */
+
+#define APPLE_HYPERCALL_IMM (0x5150)
+#define APPLE_HYPERCALL_VERSION (1)
+
+#define APPLE_HYPERCALL_SUCCESS (0)
+#define APPLE_HYPERCALL_NOT_SUPPORTED (-1)
+#define APPLE_HYPERCALL_INVALID_PARAMETERS (-2)
+
+#define APPLE_HYPERCALL_SERVICE_BASE (0)
+#define APPLE_HYPERCALL_BASE_VERSION (0)
+#define APPLE_HYPERCALL_BASE_PROBE (1)
+
+/*
+ * Handles @func of a service. @args holds x1-x6, @res x1-x3, zeroed
+ * beforehand. Called on the vCPU thread with the BQL held; returns an
+ * APPLE_HYPERCALL_* status.
+ */
+typedef int64_t AppleHypercallFn(ARMCPU *cpu, uint16_t func,
+                                 const uint64_t *args, uint64_t *res,
+                                 void *opaque);
+
+/* Registers @service, which must not be 0 nor registered already. */
+void apple_hypercall_register(uint16_t service, const char *name,
+                              uint32_t version, AppleHypercallFn *fn,
+                              void *opaque);
+
+/* Routes the hypercalls of @cpu to the registered services. */
+void apple_hypercall_attach(ARMCPU *cpu);
+
+#endif /* HW_ARM_APPLE_SILICON_HYPERCALL_H */
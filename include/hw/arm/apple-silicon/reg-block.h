@@ -0,0 +1,77 @@
+#ifndef HW_ARM_APPLE_SILICON_REG_BLOCK_H
+#define HW_ARM_APPLE_SILICON_REG_BLOCK_H
+
+#include "qemu/osdep.h"
+#include "exec/hwaddr.h"
+#include "exec/memory.h"
+
+/*
+ * RAM-backed MMIO register blocks, as used for the SoCs' PMGR and AMCC.
+ *
+ * The block is a ROM device: guest reads are served straight from the
+ * backing RAM, so polling loops never exit to C. Guest writes go through
+ * the matching descriptor's `write` hook first, if any, and then land in
+ * the backing RAM unless the register is `ro`.
+ */
+
+/*
+ * PMGR power-state registers: the guest writes the target state and spins
+ * until the actual state follows. Modelled domains transition instantly.
+ */
+#define PMGR_PS_TARGET_MASK (0xF)
+#define PMGR_PS_ACTUAL_SHIFT (4)
+#define PMGR_PS_STATE(_target) \
+    (((_target) & PMGR_PS_TARGET_MASK) << PMGR_PS_ACTUAL_SHIFT | \
+     ((_target) & PMGR_PS_TARGET_MASK))
+
+/*
+ * Register descriptor, seeded with `reset`. `write` gets the block's opaque
+ * and may rewrite the value about to be stored.
+ */
+typedef struct {
+    hwaddr offset;
+    hwaddr size;
+    uint32_t reset;
+    bool ro;
+    void (*write)(void *opaque, hwaddr addr, uint32_t *value);
+} AppleRegDesc;
+
+typedef struct {
+    void *opaque;
+    MemoryRegion mr;
+    uint8_t *ram;
+    hwaddr base;
+    hwaddr size;
+    /* Descriptors repeat every `stride` bytes when non-zero. */
+    hwaddr stride;
+    const AppleRegDesc *regs;
+    size_t nregs;
+    /* Drop writes to registers without a descriptor. */
+    bool wi;
+    uint32_t (*seed)(hwaddr addr);
+} AppleRegBlock;
+
+/* Earlier entries of `regs` take precedence over the ranges that cover them. */
+AppleRegBlock *apple_reg_block_create(Object *owner, const char *name,
+                                      hwaddr base, hwaddr size,
+                                      const AppleRegDesc *regs, size_t nregs);
+
+/*
+ * Creates a read-only block from the entries of `regs` that fall in it,
+ * given at absolute offsets. Everything else reads as `seed`, or 0.
+ * Writes are dropped: making them stick could hang the guest on bits it
+ * expects to self-clear.
+ */
+AppleRegBlock *apple_reg_block_create_ro(Object *owner, const char *name,
+                                         hwaddr base, hwaddr size,
+                                         const AppleRegDesc *regs,
+                                         size_t nregs,
+                                         uint32_t (*seed)(hwaddr addr));
+
+/* Reseeds the backing RAM. */
+void apple_reg_block_reset(AppleRegBlock *blk);
+
+/* Write hook completing a PMGR power-state transition at once. */
+void apple_pmgr_ps_write(void *opaque, hwaddr addr, uint32_t *value);
+
+#endif /* HW_ARM_APPLE_SILICON_REG_BLOCK_H */
@@ -25,6 +25,7 @@
 #include "exec/hwaddr.h"
 #include "hw/arm/apple-silicon/a9.h"
 #include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/reg-block.h"
 #include "hw/boards.h"
 #include "hw/cpu/cluster.h"
 #include "hw/sysbus.h"
@@ -69,13 +70,14 @@ typedef struct {
     char *ticket_filename;
     char *seprom_filename;
     char *sep_fw_filename;
+    char *kernel_patches_filename;
     BootMode boot_mode;
     uint32_t build_version;
     uint64_t ecid;
     Notifier init_done_notifier;
     hwaddr panic_base;
     hwaddr panic_size;
-    char pmgr_reg[0x100000];
+    AppleRegBlock *pmgr;
     bool kaslr_off;
     bool force_dfu;
 } S8000MachineState;
@@ -23,7 +23,10 @@
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
+#include "hw/misc/apple-silicon/worker.h"
 #include "hw/sysbus.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/typedefs.h"
 #include "qom/object.h"
 
@@ -35,6 +38,7 @@ struct AppleSEPSimClass {
     SysBusDeviceClass base_class;
 
     DeviceRealize parent_realize;
+    DeviceUnrealize parent_unrealize;
     DeviceReset parent_reset;
 };
 
@@ -54,6 +58,19 @@ typedef struct {
     uint32_t out_size;
 } AppleSEPSimOOLState;
 
+typedef struct AppleSEPSimKeystoreJob AppleSEPSimKeystoreJob;
+
+/*
+ * What the keystore has set up for the data volume. It survives resets,
+ * migrates, and with a keystore file is kept across runs for as long as
+ * the ECID and the NAND image stay the same.
+ */
+typedef struct {
+    uint32_t keybag_handle;
+    uint32_t lock_state;
+    uint64_t device_state;
+} AppleSEPSimKeystoreState;
+
 struct AppleSEPSimState {
     /*< private >*/
     AppleA7IOP parent_obj;
@@ -65,6 +82,16 @@ struct AppleSEPSimState {
     uint32_t status;
     AppleSEPSimOOLInfo ool_info[SEP_ENDPOINT_MAX];
     AppleSEPSimOOLState ool_state[SEP_ENDPOINT_MAX];
+    AppleWorker keystore_worker;
+    QemuMutex keystore_lock;
+    QTAILQ_HEAD(, AppleSEPSimKeystoreJob) keystore_queue;
+    QTAILQ_HEAD(, AppleSEPSimKeystoreJob) keystore_done;
+    QEMUBH *keystore_bh;
+    uint32_t keystore_generation;
+    AppleSEPSimKeystoreState keystore;
+    uint8_t keystore_nand_id[32];
+    char *keystore_path;
+    uint64_t ecid;
 };
 
 AppleSEPSimState *apple_sep_sim_create(DTBNode *node, bool modern);
@@ -31,10 +31,15 @@
 #define TYPE_APPLE_SEP "apple-sep"
 OBJECT_DECLARE_TYPE(AppleSEPState, AppleSEPClass, APPLE_SEP)
 
+#define TRNG_POOL_SIZE (4096)
+
 typedef struct {
     uint8_t key[32];
     uint64_t ecid;
     uint32_t config;
+    /* Entropy drawn ahead of the FIFO reads, pool_pos == size when empty. */
+    uint8_t pool[TRNG_POOL_SIZE];
+    size_t pool_pos;
 } AppleTRNGState;
 
 #define REG_SIZE (0x10000)
@@ -66,6 +71,14 @@ struct AppleSEPState {
     uint8_t misc0_regs[REG_SIZE];
     uint8_t misc1_regs[REG_SIZE];
     uint8_t misc2_regs[REG_SIZE];
+    /* Share of host time the SEP core is held off, 0 to 99 percent. */
+    uint8_t throttle_pct;
+    /* Time slice the throttle applies to. */
+    uint32_t quantum_us;
+    /* Park the SEP core for whole slices while its inbox is empty. */
+    bool idle_halt;
+    QEMUTimer *throttle_timer;
+    bool throttle_scheduled;
 };
 
 AppleSEPState *apple_sep_create(DTBNode *node, MemoryRegion *ool_mr, vaddr base,
@@ -0,0 +1,24 @@
+#ifndef HW_ARM_APPLE_SILICON_STATS_H
+#define HW_ARM_APPLE_SILICON_STATS_H
+
+#include "qemu/osdep.h"
+#include "qapi/qapi-types-stats.h"
+
+/*
+ * Registers the machine-wide query-stats providers of the Apple silicon
+ * machines: 'apple-cpu' (vCPU time per exception and guarded level,
+ * sampled while the VM runs) and 'apple-mmio' (MMIO accesses per device).
+ * MMIO accesses are only counted from the first 'apple-mmio' query on.
+ *
+ * Must be called once, after the vCPUs have been created.
+ */
+void apple_stats_init(void);
+
+/*
+ * Prepends a scalar named `name` to `list`, for the query-stats callbacks.
+ * Returns the new entry, for providers that report something else.
+ */
+Stats *apple_stats_prepend(StatsList **list, const char *name,
+                           uint64_t value);
+
+#endif /* HW_ARM_APPLE_SILICON_STATS_H */
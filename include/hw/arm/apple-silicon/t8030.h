@@ -25,6 +25,7 @@
 #include "exec/hwaddr.h"
 #include "hw/arm/apple-silicon/a13.h"
 #include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/reg-block.h"
 #include "hw/boards.h"
 #include "hw/sysbus.h"
 #include "sysemu/kvm.h"
@@ -47,6 +48,13 @@ typedef enum {
     kBootModeExitRecovery,
 } BootMode;
 
+/* CPU time accounting of one vCPU thread for the cpu-quota option. */
+typedef struct {
+    int64_t thread_ns;
+    int64_t wall_ns;
+    bool scheduled;
+} T8030CPUQuota;
+
 typedef struct {
     MachineState parent;
     hwaddr soc_base_pa;
@@ -66,6 +74,17 @@ typedef struct {
     char *ticket_filename;
     char *seprom_filename;
     char *sep_fw_filename;
+    char *payload_cache_dir;
+    char *xnu_profile_path;
+    char *kernel_patches_filename;
+    char *ans_readahead_path;
+    char *ans_vhost_user_path;
+    char *shmcon_chardev;
+    char *usbmux_path;
+    char *sep_keystore_filename;
+    /* Read from seprom_filename on the first boot, re-blitted on reboot. */
+    char *seprom_data;
+    gsize seprom_size;
     BootMode boot_mode;
     uint32_t rtbuddy_protocol_ver;
     uint32_t build_version;
@@ -73,11 +92,28 @@ typedef struct {
     Notifier init_done_notifier;
     hwaddr panic_base;
     hwaddr panic_size;
-    uint8_t pmgr_reg[0x100000];
-    MemoryRegion amcc;
-    uint8_t amcc_reg[0x100000];
+    MemoryRegion panic_header_mr;
+    QEMUTimer *panic_timer;
+    bool panic_reported;
+    AppleRegBlock *pmgr;
+    AppleRegBlock *amcc;
+    /* Read-only view of the DRAM range locked through the AMCC. */
+    MemoryRegion amcc_ctrr_mr;
     bool kaslr_off;
     bool force_dfu;
+    bool ans_ioeventfd;
+    bool headless;
+    bool boot_profile;
+    bool free_page_reporting;
+    bool deterministic;
+    uint64_t high_dram_size;
+    /* Host CPU lists and nice values for the P and E cluster vCPUs. */
+    char *cluster_affinity[2];
+    int32_t cluster_priority[2];
+    /* Percent of a host CPU each vCPU thread may use, 100 for no cap. */
+    uint8_t cpu_quota;
+    QEMUTimer *cpu_quota_timer;
+    T8030CPUQuota *cpu_quota_state;
 } T8030MachineState;
 
 #endif /* HW_ARM_APPLE_SILICON_T8030_H */
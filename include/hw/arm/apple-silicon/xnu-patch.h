@@ -0,0 +1,65 @@
+/*
+ * Signature-based XNU kernelcache patcher.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_ARM_APPLE_SILICON_XNU_PATCH_H
+#define HW_ARM_APPLE_SILICON_XNU_PATCH_H
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+
+/*
+ * A patch is a run of instruction words, each matching a word of the
+ * image when (word & mask) == insn, and a run of words written over the
+ * match. Replacement bits outside `replace_mask` keep the original
+ * instruction's, so a zero mask skips a word.
+ *
+ * `bundle` is the fileset entry whose __TEXT_EXEC is searched, NULL for
+ * the kernel itself. Non-fileset kernelcaches search the prelinked kexts'
+ * __PLK_TEXT_EXEC for any other bundle, they do not say which is which.
+ */
+typedef struct {
+    const char *name;
+    const char *bundle;
+    const uint32_t *insn;
+    const uint32_t *mask;
+    uint32_t insn_count;
+    const uint32_t *replace;
+    const uint32_t *replace_mask;
+    uint32_t replace_count;
+} XnuPatch;
+
+/*
+ * Applies every patch at every match, in one pass over each searched
+ * segment; all patches match against the unpatched image. Patches
+ * without a match are reported and skipped.
+ *
+ * Must be called before the kernelcache is loaded into guest memory.
+ */
+void xnu_patch_apply(MachoHeader64 *kernel, const XnuPatch *patches,
+                     size_t count);
+
+/*
+ * Applies the patches listed in `path`, one per line:
+ *
+ *   name bundle insn[/mask]... = replace|-...
+ *
+ * with hexadecimal words, "-" as the bundle for the kernel itself and
+ * "-" as a replacement word to leave that instruction alone. Text after
+ * '#' is a comment. Exits on malformed files.
+ */
+void xnu_patch_apply_file(MachoHeader64 *kernel, const char *path);
+
+#endif /* HW_ARM_APPLE_SILICON_XNU_PATCH_H */
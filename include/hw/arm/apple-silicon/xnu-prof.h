@@ -0,0 +1,34 @@
+/*
+ * Sampling profiler for XNU guests.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_ARM_APPLE_SILICON_XNU_PROF_H
+#define HW_ARM_APPLE_SILICON_XNU_PROF_H
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+
+/*
+ * Samples the PC of every running vCPU while the VM runs and attributes it
+ * to the kext and function containing it, using the kernelcache's own
+ * fileset entries and symbol tables. Samples are split into kernel, GXF
+ * (PPL) and user time. When QEMU exits the counts are written to `path` in
+ * the collapsed-stack format read by flamegraph.pl and speedscope.
+ *
+ * `kernel` must stay loaded for the lifetime of the machine.
+ */
+void xnu_prof_start(MachoHeader64 *kernel, const char *path);
+
+#endif /* HW_ARM_APPLE_SILICON_XNU_PROF_H */
@@ -0,0 +1,66 @@
+/*
+ * Address to symbol index of XNU kernelcaches.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 or later, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_ARM_APPLE_SILICON_XNU_SYM_H
+#define HW_ARM_APPLE_SILICON_XNU_SYM_H
+
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/boot.h"
+
+/* Both start with the address they are sorted and searched by. */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t image;
+} XnuSymRange;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t image;
+    const char *name;
+} XnuSym;
+
+/*
+ * The segments and symbols of the kernel and of each fileset entry
+ * ("image"), sorted by their unslid address. Names point into the
+ * kernelcache, which must stay loaded.
+ */
+typedef struct {
+    MachoHeader64 *kernel;
+    /* Image names, indexed by XnuSymRange.image and XnuSym.image. */
+    GPtrArray *images;
+    GArray *ranges;
+    GArray *symbols;
+} XnuSymIndex;
+
+/*
+ * Makes `kernel` the kernelcache that 'info xnu-sym' symbolizes against.
+ * The index is built on first use.
+ */
+void xnu_sym_init(MachoHeader64 *kernel);
+
+/* The index of `kernel`, built on first use and shared by every user. */
+XnuSymIndex *xnu_sym_index(MachoHeader64 *kernel);
+
+/*
+ * Finds what contains the unslid address `addr`: returns false if no
+ * image segment does, otherwise sets `*sym` to the symbol at or below
+ * `addr` in the same segment, or to -1 if there is none.
+ */
+bool xnu_sym_lookup(const XnuSymIndex *index, uint64_t addr,
+                    const XnuSymRange **range, gssize *sym);
+
+#endif /* HW_ARM_APPLE_SILICON_XNU_SYM_H */
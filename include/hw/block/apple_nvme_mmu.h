@@ -36,6 +36,9 @@ struct AppleNVMeMMUState {
     MemoryRegion io_ioport;
     qemu_irq irq;
     NvmeCtrl nvme;
+    uint32_t max_ioqpairs;
+    uint8_t mdts;
+    bool unmap;
 };
 
 SysBusDevice *apple_nvme_mmu_create(DTBNode *node);
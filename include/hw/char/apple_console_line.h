@@ -0,0 +1,62 @@
+#ifndef APPLE_CONSOLE_LINE_H
+#define APPLE_CONSOLE_LINE_H
+
+/*
+ * Splits what the guest writes to a console into lines for a hook, shared
+ * by apple-uart and apple-shmcon. Long lines are split, the hook only ever
+ * looks for short markers.
+ */
+
+/* Called with each complete line the guest writes, without the EOL. */
+typedef void AppleConsoleLineFunc(void *opaque, const char *line);
+
+#define APPLE_CONSOLE_LINE_SIZE 256
+
+typedef struct {
+    AppleConsoleLineFunc *fn;
+    void *opaque;
+    char buf[APPLE_CONSOLE_LINE_SIZE];
+    uint32_t len;
+} AppleConsoleLine;
+
+static inline void apple_console_line_set(AppleConsoleLine *l,
+                                          AppleConsoleLineFunc *fn,
+                                          void *opaque)
+{
+    l->fn = fn;
+    l->opaque = opaque;
+    l->len = 0;
+}
+
+/* Drops a partial line, for when the guest starts over. */
+static inline void apple_console_line_reset(AppleConsoleLine *l)
+{
+    l->len = 0;
+}
+
+static inline void apple_console_line_push(AppleConsoleLine *l,
+                                           const uint8_t *buf, size_t len)
+{
+    if (l->fn == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t ch = buf[i];
+
+        if (ch != '\n' && ch != '\r') {
+            l->buf[l->len++] = ch;
+            if (l->len < sizeof(l->buf) - 1) {
+                continue;
+            }
+        }
+
+        if (l->len) {
+            l->buf[l->len] = '\0';
+            l->len = 0;
+            l->fn(l->opaque, l->buf);
+        }
+    }
+}
+
+#endif /* APPLE_CONSOLE_LINE_H */
@@ -0,0 +1,57 @@
+#ifndef APPLE_SHMCON_H
+#define APPLE_SHMCON_H
+
+#include "chardev/char-fe.h"
+#include "hw/char/apple_console_line.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+
+/*
+ * Paravirtual console: a byte ring in RAM that the guest appends to, which
+ * QEMU drains to a chardev when the doorbell is written or, optionally, on
+ * a poll timer. Memory region 0 is the ring, 1 the doorbell page.
+ *
+ * The ring starts with a header page followed by the data area, whose size
+ * is a power of two. head is a free-running count of bytes the guest has
+ * written, tail of bytes QEMU has consumed; byte n lives at data[n % size].
+ * The guest stores the data, then head, then writes anything to the
+ * doorbell. If it laps QEMU, the oldest bytes are dropped.
+ */
+#define TYPE_APPLE_SHMCON "apple-shmcon"
+OBJECT_DECLARE_SIMPLE_TYPE(AppleShmconState, APPLE_SHMCON)
+
+#define APPLE_SHMCON_MAGIC 0x434D4853 /* 'SHMC' */
+#define APPLE_SHMCON_VERSION 1
+#define APPLE_SHMCON_HEADER_SIZE 0x4000
+#define APPLE_SHMCON_DOORBELL_SIZE 0x4000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    uint32_t head;
+    uint32_t reserved1[15];
+    uint32_t tail;
+} AppleShmconHeader;
+
+struct AppleShmconState {
+    /*< private >*/
+    SysBusDevice parent_obj;
+
+    /*< public >*/
+    MemoryRegion ring;
+    MemoryRegion doorbell;
+    CharBackend chr;
+    QEMUTimer *poll_timer;
+    uint32_t size;
+    uint32_t poll_ms;
+    uint32_t tail;
+    AppleConsoleLine line;
+};
+
+void apple_shmcon_set_line_notify(DeviceState *dev, AppleConsoleLineFunc *fn,
+                                  void *opaque);
+
+#endif /* APPLE_SHMCON_H */
@@ -1,6 +1,7 @@
 #ifndef APPLE_UART_H
 #define APPLE_UART_H
 
+#include "hw/char/apple_console_line.h"
 #include "hw/or-irq.h"
 #include "hw/sysbus.h"
 #include "qom/object.h"
@@ -8,4 +9,7 @@
 
 DeviceState *apple_uart_create(hwaddr addr, int fifo_size, int channel,
                                Chardev *chr, qemu_irq irq);
+
+void apple_uart_set_line_notify(DeviceState *dev, AppleConsoleLineFunc *fn,
+                                void *opaque);
 #endif /* APPLE_UART_H */
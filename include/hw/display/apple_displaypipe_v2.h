@@ -21,7 +21,9 @@
 
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/dma/apple_dma.h"
 #include "hw/sysbus.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "ui/console.h"
 
@@ -37,8 +39,7 @@ typedef struct {
 
 typedef struct {
     size_t index;
-    MemoryRegion *vram;
-    AddressSpace *dma_as;
+    AppleDMA *dma;
     QEMUBH *bh;
     // TODO: Not have this field.
     AppleDisplayPipeV2State *disp_state;
@@ -47,6 +48,9 @@ typedef struct {
     uint16_t width;
     uint16_t height;
     GenPipeLayer layers[2];
+    bool draw_pending;
+    // The last run was acknowledged without being drawn.
+    bool stale;
 } GenPipeState;
 
 struct AppleDisplayPipeV2State {
@@ -56,13 +60,42 @@ struct AppleDisplayPipeV2State {
     /*< public >*/
     uint32_t width, height;
     MemoryRegion up_regs, vram;
+    // GenPipe runs are drawn into the back buffer, which is flipped to the
+    // front once complete. Buffer 0 is vram, where the boot framebuffer is.
+    MemoryRegion vram_back;
+    unsigned int front;
+    // The buffer the console last scanned out of.
+    unsigned int scanout;
+    // Rows changed by the last flip, which the back buffer still lacks.
+    int flip_first, flip_last;
     MemoryRegion *dma_mr;
     AddressSpace dma_as;
+    AppleDMA dma;
     MemoryRegionSection vram_section;
     qemu_irq irqs[9];
     uint32_t int_filter;
     GenPipeState genpipes[2];
+    // GenPipe registers are RAM, read when a run is drawn. Only the control
+    // register, which starts the run, traps. The mirrors are the same at
+    // the upper copy of the register space.
+    MemoryRegion gp_regs[2], gp_control[2];
+    MemoryRegion gp_regs_mirror[2], gp_control_mirror[2];
     QemuConsole *console;
+    // VBlank rate in Hz. 0 draws and signals as soon as a GenPipe is run.
+    uint32_t refresh_rate;
+    // VBlank rate in Hz while no display is attached. 0 disables throttling.
+    uint32_t idle_rate;
+    // No console, and GenPipe runs are only acknowledged, never drawn.
+    bool headless;
+    // Scan out of a texture updated with dirty rows, instead of a surface.
+    bool gl;
+    QEMUGLContext gl_ctx;
+    uint32_t gl_texture;
+    QEMUTimer *vblank_timer;
+    // GenPipe runs drawn, and those that left VRAM as it was, for
+    // query-stats.
+    uint64_t frames;
+    uint64_t frames_unchanged;
 };
 
 AppleDisplayPipeV2State *apple_displaypipe_v2_create(MachineState *machine,
@@ -0,0 +1,127 @@
+#ifndef HW_DMA_APPLE_DMA_H
+#define HW_DMA_APPLE_DMA_H
+
+#include "qemu/osdep.h"
+#include "exec/memory.h"
+#include "hw/qdev-properties.h"
+#include "qemu/iov.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "sysemu/dma.h"
+
+/*
+ * Zero-copy DMA for the devices that sit behind a DART.
+ *
+ * apple_dma_map_sg() resolves a list of IOVA ranges into host memory in
+ * one go. When all of it is RAM, apple_dma_unmap() keeps the resolution
+ * in a small per-device cache instead of dropping it, and the next map of
+ * the same ranges in the same direction reuses it without translating;
+ * an UNMAP from the IOMMU covering any of the ranges retires it, and so
+ * does any change to the memory map the IOVAs resolve into. Dirty
+ * tracking is done by every unmap, cached or not.
+ *
+ * Anything but RAM goes through bounce buffers, which are never cached.
+ * A map returns NULL while none can be had, for the caller to retry
+ * (cpu_register_map_client()) or fall back to apple_dma_read() and
+ * apple_dma_write().
+ *
+ * All functions may be called from any thread, without the BQL.
+ *
+ * With "dma-accounting" set on the device, every map and fallback access
+ * is counted against the IOMMU region, which is one stream of a DART, and
+ * shows up in query-stats under the "apple-dma" provider: bytes each way,
+ * the rate over the last second and a heatmap of the IOVA space.
+ *
+ * "dma-rate-limit" (bytes per second) and "dma-burst" (bytes, one second's
+ * worth by default) set up a token bucket. Transfers are never failed or
+ * slowed by it; the device asks apple_dma_throttle() how long to hold back
+ * the completion of each one instead.
+ */
+
+/* 64MiB buckets covering the 36-bit IOVA space of a DART. */
+#define APPLE_DMA_HEATMAP_SHIFT (26)
+#define APPLE_DMA_HEATMAP_BUCKETS (1024)
+
+typedef struct AppleDMAMap {
+    QTAILQ_ENTRY(AppleDMAMap) next;
+    /* The mapped memory, valid until apple_dma_unmap(). */
+    QEMUIOVector iov;
+    DMADirection dir;
+    ScatterGatherEntry *sg;
+    int nsg;
+    /* Held while cached, so the host pointers stay valid. */
+    MemoryRegion **mrs;
+    bool in_use;
+    /* Unmapped by the IOMMU while in use, not to be cached again. */
+    bool stale;
+} AppleDMAMap;
+
+typedef struct AppleDMA {
+    AddressSpace *as;
+    MemoryRegion *mr;
+    IOMMUNotifier notifier;
+    /* On the address space the IOVAs end up in, to see it change. */
+    MemoryListener listener;
+    bool map_changed;
+    QemuMutex mutex;
+    /* Mapped and cached maps, most recently unmapped first. */
+    QTAILQ_HEAD(, AppleDMAMap) maps;
+    uint32_t num_cached;
+    /* Bumped by every UNMAP, to catch those racing with a map. */
+    uint64_t unmap_gen;
+
+    /* Accounting, under the mutex. Indexed by DMADirection. */
+    bool accounting;
+    QLIST_ENTRY(AppleDMA) list;
+    uint64_t bytes[2];
+    uint64_t *heatmap;
+    int64_t window_start;
+    uint64_t window_bytes;
+    uint64_t rate;
+
+    /* Token bucket, under the mutex. */
+    uint64_t rate_limit;
+    uint64_t burst;
+    int64_t tokens;
+    int64_t refill_time;
+    uint64_t delayed_ns;
+} AppleDMA;
+
+#define DEFINE_APPLE_DMA_PROPERTIES(_state, _field) \
+    DEFINE_PROP_BOOL("dma-accounting", _state, _field.accounting, false)
+
+#define DEFINE_APPLE_DMA_LIMIT_PROPERTIES(_state, _field)               \
+    DEFINE_PROP_UINT64("dma-rate-limit", _state, _field.rate_limit, 0), \
+        DEFINE_PROP_UINT64("dma-burst", _state, _field.burst, 0)
+
+/*
+ * Set up DMA through @as, whose root is @mr. If @mr is an IOMMU region,
+ * its UNMAP notifications invalidate the cache, as do changes to the
+ * system memory map it translates into; otherwise changes to @as do.
+ */
+bool apple_dma_init(AppleDMA *d, AddressSpace *as, MemoryRegion *mr,
+                    Error **errp);
+void apple_dma_destroy(AppleDMA *d);
+/* Drop everything cached, e.g. on reset. */
+void apple_dma_flush(AppleDMA *d);
+
+AppleDMAMap *apple_dma_map_sg(AppleDMA *d, const ScatterGatherEntry *sg,
+                              int nsg, DMADirection dir);
+AppleDMAMap *apple_dma_map(AppleDMA *d, dma_addr_t addr, dma_addr_t len,
+                           DMADirection dir);
+/* @access_len bytes from the start of @map were accessed. */
+void apple_dma_unmap(AppleDMA *d, AppleDMAMap *map, dma_addr_t access_len);
+
+MemTxResult apple_dma_read(AppleDMA *d, dma_addr_t addr, void *buf,
+                           dma_addr_t len);
+MemTxResult apple_dma_write(AppleDMA *d, dma_addr_t addr, const void *buf,
+                            dma_addr_t len);
+
+/*
+ * Takes @len bytes from the token bucket. Returns how many nanoseconds of
+ * QEMU_CLOCK_VIRTUAL the completion of the transfer should be held back to
+ * stay within the limit, 0 when there is none.
+ */
+int64_t apple_dma_throttle(AppleDMA *d, dma_addr_t len);
+
+#endif /* HW_DMA_APPLE_DMA_H */
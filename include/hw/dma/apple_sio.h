@@ -3,9 +3,11 @@
 
 #include "qemu/osdep.h"
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/dma/apple_dma.h"
 #include "hw/misc/apple-silicon/a7iop/rtbuddy.h"
 #include "hw/sysbus.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "sysemu/dma.h"
 
@@ -34,7 +36,7 @@ typedef struct AppleSIODMAEndpoint {
     struct sio_dma_config config;
     struct sio_dma_segment *segments;
     QEMUSGList sgl;
-    QEMUIOVector iov;
+    AppleDMAMap *map;
     uint32_t count;
     uint32_t actual_length;
     AppleSIODMAHandler *handler;
@@ -42,6 +44,14 @@ typedef struct AppleSIODMAEndpoint {
     uint32_t tag;
     bool mapped;
     DMADirection dir;
+    /* Set while waiting for bounce buffers to map the started transfer. */
+    bool map_pending;
+    uint32_t map_retries;
+    QEMUBH *map_retry_bh;
+    /* A finished transfer whose completion the rate limit holds back. */
+    bool completion_pending;
+    uint64_t completion;
+    QEMUTimer *completion_timer;
 } AppleSIODMAEndpoint;
 
 struct AppleSIOClass {
@@ -61,6 +71,7 @@ struct AppleSIOState {
     MemoryRegion ascv2_iomem;
     MemoryRegion *dma_mr;
     AddressSpace dma_as;
+    AppleDMA dma;
 
     AppleSIODMAEndpoint eps[SIO_NUM_EPS];
     uint32_t params[0x100];
@@ -21,11 +21,24 @@ struct AppleGPIOState {
     qemu_irq *out;
 
     uint32_t *gpio_cfg;
-    uint32_t **int_cfg;
+    /*
+     * Pin bitmaps, 32 pins per word like the GPIOINT registers, so edges
+     * and levels are evaluated a word at a time.
+     */
+    uint32_t nwords;
+    uint32_t **int_cfg; /* pending interrupts, per group */
+    uint32_t **int_en; /* pins routed to each group */
+    uint32_t *int_lvl_hi;
+    uint32_t *int_lvl_lo;
+    uint32_t *int_edg_ris;
+    uint32_t *int_edg_fal;
     uint32_t *in;
     uint32_t *old_in;
     uint32_t npl;
     uint32_t phandle;
+    /* All of the above packed back to back, only valid while migrating. */
+    uint32_t *mig_state;
+    uint32_t mig_words;
 };
 
 DeviceState *apple_gpio_create(DTBNode *node);
@@ -36,6 +36,10 @@ typedef struct AppleI2CState {
     bool nak;
     bool xip;
     bool is_recv;
+    /* Target of the transaction in progress, for repeated starts. */
+    uint8_t target;
+    /* Only evaluate the IRQ once a transaction stops or fails. */
+    bool burst;
 } AppleI2CState;
 
 SysBusDevice *apple_i2c_create(const char *name);
@@ -2,19 +2,47 @@
 #define APPLE_SOFT_I2C_H
 
 #include "hw/arm/apple-silicon/dtb.h"
-#include "hw/i2c/bitbang_i2c.h"
+#include "hw/i2c/i2c.h"
 #include "hw/sysbus.h"
 #include "qom/object.h"
 
 #define TYPE_APPLE_SOFT_I2C "apple.i2c.soft"
 OBJECT_DECLARE_SIMPLE_TYPE(AppleSoftI2CState, APPLE_SOFT_I2C)
 
+/* Bytes written to a slave are handed over together, at a stop or restart. */
+#define APPLE_SOFT_I2C_BUF_SIZE (64)
+
+typedef enum {
+    APPLE_SOFT_I2C_IDLE,
+    APPLE_SOFT_I2C_ADDR,
+    APPLE_SOFT_I2C_ADDR_ACK,
+    APPLE_SOFT_I2C_WRITE,
+    APPLE_SOFT_I2C_WRITE_ACK,
+    APPLE_SOFT_I2C_READ,
+    APPLE_SOFT_I2C_READ_ACK,
+    /* NACKed, waiting for the master to stop or restart. */
+    APPLE_SOFT_I2C_NACKED,
+} AppleSoftI2CPhase;
+
 struct AppleSoftI2CState {
     /*< private >*/
     SysBusDevice parent_obj;
-    bitbang_i2c_interface bitbang;
     int last_level;
 
+    /* The transaction recognized from the master's SCL and SDA levels. */
+    AppleSoftI2CPhase phase;
+    bool scl;
+    bool sda;
+    bool drive;
+    bool acked;
+    bool nack;
+    bool recv;
+    bool busy;
+    uint8_t shift;
+    uint8_t bits;
+    uint8_t buf[APPLE_SOFT_I2C_BUF_SIZE];
+    uint32_t len;
+
     /*< public >*/
     MemoryRegion iomem;
     I2CBus *bus;
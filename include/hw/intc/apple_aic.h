@@ -2,6 +2,7 @@
 #define APPLE_AIC_H
 
 #include "hw/arm/apple-silicon/dtb.h"
+#include "hw/misc/apple-silicon/deadline.h"
 #include "hw/sysbus.h"
 #include "qom/object.h"
 
@@ -14,18 +15,23 @@ typedef struct AppleAICState AppleAICState;
 
 typedef struct {
     AppleAICState *aic;
+    CPUState *cpu;
     qemu_irq irq;
     MemoryRegion iomem;
     uint32_t cpu_id;
     uint32_t pendingIPI;
     uint32_t deferredIPI;
     uint32_t ipi_mask;
+    uint32_t *eir_pending;
+    uint32_t num_pending;
 } AppleAICCPU;
 
 struct AppleAICState {
     SysBusDevice parent_obj;
-    QEMUTimer *timer;
+    AppleDeadline tick;
     QemuMutex mutex;
+    /* Registers are accessed, and CPU IRQs driven, without the BQL. */
+    bool lockless;
     uint32_t phandle;
     uint32_t base_size;
     uint32_t numEIR;
@@ -37,6 +43,14 @@ struct AppleAICState {
     uint32_t *eir_dest;
     AppleAICCPU *cpus;
     uint32_t *eir_state;
+    /* Derived from the above; rebuilt on reset and after migration. */
+    uint32_t *eir_active;
+    uint32_t *eir_target;
+    uint32_t pending_cpus;
+    /* Last CPU an IRQ was steered to. */
+    uint32_t steer_last;
+    /* Always steer to the lowest destination CPU. */
+    bool fixed_steering;
 #ifdef AIC_DEBUG_NEW_IRQ
     uint32_t *eir_mask_once;
 #endif
@@ -45,5 +59,7 @@ struct AppleAICState {
 
 SysBusDevice *apple_aic_create(uint32_t numCPU, DTBNode *node,
                                DTBNode *timebase_node);
+/* Wire IRQ output `n` to `cpu`, after the AIC has been realized. */
+void apple_aic_connect_cpu(SysBusDevice *sbd, uint32_t n, CPUState *cpu);
 
 #endif /* APPLE_AIC_H */
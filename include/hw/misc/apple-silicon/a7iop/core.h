@@ -32,10 +32,10 @@ struct AppleA7IOP {
     uint32_t cpu_ctrl;
 };
 
-void apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg);
-AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s);
-void apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg);
-AppleA7IOPMessage *apple_a7iop_recv_iop(AppleA7IOP *s);
+void apple_a7iop_send_ap(AppleA7IOP *s, const AppleA7IOPMessage *msg);
+bool apple_a7iop_recv_ap(AppleA7IOP *s, AppleA7IOPMessage *msg);
+void apple_a7iop_send_iop(AppleA7IOP *s, const AppleA7IOPMessage *msg);
+bool apple_a7iop_recv_iop(AppleA7IOP *s, AppleA7IOPMessage *msg);
 void apple_a7iop_cpu_start(AppleA7IOP *s, bool wake);
 uint32_t apple_a7iop_get_cpu_status(AppleA7IOP *s);
 void apple_a7iop_set_cpu_status(AppleA7IOP *s, uint32_t value);
@@ -45,4 +45,6 @@ void apple_a7iop_init(AppleA7IOP *s, const char *role, uint64_t mmio_size,
                       AppleA7IOPVersion version, const AppleA7IOPOps *ops,
                       QEMUBH *iop_bh);
 
+extern const VMStateDescription vmstate_apple_a7iop;
+
 #endif /* HW_MISC_APPLE_SILICON_A7IOP_CORE_H */
@@ -29,11 +29,16 @@ struct AppleA7IOPMailbox {
     QemuMutex lock;
     MemoryRegion mmio;
     QEMUBH *bh;
-    QTAILQ_HEAD(, AppleA7IOPMessage) inbox;
+    /* Ring of inbox_size (a power of two) messages, stored by value. */
+    AppleA7IOPMessage *inbox;
+    size_t inbox_size;
+    size_t inbox_head;
     size_t count;
     AppleA7IOPMailbox *iop_mailbox;
     AppleA7IOPMailbox *ap_mailbox;
     qemu_irq irqs[APPLE_A7IOP_IRQ_MAX];
+    /* Last level driven on each line, -1 if not driven since reset. */
+    int irq_levels[APPLE_A7IOP_IRQ_MAX];
     bool iop_dir_en;
     bool ap_dir_en;
     bool underflow;
@@ -42,13 +47,21 @@ struct AppleA7IOPMailbox {
     uint8_t ap_recv_reg[16];
     uint8_t iop_send_reg[16];
     uint8_t ap_send_reg[16];
+    /* Messages ever queued to this inbox, for query-stats. */
+    uint64_t messages;
+    /* The inbox flattened to words, only valid while migrating. */
+    uint64_t *mig_inbox;
+    uint32_t mig_inbox_words;
 };
 
 bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s);
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s);
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s);
+uint64_t apple_a7iop_mailbox_get_messages(AppleA7IOPMailbox *s);
+void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg);
+void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
 AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
                                            AppleA7IOPVersion version,
                                            AppleA7IOPMailbox *iop_mailbox,
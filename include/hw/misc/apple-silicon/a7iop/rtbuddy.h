@@ -4,13 +4,17 @@
 #include "qemu/osdep.h"
 #include "hw/misc/apple-silicon/a7iop/core.h"
 #include "qemu/queue.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_APPLE_RTBUDDY "apple-rtbuddy"
 OBJECT_DECLARE_TYPE(AppleRTBuddy, AppleRTBuddyClass, APPLE_RTBUDDY)
 
 #define EP_MANAGEMENT 0
 #define EP_CRASHLOG 1
+#define EP_SYSLOG 2
+#define EP_IOREPORT 4
 #define EP_USER_START 32
+#define EP_MAX 256
 
 typedef enum {
     EP0_IDLE,
@@ -71,6 +75,12 @@ typedef struct {
     uint32_t last_block;
 } AppleRTBuddyRollcallData;
 
+/* A buffer the AP mapped for the IOP, 0 until it did. */
+typedef struct {
+    uint64_t iova;
+    uint32_t size;
+} AppleRTBuddyBuffer;
+
 typedef struct {
     void (*start)(void *opaque);
     void (*wakeup)(void *opaque);
@@ -81,6 +91,8 @@ struct AppleRTBuddyClass {
     SysBusDevice base_class;
 
     /*< public >*/
+    DeviceRealize parent_realize;
+    DeviceUnrealize parent_unrealize;
     DeviceReset parent_reset;
 };
 
@@ -94,8 +106,22 @@ struct AppleRTBuddy {
     void *opaque;
     AppleRTBuddyEP0State ep0_status;
     uint32_t protocol_version;
+    /* Ordered view for rollcall; ep_table is the per-message lookup. */
     GTree *endpoints;
+    AppleRTBuddyEPData *ep_table[EP_MAX];
     QTAILQ_HEAD(, AppleA7IOPMessage) rollcall;
+    /* The IOP's side of its DART, for the shared buffers. */
+    AddressSpace *dma_as;
+    AppleRTBuddyBuffer crashlog;
+    AppleRTBuddyBuffer syslog;
+    AppleRTBuddyBuffer ioreport;
+    uint32_t syslog_entries;
+    uint32_t syslog_msg_size;
+    /* Next entry to fill, and entries the AP has not acknowledged. */
+    uint32_t syslog_next;
+    uint32_t syslog_inflight;
+    bool dedicated_thread;
+    IOThread *iothread;
 };
 
 void apple_rtbuddy_send_control_msg(AppleRTBuddy *s, uint32_t ep,
@@ -108,6 +134,28 @@ void apple_rtbuddy_register_user_ep(AppleRTBuddy *s, uint32_t ep, void *opaque,
                                     AppleRTBuddyEPHandler *handler);
 void apple_rtbuddy_unregister_control_ep(AppleRTBuddy *s, uint32_t ep);
 void apple_rtbuddy_unregister_user_ep(AppleRTBuddy *s, uint32_t ep);
+
+/*
+ * Shared buffers, as RTKit firmware uses them for bulk data. Once the AP
+ * starts one of these endpoints, the IOP asks for a buffer of the given
+ * size and the AP maps one through the IOP's DART, which is @as. Until
+ * then, and without an @as, nothing is written. All of these must be
+ * called with the BQL held.
+ */
+void apple_rtbuddy_set_dma(AppleRTBuddy *s, AddressSpace *as);
+void apple_rtbuddy_enable_crashlog(AppleRTBuddy *s, uint32_t size);
+void apple_rtbuddy_enable_syslog(AppleRTBuddy *s, uint32_t entries,
+                                 uint32_t msg_size);
+void apple_rtbuddy_enable_ioreport(AppleRTBuddy *s, uint32_t size);
+/* Logs a line to the AP, and to the apple_rtbuddy_syslog trace event. */
+void apple_rtbuddy_syslog(AppleRTBuddy *s, const char *fmt, ...)
+    G_GNUC_PRINTF(2, 3);
+/* Writes to the IOReport buffer, which the AP polls. */
+MemTxResult apple_rtbuddy_ioreport_write(AppleRTBuddy *s, uint64_t offset,
+                                         const void *buf, uint64_t len);
+/* Writes a crash log and tells the AP about it. */
+void apple_rtbuddy_crashlog(AppleRTBuddy *s, const void *buf, uint64_t len);
+
 void apple_rtbuddy_init(AppleRTBuddy *s, void *opaque, const char *role,
                         uint64_t mmio_size, AppleA7IOPVersion version,
                         uint32_t protocol_version, const AppleRTBuddyOps *ops);
@@ -116,4 +164,6 @@ AppleRTBuddy *apple_rtbuddy_new(void *opaque, const char *role,
                                 uint32_t protocol_version,
                                 const AppleRTBuddyOps *ops);
 
+extern const VMStateDescription vmstate_apple_rtbuddy;
+
 #endif /* HW_MISC_APPLE_SILICON_A7IOP_RTKIT_H */
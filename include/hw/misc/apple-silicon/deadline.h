@@ -0,0 +1,70 @@
+#ifndef HW_MISC_APPLE_SILICON_DEADLINE_H
+#define HW_MISC_APPLE_SILICON_DEADLINE_H
+
+#include "qemu/osdep.h"
+#include "migration/vmstate.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+
+/*
+ * One host timer per machine for the device deadlines on the virtual
+ * clock, in place of a QEMUTimer per device.
+ *
+ * A deadline may fire anywhere between its expiry and its expiry plus its
+ * slack, so the host timer is armed at the earliest expiry plus slack and
+ * runs every deadline already due at that point together. It is only
+ * reprogrammed when that instant moves.
+ *
+ * Deadlines can be armed and disarmed from any thread; their callbacks run
+ * in the main loop with the BQL held, like a QEMUTimer's.
+ */
+#define TYPE_APPLE_DEADLINE_SCHED "apple-deadline-sched"
+OBJECT_DECLARE_SIMPLE_TYPE(AppleDeadlineSched, APPLE_DEADLINE_SCHED)
+
+typedef void AppleDeadlineFn(void *opaque);
+
+typedef struct AppleDeadline {
+    AppleDeadlineSched *sched;
+    AppleDeadlineFn *fn;
+    void *opaque;
+    int64_t slack_ns;
+    /* Expiry on the virtual clock in ns, -1 while disarmed. */
+    int64_t expire;
+    QLIST_ENTRY(AppleDeadline) next;
+} AppleDeadline;
+
+struct AppleDeadlineSched {
+    Object parent_obj;
+
+    QEMUTimer *timer;
+    QemuMutex lock;
+    QLIST_HEAD(, AppleDeadline) deadlines;
+    /* When the host timer fires, -1 while it is disarmed. */
+    int64_t armed;
+};
+
+/* The scheduler of the current machine, created on first use. */
+AppleDeadlineSched *apple_deadline_sched_get(void);
+
+void apple_deadline_init(AppleDeadline *d, AppleDeadlineFn *fn, void *opaque,
+                         int64_t slack_ns);
+void apple_deadline_destroy(AppleDeadline *d);
+/* Arm @d to expire at @expire, or rearm it. */
+void apple_deadline_mod(AppleDeadline *d, int64_t expire);
+/* Arm @d to expire at @expire unless it is armed to expire earlier. */
+void apple_deadline_mod_anticipate(AppleDeadline *d, int64_t expire);
+void apple_deadline_del(AppleDeadline *d);
+
+static inline int64_t apple_deadline_expire_time(AppleDeadline *d)
+{
+    return qatomic_read(&d->expire);
+}
+
+extern const VMStateDescription vmstate_apple_deadline;
+
+#define VMSTATE_APPLE_DEADLINE(_f, _s) \
+    VMSTATE_STRUCT(_f, _s, 0, vmstate_apple_deadline, AppleDeadline)
+
+#endif /* HW_MISC_APPLE_SILICON_DEADLINE_H */
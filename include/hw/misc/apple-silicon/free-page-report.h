@@ -0,0 +1,55 @@
+#ifndef HW_MISC_APPLE_SILICON_FREE_PAGE_REPORT_H
+#define HW_MISC_APPLE_SILICON_FREE_PAGE_REPORT_H
+
+#include "qemu/osdep.h"
+#include "hw/sysbus.h"
+#include "qom/object.h"
+
+/*
+ * Paravirtual free page reporting: the guest hands over ranges of pages it
+ * has no use for and QEMU discards their backing on the host. A page that
+ * is touched again faults back in zeroed, so the guest must only report
+ * pages on its free lists, and must not read them back expecting their old
+ * contents.
+ *
+ * Memory region 0 is one page of registers. The guest writes the guest
+ * physical address of an array of AppleFPREntry to LIST_LO/HI, then the
+ * number of entries to COUNT, which processes the list synchronously.
+ * RESULT then holds the number of pages discarded. Ranges that are not
+ * page aligned or not in RAM are skipped. Reports are dropped while
+ * discarding is inhibited, e.g. by VFIO or incoming postcopy migration.
+ */
+#define TYPE_APPLE_FPR "apple-free-page-report"
+OBJECT_DECLARE_SIMPLE_TYPE(AppleFPRState, APPLE_FPR)
+
+#define APPLE_FPR_MAGIC 0x52504650 /* 'PFPR' */
+#define APPLE_FPR_VERSION 1
+#define APPLE_FPR_PAGE_SIZE 0x4000
+#define APPLE_FPR_MAX_ENTRIES 256
+#define APPLE_FPR_MMIO_SIZE 0x4000
+
+#define APPLE_FPR_REG_MAGIC 0x00
+#define APPLE_FPR_REG_VERSION 0x04
+#define APPLE_FPR_REG_PAGE_SIZE 0x08
+#define APPLE_FPR_REG_MAX_ENTRIES 0x0c
+#define APPLE_FPR_REG_LIST_LO 0x10
+#define APPLE_FPR_REG_LIST_HI 0x14
+#define APPLE_FPR_REG_COUNT 0x18
+#define APPLE_FPR_REG_RESULT 0x1c
+
+typedef struct QEMU_PACKED {
+    uint64_t addr;
+    uint64_t pages;
+} AppleFPREntry;
+
+struct AppleFPRState {
+    /*< private >*/
+    SysBusDevice parent_obj;
+
+    /*< public >*/
+    MemoryRegion iomem;
+    uint64_t list;
+    uint32_t result;
+};
+
+#endif /* HW_MISC_APPLE_SILICON_FREE_PAGE_REPORT_H */
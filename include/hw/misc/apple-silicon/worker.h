@@ -0,0 +1,64 @@
+#ifndef HW_MISC_APPLE_SILICON_WORKER_H
+#define HW_MISC_APPLE_SILICON_WORKER_H
+
+#include "qemu/osdep.h"
+#include "qemu/thread-context.h"
+#include "qemu/thread.h"
+#include "sysemu/runstate.h"
+
+/*
+ * A device thread that can be parked at a known point with bounded latency.
+ *
+ * The thread calls @fn, without the BQL, every time it has been kicked.
+ * Before returning, @fn must leave everything it owns in state the vmsd
+ * serializes (registers, the command queue). Long jobs should poll
+ * apple_worker_should_yield() between units of work and put their
+ * remainder back on the queue when it returns true, so that parking never
+ * waits for a whole job.
+ *
+ * Pauses nest. The worker stays parked while the VM is stopped, which
+ * covers savevm and the final stage of migration; a vmsd may still pause
+ * in pre_save and resume in post_save for saves of a running VM.
+ *
+ * Everything but apple_worker_should_yield() must be called with the BQL
+ * held and never from the worker itself.
+ */
+typedef void AppleWorkerFn(void *opaque);
+
+typedef struct AppleWorker {
+    AppleWorkerFn *fn;
+    void *opaque;
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Waited on with the BQL, signalled once the thread is parked. */
+    QemuCond parked_cond;
+    VMChangeStateEntry *vmse;
+    uint32_t pause_depth;
+    bool vm_paused;
+    bool pending;
+    bool parked;
+    bool exit;
+} AppleWorker;
+
+/*
+ * Starts a joinable device thread. With @tc, the thread is created from
+ * that thread context and so inherits its CPU affinity, which lets the
+ * heavy device models be kept off the cores running vCPUs.
+ */
+void apple_thread_create(ThreadContext *tc, QemuThread *thread,
+                         const char *name, void *(*fn)(void *), void *arg);
+
+void apple_worker_init(AppleWorker *w, const char *name, ThreadContext *tc,
+                       AppleWorkerFn *fn, void *opaque);
+void apple_worker_destroy(AppleWorker *w);
+void apple_worker_kick(AppleWorker *w);
+void apple_worker_pause(AppleWorker *w);
+void apple_worker_resume(AppleWorker *w);
+
+static inline bool apple_worker_should_yield(AppleWorker *w)
+{
+    return qatomic_read(&w->pause_depth) || qatomic_read(&w->exit);
+}
+
+#endif /* HW_MISC_APPLE_SILICON_WORKER_H */
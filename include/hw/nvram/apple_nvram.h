@@ -47,6 +47,7 @@ typedef struct NvramBank {
     QTAILQ_HEAD(, NvramPartition) parts;
 
     size_t len;
+    uint32_t generation;
 } NvramBank;
 void nvram_free(NvramBank *bank);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(NvramBank, nvram_free);
@@ -56,7 +57,24 @@ typedef struct AppleNvramState {
 
     NvramBank *bank;
     QTAILQ_HEAD(, env_var) env;
+    /* Name to env_var, the queue keeps the serialization order. */
+    GHashTable *env_index;
     size_t len;
+    /* The bank as last read from or written to the backend. */
+    uint8_t *image;
+
+    /*
+     * Write-behind: saves are queued to an AIO writer that alternates
+     * between two bank-sized slots when the backend has room for them, so
+     * the newest valid generation survives a crash mid-write.
+     */
+    bool write_behind;
+    unsigned int nslots;
+    unsigned int slot;
+    unsigned int wb_slot;
+    uint8_t *wb_buf;
+    uint8_t *wb_pending;
+    QEMUIOVector wb_qiov;
 } AppleNvramState;
 
 struct AppleNvramClass {
@@ -39,6 +39,9 @@ struct AppleSPMIState {
     uint32_t data_length;
     uint32_t data_filled;
     uint32_t command;
+    /* Last levels driven, so unchanged ones aren't signalled again. */
+    bool irq_level;
+    bool resp_pending;
 };
 
 SysBusDevice *apple_spmi_create(DTBNode *node);
@@ -54,6 +54,12 @@ struct SSIPeripheralClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSIPeripheral *dev, uint32_t val);
+    /* Optional, byte wide devices can implement this to handle a whole
+     * ssi_transfer_bulk() at once. Called like transfer, when the device cs
+     * is active, and only if transfer_raw isn't overridden.
+     */
+    void (*transfer_bulk)(SSIPeripheral *dev, const uint8_t *tx, uint8_t *rx,
+                          size_t len);
 };
 
 struct SSIPeripheral {
@@ -111,6 +117,18 @@ bool ssi_realize_and_unref(DeviceState *dev, SSIBus *bus, Error **errp);
 SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
+/**
+ * ssi_transfer_bulk: clock @len bytes through @bus
+ * @bus: SSI bus
+ * @tx: bytes to send
+ * @rx: where to store the @len bytes received
+ * @len: number of bytes
+ *
+ * Equivalent to calling ssi_transfer() for each byte of @tx, but lets
+ * peripherals implementing transfer_bulk handle the whole buffer at once.
+ */
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       size_t len);
 
 DeviceState *ssi_get_cs(SSIBus *bus, uint8_t cs_index);
 
@@ -25,6 +25,8 @@ typedef struct AppleTypeCState {
     DWC2State dwc2;
     DWC3State dwc3;
     SysBusDevice *host;
+    /* Serve the gadget's usbmux link on this socket, see usb-mux-host. */
+    char *usbmux_path;
 } AppleTypeCState;
 
 DeviceState *apple_typec_create(DTBNode *node);
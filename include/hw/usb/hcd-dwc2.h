@@ -24,6 +24,7 @@
 #include "hw/sysbus.h"
 #include "hw/usb.h"
 #include "sysemu/dma.h"
+#include "sysemu/runstate.h"
 #include "qom/object.h"
 
 #define DWC2_MMIO_SIZE      0x11000
@@ -72,6 +73,9 @@ struct DWC2State {
     USBBus bus;
     /* This device in device mode */
     DWC2DeviceState *device;
+    /* Set by post_load, the gadget goes back on the bus once running. */
+    bool device_attach_pending;
+    VMChangeStateEntry *vmse;
     qemu_irq irq;
     MemoryRegion *dma_mr;
     AddressSpace dma_as;
@@ -0,0 +1,95 @@
+#ifndef HW_USB_HCD_GADGET_H
+#define HW_USB_HCD_GADGET_H
+
+#include "qemu/osdep.h"
+#include "hw/qdev-core.h"
+#include "hw/usb.h"
+#include "qemu/coroutine.h"
+
+/*
+ * The host side of a guest USB gadget, shared by the controllers that drive
+ * one function of it themselves (usb-ncm-host, usb-mux-host): a bus whose
+ * two ports the gadget's controllers attach to, and the coroutines that
+ * enumerate the gadget and move its transfers.
+ *
+ * Each attach or reset bumps the generation and enumerates the gadget
+ * again from scratch. Transfers of an older generation fail with -ENODEV,
+ * so a coroutine stops as soon as it sees its generation is gone.
+ */
+
+/* About a USB frame, the interval a real HC would retry a NAK at. */
+#define USB_GADGET_HOST_NAK_RETRY_NS (1 * SCALE_MS)
+
+typedef struct USBGadgetHost USBGadgetHost;
+
+typedef struct USBGadgetXfer {
+    USBPacket p;
+    /* The coroutine waiting for an async completion, if any. */
+    Coroutine *co;
+} USBGadgetXfer;
+
+typedef struct USBGadgetHostOps {
+    /* The function looked for, for the warning when there is none. */
+    const char *function;
+    /*
+     * Looks for the function in a configuration descriptor, and fills in
+     * ep_in, ep_out and ep_out_mps if it is there.
+     */
+    bool (*parse_config)(USBGadgetHost *h, const uint8_t *desc, size_t len);
+    /*
+     * Runs the function once the gadget is configured, for as long as `gen`
+     * is current.
+     */
+    void coroutine_fn (*run)(USBGadgetHost *h, uint32_t gen,
+                             const uint8_t *dev_desc);
+    /* Drops the function's own state, after the transfers are cancelled. */
+    void (*stop)(USBGadgetHost *h, bool was_running);
+} USBGadgetHostOps;
+
+struct USBGadgetHost {
+    USBBus bus;
+    USBPort uports[2];
+    const USBGadgetHostOps *ops;
+
+    /* The gadget being driven, and a count of its attaches and resets. */
+    USBDevice *dev;
+    uint32_t generation;
+    uint64_t next_id;
+    USBGadgetXfer ctrl;
+    USBGadgetXfer bulk_in;
+    USBGadgetXfer bulk_out;
+
+    /* Found while enumerating. */
+    uint8_t ep_in;
+    uint8_t ep_out;
+    uint16_t ep_out_mps;
+    /* Set by the function once its link is up. */
+    bool running;
+};
+
+void usb_gadget_host_init(USBGadgetHost *h, DeviceState *dev,
+                          const USBGadgetHostOps *ops);
+void usb_gadget_host_cleanup(USBGadgetHost *h);
+/* The guest's stack restarts too, so enumerate it again from scratch. */
+void usb_gadget_host_reset(USBGadgetHost *h);
+/* Drop the link, and wake everything waiting on the gadget to notice. */
+void usb_gadget_host_stop(USBGadgetHost *h);
+
+/* Schedules the coroutine in `*co`, if any, and clears it. */
+void usb_gadget_host_wake(Coroutine **co);
+
+/*
+ * Moves `len` bytes on endpoint `ep`, retrying NAKs. Returns the length
+ * transferred, -EIO if the gadget failed it or -ENODEV once `gen` is gone.
+ */
+int coroutine_fn usb_gadget_host_xfer(USBGadgetHost *h, uint32_t gen,
+                                      USBGadgetXfer *x, int pid, uint8_t ep,
+                                      void *buf, size_t len);
+
+/* Runs the setup, data and status stages of a control transfer. */
+int coroutine_fn usb_gadget_host_control(USBGadgetHost *h, uint32_t gen,
+                                         uint8_t type, uint8_t request,
+                                         uint16_t value, uint16_t index,
+                                         void *data, uint16_t length);
+
+#endif /* HW_USB_HCD_GADGET_H */
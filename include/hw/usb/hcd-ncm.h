@@ -0,0 +1,54 @@
+#ifndef HW_USB_HCD_NCM_H
+#define HW_USB_HCD_NCM_H
+
+#include "qemu/osdep.h"
+#include "hw/sysbus.h"
+#include "hw/usb.h"
+#include "hw/usb/hcd-gadget.h"
+#include "net/net.h"
+#include "qemu/coroutine.h"
+#include "qemu/units.h"
+#include "qom/object.h"
+
+/*
+ * A host controller for a guest USB gadget, in place of usb-tcp-host: it
+ * enumerates the gadget itself, looks for a CDC-NCM function and bridges
+ * its NTBs to a NIC backend, so the guest gets a network interface without
+ * a usbmuxd relay on the host.
+ */
+#define TYPE_USB_NCM_HOST "usb-ncm-host"
+OBJECT_DECLARE_SIMPLE_TYPE(USBNCMHostState, USB_NCM_HOST)
+
+/* Our side of the NTB sizes, the gadget's parameters can only lower them. */
+#define USB_NCM_NTB_MAX_SIZE (32 * KiB)
+#define USB_NCM_MAX_DATAGRAMS (32)
+
+struct USBNCMHostState {
+    SysBusDevice parent_obj;
+    USBGadgetHost host;
+    NICState *nic;
+    NICConf conf;
+
+    /* Found while enumerating. */
+    uint8_t comm_iface;
+    uint8_t data_iface;
+    uint8_t data_alt;
+    uint32_t ntb_in_size;
+    uint32_t ntb_out_size;
+    uint16_t ntb_out_divisor;
+    uint16_t ntb_out_max_datagrams;
+
+    /* Datagrams gathered for the next NTB while the last one is sent. */
+    uint8_t tx_buf[USB_NCM_NTB_MAX_SIZE];
+    uint32_t tx_len;
+    uint16_t tx_index[USB_NCM_MAX_DATAGRAMS];
+    uint16_t tx_length[USB_NCM_MAX_DATAGRAMS];
+    uint32_t tx_count;
+    uint16_t tx_sequence;
+    uint8_t tx_ntb[USB_NCM_NTB_MAX_SIZE];
+    Coroutine *tx_co;
+
+    uint8_t rx_ntb[USB_NCM_NTB_MAX_SIZE];
+};
+
+#endif /* HW_USB_HCD_NCM_H */
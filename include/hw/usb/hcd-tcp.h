@@ -6,7 +6,11 @@
 #include "hw/usb.h"
 #include "io/channel.h"
 #include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
+#include "sysemu/iothread.h"
+#include "sysemu/runstate.h"
 
 #define TYPE_USB_TCP_HOST "usb-tcp-host"
 OBJECT_DECLARE_SIMPLE_TYPE(USBTCPHostState, USB_TCP_HOST)
@@ -17,6 +21,8 @@ typedef struct USBTCPPacket {
     USBDevice *dev;
     USBTCPHostState *s;
     uint8_t addr;
+    bool pipelined;
+    QTAILQ_ENTRY(USBTCPPacket) retry;
 } USBTCPPacket;
 
 struct USBTCPHostState {
@@ -25,10 +31,21 @@ struct USBTCPHostState {
     USBBus bus;
     USBPort uports[3];
     QIOChannel *ioc;
+    /* Runs the channel I/O off the main loop, see usb_tcp_host_lock(). */
+    IOThread *iothread;
     CoMutex write_mutex;
-    Error *migration_blocker;
+    /* NAKed pipelined requests, retried in order like an HC would. */
+    QTAILQ_HEAD(, USBTCPPacket) retry_queue;
+    QEMUTimer *retry_timer;
+    VMChangeStateEntry *vmse;
+    /* Agreed on with the remote at connect, see TCP_USB_HELLO. */
+    uint8_t proto_version;
+    uint8_t proto_features;
+    bool compress;
     bool closed;
     bool stopped;
+    /* Disconnected for a migration switchover, see the VM state handler. */
+    bool handoff;
 };
 
 #endif /* HW_USB_HCD_TCP_H */
@@ -0,0 +1,58 @@
+#ifndef HW_USB_HCD_USBMUX_H
+#define HW_USB_HCD_USBMUX_H
+
+#include "qemu/osdep.h"
+#include "hw/sysbus.h"
+#include "hw/usb.h"
+#include "hw/usb/hcd-gadget.h"
+#include "io/net-listener.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "qom/object.h"
+
+/*
+ * A host controller for a guest USB gadget, in place of usb-tcp-host: it
+ * enumerates the gadget itself, speaks the usbmux protocol to its mux
+ * interface and serves the muxed connections the way usbmuxd does, on a
+ * UNIX socket libimobiledevice can be pointed at with
+ * USBMUXD_SOCKET_ADDRESS=UNIX:<path>.
+ */
+#define TYPE_USB_MUX_HOST "usb-mux-host"
+OBJECT_DECLARE_SIMPLE_TYPE(USBMuxHostState, USB_MUX_HOST)
+
+/* The largest mux packet the device sends, headers included. */
+#define USB_MUX_PKT_MAX (64 * KiB + 64)
+#define USB_MUX_MRU (16 * KiB)
+
+typedef struct USBMuxClient USBMuxClient;
+
+struct USBMuxHostState {
+    SysBusDevice parent_obj;
+    USBGadgetHost host;
+
+    char *path;
+    char *records;
+    char *buid;
+    QIONetListener *listener;
+    QLIST_HEAD(, USBMuxClient) clients;
+
+    CoMutex tx_lock;
+
+    /* Found while enumerating. */
+    uint16_t product_id;
+    char serial[64];
+
+    /* Mux protocol state, running once the versions are agreed on. */
+    uint32_t device_id;
+    uint32_t version;
+    uint16_t tx_seq;
+    uint16_t rx_seq;
+    uint16_t next_sport;
+
+    /* Reassembles mux packets that span IN transfers. */
+    uint8_t rx_pkt[USB_MUX_PKT_MAX + USB_MUX_MRU];
+    uint32_t rx_len;
+};
+
+#endif /* HW_USB_HCD_USBMUX_H */
@@ -24,6 +24,14 @@
  */
 int qemu_guest_random_seed_main(const char *seedstr, Error **errp);
 
+/**
+ * qemu_guest_random_is_seeded(void)
+ *
+ * Returns true if qemu_guest_getrandom is in deterministic mode, i.e.
+ * qemu_guest_random_seed_main has been called.
+ */
+bool qemu_guest_random_is_seeded(void);
+
 /**
  * qemu_guest_random_seed_thread_part1(void)
  *
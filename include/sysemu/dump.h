@@ -222,4 +222,28 @@ int64_t dump_filtered_memblock_size(GuestPhysBlock *block, int64_t filter_area_s
                                     int64_t filter_area_length);
 int64_t dump_filtered_memblock_start(GuestPhysBlock *block, int64_t filter_area_start,
                                      int64_t filter_area_length);
+
+/*
+ * XNU guests
+ *
+ * Machines booting XNU describe which guest memory the xnu-macho formats
+ * keep, and where the kernel maps it.
+ */
+typedef struct XnuDumpRange {
+    uint64_t vaddr;
+    hwaddr paddr;
+    uint64_t size;
+} XnuDumpRange;
+
+typedef struct XnuDumpInfo {
+    uint64_t kernel_vaddr;      /* slid address of the kernel's Mach-O header */
+    uint64_t kernel_slide;      /* KASLR slide of kernel_vaddr */
+    uint8_t kernel_uuid[16];    /* the kernel's LC_UUID, zero if it has none */
+    GArray *ranges;             /* XnuDumpRange, one Mach-O segment each */
+} XnuDumpInfo;
+
+typedef bool (*XnuDumpInfoFunc)(XnuDumpInfo *info, void *opaque,
+                                Error **errp);
+
+void xnu_dump_register(XnuDumpInfoFunc fn, void *opaque);
 #endif
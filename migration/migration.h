@@ -450,6 +450,13 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Directory of the content-addressed page store that RAM pages are
+     * saved to and loaded from, see ram-dedup.h. NULL to send pages in
+     * the stream.
+     */
+    char *ram_dedup_store;
+
     /*
      * This save hostname when out-going migration starts
      */
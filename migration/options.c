@@ -100,6 +100,7 @@ Property migration_properties[] = {
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
                      preempt_pre_7_2, false),
+    DEFINE_PROP_STRING("x-ram-dedup-store", MigrationState, ram_dedup_store),
 
     /* Migration parameters */
     DEFINE_PROP_UINT8("x-compress-level", MigrationState,
@@ -400,6 +401,13 @@ bool migrate_rdma(void)
     return s->rdma_migration;
 }
 
+const char *migrate_ram_dedup_store(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->ram_dedup_store;
+}
+
 bool migrate_tls(void)
 {
     MigrationState *s = migrate_get_current();
@@ -676,6 +684,16 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (migrate_ram_dedup_store()) {
+        if (new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+            new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "A RAM page store is incompatible with multifd,"
+                       " mapped-ram and postcopy");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -55,6 +55,7 @@ bool migrate_zero_copy_send(void);
 bool migrate_multifd_flush_after_each_section(void);
 bool migrate_postcopy(void);
 bool migrate_rdma(void);
+const char *migrate_ram_dedup_store(void);
 bool migrate_tls(void);
 
 /* capabilities helpers */
@@ -0,0 +1,298 @@
+/*
+ * Content-addressed page store for RAM snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "io/channel-file.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "ram-dedup.h"
+#include "trace.h"
+
+#define RAM_DEDUP_MAGIC "QEMUPGST"
+#define RAM_DEDUP_VERSION 1
+
+typedef struct QEMU_PACKED {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+} RamDedupHeader;
+
+struct RamDedupStore {
+    QIOChannelFile *index;
+    QIOChannelFile *pages;
+    size_t page_size;
+    bool writable;
+    /* Digest to slot in "pages". */
+    GHashTable *slots;
+    /* Slots listed in the index, and all slots including uncommitted ones. */
+    uint64_t committed;
+    uint64_t nslots;
+    /* Digests of the uncommitted slots. */
+    GByteArray *pending;
+    GChecksum *sha;
+    uint8_t *buf;
+};
+
+static guint ram_dedup_hash(gconstpointer key)
+{
+    /* The keys are SHA-256 digests already. */
+    return ldl_he_p(key);
+}
+
+static gboolean ram_dedup_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, RAM_DEDUP_DIGEST_LEN) == 0;
+}
+
+static int ram_dedup_io(QIOChannelFile *ioc, bool write, uint8_t *buf,
+                        size_t len, off_t offset, Error **errp)
+{
+    while (len > 0) {
+        ssize_t ret;
+
+        if (write) {
+            ret = qio_channel_pwrite(QIO_CHANNEL(ioc), (char *)buf, len,
+                                     offset, errp);
+        } else {
+            ret = qio_channel_pread(QIO_CHANNEL(ioc), (char *)buf, len,
+                                    offset, errp);
+        }
+        if (ret < 0) {
+            return -EIO;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of page store");
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void ram_dedup_digest(RamDedupStore *store, const uint8_t *page,
+                             uint8_t *digest)
+{
+    gsize len = RAM_DEDUP_DIGEST_LEN;
+
+    g_checksum_reset(store->sha);
+    g_checksum_update(store->sha, page, store->page_size);
+    g_checksum_get_digest(store->sha, digest, &len);
+}
+
+static void ram_dedup_insert(RamDedupStore *store, const uint8_t *digest,
+                             uint64_t slot)
+{
+    g_hash_table_insert(store->slots, g_memdup2(digest, RAM_DEDUP_DIGEST_LEN),
+                        GSIZE_TO_POINTER(slot));
+}
+
+static int ram_dedup_load_index(RamDedupStore *store, const char *dir,
+                                Error **errp)
+{
+    RamDedupHeader hdr;
+    struct stat index_st, pages_st;
+    g_autofree uint8_t *digests = NULL;
+    uint64_t i, n;
+    int ret;
+
+    if (fstat(store->index->fd, &index_st) < 0 ||
+        fstat(store->pages->fd, &pages_st) < 0) {
+        error_setg_errno(errp, errno, "Cannot stat page store '%s'", dir);
+        return -errno;
+    }
+
+    if (index_st.st_size == 0 && store->writable) {
+        memcpy(hdr.magic, RAM_DEDUP_MAGIC, sizeof(hdr.magic));
+        hdr.version = cpu_to_be32(RAM_DEDUP_VERSION);
+        hdr.page_size = cpu_to_be32(store->page_size);
+        return ram_dedup_io(store->index, true, (uint8_t *)&hdr, sizeof(hdr),
+                            0, errp);
+    }
+
+    if (index_st.st_size < sizeof(hdr)) {
+        error_setg(errp, "'%s' is not a page store", dir);
+        return -EINVAL;
+    }
+    ret = ram_dedup_io(store->index, false, (uint8_t *)&hdr, sizeof(hdr), 0,
+                       errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (memcmp(hdr.magic, RAM_DEDUP_MAGIC, sizeof(hdr.magic)) != 0 ||
+        be32_to_cpu(hdr.version) != RAM_DEDUP_VERSION) {
+        error_setg(errp, "'%s' is not a page store", dir);
+        return -EINVAL;
+    }
+    if (be32_to_cpu(hdr.page_size) != store->page_size) {
+        error_setg(errp, "Page store '%s' holds %u byte pages, not %zu", dir,
+                   be32_to_cpu(hdr.page_size), store->page_size);
+        return -EINVAL;
+    }
+
+    /*
+     * Pages past the end of the index were left by a saver that did not
+     * commit; they are overwritten as new pages come in.
+     */
+    n = MIN((index_st.st_size - sizeof(hdr)) / RAM_DEDUP_DIGEST_LEN,
+            pages_st.st_size / store->page_size);
+    if (n == 0) {
+        return 0;
+    }
+    digests = g_malloc(n * RAM_DEDUP_DIGEST_LEN);
+    ret = ram_dedup_io(store->index, false, digests, n * RAM_DEDUP_DIGEST_LEN,
+                       sizeof(hdr), errp);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < n; i++) {
+        ram_dedup_insert(store, digests + i * RAM_DEDUP_DIGEST_LEN, i);
+    }
+    store->committed = store->nslots = n;
+    return 0;
+}
+
+void ram_dedup_close(RamDedupStore *store)
+{
+    if (store->index) {
+        object_unref(OBJECT(store->index));
+    }
+    if (store->pages) {
+        object_unref(OBJECT(store->pages));
+    }
+    g_hash_table_destroy(store->slots);
+    g_byte_array_free(store->pending, true);
+    g_checksum_free(store->sha);
+    g_free(store->buf);
+    g_free(store);
+}
+
+RamDedupStore *ram_dedup_open(const char *dir, size_t page_size,
+                              bool writable, Error **errp)
+{
+    g_autofree char *index_path = g_build_filename(dir, "index", NULL);
+    g_autofree char *pages_path = g_build_filename(dir, "pages", NULL);
+    int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+    RamDedupStore *store;
+
+    if (writable && g_mkdir_with_parents(dir, 0777) < 0) {
+        error_setg_errno(errp, errno, "Cannot create page store '%s'", dir);
+        return NULL;
+    }
+
+    store = g_new0(RamDedupStore, 1);
+    store->page_size = page_size;
+    store->writable = writable;
+    store->slots = g_hash_table_new_full(ram_dedup_hash, ram_dedup_equal,
+                                         g_free, NULL);
+    store->pending = g_byte_array_new();
+    store->sha = g_checksum_new(G_CHECKSUM_SHA256);
+    store->buf = g_malloc(page_size);
+
+    store->index = qio_channel_file_new_path(index_path, flags, 0666, errp);
+    if (!store->index) {
+        goto fail;
+    }
+    store->pages = qio_channel_file_new_path(pages_path, flags, 0666, errp);
+    if (!store->pages) {
+        goto fail;
+    }
+
+#ifndef _WIN32
+    if (writable && qemu_lock_fd(store->index->fd, 0, 0, true) < 0) {
+        error_setg(errp, "Page store '%s' is in use by another saver", dir);
+        goto fail;
+    }
+#endif
+
+    if (ram_dedup_load_index(store, dir, errp) < 0) {
+        goto fail;
+    }
+
+    trace_ram_dedup_open(dir, store->committed, writable);
+    return store;
+
+fail:
+    ram_dedup_close(store);
+    return NULL;
+}
+
+int ram_dedup_commit(RamDedupStore *store, Error **errp)
+{
+    int ret;
+
+    if (store->pending->len == 0) {
+        return 0;
+    }
+
+    /* The index must never list a page that is not on disk yet. */
+    if (qemu_fdatasync(store->pages->fd) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Cannot sync the page store");
+        return ret;
+    }
+    ret = ram_dedup_io(store->index, true, store->pending->data,
+                       store->pending->len,
+                       sizeof(RamDedupHeader) +
+                           store->committed * RAM_DEDUP_DIGEST_LEN,
+                       errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (qemu_fdatasync(store->index->fd) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Cannot sync the page store");
+        return ret;
+    }
+
+    trace_ram_dedup_commit(store->nslots - store->committed, store->nslots);
+    store->committed = store->nslots;
+    g_byte_array_set_size(store->pending, 0);
+    return 0;
+}
+
+int ram_dedup_put(RamDedupStore *store, const uint8_t *page,
+                  uint8_t *digest, Error **errp)
+{
+    uint64_t slot;
+    int ret;
+
+    assert(store->writable);
+
+    /* The guest may still be running; hash and store the same copy. */
+    memcpy(store->buf, page, store->page_size);
+    ram_dedup_digest(store, store->buf, digest);
+    if (g_hash_table_contains(store->slots, digest)) {
+        return 0;
+    }
+
+    slot = store->nslots;
+    ret = ram_dedup_io(store->pages, true, store->buf, store->page_size,
+                       slot * store->page_size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    store->nslots++;
+    g_byte_array_append(store->pending, digest, RAM_DEDUP_DIGEST_LEN);
+    ram_dedup_insert(store, digest, slot);
+    return 0;
+}
+
+int ram_dedup_get(RamDedupStore *store, const uint8_t *digest,
+                  uint8_t *page, Error **errp)
+{
+    gpointer slot;
+
+    if (!g_hash_table_lookup_extended(store->slots, digest, NULL, &slot)) {
+        error_setg(errp, "Page missing from the page store");
+        return -ENOENT;
+    }
+    return ram_dedup_io(store->pages, false, page, store->page_size,
+                        (uint64_t)GPOINTER_TO_SIZE(slot) * store->page_size,
+                        errp);
+}
@@ -0,0 +1,43 @@
+/*
+ * Content-addressed page store for RAM snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_DEDUP_H
+#define QEMU_MIGRATION_RAM_DEDUP_H
+
+/*
+ * A directory holding guest pages keyed by their SHA-256, which any
+ * number of snapshots can share. With the x-ram-dedup-store migration
+ * property set, the RAM stream carries the digest of each non-zero page
+ * instead of its contents, and pages already in the store are not
+ * written again. Zero pages stay in the stream as before.
+ *
+ * "pages" holds the pages back to back. "index" is a header followed by
+ * the digest of each page in "pages", in the same order. New pages are
+ * only added to the index once they are on disk, so a saver that dies
+ * part way leaves the store as it was. One saver may use a store at a
+ * time; loaders take no lock.
+ */
+
+#define RAM_DEDUP_DIGEST_LEN 32
+
+typedef struct RamDedupStore RamDedupStore;
+
+RamDedupStore *ram_dedup_open(const char *dir, size_t page_size,
+                              bool writable, Error **errp);
+/* Drops the pages added since the last commit. */
+void ram_dedup_close(RamDedupStore *store);
+/* Lists the pages added since the last commit in the index. */
+int ram_dedup_commit(RamDedupStore *store, Error **errp);
+
+/* Adds a copy of @page unless it is present and returns its @digest. */
+int ram_dedup_put(RamDedupStore *store, const uint8_t *page,
+                  uint8_t *digest, Error **errp);
+/* Reads the page with @digest into @page. */
+int ram_dedup_get(RamDedupStore *store, const uint8_t *digest,
+                  uint8_t *page, Error **errp);
+
+#endif
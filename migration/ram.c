@@ -34,6 +34,7 @@
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
 #include "ram-compress.h"
+#include "ram-dedup.h"
 #include "ram.h"
 #include "migration.h"
 #include "migration-stats.h"
@@ -80,9 +81,10 @@
  * RAM_SAVE_FLAG_COMPRESS_PAGE just rename it.
  */
 /*
- * RAM_SAVE_FLAG_FULL was obsoleted in 2009, it can be reused now
+ * RAM_SAVE_FLAG_FULL was obsoleted in 2009, RAM_SAVE_FLAG_DEDUP reuses
+ * it for pages sent as their digest in the page store, see ram-dedup.h.
  */
-#define RAM_SAVE_FLAG_FULL     0x01
+#define RAM_SAVE_FLAG_DEDUP    0x01
 #define RAM_SAVE_FLAG_ZERO     0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -412,6 +414,9 @@ struct RAMState {
      * RAM migration.
      */
     unsigned int postcopy_bmap_sync_requested;
+
+    /* Page store that non-zero pages go to, if any */
+    RamDedupStore *dedup;
 };
 typedef struct RAMState RAMState;
 
@@ -2094,9 +2099,44 @@ static int ram_save_target_page_legacy(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    if (rs->dedup) {
+        return save_dedup_page(rs, pss, offset);
+    }
+
     return ram_save_page(rs, pss);
 }
 
+/**
+ * save_dedup_page: add a page to the page store and send its digest
+ *
+ * Returns the number of pages written, or -1 on error.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_dedup_page(RAMState *rs, PageSearchStatus *pss,
+                           ram_addr_t offset)
+{
+    QEMUFile *file = pss->pss_channel;
+    uint8_t digest[RAM_DEDUP_DIGEST_LEN];
+    Error *local_err = NULL;
+    int len;
+
+    if (ram_dedup_put(rs->dedup, pss->block->host + offset, digest,
+                      &local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    len = save_page_header(pss, file, pss->block,
+                           offset | RAM_SAVE_FLAG_DEDUP);
+    qemu_put_buffer(file, digest, sizeof(digest));
+    ram_transferred_add(len + sizeof(digest));
+    stat64_add(&mig_stats.normal_pages, 1);
+    return 1;
+}
+
 /**
  * ram_save_target_page_multifd: send one target page to multifd workers
  *
@@ -2467,6 +2507,10 @@ static void ram_save_cleanup(void *opaque)
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    if (*rsp && (*rsp)->dedup) {
+        ram_dedup_close((*rsp)->dedup);
+        (*rsp)->dedup = NULL;
+    }
     ram_state_cleanup(rsp);
     g_free(migration_ops);
     migration_ops = NULL;
@@ -3086,6 +3130,17 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->pss[RAM_CHANNEL_PRECOPY].pss_channel = f;
 
+    if (migrate_ram_dedup_store() && !(*rsp)->dedup) {
+        Error *local_err = NULL;
+
+        (*rsp)->dedup = ram_dedup_open(migrate_ram_dedup_store(),
+                                       TARGET_PAGE_SIZE, true, &local_err);
+        if (!(*rsp)->dedup) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     /*
      * ??? Mirrors the previous value of qemu_host_page_size,
      * but is this really what was intended for the migration?
@@ -3383,6 +3438,17 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    /* The stream is only complete once the pages it names are. */
+    if (rs->dedup) {
+        Error *local_err = NULL;
+
+        ret = ram_dedup_commit(rs->dedup, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
+
     if (migrate_multifd() && !migrate_multifd_flush_after_each_section() &&
         !migrate_mapped_ram()) {
         qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
@@ -3687,6 +3753,9 @@ void colo_release_ram_cache(void)
     ram_state_cleanup(&ram_state);
 }
 
+/* Page store that RAM_SAVE_FLAG_DEDUP pages are loaded from, if any */
+static RamDedupStore *ram_dedup_load;
+
 /**
  * ram_load_setup: Setup RAM for migration incoming side
  *
@@ -3700,6 +3769,17 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
+    if (migrate_ram_dedup_store()) {
+        Error *local_err = NULL;
+
+        ram_dedup_load = ram_dedup_open(migrate_ram_dedup_store(),
+                                        TARGET_PAGE_SIZE, false, &local_err);
+        if (!ram_dedup_load) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -3713,6 +3793,11 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
 
+    if (ram_dedup_load) {
+        ram_dedup_close(ram_dedup_load);
+        ram_dedup_load = NULL;
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
@@ -4217,6 +4302,10 @@ static int ram_load_precopy(QEMUFile *f)
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
 
+    if (!ram_dedup_load) {
+        invalid_flags |= RAM_SAVE_FLAG_DEDUP;
+    }
+
     if (migrate_mapped_ram()) {
         invalid_flags |= (RAM_SAVE_FLAG_HOOK | RAM_SAVE_FLAG_MULTIFD_FLUSH |
                           RAM_SAVE_FLAG_PAGE | RAM_SAVE_FLAG_XBZRLE |
@@ -4261,7 +4350,8 @@ static int ram_load_precopy(QEMUFile *f)
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_DEDUP)) {
             RAMBlock *block = ram_block_from_stream(mis, f, flags,
                                                     RAM_CHANNEL_PRECOPY);
 
@@ -4330,6 +4420,19 @@ static int ram_load_precopy(QEMUFile *f)
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
+        case RAM_SAVE_FLAG_DEDUP: {
+            uint8_t digest[RAM_DEDUP_DIGEST_LEN];
+            Error *local_err = NULL;
+
+            qemu_get_buffer(f, digest, sizeof(digest));
+            ret = ram_dedup_get(ram_dedup_load, digest, host, &local_err);
+            if (ret < 0) {
+                error_reportf_err(local_err, "Failed to load page at "
+                                  RAM_ADDR_FMT ": ", addr);
+            }
+            break;
+        }
+
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
             if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
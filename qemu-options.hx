@@ -5230,6 +5230,21 @@ SRST
 
         The ``share`` boolean option is on by default with memfd.
 
+    ``-object memory-backend-lazy,id=id,image=file[,prefetch=file][,record=file][,chunk-size=size],size=size``
+        Creates a private anonymous memory backend whose pages are read
+        from ``image`` the first time they are touched, using
+        userfaultfd. This lets a guest restored with ``-incoming`` start
+        without copying its whole RAM image first. (Linux only)
+
+        ``chunk-size`` sets how much of ``image`` is read per fault (64
+        KiB by default). ``prefetch`` names a file of offsets into
+        ``image``, one per line, populated in that order while no fault
+        is pending. ``record`` names a file that every faulting offset
+        is written to, which can be used as ``prefetch`` by later runs.
+
+        Please refer to ``memory-backend-file`` for a description of the
+        other options. ``share`` is not supported.
+
     ``-object iommufd,id=id[,fd=fd]``
         Creates an iommufd backend which allows control of DMA mapping
         through the ``/dev/iommu`` device.
@@ -49,8 +49,9 @@ meson_options_help() {
   printf "%s\n" '  --enable-strip           Strip targets on install'
   printf "%s\n" '  --enable-tcg-interpreter TCG with bytecode interpreter (slow)'
   printf "%s\n" '  --enable-trace-backends=CHOICES'
-  printf "%s\n" '                           Set available tracing backends [log] (choices:'
-  printf "%s\n" '                           dtrace/ftrace/log/nop/simple/syslog/ust)'
+  printf "%s\n" '                           Set available tracing backends [log,flight]'
+  printf "%s\n" '                           (choices:'
+  printf "%s\n" '                           dtrace/flight/ftrace/log/nop/simple/syslog/ust)'
   printf "%s\n" '  --enable-tsan            enable thread sanitizer'
   printf "%s\n" '  --firmwarepath=VALUES    search PATH for firmware files [share/qemu-'
   printf "%s\n" '                           firmware]'
@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+
+#  Measure time-to-SpringBoard of the t8030 machine.
+#  Syntax:
+#  apple-boot-bench.py [-h] [-q QEMU] [-r RUNS] [-t TIMEOUT] [--icount]
+#                      [--ecid ECID] <firmware set json>
+#
+#  The firmware set is a JSON object naming the files to boot, relative to
+#  the JSON file itself, and optionally their SHA-256 so a run refuses to
+#  start on anything but the pinned images:
+#
+#  {
+#      "kernel": "kernelcache.research.iphone12b",
+#      "dtb": "DeviceTree.n104ap.im4p",
+#      "trustcache": "044-xxxxx.dmg.trustcache",
+#      "ticket": "root_ticket.der",
+#      "seprom": "AppleSEPROM-Cebu-B1",
+#      "sepfw": "sep-firmware.n104.RELEASE.im4p",
+#      "sha256": { "kernel": "..." },
+#      "args": ["-drive", "file=nvme.1,format=raw,if=none,id=root", "..."]
+#  }
+#
+#  Every drive is opened with -snapshot, so the NAND images start from the
+#  same state on each run. The machine runs with kaslr-off and a fixed ECID,
+#  and boot milestones are taken from the serial console as they appear.
+#  With --icount, guest instruction counts come from the machine's own
+#  boot profile. One JSON object per run is printed on stdout.
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import selectors
+import signal
+import subprocess
+import sys
+import time
+
+
+# Console substrings marking each boot stage, in boot order. The last one
+# ends the run.
+MILESTONES = [
+    ('bootstrap', 'Darwin Kernel Version'),
+    ('bsd_root_mounted', 'BSD root:'),
+    ('launchd', 'launchd'),
+    ('springboard', 'SpringBoard'),
+]
+
+# "  launchd                  at   1234.567 ms, 123456 insns"
+PROFILE_LINE = re.compile(r'^\s+(\S+)\s+at\s+([\d.]+) ms(?:, (\d+) insns)?$')
+
+FIRMWARE_PROPS = ['trustcache', 'ticket', 'seprom', 'sepfw']
+
+
+def load_firmware_set(path):
+    base = os.path.dirname(os.path.abspath(path))
+    with open(path, 'r') as f:
+        fw = json.load(f)
+
+    for key in ['kernel', 'dtb'] + FIRMWARE_PROPS:
+        if key not in fw:
+            sys.exit('Firmware set is missing "{}"'.format(key))
+        fw[key] = os.path.join(base, fw[key])
+
+    for key, digest in fw.get('sha256', {}).items():
+        with open(fw[key], 'rb') as f:
+            actual = hashlib.sha256(f.read()).hexdigest()
+        if actual != digest.lower():
+            sys.exit('{} does not match its pinned SHA-256'.format(fw[key]))
+
+    return fw
+
+
+def qemu_command(args, fw):
+    machine = ['t8030', 'kaslr-off=true', 'boot-profile=on',
+               'ecid={}'.format(args.ecid)]
+    machine += ['{}={}'.format(key, fw[key]) for key in FIRMWARE_PROPS]
+
+    cmd = [args.qemu, '-M', ','.join(machine),
+           '-kernel', fw['kernel'], '-dtb', fw['dtb'],
+           '-snapshot', '-display', 'none', '-monitor', 'none',
+           '-serial', 'stdio']
+    if args.icount:
+        cmd += ['-icount', 'shift=0,align=off,sleep=off']
+    return cmd + fw.get('args', [])
+
+
+def run_once(args, fw):
+    cmd = qemu_command(args, fw)
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    sel = selectors.DefaultSelector()
+    sel.register(proc.stdout, selectors.EVENT_READ)
+
+    console = {}
+    pending = list(MILESTONES)
+    buf = b''
+    deadline = start + args.timeout
+    while pending and time.monotonic() < deadline:
+        if not sel.select(timeout=1):
+            continue
+        data = os.read(proc.stdout.fileno(), 65536)
+        if not data:
+            break
+        buf += data
+        *lines, buf = buf.split(b'\n')
+        for line in lines:
+            text = line.decode('utf-8', 'replace')
+            for name, needle in list(pending):
+                if needle in text:
+                    console[name] = time.monotonic() - start
+                    pending.remove((name, needle))
+
+    # SIGTERM lets QEMU run its exit notifiers, which print the profile.
+    sel.close()
+    proc.send_signal(signal.SIGTERM)
+    try:
+        _, stderr = proc.communicate(timeout=30)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        _, stderr = proc.communicate()
+
+    insns = {}
+    for line in stderr.decode('utf-8', 'replace').splitlines():
+        match = PROFILE_LINE.match(line.split(': ', 1)[-1])
+        if match and match.group(3) is not None:
+            insns[match.group(1)] = int(match.group(3))
+
+    result = {'completed': not pending, 'milestones': []}
+    prev_s, prev_insns = 0.0, 0
+    for name, _ in MILESTONES:
+        if name not in console:
+            break
+        entry = {'name': name, 'wall_s': round(console[name], 3),
+                 'phase_wall_s': round(console[name] - prev_s, 3)}
+        prev_s = console[name]
+        # The machine names the first console stage kernel_bootstrap.
+        key = 'kernel_bootstrap' if name == 'bootstrap' else name
+        if key in insns:
+            entry['insns'] = insns[key]
+            entry['phase_insns'] = insns[key] - prev_insns
+            prev_insns = insns[key]
+        result['milestones'].append(entry)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure time-to-SpringBoard of the t8030 machine.')
+    parser.add_argument('-q', '--qemu', default='qemu-system-aarch64',
+                        help='QEMU binary to run (default: %(default)s)')
+    parser.add_argument('-r', '--runs', type=int, default=1,
+                        help='number of boots (default: %(default)s)')
+    parser.add_argument('-t', '--timeout', type=float, default=1800,
+                        help='seconds to wait for SpringBoard '
+                             '(default: %(default)s)')
+    parser.add_argument('--icount', action='store_true',
+                        help='run with -icount and report guest '
+                             'instruction counts per phase')
+    parser.add_argument('--ecid', default='0x1122334455667788',
+                        help='ECID of the machine (default: %(default)s)')
+    parser.add_argument('firmware', help='firmware set JSON file')
+    args = parser.parse_args()
+
+    fw = load_firmware_set(args.firmware)
+    failed = False
+    for run in range(args.runs):
+        result = run_once(args, fw)
+        result['run'] = run
+        print(json.dumps(result), flush=True)
+        failed |= not result['completed']
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+
+#  Measure what idle t8030 guests cost the host.
+#  Syntax:
+#  apple-idle-bench.py [-h] [-q QEMU] [-n INSTANCES] [-s SETTLE]
+#                      [-m MEASURE] [--ecid ECID] --loadvm SNAPSHOT
+#                      <firmware set json>
+#
+#  The firmware set is the one apple-boot-bench.py takes; its drives must
+#  hold the internal snapshot SNAPSHOT of a booted guest, e.g. one saved
+#  with savevm once SpringBoard is up. Every instance starts from it with
+#  -snapshot, so they all share the same disk state and nothing is written
+#  back.
+#
+#  Once every instance is up, they are left alone for SETTLE seconds and
+#  then watched for MEASURE seconds. For each instance, one JSON object on
+#  stdout gives its host CPU use, the wakeups per second of each device
+#  timer taken from trace events, the host context switches per second of
+#  its threads, and its resident and shared memory at the end. A last
+#  object sums them up. Linux only, as the numbers come from /proc.
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import argparse
+import importlib.util
+import json
+import os
+import re
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# Trace event of each timer callback, by the name it is reported under.
+TIMER_EVENTS = [
+    ('aic_tick', 'aic_tick'),
+    ('ipicr', 'apple_a13_ipicr_tick'),
+    ('wdt', 'apple_wdt_timer_expired'),
+    ('dwc2_sof', 'usb_dwc2_sof'),
+    ('dwc2_work', 'usb_dwc2_work_timer'),
+    ('uart_rx_timeout', 'apple_uart_rx_timeout'),
+    # The shared host timer behind aic_tick, ipicr and wdt.
+    ('deadline_sched', 'apple_deadline_sched_fire'),
+]
+
+# "1234@1700000000.123456:aic_tick " with -msg timestamp=on, else "aic_tick "
+TRACE_LINE = re.compile(r'^(?:\d+@[\d.]+:)?(\w+)')
+
+SMAPS_KEYS = ['Rss', 'Pss', 'Shared_Clean', 'Shared_Dirty',
+              'Private_Clean', 'Private_Dirty', 'Swap']
+
+
+def load_boot_bench():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'apple-boot-bench.py')
+    spec = importlib.util.spec_from_file_location('apple_boot_bench', path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def qemu_command(args, fw, boot_bench, trace_file, log_file):
+    machine = ['t8030', 'kaslr-off=true', 'ecid={}'.format(args.ecid)]
+    machine += ['{}={}'.format(key, fw[key])
+                for key in boot_bench.FIRMWARE_PROPS]
+
+    return [args.qemu, '-M', ','.join(machine),
+            '-kernel', fw['kernel'], '-dtb', fw['dtb'],
+            '-snapshot', '-loadvm', args.loadvm,
+            '-display', 'none', '-monitor', 'none', '-serial', 'null',
+            '-trace', 'events={}'.format(trace_file),
+            '-D', log_file] + fw.get('args', [])
+
+
+def cpu_seconds(pid):
+    with open('/proc/{}/stat'.format(pid), 'r') as f:
+        # The command name may hold spaces; the fields after it do not.
+        fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime, fields 14 and 15 of the whole line.
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def context_switches(pid):
+    total = 0
+    for tid in os.listdir('/proc/{}/task'.format(pid)):
+        try:
+            with open('/proc/{}/task/{}/status'.format(pid, tid), 'r') as f:
+                for line in f:
+                    # voluntary_ctxt_switches and nonvoluntary_ctxt_switches
+                    key, _, value = line.partition(':')
+                    if key.endswith('voluntary_ctxt_switches'):
+                        total += int(value)
+        except FileNotFoundError:
+            # The thread exited since the directory was listed.
+            pass
+    return total
+
+
+def memory_kib(pid):
+    mem = {}
+    with open('/proc/{}/smaps_rollup'.format(pid), 'r') as f:
+        for line in f:
+            key, _, value = line.partition(':')
+            if key in SMAPS_KEYS:
+                mem[key] = int(value.split()[0])
+    return {'rss_kib': mem.get('Rss', 0),
+            'pss_kib': mem.get('Pss', 0),
+            'shared_kib': mem.get('Shared_Clean', 0) +
+                          mem.get('Shared_Dirty', 0),
+            'private_kib': mem.get('Private_Clean', 0) +
+                           mem.get('Private_Dirty', 0),
+            'swap_kib': mem.get('Swap', 0)}
+
+
+def count_events(log_file, offset):
+    counts = {event: 0 for _, event in TIMER_EVENTS}
+    with open(log_file, 'rb') as f:
+        f.seek(offset)
+        for line in f:
+            match = TRACE_LINE.match(line.decode('utf-8', 'replace'))
+            if match and match.group(1) in counts:
+                counts[match.group(1)] += 1
+    return counts
+
+
+def sample(vm):
+    return {'time': time.monotonic(),
+            'cpu_s': cpu_seconds(vm['proc'].pid),
+            'ctxt': context_switches(vm['proc'].pid),
+            'log_offset': os.path.getsize(vm['log'])}
+
+
+def report(vm, start, end):
+    elapsed = end['time'] - start['time']
+    counts = count_events(vm['log'], start['log_offset'])
+    wakeups = {name: round(counts[event] / elapsed, 2)
+               for name, event in TIMER_EVENTS}
+    result = {'instance': vm['index'],
+              'cpu_percent': round(100 * (end['cpu_s'] - start['cpu_s']) /
+                                   elapsed, 2),
+              'wakeups_per_s': wakeups,
+              'context_switches_per_s':
+                  round((end['ctxt'] - start['ctxt']) / elapsed, 2)}
+    result.update(memory_kib(vm['proc'].pid))
+    return result
+
+
+def summarize(results):
+    summary = {'instances': len(results)}
+    for key in ['cpu_percent', 'context_switches_per_s', 'rss_kib',
+                'pss_kib', 'shared_kib', 'private_kib', 'swap_kib']:
+        summary[key] = round(sum(r[key] for r in results), 2)
+    summary['wakeups_per_s'] = {
+        name: round(sum(r['wakeups_per_s'][name] for r in results), 2)
+        for name, _ in TIMER_EVENTS}
+    return summary
+
+
+def stop(vms):
+    for vm in vms:
+        if vm['proc'].poll() is None:
+            vm['proc'].send_signal(signal.SIGTERM)
+    for vm in vms:
+        try:
+            vm['proc'].wait(timeout=30)
+        except subprocess.TimeoutExpired:
+            vm['proc'].kill()
+            vm['proc'].wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure what idle t8030 guests cost the host.')
+    parser.add_argument('-q', '--qemu', default='qemu-system-aarch64',
+                        help='QEMU binary to run (default: %(default)s)')
+    parser.add_argument('-n', '--instances', type=int, default=1,
+                        help='number of guests to run at once '
+                             '(default: %(default)s)')
+    parser.add_argument('-s', '--settle', type=float, default=60,
+                        help='seconds to let the guests settle before '
+                             'measuring (default: %(default)s)')
+    parser.add_argument('-m', '--measure', type=float, default=60,
+                        help='seconds to measure for (default: %(default)s)')
+    parser.add_argument('--ecid', default='0x1122334455667788',
+                        help='ECID of the machines (default: %(default)s)')
+    parser.add_argument('--loadvm', required=True,
+                        help='internal snapshot of a booted guest to start '
+                             'from')
+    parser.add_argument('firmware', help='firmware set JSON file')
+    args = parser.parse_args()
+
+    boot_bench = load_boot_bench()
+    fw = boot_bench.load_firmware_set(args.firmware)
+
+    with tempfile.TemporaryDirectory(prefix='apple-idle-bench-') as tmp:
+        trace_file = os.path.join(tmp, 'events')
+        with open(trace_file, 'w') as f:
+            f.write(''.join(event + '\n' for _, event in TIMER_EVENTS))
+
+        vms = []
+        try:
+            for index in range(args.instances):
+                log_file = os.path.join(tmp, 'trace-{}.log'.format(index))
+                cmd = qemu_command(args, fw, boot_bench, trace_file,
+                                   log_file)
+                open(log_file, 'w').close()
+                proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                                        stdout=subprocess.DEVNULL)
+                vms.append({'index': index, 'proc': proc, 'log': log_file})
+
+            time.sleep(args.settle)
+            for vm in vms:
+                if vm['proc'].poll() is not None:
+                    sys.exit('Instance {} exited with status {}'.format(
+                        vm['index'], vm['proc'].returncode))
+
+            starts = [sample(vm) for vm in vms]
+            time.sleep(args.measure)
+            ends = [sample(vm) for vm in vms]
+
+            results = [report(vm, start, end)
+                       for vm, start, end in zip(vms, starts, ends)]
+            for result in results:
+                print(json.dumps(result), flush=True)
+            print(json.dumps({'summary': summarize(results)}), flush=True)
+        finally:
+            stop(vms)
+
+
+if __name__ == '__main__':
+    main()
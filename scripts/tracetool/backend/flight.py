@@ -0,0 +1,48 @@
+# -*- coding: utf-8 -*-
+
+"""
+Always-on per-thread ring buffer for "flight" events, dumped post-mortem.
+"""
+
+__license__    = "GPL version 2 or (at your option) any later version"
+
+
+from tracetool import out
+from tracetool.backend.simple import is_string
+
+
+PUBLIC = True
+
+
+def generate_h_begin(events, group):
+    out('#include "trace/flight.h"',
+        '')
+
+
+def generate_h(event, group):
+    if "flight" not in event.properties:
+        return
+
+    out('    {',
+        '        FlightRecord *_rec = flight_record_begin(&%(event_obj)s, %(nargs)d);',
+        event_obj=event.api(event.QEMU_EVENT),
+        nargs=len(event.args))
+
+    for i, (type_, name) in enumerate(event.args):
+        if is_string(type_):
+            out('        flight_record_str(_rec, %(i)d, %(name)s);',
+                i=i, name=name)
+        elif type_.endswith('*'):
+            out('        _rec->args[%(i)d] = (uintptr_t)%(name)s;',
+                i=i, name=name)
+        else:
+            out('        _rec->args[%(i)d] = (uint64_t)%(name)s;',
+                i=i, name=name)
+
+    out('        flight_record_end();',
+        '    }')
+
+
+def generate_h_backend_dstate(event, group):
+    if "flight" in event.properties:
+        out('    true || \\')
@@ -91,6 +91,10 @@ static void print_stats_results(Monitor *mon, StatsTarget target,
         monitor_printf(mon, "provider: %s\n",
                        StatsProvider_str(result->provider));
     }
+    if ((target == STATS_TARGET_IOMMU || target == STATS_TARGET_DEVICE) &&
+        result->qom_path) {
+        monitor_printf(mon, "  %s\n", result->qom_path);
+    }
 
     for (stats_list = result->stats; stats_list;
              stats_list = stats_list->next,
@@ -156,6 +160,8 @@ static StatsFilter *stats_filter(StatsTarget target, const char *names,
         break;
     }
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_IOMMU:
+    case STATS_TARGET_DEVICE:
         break;
     default:
         break;
@@ -229,6 +235,8 @@ void hmp_info_stats(Monitor *mon, const QDict *qdict)
         filter = stats_filter(target, names, cpu_index, provider);
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_IOMMU:
+    case STATS_TARGET_DEVICE:
         filter = stats_filter(target, names, -1, provider);
         break;
     default:
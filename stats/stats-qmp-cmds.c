@@ -65,6 +65,8 @@ static bool invoke_stats_cb(StatsCallbacks *entry,
         }
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_IOMMU:
+    case STATS_TARGET_DEVICE:
         break;
     default:
         abort();
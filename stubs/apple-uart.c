@@ -0,0 +1,22 @@
+/*
+ * Apple silicon UART QMP stubs
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-char.h"
+
+void qmp_apple_uart_write(const char *device, const char *data,
+                          bool has_format, DataFormat format, Error **errp)
+{
+    error_setg(errp, "Apple UART support is not built in");
+}
+
+char *qmp_apple_uart_read(const char *device, int64_t size, bool has_format,
+                          DataFormat format, Error **errp)
+{
+    error_setg(errp, "Apple UART support is not built in");
+    return NULL;
+}
@@ -26,6 +26,7 @@
 #include "trace.h"
 
 #include "exec/memory-internal.h"
+#include "exec/mmio-profile.h"
 #include "exec/ram_addr.h"
 #include "sysemu/kvm.h"
 #include "sysemu/runstate.h"
@@ -41,6 +42,7 @@ static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 unsigned int global_dirty_tracking;
+bool memory_region_count_accesses;
 
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -1445,6 +1447,7 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
 {
     unsigned size = memop_size(op);
     MemTxResult r;
+    int64_t start;
 
     if (mr->alias) {
         return memory_region_dispatch_read(mr->alias,
@@ -1456,7 +1459,12 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (unlikely(qatomic_read(&memory_region_count_accesses))) {
+        stat64_add(&mr->accesses, 1);
+    }
+    start = mmio_profile_begin();
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    mmio_profile_end(mr, addr, false, start);
     adjust_endianness(mr, pval, op);
     return r;
 }
@@ -1487,6 +1495,28 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
+static MemTxResult memory_region_dispatch_write1(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 uint64_t data,
+                                                 unsigned size,
+                                                 MemTxAttrs attrs)
+{
+    if (mr->ops->write) {
+        return access_with_adjusted_size(addr, &data, size,
+                                         mr->ops->impl.min_access_size,
+                                         mr->ops->impl.max_access_size,
+                                         memory_region_write_accessor, mr,
+                                         attrs);
+    } else {
+        return
+            access_with_adjusted_size(addr, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_write_with_attrs_accessor,
+                                      mr, attrs);
+    }
+}
+
 MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          hwaddr addr,
                                          uint64_t data,
@@ -1494,6 +1524,8 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          MemTxAttrs attrs)
 {
     unsigned size = memop_size(op);
+    MemTxResult r;
+    int64_t start;
 
     if (mr->alias) {
         return memory_region_dispatch_write(mr->alias,
@@ -1507,6 +1539,9 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
 
     adjust_endianness(mr, &data, op);
 
+    if (unlikely(qatomic_read(&memory_region_count_accesses))) {
+        stat64_add(&mr->accesses, 1);
+    }
     /*
      * FIXME: it's not clear why under KVM the write would be processed
      * directly, instead of going through eventfd.  This probably should
@@ -1517,20 +1552,20 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
-    if (mr->ops->write) {
-        return access_with_adjusted_size(addr, &data, size,
-                                         mr->ops->impl.min_access_size,
-                                         mr->ops->impl.max_access_size,
-                                         memory_region_write_accessor, mr,
-                                         attrs);
-    } else {
-        return
-            access_with_adjusted_size(addr, &data, size,
-                                      mr->ops->impl.min_access_size,
-                                      mr->ops->impl.max_access_size,
-                                      memory_region_write_with_attrs_accessor,
-                                      mr, attrs);
-    }
+    start = mmio_profile_begin();
+    r = memory_region_dispatch_write1(mr, addr, data, size, attrs);
+    mmio_profile_end(mr, addr, true, start);
+    return r;
+}
+
+uint64_t memory_region_get_accesses(MemoryRegion *mr)
+{
+    return stat64_get(&mr->accesses);
+}
+
+void memory_region_enable_access_counting(void)
+{
+    qatomic_set(&memory_region_count_accesses, true);
 }
 
 void memory_region_init_io(MemoryRegion *mr,
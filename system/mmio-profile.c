@@ -0,0 +1,201 @@
+/*
+ * Per-register MMIO access profiling
+ *
+ * Counts every access dispatched to an MMIO MemoryRegion, keyed by region
+ * and offset, together with a coarse histogram of the host time spent in
+ * the device model. Meant to find the registers worth turning into
+ * RAM-backed or otherwise cheaper fast paths.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/memory.h"
+#include "exec/mmio-profile.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/thread.h"
+
+/* Bucket i >= 1 holds accesses of [250 << (i - 1), 250 << i) ns. */
+#define MMIO_PROFILE_BUCKETS (8)
+#define MMIO_PROFILE_BUCKET_NS (250)
+
+typedef struct {
+    MemoryRegion *mr;
+    hwaddr addr;
+} MMIOProfileKey;
+
+typedef struct {
+    MMIOProfileKey key;
+    char *name;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t total_ns;
+    uint64_t hist[MMIO_PROFILE_BUCKETS];
+} MMIOProfileEntry;
+
+bool mmio_profile_enabled;
+
+static QemuMutex mmio_profile_lock;
+static GHashTable *mmio_profile_table;
+
+static guint mmio_profile_hash(gconstpointer p)
+{
+    const MMIOProfileKey *key = p;
+
+    return g_direct_hash(key->mr) ^ g_int64_hash(&key->addr);
+}
+
+static gboolean mmio_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const MMIOProfileKey *ka = a;
+    const MMIOProfileKey *kb = b;
+
+    return ka->mr == kb->mr && ka->addr == kb->addr;
+}
+
+static void mmio_profile_entry_free(gpointer p)
+{
+    MMIOProfileEntry *entry = p;
+
+    g_free(entry->name);
+    g_free(entry);
+}
+
+static void __attribute__((constructor)) mmio_profile_init(void)
+{
+    qemu_mutex_init(&mmio_profile_lock);
+    mmio_profile_table =
+        g_hash_table_new_full(mmio_profile_hash, mmio_profile_equal, NULL,
+                              mmio_profile_entry_free);
+}
+
+void mmio_profile_enable(void)
+{
+    qatomic_set(&mmio_profile_enabled, true);
+}
+
+void mmio_profile_disable(void)
+{
+    qatomic_set(&mmio_profile_enabled, false);
+}
+
+void mmio_profile_reset(void)
+{
+    qemu_mutex_lock(&mmio_profile_lock);
+    g_hash_table_remove_all(mmio_profile_table);
+    qemu_mutex_unlock(&mmio_profile_lock);
+}
+
+void mmio_profile_record(MemoryRegion *mr, hwaddr addr, bool is_write,
+                         int64_t start)
+{
+    uint64_t ns = get_clock() - start;
+    MMIOProfileKey key = { .mr = mr, .addr = addr };
+    MMIOProfileEntry *entry;
+    unsigned int bucket;
+
+    bucket = ns < MMIO_PROFILE_BUCKET_NS ?
+                 0 :
+                 MIN(MMIO_PROFILE_BUCKETS - 1,
+                     64 - clz64(ns / MMIO_PROFILE_BUCKET_NS));
+
+    qemu_mutex_lock(&mmio_profile_lock);
+    entry = g_hash_table_lookup(mmio_profile_table, &key);
+    if (entry == NULL) {
+        entry = g_new0(MMIOProfileEntry, 1);
+        entry->key = key;
+        /* Copied, the region may be gone by the time the table is shown. */
+        entry->name = g_strdup(memory_region_name(mr));
+        g_hash_table_insert(mmio_profile_table, &entry->key, entry);
+    }
+    if (is_write) {
+        entry->writes++;
+    } else {
+        entry->reads++;
+    }
+    entry->total_ns += ns;
+    entry->hist[bucket]++;
+    qemu_mutex_unlock(&mmio_profile_lock);
+}
+
+static gint mmio_profile_cmp_count(gconstpointer a, gconstpointer b)
+{
+    const MMIOProfileEntry *ea = *(MMIOProfileEntry *const *)a;
+    const MMIOProfileEntry *eb = *(MMIOProfileEntry *const *)b;
+    uint64_t ca = ea->reads + ea->writes;
+    uint64_t cb = eb->reads + eb->writes;
+
+    return ca > cb ? -1 : ca < cb;
+}
+
+static gint mmio_profile_cmp_time(gconstpointer a, gconstpointer b)
+{
+    const MMIOProfileEntry *ea = *(MMIOProfileEntry *const *)a;
+    const MMIOProfileEntry *eb = *(MMIOProfileEntry *const *)b;
+
+    return ea->total_ns > eb->total_ns ? -1 : ea->total_ns < eb->total_ns;
+}
+
+void hmp_mmio_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_try_str(qdict, "op");
+
+    if (op == NULL) {
+        monitor_printf(mon, "mmio-profile is %s\n",
+                       qatomic_read(&mmio_profile_enabled) ? "on" : "off");
+        return;
+    }
+    if (!strcmp(op, "on")) {
+        mmio_profile_enable();
+    } else if (!strcmp(op, "off")) {
+        mmio_profile_disable();
+    } else if (!strcmp(op, "reset")) {
+        mmio_profile_reset();
+    } else {
+        Error *err = NULL;
+
+        error_setg(&err, "invalid parameter '%s',"
+                   " expecting 'on', 'off', or 'reset'", op);
+        hmp_handle_error(mon, err);
+    }
+}
+
+void hmp_info_mmio_profile(Monitor *mon, const QDict *qdict)
+{
+    bool by_time = qdict_get_try_bool(qdict, "time", false);
+    int64_t max = qdict_get_try_int(qdict, "max", 20);
+    g_autoptr(GPtrArray) entries = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer value;
+
+    qemu_mutex_lock(&mmio_profile_lock);
+    g_hash_table_iter_init(&iter, mmio_profile_table);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(entries, value);
+    }
+    g_ptr_array_sort(entries, by_time ? mmio_profile_cmp_time :
+                                        mmio_profile_cmp_count);
+
+    monitor_printf(mon,
+                   "%-32s %10s %12s %12s %10s  "
+                   "<250ns <500ns <1us <2us <4us <8us <16us >=16us\n",
+                   "Region", "Offset", "Reads", "Writes", "Mean ns");
+    for (guint i = 0; i < entries->len && (max <= 0 || i < max); i++) {
+        const MMIOProfileEntry *entry = g_ptr_array_index(entries, i);
+        uint64_t count = entry->reads + entry->writes;
+
+        monitor_printf(mon, "%-32s 0x%08" HWADDR_PRIx " %12" PRIu64
+                       " %12" PRIu64 " %10" PRIu64 " ",
+                       entry->name, entry->key.addr, entry->reads,
+                       entry->writes, entry->total_ns / count);
+        for (int b = 0; b < MMIO_PROFILE_BUCKETS; b++) {
+            monitor_printf(mon, " %" PRIu64, entry->hist[b]);
+        }
+        monitor_printf(mon, "\n");
+    }
+    qemu_mutex_unlock(&mmio_profile_lock);
+}
@@ -60,6 +60,7 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/tpm.h"
 #include "trace.h"
+#include "trace/flight.h"
 
 static NotifierList exit_notifiers =
     NOTIFIER_LIST_INITIALIZER(exit_notifiers);
@@ -522,6 +523,7 @@ static void qemu_system_wakeup(void)
 void qemu_system_guest_panicked(GuestPanicInformation *info)
 {
     qemu_log_mask(LOG_GUEST_ERROR, "Guest crashed");
+    flight_dump("guest panic");
 
     if (current_cpu) {
         current_cpu->crash_occurred = true;
@@ -560,6 +562,8 @@ void qemu_system_guest_panicked(GuestPanicInformation *info)
                           S390CrashReason_str(info->u.s390.reason),
                           info->u.s390.psw_mask,
                           info->u.s390.psw_addr);
+        } else if (info->type == GUEST_PANIC_INFORMATION_TYPE_XNU) {
+            qemu_log_mask(LOG_GUEST_ERROR, ": %s\n", info->u.xnu.message);
         }
         qapi_free_GuestPanicInformation(info);
     }
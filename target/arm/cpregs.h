@@ -126,6 +126,12 @@ enum {
      * equivalent EL1 register when FEAT_NV2 is enabled.
      */
     ARM_CP_NV2_REDIRECT          = 1 << 20,
+    /*
+     * Flag: Register is only accessible in Apple's GXF guarded execution
+     * and UNDEFs outside it. Guarded execution is part of the TB flags,
+     * so the check is made at translation time, not by an accessfn.
+     */
+    ARM_CP_GXF                   = 1 << 21,
 };
 
 /*
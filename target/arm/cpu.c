@@ -125,13 +125,30 @@ void arm_restore_state_to_opc(CPUState *cs,
 static bool arm_cpu_has_work(CPUState *cs)
 {
     ARMCPU *cpu = ARM_CPU(cs);
+    CPUARMState *env = &cpu->env;
 
     return (cpu->power_state != PSCI_OFF)
-        && cs->interrupt_request &
-        (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
-         | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ | CPU_INTERRUPT_VSERR
-         | CPU_INTERRUPT_EXITTB);
+        && ((cs->interrupt_request &
+             (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
+              | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ | CPU_INTERRUPT_VSERR
+              | CPU_INTERRUPT_EXITTB)) ||
+            (qatomic_read(&env->wfe_halted) &&
+             qatomic_read(&env->event_register)));
+}
+
+#ifndef CONFIG_USER_ONLY
+/* Wakes a WFE halt that nothing else has ended in time. */
+static void arm_wfe_timer_cb(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+    CPUState *cs = CPU(cpu);
+
+    if (qatomic_read(&cs->halted) && qatomic_read(&cpu->env.wfe_halted)) {
+        qatomic_set(&cpu->env.event_register, 1);
+        qemu_cpu_kick(cs);
+    }
 }
+#endif
 
 static int arm_cpu_mmu_index(CPUState *cs, bool ifetch)
 {
@@ -160,6 +177,22 @@ void arm_register_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
     QLIST_INSERT_HEAD(&cpu->el_change_hooks, entry, node);
 }
 
+void arm_set_hypercall_handler(ARMCPU *cpu, uint16_t imm, ARMHypercallFn *fn,
+                               void *opaque)
+{
+    cpu->hypercall = fn;
+    cpu->hypercall_opaque = opaque;
+    cpu->hypercall_imm = imm;
+}
+
+bool arm_is_hypercall(ARMCPU *cpu, uint32_t syndrome)
+{
+    return cpu->hypercall != NULL &&
+           !arm_feature(&cpu->env, ARM_FEATURE_EL2) &&
+           syn_get_ec(syndrome) == EC_AA64_HVC &&
+           extract32(syndrome, 0, 16) == cpu->hypercall_imm;
+}
+
 static void cp_reg_reset(gpointer key, gpointer value, gpointer opaque)
 {
     /* Reset a single ARMCPRegInfo register */
@@ -950,9 +983,9 @@ static void arm_cpu_set_irq(void *opaque, int irq, int level)
     }
 
     if (level) {
-        env->irq_line_state |= mask[irq];
+        qatomic_or(&env->irq_line_state, mask[irq]);
     } else {
-        env->irq_line_state &= ~mask[irq];
+        qatomic_and(&env->irq_line_state, ~mask[irq]);
     }
 
     switch (irq) {
@@ -1764,6 +1797,9 @@ static void arm_cpu_finalizefn(Object *obj)
     if (cpu->pmu_timer) {
         timer_free(cpu->pmu_timer);
     }
+    if (cpu->wfe_timer) {
+        timer_free(cpu->wfe_timer);
+    }
 #endif
 }
 
@@ -1916,6 +1952,11 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
         cpu->gt_timer[GTIMER_HYPVIRT] = timer_new(QEMU_CLOCK_VIRTUAL, scale,
                                                   arm_gt_hvtimer_cb, cpu);
     }
+
+    if (tcg_enabled() && arm_feature(env, ARM_FEATURE_WFE_EVENT)) {
+        cpu->wfe_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, arm_wfe_timer_cb,
+                                      cpu);
+    }
 #endif
 
     cpu_exec_realizefn(cs, &local_err);
@@ -2543,6 +2584,7 @@ static void arm_cpu_class_init(ObjectClass *oc, void *data)
     cc->gdb_write_register = arm_cpu_gdb_write_register;
 #ifndef CONFIG_USER_ONLY
     cc->sysemu_ops = &arm_sysemu_ops;
+    cc->memory_rw_debug = arm_cpu_memory_rw_debug;
 #endif
     cc->gdb_arch_name = arm_gdb_arch_name;
     cc->gdb_stop_before_watchpoint = true;
@@ -580,8 +580,46 @@ typedef struct CPUArchState {
         uint64_t sprr_el_br_el1[4][2];
         uint64_t sprr_config_el[4];
         uint64_t mprr_el_br_el1[4][2];
+        /*
+         * Permissions decoded from sprr_el_br_el1[el][el] for EL0/EL1,
+         * indexed by [el][guarded][sprr_idx]. prot_lut_key holds the
+         * register value the table was built from; a zeroed table is
+         * the valid decoding of a zero register.
+         */
+        uint64_t prot_lut_key[2];
+        uint8_t prot_lut[2][2][16];
     } sprr;
 
+    /*
+     * Apple AMX coprocessor: eight 64-byte X and Y registers and a 64x64
+     * byte Z matrix, held in guest memory byte order. ctl is AMX_CTL_EL1,
+     * enabled tracks the AMX set/clr instructions.
+     */
+    struct {
+        uint8_t x[8][64];
+        uint8_t y[8][64];
+        uint8_t z[64][64];
+        uint64_t ctl;
+        bool enabled;
+    } amx;
+
+    /*
+     * Apple implementation-defined PMU. insns counts the instructions TCG
+     * has run at each EL, last how many of those the counters have seen
+     * and limit when TCG has to call out to check for an overflow.
+     */
+    struct {
+        uint64_t pmc[10];
+        uint64_t pmcr0;
+        uint64_t pmcr1;
+        uint64_t pmesr[2];
+        uint64_t pmsr;
+        uint64_t insns[4];
+        uint64_t last[4];
+        uint64_t limit[4];
+        bool pmi;
+    } apple_pmc;
+
     struct {
         /* M profile has up to 4 stack pointers:
          * a Main Stack Pointer and a Process Stack Pointer for each
@@ -727,6 +765,13 @@ typedef struct CPUArchState {
      * semantics of these fields are baked into the migration format.
      */
     uint64_t exclusive_high;
+    /*
+     * The event register, and whether the CPU last halted in WFE rather
+     * than WFI. Only used with ARM_FEATURE_WFE_EVENT, where SEV on any
+     * vCPU sets event_register on all of them.
+     */
+    uint32_t event_register;
+    uint32_t wfe_halted;
 
     /* iwMMXt coprocessor state.  */
     struct {
@@ -747,6 +792,18 @@ typedef struct CPUArchState {
         ARMPACKey m;
     } keys;
 
+    /*
+     * VA parameters used by the PAC instructions, decoded for the last
+     * stage 1 regime and TCR value they ran under. mmu_idx 0 is not a
+     * valid A-profile index, so a zeroed cache is empty.
+     */
+    struct {
+        uint64_t tcr;
+        uint32_t mmu_idx;
+        uint8_t tsz[2][2]; /* [data][select] */
+        uint8_t tbi[2][2];
+    } pauth_va;
+
     uint64_t scxtnum_el[4];
 
     /*
@@ -857,6 +914,13 @@ struct ARMELChangeHook {
     QLIST_ENTRY(ARMELChangeHook) node;
 };
 
+/**
+ * ARMHypercallFn:
+ * type of a function which can be registered via arm_set_hypercall_handler()
+ * to handle paravirtual hypercalls from the guest.
+ */
+typedef void ARMHypercallFn(ARMCPU *cpu, void *opaque);
+
 /* These values map onto the return values for
  * QEMU_PSCI_0_2_FN_AFFINITY_INFO */
 typedef enum ARMPSCIState {
@@ -880,6 +944,15 @@ typedef struct {
     uint32_t map, init, supported;
 } ARMVQMap;
 
+#define ARM_DEBUG_TLB_SIZE 256
+#define ARM_DEBUG_TLB_CTX 10
+
+typedef struct ARMDebugTLBEntry {
+    vaddr page; /* bit 0 set when valid */
+    hwaddr phys;
+    MemTxAttrs attrs;
+} ARMDebugTLBEntry;
+
 /**
  * ARMCPU:
  * @env: #CPUARMState
@@ -925,12 +998,16 @@ struct ArchCPU {
      * pmu_op_finish() - it does not need other handling during migration
      */
     QEMUTimer *pmu_timer;
+    /* Bounds a WFE halt, see HELPER(wfe) */
+    QEMUTimer *wfe_timer;
     /* GPIO outputs for generic timer */
     qemu_irq gt_timer_outputs[NUM_GTIMERS];
     /* GPIO output for GICv3 maintenance interrupt signal */
     qemu_irq gicv3_maintenance_interrupt;
     /* GPIO output for the PMU interrupt */
     qemu_irq pmu_interrupt;
+    /* Apple PMU interrupt, a FIQ source */
+    qemu_irq apple_pmi;
 
     /* MemoryRegion to use for secure physical accesses */
     MemoryRegion *secure_memory;
@@ -1132,6 +1209,11 @@ struct ArchCPU {
     QLIST_HEAD(, ARMELChangeHook) pre_el_change_hooks;
     QLIST_HEAD(, ARMELChangeHook) el_change_hooks;
 
+    /* Handler of "HVC #hypercall_imm", see arm_set_hypercall_handler() */
+    ARMHypercallFn *hypercall;
+    void *hypercall_opaque;
+    uint16_t hypercall_imm;
+
     int32_t node_id; /* NUMA node this CPU belongs to */
 
     /* Used to synchronize KVM and QEMU in-kernel device levels */
@@ -1155,6 +1237,15 @@ struct ArchCPU {
     /* Apple PAC boot diversifier */
     uint64_t m_key_lo;
     uint64_t m_key_hi;
+
+#ifndef CONFIG_USER_ONLY
+    /*
+     * Debug translations, kept while the VM is stopped and valid for one
+     * translation context, see arm_cpu_get_phys_page_attrs_debug().
+     */
+    ARMDebugTLBEntry debug_tlb[ARM_DEBUG_TLB_SIZE];
+    uint64_t debug_tlb_ctx[ARM_DEBUG_TLB_CTX];
+#endif
 };
 
 typedef struct ARMCPUInfo {
@@ -1219,6 +1310,9 @@ void arm_v7m_cpu_do_interrupt(CPUState *cpu);
 
 hwaddr arm_cpu_get_phys_page_attrs_debug(CPUState *cpu, vaddr addr,
                                          MemTxAttrs *attrs);
+int arm_cpu_memory_rw_debug(CPUState *cpu, vaddr addr, uint8_t *buf, int len,
+                            bool is_write);
+void arm_debug_tlb_flush(ARMCPU *cpu);
 #endif /* !CONFIG_USER_ONLY */
 
 int arm_cpu_gdb_read_register(CPUState *cpu, GByteArray *buf, int reg);
@@ -2433,6 +2527,9 @@ enum arm_features {
     ARM_FEATURE_M_MAIN, /* M profile Main Extension */
     ARM_FEATURE_V8_1M, /* M profile extras only in v8.1M and later */
     ARM_FEATURE_GXF, /* has Apple's GXF support */
+    ARM_FEATURE_AMX, /* has Apple's AMX coprocessor */
+    ARM_FEATURE_APPLE_PMC, /* has Apple's PMCs, counted by TCG */
+    ARM_FEATURE_WFE_EVENT, /* WFE halts until an event, TCG only */
 };
 
 static inline int arm_feature(CPUARMState *env, int feature)
@@ -3314,6 +3411,17 @@ void arm_register_pre_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
 void arm_register_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook, void
         *opaque);
 
+/**
+ * arm_set_hypercall_handler:
+ * Make AArch64 "HVC #imm" with the given immediate call @fn instead of
+ * UNDEFing, on a CPU without EL2. The function runs in place of the
+ * exception, with the guest registers as they were after the HVC and the
+ * PC on the next instruction, and is passed a pointer to the ARMCPU and
+ * @opaque. HVC with other immediates behaves as before.
+ */
+void arm_set_hypercall_handler(ARMCPU *cpu, uint16_t imm, ARMHypercallFn *fn,
+                               void *opaque);
+
 /**
  * arm_rebuild_hflags:
  * Rebuild the cached TBFLAGS for arbitrary changed processor state.
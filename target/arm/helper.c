@@ -1284,6 +1284,152 @@ static void pmu_update_irq(CPUARMState *env)
             (env->cp15.c9_pminten & env->cp15.c9_pmovsr));
 }
 
+/*
+ * Apple implementation-defined PMU. TCG adds each TB's instruction count
+ * to apple_pmc.insns[el] as the TB starts and calls arm_apple_pmc_sync()
+ * once that passes apple_pmc.limit[el]. The cycle counter is estimated
+ * as one cycle per instruction.
+ */
+#define APPLE_PMC_WIDTH 48
+#define APPLE_PMC_OVF (1ULL << 47)
+#define APPLE_PMCR0_IMODE_FIQ 4
+#define APPLE_PMCR0_IACT (1ULL << 11)
+#define APPLE_EVENT_CYCLES 0x02
+#define APPLE_EVENT_INSNS 0x8c
+
+/* PMC0-7 use bits 0-7 of a field, PMC8-9 bits 32-33 of it. */
+static bool apple_pmc_bit(uint64_t reg, int shift, int counter)
+{
+    return extract64(reg, counter < 8 ? shift + counter :
+                     shift + 32 + counter - 8, 1);
+}
+
+static bool apple_pmc_counts_insns(CPUARMState *env, int counter)
+{
+    int event;
+
+    if (!apple_pmc_bit(env->apple_pmc.pmcr0, 0, counter)) {
+        return false;
+    }
+    if (counter < 2) {
+        return true;
+    }
+    event = extract64(env->apple_pmc.pmesr[(counter - 2) / 4],
+                      ((counter - 2) % 4) * 8, 8);
+    return event == APPLE_EVENT_CYCLES || event == APPLE_EVENT_INSNS;
+}
+
+/* Bit 8 + n of PMCR1 enables counting at EL0, bit 16 + n at EL1. */
+static bool apple_pmc_counts_el(CPUARMState *env, int counter, int el)
+{
+    return el < 2 && apple_pmc_bit(env->apple_pmc.pmcr1, 8 + el * 8, counter);
+}
+
+static bool apple_pmc_pmi_enabled(CPUARMState *env, int counter)
+{
+    return apple_pmc_bit(env->apple_pmc.pmcr0, 12, counter);
+}
+
+void arm_apple_pmc_sync(CPUARMState *env)
+{
+    uint64_t delta[4];
+    int i, el;
+
+    for (el = 0; el < 4; el++) {
+        delta[el] = env->apple_pmc.insns[el] - env->apple_pmc.last[el];
+        env->apple_pmc.last[el] = env->apple_pmc.insns[el];
+    }
+
+    for (i = 0; i < ARRAY_SIZE(env->apple_pmc.pmc); i++) {
+        uint64_t old = env->apple_pmc.pmc[i];
+        uint64_t sum = old;
+
+        if (!apple_pmc_counts_insns(env, i)) {
+            continue;
+        }
+        for (el = 0; el < 4; el++) {
+            if (apple_pmc_counts_el(env, i, el)) {
+                sum += delta[el];
+            }
+        }
+        if (sum == old) {
+            continue;
+        }
+        env->apple_pmc.pmc[i] = extract64(sum, 0, APPLE_PMC_WIDTH);
+        /* Overflow is bit 47 becoming set, kpc reloads to just below it */
+        if ((!(old & APPLE_PMC_OVF) && sum >= APPLE_PMC_OVF) ||
+            sum >= (1ULL << APPLE_PMC_WIDTH) + APPLE_PMC_OVF) {
+            env->apple_pmc.pmsr |= 1ULL << i;
+            if (apple_pmc_pmi_enabled(env, i)) {
+                env->apple_pmc.pmcr0 |= APPLE_PMCR0_IACT;
+            }
+        }
+    }
+}
+
+/*
+ * Recompute when TCG next has to call in, and the PMI level. The caller
+ * has synced the counters.
+ */
+void arm_apple_pmc_update(CPUARMState *env)
+{
+    ARMCPU *cpu = env_archcpu(env);
+    uint64_t remaining[4] = { UINT64_MAX, UINT64_MAX, UINT64_MAX,
+                              UINT64_MAX };
+    bool pmi;
+    int i, el;
+
+    for (i = 0; i < ARRAY_SIZE(env->apple_pmc.pmc); i++) {
+        uint64_t left;
+        int els = 0;
+
+        if (!apple_pmc_counts_insns(env, i) ||
+            !apple_pmc_pmi_enabled(env, i)) {
+            continue;
+        }
+        for (el = 0; el < 4; el++) {
+            els += apple_pmc_counts_el(env, i, el);
+        }
+        if (els == 0) {
+            continue;
+        }
+        left = env->apple_pmc.pmc[i] & APPLE_PMC_OVF ?
+                   (1ULL << APPLE_PMC_WIDTH) - env->apple_pmc.pmc[i] +
+                       APPLE_PMC_OVF :
+                   APPLE_PMC_OVF - env->apple_pmc.pmc[i];
+        /*
+         * A counter fed by several ELs gets a share of its headroom in
+         * each, so the sum cannot pass it unseen; the share shrinks as
+         * the overflow nears.
+         */
+        left = MAX(left / els, 1);
+        for (el = 0; el < 4; el++) {
+            if (apple_pmc_counts_el(env, i, el)) {
+                remaining[el] = MIN(remaining[el], left);
+            }
+        }
+    }
+    for (el = 0; el < 4; el++) {
+        env->apple_pmc.limit[el] = remaining[el] == UINT64_MAX ?
+                                       UINT64_MAX :
+                                       env->apple_pmc.insns[el] +
+                                           remaining[el];
+    }
+
+    pmi = (env->apple_pmc.pmcr0 & APPLE_PMCR0_IACT) &&
+          extract64(env->apple_pmc.pmcr0, 8, 3) == APPLE_PMCR0_IMODE_FIQ;
+    if (pmi != env->apple_pmc.pmi) {
+        env->apple_pmc.pmi = pmi;
+        if (bql_locked()) {
+            qemu_set_irq(cpu->apple_pmi, pmi);
+        } else {
+            bql_lock();
+            qemu_set_irq(cpu->apple_pmi, pmi);
+            bql_unlock();
+        }
+    }
+}
+
 static bool pmccntr_clockdiv_enabled(CPUARMState *env)
 {
     /*
@@ -5001,6 +5147,77 @@ static void tlbi_aa64_vmalle1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
     tlb_flush_by_mmuidx_all_cpus_synced(cs, mask);
 }
 
+/*
+ * The softmmu TLB is not tagged with ASIDs: a vCPU flushes it whenever its
+ * own ASID changes (see vmsa_ttbr_write and vmsa_tcr_el12_write). So the
+ * non-global entries of an ASID, the only ones TLBI ASIDE1* invalidates,
+ * can only be cached by the vCPUs currently running with that ASID.
+ */
+static bool tlbi_asid_cached(CPUARMState *env, uint16_t asid)
+{
+    uint64_t tcr = env->cp15.tcr_el[1];
+    uint64_t ttbr;
+
+    /* With EL2 the VMID matters too; don't bother. */
+    if (!is_a64(env) || arm_is_el2_enabled(env)) {
+        return true;
+    }
+
+    ttbr = tcr & TTBCR_A1 ? env->cp15.ttbr1_el[1] : env->cp15.ttbr0_el[1];
+    if (!extract64(tcr, 36, 1)) { /* AS: 8-bit ASIDs */
+        return extract64(ttbr, 48, 8) == (asid & 0xff);
+    }
+    return extract64(ttbr, 48, 16) == asid;
+}
+
+static void tlbi_aside1_sync_work(CPUState *cs, run_on_cpu_data data)
+{
+    CPUARMState *env = cpu_env(cs);
+
+    if (tlbi_asid_cached(env, data.host_int)) {
+        tlb_flush_by_mmuidx(cs, vae1_tlbmask(env));
+    }
+}
+
+static void tlbi_aa64_aside1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                     uint64_t value)
+{
+    CPUState *cs = env_cpu(env);
+    CPUState *other;
+    uint16_t asid = extract64(value, 48, 16);
+    bool synced = false;
+
+    CPU_FOREACH(other) {
+        if (other != cs && tlbi_asid_cached(cpu_env(other), asid)) {
+            tlb_flush_by_mmuidx(other, vae1_tlbmask(cpu_env(other)));
+            synced = true;
+        }
+    }
+
+    /*
+     * Like tlb_flush_by_mmuidx_all_cpus_synced, wait for the others to
+     * finish, but only when any of them had something to flush.
+     */
+    if (synced) {
+        async_safe_run_on_cpu(cs, tlbi_aside1_sync_work,
+                              RUN_ON_CPU_HOST_INT(asid));
+    } else if (tlbi_asid_cached(env, asid)) {
+        tlb_flush_by_mmuidx(cs, vae1_tlbmask(env));
+    }
+}
+
+static void tlbi_aa64_aside1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    CPUState *cs = env_cpu(env);
+
+    if (tlb_force_broadcast(env)) {
+        tlbi_aa64_aside1is_write(env, ri, value);
+    } else if (tlbi_asid_cached(env, extract64(value, 48, 16))) {
+        tlb_flush_by_mmuidx(cs, vae1_tlbmask(env));
+    }
+}
+
 static void tlbi_aa64_vmalle1_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                     uint64_t value)
 {
@@ -5726,7 +5943,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlbis, .type = ARM_CP_NO_RAW,
       .fgt = FGT_TLBIASIDE1IS,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_VAAE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlbis, .type = ARM_CP_NO_RAW,
@@ -5756,7 +5973,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
       .fgt = FGT_TLBIASIDE1,
-      .writefn = tlbi_aa64_vmalle1_write },
+      .writefn = tlbi_aa64_aside1_write },
     { .name = "TLBI_VAAE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
@@ -8010,7 +8227,7 @@ static const ARMCPRegInfo tlbios_reginfo[] = {
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 1, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlbos, .type = ARM_CP_NO_RAW,
       .fgt = FGT_TLBIASIDE1OS,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_VAAE1OS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 1, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlbos, .type = ARM_CP_NO_RAW,
@@ -11573,6 +11790,46 @@ static bool syndrome_is_sync_extabt(uint32_t syndrome)
     }
 }
 
+unsigned int aarch64_entry_pstate_mode(CPUARMState *env, unsigned int new_el,
+                                       unsigned int old_mode,
+                                       unsigned int new_mode)
+{
+    ARMCPU *cpu = env_archcpu(env);
+
+    if (cpu_isar_feature(aa64_pan, cpu)) {
+        /* The value of PSTATE.PAN is normally preserved, except when ... */
+        new_mode |= old_mode & PSTATE_PAN;
+        switch (new_el) {
+        case 2:
+            /* ... the target is EL2 with HCR_EL2.{E2H,TGE} == '11' ...  */
+            if ((arm_hcr_el2_eff(env) & (HCR_E2H | HCR_TGE))
+                != (HCR_E2H | HCR_TGE)) {
+                break;
+            }
+            /* fall through */
+        case 1:
+            /* ... the target is EL1 ... */
+            /* ... and SCTLR_ELx.SPAN == 0, then set to 1.  */
+            if ((env->cp15.sctlr_el[new_el] & SCTLR_SPAN) == 0) {
+                new_mode |= PSTATE_PAN;
+            }
+            break;
+        }
+    }
+    if (cpu_isar_feature(aa64_mte, cpu)) {
+        new_mode |= PSTATE_TCO;
+    }
+
+    if (cpu_isar_feature(aa64_ssbs, cpu)) {
+        if (env->cp15.sctlr_el[new_el] & SCTLR_DSSBS_64) {
+            new_mode |= PSTATE_SSBS;
+        } else {
+            new_mode &= ~PSTATE_SSBS;
+        }
+    }
+    return new_mode;
+}
+
 /* Handle exception entry to a target EL which is using AArch64 */
 static void arm_cpu_do_interrupt_aarch64(CPUState *cs)
 {
@@ -11788,38 +12045,7 @@ static void arm_cpu_do_interrupt_aarch64(CPUState *cs)
                     env->elr_el[new_el]);
     }
 
-    if (cpu_isar_feature(aa64_pan, cpu)) {
-        /* The value of PSTATE.PAN is normally preserved, except when ... */
-        new_mode |= old_mode & PSTATE_PAN;
-        switch (new_el) {
-        case 2:
-            /* ... the target is EL2 with HCR_EL2.{E2H,TGE} == '11' ...  */
-            if ((arm_hcr_el2_eff(env) & (HCR_E2H | HCR_TGE))
-                != (HCR_E2H | HCR_TGE)) {
-                break;
-            }
-            /* fall through */
-        case 1:
-            /* ... the target is EL1 ... */
-            /* ... and SCTLR_ELx.SPAN == 0, then set to 1.  */
-            if ((env->cp15.sctlr_el[new_el] & SCTLR_SPAN) == 0) {
-                new_mode |= PSTATE_PAN;
-            }
-            break;
-        }
-    }
-    if (cpu_isar_feature(aa64_mte, cpu)) {
-        new_mode |= PSTATE_TCO;
-    }
-
-    if (cpu_isar_feature(aa64_ssbs, cpu)) {
-        if (env->cp15.sctlr_el[new_el] & SCTLR_DSSBS_64) {
-            new_mode |= PSTATE_SSBS;
-        } else {
-            new_mode &= ~PSTATE_SSBS;
-        }
-    }
-
+    new_mode = aarch64_entry_pstate_mode(env, new_el, old_mode, new_mode);
     pstate_write(env, PSTATE_DAIF | new_mode);
     env->gxf.gxf_status_el[new_el] |= genter;
     env->aarch64 = true;
@@ -11898,6 +12124,13 @@ void arm_cpu_do_interrupt(CPUState *cs)
         return;
     }
 
+    if (cs->exception_index == EXCP_HVC &&
+        arm_is_hypercall(cpu, env->exception.syndrome)) {
+        cpu->hypercall(cpu, cpu->hypercall_opaque);
+        qemu_log_mask(CPU_LOG_INT, "...handled as hypercall\n");
+        return;
+    }
+
     /*
      * Semihosting semantics depend on the register width of the code
      * that caused the exception, not the target exception level, so
@@ -11929,7 +12162,7 @@ void arm_cpu_do_interrupt(CPUState *cs)
     arm_call_el_change_hook(cpu);
 
     if (!kvm_enabled()) {
-        cs->interrupt_request |= CPU_INTERRUPT_EXITTB;
+        qatomic_or(&cs->interrupt_request, CPU_INTERRUPT_EXITTB);
     }
 }
 #endif /* !CONFIG_USER_ONLY */
@@ -52,9 +52,10 @@ DEF_HELPER_2(exception_swstep, noreturn, env, i32)
 DEF_HELPER_2(exception_pc_alignment, noreturn, env, tl)
 DEF_HELPER_1(setend, void, env)
 DEF_HELPER_2(wfi, void, env, i32)
-DEF_HELPER_1(wfe, void, env)
+DEF_HELPER_2(wfe, void, env, i32)
+DEF_HELPER_1(sev, void, env)
 DEF_HELPER_1(yield, void, env)
-DEF_HELPER_1(pre_hvc, void, env)
+DEF_HELPER_2(pre_hvc, void, env, i32)
 DEF_HELPER_2(pre_smc, void, env, i32)
 DEF_HELPER_1(vesb, void, env)
 
@@ -400,6 +400,17 @@ static inline void aarch64_restore_sp(CPUARMState *env, int el)
     }
 }
 
+/*
+ * aarch64_entry_pstate_mode: PSTATE for entry to @new_el
+ * @old_mode: PSTATE at the time of the exception
+ * @new_mode: the mode bits for the target EL, see aarch64_pstate_mode()
+ *
+ * Applies the PAN, TCO and SSBS adjustments of AArch64 exception entry.
+ */
+unsigned int aarch64_entry_pstate_mode(CPUARMState *env, unsigned int new_el,
+                                       unsigned int old_mode,
+                                       unsigned int new_mode);
+
 static inline void update_spsel(CPUARMState *env, uint32_t imm)
 {
     unsigned int cur_el = arm_current_el(env);
@@ -492,6 +503,12 @@ bool arm_is_psci_call(ARMCPU *cpu, int excp_type);
 void arm_handle_psci_call(ARMCPU *cpu);
 #endif
 
+/*
+ * Return true if the HVC with this syndrome is a hypercall for the handler
+ * set with arm_set_hypercall_handler().
+ */
+bool arm_is_hypercall(ARMCPU *cpu, uint32_t syndrome);
+
 /**
  * arm_clear_exclusive: clear the exclusive monitor
  * @env: CPU env
@@ -1434,6 +1451,17 @@ bool get_phys_addr_with_space_nogpc(CPUARMState *env, target_ulong address,
                                     ARMMMUFaultInfo *fi)
     __attribute__((nonnull));
 
+/**
+ * arm_sprr_update_prot_lut: rebuild the decoded SPRR permissions for @el
+ * @env: CPUARMState
+ * @el: exception level, 0 or 1
+ *
+ * Must be called after SPRR_EL<el>BR<el>_EL1 changes. The page table
+ * walker also rebuilds the table itself if it finds it stale, e.g.
+ * after a raw register write from migration.
+ */
+void arm_sprr_update_prot_lut(CPUARMState *env, int el);
+
 bool pmsav8_mpu_lookup(CPUARMState *env, uint32_t address,
                        MMUAccessType access_type, ARMMMUIdx mmu_idx,
                        bool is_secure, GetPhysAddrResult *result,
@@ -1636,6 +1664,11 @@ static inline uint64_t pmu_counter_mask(CPUARMState *env)
   return (1ULL << 31) | ((1ULL << pmu_num_counters(env)) - 1);
 }
 
+/* Fold the instructions run so far into the Apple PMCs. */
+void arm_apple_pmc_sync(CPUARMState *env);
+/* Recompute the Apple PMC overflow limits and PMI after a sync. */
+void arm_apple_pmc_update(CPUARMState *env);
+
 #ifdef TARGET_AARCH64
 GDBFeature *arm_gen_dynamic_svereg_feature(CPUState *cpu, int base_reg);
 int aarch64_gdb_get_sve_reg(CPUState *cs, GByteArray *buf, int reg);
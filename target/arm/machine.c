@@ -203,6 +203,27 @@ static const VMStateDescription vmstate_za = {
         VMSTATE_END_OF_LIST()
     }
 };
+
+static bool amx_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    return cpu->env.amx.enabled;
+}
+
+static const VMStateDescription vmstate_amx = {
+    .name = "cpu/amx",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = amx_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8_2DARRAY(env.amx.x, ARMCPU, 8, 64),
+        VMSTATE_UINT8_2DARRAY(env.amx.y, ARMCPU, 8, 64),
+        VMSTATE_UINT8_2DARRAY(env.amx.z, ARMCPU, 64, 64),
+        VMSTATE_BOOL(env.amx.enabled, ARMCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
 #endif /* AARCH64 */
 
 static bool serror_needed(void *opaque)
@@ -226,6 +247,37 @@ static const VMStateDescription vmstate_serror = {
     }
 };
 
+static bool wfe_event_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    return cpu->env.event_register || cpu->env.wfe_halted;
+}
+
+static int wfe_event_post_load(void *opaque, int version_id)
+{
+    ARMCPU *cpu = opaque;
+
+    /* The wake-up timer is not migrated, so end any WFE halt early. */
+    if (cpu->env.wfe_halted) {
+        cpu->env.event_register = 1;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_wfe_event = {
+    .name = "cpu/wfe_event",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = wfe_event_needed,
+    .post_load = wfe_event_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(env.event_register, ARMCPU),
+        VMSTATE_UINT32(env.wfe_halted, ARMCPU),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static bool irq_line_state_needed(void *opaque)
 {
     return true;
@@ -856,6 +908,13 @@ static int cpu_post_load(void *opaque, int version_id)
         hw_watchpoint_update_all(cpu);
     }
 
+    /*
+     * A loadvm while the VM is stopped replaces the page tables without
+     * the VM ever resuming, which is what normally drops the translations
+     * cached for the debugger.
+     */
+    arm_debug_tlb_flush(cpu);
+
     /*
      * TCG gen_update_fp_context() relies on the invariant that
      * FPDSCR.LTPSIZE is constant 4 for M-profile with the LOB extension;
@@ -954,9 +1013,11 @@ const VMStateDescription vmstate_arm_cpu = {
 #ifdef TARGET_AARCH64
         &vmstate_sve,
         &vmstate_za,
+        &vmstate_amx,
 #endif
         &vmstate_serror,
         &vmstate_irq_line_state,
+        &vmstate_wfe_event,
         NULL
     }
 };
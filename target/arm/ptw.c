@@ -11,6 +11,7 @@
 #include "qemu/range.h"
 #include "qemu/main-loop.h"
 #include "exec/exec-all.h"
+#include "sysemu/runstate.h"
 #include "cpu.h"
 #include "internals.h"
 #include "cpu-features.h"
@@ -999,6 +1000,73 @@ static int simple_ap_to_rw_prot(CPUARMState *env, ARMMMUIdx mmu_idx, int ap)
     return simple_ap_to_rw_prot_is_user(ap, regime_is_user(env, mmu_idx));
 }
 
+/* Decode one SPRR permission attribute to R/W/X protection flags. */
+static int sprr_attr_to_prot(int attr, bool guarded)
+{
+    int prot = 0;
+
+    if (guarded) {
+        switch (attr >> 2) {
+        case 0:
+            prot = 0;
+            break;
+        case 1:
+            prot = PAGE_READ | PAGE_EXEC;
+            break;
+        case 2:
+            prot = PAGE_READ;
+            break;
+        case 3:
+            prot = PAGE_READ | PAGE_WRITE;
+            break;
+        default:
+            g_assert_not_reached();
+            break;
+        }
+    } else {
+        switch (attr & 3) {
+        case 0:
+            prot = 0;
+            break;
+        case 1:
+            prot = PAGE_READ | PAGE_EXEC;
+            if ((attr >> 2) == 2) {
+                prot = PAGE_EXEC;
+            }
+            break;
+        case 2:
+            prot = PAGE_READ;
+            break;
+        case 3:
+            prot = PAGE_READ | PAGE_WRITE;
+            if ((attr >> 2) == 1) {
+                /* No R/W in EL if RX in GXF */
+                prot = 0;
+            }
+            break;
+        default:
+            g_assert_not_reached();
+            break;
+        }
+    }
+    return prot;
+}
+
+void arm_sprr_update_prot_lut(CPUARMState *env, int el)
+{
+    uint64_t sprr_perm;
+
+    assert(el < 2);
+    sprr_perm = env->sprr.sprr_el_br_el1[el][el];
+    for (int i = 0; i < 16; i++) {
+        int attr = SPRR_EXTRACT_IDX_ATTR(sprr_perm, i);
+
+        env->sprr.prot_lut[el][0][i] = sprr_attr_to_prot(attr, false);
+        env->sprr.prot_lut[el][1][i] = sprr_attr_to_prot(attr, true);
+    }
+    env->sprr.prot_lut_key[el] = sprr_perm;
+}
+
 /* Translate section/page attributes to page
  * R/W/X protection flags.
  *
@@ -1012,60 +1080,18 @@ static inline int
 pte_to_sprr_prot_is_guarded(CPUARMState *env, int ap, int xn, int pxn, bool guarded)
 {
     int sprr_idx = ((ap << 2) | (xn << 1) | pxn) & 0xf;
-    assert(arm_current_el(env) < 2);
-    uint64_t sprr_perm = env->sprr.sprr_el_br_el1[arm_current_el(env)][arm_current_el(env)];
+    int el = arm_current_el(env);
 
-    if (arm_is_sprr_enabled(env)) {
-        int attr = SPRR_EXTRACT_IDX_ATTR(sprr_perm, sprr_idx);
-        int prot = 0;
+    assert(el < 2);
+    if (!arm_is_sprr_enabled(env)) {
+        return PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+    }
 
-        if (guarded) {
-            switch (attr >> 2) {
-            case 0:
-                prot = 0;
-                break;
-            case 1:
-                prot = PAGE_READ | PAGE_EXEC;
-                break;
-            case 2:
-                prot = PAGE_READ;
-                break;
-            case 3:
-                prot = PAGE_READ | PAGE_WRITE;
-                break;
-            default:
-                g_assert_not_reached();
-                break;
-            }
-        } else {
-            switch (attr & 3) {
-            case 0:
-                prot = 0;
-                break;
-            case 1:
-                prot = PAGE_READ | PAGE_EXEC;
-                if ((attr >> 2) == 2) {
-                    prot = PAGE_EXEC;
-                }
-                break;
-            case 2:
-                prot = PAGE_READ;
-                break;
-            case 3:
-                prot = PAGE_READ | PAGE_WRITE;
-                if ((attr >> 2) == 1) {
-                    /* No R/W in EL if RX in GXF */
-                    prot = 0;
-                }
-                break;
-            default:
-                g_assert_not_reached();
-                break;
-            }
-        }
-        return prot;
+    if (unlikely(env->sprr.prot_lut_key[el] !=
+                 env->sprr.sprr_el_br_el1[el][el])) {
+        arm_sprr_update_prot_lut(env, el);
     }
-    return PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+    return env->sprr.prot_lut[el][guarded][sprr_idx];
 }
 
 
@@ -3759,6 +3785,58 @@ bool get_phys_addr(CPUARMState *env, target_ulong address,
     return get_phys_addr_gpc(env, &ptw, address, access_type, result, fi);
 }
 
+/*
+ * A debugger walking kernel data structures translates the same pages over
+ * and over, each time through the full walk. While the VM is stopped the
+ * tables can only change through the debugger itself, so the translations
+ * are kept until the VM resumes, the translation registers change, or the
+ * debugger writes to virtual memory. Writes in gdbstub's physical memory
+ * mode are not seen until the VM next resumes.
+ */
+static VMChangeStateEntry *arm_debug_tlb_vmse;
+
+void arm_debug_tlb_flush(ARMCPU *cpu)
+{
+    memset(cpu->debug_tlb, 0, sizeof(cpu->debug_tlb));
+}
+
+static void arm_debug_tlb_flush_all(void)
+{
+    CPUState *cs;
+
+    CPU_FOREACH(cs) {
+        if (object_dynamic_cast(OBJECT(cs), TYPE_ARM_CPU)) {
+            arm_debug_tlb_flush(ARM_CPU(cs));
+        }
+    }
+}
+
+static void arm_debug_tlb_vm_state_change(void *opaque, bool running,
+                                          RunState state)
+{
+    if (running) {
+        arm_debug_tlb_flush_all();
+    }
+}
+
+/* Everything the walk for a debug access depends on. */
+static void arm_debug_tlb_context(CPUARMState *env, ARMMMUIdx mmu_idx,
+                                  ARMSecuritySpace ss, uint64_t *ctx)
+{
+    uint32_t el = regime_el(env, mmu_idx);
+
+    ctx[0] = mmu_idx;
+    ctx[1] = ss;
+    ctx[2] = arm_is_guarded(env);
+    ctx[3] = env->cp15.sctlr_el[el];
+    ctx[4] = env->cp15.tcr_el[el];
+    ctx[5] = env->cp15.ttbr0_el[el];
+    ctx[6] = env->cp15.ttbr1_el[el];
+    ctx[7] = env->cp15.hcr_el2;
+    ctx[8] = env->cp15.vttbr_el2;
+    ctx[9] = env->cp15.vtcr_el2;
+}
+
 hwaddr arm_cpu_get_phys_page_attrs_debug(CPUState *cs, vaddr addr,
                                          MemTxAttrs *attrs)
 {
@@ -3773,13 +3851,53 @@ hwaddr arm_cpu_get_phys_page_attrs_debug(CPUState *cs, vaddr addr,
     };
     GetPhysAddrResult res = {};
     ARMMMUFaultInfo fi = {};
+    vaddr page = addr & TARGET_PAGE_MASK;
+    ARMDebugTLBEntry *entry =
+        &cpu->debug_tlb[(page >> TARGET_PAGE_BITS) % ARM_DEBUG_TLB_SIZE];
+    uint64_t ctx[ARM_DEBUG_TLB_CTX];
+    bool cache = !runstate_is_running();
     bool ret;
 
+    if (cache) {
+        if (arm_debug_tlb_vmse == NULL) {
+            arm_debug_tlb_vmse = qemu_add_vm_change_state_handler(
+                arm_debug_tlb_vm_state_change, NULL);
+        }
+        arm_debug_tlb_context(env, mmu_idx, ss, ctx);
+        if (memcmp(ctx, cpu->debug_tlb_ctx, sizeof(ctx)) != 0) {
+            arm_debug_tlb_flush(cpu);
+            memcpy(cpu->debug_tlb_ctx, ctx, sizeof(ctx));
+        }
+        if (entry->page == (page | 1)) {
+            *attrs = entry->attrs;
+            return entry->phys | (addr & ~TARGET_PAGE_MASK);
+        }
+    }
+
     ret = get_phys_addr_gpc(env, &ptw, addr, MMU_DATA_LOAD, &res, &fi);
     *attrs = res.f.attrs;
 
     if (ret) {
         return -1;
     }
+
+    /* MPU regions may be smaller than a page. */
+    if (cache && res.f.lg_page_size >= TARGET_PAGE_BITS) {
+        entry->page = page | 1;
+        entry->phys = res.f.phys_addr & TARGET_PAGE_MASK;
+        entry->attrs = res.f.attrs;
+    }
     return res.f.phys_addr;
 }
+
+int arm_cpu_memory_rw_debug(CPUState *cs, vaddr addr, uint8_t *buf, int len,
+                            bool is_write)
+{
+    int ret = cpu_memory_rw_debug(cs, addr, buf, len, is_write);
+
+    /* The write may have been to page tables, of any CPU. */
+    if (is_write) {
+        arm_debug_tlb_flush_all();
+    }
+    return ret;
+}
@@ -0,0 +1,317 @@
+/*
+ * Apple AMX coprocessor
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The instructions are 0x00201000 | (op << 5) | Xn, where Xn holds a
+ * 64-bit operand (op 17 takes the register field as an immediate). The
+ * operand layouts follow the publicly documented reverse engineering of
+ * the first AMX generation, which is the one A13 implements:
+ *
+ *   ldx/ldy/stx/sty   bits 0-55 address, 56-58 register, 62 pair
+ *   ldz/stz           bits 0-55 address, 56-61 Z row, 62 pair
+ *   ldzi/stzi         bits 0-55 address, 56 half, 57-61 Z row pair
+ *   extrx             bits 16-18 X register, 20-25 Z row
+ *   extry             bits 6-8 Y register, 20-25 Z row
+ *   fma/fms/mac       bits 0-8 Y offset, 10-18 X offset, 20-25 Z row,
+ *                     27 skip Z, 28 skip Y, 29 skip X, 63 vector mode
+ *
+ * The registers hold bytes in guest memory order and the arithmetic
+ * views them through GCC vector types, which the compiler lowers to
+ * whatever SIMD the host has. That needs a little-endian host, so the
+ * feature is never set on big-endian ones.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "internals.h"
+#include "exec/helper-proto.h"
+#include "exec/cpu_ldst.h"
+#include "exec/exec-all.h"
+#include "fpu/softfloat.h"
+
+enum {
+    AMX_LDX = 0,
+    AMX_LDY = 1,
+    AMX_STX = 2,
+    AMX_STY = 3,
+    AMX_LDZ = 4,
+    AMX_STZ = 5,
+    AMX_LDZI = 6,
+    AMX_STZI = 7,
+    AMX_EXTRX = 8,
+    AMX_EXTRY = 9,
+    AMX_FMA64 = 10,
+    AMX_FMS64 = 11,
+    AMX_FMA32 = 12,
+    AMX_FMS32 = 13,
+    AMX_MAC16 = 14,
+    AMX_FMA16 = 15,
+    AMX_FMS16 = 16,
+    AMX_SETCLR = 17,
+};
+
+#define AMX_CTL_EN (1ULL << 63)
+
+#define AMX_ADDR(operand) extract64(operand, 0, 56)
+#define AMX_PAIR(operand) extract64(operand, 62, 1)
+
+typedef double amx_f64 __attribute__((vector_size(64)));
+typedef float amx_f32 __attribute__((vector_size(64)));
+typedef int16_t amx_i16 __attribute__((vector_size(64)));
+
+static void amx_load(CPUARMState *env, uint8_t *reg, uint64_t addr,
+                     uintptr_t ra)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        stq_le_p(reg + i * 8, cpu_ldq_le_data_ra(env, addr + i * 8, ra));
+    }
+}
+
+static void amx_store(CPUARMState *env, const uint8_t *reg, uint64_t addr,
+                      uintptr_t ra)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        cpu_stq_le_data_ra(env, addr + i * 8, ldq_le_p(reg + i * 8), ra);
+    }
+}
+
+static void amx_ldst_xy(CPUARMState *env, uint8_t (*regs)[64],
+                        uint64_t operand, bool store, uintptr_t ra)
+{
+    uint64_t addr = AMX_ADDR(operand);
+    unsigned int reg = extract64(operand, 56, 3);
+    int i;
+
+    for (i = 0; i <= AMX_PAIR(operand); i++) {
+        if (store) {
+            amx_store(env, regs[(reg + i) & 7], addr + i * 64, ra);
+        } else {
+            amx_load(env, regs[(reg + i) & 7], addr + i * 64, ra);
+        }
+    }
+}
+
+static void amx_ldst_z(CPUARMState *env, uint64_t operand, bool store,
+                       uintptr_t ra)
+{
+    uint64_t addr = AMX_ADDR(operand);
+    unsigned int row = extract64(operand, 56, 6);
+    int i;
+
+    for (i = 0; i <= AMX_PAIR(operand); i++) {
+        if (store) {
+            amx_store(env, env->amx.z[(row + i) & 63], addr + i * 64, ra);
+        } else {
+            amx_load(env, env->amx.z[(row + i) & 63], addr + i * 64, ra);
+        }
+    }
+}
+
+/*
+ * ldzi/stzi move one half of a pair of Z rows, with the 32-bit lanes of
+ * the two rows interleaved in memory.
+ */
+static void amx_ldst_zi(CPUARMState *env, uint64_t operand, bool store,
+                        uintptr_t ra)
+{
+    unsigned int half = extract64(operand, 56, 1);
+    unsigned int row = extract64(operand, 57, 5) * 2;
+    uint8_t buf[64];
+    int i;
+
+    if (store) {
+        for (i = 0; i < 16; i++) {
+            memcpy(buf + i * 4,
+                   env->amx.z[row + (i & 1)] + (half * 8 + i / 2) * 4, 4);
+        }
+        amx_store(env, buf, AMX_ADDR(operand), ra);
+    } else {
+        amx_load(env, buf, AMX_ADDR(operand), ra);
+        for (i = 0; i < 16; i++) {
+            memcpy(env->amx.z[row + (i & 1)] + (half * 8 + i / 2) * 4,
+                   buf + i * 4, 4);
+        }
+    }
+}
+
+/* X and Y operands are read at a byte offset, wrapping around the file. */
+static void amx_read_xy(uint8_t (*regs)[64], unsigned int offset,
+                        uint8_t *out)
+{
+    const uint8_t *base = regs[0];
+    unsigned int first = MIN(64, 512 - offset);
+
+    memcpy(out, base + offset, first);
+    memcpy(out + first, base, 64 - first);
+}
+
+#define DO_AMX_FMA(NAME, TYPE, ETYPE, LANES, NEG)                            \
+static void NAME(CPUARMState *env, uint64_t operand)                         \
+{                                                                            \
+    unsigned int zrow = extract64(operand, 20, 6);                           \
+    TYPE x, y, z;                                                            \
+    int j;                                                                   \
+                                                                             \
+    amx_read_xy(env->amx.x, extract64(operand, 10, 9), (uint8_t *)&x);       \
+    amx_read_xy(env->amx.y, extract64(operand, 0, 9), (uint8_t *)&y);        \
+    if (extract64(operand, 29, 1)) {                                         \
+        x = (TYPE){} + (ETYPE)1;                                             \
+    }                                                                        \
+    if (extract64(operand, 28, 1)) {                                         \
+        y = (TYPE){} + (ETYPE)1;                                             \
+    }                                                                        \
+    if (NEG) {                                                               \
+        x = -x;                                                              \
+    }                                                                        \
+                                                                             \
+    if (extract64(operand, 63, 1)) {                                         \
+        if (extract64(operand, 27, 1)) {                                     \
+            z = (TYPE){};                                                    \
+        } else {                                                             \
+            memcpy(&z, env->amx.z[zrow], 64);                                \
+        }                                                                    \
+        z += x * y;                                                          \
+        memcpy(env->amx.z[zrow], &z, 64);                                    \
+        return;                                                              \
+    }                                                                        \
+                                                                             \
+    for (j = 0; j < LANES; j++) {                                            \
+        uint8_t *row = env->amx.z[j * (64 / LANES) + zrow % (64 / LANES)];   \
+                                                                             \
+        if (extract64(operand, 27, 1)) {                                     \
+            z = (TYPE){};                                                    \
+        } else {                                                             \
+            memcpy(&z, row, 64);                                             \
+        }                                                                    \
+        z += x * y[j];                                                       \
+        memcpy(row, &z, 64);                                                 \
+    }                                                                        \
+}
+
+DO_AMX_FMA(amx_fma64, amx_f64, double, 8, false)
+DO_AMX_FMA(amx_fms64, amx_f64, double, 8, true)
+DO_AMX_FMA(amx_fma32, amx_f32, float, 16, false)
+DO_AMX_FMA(amx_fms32, amx_f32, float, 16, true)
+DO_AMX_FMA(amx_mac16, amx_i16, int16_t, 32, false)
+
+/* There is no portable host half-precision vector type, so f16 is soft. */
+static void amx_fma16(CPUARMState *env, uint64_t operand, bool neg)
+{
+    unsigned int zrow = extract64(operand, 20, 6);
+    bool vector = extract64(operand, 63, 1);
+    bool skip_z = extract64(operand, 27, 1);
+    int flags = neg ? float_muladd_negate_product : 0;
+    float_status st = { };
+    float16 x[32], y[32];
+    int i, j;
+
+    set_float_rounding_mode(float_round_nearest_even, &st);
+    set_default_nan_mode(true, &st);
+
+    amx_read_xy(env->amx.x, extract64(operand, 10, 9), (uint8_t *)x);
+    amx_read_xy(env->amx.y, extract64(operand, 0, 9), (uint8_t *)y);
+    for (i = 0; i < 32; i++) {
+        if (extract64(operand, 29, 1)) {
+            x[i] = float16_one;
+        }
+        if (extract64(operand, 28, 1)) {
+            y[i] = float16_one;
+        }
+    }
+
+    for (j = 0; j < (vector ? 1 : 32); j++) {
+        float16 *z = (float16 *)env->amx.z[vector ? zrow : j * 2 + (zrow & 1)];
+
+        for (i = 0; i < 32; i++) {
+            z[i] = float16_muladd(x[i], vector ? y[i] : y[j],
+                                  skip_z ? float16_zero : z[i], flags, &st);
+        }
+    }
+}
+
+void HELPER(amx)(CPUARMState *env, uint32_t op, uint64_t operand)
+{
+    uintptr_t ra = GETPC();
+
+    if (!(env->amx.ctl & AMX_CTL_EN) ||
+        (op != AMX_SETCLR && !env->amx.enabled)) {
+        raise_exception_ra(env, EXCP_UDEF, syn_uncategorized(),
+                           exception_target_el(env), ra);
+    }
+
+    switch (op) {
+    case AMX_LDX:
+    case AMX_STX:
+        amx_ldst_xy(env, env->amx.x, operand, op == AMX_STX, ra);
+        break;
+    case AMX_LDY:
+    case AMX_STY:
+        amx_ldst_xy(env, env->amx.y, operand, op == AMX_STY, ra);
+        break;
+    case AMX_LDZ:
+    case AMX_STZ:
+        amx_ldst_z(env, operand, op == AMX_STZ, ra);
+        break;
+    case AMX_LDZI:
+    case AMX_STZI:
+        amx_ldst_zi(env, operand, op == AMX_STZI, ra);
+        break;
+    case AMX_EXTRX:
+        memcpy(env->amx.x[extract64(operand, 16, 3)],
+               env->amx.z[extract64(operand, 20, 6)], 64);
+        break;
+    case AMX_EXTRY:
+        memcpy(env->amx.y[extract64(operand, 6, 3)],
+               env->amx.z[extract64(operand, 20, 6)], 64);
+        break;
+    case AMX_FMA64:
+        amx_fma64(env, operand);
+        break;
+    case AMX_FMS64:
+        amx_fms64(env, operand);
+        break;
+    case AMX_FMA32:
+        amx_fma32(env, operand);
+        break;
+    case AMX_FMS32:
+        amx_fms32(env, operand);
+        break;
+    case AMX_MAC16:
+        amx_mac16(env, operand);
+        break;
+    case AMX_FMA16:
+    case AMX_FMS16:
+        amx_fma16(env, operand, op == AMX_FMS16);
+        break;
+    case AMX_SETCLR:
+        if (operand == 0) {
+            memset(env->amx.x, 0, sizeof(env->amx.x));
+            memset(env->amx.y, 0, sizeof(env->amx.y));
+            memset(env->amx.z, 0, sizeof(env->amx.z));
+            env->amx.enabled = true;
+        } else if (operand == 1) {
+            env->amx.enabled = false;
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
@@ -913,6 +913,32 @@ illegal_return:
                   "resuming execution at 0x%" PRIx64 "\n", cur_el, env->pc);
 }
 
+/*
+ * GENTER without going through the exception path. This is the same-EL
+ * guarded entry arm_cpu_do_interrupt_aarch64() performs for EXCP_GENTER,
+ * with env->pc already pointing past the GENTER.
+ */
+void HELPER(genter)(CPUARMState *env)
+{
+    int cur_el = arm_current_el(env);
+    uint32_t old_mode = pstate_read(env);
+    uint32_t new_mode = aarch64_pstate_mode(cur_el, true);
+
+    aarch64_save_sp(env, cur_el);
+    env->gxf.elr_gl[cur_el] = env->pc;
+    env->gxf.spsr_gl[cur_el] = old_mode;
+
+    new_mode = aarch64_entry_pstate_mode(env, cur_el, old_mode, new_mode);
+    pstate_write(env, PSTATE_DAIF | new_mode);
+    env->gxf.gxf_status_el[cur_el] |= 1;
+    aarch64_restore_sp(env, cur_el);
+    helper_rebuild_hflags_a64(env, cur_el);
+    env->pc = env->gxf.gxf_enter_el[cur_el];
+    qemu_log_mask(CPU_LOG_INT, "Guarded execution entry from AArch64 EL%d to "
+                      "AArch64 GL%d PC 0x%" PRIx64 "\n",
+                      cur_el, cur_el, env->pc);
+}
+
 void HELPER(gexit)(CPUARMState *env)
 {
     int cur_el = arm_current_el(env);
@@ -935,6 +961,15 @@ void HELPER(gexit)(CPUARMState *env)
     aarch64_restore_sp(env, cur_el);
     env->pc = env->gxf.elr_gl[cur_el];
     helper_rebuild_hflags_a64(env, cur_el);
+
+    /*
+     * The translator chains straight into the code after GEXIT. If the
+     * restored PSTATE unmasks an interrupt that is already pending, make
+     * the next TB exit so the main loop can take it.
+     */
+    if (qatomic_read(&env_cpu(env)->interrupt_request)) {
+        qatomic_set(&env_cpu(env)->neg.icount_decr.u16.high, -1);
+    }
     qemu_log_mask(CPU_LOG_INT, "Guarded execution exit from AArch64 GL%d to "
                       "AArch64 EL%d PC 0x%" PRIx64 "\n",
                       cur_el, cur_el, env->pc);
@@ -1000,6 +1035,40 @@ void HELPER(dc_zva)(CPUARMState *env, uint64_t vaddr_in)
     memset(mem, 0, blocklen);
 }
 
+/*
+ * Runs all but the last iteration of a "dc zva, xT; add xT, xT, #B;
+ * subs xC, xC, #B; b.hi" loop, B being the ZVA block size, as far as it
+ * stays in the page of @vaddr_in. The translated loop then does the last
+ * one, and everything the fast path here cannot handle.
+ */
+void HELPER(dc_zva_loop)(CPUARMState *env, uint64_t vaddr_in, uint32_t regs)
+{
+    int rt = extract32(regs, 0, 5);
+    int rc = extract32(regs, 5, 5);
+    int blocklen = 4 << env_archcpu(env)->dcz_blocksize;
+    uint64_t vaddr = vaddr_in & ~(blocklen - 1);
+    uint64_t count = env->xregs[rc];
+    uint64_t n;
+    void *mem;
+
+    /* The loop goes on while the count before SUBS is above B. */
+    n = count > blocklen ? (count - 1) / blocklen : 0;
+    n = MIN(n, (TARGET_PAGE_SIZE - (vaddr & ~TARGET_PAGE_MASK)) / blocklen);
+    if (n == 0) {
+        return;
+    }
+
+    mem = tlb_vaddr_to_host(env, vaddr, MMU_DATA_STORE,
+                            arm_env_mmu_index(env));
+    if (!mem) {
+        return;
+    }
+
+    memset(mem, 0, n * blocklen);
+    env->xregs[rt] += n * blocklen;
+    env->xregs[rc] -= n * blocklen;
+}
+
 void HELPER(unaligned_access)(CPUARMState *env, uint64_t addr,
                               uint32_t access_type, uint32_t mmu_idx)
 {
@@ -1934,6 +2003,12 @@ static void *get_page_write(CPUARMState *env, uint64_t vaddr_in, int mmu_idx)
     return mem;
 }
 
+void HELPER(apple_pmc_sync)(CPUARMState *env)
+{
+    arm_apple_pmc_sync(env);
+    arm_apple_pmc_update(env);
+}
+
 uint64_t HELPER(wkdmc)(CPUARMState *env, uint64_t vaddr_in, uint64_t vaddr_out)
 {
     int mmu_idx;
@@ -403,14 +403,79 @@ void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
                         target_el);
     }
 
+    qatomic_set(&env->wfe_halted, 0);
     cs->exception_index = EXCP_HLT;
-    cs->halted = 1;
+    qatomic_set(&cs->halted, 1);
+    /*
+     * Pairs with interrupt controllers that raise the line without the
+     * BQL and only kick halted CPUs: either they see us halted, or we see
+     * their interrupt before going to sleep.
+     */
+    smp_mb();
     cpu_loop_exit(cs);
 #endif
 }
 
-void HELPER(wfe)(CPUARMState *env)
+#ifndef CONFIG_USER_ONLY
+/*
+ * TCG cannot see another vCPU's store clearing our exclusive monitor,
+ * which is a WFE wake-up event, so a WFE with the monitor armed only
+ * naps briefly. Otherwise just SEV, interrupts and the event stream wake
+ * the CPU, and the cap merely bounds a lost kick.
+ */
+#define ARM_WFE_POLL_NS (50 * SCALE_US)
+#define ARM_WFE_MAX_NS (1 * SCALE_MS)
+
+static int64_t arm_wfe_timeout_ns(CPUARMState *env)
 {
+    uint64_t cntkctl = env->cp15.c14_cntkctl;
+    int64_t ns = env->exclusive_addr != -1 ? ARM_WFE_POLL_NS : ARM_WFE_MAX_NS;
+
+    /* EVNTEN: an event every 2^(EVNTI + 1) ticks, give or take a phase */
+    if (cntkctl & (1 << 2)) {
+        ns = MIN(ns, (int64_t)gt_cntfrq_period_ns(env_archcpu(env))
+                         << (extract64(cntkctl, 4, 4) + 1));
+    }
+    return ns;
+}
+#endif
+
+void HELPER(wfe)(CPUARMState *env, uint32_t insn_len)
+{
+#ifndef CONFIG_USER_ONLY
+    if (arm_feature(env, ARM_FEATURE_WFE_EVENT)) {
+        CPUState *cs = env_cpu(env);
+        int target_el;
+
+        /* A pending event is consumed and WFE completes at once. */
+        if (qatomic_xchg(&env->event_register, 0) || cpu_has_work(cs)) {
+            return;
+        }
+
+        target_el = check_wfx_trap(env, true);
+        if (target_el) {
+            if (env->aarch64) {
+                env->pc -= insn_len;
+            } else {
+                env->regs[15] -= insn_len;
+            }
+
+            raise_exception(env, EXCP_UDEF,
+                            syn_wfx(1, 0xe, 1, insn_len == 2), target_el);
+        }
+
+        qatomic_set(&env->wfe_halted, 1);
+        timer_mod(env_archcpu(env)->wfe_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      arm_wfe_timeout_ns(env));
+        cs->exception_index = EXCP_HLT;
+        qatomic_set(&cs->halted, 1);
+        /* Pairs with HELPER(sev): either we see its event or it sees us. */
+        smp_mb();
+        cpu_loop_exit(cs);
+    }
+#endif
+
     /* This is a hint instruction that is semantically different
      * from YIELD even though we currently implement it identically.
      * Don't actually halt the CPU, just yield back to top
@@ -421,6 +486,26 @@ void HELPER(wfe)(CPUARMState *env)
     HELPER(yield)(env);
 }
 
+void HELPER(sev)(CPUARMState *env)
+{
+#ifndef CONFIG_USER_ONLY
+    CPUState *cs;
+
+    CPU_FOREACH(cs) {
+        CPUARMState *other = cpu_env(cs);
+
+        if (!arm_feature(other, ARM_FEATURE_WFE_EVENT)) {
+            continue;
+        }
+        qatomic_set(&other->event_register, 1);
+        smp_mb();
+        if (qatomic_read(&cs->halted) && qatomic_read(&other->wfe_halted)) {
+            qemu_cpu_kick(cs);
+        }
+    }
+#endif
+}
+
 void HELPER(yield)(CPUARMState *env)
 {
     CPUState *cs = env_cpu(env);
@@ -928,7 +1013,7 @@ uint64_t HELPER(get_cp_reg64)(CPUARMState *env, const void *rip)
     return res;
 }
 
-void HELPER(pre_hvc)(CPUARMState *env)
+void HELPER(pre_hvc)(CPUARMState *env, uint32_t syndrome)
 {
     ARMCPU *cpu = env_archcpu(env);
     int cur_el = arm_current_el(env);
@@ -943,6 +1028,11 @@ void HELPER(pre_hvc)(CPUARMState *env)
         return;
     }
 
+    if (arm_is_hypercall(cpu, syndrome)) {
+        /* Likewise for the immediate of a paravirtual hypercall. */
+        return;
+    }
+
     if (!arm_feature(env, ARM_FEATURE_EL2)) {
         /* If EL2 doesn't exist, HVC always UNDEFs */
         undef = true;
@@ -329,12 +329,45 @@ static uint64_t pauth_computepac(CPUARMState *env, uint64_t data,
     }
 }
 
+/*
+ * The PAC instructions only need TSZ and TBI, which aa64_va_parameters()
+ * derives from the regime's TCR alone. Signed return addresses make these
+ * instructions very frequent, so keep the decoded values until the
+ * regime or its TCR changes.
+ */
+static ARMVAParameters pauth_va_parameters(CPUARMState *env, uint64_t ptr,
+                                           bool data)
+{
+    ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
+    uint64_t tcr = regime_tcr(env, mmu_idx);
+    int select = extract64(ptr, 55, 1);
+
+    if (unlikely(env->pauth_va.mmu_idx != mmu_idx ||
+                 env->pauth_va.tcr != tcr)) {
+        for (int d = 0; d < 2; d++) {
+            for (int s = 0; s < 2; s++) {
+                ARMVAParameters p = aa64_va_parameters(env, (uint64_t)s << 55,
+                                                       mmu_idx, d, false);
+                env->pauth_va.tsz[d][s] = p.tsz;
+                env->pauth_va.tbi[d][s] = p.tbi;
+            }
+        }
+        env->pauth_va.mmu_idx = mmu_idx;
+        env->pauth_va.tcr = tcr;
+    }
+
+    return (ARMVAParameters) {
+        .tsz = env->pauth_va.tsz[data][select],
+        .tbi = env->pauth_va.tbi[data][select],
+        .select = select && regime_has_2_ranges(mmu_idx),
+    };
+}
+
 static uint64_t pauth_addpac(CPUARMState *env, uint64_t ptr, uint64_t modifier,
                              ARMPACKey *key, bool data)
 {
     ARMCPU *cpu = env_archcpu(env);
-    ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
-    ARMVAParameters param = aa64_va_parameters(env, ptr, mmu_idx, data, false);
+    ARMVAParameters param = pauth_va_parameters(env, ptr, data);
     ARMPauthFeature pauth_feature = cpu_isar_feature(pauth_feature, cpu);
     uint64_t pac, ext_ptr, ext, test;
     int bot_bit, top_bit;
@@ -415,8 +448,7 @@ static uint64_t pauth_auth(CPUARMState *env, uint64_t ptr, uint64_t modifier,
                            uintptr_t ra, bool is_combined)
 {
     ARMCPU *cpu = env_archcpu(env);
-    ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
-    ARMVAParameters param = aa64_va_parameters(env, ptr, mmu_idx, data, false);
+    ARMVAParameters param = pauth_va_parameters(env, ptr, data);
     ARMPauthFeature pauth_feature = cpu_isar_feature(pauth_feature, cpu);
     int bot_bit, top_bit;
     uint64_t pac, orig_ptr, cmp_mask;
@@ -454,8 +486,7 @@ static uint64_t pauth_auth(CPUARMState *env, uint64_t ptr, uint64_t modifier,
 
 static uint64_t pauth_strip(CPUARMState *env, uint64_t ptr, bool data)
 {
-    ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
-    ARMVAParameters param = aa64_va_parameters(env, ptr, mmu_idx, data, false);
+    ARMVAParameters param = pauth_va_parameters(env, ptr, data);
 
     return pauth_original_ptr(ptr, param);
 }
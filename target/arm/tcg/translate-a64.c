@@ -24,6 +24,7 @@
 #include "qemu/log.h"
 #include "disas/disas.h"
 #include "arm_ldst.h"
+#include "exec/cpu_ldst.h"
 #include "semihosting/semihost.h"
 #include "cpregs.h"
 
@@ -1690,16 +1691,33 @@ static bool trans_WFE(DisasContext *s, arg_WFI *a)
 {
     /*
      * When running in MTTCG we don't generate jumps to the yield and
-     * WFE helpers as it won't affect the scheduling of other vCPUs.
-     * If we wanted to more completely model WFE/SEV so we don't busy
-     * spin unnecessarily we would need to do something more involved.
+     * WFE helpers as it won't affect the scheduling of other vCPUs,
+     * unless the CPU models the event register and WFE really halts.
      */
-    if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
+    if (!(tb_cflags(s->base.tb) & CF_PARALLEL) ||
+        arm_dc_feature(s, ARM_FEATURE_WFE_EVENT)) {
         s->base.is_jmp = DISAS_WFE;
     }
     return true;
 }
 
+static bool trans_SEV(DisasContext *s, arg_SEV *a)
+{
+    if (arm_dc_feature(s, ARM_FEATURE_WFE_EVENT)) {
+        gen_helper_sev(tcg_env);
+    }
+    return true;
+}
+
+static bool trans_SEVL(DisasContext *s, arg_SEVL *a)
+{
+    if (arm_dc_feature(s, ARM_FEATURE_WFE_EVENT)) {
+        tcg_gen_st_i32(tcg_constant_i32(1), tcg_env,
+                       offsetof(CPUARMState, event_register));
+    }
+    return true;
+}
+
 static bool trans_XPACLRI(DisasContext *s, arg_XPACLRI *a)
 {
     if (s->pauth_active) {
@@ -2233,6 +2251,11 @@ static void handle_sys(DisasContext *s, bool isread,
         }
     }
 
+    if ((ri->type & ARM_CP_GXF) && !s->guarded) {
+        gen_exception_insn(s, 0, EXCP_UDEF, syndrome);
+        return;
+    }
+
     if (ri->accessfn || (ri->fgt && s->fgt_active)) {
         /* Emit code to perform further access permissions checks at
          * runtime; this may result in an exception.
@@ -2350,6 +2373,10 @@ static void handle_sys(DisasContext *s, bool isread,
         return;
     }
     case ARM_CP_DC_ZVA:
+        if (s->zva_loop_rc >= 0) {
+            gen_helper_dc_zva_loop(tcg_env, clean_data_tbi(s, cpu_reg(s, rt)),
+                                   tcg_constant_i32(rt | s->zva_loop_rc << 5));
+        }
         /* Writes clear the aligned block of memory which rt points into. */
         if (s->mte_active[0]) {
             int desc = 0;
@@ -2494,7 +2521,7 @@ static bool trans_HVC(DisasContext *s, arg_i *a)
      * as an undefined insn by runtime configuration.
      */
     gen_a64_update_pc(s, 0);
-    gen_helper_pre_hvc(tcg_env);
+    gen_helper_pre_hvc(tcg_env, tcg_constant_i32(syn_aa64_hvc(a->imm)));
     /* Architecture requires ss advance before we do the actual work */
     gen_ss_advance(s);
     gen_exception_insn_el(s, 4, EXCP_HVC, syn_aa64_hvc(a->imm), target_el);
@@ -14069,6 +14096,17 @@ static bool disas_apple_insn(DisasContext *s, uint32_t insn)
     rn = extract32(insn, 5, 5);
     rd = extract32(insn, 0, 5);
 
+    /* AMX is used from EL0, the helper checks AMX_CTL_EL1 at run time. */
+    if ((insn & ~0x3ffu) == 0x00201000u &&
+        arm_dc_feature(s, ARM_FEATURE_AMX)) {
+        if (rn > 17) {
+            return false;
+        }
+        gen_helper_amx(tcg_env, tcg_constant_i32(rn),
+                       rn == 17 ? tcg_constant_i64(rd) : cpu_reg(s, rd));
+        return true;
+    }
+
     if (s->current_el == 0) {
         return false;
     }
@@ -14091,8 +14129,15 @@ static bool disas_apple_insn(DisasContext *s, uint32_t insn)
                     }
                     gen_a64_update_pc(s, 0);
                     gen_ss_advance(s);
-                    gen_exception_insn(s, 4, EXCP_GENTER,
-                                       syn_aa64_genter(rd));
+                    if (s->ss_active) {
+                        /* Let the exception path complete the step */
+                        gen_exception_insn(s, 4, EXCP_GENTER,
+                                           syn_aa64_genter(rd));
+                        return true;
+                    }
+                    gen_a64_update_pc(s, 4);
+                    gen_helper_genter(tcg_env);
+                    s->base.is_jmp = DISAS_JUMP;
                     return true;
 
                 case 0: /* GEXIT */
@@ -14100,7 +14145,7 @@ static bool disas_apple_insn(DisasContext *s, uint32_t insn)
                         return false;
                     }
                     gen_helper_gexit(tcg_env);
-                    s->base.is_jmp = DISAS_EXIT;
+                    s->base.is_jmp = DISAS_JUMP;
                     return true;
                 default:
                     return false;
@@ -14237,6 +14282,34 @@ static void aarch64_tr_init_disas_context(DisasContextBase *dcbase,
 
 static void aarch64_tr_tb_start(DisasContextBase *db, CPUState *cpu)
 {
+    DisasContext *dc = container_of(db, DisasContext, base);
+    ptrdiff_t insns, limit;
+    TCGv_i64 count, tcg_limit;
+    TCGLabel *skip;
+
+    /* A 64-bit add has to be one op for tb_stop to patch it. */
+    if (TCG_TARGET_REG_BITS != 64 ||
+        !arm_dc_feature(dc, ARM_FEATURE_APPLE_PMC)) {
+        return;
+    }
+
+    /*
+     * Count the whole TB as it starts. The length is patched in by
+     * tb_stop, as for icount.
+     */
+    insns = offsetof(CPUARMState, apple_pmc.insns[dc->current_el]);
+    limit = offsetof(CPUARMState, apple_pmc.limit[dc->current_el]);
+    count = tcg_temp_new_i64();
+    tcg_limit = tcg_temp_new_i64();
+    skip = gen_new_label();
+    tcg_gen_ld_i64(count, tcg_env, insns);
+    tcg_gen_add_i64(count, count, tcg_constant_i64(0));
+    dc->apple_pmc_insn = tcg_last_op();
+    tcg_gen_st_i64(count, tcg_env, insns);
+    tcg_gen_ld_i64(tcg_limit, tcg_env, limit);
+    tcg_gen_brcond_i64(TCG_COND_LTU, count, tcg_limit, skip);
+    gen_helper_apple_pmc_sync(tcg_env);
+    gen_set_label(skip);
 }
 
 static void aarch64_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
@@ -14251,6 +14324,39 @@ static void aarch64_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
     dc->insn_start_updated = false;
 }
 
+/*
+ * XNU zeroes pages with "dc zva, xT; add xT, xT, #B; subs xC, xC, #B;
+ * b.hi" loops, B being the ZVA block size. Returns C if such a loop
+ * starts at @pc, so DC ZVA can run most iterations in one helper call.
+ */
+static int aarch64_zva_loop_rc(DisasContext *s, CPUARMState *env,
+                               uint64_t pc, uint32_t insn)
+{
+    uint32_t imm = 4 << s->dcz_blocksize;
+    uint32_t rt = extract32(insn, 0, 5);
+    uint32_t add = 0x91000000 | imm << 10 | rt << 5 | rt;
+    uint32_t bhi = 0x54000000 | (-3 & 0x7ffff) << 5 | 8; /* b.hi pc */
+    uint32_t insn1, insn2, subs;
+    uint32_t rc;
+
+    if ((insn & 0xffffffe0) != 0xd50b7420 || rt == 31 || s->ss_active ||
+        s->mte_active[0] || (tb_cflags(s->base.tb) & CF_USE_ICOUNT) ||
+        (pc & ~TARGET_PAGE_MASK) > TARGET_PAGE_SIZE - 16) {
+        return -1;
+    }
+
+    insn1 = cpu_ldl_code(env, pc + 4);
+    insn2 = cpu_ldl_code(env, pc + 8);
+    subs = insn1 == add ? insn2 : insn1;
+    rc = extract32(subs, 0, 5);
+    if ((insn1 != add && insn2 != add) ||
+        subs != (0xf1000000 | imm << 10 | rc << 5 | rc) || rc == 31 ||
+        rc == rt || cpu_ldl_code(env, pc + 12) != bhi) {
+        return -1;
+    }
+    return rc;
+}
+
 static void aarch64_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *s = container_of(dcbase, DisasContext, base);
@@ -14295,6 +14401,7 @@ static void aarch64_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     insn = arm_ldl_code(env, &s->base, pc, s->sctlr_b);
     s->insn = insn;
     s->base.pc_next = pc + 4;
+    s->zva_loop_rc = aarch64_zva_loop_rc(s, env, pc, insn);
 
     s->fp_access_checked = false;
     s->sve_access_checked = false;
@@ -14368,6 +14475,11 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
 
+    if (dc->apple_pmc_insn) {
+        tcg_set_insn_param(dc->apple_pmc_insn, 2,
+                           tcgv_i64_arg(tcg_constant_i64(dc->base.num_insns)));
+    }
+
     if (unlikely(dc->ss_active)) {
         /* Note that this means single stepping WFI doesn't halt the CPU.
          * For conditional branch insns this is harmless unreachable code as
@@ -14409,7 +14521,9 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             break;
         case DISAS_WFE:
             gen_a64_update_pc(dc, 4);
-            gen_helper_wfe(tcg_env);
+            gen_helper_wfe(tcg_env, tcg_constant_i32(4));
+            /* With ARM_FEATURE_WFE_EVENT the helper may return. */
+            tcg_gen_exit_tb(NULL, 0);
             break;
         case DISAS_YIELD:
             gen_a64_update_pc(dc, 4);
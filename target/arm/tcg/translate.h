@@ -163,6 +163,8 @@ typedef struct DisasContext {
     int8_t btype;
     /* A copy of cpu->dcz_blocksize. */
     uint8_t dcz_blocksize;
+    /* Count register of the DC ZVA loop starting at this insn, or -1. */
+    int8_t zva_loop_rc;
     /* A copy of cpu->gm_blocksize. */
     uint8_t gm_blocksize;
     /* True if this page is guarded.  */
@@ -171,6 +173,8 @@ typedef struct DisasContext {
     bool insn_start_updated;
     /* True if in GXF */
     bool guarded;
+    /* The add of this TB's length to the Apple PMC instruction count */
+    TCGOp *apple_pmc_insn;
     /* Bottom two bits of XScale c15_cpar coprocessor access control reg */
     int c15_cpar;
     /* Offset from VNCR_EL2 when FEAT_NV2 redirects this reg to memory */
@@ -404,6 +404,32 @@ void tcg_region_initial_alloc(TCGContext *s)
 }
 
 /* Call from a safe-work context */
+/*
+ * Hand the pages of every region back to the host. Called from a flush,
+ * with all vCPUs stopped and every TB already discarded, so nothing runs
+ * from or points into the regions. Without this a long-running VM keeps
+ * its code buffer resident up to the high-water mark of its busiest
+ * period, which adds up with many VMs on one host. Regions fault back in
+ * as code is generated again. With split-wx the buffer is a memfd, so the
+ * pages are removed from the file rather than just unmapped.
+ */
+static void tcg_region_release_all(void)
+{
+    int advice = tcg_splitwx_diff ? QEMU_MADV_REMOVE : QEMU_MADV_DONTNEED;
+    size_t page_size = qemu_real_host_page_size();
+
+    for (size_t i = 0; i < region.n; i++) {
+        void *start, *end;
+
+        tcg_region_bounds(i, &start, &end);
+        start = QEMU_ALIGN_PTR_UP(start, page_size);
+        end = QEMU_ALIGN_PTR_DOWN(end, page_size);
+        if (start < end) {
+            qemu_madvise(start, end - start, advice);
+        }
+    }
+}
+
 void tcg_region_reset_all(void)
 {
     unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
@@ -419,6 +445,7 @@ void tcg_region_reset_all(void)
     }
     qemu_mutex_unlock(&region.lock);
 
+    tcg_region_release_all();
     tcg_region_tree_reset_all();
 }
 
@@ -0,0 +1,586 @@
+/*
+ * Apple silicon machine helpers speed benchmark
+ *
+ * Every result is reported as one "bench:" line of space separated
+ * key=value pairs, so runs can be compared mechanically when bisecting.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
+#include "hw/arm/apple-silicon/boot.h"
+#include "hw/arm/apple-silicon/dtb.h"
+#include "hw/arm/apple-silicon/lzss.h"
+#ifdef BENCH_LZFSE
+#include <lzfse.h>
+#endif
+
+#define BENCH_ITERATIONS (64)
+#define BENCH_PAYLOAD_SIZE (8 * MiB)
+
+/*
+ * Kernelcache-like input: runs of pseudo-random bytes broken up by
+ * repeats of recent data, so both literals and matches are exercised.
+ */
+static uint8_t *bench_payload(size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    GRand *rand = g_rand_new_with_seed(0x8030);
+    size_t pos = 0;
+
+    while (pos < size) {
+        size_t len = MIN(g_rand_int_range(rand, 4, 64), size - pos);
+
+        if (pos >= 256 && g_rand_boolean(rand)) {
+            memmove(buf + pos, buf + pos - g_rand_int_range(rand, 1, 256), len);
+        } else {
+            for (size_t i = 0; i < len; i++) {
+                buf[pos + i] = g_rand_int(rand);
+            }
+        }
+        pos += len;
+    }
+
+    g_rand_free(rand);
+    return buf;
+}
+
+/*
+ * Greedy encoder for the format decompress_lzss() reads, trying only the
+ * last position with the same three leading bytes as the match candidate.
+ */
+static size_t bench_lzss_encode(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    g_autofree size_t *head = g_new0(size_t, 1 << 16);
+    size_t pos = 0, out = 0;
+
+    while (pos < len) {
+        size_t flags_pos = out++;
+        uint8_t flags = 0;
+
+        for (int bit = 0; bit < 8 && pos < len; bit++) {
+            size_t match_len = 0, dist = 0;
+
+            if (len - pos >= 3) {
+                uint16_t hash = (src[pos] << 8 | src[pos + 1]) ^
+                                (src[pos + 2] << 4);
+
+                if (head[hash] != 0 && pos + 1 - head[hash] < N - F) {
+                    dist = pos + 1 - head[hash];
+                    while (match_len < F && pos + match_len < len &&
+                           src[pos + match_len] ==
+                               src[pos + match_len - dist]) {
+                        match_len++;
+                    }
+                }
+                head[hash] = pos + 1;
+            }
+
+            if (match_len > THRESHOLD) {
+                size_t i = (N - F + pos - dist) & (N - 1);
+
+                dst[out++] = i & 0xFF;
+                dst[out++] = ((i >> 4) & 0xF0) | (match_len - THRESHOLD - 1);
+                pos += match_len;
+            } else {
+                flags |= 1 << bit;
+                dst[out++] = src[pos++];
+            }
+        }
+        dst[flags_pos] = flags;
+    }
+
+    return out;
+}
+
+/*
+ * decompress_lzss() as it was before it decoded matches from the output:
+ * byte at a time, through a ring buffer of the last N bytes.
+ */
+static size_t bench_lzss_decode_old(uint8_t *dst, const uint8_t *src,
+                                    size_t srclen)
+{
+    uint8_t text_buf[N + F - 1];
+    uint8_t *dststart = dst;
+    const uint8_t *srcend = src + srclen;
+    int i, j, k, r, c;
+    unsigned int flags;
+
+    memset(text_buf, ' ', N - F);
+    r = N - F;
+    flags = 0;
+    for (;;) {
+        if (((flags >>= 1) & 0x100) == 0) {
+            if (src >= srcend) {
+                break;
+            }
+            flags = *src++ | 0xFF00;
+        }
+        if (flags & 1) {
+            if (src >= srcend) {
+                break;
+            }
+            c = *src++;
+            *dst++ = c;
+            text_buf[r++] = c;
+            r &= (N - 1);
+        } else {
+            if (srcend - src < 2) {
+                break;
+            }
+            i = *src++;
+            j = *src++;
+            i |= ((j & 0xF0) << 4);
+            j = (j & 0x0F) + THRESHOLD;
+            for (k = 0; k <= j; k++) {
+                c = text_buf[(i + k) & (N - 1)];
+                *dst++ = c;
+                text_buf[r++] = c;
+                r &= (N - 1);
+            }
+        }
+    }
+
+    return dst - dststart;
+}
+
+static void bench_report(const char *name, const char *metric, double value)
+{
+    g_test_message("bench: name=%s %s=%.2f", name, metric, value);
+}
+
+static void test_lzss_decode(void)
+{
+    g_autofree uint8_t *plain = bench_payload(BENCH_PAYLOAD_SIZE);
+    g_autofree uint8_t *comp = g_malloc(BENCH_PAYLOAD_SIZE * 9 / 8 + 16);
+    g_autofree uint8_t *out = g_malloc(BENCH_PAYLOAD_SIZE);
+    size_t comp_len;
+    double old, new;
+
+    comp_len = bench_lzss_encode(comp, plain, BENCH_PAYLOAD_SIZE);
+    g_assert_cmpuint(bench_lzss_decode_old(out, comp, comp_len), ==,
+                     BENCH_PAYLOAD_SIZE);
+    g_assert(memcmp(out, plain, BENCH_PAYLOAD_SIZE) == 0);
+    memset(out, 0, BENCH_PAYLOAD_SIZE);
+    g_assert_cmpuint(decompress_lzss(out, BENCH_PAYLOAD_SIZE, comp, comp_len),
+                     ==, BENCH_PAYLOAD_SIZE);
+    g_assert(memcmp(out, plain, BENCH_PAYLOAD_SIZE) == 0);
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        bench_lzss_decode_old(out, comp, comp_len);
+    }
+    old = (double)BENCH_PAYLOAD_SIZE * BENCH_ITERATIONS / MiB /
+          g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        decompress_lzss(out, BENCH_PAYLOAD_SIZE, comp, comp_len);
+    }
+    new = (double)BENCH_PAYLOAD_SIZE * BENCH_ITERATIONS / MiB /
+          g_test_timer_elapsed();
+
+    bench_report("lzss-decode-old", "mb_per_sec", old);
+    bench_report("lzss-decode", "mb_per_sec", new);
+    bench_report("lzss-decode", "speedup", new / old);
+}
+
+#ifdef BENCH_LZFSE
+static void test_lzfse_decode(void)
+{
+    g_autofree uint8_t *plain = bench_payload(BENCH_PAYLOAD_SIZE);
+    g_autofree uint8_t *comp = g_malloc(BENCH_PAYLOAD_SIZE * 2);
+    g_autofree uint8_t *out = g_malloc(BENCH_PAYLOAD_SIZE);
+    g_autofree uint8_t *scratch = g_malloc(lzfse_decode_scratch_size());
+    size_t comp_len;
+
+    comp_len = lzfse_encode_buffer(comp, BENCH_PAYLOAD_SIZE * 2, plain,
+                                   BENCH_PAYLOAD_SIZE, NULL);
+    g_assert_cmpuint(comp_len, !=, 0);
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        g_assert_cmpuint(lzfse_decode_buffer(out, BENCH_PAYLOAD_SIZE, comp,
+                                             comp_len, scratch),
+                         ==, BENCH_PAYLOAD_SIZE);
+    }
+    g_test_timer_elapsed();
+    g_assert(memcmp(out, plain, BENCH_PAYLOAD_SIZE) == 0);
+
+    bench_report("lzfse-decode", "mb_per_sec",
+                 (double)BENCH_PAYLOAD_SIZE * BENCH_ITERATIONS / MiB /
+                     g_test_timer_last());
+}
+#endif
+
+/*
+ * About the symbol and local relocation counts of an iOS 14 kernelcache,
+ * with the relocated pointers spread over its text.
+ */
+#define BENCH_MACHO_SYMS (256 * 1024)
+#define BENCH_MACHO_RELOCS (384 * 1024)
+#define BENCH_MACHO_TEXT_SIZE (16 * MiB)
+#define BENCH_MACHO_SLIDE (0x1234000ULL)
+
+typedef struct {
+    uint8_t *data;
+    /* Where __LINKEDIT's file offset 0 lands in data. */
+    uint64_t linkedit_vmoff;
+    uint64_t linkedit_fileoff;
+    uint32_t sym_off;
+    uint32_t loc_rel_off;
+} BenchMacho;
+
+/*
+ * macho_process_symbols() as it was before the slide loops were hoisted:
+ * every entry recomputes its address from the segment and command offsets.
+ */
+static void bench_macho_slide_old(BenchMacho *m, uint64_t slide)
+{
+    uint8_t *base = m->data + m->linkedit_vmoff;
+    uint64_t off = m->linkedit_fileoff;
+    MachoNList64 *sym = (MachoNList64 *)(base + (m->sym_off - off));
+
+    for (int i = 0; i < BENCH_MACHO_SYMS; i++) {
+        if (sym[i].n_type & N_STAB) {
+            continue;
+        }
+        sym[i].n_value += slide;
+    }
+    for (size_t i = 0; i < BENCH_MACHO_RELOCS; i++) {
+        int32_t r_address =
+            *(int32_t *)(base + (m->loc_rel_off - off) + i * 8);
+        *(uint64_t *)(m->data + r_address) += slide;
+    }
+}
+
+static void bench_macho_slide_new(BenchMacho *m, uint64_t slide)
+{
+    uint8_t *linkedit = m->data + m->linkedit_vmoff - m->linkedit_fileoff;
+
+    macho_slide_symbols((MachoNList64 *)(linkedit + m->sym_off),
+                        BENCH_MACHO_SYMS, slide);
+    macho_slide_local_relocs(m->data,
+                             (const int32_t *)(linkedit + m->loc_rel_off),
+                             BENCH_MACHO_RELOCS, slide);
+}
+
+static void test_macho_slide(void)
+{
+    size_t syms_size = BENCH_MACHO_SYMS * sizeof(MachoNList64);
+    size_t size = BENCH_MACHO_TEXT_SIZE + syms_size + BENCH_MACHO_RELOCS * 8;
+    g_autofree uint8_t *data = bench_payload(size);
+    g_autofree uint8_t *orig = NULL;
+    GRand *rand = g_rand_new_with_seed(0x8030);
+    BenchMacho m = {
+        .data = data,
+        .linkedit_vmoff = BENCH_MACHO_TEXT_SIZE,
+        .linkedit_fileoff = 0x4000,
+        .sym_off = 0x4000,
+        .loc_rel_off = 0x4000 + syms_size,
+    };
+    MachoNList64 *sym = (MachoNList64 *)(data + BENCH_MACHO_TEXT_SIZE);
+    uint32_t *rel = (uint32_t *)(data + BENCH_MACHO_TEXT_SIZE + syms_size);
+    double old, new;
+
+    /* One in eight symbols is a debugger entry, which stays put. */
+    for (int i = 0; i < BENCH_MACHO_SYMS; i++) {
+        sym[i].n_type = i % 8 ? N_SECT | N_EXT : N_STAB;
+    }
+    for (int i = 0; i < BENCH_MACHO_RELOCS; i++) {
+        rel[i * 2] = g_rand_int_range(rand, 0, BENCH_MACHO_TEXT_SIZE / 8) * 8;
+    }
+    g_rand_free(rand);
+    orig = g_memdup2(data, size);
+
+    /* Sliding one way and back the other must give back the image. */
+    bench_macho_slide_old(&m, BENCH_MACHO_SLIDE);
+    g_assert(memcmp(data, orig, size) != 0);
+    bench_macho_slide_new(&m, -BENCH_MACHO_SLIDE);
+    g_assert(memcmp(data, orig, size) == 0);
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        bench_macho_slide_old(&m, i & 1 ? -BENCH_MACHO_SLIDE :
+                                          BENCH_MACHO_SLIDE);
+    }
+    old = g_test_timer_elapsed() * 1e3 / BENCH_ITERATIONS;
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        bench_macho_slide_new(&m, i & 1 ? -BENCH_MACHO_SLIDE :
+                                          BENCH_MACHO_SLIDE);
+    }
+    new = g_test_timer_elapsed() * 1e3 / BENCH_ITERATIONS;
+    g_assert(memcmp(data, orig, size) == 0);
+
+    bench_report("macho-slide-old", "ms_per_op", old);
+    bench_report("macho-slide", "ms_per_op", new);
+    bench_report("macho-slide", "speedup", old / new);
+}
+
+/* Roughly the shape of a t8030 device tree: arm-io with many devices. */
+#define BENCH_DTB_DEVICES (512)
+#define BENCH_DTB_PROPS (16)
+
+static uint8_t *bench_dtb_blob(uint64_t *size)
+{
+    /* A root node with only its name: "device-tree". */
+    uint32_t root_blob[14] = { 1, 0 };
+    DTBNode *root;
+    uint8_t *blob;
+
+    memcpy(&root_blob[2], "name", sizeof("name"));
+    root_blob[10] = sizeof("device-tree");
+    memcpy(&root_blob[11], "device-tree", sizeof("device-tree"));
+    root = load_dtb((uint8_t *)root_blob);
+    for (int i = 0; i < BENCH_DTB_DEVICES; i++) {
+        g_autofree char *path = g_strdup_printf("arm-io/device%d", i);
+        DTBNode *node = get_dtb_node(root, path);
+
+        for (int j = 0; j < BENCH_DTB_PROPS; j++) {
+            g_autofree char *name = g_strdup_printf("prop%d", j);
+            uint64_t value[4] = { i, j, i * j, i + j };
+
+            set_dtb_prop(node, name, sizeof(value), value);
+        }
+    }
+
+    *size = get_dtb_node_buffer_size(root);
+    blob = g_malloc0(*size);
+    save_dtb(blob, root);
+    destroy_dtb(root);
+    return blob;
+}
+
+/*
+ * The device tree code as it was before nodes were indexed and subtrees
+ * saved straight from the loaded blob: a copy of every property value,
+ * lists of properties and children, and finds that scan them.
+ */
+typedef struct {
+    uint8_t name[DTB_PROP_NAME_LEN];
+    uint32_t length;
+    uint8_t *value;
+} BenchOldDTBProp;
+
+typedef struct {
+    uint32_t prop_count;
+    uint32_t child_node_count;
+    GList *props;
+    GList *child_nodes;
+} BenchOldDTBNode;
+
+static BenchOldDTBNode *bench_dtb_old_read(const uint8_t **blob)
+{
+    BenchOldDTBNode *node = g_new0(BenchOldDTBNode, 1);
+
+    *blob = QEMU_ALIGN_PTR_UP(*blob, 4);
+    node->prop_count = ldl_le_p(*blob);
+    node->child_node_count = ldl_le_p(*blob + 4);
+    *blob += 8;
+
+    for (uint32_t i = 0; i < node->prop_count; i++) {
+        BenchOldDTBProp *prop = g_new0(BenchOldDTBProp, 1);
+
+        *blob = QEMU_ALIGN_PTR_UP(*blob, 4);
+        memcpy(prop->name, *blob, DTB_PROP_NAME_LEN);
+        prop->length = ldl_le_p(*blob + DTB_PROP_NAME_LEN) & DT_PROP_SIZE_MASK;
+        *blob += DTB_PROP_NAME_LEN + 4;
+        if (prop->length) {
+            prop->value = g_malloc0(prop->length);
+            memcpy(prop->value, *blob, prop->length);
+            *blob += prop->length;
+        }
+        node->props = g_list_append(node->props, prop);
+    }
+
+    for (uint32_t i = 0; i < node->child_node_count; i++) {
+        node->child_nodes =
+            g_list_append(node->child_nodes, bench_dtb_old_read(blob));
+    }
+
+    return node;
+}
+
+static BenchOldDTBNode *bench_dtb_old_load(const uint8_t *blob)
+{
+    return bench_dtb_old_read(&blob);
+}
+
+static void bench_dtb_old_free_prop(BenchOldDTBProp *prop)
+{
+    g_free(prop->value);
+    g_free(prop);
+}
+
+static void bench_dtb_old_free(BenchOldDTBNode *node)
+{
+    g_list_free_full(node->props, (GDestroyNotify)bench_dtb_old_free_prop);
+    g_list_free_full(node->child_nodes, (GDestroyNotify)bench_dtb_old_free);
+    g_free(node);
+}
+
+static BenchOldDTBProp *bench_dtb_old_find_prop(BenchOldDTBNode *node,
+                                                const char *name)
+{
+    for (GList *iter = node->props; iter; iter = iter->next) {
+        BenchOldDTBProp *prop = iter->data;
+
+        if (strncmp((const char *)prop->name, name, DTB_PROP_NAME_LEN) == 0) {
+            return prop;
+        }
+    }
+    return NULL;
+}
+
+static BenchOldDTBNode *bench_dtb_old_find_node(BenchOldDTBNode *node,
+                                                const char *path)
+{
+    g_auto(GStrv) names = g_strsplit(path, "/", -1);
+
+    for (int i = 0; node != NULL && names[i] != NULL; i++) {
+        BenchOldDTBNode *found = NULL;
+
+        if (names[i][0] == '\0') {
+            continue;
+        }
+        for (GList *iter = node->child_nodes; iter; iter = iter->next) {
+            BenchOldDTBNode *child = iter->data;
+            BenchOldDTBProp *prop = bench_dtb_old_find_prop(child, "name");
+
+            if (prop != NULL &&
+                strncmp((const char *)prop->value, names[i], prop->length) ==
+                    0) {
+                found = child;
+            }
+        }
+        node = found;
+    }
+    return node;
+}
+
+static void bench_dtb_old_save(BenchOldDTBNode *node, uint8_t **buf)
+{
+    *buf = QEMU_ALIGN_PTR_UP(*buf, 4);
+    stl_le_p(*buf, node->prop_count);
+    stl_le_p(*buf + 4, node->child_node_count);
+    *buf += 8;
+
+    for (GList *iter = node->props; iter; iter = iter->next) {
+        BenchOldDTBProp *prop = iter->data;
+
+        *buf = QEMU_ALIGN_PTR_UP(*buf, 4);
+        memcpy(*buf, prop->name, DTB_PROP_NAME_LEN);
+        stl_le_p(*buf + DTB_PROP_NAME_LEN, prop->length);
+        *buf += DTB_PROP_NAME_LEN + 4;
+        if (prop->length) {
+            memcpy(*buf, prop->value, prop->length);
+            *buf += prop->length;
+        }
+    }
+    for (GList *iter = node->child_nodes; iter; iter = iter->next) {
+        bench_dtb_old_save(iter->data, buf);
+    }
+}
+
+static void test_dtb(void)
+{
+    uint64_t size;
+    g_autofree uint8_t *blob = bench_dtb_blob(&size);
+    g_autofree uint8_t *out = g_malloc0(size);
+    BenchOldDTBNode *old_root;
+    DTBNode *root;
+    double load[2], find[2], save[2];
+    char path[32];
+    uint8_t *buf;
+
+    /* The old code has to give back the same blob too. */
+    old_root = bench_dtb_old_load(blob);
+    buf = out;
+    bench_dtb_old_save(old_root, &buf);
+    g_assert(memcmp(out, blob, size) == 0);
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        bench_dtb_old_free(bench_dtb_old_load(blob));
+    }
+    load[0] = g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS;
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        destroy_dtb(load_dtb(blob));
+    }
+    load[1] = g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS;
+
+    root = load_dtb(blob);
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        for (int j = 0; j < BENCH_DTB_DEVICES; j++) {
+            BenchOldDTBNode *node;
+
+            snprintf(path, sizeof(path), "arm-io/device%d", j);
+            node = bench_dtb_old_find_node(old_root, path);
+            g_assert_nonnull(bench_dtb_old_find_prop(node, "prop7"));
+        }
+    }
+    find[0] =
+        g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS / BENCH_DTB_DEVICES;
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        for (int j = 0; j < BENCH_DTB_DEVICES; j++) {
+            DTBNode *node;
+
+            snprintf(path, sizeof(path), "arm-io/device%d", j);
+            node = find_dtb_node(root, path);
+            g_assert_nonnull(find_dtb_prop(node, "prop7"));
+        }
+    }
+    find[1] =
+        g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS / BENCH_DTB_DEVICES;
+
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        buf = out;
+        bench_dtb_old_save(old_root, &buf);
+    }
+    save[0] = g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS;
+
+    memset(out, 0, size);
+    g_test_timer_start();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        save_dtb(out, root);
+    }
+    save[1] = g_test_timer_elapsed() * 1e9 / BENCH_ITERATIONS;
+    g_assert(memcmp(out, blob, size) == 0);
+
+    bench_dtb_old_free(old_root);
+    destroy_dtb(root);
+
+    bench_report("dtb-load-old", "ns_per_op", load[0]);
+    bench_report("dtb-load", "ns_per_op", load[1]);
+    bench_report("dtb-find-old", "ns_per_op", find[0]);
+    bench_report("dtb-find", "ns_per_op", find[1]);
+    bench_report("dtb-save-old", "ns_per_op", save[0]);
+    bench_report("dtb-save", "ns_per_op", save[1]);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/apple-silicon/benchmark/lzss-decode", test_lzss_decode);
+#ifdef BENCH_LZFSE
+    g_test_add_func("/apple-silicon/benchmark/lzfse-decode",
+                    test_lzfse_decode);
+#endif
+    g_test_add_func("/apple-silicon/benchmark/macho-slide", test_macho_slide);
+    g_test_add_func("/apple-silicon/benchmark/dtb", test_dtb);
+
+    return g_test_run();
+}
@@ -0,0 +1,100 @@
+/*
+ * Apple DART page table walk helpers unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "hw/arm/apple-silicon/dart-ptw.h"
+
+/*
+ * An L2 table mapping every page to a physically contiguous range at
+ * `pa`, so the whole window coalesces.
+ */
+static void fill_l2(uint64_t *l2, size_t n, uint64_t pa, unsigned page_shift)
+{
+    for (size_t i = 0; i < n; i++) {
+        l2[i] = (pa + (i << page_shift)) | DART_TTE_VALID;
+    }
+}
+
+/*
+ * Key every page of the window fetched for `iova` the way the prefetch
+ * does, and record which block it was mapped to.
+ */
+static void prefetch_window(GHashTable *tlb, const uint64_t *l2, uint64_t iova,
+                            unsigned page_shift)
+{
+    uint64_t idx = DART_PTW_INDEX(page_shift, 2, iova);
+    uint64_t first = idx & ~(uint64_t)(DART_PTW_SPAN_PTES - 1);
+    uint64_t window = apple_dart_ptw_window(iova);
+    uint32_t i = 0;
+
+    g_assert_cmpuint(window + (idx - first), ==, iova);
+
+    while (i < DART_PTW_SPAN_PTES) {
+        uint64_t mask = apple_dart_ptw_span(l2 + first, i, page_shift);
+        uint64_t block = DART_PTW_TABLE(page_shift, l2[first + i]) & ~mask;
+        uint64_t *old = g_hash_table_lookup(tlb, &(uint64_t){ window + i });
+        uint64_t *key = g_new(uint64_t, 1);
+
+        g_assert_cmpuint(mask, ==,
+                         ((uint64_t)DART_PTW_SPAN_PTES << page_shift) - 1);
+        g_assert_null(old);
+        *key = window + i;
+        g_hash_table_insert(tlb, key, g_memdup2(&block, sizeof(block)));
+        i += (mask >> page_shift) + 1;
+    }
+}
+
+/*
+ * Two IOVAs with the same L2 index under different L1 entries must not
+ * share IOTLB entries.
+ */
+static void test_prefetch_keys(gconstpointer opaque)
+{
+    unsigned page_shift = GPOINTER_TO_UINT(opaque);
+    size_t l2_n = 1 << DART_PTW_LEVEL_BITS(page_shift);
+    g_autofree uint64_t *l2_a = g_new(uint64_t, l2_n);
+    g_autofree uint64_t *l2_b = g_new(uint64_t, l2_n);
+    g_autoptr(GHashTable) tlb =
+        g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+    uint64_t l2_idx = 0x45;
+    uint64_t iova_a = (1ULL << DART_PTW_SHIFT(page_shift, 1)) | l2_idx;
+    uint64_t iova_b = (2ULL << DART_PTW_SHIFT(page_shift, 1)) | l2_idx;
+    uint64_t pa_a = 0x10000000;
+    uint64_t pa_b = 0x20000000;
+    uint64_t *block;
+
+    g_assert_cmpuint(DART_PTW_INDEX(page_shift, 2, iova_a), ==,
+                     DART_PTW_INDEX(page_shift, 2, iova_b));
+    g_assert_cmpuint(DART_PTW_INDEX(page_shift, 1, iova_a), !=,
+                     DART_PTW_INDEX(page_shift, 1, iova_b));
+
+    fill_l2(l2_a, l2_n, pa_a, page_shift);
+    fill_l2(l2_b, l2_n, pa_b, page_shift);
+    prefetch_window(tlb, l2_a, iova_a, page_shift);
+    prefetch_window(tlb, l2_b, iova_b, page_shift);
+
+    block = g_hash_table_lookup(tlb,
+                                &(uint64_t){ apple_dart_ptw_window(iova_a) });
+    g_assert_nonnull(block);
+    g_assert_cmpuint(*block, ==, pa_a);
+    block = g_hash_table_lookup(tlb,
+                                &(uint64_t){ apple_dart_ptw_window(iova_b) });
+    g_assert_nonnull(block);
+    g_assert_cmpuint(*block, ==, pa_b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/apple-dart/ptw/prefetch-keys/4k",
+                         GUINT_TO_POINTER(12), test_prefetch_keys);
+    g_test_add_data_func("/apple-dart/ptw/prefetch-keys/16k",
+                         GUINT_TO_POINTER(14), test_prefetch_keys);
+
+    return g_test_run();
+}
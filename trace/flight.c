@@ -0,0 +1,153 @@
+/*
+ * Flight recorder trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/log.h"
+#include "qemu/notify.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "trace/control.h"
+#include "trace/flight.h"
+
+/* Per thread; a power of two. */
+#define FLIGHT_RING_SIZE 2048
+
+typedef struct FlightRing {
+    QSLIST_ENTRY(FlightRing) next;
+    Notifier exit_notifier;
+    /* Owned by a live thread; rings of exited threads are reused. */
+    bool in_use;
+    /* The owner's, looked up once rather than a syscall per record. */
+    int32_t tid;
+    /* Only written by the owner. Records before it are complete. */
+    uint64_t head;
+    FlightRecord rec[FLIGHT_RING_SIZE];
+} FlightRing;
+
+/* Rings are never freed, so the list only ever grows at its head. */
+static QSLIST_HEAD(, FlightRing) flight_rings;
+static __thread FlightRing *flight_ring;
+static GMutex flight_dump_lock;
+
+static void flight_thread_exit(Notifier *n, void *data)
+{
+    FlightRing *ring = container_of(n, FlightRing, exit_notifier);
+
+    flight_ring = NULL;
+    qatomic_store_release(&ring->in_use, false);
+}
+
+static FlightRing *flight_ring_get(void)
+{
+    FlightRing *ring;
+
+    for (ring = qatomic_load_acquire(&flight_rings.slh_first); ring;
+         ring = ring->next.sle_next) {
+        if (!qatomic_read(&ring->in_use) &&
+            !qatomic_cmpxchg(&ring->in_use, false, true)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = g_new0(FlightRing, 1);
+        ring->in_use = true;
+        QSLIST_INSERT_HEAD_ATOMIC(&flight_rings, ring, next);
+    }
+
+    ring->tid = qemu_get_thread_id();
+    ring->exit_notifier.notify = flight_thread_exit;
+    qemu_thread_atexit_add(&ring->exit_notifier);
+    return ring;
+}
+
+FlightRecord *flight_record_begin(const TraceEvent *ev, unsigned nargs)
+{
+    FlightRecord *rec;
+
+    if (unlikely(!flight_ring)) {
+        flight_ring = flight_ring_get();
+    }
+    rec = &flight_ring->rec[flight_ring->head & (FLIGHT_RING_SIZE - 1)];
+    rec->timestamp = get_clock();
+    rec->ev = ev;
+    rec->tid = flight_ring->tid;
+    rec->nargs = nargs;
+    rec->strmask = 0;
+    return rec;
+}
+
+void flight_record_str(FlightRecord *rec, unsigned n, const char *str)
+{
+    rec->strmask |= 1 << n;
+    rec->args[n] = 0;
+    if (str) {
+        memcpy(&rec->args[n], str, strnlen(str, sizeof(rec->args[n])));
+    }
+}
+
+void flight_record_end(void)
+{
+    qatomic_store_release(&flight_ring->head, flight_ring->head + 1);
+}
+
+static gint flight_record_cmp(gconstpointer a, gconstpointer b)
+{
+    const FlightRecord *ra = a;
+    const FlightRecord *rb = b;
+
+    return ra->timestamp < rb->timestamp ? -1 : ra->timestamp > rb->timestamp;
+}
+
+static void flight_record_print(FILE *f, const FlightRecord *rec)
+{
+    fprintf(f, "%d@%" PRId64 ".%09" PRId64 ":%s", rec->tid,
+            rec->timestamp / NANOSECONDS_PER_SECOND,
+            rec->timestamp % NANOSECONDS_PER_SECOND, rec->ev->name);
+    for (unsigned i = 0; i < rec->nargs; i++) {
+        if (rec->strmask & (1 << i)) {
+            const char *s = (const char *)&rec->args[i];
+
+            fprintf(f, " \"%.*s\"", (int)strnlen(s, sizeof(rec->args[i])), s);
+        } else {
+            fprintf(f, " 0x%" PRIx64, rec->args[i]);
+        }
+    }
+    fputc('\n', f);
+}
+
+void flight_dump(const char *reason)
+{
+    g_autoptr(GArray) recs = g_array_new(false, false, sizeof(FlightRecord));
+    FlightRing *ring;
+    FILE *f;
+
+    g_mutex_lock(&flight_dump_lock);
+    for (ring = qatomic_load_acquire(&flight_rings.slh_first); ring;
+         ring = ring->next.sle_next) {
+        uint64_t head = qatomic_load_acquire(&ring->head);
+        /* The slot at head may be half written, leave it out. */
+        uint64_t n = MIN(head, FLIGHT_RING_SIZE - 1);
+
+        for (uint64_t i = head - n; i < head; i++) {
+            g_array_append_val(recs, ring->rec[i & (FLIGHT_RING_SIZE - 1)]);
+        }
+    }
+    g_array_sort(recs, flight_record_cmp);
+
+    f = qemu_log_trylock();
+    fprintf(f ? f : stderr, "flight recorder: %s, %u records\n", reason,
+            recs->len);
+    for (guint i = 0; i < recs->len; i++) {
+        flight_record_print(f ? f : stderr,
+                            &g_array_index(recs, FlightRecord, i));
+    }
+    qemu_log_unlock(f);
+    g_mutex_unlock(&flight_dump_lock);
+}
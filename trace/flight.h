@@ -0,0 +1,53 @@
+/*
+ * Flight recorder trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TRACE_FLIGHT_H
+#define TRACE_FLIGHT_H
+
+#include "trace/event-internal.h"
+
+/*
+ * Events declared with the "flight" property are recorded unconditionally
+ * into a ring owned by the calling thread, so recording takes no lock and
+ * costs a few stores. The rings are only read by flight_dump().
+ */
+
+#define FLIGHT_MAX_ARGS 10
+
+typedef struct FlightRecord {
+    int64_t timestamp;
+    const TraceEvent *ev;
+    int32_t tid;
+    uint16_t nargs;
+    /* Bit n set: args[n] holds the first bytes of a string, not a value. */
+    uint16_t strmask;
+    uint64_t args[FLIGHT_MAX_ARGS];
+} FlightRecord;
+
+/* Only for the code tracetool generates. */
+FlightRecord *flight_record_begin(const TraceEvent *ev, unsigned nargs);
+void flight_record_str(FlightRecord *rec, unsigned n, const char *str);
+void flight_record_end(void);
+
+#ifdef CONFIG_TRACE_FLIGHT
+/**
+ * flight_dump:
+ * @reason: what prompted the dump, printed in its header
+ *
+ * Print what every thread has recorded to the log, oldest first. Threads
+ * may keep recording meanwhile; at worst a record that is overwritten as
+ * it is printed comes out garbled.
+ */
+void flight_dump(const char *reason);
+#else
+static inline void flight_dump(const char *reason)
+{
+}
+#endif
+
+#endif /* TRACE_FLIGHT_H */